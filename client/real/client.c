@@ -20,15 +20,20 @@
 #include "client/fishc_internal.h"
 #include "client/stub/xattrs.h"
 #include "mds/const.h"
+#include "msg/hedge.h"
+#include "msg/lpack.h"
+#include "msg/xdr.h"
 #include "util/compiler.h"
 #include "util/dir.h"
 #include "util/error.h"
 #include "util/macro.h"
+#include "util/packed.h"
 #include "util/path.h"
 #include "util/platform/readdir.h"
 #include "util/run_cmd.h"
 #include "util/safe_io.h"
 #include "util/string.h"
+#include "util/time.h"
 #include "util/username.h"
 
 #include <atomic_ops.h>
@@ -49,6 +54,10 @@
 /****************************** macros ********************************/
 #define FAILTHREAD_LONG_SLEEP_MS 500
 #define FISHC_RPC_TIMEOUT 30
+/** How long to wait before retrying when the MDS says it is too busy */
+#define FISHC_RPC_BACKOFF_MIN_MS 10
+/** Upper limit on the time to wait between retries to a busy MDS */
+#define FISHC_RPC_BACKOFF_MAX_MS 2000
 #define RF_FILE_FLAG_WRITABLE 0x1
 #define RF_FILE_FLAG_SHUTDOWN 0x2
 
@@ -88,6 +97,9 @@ struct redfish_client {
 	pthread_cond_t rpc_cond;
 	/** Reference count */
 	int refcnt;
+	/** Latency history of each OSD we have read from.  Used to decide
+	 * which replica to read from, and when to hedge. */
+	struct rlat *rlat;
 };
 
 /** Represents a chunk of a Redfish file */
@@ -133,7 +145,7 @@ static void rf_file_chunk_copy(struct rf_file_chunk_prealloc *dst,
 static struct msg *fishc_do_mds_rpc(struct redfish_client *cli,
 		struct rf_cli_tls *tls, struct msg *m)
 {
-	int ret;
+	int ret, backoff_ms = FISHC_RPC_BACKOFF_MIN_MS;
 	struct msg *resp;
 	uint32_t mds_ip;
 	uint16_t mds_addr;
@@ -172,6 +184,23 @@ static struct msg *fishc_do_mds_rpc(struct redfish_client *cli,
 			pthread_cond_signal(&cli->need_failover_cond);
 			continue;
 		}
+		if ((unpack_from_be16(&tr->m->ty) == mmm_resp_ty) &&
+				(msg_xdr_decode_as_generic(tr->m) == EAGAIN)) {
+			/* The MDS has too much work queued up.  Wait a while
+			 * before trying again, and wait longer each time.  Only
+			 * a generic response can say that; any other reply
+			 * could start with the same four bytes. */
+			bsend_reset(tls->ctx);
+			mt_msleep(backoff_ms + (rand() % backoff_ms));
+			if (backoff_ms < FISHC_RPC_BACKOFF_MAX_MS / 2)
+				backoff_ms *= 2;
+			pthread_mutex_lock(&cli->lock);
+			continue;
+		}
+		resp = tr->m;
+		tr->m = NULL;
+		bsend_reset(tls->ctx);
+		break;
 	}
 	return resp;
 }
@@ -371,6 +400,38 @@ static int stat_resp_to_rf_stat(struct rf_stat *stat, struct redfish_stat *osa)
 	return 0;
 }
 
+static int lpack_entry_to_dir_entry(const struct lpack_entry *e,
+		struct redfish_dir_entry *oda)
+{
+	struct redfish_stat *osa = &oda->stat;
+
+	osa->length = e->length;
+	osa->is_dir = (e->mode_and_type & MMM_STAT_TYPE_DIR);
+	osa->repl = e->man_repl;
+	osa->block_sz = e->block_sz;
+	osa->mtime = e->mtime;
+	osa->atime = e->atime;
+	osa->nid = e->nid;
+	osa->mode = e->mode_and_type & MMM_STAT_MODE_MASK;
+	oda->name = strdup(e->pcomp);
+	if (!oda->name)
+		goto error;
+	osa->owner = strdup(e->user);
+	if (!osa->owner)
+		goto error_free_name;
+	osa->group = strdup(e->group);
+	if (!osa->group)
+		goto error_free_owner;
+	return 0;
+
+error_free_owner:
+	free(osa->owner);
+error_free_name:
+	free(oda->name);
+error:
+	return -ENOMEM;
+}
+
 /****************************** tls ********************************/
 static struct rf_cli_tls *client_alloc_tls(struct redfish_thread *rt,
 		struct redfish_cli *cli)
@@ -492,6 +553,13 @@ struct redfish_client *redfish_connect(const char *conf_path,
 			"error %d: %s", ret, terror(ret));
 		goto error_free_failover_cond;
 	}
+	cli->rlat = rlat_init();
+	if (IS_ERR(cli->rlat)) {
+		ret = PTR_ERR(cli->rlat);
+		snprintf(err, err_len, "rlat_init failed with "
+			"error %d: %s", ret, terror(ret));
+		goto error_free_rpc_cond;
+	}
 	pthread_mutex_lock(&g_highest_clid_lock);
 	cli->clid = ++g_highest_clid;
 	pthread_mutex_unlock(&g_highest_clid_lock);
@@ -504,7 +572,7 @@ struct redfish_client *redfish_connect(const char *conf_path,
 		ret = PTR_ERR(fail_fb);
 		snprintf(err, err_len, "fast_log_create failed with "
 			"error %d: %s", ret, terror(ret));
-		goto error_free_rpc_cond;
+		goto error_free_rlat;
 	}
 	cli->fail_ctx = bsend_init(fail_fb, 1);
 	if (IS_ERR(cli->fail_ctx)) {
@@ -525,6 +593,8 @@ struct redfish_client *redfish_connect(const char *conf_path,
 
 error_free_fail_fb:
 	fast_log_free(cli->fail_fb);
+error_free_rlat:
+	rlat_free(cli->rlat);
 error_free_rpc_cond:
 	pthread_cond_destroy(&cli->rpc_cond);
 error_free_failover_cond:
@@ -719,11 +789,83 @@ int redfish_get_file_status(POSSIBLY_UNUSED(struct redfish_file *ofe),
 	return -ENOTSUP;
 }
 
-int redfish_list_directory(POSSIBLY_UNUSED(struct redfish_client *cli),
-	POSSIBLY_UNUSED(const char *path),
-	POSSIBLY_UNUSED(struct redfish_dir_entry** oda))
+int redfish_list_directory(struct redfish_client *cli, const char *path,
+	struct redfish_dir_entry** oda)
 {
-	return -ENOTSUP;
+	int i, ret, num_ent;
+	char cpath[RF_PATH_MAX];
+	struct mmm_listdir_req req;
+	struct lpack_dec dec;
+	struct lpack_entry e;
+	struct redfish_dir_entry *odas;
+	struct msg *m, *r;
+	struct rf_cli_tls *tls;
+
+	tls = client_get_tls();
+	if (IS_ERR(tls)) {
+		ret = PTR_ERR(tls);
+		goto done;
+	}
+	ret = canonicalize_path2(cpath, RF_PATH_MAX, path);
+	if (ret < 0)
+		goto done;
+	memset(&req, 0, sizeof(req));
+	req.path = cpath;
+	req.user = cli->user;
+	m = msg_xdr_alloc(mmm_listdir_compact_req_ty,
+		(xdrproc_t)xdr_mmm_listdir_req, &req);
+	if (IS_ERR(m)) {
+		ret = PTR_ERR(m);
+		goto done;
+	}
+	r = fishc_do_mds_rpc(cli, tls, m);
+	if (IS_ERR(r)) {
+		ret = PTR_ERR(r);
+		goto done_release_m;
+	}
+	if (unpack_from_be16(&r->ty) != mmm_listdir_compact_resp_ty) {
+		ret = msg_xdr_decode_as_generic(r);
+		if (ret == 0)
+			ret = -EIO;
+		goto done_release_r;
+	}
+	/* Decode straight from the response into the caller's entries,
+	 * without going through rf_lentry. */
+	num_ent = lpack_dec_init(&dec, r);
+	if (num_ent < 0) {
+		ret = -EIO;
+		goto done_release_r;
+	}
+	odas = calloc(num_ent + 1, sizeof(struct redfish_dir_entry));
+	if (!odas) {
+		ret = -ENOMEM;
+		goto done_free_dec;
+	}
+	for (i = 0; i < num_ent; ++i) {
+		ret = lpack_dec_next(&dec, &e);
+		if (ret != 1) {
+			ret = -EIO;
+			redfish_free_dir_entries(odas, i);
+			goto done_free_dec;
+		}
+		ret = lpack_entry_to_dir_entry(&e, &odas[i]);
+		if (ret) {
+			redfish_free_dir_entries(odas, i);
+			goto done_free_dec;
+		}
+	}
+	*oda = odas;
+	ret = 0;
+done_free_dec:
+	lpack_dec_free(&dec);
+done_release_r:
+	msg_release(r);
+done_release_m:
+	msg_release(m);
+done:
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	return num_ent;
 }
 
 int redfish_chmod(struct redfish_client *cli, const char *path, int mode)
@@ -876,6 +1018,7 @@ void redfish_release_client(struct redfish_client *cli)
 	cmap_free(cli->cmap);
 	pthread_cond_destroy(&cli->need_failover_cond);
 	pthread_cond_destroy(&cli->rpc_cond);
+	rlat_free(cli->rlat);
 	pthread_key_delete(cli->tls_key);
 	fast_log_mgr_release(cli->fl_mgr);
 	free(cli);
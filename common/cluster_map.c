@@ -296,3 +296,19 @@ struct daemon_info *cmap_get_oinfo(struct cmap *cmap, int oid)
 		return NULL;
 	return &cmap->oinfo[oid];
 }
+
+int cmap_check_oid_chain(uint32_t first, const uint32_t *chain,
+			int chain_len)
+{
+	int i, j;
+
+	for (i = 0; i < chain_len; ++i) {
+		if (chain[i] == first)
+			return -EINVAL;
+		for (j = 0; j < i; ++j) {
+			if (chain[j] == chain[i])
+				return -EINVAL;
+		}
+	}
+	return 0;
+}
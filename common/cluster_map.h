@@ -123,4 +123,19 @@ extern void cmap_free(struct cmap *cmap);
  */
 extern struct daemon_info *cmap_get_oinfo(struct cmap *cmap, int oid);
 
+/** Check a chain of OSDs that an hflush is to be passed down
+ *
+ * Every OSD in the chain writes the data once, so an OSD which appeared twice
+ * would append the same data to the chunk twice.
+ *
+ * @param first		The OSD which the chain starts after
+ * @param chain		IDs of the OSDs in the chain
+ * @param chain_len	Number of entries in chain
+ *
+ * @return		0 if the chain is OK; -EINVAL if it contains first, or
+ *			any OSD more than once
+ */
+extern int cmap_check_oid_chain(uint32_t first, const uint32_t *chain,
+				int chain_len);
+
 #endif
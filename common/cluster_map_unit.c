@@ -202,6 +202,22 @@ static int test_cmap_round_trip_2(void)
 	return 0;
 }
 
+static int test_cmap_check_oid_chain(void)
+{
+	const uint32_t good[] = { 1, 2, 0 };
+	const uint32_t self[] = { 1, 3, 2 };
+	const uint32_t dup[] = { 1, 2, 1 };
+
+	EXPECT_ZERO(cmap_check_oid_chain(3, NULL, 0));
+	EXPECT_ZERO(cmap_check_oid_chain(3, good, 3));
+	EXPECT_EQ(cmap_check_oid_chain(3, self, 3), -EINVAL);
+	EXPECT_EQ(cmap_check_oid_chain(1, good, 1), -EINVAL);
+	EXPECT_EQ(cmap_check_oid_chain(3, dup, 3), -EINVAL);
+	EXPECT_ZERO(cmap_check_oid_chain(3, dup, 2));
+
+	return 0;
+}
+
 int main(void)
 {
 	char tdir[PATH_MAX];
@@ -211,6 +227,7 @@ int main(void)
 	EXPECT_ZERO(test_cmap_from_conf(tdir));
 	EXPECT_ZERO(test_cmap_round_trip_1());
 	EXPECT_ZERO(test_cmap_round_trip_2());
+	EXPECT_ZERO(test_cmap_check_oid_chain());
 
 	return EXIT_SUCCESS;
 }
@@ -26,6 +26,17 @@
 #define MDSC_DEFAULT_OSD_PORT 7001
 #define MDSC_DEFAULT_CLI_PORT 7002
 
+/** Maximum number of chunk copies that re-replication makes at once.  0 turns
+ * re-replication off. */
+#define MDSC_DEFAULT_REREP_MAX_COPIES 32
+
+/** Maximum number of chunk copies that one OSD sends or receives at once
+ * during re-replication.  This keeps recovery from crowding out clients. */
+#define MDSC_DEFAULT_REREP_MAX_PER_OSD 2
+
+/** Number of seconds between scans for under-replicated chunks */
+#define MDSC_DEFAULT_REREP_IVAL 30
+
 void harmonize_mdsc(struct mdsc *conf, char *err, size_t err_len)
 {
 	harmonize_logc(conf->lc, err, err_len);
@@ -50,4 +61,22 @@ void harmonize_mdsc(struct mdsc *conf, char *err, size_t err_len)
 		snprintf(err, err_len, "you must give a hostname");
 		return;
 	}
+	if (conf->rerep_max_copies == JORM_INVAL_INT)
+		conf->rerep_max_copies = MDSC_DEFAULT_REREP_MAX_COPIES;
+	else if (conf->rerep_max_copies < 0) {
+		snprintf(err, err_len, "rerep_max_copies can't be negative");
+		return;
+	}
+	if (conf->rerep_max_per_osd == JORM_INVAL_INT)
+		conf->rerep_max_per_osd = MDSC_DEFAULT_REREP_MAX_PER_OSD;
+	else if (conf->rerep_max_per_osd < 1) {
+		snprintf(err, err_len, "rerep_max_per_osd must be at least 1");
+		return;
+	}
+	if (conf->rerep_ival == JORM_INVAL_INT)
+		conf->rerep_ival = MDSC_DEFAULT_REREP_IVAL;
+	else if (conf->rerep_ival < 1) {
+		snprintf(err, err_len, "rerep_ival must be at least 1");
+		return;
+	}
 }
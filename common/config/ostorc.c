@@ -24,13 +24,112 @@
 
 #define DEFAULT_OSTOR_TIMEO 120
 
+#define DEFAULT_OSTOR_IO_DEPTH 32
+
+#define DEFAULT_OSTOR_IO_URING 1
+
+#define DEFAULT_OSTOR_SCRUB_RATE 4096
+
+#define DEFAULT_OSTOR_SCRUB_IVAL 86400
+
+#define DEFAULT_OSTOR_COALESCE_KB 1024
+
+#define DEFAULT_OSTOR_PREALLOC_KB 8192
+
+#define DEFAULT_OSTOR_CHUNK_KB 65536
+
+#define DEFAULT_OSTOR_DIRECT_KB 0
+
+/* Two levels of 256 directories each keep tens of millions of chunks down to
+ * a few hundred files per directory. */
+#define DEFAULT_OSTOR_DIR_LEVELS 2
+
+#define DEFAULT_OSTOR_DIR_BITS 8
+
+/* Packing small chunks into segment files is off unless asked for */
+#define DEFAULT_OSTOR_PACK_KB 0
+
+#define DEFAULT_OSTOR_PACK_SEG_MB 64
+
+#define DEFAULT_OSTOR_PACK_IVAL 60
+
+/** Largest batch of appends we'll write at once, in kilobytes */
+#define MAX_OSTOR_COALESCE_KB (1024 * 1024)
+
+/** Largest chunk we'll pack into a segment file, in kilobytes */
+#define MAX_OSTOR_PACK_KB 1024
+
+/** Largest segment file, in megabytes */
+#define MAX_OSTOR_PACK_SEG_MB 2048
+
+static void harmonize_ostor_diskc(struct ostor_diskc *dconf, int idx,
+		char *err, size_t err_len)
+{
+	if (dconf->path == JORM_INVAL_STR) {
+		snprintf(err, err_len, "ostor->ostor_disk[%d] has no path",
+			idx);
+		return;
+	}
+	/* A weight of 0 means "use the size of the filesystem" */
+	if (dconf->weight == JORM_INVAL_INT)
+		dconf->weight = 0;
+	if (dconf->weight < 0) {
+		snprintf(err, err_len, "ostor->ostor_disk[%d].weight cannot "
+			"be less than 0", idx);
+		return;
+	}
+}
+
 void harmonize_ostorc(struct ostorc *conf, char *err, size_t err_len)
 {
+	int i;
+
 	if (conf->ostor_max_open == JORM_INVAL_INT)
 		conf->ostor_max_open = sysconf(_SC_OPEN_MAX);
 	if (conf->ostor_timeo == JORM_INVAL_INT)
 		conf->ostor_timeo = DEFAULT_OSTOR_TIMEO;
-	if (conf->ostor_path == JORM_INVAL_STR) {
+	if (conf->ostor_io_depth == JORM_INVAL_INT)
+		conf->ostor_io_depth = DEFAULT_OSTOR_IO_DEPTH;
+	if (conf->ostor_io_uring == JORM_INVAL_INT)
+		conf->ostor_io_uring = DEFAULT_OSTOR_IO_URING;
+	if (conf->ostor_scrub_rate == JORM_INVAL_INT)
+		conf->ostor_scrub_rate = DEFAULT_OSTOR_SCRUB_RATE;
+	if (conf->ostor_scrub_ival == JORM_INVAL_INT)
+		conf->ostor_scrub_ival = DEFAULT_OSTOR_SCRUB_IVAL;
+	if (conf->ostor_coalesce_kb == JORM_INVAL_INT)
+		conf->ostor_coalesce_kb = DEFAULT_OSTOR_COALESCE_KB;
+	if (conf->ostor_prealloc_kb == JORM_INVAL_INT)
+		conf->ostor_prealloc_kb = DEFAULT_OSTOR_PREALLOC_KB;
+	if (conf->ostor_chunk_kb == JORM_INVAL_INT)
+		conf->ostor_chunk_kb = DEFAULT_OSTOR_CHUNK_KB;
+	if (conf->ostor_direct_kb == JORM_INVAL_INT)
+		conf->ostor_direct_kb = DEFAULT_OSTOR_DIRECT_KB;
+	if (conf->ostor_dir_levels == JORM_INVAL_INT)
+		conf->ostor_dir_levels = DEFAULT_OSTOR_DIR_LEVELS;
+	if (conf->ostor_dir_bits == JORM_INVAL_INT)
+		conf->ostor_dir_bits = DEFAULT_OSTOR_DIR_BITS;
+	if (conf->ostor_pack_kb == JORM_INVAL_INT)
+		conf->ostor_pack_kb = DEFAULT_OSTOR_PACK_KB;
+	if (conf->ostor_pack_seg_mb == JORM_INVAL_INT)
+		conf->ostor_pack_seg_mb = DEFAULT_OSTOR_PACK_SEG_MB;
+	if (conf->ostor_pack_ival == JORM_INVAL_INT)
+		conf->ostor_pack_ival = DEFAULT_OSTOR_PACK_IVAL;
+	if (conf->ostor_disk) {
+		/* If ostor_disk is given, it overrides ostor_path. */
+		for (i = 0; conf->ostor_disk[i]; ++i) {
+			harmonize_ostor_diskc(conf->ostor_disk[i], i,
+				err, err_len);
+			if (err[0])
+				return;
+		}
+		if (i > OSTORC_MAX_DISK) {
+			snprintf(err, err_len, "ostor->ostor_disk can have "
+				"at most %d entries", OSTORC_MAX_DISK);
+			return;
+		}
+	}
+	if ((!conf->ostor_disk || !conf->ostor_disk[0]) &&
+			(conf->ostor_path == JORM_INVAL_STR)) {
 		snprintf(err, err_len, "you must give a path to the ostor");
 		return;
 	}
@@ -44,4 +143,74 @@ void harmonize_ostorc(struct ostorc *conf, char *err, size_t err_len)
 			"than 0");
 		return;
 	}
+	if (conf->ostor_io_depth <= 0) {
+		snprintf(err, err_len, "ostor->ostor_io_depth must be at "
+			"least 1");
+		return;
+	}
+	if (conf->ostor_scrub_rate < 0) {
+		snprintf(err, err_len, "ostor->ostor_scrub_rate cannot be "
+			"less than 0");
+		return;
+	}
+	if (conf->ostor_scrub_ival <= 0) {
+		snprintf(err, err_len, "ostor->ostor_scrub_ival must be at "
+			"least 1");
+		return;
+	}
+	if ((conf->ostor_coalesce_kb < 0) ||
+			(conf->ostor_coalesce_kb > MAX_OSTOR_COALESCE_KB)) {
+		snprintf(err, err_len, "ostor->ostor_coalesce_kb must be "
+			"between 0 and %d", MAX_OSTOR_COALESCE_KB);
+		return;
+	}
+	if (conf->ostor_prealloc_kb < 0) {
+		snprintf(err, err_len, "ostor->ostor_prealloc_kb cannot be "
+			"less than 0");
+		return;
+	}
+	if (conf->ostor_chunk_kb <= 0) {
+		snprintf(err, err_len, "ostor->ostor_chunk_kb must be at "
+			"least 1");
+		return;
+	}
+	if (conf->ostor_direct_kb < 0) {
+		snprintf(err, err_len, "ostor->ostor_direct_kb cannot be "
+			"less than 0");
+		return;
+	}
+	if ((conf->ostor_dir_levels < 1) ||
+			(conf->ostor_dir_levels > OSTORC_MAX_DIR_LEVELS)) {
+		snprintf(err, err_len, "ostor->ostor_dir_levels must be "
+			"between 1 and %d", OSTORC_MAX_DIR_LEVELS);
+		return;
+	}
+	if ((conf->ostor_dir_bits < 1) ||
+			(conf->ostor_dir_bits > OSTORC_MAX_DIR_BITS)) {
+		snprintf(err, err_len, "ostor->ostor_dir_bits must be "
+			"between 1 and %d", OSTORC_MAX_DIR_BITS);
+		return;
+	}
+	if ((conf->ostor_pack_seg_mb < 1) ||
+			(conf->ostor_pack_seg_mb > MAX_OSTOR_PACK_SEG_MB)) {
+		snprintf(err, err_len, "ostor->ostor_pack_seg_mb must be "
+			"between 1 and %d", MAX_OSTOR_PACK_SEG_MB);
+		return;
+	}
+	if ((conf->ostor_pack_kb < 0) ||
+			(conf->ostor_pack_kb > MAX_OSTOR_PACK_KB)) {
+		snprintf(err, err_len, "ostor->ostor_pack_kb must be "
+			"between 0 and %d", MAX_OSTOR_PACK_KB);
+		return;
+	}
+	if (conf->ostor_pack_kb >= conf->ostor_pack_seg_mb * 1024) {
+		snprintf(err, err_len, "ostor->ostor_pack_kb must be less "
+			"than ostor->ostor_pack_seg_mb");
+		return;
+	}
+	if (conf->ostor_pack_ival <= 0) {
+		snprintf(err, err_len, "ostor->ostor_pack_ival must be at "
+			"least 1");
+		return;
+	}
 }
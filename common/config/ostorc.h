@@ -25,6 +25,16 @@
 #include "common/config/ostorc.jorm"
 #endif
 
+/** Maximum number of data directories an ostor can have */
+#define OSTORC_MAX_DISK 64
+
+/** Maximum number of directory levels above each chunk file */
+#define OSTORC_MAX_DIR_LEVELS 4
+
+/** Maximum number of bits of the chunk ID hash used to pick the directory at
+ * each level */
+#define OSTORC_MAX_DIR_BITS 16
+
 /** Harmonize the ostor configuration
  *
  * @param conf		The mstor configuration
@@ -45,3 +45,59 @@ for d in of_node.OfNodeIter(node_list, ["osd"]):
         "-o", output_file, "-k", str(d.id), hex(cid) ]
     of_util.subprocess_check_output(tool_cmd)
     filecmp.cmp(input_file, output_file)
+
+# write another chunk once, and have the OSDs pass it down the chain
+osds = [ d for d in of_node.OfNodeIter(node_list, ["osd"]) ]
+if len(osds) > 1:
+    print "writing chunk to " + osds[0].get_short_name() + \
+        " and passing it on"
+    tool_cmd = [ opts.bld_dir + "/tool/fishtool", "chunk_write",
+        "-i", input_file, "-k", str(osds[0].id),
+        "-r", ",".join([ str(d.id) for d in osds[1:] ]), hex(cid + 1) ]
+    of_util.subprocess_check_output(tool_cmd)
+    for d in osds:
+        print "reading chained chunk from " + d.get_short_name()
+        tool_cmd = [ opts.bld_dir + "/tool/fishtool", "chunk_read", "-v",
+            "-o", output_file, "-k", str(d.id), hex(cid + 1) ]
+        of_util.subprocess_check_output(tool_cmd)
+        if not filecmp.cmp(input_file, output_file, shallow=False):
+            raise RuntimeError("chained chunk on " + d.get_short_name() +
+                " differs from the original")
+
+# have one OSD copy a chunk to another.  The chunk is bigger than the pieces
+# that chunks are copied in, so the copy takes several hflushes.
+if len(osds) > 1:
+    big_file = opts.bld_dir + "/big.in"
+    f = open(big_file, "wb")
+    try:
+        f.write(os.urandom((10 * 1024 * 1024) + 123))
+    finally:
+        f.close()
+    print "writing big chunk to " + osds[0].get_short_name()
+    tool_cmd = [ opts.bld_dir + "/tool/fishtool", "chunk_write",
+        "-i", big_file, "-k", str(osds[0].id), hex(cid + 2) ]
+    of_util.subprocess_check_output(tool_cmd)
+    print "copying big chunk to " + osds[1].get_short_name()
+    tool_cmd = [ opts.bld_dir + "/tool/fishtool", "chunk_copy",
+        "-k", str(osds[0].id), "-d", str(osds[1].id), hex(cid + 2) ]
+    copy_out = of_util.subprocess_check_output(tool_cmd)
+    # the copy must have the length and checksum of the original, as both
+    # OSDs compute them by reading the chunk back
+    csums = []
+    for d in osds[0:2]:
+        tool_cmd = [ opts.bld_dir + "/tool/fishtool", "chunk_csum",
+            "-k", str(d.id), hex(cid + 2) ]
+        csums.append(of_util.subprocess_check_output(tool_cmd).strip())
+    print "source: " + csums[0] + ", copy: " + csums[1]
+    if csums[0] != csums[1]:
+        raise RuntimeError("copied chunk has a different checksum")
+    if not copy_out.strip().endswith(csums[0]):
+        raise RuntimeError("chunk_copy reported a different checksum")
+    if not csums[0].startswith(str(os.path.getsize(big_file)) + " bytes"):
+        raise RuntimeError("chunk checksum covers the wrong length")
+    print "reading copied chunk from " + osds[1].get_short_name()
+    tool_cmd = [ opts.bld_dir + "/tool/fishtool", "chunk_read", "-v",
+        "-o", output_file, "-k", str(osds[1].id), hex(cid + 2) ]
+    of_util.subprocess_check_output(tool_cmd)
+    if not filecmp.cmp(big_file, output_file, shallow=False):
+        raise RuntimeError("copied chunk differs from the original")
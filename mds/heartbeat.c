@@ -26,6 +26,7 @@
 #include "mds/delegation.h"
 #include "mds/dslots.h"
 #include "mds/const.h"
+#include "mds/heartbeat.h"
 #include "mds/net.h"
 #include "msg/bsend.h"
 #include "msg/msg.h"
@@ -61,6 +62,65 @@ extern struct msgr *g_msgr[];
 
 #define MDS_SUICIDE_TIMEOUT 40
 
+/** An OSD that we haven't heard from in this many seconds is down */
+#define MDS_OSD_DOWN_TIMEO 30
+
+/** Time of the last heartbeat from each OSD, indexed by OSD ID.  Accessed
+ * atomically. */
+static time_t *g_osd_hb_time;
+
+/** Length of g_osd_hb_time */
+static int g_num_osd_hb;
+
+int mds_hb_init(int num_osd)
+{
+	int i;
+	time_t now;
+
+	g_osd_hb_time = calloc(num_osd, sizeof(time_t));
+	if (!g_osd_hb_time)
+		return -ENOMEM;
+	now = mt_time();
+	for (i = 0; i < num_osd; ++i)
+		g_osd_hb_time[i] = now;
+	g_num_osd_hb = num_osd;
+	return 0;
+}
+
+void mds_hb_recv(const struct mmm_heartbeat *hb)
+{
+	if (hb->ty != RF_ENTITY_TY_OSD)
+		return;
+	if (hb->id >= (uint32_t)g_num_osd_hb) {
+		glitch_log("mds_hb_recv: got a heartbeat from unknown OSD "
+			"%u\n", hb->id);
+		return;
+	}
+	__atomic_store_n(&g_osd_hb_time[hb->id], mt_time(), __ATOMIC_RELAXED);
+}
+
+int mds_hb_get_live(uint8_t *live, int num_osd, time_t now)
+{
+	int i, num_down = 0;
+	time_t last;
+
+	for (i = 0; i < num_osd; ++i) {
+		live[i] = 0;
+		if ((i >= g_num_osd_hb) || (i >= g_cmap->num_osd) ||
+				(!g_cmap->oinfo[i].in)) {
+			++num_down;
+			continue;
+		}
+		last = __atomic_load_n(&g_osd_hb_time[i], __ATOMIC_RELAXED);
+		if (now - last > MDS_OSD_DOWN_TIMEO) {
+			++num_down;
+			continue;
+		}
+		live[i] = 1;
+	}
+	return num_down;
+}
+
 int mds_send_hb_thread(struct redfish_thread *rt)
 {
 	struct mtran *tr;
@@ -75,7 +135,7 @@ int mds_send_hb_thread(struct redfish_thread *rt)
 
 	resp.ty = RF_ENTITY_TY_MDS;
 	resp.id = g_mid;
-	r = MSG_XDR_ALLOC(mmm_resp, &resp);
+	r = MSG_XDR_ALLOC(mmm_heartbeat, &resp);
 	if (IS_ERR(r)) {
 		abort();
 	}
@@ -19,8 +19,43 @@
 #ifndef REDFISH_MDS_HEARTBEAT_DOT_H
 #define REDFISH_MDS_HEARTBEAT_DOT_H
 
+#include <stdint.h> /* for uint8_t, etc. */
+#include <time.h> /* for time_t */
+
+struct mmm_heartbeat;
 struct redfish_thread;
 
+/** Start tracking heartbeats from OSDs
+ *
+ * Every OSD gets a grace period, starting now, to send its first heartbeat
+ * before it is taken to be down.
+ *
+ * @param num_osd	Number of OSDs in the cluster
+ *
+ * @return		0 on success; error code otherwise
+ */
+extern int mds_hb_init(int num_osd);
+
+/** Record a heartbeat that we received
+ *
+ * @param hb		The heartbeat
+ */
+extern void mds_hb_recv(const struct mmm_heartbeat *hb);
+
+/** Find out which OSDs are up
+ *
+ * An OSD is up if it is in the cluster map and we have heard from it
+ * recently.  The caller must hold g_cmap_lock.
+ *
+ * @param live		(out param) array indexed by OSD ID: set to nonzero if
+ *			the OSD is up
+ * @param num_osd	Length of live
+ * @param now		The current time, as returned by mt_time
+ *
+ * @return		The number of OSDs that are down
+ */
+extern int mds_hb_get_live(uint8_t *live, int num_osd, time_t now);
+
 /** Runs the MDS heartbeat thread
  *
  * @param rt		The Redfish thread object
@@ -21,6 +21,7 @@
 #include "mds/mstor.h"
 #include "mds/srange_lock.h"
 #include "mds/user.h"
+#include "msg/lpack.h"
 #include "msg/types.h"
 #include "msg/xdr.h"
 #include "util/error.h"
@@ -49,7 +50,7 @@
  * for directory children:
  *	c[8-byte node-id][child-name] => 8-byte child ID
  * for chunks:
- *      h[8-byte-chunk-id] => <packed-array of 4-byte OSD-IDs>
+ *      h[8-byte-chunk-id] => <packed-array of big-endian 4-byte OSD-IDs>
  * for zombie chunks:
  *      z[8-byte-death-time][8-byte-zombie-chunk-id] => []
  * for users:
@@ -59,7 +60,9 @@
  */
 /****************************** constants ********************************/
 
-#define MSTOR_CUR_VERSION 0x000000001U
+/* Version 1 stored the OSD IDs in chunk records in host byte order */
+#define MSTOR_CUR_VERSION 0x000000002U
+#define MSTOR_VERSION_HOST_OIDS 0x000000001U
 #define MSTOR_VERSION_MAGIC "Fish"
 #define MSTOR_VERSION_MAGIC_LEN 4
 #define MSTOR_VERSION_BODY_LEN 8
@@ -95,6 +98,9 @@ static int fill_rf_stat(struct mstor *mstor, struct rf_stat *stat,
 		const struct mnode *cnode);
 static int fill_rf_lentry(struct mstor *mstor, struct rf_lentry *le,
 		struct mnode *node, const char *path);
+static int fill_lpack_entry(struct mstor *mstor, struct lpack_enc *enc,
+		const struct mnode *node, const char *pcomp,
+		uint32_t pcomp_len);
 
 /****************************** types ********************************/
 /** A metadata node representing either a file or a directory
@@ -199,6 +205,9 @@ static int mstor_range_lock_by_op(struct mstor *mstor, struct mreq *mreq)
 	case MSTOR_OP_CHUNKALLOC:
 	case MSTOR_OP_FIND_ZOMBIES:
 	case MSTOR_OP_DESTROY_ZOMBIE:
+	case MSTOR_OP_FIND_UNDERREP:
+	case MSTOR_OP_CHUNK_LOOKUP:
+	case MSTOR_OP_CHUNK_MOVE:
 		strat = RL_STRAT_NO_LOCK;
 		break;
 	case MSTOR_OP_NODE_SEARCH:
@@ -336,6 +345,12 @@ const char *mstor_op_ty_to_str(enum mstor_op_ty op)
 		return "MSTOR_OP_DESTROY_ZOMBIE";
 	case MSTOR_OP_RENAME:
 		return "MSTOR_OP_RENAME";
+	case MSTOR_OP_FIND_UNDERREP:
+		return "MSTOR_OP_FIND_UNDERREP";
+	case MSTOR_OP_CHUNK_LOOKUP:
+		return "MSTOR_OP_CHUNK_LOOKUP";
+	case MSTOR_OP_CHUNK_MOVE:
+		return "MSTOR_OP_CHUNK_MOVE";
 	case MSTOR_OP_NODE_SEARCH:
 		return "MSTOR_OP_NODE_SEARCH";
 	default:
@@ -433,14 +448,19 @@ done:
 	return ret;
 }
 
+static void mstor_pack_version(char *val, uint32_t vers)
+{
+	memcpy(val, MSTOR_VERSION_MAGIC, MSTOR_VERSION_MAGIC_LEN);
+	pack_to_be32(val + MSTOR_VERSION_MAGIC_LEN, vers);
+}
+
 static int mstor_write_version(struct mstor *mstor, uint32_t vers)
 {
 	int ret;
 	char *err = NULL;
 	char val[MSTOR_VERSION_BODY_LEN];
 
-	memcpy(val, MSTOR_VERSION_MAGIC, MSTOR_VERSION_MAGIC_LEN);
-	pack_to_be32(val + MSTOR_VERSION_MAGIC_LEN, vers);
+	mstor_pack_version(val, vers);
 	leveldb_put(mstor->ldb, mstor->lwropt, "v", 1, val,
 		MSTOR_VERSION_BODY_LEN, &err);
 	if (err) {
@@ -595,6 +615,82 @@ static int mstor_load_next_cid(leveldb_iterator_t *iter, uint64_t *next_cid)
 	return 0;
 }
 
+/** Upgrade an mstor whose chunk records have host-endian OSD IDs
+ *
+ * Every chunk record is rewritten with big-endian OSD IDs, in the same write
+ * batch as the new version number.  That way, if we crash part of the way
+ * through, the next attempt starts over from the old records.
+ *
+ * @param mstor		The mstor
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int mstor_upgrade_host_oids(struct mstor *mstor)
+{
+	int i, ret, num_oid;
+	leveldb_iterator_t *iter = NULL;
+	leveldb_writebatch_t *bat = NULL;
+	const char *k, *v;
+	char *err = NULL;
+	char val[MSTOR_VERSION_BODY_LEN];
+	size_t klen, vlen;
+	uint32_t oid, be_oids[RF_MAX_OID];
+	uint64_t num_chunk = 0;
+
+	iter = leveldb_create_iterator(mstor->ldb, mstor->lreadopt);
+	if (!iter) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	bat = leveldb_writebatch_create();
+	if (!bat) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	for (leveldb_iter_seek(iter, "h", 1); leveldb_iter_valid(iter);
+			leveldb_iter_next(iter)) {
+		k = leveldb_iter_key(iter, &klen);
+		if ((klen < 1) || (k[0] != 'h'))
+			break;
+		v = leveldb_iter_value(iter, &vlen);
+		if ((vlen % sizeof(uint32_t)) || (vlen > sizeof(be_oids))) {
+			glitch_log("mstor_upgrade_host_oids: invalid chunk "
+				"record of length %Zd\n", vlen);
+			ret = -EIO;
+			goto done;
+		}
+		num_oid = vlen / sizeof(uint32_t);
+		for (i = 0; i < num_oid; ++i) {
+			memcpy(&oid, v + (i * sizeof(uint32_t)), sizeof(oid));
+			pack_to_be32(&be_oids[i], oid);
+		}
+		leveldb_writebatch_put(bat, k, klen,
+			(const char*)be_oids, vlen);
+		++num_chunk;
+	}
+	mstor_pack_version(val, MSTOR_CUR_VERSION);
+	leveldb_writebatch_put(bat, "v", 1, val, MSTOR_VERSION_BODY_LEN);
+	leveldb_write(mstor->ldb, mstor->lwropt, bat, &err);
+	if (err) {
+		glitch_log("mstor_upgrade_host_oids: leveldb_write "
+			"failed: '%s'\n", err);
+		ret = -EIO;
+		goto done;
+	}
+	glitch_log("mstor_upgrade_host_oids: upgraded %" PRIu64 " chunk "
+		"records to version %d of the mstor format\n", num_chunk,
+		MSTOR_CUR_VERSION);
+	ret = 0;
+
+done:
+	free(err);
+	if (bat)
+		leveldb_writebatch_destroy(bat);
+	if (iter)
+		leveldb_iter_destroy(iter);
+	return ret;
+}
+
 static int mstor_leveldb_load(struct mstor *mstor)
 {
 	int ret;
@@ -608,6 +704,12 @@ static int mstor_leveldb_load(struct mstor *mstor)
 		ret = -EINVAL;
 		goto done;
 	}
+	if (vers == MSTOR_VERSION_HOST_OIDS) {
+		ret = mstor_upgrade_host_oids(mstor);
+		if (ret)
+			goto done;
+		vers = MSTOR_CUR_VERSION;
+	}
 	if (vers != MSTOR_CUR_VERSION) {
 		glitch_log("mstor_leveldb_load: can't understand version "
 			   "%d of the mstor format.\n", vers);
@@ -1348,8 +1450,9 @@ static int mstor_do_chunkalloc(struct mstor *mstor, struct mreq *mreq)
 	struct mnode node;
 	struct chunk_info cinfo;
 	uint64_t cid, be_cid;
-	uint32_t oids[RF_MAX_REPLICAS];
+	uint32_t oids[RF_MAX_REPLICAS], be_oids[RF_MAX_REPLICAS];
 	leveldb_writebatch_t* bat = NULL;
+	int i;
 
 	memset(&node, 0, sizeof(node));
 	req = (struct mreq_chunkalloc*)mreq;
@@ -1390,8 +1493,10 @@ static int mstor_do_chunkalloc(struct mstor *mstor, struct mreq *mreq)
 			(const char*)&be_cid, sizeof(be_cid));
 	hkey[0] = 'h';
 	pack_to_be64(hkey + 1, cid);
+	for (i = 0; i < num_oid; ++i)
+		pack_to_be32(&be_oids[i], oids[i]);
 	leveldb_writebatch_put(bat, hkey, MCHUNK_KEY_LEN,
-			(const char *)oids, sizeof(uint32_t) * num_oid);
+			(const char *)be_oids, sizeof(uint32_t) * num_oid);
 	leveldb_write(mstor->ldb, mstor->lwropt, bat, &err);
 	if (err) {
 		glitch_log("mstor_do_chunkalloc(%" PRIx64 "): leveldb_write "
@@ -1509,8 +1614,14 @@ static int mstor_do_listdir(struct mstor *mstor, struct mreq *mreq,
 			/* error condition */
 			goto done;
 		}
-		ret = fill_rf_lentry(mstor, &req->le[num_stat], &node,
-			pcomp);
+		if (req->enc) {
+			ret = fill_lpack_entry(mstor, req->enc, &node, pcomp,
+				klen - MCHILD_KEY_LEN_PREFIX);
+		}
+		else {
+			ret = fill_rf_lentry(mstor, &req->le[num_stat], &node,
+				pcomp);
+		}
 		if (ret)
 			goto done;
 next:
@@ -1526,7 +1637,7 @@ done:
 		leveldb_iter_destroy(iter);
 	mnode_free(&node);
 	if (ret) {
-		for (i = 0; i < num_stat; ++i) {
+		for (i = 0; (i < num_stat) && (!req->enc); ++i) {
 			XDR_REQ_FREE(rf_lentry, &req->le[i]);
 		}
 		req->num_stat = 0;
@@ -1573,29 +1684,50 @@ static int mstor_do_nid_stat(struct mstor *mstor, struct mreq *mreq)
 	return ret;
 }
 
+/** Fill in the attributes of a node which every kind of stat and listdir
+ * response carries
+ *
+ * The path component is left alone.  The user and group names point into
+ * mstor->udata.
+ *
+ * @param mstor		The mstor
+ * @param node		The node
+ * @param e		(out param) the attributes
+ */
+static void fill_node_attrs(struct mstor *mstor, const struct mnode *node,
+		struct lpack_entry *e)
+{
+	e->nid = node->nid;
+	e->mtime = unpack_from_be64(&node->val->mtime);
+	e->atime = unpack_from_be64(&node->val->atime);
+	e->length = unpack_from_be64(&node->val->length);
+	e->block_sz = 0; // TODO: fill in
+	e->mode_and_type = unpack_from_be16(&node->val->mode_and_type);
+	// TODO: support custom per-file replication settings
+	e->man_repl = mstor->man_repl;
+	e->user = udata_lookup_uid(mstor->udata,
+		unpack_from_be32(&node->val->uid))->name;
+	e->group = udata_lookup_gid(mstor->udata,
+		unpack_from_be32(&node->val->gid))->name;
+}
+
 static int fill_rf_stat(struct mstor *mstor, struct rf_stat *stat,
 		const struct mnode *node)
 {
-	struct user *user;
-	struct group *group;
-	uint64_t uid, gid;
-
-	stat->mtime = unpack_from_be64(&node->val->mtime);
-	stat->atime = unpack_from_be64(&node->val->atime);
-	stat->length = unpack_from_be64(&node->val->length);
-	stat->nid = node->nid;
-	stat->block_sz = 0; // TODO: fill in
-	stat->mode_and_type = unpack_from_be16(&node->val->mode_and_type);
-	// TODO: support custom per-file replication settings
-	stat->man_repl = mstor->man_repl;
-	uid = unpack_from_be32(&node->val->uid);
-	user = udata_lookup_uid(mstor->udata, uid);
-	stat->user = strdup(user->name);
+	struct lpack_entry e;
+
+	fill_node_attrs(mstor, node, &e);
+	stat->mtime = e.mtime;
+	stat->atime = e.atime;
+	stat->length = e.length;
+	stat->nid = e.nid;
+	stat->block_sz = e.block_sz;
+	stat->mode_and_type = e.mode_and_type;
+	stat->man_repl = e.man_repl;
+	stat->user = strdup(e.user);
 	if (!stat->user)
 		return -ENOMEM;
-	gid = unpack_from_be32(&node->val->gid);
-	group = udata_lookup_gid(mstor->udata, gid);
-	stat->group = strdup(group->name);
+	stat->group = strdup(e.group);
 	if (!stat->group) {
 		free(stat->user);
 		return -ENOMEM;
@@ -1619,6 +1751,20 @@ static int fill_rf_lentry(struct mstor *mstor, struct rf_lentry *le,
 	return 0;
 }
 
+static int fill_lpack_entry(struct mstor *mstor, struct lpack_enc *enc,
+		const struct mnode *node, const char *pcomp,
+		uint32_t pcomp_len)
+{
+	struct lpack_entry e;
+
+	/* Unlike fill_rf_stat, we don't need to copy the user and group names;
+	 * the encoder keeps just one copy of each. */
+	fill_node_attrs(mstor, node, &e);
+	e.pcomp = pcomp;
+	e.pcomp_len = pcomp_len;
+	return lpack_enc_add(enc, &e);
+}
+
 static int mstor_do_chmod(struct mstor *mstor, struct mreq *mreq,
 		const struct mnode *node)
 {
@@ -2065,6 +2211,183 @@ done:
 	return ret;
 }
 
+/** Decode a chunk replica record
+ *
+ * @param v		The h[cid] value
+ * @param vlen		Length of v
+ * @param crep		(out param) the chunk's OSD IDs are stored here
+ *
+ * @return		0 on success; -EIO if the record is invalid
+ */
+static int mstor_unpack_chunk_repl(const char *v, size_t vlen,
+		struct chunk_repl *crep)
+{
+	int i;
+
+	if ((vlen % sizeof(uint32_t)) ||
+			(vlen > sizeof(uint32_t) * RF_MAX_OID))
+		return -EIO;
+	crep->num_oid = vlen / sizeof(uint32_t);
+	for (i = 0; i < crep->num_oid; ++i)
+		crep->oid[i] = unpack_from_be32(v + (i * sizeof(uint32_t)));
+	return 0;
+}
+
+static int mstor_do_find_underrep(struct mstor *mstor, struct mreq *mreq)
+{
+	int i, ret, num_res;
+	leveldb_iterator_t *iter = NULL;
+	const char *k, *v;
+	char hkey[MCHUNK_KEY_LEN];
+	size_t klen, vlen;
+	struct mreq_find_underrep *req;
+	struct chunk_repl *crep;
+	uint32_t oid;
+
+	req = (struct mreq_find_underrep*)mreq;
+	req->next = RF_INVAL_CID;
+	iter = leveldb_create_iterator(mstor->ldb, mstor->lreadopt);
+	if (!iter) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	hkey[0] = 'h';
+	pack_to_be64(hkey + 1, req->start);
+	leveldb_iter_seek(iter, hkey, MCHUNK_KEY_LEN);
+	num_res = 0;
+	while (1) {
+		if (!leveldb_iter_valid(iter))
+			break;
+		k = leveldb_iter_key(iter, &klen);
+		if ((klen < 1) || (k[0] != 'h'))
+			break;
+		if (klen != MCHUNK_KEY_LEN) {
+			glitch_log("mstor_do_find_underrep: leveldb_iter_key "
+				"returned klen = %Zd.  That should not be "
+				"possible.\n", klen);
+			ret = -EIO;
+			goto done;
+		}
+		if (num_res == req->max_res) {
+			req->next = unpack_from_be64(k + 1);
+			break;
+		}
+		crep = &req->creps[num_res];
+		crep->cid = unpack_from_be64(k + 1);
+		v = leveldb_iter_value(iter, &vlen);
+		if (mstor_unpack_chunk_repl(v, vlen, crep)) {
+			glitch_log("mstor_do_find_underrep: invalid record "
+				"for chunk 0x%016" PRIx64 " of length %Zd\n",
+				crep->cid, vlen);
+			ret = -EIO;
+			goto done;
+		}
+		crep->bad = 0;
+		crep->num_live = 0;
+		for (i = 0; i < crep->num_oid; ++i) {
+			oid = crep->oid[i];
+			if ((oid < (uint32_t)req->num_osd) && req->live[oid])
+				++crep->num_live;
+		}
+		if (crep->num_live < crep->num_oid)
+			++num_res;
+		leveldb_iter_next(iter);
+	}
+	req->num_res = num_res;
+	ret = 0;
+done:
+	if (iter)
+		leveldb_iter_destroy(iter);
+	return ret;
+}
+
+/** Fetch the record of which OSDs a chunk is on
+ *
+ * @param mstor		The mstor
+ * @param cid		The chunk ID
+ * @param crep		(out param) the chunk's OSD IDs are stored here
+ *
+ * @return		0 on success; -ENOENT if there is no such chunk; other
+ *			error codes otherwise
+ */
+static int mstor_fetch_chunk_repl(struct mstor *mstor, uint64_t cid,
+		struct chunk_repl *crep)
+{
+	int ret;
+	char hkey[MCHUNK_KEY_LEN], *v, *err = NULL;
+	size_t vlen;
+
+	hkey[0] = 'h';
+	pack_to_be64(hkey + 1, cid);
+	v = leveldb_get(mstor->ldb, mstor->lreadopt, hkey, MCHUNK_KEY_LEN,
+			&vlen, &err);
+	if (err) {
+		glitch_log("mstor_fetch_chunk_repl(cid=0x%" PRIx64 ") got "
+			"leveldb_get error '%s'\n", cid, err);
+		free(err);
+		return -EIO;
+	}
+	if (!v)
+		return -ENOENT;
+	memset(crep, 0, sizeof(struct chunk_repl));
+	crep->cid = cid;
+	ret = mstor_unpack_chunk_repl(v, vlen, crep);
+	if (ret) {
+		glitch_log("mstor_fetch_chunk_repl(cid=0x%" PRIx64 "): "
+			"invalid record of length %Zd\n", cid, vlen);
+	}
+	free(v);
+	return ret;
+}
+
+static int mstor_do_chunk_lookup(struct mstor *mstor, struct mreq *mreq)
+{
+	struct mreq_chunk_lookup *req;
+
+	req = (struct mreq_chunk_lookup*)mreq;
+	return mstor_fetch_chunk_repl(mstor, req->cid, req->crep);
+}
+
+static int mstor_do_chunk_move(struct mstor *mstor, struct mreq *mreq)
+{
+	int i, ret;
+	char hkey[MCHUNK_KEY_LEN], *err = NULL;
+	struct mreq_chunk_move *req;
+	struct chunk_repl crep;
+	uint32_t be_oids[RF_MAX_OID];
+
+	req = (struct mreq_chunk_move*)mreq;
+	ret = mstor_fetch_chunk_repl(mstor, req->cid, &crep);
+	if (ret)
+		return ret;
+	/* If the source is gone, someone else has already moved the replica.
+	 * If the destination is already there, moving it would leave the
+	 * chunk with one replica fewer. */
+	ret = -ENOENT;
+	for (i = 0; i < crep.num_oid; ++i) {
+		if (crep.oid[i] == req->dst)
+			return -EEXIST;
+		if (crep.oid[i] == req->src)
+			ret = i;
+	}
+	if (ret < 0)
+		return ret;
+	crep.oid[ret] = req->dst;
+	for (i = 0; i < crep.num_oid; ++i)
+		pack_to_be32(&be_oids[i], crep.oid[i]);
+	hkey[0] = 'h';
+	pack_to_be64(hkey + 1, req->cid);
+	leveldb_put(mstor->ldb, mstor->lwropt, hkey, MCHUNK_KEY_LEN,
+		(const char*)be_oids, sizeof(uint32_t) * crep.num_oid, &err);
+	if (err) {
+		glitch_log("mstor_do_chunk_move(cid=0x%" PRIx64 ") got "
+			"leveldb_put error '%s'\n", req->cid, err);
+		free(err);
+		return -EIO;
+	}
+	return 0;
+}
+
 static int mstor_do_path_operation(struct mstor *mstor, struct mreq *mreq,
 			    struct mnode *pnode, struct mnode *cnode)
 {
@@ -2379,6 +2702,15 @@ int mstor_do_operation(struct mstor *mstor, struct mreq *mreq)
 	case MSTOR_OP_DESTROY_ZOMBIE:
 		ret = mstor_do_destroy_zombie(mstor, mreq);
 		break;
+	case MSTOR_OP_FIND_UNDERREP:
+		ret = mstor_do_find_underrep(mstor, mreq);
+		break;
+	case MSTOR_OP_CHUNK_LOOKUP:
+		ret = mstor_do_chunk_lookup(mstor, mreq);
+		break;
+	case MSTOR_OP_CHUNK_MOVE:
+		ret = mstor_do_chunk_move(mstor, mreq);
+		break;
 	case MSTOR_OP_NID_STAT:
 		ret = mstor_do_nid_stat(mstor, mreq);
 		break;
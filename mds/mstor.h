@@ -38,7 +38,9 @@
  * users and groups are added rather infrequently, this should be as acceptable.
  */
 struct fast_log_mgr;
+struct lpack_enc;
 struct mstor;
+struct mstorc;
 struct srange_locker;
 struct udata;
 
@@ -97,6 +99,15 @@ enum mstor_op_ty {
 	/** Operation that renames a directory or file
 	 * Locking: uses range locker */
 	MSTOR_OP_RENAME,
+	/** Operation that finds chunks with fewer live replicas than they were
+	 * given.  Locking: external */
+	MSTOR_OP_FIND_UNDERREP,
+	/** Operation that looks up which OSDs a chunk is on.
+	 * Locking: external */
+	MSTOR_OP_CHUNK_LOOKUP,
+	/** Operation that moves a chunk replica from one OSD to another.
+	 * Locking: external */
+	MSTOR_OP_CHUNK_MOVE,
 	/** For mstor internal use only */
 	MSTOR_OP_NODE_SEARCH,
 };
@@ -224,6 +235,9 @@ struct mreq_listdir {
 	/** (inout param) Pointer to buffer to use to return the results.
 	 * The results will be returned as an array of rf_stat entries. */
 	struct rf_lentry *le;
+	/** If this is non-NULL, the results are added to this compact listdir
+	 * encoder instead, and le is not used. */
+	struct lpack_enc *enc;
 	/** Maximum number of rf_lentry structures that can fit in our
 	 * buffer. */
 	int max_stat;
@@ -290,6 +304,60 @@ struct mreq_destroy_zombie {
 	struct zombie_info zinfo;
 };
 
+struct chunk_repl {
+	/** chunk ID */
+	uint64_t cid;
+	/** OSDs which are supposed to have the chunk */
+	uint32_t oid[RF_MAX_OID];
+	/** length of oid array */
+	int num_oid;
+	/** Bitmap of entries in oid whose replicas are known to be bad, even
+	 * though their OSDs are up.  The mstor doesn't track this; it is
+	 * always 0 in find_underrep results. */
+	int bad;
+	/** Number of entries in oid whose OSDs are up, and which aren't bad */
+	int num_live;
+};
+
+struct mreq_find_underrep {
+	struct mreq base;
+	/** The lowest chunk ID to look at */
+	uint64_t start;
+	/** Array indexed by OSD ID: nonzero if the OSD is up */
+	const uint8_t *live;
+	/** Length of the live array.  OSDs past the end are taken to be down.
+	 */
+	int num_osd;
+	/** Size of result buffer */
+	int max_res;
+	/** (out param) number of results found */
+	int num_res;
+	/** (out param) the chunk ID to start the next search at, or
+	 * RF_INVAL_CID if there are no more chunks */
+	uint64_t next;
+	/** (out param) an array of size max_res where we'll store the
+	 * under-replicated chunks */
+	struct chunk_repl *creps;
+};
+
+struct mreq_chunk_lookup {
+	struct mreq base;
+	/** chunk ID */
+	uint64_t cid;
+	/** (out param) the OSDs which the chunk is on */
+	struct chunk_repl *crep;
+};
+
+struct mreq_chunk_move {
+	struct mreq base;
+	/** chunk ID */
+	uint64_t cid;
+	/** OSD which should no longer have the chunk */
+	uint32_t src;
+	/** OSD which now has a copy of the chunk */
+	uint32_t dst;
+};
+
 struct mreq_rename {
 	struct mreq base;
 	/** destination path */
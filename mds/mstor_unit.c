@@ -31,6 +31,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <leveldb/c.h>
 #include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -61,6 +62,9 @@
 #define MSTORU_MAX_CINFOS 64
 #define MSTORU_MAX_ZINFOS 64
 
+#define MSTORU_UNDERREP_CHUNKS 4
+#define MSTORU_UNDERREP_OSDS 4
+
 static pthread_key_t g_tls_key;
 
 struct mstoru_tls {
@@ -374,6 +378,58 @@ static int mstoru_do_destroy_zombie(struct mstor *mstor,
 	return mstor_do_operation(mstor, (struct mreq*)&mreq);
 }
 
+static int mstoru_do_find_underrep(struct mstor *mstor, uint64_t start,
+		const uint8_t *live, int num_osd, int max_res,
+		struct chunk_repl *creps, uint64_t *next)
+{
+	int ret;
+	struct mreq_find_underrep mreq;
+	struct mstoru_tls *tls = mstoru_tls_get();
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.base.lk = tls->lk;
+	mreq.base.op = MSTOR_OP_FIND_UNDERREP;
+	mreq.start = start;
+	mreq.live = live;
+	mreq.num_osd = num_osd;
+	mreq.max_res = max_res;
+	mreq.creps = creps;
+	ret = mstor_do_operation(mstor, (struct mreq*)&mreq);
+	if (ret < 0)
+		return ret;
+	*next = mreq.next;
+	return mreq.num_res;
+}
+
+static int mstoru_do_chunk_lookup(struct mstor *mstor, uint64_t cid,
+		struct chunk_repl *crep)
+{
+	struct mreq_chunk_lookup mreq;
+	struct mstoru_tls *tls = mstoru_tls_get();
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.base.lk = tls->lk;
+	mreq.base.op = MSTOR_OP_CHUNK_LOOKUP;
+	mreq.cid = cid;
+	mreq.crep = crep;
+	return mstor_do_operation(mstor, (struct mreq*)&mreq);
+}
+
+static int mstoru_do_chunk_move(struct mstor *mstor, uint64_t cid,
+		uint32_t src, uint32_t dst)
+{
+	struct mreq_chunk_move mreq;
+	struct mstoru_tls *tls = mstoru_tls_get();
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.base.lk = tls->lk;
+	mreq.base.op = MSTOR_OP_CHUNK_MOVE;
+	mreq.cid = cid;
+	mreq.src = src;
+	mreq.dst = dst;
+	return mstor_do_operation(mstor, (struct mreq*)&mreq);
+}
+
 static int mstoru_do_chunkfind(struct mstor *mstor, const char *full_path,
 		uint64_t start, uint64_t end, const char *user_name,
 		int max_cinfos, struct chunk_info *cinfos)
@@ -778,6 +834,153 @@ static int mstoru_test1(const char *tdir)
 	return 0;
 }
 
+static int mstoru_test_underrep(const char *tdir)
+{
+	int i;
+	struct mstor *mstor;
+	struct udata *udata;
+	uint64_t nid, next;
+	uint64_t csize = 134217728ULL;
+	struct chunk_info cinfos[MSTORU_UNDERREP_CHUNKS];
+	struct chunk_repl creps[MSTORU_UNDERREP_CHUNKS];
+	uint8_t live[MSTORU_UNDERREP_OSDS];
+
+	udata = udata_unit_create_default();
+	EXPECT_NOT_ERRPTR(udata);
+	mstor = mstoru_init_unit(tdir, "underrep", 1024, udata);
+	EXPECT_NOT_ERRPTR(mstor);
+	EXPECT_ZERO(mstoru_do_creat(mstor, "/u", 0644, 123,
+		RF_SUPERUSER_NAME, &nid));
+	for (i = 0; i < MSTORU_UNDERREP_CHUNKS; ++i) {
+		EXPECT_ZERO(mstoru_do_chunkalloc(mstor, nid, i * csize,
+			&cinfos[i]));
+	}
+	/* None of the OSDs that the chunks were given to exist */
+	memset(live, 1, sizeof(live));
+	EXPECT_EQ(mstoru_do_find_underrep(mstor, 0, live,
+		MSTORU_UNDERREP_OSDS, MSTORU_UNDERREP_CHUNKS, creps, &next),
+		MSTORU_UNDERREP_CHUNKS);
+	EXPECT_EQ(next, RF_INVAL_CID);
+	for (i = 0; i < MSTORU_UNDERREP_CHUNKS; ++i) {
+		EXPECT_EQ(creps[i].cid, cinfos[i].cid);
+		EXPECT_EQ(creps[i].num_oid, 2);
+		EXPECT_EQ(creps[i].num_live, 0);
+	}
+	/* Move every chunk onto OSDs 1 and 2 */
+	for (i = 0; i < MSTORU_UNDERREP_CHUNKS; ++i) {
+		EXPECT_ZERO(mstoru_do_chunk_move(mstor, creps[i].cid,
+			creps[i].oid[0], 1));
+		EXPECT_ZERO(mstoru_do_chunk_move(mstor, creps[i].cid,
+			creps[i].oid[1], 2));
+	}
+	EXPECT_EQ(mstoru_do_chunk_move(mstor, cinfos[0].cid, 1, 2), -EEXIST);
+	EXPECT_EQ(mstoru_do_chunk_move(mstor, cinfos[0].cid, 3, 0), -ENOENT);
+	EXPECT_EQ(mstoru_do_chunk_move(mstor, 0xabcdefULL, 1, 0), -ENOENT);
+	EXPECT_ZERO(mstoru_do_chunk_lookup(mstor, cinfos[3].cid, &creps[0]));
+	EXPECT_EQ(creps[0].cid, cinfos[3].cid);
+	EXPECT_EQ(creps[0].num_oid, 2);
+	EXPECT_EQ(creps[0].oid[0], 1);
+	EXPECT_EQ(creps[0].oid[1], 2);
+	EXPECT_EQ(mstoru_do_chunk_lookup(mstor, 0xabcdefULL, &creps[0]),
+		-ENOENT);
+	EXPECT_EQ(mstoru_do_find_underrep(mstor, 0, live,
+		MSTORU_UNDERREP_OSDS, MSTORU_UNDERREP_CHUNKS, creps, &next), 0);
+
+	/* Take down OSD 2, and page through the results */
+	live[2] = 0;
+	EXPECT_EQ(mstoru_do_find_underrep(mstor, 0, live,
+		MSTORU_UNDERREP_OSDS, 2, creps, &next), 2);
+	EXPECT_EQ(creps[0].cid, cinfos[0].cid);
+	EXPECT_EQ(creps[1].cid, cinfos[1].cid);
+	EXPECT_EQ(creps[1].oid[0], 1);
+	EXPECT_EQ(creps[1].oid[1], 2);
+	EXPECT_EQ(creps[1].num_live, 1);
+	EXPECT_EQ(next, cinfos[2].cid);
+	EXPECT_EQ(mstoru_do_find_underrep(mstor, next, live,
+		MSTORU_UNDERREP_OSDS, 2, creps, &next), 2);
+	EXPECT_EQ(creps[1].cid, cinfos[3].cid);
+	EXPECT_EQ(next, RF_INVAL_CID);
+
+	/* OSDs past the end of the live array are down */
+	EXPECT_EQ(mstoru_do_find_underrep(mstor, 0, live, 1,
+		MSTORU_UNDERREP_CHUNKS, creps, &next),
+		MSTORU_UNDERREP_CHUNKS);
+	EXPECT_EQ(creps[0].num_live, 0);
+
+	mstor_shutdown(mstor);
+	udata_free(udata);
+	return 0;
+}
+
+/** Make a chunk record look the way version 1 of the mstor format wrote it,
+ * with host-endian OSD IDs
+ */
+static int mstoru_downgrade_chunk(const char *tdir, const char *name,
+		uint64_t cid, const uint32_t *oids, int num_oid)
+{
+	char path[PATH_MAX], hkey[9], vers[8], *err = NULL;
+	leveldb_options_t *lopt;
+	leveldb_writeoptions_t *lwropt;
+	leveldb_t *ldb;
+
+	EXPECT_ZERO(zsnprintf(path, sizeof(path), "%s/%s", tdir, name));
+	lopt = leveldb_options_create();
+	EXPECT_NOT_EQ(lopt, NULL);
+	ldb = leveldb_open(lopt, path, &err);
+	EXPECT_EQ(err, NULL);
+	lwropt = leveldb_writeoptions_create();
+	EXPECT_NOT_EQ(lwropt, NULL);
+	hkey[0] = 'h';
+	pack_to_be64(hkey + 1, cid);
+	leveldb_put(ldb, lwropt, hkey, sizeof(hkey), (const char*)oids,
+		num_oid * sizeof(uint32_t), &err);
+	EXPECT_EQ(err, NULL);
+	memcpy(vers, "Fish", 4);
+	pack_to_be32(vers + 4, 1);
+	leveldb_put(ldb, lwropt, "v", 1, vers, sizeof(vers), &err);
+	EXPECT_EQ(err, NULL);
+	leveldb_writeoptions_destroy(lwropt);
+	leveldb_close(ldb);
+	leveldb_options_destroy(lopt);
+	return 0;
+}
+
+static int mstoru_test_upgrade(const char *tdir)
+{
+	int i;
+	struct mstor *mstor;
+	struct udata *udata;
+	uint64_t nid;
+	struct chunk_info cinfo;
+	struct chunk_repl crep;
+	const uint32_t oids[] = { 1, 0x203 };
+
+	udata = udata_unit_create_default();
+	EXPECT_NOT_ERRPTR(udata);
+	mstor = mstoru_init_unit(tdir, "upgrade", 1024, udata);
+	EXPECT_NOT_ERRPTR(mstor);
+	EXPECT_ZERO(mstoru_do_creat(mstor, "/u", 0644, 123,
+		RF_SUPERUSER_NAME, &nid));
+	EXPECT_ZERO(mstoru_do_chunkalloc(mstor, nid, 0, &cinfo));
+	mstor_shutdown(mstor);
+	EXPECT_ZERO(mstoru_downgrade_chunk(tdir, "upgrade", cinfo.cid,
+		oids, 2));
+
+	/* Opening the mstor converts the chunk records.  Opening it again
+	 * must leave them alone. */
+	for (i = 0; i < 2; ++i) {
+		mstor = mstoru_init_unit(tdir, "upgrade", 1024, udata);
+		EXPECT_NOT_ERRPTR(mstor);
+		EXPECT_ZERO(mstoru_do_chunk_lookup(mstor, cinfo.cid, &crep));
+		EXPECT_EQ(crep.num_oid, 2);
+		EXPECT_EQ(crep.oid[0], oids[0]);
+		EXPECT_EQ(crep.oid[1], oids[1]);
+		mstor_shutdown(mstor);
+	}
+	udata_free(udata);
+	return 0;
+}
+
 struct mstoru_test2_tinfo {
 	int tid;
 	struct mstor *mstor;
@@ -844,6 +1047,8 @@ int main(POSSIBLY_UNUSED(int argc), char **argv)
 	EXPECT_ZERO(mstoru_test_open_close(tdir));
 	EXPECT_ZERO(mstoru_test1(tdir));
 	EXPECT_ZERO(mstoru_test2(tdir));
+	EXPECT_ZERO(mstoru_test_underrep(tdir));
+	EXPECT_ZERO(mstoru_test_upgrade(tdir));
 
 	EXPECT_ZERO(pthread_key_delete(g_tls_key));
 	process_ctx_shutdown();
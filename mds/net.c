@@ -25,9 +25,11 @@
 #include "mds/heartbeat.h"
 #include "mds/mstor.h"
 #include "mds/net.h"
+#include "mds/rerep.h"
 #include "mds/srange_lock.h"
 #include "mds/user.h"
 #include "msg/bsend.h"
+#include "msg/lpack.h"
 #include "msg/msg.h"
 #include "msg/msgr.h"
 #include "msg/recv_pool.h"
@@ -44,6 +46,7 @@
 #include "util/time.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -55,6 +58,14 @@
 
 #define MDS_NET_REPLICA_TIMEO 60
 
+/** Maximum number of expensive requests, like listdir, that may be waiting in
+ * one recv_pool.  Past this point, clients are told to try again later. */
+#define MDS_NET_MAX_PENDING_BULK 256
+
+/** Maximum number of other requests that may be waiting in one recv_pool.
+ * Heartbeats and status requests are never turned away. */
+#define MDS_NET_MAX_PENDING_NORMAL 4096
+
 /****************************** types ********************************/
 struct mnrp_tls {
 	struct srange_locker lk;
@@ -70,6 +81,9 @@ struct mnrp_tls g_mnrp_tls[RF_ENTITY_TY_NUM];
 /** Thread that sends heartbeats */
 struct redfish_thread g_mds_send_hb_thread;
 
+/** Thread that re-replicates chunks */
+static struct redfish_thread g_mds_rerep_thread;
+
 /** The metadata store */
 struct mstor *g_mstor;
 
@@ -102,7 +116,7 @@ static void handle_primary_role(struct recv_pool_thread *rt, struct msg *m,
 {
 	struct daemon_info *di;
 	struct mtran *tr;
-	int i;
+	int i, mid, ret;
 
 	if (op_ret) {
 		/* If the operation failed, we don't have to tell the replicas
@@ -111,7 +125,8 @@ static void handle_primary_role(struct recv_pool_thread *rt, struct msg *m,
 	}
 
 	/* Since we're the primary, we tell the replicas to perform the
-	 * same operation */ 
+	 * same operation.  They must not turn it away. */ 
+	m->flags |= MSG_FLAG_MUSTDO;
 	msg_addref(m);
 	pthread_mutex_lock(&g_cmap_lock);
 	for (i = 0; i < g_cmap->num_mds; ++i) {
@@ -127,12 +142,22 @@ static void handle_primary_role(struct recv_pool_thread *rt, struct msg *m,
 	bsend_join(rt->ctx);
 	for (i = 0; i < bsend_get_num_sent(rt->ctx); ++i) {
 		tr = bsend_get_mtran(rt->ctx, i);
+		mid = (int)(uintptr_t)bsend_get_mtran_tag(rt->ctx, i);
 		if ((tr->m == NULL) || (IS_ERR(tr->m))) {
-			int mid = (int)(uintptr_t)bsend_get_mtran_tag(rt->ctx, i);
 			glitch_log("fail_replica_mds(%d)\n", mid);
 			fail_replica_mds(mid);
+			continue;
+		}
+		/* Replicas only send a generic response when they couldn't
+		 * apply the operation */
+		if (unpack_from_be16(&tr->m->ty) != mmm_resp_ty)
+			continue;
+		ret = msg_xdr_decode_as_generic(tr->m);
+		if (ret) {
+			glitch_log("fail_replica_mds(%d): replica failed to "
+				"apply operation: error %d\n", mid, ret);
+			fail_replica_mds(mid);
 		}
-		// TOOD: ... check resp ...
 	}
 	bsend_reset(rt->ctx);
 	pthread_mutex_unlock(&g_cmap_lock);
@@ -248,27 +273,27 @@ static int handle_mmm_listdir_req(struct recv_pool_thread *rt,
 		struct mtran *tr, struct msg *m)
 {
 	int i, ret;
-	struct mmm_listdir_req req;
+	struct mmm_listdir_req_view req;
 	struct mmm_listdir_resp resp;
 	struct mreq_listdir mreq;
 	struct mnrp_tls *tls = rt->base.priv;
 	struct rf_lentry *le;
 	struct msg *r;
 
-	ret = MSG_XDR_DECODE(mmm_mkdirs_req, m, &req);
+	ret = MSG_XDR_VIEW(mmm_listdir_req, m, &req);
 	if (ret)
 		goto done;
 	// TODO: implement partial listdir!
 	le = calloc(RF_MAX_FILES_PER_LISTDIR, sizeof(struct rf_lentry)); 
 	if (!le) {
 		ret = -ENOMEM;
-		goto done_free_req;
+		goto done;
 	}
 	memset(&mreq, 0, sizeof(mreq));
 	mreq.base.lk = &tls->lk;
 	mreq.base.op = MSTOR_OP_LISTDIR;
-	mreq.base.full_path = req.path;
-	mreq.base.user_name = req.user;
+	mreq.base.full_path = req.path.buf;
+	mreq.base.user_name = req.user.buf;
 	mreq.le = le;
 	mreq.max_stat = RF_MAX_FILES_PER_LISTDIR;
 	ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
@@ -290,8 +315,45 @@ done_free_le:
 		XDR_REQ_FREE(rf_lentry, &le[i]);
 	}
 	free(le);
-done_free_req:
-	XDR_REQ_FREE(mmm_listdir_req, &req);
+done:
+	return ret;
+}
+
+static int handle_mmm_listdir_compact_req(struct recv_pool_thread *rt,
+		struct mtran *tr, struct msg *m)
+{
+	int ret;
+	struct mmm_listdir_req_view req;
+	struct mreq_listdir mreq;
+	struct lpack_enc enc;
+	struct mnrp_tls *tls = rt->base.priv;
+	struct msg *r;
+
+	ret = MSG_XDR_VIEW(mmm_listdir_req, m, &req);
+	if (ret)
+		goto done;
+	ret = lpack_enc_init(&enc);
+	if (ret)
+		goto done;
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.base.lk = &tls->lk;
+	mreq.base.op = MSTOR_OP_LISTDIR;
+	mreq.base.full_path = req.path.buf;
+	mreq.base.user_name = req.user.buf;
+	mreq.enc = &enc;
+	mreq.max_stat = RF_MAX_FILES_PER_LISTDIR;
+	ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
+	if (ret < 0) {
+		lpack_enc_free(&enc);
+		ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
+		goto done;
+	}
+	r = lpack_enc_finish(&enc);
+	if (IS_ERR(r)) {
+		ret = PTR_ERR(r);
+		goto done;
+	}
+	ret = bsend_reply(rt->base.fb, rt->ctx, tr, r);
 done:
 	return ret;
 }
@@ -300,35 +362,33 @@ static int handle_mmm_path_stat_req(struct recv_pool_thread *rt,
 		struct mtran *tr, struct msg *m)
 {
 	int ret;
-	struct mmm_path_stat_req req;
+	struct mmm_path_stat_req_view req;
 	struct mmm_stat_resp resp;
 	struct mreq_stat mreq;
 	struct mnrp_tls *tls = rt->base.priv;
 	struct msg *r;
 
-	ret = MSG_XDR_DECODE(mmm_path_stat_req, m, &req);
+	ret = MSG_XDR_VIEW(mmm_path_stat_req, m, &req);
 	if (ret)
 		goto done;
 	memset(&mreq, 0, sizeof(mreq));
 	mreq.base.lk = &tls->lk;
 	mreq.base.op = MSTOR_OP_STAT;
-	mreq.base.full_path = req.path;
-	mreq.base.user_name = req.user;
+	mreq.base.full_path = req.path.buf;
+	mreq.base.user_name = req.user.buf;
 	mreq.stat = &resp.stat;
 	ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
 	if (ret < 0) {
 		ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
-		goto done_free_req;
+		goto done;
 	}
 	memset(&resp, 0, sizeof(resp));
 	r = MSG_XDR_ALLOC(mmm_stat_resp, &resp);
 	if (IS_ERR(r)) {
 		ret = PTR_ERR(r);
-		goto done_free_req;
+		goto done;
 	}
 	ret = bsend_reply(rt->base.fb, rt->ctx, tr, r);
-done_free_req:
-	XDR_REQ_FREE(mmm_path_stat_req, &req);
 done:
 	return ret;
 }
@@ -337,13 +397,13 @@ static int handle_mmm_nid_stat_req(struct recv_pool_thread *rt,
 		struct mtran *tr, struct msg *m)
 {
 	int ret;
-	struct mmm_nid_stat_req req;
+	struct mmm_nid_stat_req_view req;
 	struct mmm_stat_resp resp;
 	struct mreq_nid_stat mreq;
 	struct mnrp_tls *tls = rt->base.priv;
 	struct msg *r;
 
-	ret = MSG_XDR_DECODE(mmm_nid_stat_req, m, &req);
+	ret = MSG_XDR_VIEW(mmm_nid_stat_req, m, &req);
 	if (ret)
 		goto done;
 	memset(&mreq, 0, sizeof(mreq));
@@ -354,17 +414,15 @@ static int handle_mmm_nid_stat_req(struct recv_pool_thread *rt,
 	ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
 	if (ret < 0) {
 		ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
-		goto done_free_req;
+		goto done;
 	}
 	memset(&resp, 0, sizeof(resp));
 	r = MSG_XDR_ALLOC(mmm_stat_resp, &resp);
 	if (IS_ERR(r)) {
 		ret = PTR_ERR(r);
-		goto done_free_req;
+		goto done;
 	}
 	ret = bsend_reply(rt->base.fb, rt->ctx, tr, r);
-done_free_req:
-	XDR_REQ_FREE(mmm_nid_stat_req, &req);
 done:
 	return ret;
 }
@@ -516,6 +574,97 @@ done:
 	return ret;
 }
 
+/** Handle a report of corrupt chunks from an OSD
+ *
+ * The OSD doesn't wait for a reply.  The chunks are handed to the
+ * re-replication thread, which replaces the bad replicas with copies of good
+ * ones.
+ */
+static int handle_mmm_osd_corrupt_chunks(
+		POSSIBLY_UNUSED(struct recv_pool_thread *rt),
+		struct mtran *tr, struct msg *m)
+{
+	int i, num_cid;
+	struct mmm_osd_corrupt_chunks req;
+	const uint64_t *cids;
+	int32_t dlen;
+
+	dlen = msg_xdr_extdecode((xdrproc_t)xdr_mmm_osd_corrupt_chunks,
+		m, &req, (const void**)&cids);
+	if (dlen < 0) {
+		mtran_free(tr);
+		return dlen;
+	}
+	num_cid = dlen / sizeof(uint64_t);
+	for (i = 0; i < num_cid; ++i) {
+		glitch_log("mds: osd %d reports that chunk 0x%016" PRIx64
+			" is corrupt\n", req.oid, unpack_from_be64(&cids[i]));
+	}
+	mds_rerep_report_bad(req.oid, cids, num_cid);
+	XDR_REQ_FREE(mmm_osd_corrupt_chunks, &req);
+	mtran_free(tr);
+	return 0;
+}
+
+/** Handle a heartbeat from another daemon.  No response is sent. */
+static int handle_mmm_heartbeat(POSSIBLY_UNUSED(struct recv_pool_thread *rt),
+		struct mtran *tr, struct msg *m)
+{
+	struct mmm_heartbeat hb;
+	int ret;
+
+	ret = MSG_XDR_DECODE(mmm_heartbeat, m, &hb);
+	if (ret < 0) {
+		mtran_free(tr);
+		return ret;
+	}
+	mds_hb_recv(&hb);
+	XDR_REQ_FREE(mmm_heartbeat, &hb);
+	mtran_free(tr);
+	return 0;
+}
+
+static int handle_mmm_rerep_stats_req(struct recv_pool_thread *rt,
+		struct mtran *tr, struct msg *m)
+{
+	struct mmm_rerep_stats_req req;
+	struct mmm_rerep_stats_resp resp;
+	struct msg *r;
+	int ret;
+
+	ret = MSG_XDR_DECODE(mmm_rerep_stats_req, m, &req);
+	if (ret < 0)
+		return bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
+	XDR_REQ_FREE(mmm_rerep_stats_req, &req);
+	mds_rerep_get_stats(&resp);
+	r = MSG_XDR_ALLOC(mmm_rerep_stats_resp, &resp);
+	if (IS_ERR(r))
+		return bsend_std_reply(rt->base.fb, rt->ctx, tr, PTR_ERR(r));
+	return bsend_reply(rt->base.fb, rt->ctx, tr, r);
+}
+
+/** Sort incoming messages into recv_pool priority classes
+ *
+ * Heartbeats and cheap lookups must not get stuck behind a pile of listdir
+ * requests on huge directories.
+ */
+static int mds_net_classify(uint16_t ty)
+{
+	switch (ty) {
+	case mmm_heartbeat_ty:
+	case mmm_status_req_ty:
+	case mmm_path_stat_req_ty:
+	case mmm_nid_stat_req_ty:
+	case mmm_rerep_stats_req_ty:
+		return RECV_POOL_PRIO_HIGH;
+	case mmm_listdir_req_ty:
+	case mmm_listdir_compact_req_ty:
+		return RECV_POOL_PRIO_BULK;
+	default:
+		return RECV_POOL_PRIO_NORMAL;
+	}
+}
+
 static int mds_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 {
 	int ret;
@@ -525,14 +674,13 @@ static int mds_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 
 	m = tr->m;
 	tr->m = NULL;
-	ty = unpack_from_be16(&tr->m->ty);
+	ty = unpack_from_be16(&m->ty);
 	mtran_ep_to_str(tr, ep_buf, sizeof(ep_buf));
 	glitch_log("mds_net_handle_mds_tr: incoming message of type %d "
 		"from %s\n", ty, ep_buf);
 	switch (ty) {
 	case mmm_heartbeat_ty:
-		// FIXME: record this
-		ret = 0;
+		ret = handle_mmm_heartbeat(rt, tr, m);
 		break;
 	case mmm_status_req_ty:
 		ret = handle_mmm_get_mds_status(rt, tr, m);
@@ -558,6 +706,9 @@ static int mds_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 	case mmm_listdir_req_ty:
 		ret = handle_mmm_listdir_req(rt, tr, m);
 		break;
+	case mmm_listdir_compact_req_ty:
+		ret = handle_mmm_listdir_compact_req(rt, tr, m);
+		break;
 	case mmm_path_stat_req_ty:
 		ret = handle_mmm_path_stat_req(rt, tr, m);
 		break;
@@ -579,6 +730,12 @@ static int mds_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 	case mmm_rename_req_ty:
 		ret = handle_mmm_rename_req(rt, tr, m);
 		break;
+	case mmm_osd_corrupt_chunks_ty:
+		ret = handle_mmm_osd_corrupt_chunks(rt, tr, m);
+		break;
+	case mmm_rerep_stats_req_ty:
+		ret = handle_mmm_rerep_stats_req(rt, tr, m);
+		break;
 	default:
 		glitch_log("mds_net_handle_mds_tr: unhandled message "
 			   "type %d\n", ty);
@@ -613,6 +770,20 @@ void mds_net_init(POSSIBLY_UNUSED(struct fast_log_buf *fb),
 		{ 16, 16, 8 };
 	const int recv_pool_ports[RF_ENTITY_TY_NUM] =
 		{ mdsc->mds_port, mdsc->osd_port, mdsc->cli_port };
+	const struct recv_pool_prio_conf prio_conf[RECV_POOL_NUM_PRIO] = {
+		[RECV_POOL_PRIO_HIGH] = {
+			.weight = 8,
+			.max_pending = 0,
+		},
+		[RECV_POOL_PRIO_NORMAL] = {
+			.weight = 4,
+			.max_pending = MDS_NET_MAX_PENDING_NORMAL,
+		},
+		[RECV_POOL_PRIO_BULK] = {
+			.weight = 1,
+			.max_pending = MDS_NET_MAX_PENDING_BULK,
+		},
+	};
 	struct msgr_conf msgr_conf[RF_ENTITY_TY_NUM] = {
 		{
 			.max_conn = 65535,
@@ -634,6 +805,7 @@ void mds_net_init(POSSIBLY_UNUSED(struct fast_log_buf *fb),
 			.tcp_teardown_timeo = 300,
 			.name = "cli_msgr",
 			.fl_mgr = g_fast_log_mgr,
+			.compress_min = MSGR_DEFAULT_COMPRESS_MIN,
 		},
 	};
 
@@ -645,6 +817,12 @@ void mds_net_init(POSSIBLY_UNUSED(struct fast_log_buf *fb),
 			"from configuration: error %s\n", err);
 		abort();
 	}
+	ret = mds_hb_init(g_cmap->num_osd);
+	if (ret) {
+		glitch_log("mds_net_init: mds_hb_init failed with error %d\n",
+			ret);
+		abort();
+	}
 	g_udata = udata_create_default();
 	if (IS_ERR(g_udata))
 		abort();
@@ -672,7 +850,7 @@ void mds_net_init(POSSIBLY_UNUSED(struct fast_log_buf *fb),
 		}
 	}
 	for (i = 0; i < RF_ENTITY_TY_NUM; ++i) {
-		g_rpool[i] = recv_pool_init(recv_pool_names[i]);
+		g_rpool[i] = recv_pool_init(recv_pool_names[i], 0);
 		if (IS_ERR(g_rpool[i])) {
 			ret = PTR_ERR(g_rpool[i]);
 			glitch_log("mds_net_init: failed to create "
@@ -680,6 +858,19 @@ void mds_net_init(POSSIBLY_UNUSED(struct fast_log_buf *fb),
 				ret, terror(ret));
 			abort();
 		}
+		/* Limits are for clients and OSDs.  The other MDSes only send
+		 * us work that we can't refuse. */
+		if (i != RF_ENTITY_TY_MDS) {
+			ret = recv_pool_set_prio(g_rpool[i],
+				mds_net_classify, prio_conf);
+			if (ret) {
+				glitch_log("mds_net_init: failed to set up "
+					"priority classes for %s: error %d "
+					"(%s)\n", recv_pool_names[i], ret,
+					terror(ret));
+				abort();
+			}
+		}
 		for (j = 0; j < recv_pool_nthreads[i]; ++j) {
 			ret = recv_pool_thread_create(g_rpool[i],
 				g_fast_log_mgr, mds_net_handle_tr, &g_mnrp_tls[i]);
@@ -715,6 +906,15 @@ void mds_net_init(POSSIBLY_UNUSED(struct fast_log_buf *fb),
 			"mds_send_hb_thread: error %d\n", ret);
 		abort();
 	}
+	if (mds_rerep_init(mdsc)) {
+		ret = redfish_thread_create(g_fast_log_mgr,
+				&g_mds_rerep_thread, mds_rerep_thread, NULL);
+		if (ret) {
+			glitch_log("mds_net_init: failed to create "
+				"mds_rerep_thread: error %d\n", ret);
+			abort();
+		}
+	}
 }
 
 int mds_main_loop(void)
@@ -0,0 +1,786 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ * 
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/cluster_map.h"
+#include "common/config/mdsc.h"
+#include "core/glitch_log.h"
+#include "mds/const.h"
+#include "mds/heartbeat.h"
+#include "mds/mstor.h"
+#include "mds/rerep.h"
+#include "mds/rplan.h"
+#include "mds/srange_lock.h"
+#include "msg/bsend.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/thread.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern uint16_t g_mid;
+
+extern uint16_t g_pri_mid;
+
+extern pthread_mutex_t g_cmap_lock;
+
+extern struct cmap *g_cmap;
+
+extern struct msgr *g_msgr[];
+
+extern struct mstor *g_mstor;
+
+/** Number of chunks to fetch from the mstor at a time while scanning */
+#define MDS_REREP_SCAN_BATCH 1024
+
+/** Maximum number of under-replicated chunks to keep track of at once.  If
+ * there are more, the rest are picked up by later scans. */
+#define MDS_REREP_MAX_WORK 262144
+
+/** Maximum number of bad replica reports to keep track of */
+#define MDS_REREP_MAX_BAD 4096
+
+/** Seconds to wait for an OSD to finish copying a chunk */
+#define MDS_REREP_COPY_TIMEO 120
+
+/** Seconds to wait for an OSD to read back a replica that it was sent */
+#define MDS_REREP_CSUM_TIMEO 60
+
+/** Seconds to wait for an OSD to unlink a replica that we replaced */
+#define MDS_REREP_UNLINK_TIMEO 10
+
+/** Seconds to wait between rounds when there is nothing we can do, or when
+ * every copy in the last round failed */
+#define MDS_REREP_IDLE_SLEEP 1
+
+/** A replica which an OSD told us was bad */
+struct rerep_bad {
+	/** chunk ID */
+	uint64_t cid;
+	/** OSD holding the bad replica */
+	uint32_t oid;
+};
+
+/** A copy which the source OSD says it has made, but which hasn't been
+ * checked yet */
+struct rerep_copied {
+	/** The copy */
+	struct rplan_copy cp;
+	/** Number of bytes the source OSD sent */
+	uint64_t len;
+	/** CRC32C of the bytes the source OSD sent */
+	uint32_t crc;
+};
+
+/** State belonging to the re-replication thread */
+struct rerep_ctx {
+	/** String range locker.  We only use unlocked operations. */
+	struct srange_locker lk;
+	/** Blocking RPC context */
+	struct bsend *ctx;
+	/** Number of OSDs in the cluster */
+	int num_osd;
+	/** Array indexed by OSD ID: nonzero if the OSD is up */
+	uint8_t *live;
+	/** The value of live in the last round */
+	uint8_t *prev_live;
+	/** Chunks which need new replicas */
+	struct chunk_repl *creps;
+	/** Length of creps */
+	int num_crep;
+	/** Allocated size of creps */
+	int max_crep;
+	/** Copies planned for this round */
+	struct rplan_copy *copies;
+	/** Copies made this round which still have to be checked */
+	struct rerep_copied *copied;
+	/** Replicas to unlink after this round */
+	struct rplan_copy *unlinks;
+	/** Where the planner starts breaking ties */
+	unsigned int rot;
+	/** Time of the next scan */
+	time_t next_scan;
+};
+
+/** Protects everything below */
+static pthread_mutex_t g_rerep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Re-replication statistics */
+static struct mmm_rerep_stats_resp g_rerep_stats;
+
+/** Bad replicas that haven't been replaced yet */
+static struct rerep_bad g_rerep_bad[MDS_REREP_MAX_BAD];
+
+/** Number of entries in g_rerep_bad */
+static int g_num_rerep_bad;
+
+/** Nonzero if there are reports in g_rerep_bad which the re-replication
+ * thread hasn't looked at yet */
+static int g_rerep_bad_new;
+
+/** Maximum number of copies per round; read-only after init */
+static int g_rerep_max_copies;
+
+/** Maximum number of copies per OSD per round; read-only after init */
+static int g_rerep_max_per_osd;
+
+/** Seconds between scans; read-only after init */
+static int g_rerep_ival;
+
+int mds_rerep_init(const struct mdsc *mdsc)
+{
+	g_rerep_max_copies = mdsc->rerep_max_copies;
+	g_rerep_max_per_osd = mdsc->rerep_max_per_osd;
+	g_rerep_ival = mdsc->rerep_ival;
+	return (g_rerep_max_copies > 0);
+}
+
+void mds_rerep_report_bad(uint32_t oid, const uint64_t *cids, int num_cid)
+{
+	int i, j;
+	uint64_t cid;
+
+	pthread_mutex_lock(&g_rerep_lock);
+	for (i = 0; i < num_cid; ++i) {
+		cid = unpack_from_be64(&cids[i]);
+		for (j = 0; j < g_num_rerep_bad; ++j) {
+			if ((g_rerep_bad[j].cid == cid) &&
+					(g_rerep_bad[j].oid == oid))
+				break;
+		}
+		if (j < g_num_rerep_bad)
+			continue;
+		if (g_num_rerep_bad == MDS_REREP_MAX_BAD) {
+			glitch_log("mds_rerep_report_bad: too many bad "
+				"replicas.  Forgetting that chunk 0x%016"
+				PRIx64 " is bad on OSD %" PRIu32 "\n",
+				cid, oid);
+			continue;
+		}
+		g_rerep_bad[g_num_rerep_bad].cid = cid;
+		g_rerep_bad[g_num_rerep_bad].oid = oid;
+		++g_num_rerep_bad;
+		g_rerep_bad_new = 1;
+	}
+	pthread_mutex_unlock(&g_rerep_lock);
+}
+
+void mds_rerep_get_stats(struct mmm_rerep_stats_resp *resp)
+{
+	pthread_mutex_lock(&g_rerep_lock);
+	memcpy(resp, &g_rerep_stats, sizeof(*resp));
+	pthread_mutex_unlock(&g_rerep_lock);
+}
+
+/** Forget a bad replica report.  The caller must hold g_rerep_lock.
+ *
+ * @param i		Index of the report in g_rerep_bad
+ */
+static void rerep_bad_remove(int i)
+{
+	g_rerep_bad[i] = g_rerep_bad[--g_num_rerep_bad];
+}
+
+static int compare_crep_cid(const void *a, const void *b)
+{
+	const struct chunk_repl *ca = a;
+	const struct chunk_repl *cb = b;
+
+	if (ca->cid < cb->cid)
+		return -1;
+	if (ca->cid > cb->cid)
+		return 1;
+	return 0;
+}
+
+/** Make room for one more chunk in the work list
+ *
+ * @param rc		The re-replication context
+ *
+ * @return		0 on success; -ENOSPC if the work list is as big as it
+ *			may get; -ENOMEM if we ran out of memory
+ */
+static int rerep_work_grow(struct rerep_ctx *rc)
+{
+	struct chunk_repl *creps;
+	int max_crep;
+
+	if (rc->num_crep < rc->max_crep)
+		return 0;
+	if (rc->max_crep >= MDS_REREP_MAX_WORK)
+		return -ENOSPC;
+	max_crep = rc->max_crep ? (rc->max_crep * 2) : MDS_REREP_SCAN_BATCH;
+	if (max_crep > MDS_REREP_MAX_WORK)
+		max_crep = MDS_REREP_MAX_WORK;
+	creps = realloc(rc->creps, max_crep * sizeof(struct chunk_repl));
+	if (!creps)
+		return -ENOMEM;
+	rc->creps = creps;
+	rc->max_crep = max_crep;
+	return 0;
+}
+
+/** Find a chunk in the work list
+ *
+ * @param rc		The re-replication context
+ * @param cid		The chunk ID
+ *
+ * @return		The chunk, or NULL if it isn't in the list
+ */
+static struct chunk_repl *rerep_work_find(struct rerep_ctx *rc, uint64_t cid)
+{
+	int i;
+
+	for (i = 0; i < rc->num_crep; ++i) {
+		if (rc->creps[i].cid == cid)
+			return &rc->creps[i];
+	}
+	return NULL;
+}
+
+/** Rebuild the work list from the chunk table
+ *
+ * @param rc		The re-replication context
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int rerep_scan(struct rerep_ctx *rc)
+{
+	struct mreq_find_underrep mreq;
+	uint64_t start = 0;
+	int ret;
+
+	rc->num_crep = 0;
+	do {
+		ret = rerep_work_grow(rc);
+		if (ret == -ENOSPC) {
+			glitch_log("rerep_scan: more than %d chunks need "
+				"new replicas.  Handling the first %d this "
+				"time around.\n", MDS_REREP_MAX_WORK,
+				MDS_REREP_MAX_WORK);
+			break;
+		}
+		else if (ret)
+			return ret;
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.base.lk = &rc->lk;
+		mreq.base.op = MSTOR_OP_FIND_UNDERREP;
+		mreq.start = start;
+		mreq.live = rc->live;
+		mreq.num_osd = rc->num_osd;
+		mreq.max_res = rc->max_crep - rc->num_crep;
+		if (mreq.max_res > MDS_REREP_SCAN_BATCH)
+			mreq.max_res = MDS_REREP_SCAN_BATCH;
+		mreq.creps = rc->creps + rc->num_crep;
+		ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
+		if (ret < 0)
+			return ret;
+		rc->num_crep += mreq.num_res;
+		start = mreq.next;
+	} while (start != RF_INVAL_CID);
+	return 0;
+}
+
+/** Mark the replicas that OSDs have told us are bad in the work list,
+ * adding chunks to it if necessary.  Reports about replicas which no longer
+ * exist are dropped.
+ *
+ * @param rc		The re-replication context
+ */
+static void rerep_merge_bad(struct rerep_ctx *rc)
+{
+	struct mreq_chunk_lookup mreq;
+	struct chunk_repl *crep;
+	struct rerep_bad *b;
+	int i, j, ret, num_sorted;
+
+	/* The work list is usually far longer than the list of bad replicas,
+	 * so sort it once rather than searching it over and over. */
+	qsort(rc->creps, rc->num_crep, sizeof(struct chunk_repl),
+		compare_crep_cid);
+	num_sorted = rc->num_crep;
+	pthread_mutex_lock(&g_rerep_lock);
+	g_rerep_bad_new = 0;
+	i = 0;
+	while (i < g_num_rerep_bad) {
+		b = &g_rerep_bad[i];
+		crep = NULL;
+		if (num_sorted > 0) {
+			struct chunk_repl key;
+
+			key.cid = b->cid;
+			crep = bsearch(&key, rc->creps, num_sorted,
+				sizeof(struct chunk_repl), compare_crep_cid);
+		}
+		for (j = num_sorted; (!crep) && (j < rc->num_crep); ++j) {
+			if (rc->creps[j].cid == b->cid)
+				crep = &rc->creps[j];
+		}
+		if (!crep) {
+			if (rerep_work_grow(rc)) {
+				/* Try again after the next scan */
+				++i;
+				continue;
+			}
+			crep = &rc->creps[rc->num_crep];
+			memset(&mreq, 0, sizeof(mreq));
+			mreq.base.lk = &rc->lk;
+			mreq.base.op = MSTOR_OP_CHUNK_LOOKUP;
+			mreq.cid = b->cid;
+			mreq.crep = crep;
+			ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
+			if (ret == -ENOENT) {
+				/* The chunk has been deleted */
+				rerep_bad_remove(i);
+				continue;
+			}
+			else if (ret) {
+				glitch_log("rerep_merge_bad: error %d looking "
+					"up chunk 0x%016" PRIx64 "\n",
+					ret, b->cid);
+				++i;
+				continue;
+			}
+			++rc->num_crep;
+		}
+		for (j = 0; j < crep->num_oid; ++j) {
+			if (crep->oid[j] == b->oid)
+				break;
+		}
+		if (j == crep->num_oid) {
+			/* The bad replica has already been replaced */
+			rerep_bad_remove(i);
+			continue;
+		}
+		crep->bad |= (1 << j);
+		++i;
+	}
+	pthread_mutex_unlock(&g_rerep_lock);
+}
+
+/** Drop the chunks that are fully replicated from the work list, put the
+ * rest in the order that they should be fixed in, and update the statistics
+ *
+ * @param rc		The re-replication context
+ * @param num_down	Number of OSDs that are down
+ */
+static void rerep_work_update(struct rerep_ctx *rc, int num_down)
+{
+	int i, j;
+	uint64_t one_left = 0, lost = 0;
+
+	rplan_sort(rc->creps, rc->num_crep, rc->live, rc->num_osd);
+	for (i = 0, j = 0; i < rc->num_crep; ++i) {
+		if (rc->creps[i].num_live >= rc->creps[i].num_oid)
+			continue;
+		if (rc->creps[i].num_live == 0)
+			++lost;
+		else if (rc->creps[i].num_live == 1)
+			++one_left;
+		if (i != j)
+			rc->creps[j] = rc->creps[i];
+		++j;
+	}
+	rc->num_crep = j;
+	pthread_mutex_lock(&g_rerep_lock);
+	g_rerep_stats.active = 1;
+	g_rerep_stats.osds_down = num_down;
+	g_rerep_stats.under_rep = rc->num_crep;
+	g_rerep_stats.one_left = one_left;
+	g_rerep_stats.lost = lost;
+	pthread_mutex_unlock(&g_rerep_lock);
+}
+
+/** Record that a chunk has been copied
+ *
+ * @param rc		The re-replication context
+ * @param cp		The copy that was made
+ * @param len		Number of bytes copied
+ *
+ * @return		1 if the replica that was replaced should be
+ *			unlinked; 0 otherwise
+ */
+static int rerep_copy_done(struct rerep_ctx *rc,
+		const struct rplan_copy *cp, uint64_t len)
+{
+	struct mreq_chunk_move mreq;
+	struct chunk_repl *crep;
+	int i, ret;
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.base.lk = &rc->lk;
+	mreq.base.op = MSTOR_OP_CHUNK_MOVE;
+	mreq.cid = cp->cid;
+	mreq.src = cp->old;
+	mreq.dst = cp->dst;
+	ret = mstor_do_operation(g_mstor, (struct mreq*)&mreq);
+	if (ret) {
+		glitch_log("rerep_copy_done: error %d recording that chunk "
+			"0x%016" PRIx64 " was copied to OSD %" PRIu32 "\n",
+			ret, cp->cid, cp->dst);
+		pthread_mutex_lock(&g_rerep_lock);
+		++g_rerep_stats.copies_failed;
+		pthread_mutex_unlock(&g_rerep_lock);
+		return 0;
+	}
+	crep = rerep_work_find(rc, cp->cid);
+	if (crep) {
+		for (i = 0; i < crep->num_oid; ++i) {
+			if (crep->oid[i] == cp->old) {
+				crep->oid[i] = cp->dst;
+				crep->bad &= ~(1 << i);
+				break;
+			}
+		}
+	}
+	pthread_mutex_lock(&g_rerep_lock);
+	++g_rerep_stats.copies_done;
+	g_rerep_stats.bytes_copied += len;
+	for (i = 0; i < g_num_rerep_bad; ++i) {
+		if ((g_rerep_bad[i].cid == cp->cid) &&
+				(g_rerep_bad[i].oid == cp->old)) {
+			rerep_bad_remove(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_rerep_lock);
+	/* A replica on an OSD that is up must have been bad.  Get rid of it.
+	 * Replicas on OSDs that are down can't be reached now. */
+	return ((cp->old < (uint32_t)rc->num_osd) && rc->live[cp->old]);
+}
+
+/** Unlink the replicas that we have replaced.  This is best-effort.
+ *
+ * @param rc		The re-replication context
+ * @param num_unlink	Number of entries in rc->unlinks
+ */
+static void rerep_send_unlinks(struct rerep_ctx *rc, int num_unlink)
+{
+	struct mmm_osd_unlink_req req;
+	struct daemon_info *oinfo;
+	struct msg *m;
+	int i, ret;
+
+	pthread_mutex_lock(&g_cmap_lock);
+	for (i = 0; i < num_unlink; ++i) {
+		req.cid = rc->unlinks[i].cid;
+		m = MSG_XDR_ALLOC(mmm_osd_unlink_req, &req);
+		if (IS_ERR(m))
+			continue;
+		oinfo = &g_cmap->oinfo[rc->unlinks[i].old];
+		ret = bsend_add(rc->ctx, g_msgr[RF_ENTITY_TY_OSD], BSF_RESP,
+			m, oinfo->ip, oinfo->port[RF_ENTITY_TY_MDS],
+			MDS_REREP_UNLINK_TIMEO, NULL);
+		if (ret)
+			msg_release(m);
+	}
+	pthread_mutex_unlock(&g_cmap_lock);
+	bsend_join(rc->ctx);
+	bsend_reset(rc->ctx);
+}
+
+/** Check the new replicas made this round against what their sources sent,
+ * and record the ones that match.
+ *
+ * A copy is only recorded in the chunk table, and the replica it replaces only
+ * unlinked, once the destination OSD has read the new replica back and found
+ * the same length and CRC that the source OSD computed from the original.
+ * New replicas that don't match are unlinked instead.
+ *
+ * @param rc		The re-replication context
+ * @param num_copied	Number of entries in rc->copied
+ * @param num_unlink	(in-out param) Number of entries in rc->unlinks
+ *
+ * @return		The number of copies that were good
+ */
+static int rerep_verify_copies(struct rerep_ctx *rc, int num_copied,
+		int *num_unlink)
+{
+	struct mmm_osd_chunk_csum_req req;
+	struct mmm_osd_chunk_csum_resp resp;
+	struct rerep_copied *cd;
+	struct rplan_copy bad;
+	struct daemon_info *oinfo;
+	struct mtran *tr;
+	struct msg *m;
+	int i, ret, num_sent, good, succ = 0;
+
+	pthread_mutex_lock(&g_cmap_lock);
+	for (i = 0; i < num_copied; ++i) {
+		cd = &rc->copied[i];
+		req.cid = cd->cp.cid;
+		m = MSG_XDR_ALLOC(mmm_osd_chunk_csum_req, &req);
+		if (IS_ERR(m))
+			continue;
+		oinfo = &g_cmap->oinfo[cd->cp.dst];
+		ret = bsend_add(rc->ctx, g_msgr[RF_ENTITY_TY_OSD], BSF_RESP,
+			m, oinfo->ip, oinfo->port[RF_ENTITY_TY_MDS],
+			MDS_REREP_CSUM_TIMEO, (void*)(uintptr_t)i);
+		if (ret)
+			msg_release(m);
+	}
+	pthread_mutex_unlock(&g_cmap_lock);
+	num_sent = bsend_join(rc->ctx);
+	for (i = 0; i < num_sent; ++i) {
+		tr = bsend_get_mtran(rc->ctx, i);
+		cd = &rc->copied[(uintptr_t)bsend_get_mtran_tag(rc->ctx, i)];
+		if (IS_ERR(tr->m)) {
+			glitch_log("rerep_verify_copies: error %d checking "
+				"the copy of chunk 0x%016" PRIx64 " on OSD %"
+				PRIu32 "\n", (int)PTR_ERR(tr->m), cd->cp.cid,
+				cd->cp.dst);
+			continue;
+		}
+		if (MSG_XDR_DECODE(mmm_osd_chunk_csum_resp, tr->m,
+				&resp) < 0) {
+			ret = msg_xdr_decode_as_generic(tr->m);
+			glitch_log("rerep_verify_copies: OSD %" PRIu32
+				" failed to read back its copy of chunk 0x%016"
+				PRIx64 ": error %d\n", cd->cp.dst, cd->cp.cid,
+				ret);
+			good = 0;
+		}
+		else {
+			good = ((resp.len == cd->len) &&
+				(resp.crc == cd->crc));
+			if (!good) {
+				glitch_log("rerep_verify_copies: the copy of "
+					"chunk 0x%016" PRIx64 " on OSD %"
+					PRIu32 " doesn't match the original "
+					"on OSD %" PRIu32 "\n", cd->cp.cid,
+					cd->cp.dst, cd->cp.src);
+			}
+			XDR_REQ_FREE(mmm_osd_chunk_csum_resp, &resp);
+		}
+		if (!good) {
+			/* Get rid of the bad copy.  The chunk table never
+			 * heard of it. */
+			bad = cd->cp;
+			bad.old = bad.dst;
+			rc->unlinks[(*num_unlink)++] = bad;
+			continue;
+		}
+		if (rerep_copy_done(rc, &cd->cp, cd->len))
+			rc->unlinks[(*num_unlink)++] = cd->cp;
+		++succ;
+	}
+	bsend_reset(rc->ctx);
+	return succ;
+}
+
+/** Have the OSDs make a round of copies
+ *
+ * @param rc		The re-replication context
+ * @param num_copy	Number of entries in rc->copies
+ *
+ * @return		The number of copies that succeeded
+ */
+static int rerep_do_copies(struct rerep_ctx *rc, int num_copy)
+{
+	struct mmm_osd_chunk_copy_req req;
+	struct mmm_osd_chunk_copy_resp resp;
+	struct rplan_copy *cp;
+	struct daemon_info *oinfo;
+	struct mtran *tr;
+	struct msg *m;
+	int i, ret, num_sent, succ, failed = 0, num_copied = 0;
+	int num_unlink = 0;
+
+	pthread_mutex_lock(&g_cmap_lock);
+	for (i = 0; i < num_copy; ++i) {
+		cp = &rc->copies[i];
+		req.cid = cp->cid;
+		req.dst = cp->dst;
+		m = MSG_XDR_ALLOC(mmm_osd_chunk_copy_req, &req);
+		if (IS_ERR(m)) {
+			++failed;
+			continue;
+		}
+		oinfo = &g_cmap->oinfo[cp->src];
+		ret = bsend_add(rc->ctx, g_msgr[RF_ENTITY_TY_OSD], BSF_RESP,
+			m, oinfo->ip, oinfo->port[RF_ENTITY_TY_MDS],
+			MDS_REREP_COPY_TIMEO, (void*)(uintptr_t)i);
+		if (ret) {
+			msg_release(m);
+			++failed;
+		}
+	}
+	pthread_mutex_unlock(&g_cmap_lock);
+	pthread_mutex_lock(&g_rerep_lock);
+	g_rerep_stats.in_flight = num_copy - failed;
+	pthread_mutex_unlock(&g_rerep_lock);
+
+	num_sent = bsend_join(rc->ctx);
+	for (i = 0; i < num_sent; ++i) {
+		tr = bsend_get_mtran(rc->ctx, i);
+		cp = &rc->copies[(uintptr_t)bsend_get_mtran_tag(rc->ctx, i)];
+		if (IS_ERR(tr->m)) {
+			ret = PTR_ERR(tr->m);
+			glitch_log("rerep_do_copies: error %d sending copy of "
+				"chunk 0x%016" PRIx64 " to OSD %" PRIu32 "\n",
+				ret, cp->cid, cp->src);
+			++failed;
+			continue;
+		}
+		if (MSG_XDR_DECODE(mmm_osd_chunk_copy_resp, tr->m,
+				&resp) < 0) {
+			ret = msg_xdr_decode_as_generic(tr->m);
+			glitch_log("rerep_do_copies: OSD %" PRIu32 " failed "
+				"to copy chunk 0x%016" PRIx64 " to OSD %"
+				PRIu32 ": error %d\n", cp->src, cp->cid,
+				cp->dst, ret);
+			++failed;
+			continue;
+		}
+		rc->copied[num_copied].cp = *cp;
+		rc->copied[num_copied].len = resp.len;
+		rc->copied[num_copied].crc = resp.crc;
+		++num_copied;
+		XDR_REQ_FREE(mmm_osd_chunk_copy_resp, &resp);
+	}
+	bsend_reset(rc->ctx);
+	succ = rerep_verify_copies(rc, num_copied, &num_unlink);
+	failed += num_copied - succ;
+	pthread_mutex_lock(&g_rerep_lock);
+	g_rerep_stats.in_flight = 0;
+	g_rerep_stats.copies_failed += failed;
+	pthread_mutex_unlock(&g_rerep_lock);
+	if (num_unlink > 0)
+		rerep_send_unlinks(rc, num_unlink);
+	return succ;
+}
+
+/** Initialize the re-replication thread's state
+ *
+ * @param rc		The re-replication context
+ * @param rt		The Redfish thread object
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int rerep_ctx_init(struct rerep_ctx *rc, struct redfish_thread *rt)
+{
+	memset(rc, 0, sizeof(*rc));
+	pthread_mutex_lock(&g_cmap_lock);
+	rc->num_osd = g_cmap->num_osd;
+	pthread_mutex_unlock(&g_cmap_lock);
+	rc->live = calloc(rc->num_osd, sizeof(uint8_t));
+	if (!rc->live)
+		return -ENOMEM;
+	rc->prev_live = calloc(rc->num_osd, sizeof(uint8_t));
+	if (!rc->prev_live)
+		return -ENOMEM;
+	rc->copies = calloc(g_rerep_max_copies, sizeof(struct rplan_copy));
+	if (!rc->copies)
+		return -ENOMEM;
+	rc->copied = calloc(g_rerep_max_copies, sizeof(struct rerep_copied));
+	if (!rc->copied)
+		return -ENOMEM;
+	rc->unlinks = calloc(g_rerep_max_copies, sizeof(struct rplan_copy));
+	if (!rc->unlinks)
+		return -ENOMEM;
+	rc->ctx = bsend_init(rt->fb, g_rerep_max_copies);
+	if (IS_ERR(rc->ctx))
+		return PTR_ERR(rc->ctx);
+	return 0;
+}
+
+int mds_rerep_thread(struct redfish_thread *rt)
+{
+	struct rerep_ctx rc;
+	int ret, num_down, num_copy, bad_new;
+	time_t now;
+
+	ret = rerep_ctx_init(&rc, rt);
+	if (ret) {
+		glitch_log("mds_rerep_thread: failed to initialize: "
+			"error %d\n", ret);
+		abort();
+	}
+	while (1) {
+		if (g_mid != g_pri_mid) {
+			/* Only the primary re-replicates */
+			pthread_mutex_lock(&g_rerep_lock);
+			g_rerep_stats.active = 0;
+			pthread_mutex_unlock(&g_rerep_lock);
+			rc.num_crep = 0;
+			rc.next_scan = 0;
+			mt_sleep_until(mt_time() + g_rerep_ival);
+			continue;
+		}
+		now = mt_time();
+		pthread_mutex_lock(&g_cmap_lock);
+		num_down = mds_hb_get_live(rc.live, rc.num_osd, now);
+		pthread_mutex_unlock(&g_cmap_lock);
+		/* When an OSD goes down or comes back up, we want to know
+		 * about it right away rather than at the next scheduled scan.
+		 */
+		if (memcmp(rc.live, rc.prev_live, rc.num_osd))
+			rc.next_scan = now;
+		memcpy(rc.prev_live, rc.live, rc.num_osd);
+		pthread_mutex_lock(&g_rerep_lock);
+		bad_new = g_rerep_bad_new;
+		pthread_mutex_unlock(&g_rerep_lock);
+		if (now >= rc.next_scan) {
+			ret = rerep_scan(&rc);
+			if (ret) {
+				glitch_log("mds_rerep_thread: error %d "
+					"scanning for under-replicated "
+					"chunks\n", ret);
+			}
+			rc.next_scan = now + g_rerep_ival;
+			pthread_mutex_lock(&g_rerep_lock);
+			++g_rerep_stats.scans;
+			g_rerep_stats.last_scan = now;
+			pthread_mutex_unlock(&g_rerep_lock);
+			rerep_merge_bad(&rc);
+		}
+		else if (bad_new) {
+			rerep_merge_bad(&rc);
+		}
+		rerep_work_update(&rc, num_down);
+		num_copy = rplan_plan(rc.creps, rc.num_crep, rc.live,
+			rc.num_osd, g_rerep_max_per_osd, &rc.rot, rc.copies,
+			g_rerep_max_copies);
+		if (num_copy < 0) {
+			glitch_log("mds_rerep_thread: error %d planning "
+				"copies\n", num_copy);
+			mt_sleep_until(now + MDS_REREP_IDLE_SLEEP);
+			continue;
+		}
+		if (num_copy == 0) {
+			mt_sleep_until(now + MDS_REREP_IDLE_SLEEP);
+			continue;
+		}
+		if (rerep_do_copies(&rc, num_copy) == 0) {
+			/* Don't hammer OSDs that aren't cooperating */
+			mt_sleep_until(mt_time() + MDS_REREP_IDLE_SLEEP);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ * 
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_MDS_REREP_DOT_H
+#define REDFISH_MDS_REREP_DOT_H
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+/*
+ * Chunk re-replication.
+ *
+ * The primary MDS periodically scans the chunk table for chunks whose
+ * replicas are on OSDs that are down, or that an OSD has reported as corrupt.
+ * It then has the surviving OSDs copy those chunks to other OSDs, a few at a
+ * time, so that recovery doesn't swamp the cluster.
+ */
+
+struct mdsc;
+struct mmm_rerep_stats_resp;
+struct redfish_thread;
+
+/** Configure re-replication
+ *
+ * @param mdsc		The MDS configuration
+ *
+ * @return		1 if the re-replication thread should be started; 0
+ *			if re-replication is turned off
+ */
+extern int mds_rerep_init(const struct mdsc *mdsc);
+
+/** Note that some replicas are bad, so that they get replaced
+ *
+ * @param oid		The OSD holding the bad replicas
+ * @param cids		Big-endian chunk IDs
+ * @param num_cid	Length of cids
+ */
+extern void mds_rerep_report_bad(uint32_t oid, const uint64_t *cids,
+		int num_cid);
+
+/** Get re-replication statistics
+ *
+ * @param resp		(out param) the statistics
+ */
+extern void mds_rerep_get_stats(struct mmm_rerep_stats_resp *resp);
+
+/** Runs the re-replication thread
+ *
+ * @param rt		The Redfish thread object
+ *
+ * @return		(never returns)
+ */
+extern int mds_rerep_thread(struct redfish_thread *rt);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ * 
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mds/mstor.h"
+#include "mds/rplan.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+int rplan_slot_live(const struct chunk_repl *crep, int i,
+		const uint8_t *live, int num_osd)
+{
+	uint32_t oid = crep->oid[i];
+
+	if (crep->bad & (1 << i))
+		return 0;
+	return (oid < (uint32_t)num_osd) && live[oid];
+}
+
+static int compare_chunk_repl(const void *a, const void *b)
+{
+	const struct chunk_repl *ca = a;
+	const struct chunk_repl *cb = b;
+
+	if (ca->num_live != cb->num_live)
+		return (ca->num_live < cb->num_live) ? -1 : 1;
+	if (ca->cid != cb->cid)
+		return (ca->cid < cb->cid) ? -1 : 1;
+	return 0;
+}
+
+void rplan_sort(struct chunk_repl *creps, int num_crep,
+		const uint8_t *live, int num_osd)
+{
+	int i, j;
+
+	for (i = 0; i < num_crep; ++i) {
+		creps[i].num_live = 0;
+		for (j = 0; j < creps[i].num_oid; ++j) {
+			if (rplan_slot_live(&creps[i], j, live, num_osd))
+				++creps[i].num_live;
+		}
+	}
+	qsort(creps, num_crep, sizeof(struct chunk_repl), compare_chunk_repl);
+}
+
+static int rplan_has_oid(const struct chunk_repl *crep, uint32_t oid)
+{
+	int i;
+
+	for (i = 0; i < crep->num_oid; ++i) {
+		if (crep->oid[i] == oid)
+			return 1;
+	}
+	return 0;
+}
+
+/** Plan one copy of a chunk
+ *
+ * @return		1 if a copy was planned; 0 if there was nothing we
+ *			could do for this chunk
+ */
+static int rplan_plan_chunk(const struct chunk_repl *crep,
+		const uint8_t *live, int num_osd, int max_per_osd,
+		unsigned int rot, int *load, struct rplan_copy *copy)
+{
+	int i, j, old = -1, src = -1, dst = -1;
+	uint32_t oid;
+
+	for (j = 0; j < crep->num_oid; ++j) {
+		i = (j + rot) % crep->num_oid;
+		if (!rplan_slot_live(crep, i, live, num_osd)) {
+			if (old < 0)
+				old = i;
+			continue;
+		}
+		oid = crep->oid[i];
+		if (load[oid] >= max_per_osd)
+			continue;
+		if ((src < 0) || (load[oid] < load[crep->oid[src]]))
+			src = i;
+	}
+	if ((old < 0) || (src < 0))
+		return 0;
+	for (j = 0; j < num_osd; ++j) {
+		oid = (j + rot) % num_osd;
+		if ((!live[oid]) || (load[oid] >= max_per_osd))
+			continue;
+		if (rplan_has_oid(crep, oid))
+			continue;
+		if ((dst < 0) || (load[oid] < load[dst]))
+			dst = oid;
+	}
+	if (dst < 0)
+		return 0;
+	copy->cid = crep->cid;
+	copy->src = crep->oid[src];
+	copy->dst = dst;
+	copy->old = crep->oid[old];
+	++load[copy->src];
+	++load[copy->dst];
+	return 1;
+}
+
+int rplan_plan(const struct chunk_repl *creps, int num_crep,
+		const uint8_t *live, int num_osd, int max_per_osd,
+		unsigned int *rot, struct rplan_copy *copies, int max_copies)
+{
+	int i, num_copies;
+	int *load;
+
+	if (num_osd <= 0)
+		return 0;
+	load = calloc(num_osd, sizeof(int));
+	if (!load)
+		return -ENOMEM;
+	num_copies = 0;
+	for (i = 0; i < num_crep; ++i) {
+		if (num_copies == max_copies)
+			break;
+		if (creps[i].num_live == 0)
+			continue;
+		if (rplan_plan_chunk(&creps[i], live, num_osd, max_per_osd,
+				*rot, load, &copies[num_copies])) {
+			++num_copies;
+			++*rot;
+		}
+	}
+	free(load);
+	return num_copies;
+}
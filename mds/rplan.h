@@ -0,0 +1,94 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ * 
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_MDS_RPLAN_DOT_H
+#define REDFISH_MDS_RPLAN_DOT_H
+
+#include <stdint.h> /* for uint64_t, etc. */
+
+/*
+ * The re-replication planner.
+ *
+ * Given the chunks which have lost replicas, and which OSDs are up, this
+ * decides which copies to make next.  It doesn't do any I/O itself.
+ */
+
+struct chunk_repl;
+
+/** A copy that the planner wants made */
+struct rplan_copy {
+	/** chunk ID */
+	uint64_t cid;
+	/** OSD to copy from */
+	uint32_t src;
+	/** OSD to copy to */
+	uint32_t dst;
+	/** OSD whose replica the new copy replaces */
+	uint32_t old;
+};
+
+/** Determine whether a replica of a chunk is usable
+ *
+ * @param crep		The chunk
+ * @param i		Index of the replica in crep->oid
+ * @param live		Array indexed by OSD ID: nonzero if the OSD is up
+ * @param num_osd	Length of live
+ *
+ * @return		1 if the replica's OSD is up and the replica isn't
+ *			known to be bad; 0 otherwise
+ */
+extern int rplan_slot_live(const struct chunk_repl *crep, int i,
+		const uint8_t *live, int num_osd);
+
+/** Count the live replicas of some chunks, and sort them so that the chunks
+ * with the fewest live replicas come first.
+ *
+ * @param creps		The chunks.  num_live is updated.
+ * @param num_crep	Number of chunks
+ * @param live		Array indexed by OSD ID: nonzero if the OSD is up
+ * @param num_osd	Length of live
+ */
+extern void rplan_sort(struct chunk_repl *creps, int num_crep,
+		const uint8_t *live, int num_osd);
+
+/** Plan a round of copies
+ *
+ * Chunks are taken in order, so call rplan_sort first.  Each chunk gets at
+ * most one copy per round.  No OSD sends or receives more than max_per_osd
+ * copies in a round.  Among the OSDs that could do a copy, the one with the
+ * least to do so far is picked, and ties are broken in a different order for
+ * each chunk, so that the copies are spread out over the cluster.
+ *
+ * Chunks with no live replicas can't be copied, and are skipped.
+ *
+ * @param creps		The chunks
+ * @param num_crep	Number of chunks
+ * @param live		Array indexed by OSD ID: nonzero if the OSD is up
+ * @param num_osd	Length of live
+ * @param max_per_osd	Maximum number of copies that one OSD may be part of
+ * @param rot		(inout) where to start breaking ties
+ * @param copies	(out param) the copies to make
+ * @param max_copies	Maximum number of copies to plan
+ *
+ * @return		The number of copies planned, or a negative error code
+ */
+extern int rplan_plan(const struct chunk_repl *creps, int num_crep,
+		const uint8_t *live, int num_osd, int max_per_osd,
+		unsigned int *rot, struct rplan_copy *copies, int max_copies);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ * 
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/process_ctx.h"
+#include "mds/mstor.h"
+#include "mds/rplan.h"
+#include "util/compiler.h"
+#include "util/test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RPLAN_UNIT_NUM_OSD 4
+#define RPLAN_UNIT_MAX_COPIES 16
+
+static void rplan_unit_set(struct chunk_repl *crep, uint64_t cid,
+		int num_oid, uint32_t a, uint32_t b, uint32_t c)
+{
+	memset(crep, 0, sizeof(struct chunk_repl));
+	crep->cid = cid;
+	crep->num_oid = num_oid;
+	crep->oid[0] = a;
+	crep->oid[1] = b;
+	crep->oid[2] = c;
+}
+
+static int test_rplan_sort(void)
+{
+	struct chunk_repl creps[3];
+	const uint8_t live[RPLAN_UNIT_NUM_OSD] = { 1, 1, 1, 0 };
+
+	rplan_unit_set(&creps[0], 100, 3, 0, 1, 3);
+	rplan_unit_set(&creps[1], 101, 2, 2, 3, 0);
+	rplan_unit_set(&creps[2], 102, 2, 3, 7, 0);
+	rplan_sort(creps, 3, live, RPLAN_UNIT_NUM_OSD);
+	EXPECT_EQ(creps[0].cid, 102);
+	EXPECT_EQ(creps[0].num_live, 0);
+	EXPECT_EQ(creps[1].cid, 101);
+	EXPECT_EQ(creps[1].num_live, 1);
+	EXPECT_EQ(creps[2].cid, 100);
+	EXPECT_EQ(creps[2].num_live, 2);
+	return 0;
+}
+
+static int test_rplan_plan(void)
+{
+	int i, num;
+	unsigned int rot = 0;
+	struct chunk_repl creps[3];
+	struct rplan_copy copies[RPLAN_UNIT_MAX_COPIES];
+	const uint8_t live[RPLAN_UNIT_NUM_OSD] = { 1, 1, 1, 0 };
+
+	/* The lost chunk is skipped, and the chunk with one replica left is
+	 * copied before the one with two. */
+	rplan_unit_set(&creps[0], 100, 3, 0, 1, 3);
+	rplan_unit_set(&creps[1], 101, 2, 0, 3, 0);
+	rplan_unit_set(&creps[2], 102, 2, 3, 7, 0);
+	rplan_sort(creps, 3, live, RPLAN_UNIT_NUM_OSD);
+	num = rplan_plan(creps, 3, live, RPLAN_UNIT_NUM_OSD, 1, &rot,
+		copies, RPLAN_UNIT_MAX_COPIES);
+	EXPECT_EQ(num, 1);
+	EXPECT_EQ(copies[0].cid, 101);
+	EXPECT_EQ(copies[0].src, 0);
+	EXPECT_EQ(copies[0].old, 3);
+	EXPECT_NOT_EQ(copies[0].dst, 0);
+	EXPECT_NOT_EQ(copies[0].dst, 3);
+
+	/* With more copies allowed per OSD, both chunks can be fixed */
+	rot = 0;
+	num = rplan_plan(creps, 3, live, RPLAN_UNIT_NUM_OSD, 2, &rot,
+		copies, RPLAN_UNIT_MAX_COPIES);
+	EXPECT_EQ(num, 2);
+	EXPECT_EQ(copies[1].cid, 100);
+	EXPECT_EQ(copies[1].dst, 2);
+	EXPECT_EQ(copies[1].old, 3);
+	EXPECT_EQ(rot, 2);
+
+	/* ...unless we can only make one copy */
+	num = rplan_plan(creps, 3, live, RPLAN_UNIT_NUM_OSD, 2, &rot,
+		copies, 1);
+	EXPECT_EQ(num, 1);
+	EXPECT_EQ(copies[0].cid, 101);
+
+	/* A bad replica is replaced like a missing one, and never used as the
+	 * source */
+	rplan_unit_set(&creps[0], 200, 2, 0, 1, 0);
+	creps[0].bad = 0x1;
+	rplan_sort(creps, 1, live, RPLAN_UNIT_NUM_OSD);
+	EXPECT_EQ(creps[0].num_live, 1);
+	for (i = 0; i < 4; ++i) {
+		num = rplan_plan(creps, 1, live, RPLAN_UNIT_NUM_OSD, 1, &rot,
+			copies, RPLAN_UNIT_MAX_COPIES);
+		EXPECT_EQ(num, 1);
+		EXPECT_EQ(copies[0].src, 1);
+		EXPECT_EQ(copies[0].dst, 2);
+		EXPECT_EQ(copies[0].old, 0);
+	}
+	return 0;
+}
+
+static int test_rplan_spread(void)
+{
+	int i, num;
+	unsigned int rot = 0;
+	int sent[RPLAN_UNIT_NUM_OSD], recvd[RPLAN_UNIT_NUM_OSD];
+	struct chunk_repl creps[RPLAN_UNIT_MAX_COPIES];
+	struct rplan_copy copies[RPLAN_UNIT_MAX_COPIES];
+	const uint8_t live[RPLAN_UNIT_NUM_OSD] = { 1, 1, 1, 1 };
+
+	/* Every chunk lives on OSDs 0 and 1, and all of the copies on OSD 1
+	 * have gone bad.  OSD 0 is the only source, so it limits how much we
+	 * can do at once, but the copies should go to OSDs 2 and 3 equally. */
+	for (i = 0; i < RPLAN_UNIT_MAX_COPIES; ++i) {
+		rplan_unit_set(&creps[i], 300 + i, 2, 0, 1, 0);
+		creps[i].bad = 0x2;
+	}
+	rplan_sort(creps, RPLAN_UNIT_MAX_COPIES, live, RPLAN_UNIT_NUM_OSD);
+	num = rplan_plan(creps, RPLAN_UNIT_MAX_COPIES, live,
+		RPLAN_UNIT_NUM_OSD, 4, &rot, copies, RPLAN_UNIT_MAX_COPIES);
+	EXPECT_EQ(num, 4);
+	memset(sent, 0, sizeof(sent));
+	memset(recvd, 0, sizeof(recvd));
+	for (i = 0; i < num; ++i) {
+		++sent[copies[i].src];
+		++recvd[copies[i].dst];
+	}
+	EXPECT_EQ(sent[0], 4);
+	EXPECT_EQ(recvd[2], 2);
+	EXPECT_EQ(recvd[3], 2);
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	EXPECT_ZERO(utility_ctx_init(argv[0]));
+	EXPECT_ZERO(test_rplan_sort());
+	EXPECT_ZERO(test_rplan_plan());
+	EXPECT_ZERO(test_rplan_spread());
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
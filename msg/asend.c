@@ -0,0 +1,377 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "msg/asend.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/platform/pipe2.h"
+#include "util/queue.h"
+#include "util/thread.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct asend_call {
+	/** Entry in the context's list of calls waiting to be reaped */
+	TAILQ_ENTRY(asend_call) entry;
+	/** The context this call was made with */
+	struct asend *ctx;
+	/** The transactor */
+	struct mtran *tr;
+	/** Callback to invoke on completion, or NULL */
+	asend_cb_t cb;
+	/** Private pointer for the callback */
+	void *priv;
+	/** Result of the call.  Valid once done is set. */
+	int error;
+	/** ASF_* flags */
+	uint8_t flags;
+	/** 1 once the call has finished */
+	uint8_t done;
+	/** 1 if the call is on the context's reap list */
+	uint8_t queued;
+	/** 1 if the call was freed while it was still in use */
+	uint8_t abandoned;
+	/** Number of asend_wait_quorum callers looking at this call.  The call
+	 * can't be released until this drops to 0. */
+	int refs;
+};
+
+TAILQ_HEAD(asend_call_list, asend_call);
+
+/** An asynchronous RPC context */
+struct asend {
+	/** Protects everything in the context, and the done, queued,
+	 * abandoned, and refs fields of each call */
+	pthread_mutex_t lock;
+	/** Broadcast whenever a call finishes */
+	pthread_cond_t cond;
+	/** Finished calls waiting to be reaped */
+	struct asend_call_list done_head;
+	/** Number of calls which have not yet finished */
+	int num_outstanding;
+	/** Self-pipe.  There is a byte in the pipe whenever done_head is not
+	 * empty. */
+	int pipefd[2];
+};
+
+struct asend *asend_init(void)
+{
+	int ret, POSSIBLY_UNUSED(res);
+	struct asend *ctx;
+
+	ctx = calloc(1, sizeof(struct asend));
+	if (!ctx) {
+		ret = ENOMEM;
+		goto error;
+	}
+	TAILQ_INIT(&ctx->done_head);
+	ret = do_pipe2(ctx->pipefd, WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+	if (ret)
+		goto error_free_ctx;
+	ret = pthread_mutex_init(&ctx->lock, NULL);
+	if (ret)
+		goto error_close_pipe;
+	ret = pthread_cond_init_mt(&ctx->cond);
+	if (ret)
+		goto error_destroy_lock;
+	return ctx;
+
+error_destroy_lock:
+	pthread_mutex_destroy(&ctx->lock);
+error_close_pipe:
+	RETRY_ON_EINTR(res, close(ctx->pipefd[PIPE_READ]));
+	RETRY_ON_EINTR(res, close(ctx->pipefd[PIPE_WRITE]));
+error_free_ctx:
+	free(ctx);
+error:
+	return ERR_PTR(FORCE_POSITIVE(ret));
+}
+
+int asend_get_fd(const struct asend *ctx)
+{
+	return ctx->pipefd[PIPE_READ];
+}
+
+/** Make the context's file descriptor readable
+ *
+ * @param ctx		The asynchronous RPC context.  Must be locked.
+ */
+static void asend_notify(struct asend *ctx)
+{
+	char c = 0;
+	ssize_t POSSIBLY_UNUSED(res);
+
+	/* The pipe is non-blocking and holds at most one byte, so this can't
+	 * block. */
+	RETRY_ON_EINTR(res, write(ctx->pipefd[PIPE_WRITE], &c, 1));
+}
+
+/** Make the context's file descriptor unreadable again
+ *
+ * @param ctx		The asynchronous RPC context.  Must be locked.
+ */
+static void asend_drain(struct asend *ctx)
+{
+	char buf[16];
+	ssize_t res;
+
+	do {
+		RETRY_ON_EINTR(res, read(ctx->pipefd[PIPE_READ],
+				buf, sizeof(buf)));
+	} while (res > 0);
+}
+
+static void asend_call_release(struct asend_call *call)
+{
+	mtran_free(call->tr);
+	free(call);
+}
+
+static void asend_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct asend_call *call = (struct asend_call *)tr->priv;
+	struct asend *ctx = call->ctx;
+
+	if ((call->flags & ASF_RESP) && (tr->state == MTRAN_STATE_SENT) &&
+			(tr->m == NULL)) {
+		/* The request went out.  Now let's get the response. */
+		mtran_recv_next(conn, tr);
+		return;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	call->error = (tr->m && IS_ERR(tr->m)) ?
+		FORCE_NEGATIVE(PTR_ERR(tr->m)) : 0;
+	call->done = 1;
+	ctx->num_outstanding--;
+	if (call->abandoned) {
+		pthread_cond_broadcast(&ctx->cond);
+		if (call->refs > 0) {
+			/* The last waiter will release it. */
+			pthread_mutex_unlock(&ctx->lock);
+			return;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+		asend_call_release(call);
+		return;
+	}
+	if (call->cb) {
+		pthread_mutex_unlock(&ctx->lock);
+		/* The callback may free the call, so we mustn't touch it
+		 * after this. */
+		call->cb(call, call->priv);
+		pthread_mutex_lock(&ctx->lock);
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	if (TAILQ_EMPTY(&ctx->done_head))
+		asend_notify(ctx);
+	TAILQ_INSERT_TAIL(&ctx->done_head, call, entry);
+	call->queued = 1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+struct asend_call *asend_add(struct asend *ctx, struct msgr *msgr,
+	uint8_t flags, struct msg *m, uint32_t addr, uint16_t port, int timeo,
+	asend_cb_t cb, void *priv)
+{
+	struct asend_call *call;
+	struct mtran *tr;
+
+	call = calloc(1, sizeof(struct asend_call));
+	if (!call)
+		return ERR_PTR(ENOMEM);
+	tr = mtran_alloc(msgr);
+	if (!tr) {
+		free(call);
+		return ERR_PTR(ENOMEM);
+	}
+	tr->ip = addr;
+	tr->port = port;
+	if (flags & ASF_BULK)
+		tr->flags |= MTRAN_FLAG_BULK;
+	call->ctx = ctx;
+	call->tr = tr;
+	call->cb = cb;
+	call->priv = priv;
+	call->flags = flags;
+	pthread_mutex_lock(&ctx->lock);
+	ctx->num_outstanding++;
+	pthread_mutex_unlock(&ctx->lock);
+	/* If there is a callback, the call may be finished and freed before
+	 * mtran_send even returns. */
+	mtran_send(msgr, tr, asend_cb, call, m, timeo);
+	return call;
+}
+
+int asend_reap(struct asend *ctx, struct asend_call **calls, int max,
+	int wait)
+{
+	int n;
+	struct asend_call *call;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (wait && TAILQ_EMPTY(&ctx->done_head) &&
+			(ctx->num_outstanding > 0)) {
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	}
+	for (n = 0; n < max; ++n) {
+		call = TAILQ_FIRST(&ctx->done_head);
+		if (!call)
+			break;
+		TAILQ_REMOVE(&ctx->done_head, call, entry);
+		call->queued = 0;
+		calls[n] = call;
+	}
+	if (TAILQ_EMPTY(&ctx->done_head))
+		asend_drain(ctx);
+	pthread_mutex_unlock(&ctx->lock);
+	return n;
+}
+
+int asend_wait_quorum(struct asend *ctx, struct asend_call **calls,
+	int n, int k)
+{
+	return asend_wait_quorum_timed(ctx, calls, n, k, -1);
+}
+
+int asend_wait_quorum_timed(struct asend *ctx, struct asend_call **calls,
+	int n, int k, int timeo_ms)
+{
+	int i, num_ok, num_failed;
+	struct timespec ts;
+	struct asend_call_list release_head;
+	struct asend_call *call;
+
+	if (timeo_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		timespec_add_sec(&ts, timeo_ms / 1000);
+		timespec_add_nsec(&ts, (timeo_ms % 1000) * 1000000);
+	}
+	TAILQ_INIT(&release_head);
+	pthread_mutex_lock(&ctx->lock);
+	/* A call's callback may free it while we wait.  Hold a reference to
+	 * each call so that we can keep looking at it. */
+	for (i = 0; i < n; ++i)
+		calls[i]->refs++;
+	while (1) {
+		num_ok = 0;
+		num_failed = 0;
+		for (i = 0; i < n; ++i) {
+			if (!calls[i]->done)
+				continue;
+			if (calls[i]->error)
+				num_failed++;
+			else
+				num_ok++;
+		}
+		if ((num_ok >= k) || (n - num_failed < k))
+			break;
+		if (timeo_ms < 0) {
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		}
+		else if (pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts) ==
+				ETIMEDOUT) {
+			break;
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		call = calls[i];
+		if ((--call->refs == 0) && call->abandoned && call->done)
+			TAILQ_INSERT_TAIL(&release_head, call, entry);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	while ((call = TAILQ_FIRST(&release_head))) {
+		TAILQ_REMOVE(&release_head, call, entry);
+		asend_call_release(call);
+	}
+	return num_ok;
+}
+
+int asend_call_done(const struct asend_call *call)
+{
+	int done;
+
+	pthread_mutex_lock(&call->ctx->lock);
+	done = call->done;
+	pthread_mutex_unlock(&call->ctx->lock);
+	return done;
+}
+
+int asend_call_get_error(const struct asend_call *call)
+{
+	return call->error;
+}
+
+struct mtran *asend_call_get_mtran(struct asend_call *call)
+{
+	return call->tr;
+}
+
+void *asend_call_get_priv(const struct asend_call *call)
+{
+	return call->priv;
+}
+
+void asend_call_free(struct asend_call *call)
+{
+	struct asend *ctx = call->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (call->queued) {
+		TAILQ_REMOVE(&ctx->done_head, call, entry);
+		call->queued = 0;
+		if (TAILQ_EMPTY(&ctx->done_head))
+			asend_drain(ctx);
+	}
+	if ((!call->done) || (call->refs > 0)) {
+		/* The messenger still has the transactor, or somebody is
+		 * waiting on the call.  Whoever is last to finish with it will
+		 * release it. */
+		call->abandoned = 1;
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	asend_call_release(call);
+}
+
+void asend_free(struct asend *ctx)
+{
+	int POSSIBLY_UNUSED(res);
+	struct asend_call *call;
+
+	while ((call = TAILQ_FIRST(&ctx->done_head))) {
+		TAILQ_REMOVE(&ctx->done_head, call, entry);
+		asend_call_release(call);
+	}
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	RETRY_ON_EINTR(res, close(ctx->pipefd[PIPE_READ]));
+	RETRY_ON_EINTR(res, close(ctx->pipefd[PIPE_WRITE]));
+	free(ctx);
+}
@@ -0,0 +1,216 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_MSG_ASEND_H
+#define REDFISH_MSG_ASEND_H
+
+/*
+ * Redfish asynchronous RPC implementation
+ *
+ * Unlike bsend, which makes the caller wait for a whole batch of RPCs, asend
+ * hands back a call handle as soon as the message has been queued.  The caller
+ * can then find out when calls finish in one of three ways:
+ *
+ * 1. Give asend_add a callback.  It is invoked on the messenger thread when the
+ * call finishes, so it must not block.
+ *
+ * 2. Collect finished calls with asend_reap.  asend_get_fd returns a file
+ * descriptor which becomes readable whenever there are finished calls waiting
+ * to be reaped, so it can be put into a poll set or event loop.
+ *
+ * 3. Wait for some number of a group of calls to finish with
+ * asend_wait_quorum.
+ *
+ * There is no timeout parameter for the context as a whole; each call has its
+ * own timeout, and the messenger enforces it.
+ */
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+struct asend;
+struct asend_call;
+struct msg;
+struct msgr;
+struct mtran;
+
+/** Asynchronous RPC flag: listen for a response to this message */
+#define ASF_RESP 0x1
+
+/** Asynchronous RPC flag: this RPC is part of a bulk transfer.  See
+ * MTRAN_FLAG_BULK. */
+#define ASF_BULK 0x2
+
+/** Callback invoked on the messenger thread when a call finishes
+ *
+ * The callback may free the call with asend_call_free.
+ *
+ * @param call		The call that finished
+ * @param priv		The private pointer given to asend_add
+ */
+typedef void (*asend_cb_t)(struct asend_call *call, void *priv);
+
+/** Create an asynchronous RPC context
+ *
+ * @return		Pointer to a valid asend context, or an error pointer
+ */
+extern struct asend *asend_init(void);
+
+/** Get a file descriptor that becomes readable when calls can be reaped
+ *
+ * Don't read from this file descriptor yourself; asend_reap takes care of that.
+ *
+ * @param ctx		The asynchronous RPC context
+ *
+ * @return		The file descriptor
+ */
+extern int asend_get_fd(const struct asend *ctx);
+
+/** Send out an RPC message
+ *
+ * This function will allocate a transactor for you.  This can be called from
+ * any thread, including from an asend callback.
+ *
+ * @param ctx		The asynchronous RPC context
+ * @param msgr		Messenger to send the message on
+ * @param flags		ASF_* flags
+ * @param m		The message.  On success, the messenger takes ownership
+ *			of this.
+ * @param addr		The destination address
+ * @param port		The destination port
+ * @param timeo		Timeout in seconds
+ * @param cb		Callback to invoke when the call finishes, or NULL to
+ *			put the call on the context's reap list instead
+ * @param priv		Private pointer for the call
+ *
+ * @return		The call handle, or an error pointer
+ */
+extern struct asend_call *asend_add(struct asend *ctx, struct msgr *msgr,
+	uint8_t flags, struct msg *m, uint32_t addr, uint16_t port, int timeo,
+	asend_cb_t cb, void *priv);
+
+/** Collect calls that have finished
+ *
+ * Calls that were given a callback are never returned here.
+ *
+ * @param ctx		The asynchronous RPC context
+ * @param calls		(out param) array of finished calls
+ * @param max		Length of the calls array
+ * @param wait		If nonzero, block until at least one call has finished.
+ *			If there are no calls outstanding, we return right away
+ *			anyway.
+ *
+ * @return		The number of calls placed in the array
+ */
+extern int asend_reap(struct asend *ctx, struct asend_call **calls, int max,
+	int wait);
+
+/** Wait until k out of a group of calls have succeeded
+ *
+ * A call has succeeded if it got a response, or if it was sent without
+ * ASF_RESP and the send went through.  We stop waiting early if so many calls
+ * have failed that k successes are no longer possible.
+ *
+ * This does not reap any calls.  A call may be freed while we are waiting on
+ * it, for example by its callback; it will be released when we return.
+ *
+ * @param ctx		The asynchronous RPC context
+ * @param calls		Array of calls to wait for
+ * @param n		Length of the calls array
+ * @param k		Number of successful calls to wait for
+ *
+ * @return		The number of calls that succeeded.  If this is less
+ *			than k, the quorum could not be reached.
+ */
+extern int asend_wait_quorum(struct asend *ctx, struct asend_call **calls,
+	int n, int k);
+
+/** Wait until k out of a group of calls have succeeded, or a timeout expires
+ *
+ * This is like asend_wait_quorum, except that we also stop waiting after
+ * timeo_ms milliseconds.
+ *
+ * @param ctx		The asynchronous RPC context
+ * @param calls		Array of calls to wait for
+ * @param n		Length of the calls array
+ * @param k		Number of successful calls to wait for
+ * @param timeo_ms	Maximum time to wait, in milliseconds.  Negative
+ *			numbers mean wait forever.
+ *
+ * @return		The number of calls that succeeded
+ */
+extern int asend_wait_quorum_timed(struct asend *ctx,
+	struct asend_call **calls, int n, int k, int timeo_ms);
+
+/** Determine whether a call has finished
+ *
+ * @param call		The call
+ *
+ * @return		1 if the call has finished; 0 otherwise
+ */
+extern int asend_call_done(const struct asend_call *call);
+
+/** Get the result of a finished call
+ *
+ * @param call		The call
+ *
+ * @return		0 if the call succeeded; a negative error code otherwise.
+ *			-ETIMEDOUT means that we timed out waiting for a
+ *			response.
+ */
+extern int asend_call_get_error(const struct asend_call *call);
+
+/** Get the transactor of a finished call
+ *
+ * tr->m is the response, if there was one.  The transactor belongs to the call
+ * and will be freed along with it.  See bsend_get_mtran for details.
+ *
+ * @param call		The call
+ *
+ * @return		The transactor
+ */
+extern struct mtran *asend_call_get_mtran(struct asend_call *call);
+
+/** Get the private pointer of a call
+ *
+ * @param call		The call
+ *
+ * @return		The private pointer that was given to asend_add
+ */
+extern void *asend_call_get_priv(const struct asend_call *call);
+
+/** Free a call
+ *
+ * If the call hasn't finished yet, it will be freed when it does, and its
+ * callback will not be invoked.  If somebody is waiting on the call in
+ * asend_wait_quorum, it will be freed when they are done with it.  A call which has a callback should only be
+ * freed before it finishes, or from the callback itself.
+ *
+ * @param call		The call
+ */
+extern void asend_call_free(struct asend_call *call);
+
+/** Free an asynchronous RPC context
+ *
+ * All calls made with this context must have finished.  Calls that haven't
+ * been reaped yet are freed.
+ *
+ * @param ctx		The asynchronous RPC context
+ */
+extern void asend_free(struct asend *ctx);
+
+#endif
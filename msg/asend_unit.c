@@ -0,0 +1,352 @@
+/*
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/alarm.h"
+#include "core/process_ctx.h"
+#include "msg/asend.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/fast_log.h"
+#include "util/macro.h"
+#include "util/packed.h"
+#include "util/test.h"
+#include "util/time.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSGR_UNIT_PORT 9096
+
+#define ASEND_TEST_MAX_CALLS 32
+
+struct msgr_conf g_std_foo_msgr_conf = {
+	.max_conn = 10,
+	.max_tran = 100,
+	.tcp_teardown_timeo = 360,
+	.name = "foo_msgr",
+	.fl_mgr = NULL
+};
+
+struct msgr_conf g_std_bar_msgr_conf = {
+	.max_conn = 10,
+	.max_tran = 100,
+	.tcp_teardown_timeo = 360,
+	.name = "bar_msgr",
+	.fl_mgr = NULL
+};
+
+enum {
+	mmm_test30_ty = 9030,
+	mmm_test31_ty,
+};
+
+PACKED(
+struct mmm_test30 {
+	struct msg base;
+	uint32_t x;
+	uint32_t y;
+});
+
+PACKED(
+struct mmm_test31 {
+	struct msg base;
+	uint32_t z;
+});
+
+static uint32_t g_localhost;
+
+static sem_t g_asend_cb_sem;
+
+static int g_asend_cb_bad;
+
+/** Reply to each mmm_test30 with the sum of x and y.  If x and y are both 0,
+ * don't reply at all. */
+static void asend_test_listen_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct mmm_test30 *m;
+	struct mmm_test31 *mout;
+	uint32_t x, y;
+
+	if ((tr->state != MTRAN_STATE_RECV) || IS_ERR(tr->m)) {
+		mtran_free(tr);
+		return;
+	}
+	m = (struct mmm_test30*)tr->m;
+	x = unpack_from_be32(&m->x);
+	y = unpack_from_be32(&m->y);
+	if ((x == 0) && (y == 0)) {
+		mtran_free(tr);
+		return;
+	}
+	mout = calloc_msg(mmm_test31_ty, sizeof(struct mmm_test31));
+	if (!mout)
+		abort();
+	pack_to_be32(&mout->z, x + y);
+	msg_release((struct msg*)m);
+	tr->m = NULL;
+	mtran_send_next(conn, tr, (struct msg*)mout, 60);
+}
+
+static struct asend_call *asend_test30(struct asend *ctx, struct msgr *msgr,
+		int x, int y, int timeo, asend_cb_t cb, void *priv)
+{
+	struct mmm_test30 *m;
+
+	m = calloc_msg(mmm_test30_ty, sizeof(struct mmm_test30));
+	if (!m)
+		return ERR_PTR(ENOMEM);
+	pack_to_be32(&m->x, x);
+	pack_to_be32(&m->y, y);
+	return asend_add(ctx, msgr, ASF_RESP, (struct msg*)m, g_localhost,
+		MSGR_UNIT_PORT, timeo, cb, priv);
+}
+
+/** Check that a call got back the sum we expected
+ *
+ * @param call		The call
+ * @param ex		The expected sum
+ *
+ * @return		0 if the response was right; -EIO otherwise
+ */
+static int asend_test_check_resp(struct asend_call *call, uint32_t ex)
+{
+	struct mtran *tr;
+	struct mmm_test31 *m;
+
+	if (asend_call_get_error(call))
+		return -EIO;
+	tr = asend_call_get_mtran(call);
+	m = (struct mmm_test31*)tr->m;
+	if (IS_ERR(m))
+		return -EIO;
+	if (unpack_from_be16(&m->base.ty) != mmm_test31_ty)
+		return -EIO;
+	if (unpack_from_be32(&m->z) != ex)
+		return -EIO;
+	return 0;
+}
+
+static int asend_test_setup(struct msgr **foo_msgr, struct msgr **bar_msgr,
+		struct asend **ctx)
+{
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	struct listen_info linfo;
+
+	g_std_foo_msgr_conf.fl_mgr = g_fast_log_mgr;
+	*foo_msgr = msgr_init(err, err_len, &g_std_foo_msgr_conf);
+	EXPECT_ZERO(err[0]);
+	g_std_bar_msgr_conf.fl_mgr = g_fast_log_mgr;
+	*bar_msgr = msgr_init(err, err_len, &g_std_bar_msgr_conf);
+	EXPECT_ZERO(err[0]);
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = asend_test_listen_cb;
+	linfo.priv = NULL;
+	linfo.port = MSGR_UNIT_PORT;
+	msgr_listen(*bar_msgr, &linfo, err, err_len);
+	EXPECT_EQ(err[0], '\0');
+	msgr_start(*foo_msgr, err, err_len);
+	EXPECT_EQ(err[0], '\0');
+	msgr_start(*bar_msgr, err, err_len);
+	EXPECT_EQ(err[0], '\0');
+	*ctx = asend_init();
+	EXPECT_NOT_ERRPTR(*ctx);
+	return 0;
+}
+
+static void asend_test_teardown(struct msgr *foo_msgr, struct msgr *bar_msgr,
+			struct asend *ctx)
+{
+	asend_free(ctx);
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+}
+
+static int asend_test_init_shutdown(void)
+{
+	struct asend *ctx;
+	struct asend_call *calls[1];
+
+	ctx = asend_init();
+	EXPECT_NOT_ERRPTR(ctx);
+	EXPECT_ZERO(asend_reap(ctx, calls, 1, 1));
+	asend_free(ctx);
+	return 0;
+}
+
+static int asend_test_reap(int ncalls)
+{
+	int i, n, num_reaped;
+	struct asend *ctx;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct asend_call *call, *calls[ASEND_TEST_MAX_CALLS];
+	struct pollfd pfd;
+	uintptr_t idx;
+
+	EXPECT_ZERO(asend_test_setup(&foo_msgr, &bar_msgr, &ctx));
+	for (i = 0; i < ncalls; ++i) {
+		call = asend_test30(ctx, foo_msgr, i, 1, 60, NULL,
+			(void*)(uintptr_t)i);
+		EXPECT_NOT_ERRPTR(call);
+	}
+	/* Nothing should be reapable until the file descriptor says so. */
+	num_reaped = 0;
+	while (num_reaped < ncalls) {
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = asend_get_fd(ctx);
+		pfd.events = POLLIN;
+		EXPECT_EQ(poll(&pfd, 1, 60000), 1);
+		n = asend_reap(ctx, calls, ASEND_TEST_MAX_CALLS, 0);
+		EXPECT_GT(n, 0);
+		for (i = 0; i < n; ++i) {
+			EXPECT_EQ(asend_call_done(calls[i]), 1);
+			idx = (uintptr_t)asend_call_get_priv(calls[i]);
+			EXPECT_ZERO(asend_test_check_resp(calls[i], idx + 1));
+			asend_call_free(calls[i]);
+		}
+		num_reaped += n;
+	}
+	EXPECT_EQ(num_reaped, ncalls);
+	/* Once everything has been reaped, the fd is no longer readable. */
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = asend_get_fd(ctx);
+	pfd.events = POLLIN;
+	EXPECT_ZERO(poll(&pfd, 1, 0));
+	asend_test_teardown(foo_msgr, bar_msgr, ctx);
+	return 0;
+}
+
+static void asend_test_cb(struct asend_call *call, void *priv)
+{
+	uintptr_t idx = (uintptr_t)priv;
+
+	if (asend_test_check_resp(call, idx + 1))
+		g_asend_cb_bad = 1;
+	asend_call_free(call);
+	sem_post(&g_asend_cb_sem);
+}
+
+static void asend_test_free_cb(struct asend_call *call,
+		POSSIBLY_UNUSED(void *priv))
+{
+	asend_call_free(call);
+	sem_post(&g_asend_cb_sem);
+}
+
+static int asend_test_callback(int ncalls)
+{
+	int i;
+	struct asend *ctx;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct asend_call *call, *calls[1];
+
+	EXPECT_ZERO(sem_init(&g_asend_cb_sem, 0, 0));
+	g_asend_cb_bad = 0;
+	EXPECT_ZERO(asend_test_setup(&foo_msgr, &bar_msgr, &ctx));
+	for (i = 0; i < ncalls; ++i) {
+		call = asend_test30(ctx, foo_msgr, i, 1, 60, asend_test_cb,
+			(void*)(uintptr_t)i);
+		EXPECT_NOT_ERRPTR(call);
+	}
+	for (i = 0; i < ncalls; ++i)
+		sem_wait(&g_asend_cb_sem);
+	EXPECT_ZERO(g_asend_cb_bad);
+	/* Calls with callbacks never show up on the reap list. */
+	EXPECT_ZERO(asend_reap(ctx, calls, 1, 1));
+	asend_test_teardown(foo_msgr, bar_msgr, ctx);
+	sem_destroy(&g_asend_cb_sem);
+	return 0;
+}
+
+static int asend_test_quorum(void)
+{
+	int i;
+	struct asend *ctx;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct asend_call *calls[3], *reaped[3];
+
+	EXPECT_ZERO(asend_test_setup(&foo_msgr, &bar_msgr, &ctx));
+	/* Two of the three calls get a reply.  The third never does. */
+	calls[0] = asend_test30(ctx, foo_msgr, 1, 1, 60, NULL, NULL);
+	EXPECT_NOT_ERRPTR(calls[0]);
+	calls[1] = asend_test30(ctx, foo_msgr, 0, 0, 1, NULL, NULL);
+	EXPECT_NOT_ERRPTR(calls[1]);
+	calls[2] = asend_test30(ctx, foo_msgr, 2, 2, 60, NULL, NULL);
+	EXPECT_NOT_ERRPTR(calls[2]);
+	EXPECT_EQ(asend_wait_quorum(ctx, calls, 3, 2), 2);
+	EXPECT_ZERO(asend_test_check_resp(calls[0], 2));
+	EXPECT_ZERO(asend_test_check_resp(calls[2], 4));
+	/* Asking for all three has to wait for the third to time out. */
+	EXPECT_EQ(asend_wait_quorum(ctx, calls, 3, 3), 2);
+	EXPECT_EQ(asend_call_get_error(calls[1]), -ETIMEDOUT);
+	for (i = 0; i < 3; ++i)
+		asend_call_free(calls[i]);
+	EXPECT_ZERO(asend_reap(ctx, reaped, 3, 0));
+
+	/* Give up on a call which is still outstanding.  It gets cleaned up
+	 * once it times out. */
+	calls[0] = asend_test30(ctx, foo_msgr, 0, 0, 1, NULL, NULL);
+	EXPECT_NOT_ERRPTR(calls[0]);
+	asend_call_free(calls[0]);
+	EXPECT_ZERO(asend_reap(ctx, reaped, 3, 1));
+
+	/* Calls may free themselves from their callbacks while we wait on
+	 * them. */
+	EXPECT_ZERO(sem_init(&g_asend_cb_sem, 0, 0));
+	for (i = 0; i < 2; ++i) {
+		calls[i] = asend_test30(ctx, foo_msgr, 0, 0, 1,
+			asend_test_free_cb, NULL);
+		EXPECT_NOT_ERRPTR(calls[i]);
+	}
+	EXPECT_EQ(asend_wait_quorum(ctx, calls, 2, 1), 0);
+	for (i = 0; i < 2; ++i)
+		sem_wait(&g_asend_cb_sem);
+	sem_destroy(&g_asend_cb_sem);
+	asend_test_teardown(foo_msgr, bar_msgr, ctx);
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	timer_t timer;
+	time_t t;
+
+	EXPECT_ZERO(utility_ctx_init(argv[0]));
+	t = mt_time() + 600;
+	EXPECT_ZERO(mt_set_alarm(t, "asend_unit timed out", &timer));
+	EXPECT_ZERO(get_localhost_ipv4(&g_localhost));
+	EXPECT_ZERO(asend_test_init_shutdown());
+	EXPECT_ZERO(asend_test_reap(1));
+	EXPECT_ZERO(asend_test_reap(ASEND_TEST_MAX_CALLS));
+	EXPECT_ZERO(asend_test_callback(1));
+	EXPECT_ZERO(asend_test_callback(20));
+	EXPECT_ZERO(asend_test_quorum());
+	EXPECT_ZERO(mt_deactivate_alarm(timer));
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
@@ -180,6 +180,8 @@ int bsend_add_tr_or_free(struct bsend *ctx, struct msgr *msgr, uint8_t flags,
 	btr->ctx = ctx;
 	btr->tag = tag;
 	btr->flags = flags;
+	if (flags & BSF_BULK)
+		tr->flags |= MTRAN_FLAG_BULK;
 	ctx->num_tr++;
 	fast_log_bsend(ctx->fb, FAST_LOG_BSEND_DEBUG, FLBS_ADD_TR,
 			tr->port, tr->ip, flags, 0, ctx->num_tr);
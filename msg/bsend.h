@@ -35,6 +35,10 @@ struct bsend;
 /** Blocking RPC flag: listen for a response to this message */
 #define BSF_RESP 0x1
 
+/** Blocking RPC flag: this RPC is part of a bulk transfer.  Use this for
+ * requests whose responses will be large.  See MTRAN_FLAG_BULK. */
+#define BSF_BULK 0x2
+
 /** Create a blocking RPC sending context
  *
  * There is no timeout parameter here; timeouts are determined by the messengers
@@ -115,7 +115,7 @@ static void bsend_test_cb(struct mconn *conn, struct mtran *tr)
 	}
 	pack_to_be32(&mout->z, x + y);
 	mtran_send_next(conn, tr, (struct msg*)mout, 60);
-	free(m);
+	msg_release((struct msg*)m);
 }
 
 static void bsend_test_cb_noresp(POSSIBLY_UNUSED(struct mconn *conn),
@@ -111,7 +111,8 @@ void fast_log_msgr_dump(struct fast_log_msgr_entry *fe, char *buf)
 		break;
 	case FLME_INBOUND_CONN_CREATED:
 		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
-			"created new inbound connection\n");
+			"created new inbound %s connection\n",
+			fe->event_data ? "local" : "TCP");
 		break;
 	case FLME_OUTBOUND_CONN_CREATED:
 		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
@@ -195,6 +196,44 @@ void fast_log_msgr_dump(struct fast_log_msgr_entry *fe, char *buf)
 			"error writing message body: error %d\n",
 			fe->event_data);
 		break;
+	case FLME_LOCAL_CONN_ESTABLISHED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"using local socket for outbound connection\n");
+		break;
+	case FLME_LOCAL_CONN_FAILED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"local socket connect failed with error %d; "
+			"falling back to TCP\n", fe->event_data);
+		break;
+	case FLME_URING_ENABLED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"using io_uring for established connections\n");
+		break;
+	case FLME_URING_ARM_FAILED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"failed to queue io_uring operation: error %d; "
+			"falling back to readiness notification\n",
+			fe->event_data);
+		break;
+	case FLME_URING_SUBMIT_FAILED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"io_uring submit failed with error %d\n",
+			fe->event_data);
+		break;
+	case FLME_PEER_CLOSED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"peer closed the connection\n");
+		break;
+	case FLME_LZ4_BAD_MSG:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"failed to decompress message: error %d\n",
+			fe->event_data);
+		break;
+	case FLME_LOCAL_PEER_REJECTED:
+		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"rejected inbound local connection: error %d\n",
+			fe->event_data);
+		break;
 	default:
 		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
 			 "(unknown event %d\n)", fe->event);
@@ -46,6 +46,14 @@ enum fast_log_msgr_event {
 	FLME_HDR_READ_ERROR,
 	FLME_READ_ERROR,
 	FLME_WRITE_ERROR,
+	FLME_LOCAL_CONN_ESTABLISHED,
+	FLME_LOCAL_CONN_FAILED,
+	FLME_URING_ENABLED,
+	FLME_URING_ARM_FAILED,
+	FLME_URING_SUBMIT_FAILED,
+	FLME_PEER_CLOSED,
+	FLME_LZ4_BAD_MSG,
+	FLME_LOCAL_PEER_REJECTED,
 	FLME_MAX,
 };
 
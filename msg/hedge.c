@@ -0,0 +1,431 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "msg/asend.h"
+#include "msg/hedge.h"
+#include "msg/msg.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/time.h"
+#include "util/tree.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Once a replica has this many new samples, halve its histogram, so that old
+ * samples count for less and less */
+#define RLAT_DECAY_SAMPLES 128
+
+/** Latency histogram for one replica */
+struct rlat_ep {
+	RB_ENTRY(rlat_ep) entry;
+	/** Replica IP address */
+	uint32_t ip;
+	/** Replica port */
+	uint16_t port;
+	/** Number of samples since the histogram was last halved */
+	uint32_t num_new;
+	/** Latency histogram */
+	uint32_t hist[RLAT_BUCKETS];
+};
+
+static int rlat_ep_compare(struct rlat_ep *a, struct rlat_ep *b) PURE;
+
+RB_HEAD(rlat_ep_tree, rlat_ep);
+RB_GENERATE(rlat_ep_tree, rlat_ep, entry, rlat_ep_compare);
+
+struct rlat {
+	/** Protects eps */
+	pthread_mutex_t lock;
+	/** Latency histograms for each replica we have heard from */
+	struct rlat_ep_tree eps;
+};
+
+/** A request sent by hedge_send */
+struct hedge_req {
+	/** Index of the replica in the endpoint array */
+	int idx;
+	/** 1 once we have dealt with the result of this request */
+	int finished;
+	/** Monotonic time in microseconds at which the request was sent */
+	uint64_t start_us;
+	/** Monotonic time in microseconds at which to send a hedged request
+	 * if this one hasn't been answered */
+	uint64_t hedge_us;
+};
+
+static int rlat_ep_compare(struct rlat_ep *a, struct rlat_ep *b)
+{
+	if (a->ip < b->ip)
+		return -1;
+	if (a->ip > b->ip)
+		return 1;
+	if (a->port < b->port)
+		return -1;
+	if (a->port > b->port)
+		return 1;
+	return 0;
+}
+
+struct rlat *rlat_init(void)
+{
+	int ret;
+	struct rlat *rl;
+
+	rl = calloc(1, sizeof(struct rlat));
+	if (!rl)
+		return ERR_PTR(ENOMEM);
+	ret = pthread_mutex_init(&rl->lock, NULL);
+	if (ret) {
+		free(rl);
+		return ERR_PTR(ret);
+	}
+	RB_INIT(&rl->eps);
+	return rl;
+}
+
+void rlat_free(struct rlat *rl)
+{
+	struct rlat_ep *rep, *rep_tmp;
+
+	RB_FOREACH_SAFE(rep, rlat_ep_tree, &rl->eps, rep_tmp) {
+		RB_REMOVE(rlat_ep_tree, &rl->eps, rep);
+		free(rep);
+	}
+	pthread_mutex_destroy(&rl->lock);
+	free(rl);
+}
+
+/** Find the histogram for a replica
+ *
+ * @param rl		The tracker.  Must be locked.
+ * @param ip		The replica's IP address
+ * @param port		The replica's port
+ *
+ * @return		The histogram, or NULL if there isn't one
+ */
+static struct rlat_ep *rlat_lookup(struct rlat *rl, uint32_t ip,
+		uint16_t port)
+{
+	struct rlat_ep exemplar;
+
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.ip = ip;
+	exemplar.port = port;
+	return RB_FIND(rlat_ep_tree, &rl->eps, &exemplar);
+}
+
+void rlat_record(struct rlat *rl, uint32_t ip, uint16_t port, uint64_t usec)
+{
+	int i, bucket = 0;
+	struct rlat_ep *rep;
+
+	while ((bucket < RLAT_BUCKETS - 1) && (usec >= (2ULL << bucket)))
+		bucket++;
+	pthread_mutex_lock(&rl->lock);
+	rep = rlat_lookup(rl, ip, port);
+	if (!rep) {
+		rep = calloc(1, sizeof(struct rlat_ep));
+		if (!rep) {
+			/* We'll just have to do without this sample. */
+			pthread_mutex_unlock(&rl->lock);
+			return;
+		}
+		rep->ip = ip;
+		rep->port = port;
+		RB_INSERT(rlat_ep_tree, &rl->eps, rep);
+	}
+	rep->hist[bucket]++;
+	if (++rep->num_new >= RLAT_DECAY_SAMPLES) {
+		for (i = 0; i < RLAT_BUCKETS; ++i)
+			rep->hist[i] /= 2;
+		rep->num_new = 0;
+	}
+	pthread_mutex_unlock(&rl->lock);
+}
+
+/** Estimate a percentile from a latency histogram
+ *
+ * @param rep		The histogram
+ * @param pct		The percentile, from 0 to 100
+ *
+ * @return		The estimate in microseconds, or 0 if the histogram is
+ *			empty
+ */
+static uint64_t rlat_ep_pct(const struct rlat_ep *rep, int pct)
+{
+	uint64_t total = 0, seen = 0, target;
+	int i;
+
+	for (i = 0; i < RLAT_BUCKETS; ++i)
+		total += rep->hist[i];
+	if (total == 0)
+		return 0;
+	target = ((total * pct) + 99) / 100;
+	for (i = 0; i < RLAT_BUCKETS - 1; ++i) {
+		seen += rep->hist[i];
+		if (seen >= target)
+			break;
+	}
+	return 2ULL << i;
+}
+
+uint64_t rlat_get_pct(struct rlat *rl, uint32_t ip, uint16_t port, int pct)
+{
+	uint64_t ret = 0;
+	struct rlat_ep *rep;
+
+	pthread_mutex_lock(&rl->lock);
+	rep = rlat_lookup(rl, ip, port);
+	if (rep)
+		ret = rlat_ep_pct(rep, pct);
+	pthread_mutex_unlock(&rl->lock);
+	return ret;
+}
+
+void rlat_rank(struct rlat *rl, const struct endpoint *ep, int num_ep,
+		int *order)
+{
+	int i, j, tmp;
+	uint64_t med[RF_MAX_OID];
+
+	for (i = 0; i < num_ep; ++i) {
+		order[i] = i;
+		med[i] = rlat_get_pct(rl, ep[i].ip, ep[i].port, 50);
+	}
+	/* There are only a handful of replicas, so an insertion sort will do.
+	 * Replicas that are equally fast keep the order they were given in. */
+	for (i = 1; i < num_ep; ++i) {
+		for (j = i; j > 0; --j) {
+			if (med[order[j - 1]] <= med[order[j]])
+				break;
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+	}
+}
+
+/** Make a copy of a message, so that it can be sent on another transactor
+ * while the original is still being sent
+ *
+ * @param m		The message
+ *
+ * @return		The copy, or NULL on OOM
+ */
+static struct msg *hedge_copy_msg(const struct msg *m)
+{
+	uint32_t len;
+	struct msg *c;
+
+	len = unpack_from_be32(&m->len);
+	c = calloc_msg(unpack_from_be16(&m->ty), len);
+	if (!c)
+		return NULL;
+	c->flags = m->flags;
+	memcpy(((char*)c) + sizeof(struct msg), ((const char*)m) +
+		sizeof(struct msg), len - sizeof(struct msg));
+	return c;
+}
+
+/** Find out whether a request failed, even though a reply came back
+ *
+ * A replica which couldn't do what we asked answers with a generic response
+ * holding an error code.  That mustn't win the race while another replica may
+ * still have a proper answer.
+ *
+ * @param call		The call, which must be done
+ *
+ * @return		0 if the request succeeded; a negative error code
+ *			otherwise
+ */
+static int hedge_get_error(struct asend_call *call)
+{
+	int ret;
+	struct mtran *tr;
+
+	ret = asend_call_get_error(call);
+	if (ret)
+		return ret;
+	tr = asend_call_get_mtran(call);
+	if (unpack_from_be16(&tr->m->ty) != mmm_resp_ty)
+		return 0;
+	ret = msg_xdr_decode_as_generic(tr->m);
+	return FORCE_NEGATIVE(ret);
+}
+
+/** Send one of the requests for hedge_send
+ *
+ * @param req		(out param) the request to fill in
+ * @param call		(out param) the call
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int hedge_launch(struct rlat *rl, const struct hedge_conf *conf,
+		struct asend *ctx, struct msgr *msgr, uint8_t flags,
+		struct msg *m, const struct endpoint *ep, int idx, int timeo,
+		int first, struct hedge_req *req, struct asend_call **call)
+{
+	uint64_t delay_us;
+	struct msg *c;
+
+	if (first) {
+		/* The first request can use the caller's message. */
+		msg_addref(m);
+		c = m;
+	}
+	else {
+		c = hedge_copy_msg(m);
+		if (!c)
+			return -ENOMEM;
+	}
+	*call = asend_add(ctx, msgr, flags | ASF_RESP, c, ep[idx].ip,
+		ep[idx].port, timeo, NULL, NULL);
+	if (IS_ERR(*call)) {
+		msg_release(c);
+		return FORCE_NEGATIVE(PTR_ERR(*call));
+	}
+	delay_us = rlat_get_pct(rl, ep[idx].ip, ep[idx].port, conf->pct);
+	if ((delay_us == 0) || (delay_us > conf->max_delay_us))
+		delay_us = conf->max_delay_us;
+	else if (delay_us < conf->min_delay_us)
+		delay_us = conf->min_delay_us;
+	req->idx = idx;
+	req->finished = 0;
+	req->start_us = mt_time_usec();
+	req->hedge_us = req->start_us + delay_us;
+	return 0;
+}
+
+/** Figure out how long hedge_send should wait before sending another request
+ *
+ * @return		The time to wait in milliseconds, or -1 to wait until
+ *			something happens
+ */
+static int hedge_get_wait_ms(const struct hedge_req *reqs, int ncalls,
+		int num_outstanding, int have_spare)
+{
+	int i;
+	uint64_t now;
+
+	/* We only ever hedge against one slow request at a time. */
+	if ((!have_spare) || (num_outstanding != 1))
+		return -1;
+	for (i = 0; i < ncalls; ++i) {
+		if (!reqs[i].finished)
+			break;
+	}
+	now = mt_time_usec();
+	if (reqs[i].hedge_us <= now)
+		return 0;
+	return (reqs[i].hedge_us - now + 999) / 1000;
+}
+
+struct msg *hedge_send(struct rlat *rl, const struct hedge_conf *conf,
+		struct asend *ctx, struct msgr *msgr, uint8_t flags,
+		struct msg *m, const struct endpoint *ep, int num_ep,
+		int timeo, int *idx)
+{
+	int i, ret, order[RF_MAX_OID], next = 0, ncalls = 0, launch = 1;
+	int num_outstanding = 0, winner = -1, err = -EIO, wait_ms, found;
+	struct hedge_req reqs[RF_MAX_OID];
+	struct asend_call *calls[RF_MAX_OID];
+	struct msg *resp;
+	struct mtran *tr;
+	uint64_t now;
+
+	if ((num_ep <= 0) || (num_ep > RF_MAX_OID))
+		return ERR_PTR(EINVAL);
+	rlat_rank(rl, ep, num_ep, order);
+	while (1) {
+		if (launch && (next < num_ep)) {
+			ret = hedge_launch(rl, conf, ctx, msgr, flags, m, ep,
+				order[next++], timeo, (ncalls == 0),
+				&reqs[ncalls], &calls[ncalls]);
+			if (ret) {
+				err = ret;
+				continue;
+			}
+			ncalls++;
+			num_outstanding++;
+		}
+		if (num_outstanding == 0)
+			break;
+		wait_ms = hedge_get_wait_ms(reqs, ncalls, num_outstanding,
+			(next < num_ep));
+		asend_wait_quorum_timed(ctx, calls, ncalls, 1, wait_ms);
+		now = mt_time_usec();
+		found = 0;
+		for (i = 0; i < ncalls; ++i) {
+			if (reqs[i].finished || !asend_call_done(calls[i]))
+				continue;
+			reqs[i].finished = 1;
+			num_outstanding--;
+			found = 1;
+			ret = hedge_get_error(calls[i]);
+			if (ret == 0) {
+				rlat_record(rl, ep[reqs[i].idx].ip,
+					ep[reqs[i].idx].port,
+					now - reqs[i].start_us);
+				if (winner < 0)
+					winner = i;
+			}
+			else {
+				/* Count a failure as if the replica had taken
+				 * the whole timeout to answer, so that we
+				 * steer clear of it for a while. */
+				rlat_record(rl, ep[reqs[i].idx].ip,
+					ep[reqs[i].idx].port,
+					((uint64_t)timeo) * 1000000ULL);
+				err = ret;
+			}
+		}
+		if (winner >= 0)
+			break;
+		/* Try another replica if everything we sent has failed, or if
+		 * the request in flight is overdue. */
+		launch = (num_outstanding == 0) || ((!found) && (wait_ms >= 0));
+	}
+	if (winner < 0) {
+		resp = ERR_PTR(FORCE_POSITIVE(err));
+	}
+	else {
+		tr = asend_call_get_mtran(calls[winner]);
+		resp = tr->m;
+		tr->m = NULL;
+		if (idx)
+			*idx = reqs[winner].idx;
+	}
+	now = mt_time_usec();
+	for (i = 0; i < ncalls; ++i) {
+		if (!reqs[i].finished) {
+			/* This replica lost the race.  We know it took at
+			 * least this long. */
+			rlat_record(rl, ep[reqs[i].idx].ip,
+				ep[reqs[i].idx].port, now - reqs[i].start_us);
+		}
+		asend_call_free(calls[i]);
+	}
+	return resp;
+}
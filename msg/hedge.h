@@ -0,0 +1,139 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_MSG_HEDGE_H
+#define REDFISH_MSG_HEDGE_H
+
+/*
+ * Hedged requests
+ *
+ * When the same data can be read from any of several replicas, one slow
+ * replica shouldn't be able to hold up the reader.  hedge_send sends the
+ * request to the replica which has been answering fastest.  If no reply has
+ * arrived by the time that replica would normally have answered, it sends the
+ * same request to the next best replica as well, and takes whichever reply
+ * comes back first.
+ *
+ * How long to wait before hedging is learned from experience.  A struct rlat
+ * keeps a latency histogram for each replica, built from the replies that
+ * hedge_send sees.  Older samples are gradually aged out, so that a replica
+ * which becomes slow (or recovers) is noticed quickly.
+ */
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+struct asend;
+struct endpoint;
+struct msg;
+struct msgr;
+struct rlat;
+
+/** Number of buckets in a replica latency histogram.  Bucket i holds samples
+ * of less than 2^(i+1) microseconds. */
+#define RLAT_BUCKETS 24
+
+/** Configuration for hedged requests */
+struct hedge_conf {
+	/** Percentile of a replica's latency to wait for before hedging */
+	int pct;
+	/** Minimum time to wait before hedging, in microseconds */
+	uint64_t min_delay_us;
+	/** Maximum time to wait before hedging, in microseconds.  This is
+	 * also used for replicas we know nothing about yet. */
+	uint64_t max_delay_us;
+};
+
+/** Create a replica latency tracker
+ *
+ * @return		The tracker, or an error pointer
+ */
+extern struct rlat *rlat_init(void);
+
+/** Free a replica latency tracker
+ *
+ * @param rl		The tracker
+ */
+extern void rlat_free(struct rlat *rl);
+
+/** Record how long a replica took to answer
+ *
+ * @param rl		The tracker
+ * @param ip		The replica's IP address
+ * @param port		The replica's port
+ * @param usec		How long the replica took, in microseconds
+ */
+extern void rlat_record(struct rlat *rl, uint32_t ip, uint16_t port,
+		uint64_t usec);
+
+/** Estimate a percentile of a replica's latency
+ *
+ * @param rl		The tracker
+ * @param ip		The replica's IP address
+ * @param port		The replica's port
+ * @param pct		The percentile, from 0 to 100
+ *
+ * @return		The estimate in microseconds, rounded up to a power of
+ *			two, or 0 if we have no samples for this replica
+ */
+extern uint64_t rlat_get_pct(struct rlat *rl, uint32_t ip, uint16_t port,
+		int pct);
+
+/** Order replicas from fastest to slowest
+ *
+ * Replicas are compared by their median latency.  Replicas we know nothing
+ * about come first, so that we find out about them.
+ *
+ * @param rl		The tracker
+ * @param ep		Array of replicas
+ * @param num_ep	Length of ep
+ * @param order		(out param) indices into ep, fastest first
+ */
+extern void rlat_rank(struct rlat *rl, const struct endpoint *ep,
+		int num_ep, int *order);
+
+/** Send a request to one of several replicas, hedging against slow ones
+ *
+ * Replies and failures are recorded in rl.  If a replica fails, the next one
+ * is tried straight away.  A generic response with a nonzero error code counts
+ * as a failure.  Requests which are still outstanding when a successful reply
+ * arrives are abandoned.
+ *
+ * ctx must not be reaped by anyone else while this is running.
+ *
+ * @param rl		Replica latency tracker
+ * @param conf		Hedging configuration
+ * @param ctx		Asynchronous RPC context to send with
+ * @param msgr		Messenger to send on
+ * @param flags		ASF_* flags.  ASF_RESP is implied.
+ * @param m		The request.  The caller keeps its reference.  Copies
+ *			sent to other replicas keep its flags.
+ * @param ep		Array of replicas to send to
+ * @param num_ep	Length of ep
+ * @param timeo		Timeout for each request, in seconds
+ * @param idx		(out param) index in ep of the replica that answered.
+ *			May be NULL.
+ *
+ * @return		The reply, or an error pointer if no replica answered
+ *			successfully.  The error is the last one we got.
+ */
+extern struct msg *hedge_send(struct rlat *rl, const struct hedge_conf *conf,
+		struct asend *ctx, struct msgr *msgr, uint8_t flags,
+		struct msg *m, const struct endpoint *ep, int num_ep,
+		int timeo, int *idx);
+
+#endif
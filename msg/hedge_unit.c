@@ -0,0 +1,350 @@
+/*
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/alarm.h"
+#include "core/process_ctx.h"
+#include "msg/asend.h"
+#include "msg/hedge.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "msg/types.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/fast_log.h"
+#include "util/macro.h"
+#include "util/packed.h"
+#include "util/test.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Replica which answers straight away */
+#define HEDGE_UNIT_FAST_PORT 9097
+
+/** Replica which never answers */
+#define HEDGE_UNIT_SLOW_PORT 9098
+
+/** Replica which isn't there at all */
+#define HEDGE_UNIT_DEAD_PORT 9099
+
+/** Replica which answers straight away with an error */
+#define HEDGE_UNIT_ERR_PORT 9096
+
+struct msgr_conf g_std_foo_msgr_conf = {
+	.max_conn = 10,
+	.max_tran = 100,
+	.tcp_teardown_timeo = 360,
+	.name = "foo_msgr",
+	.fl_mgr = NULL
+};
+
+struct msgr_conf g_std_fast_msgr_conf = {
+	.max_conn = 10,
+	.max_tran = 100,
+	.tcp_teardown_timeo = 360,
+	.name = "fast_msgr",
+	.fl_mgr = NULL
+};
+
+struct msgr_conf g_std_slow_msgr_conf = {
+	.max_conn = 10,
+	.max_tran = 100,
+	.tcp_teardown_timeo = 360,
+	.name = "slow_msgr",
+	.fl_mgr = NULL
+};
+
+struct msgr_conf g_std_err_msgr_conf = {
+	.max_conn = 10,
+	.max_tran = 100,
+	.tcp_teardown_timeo = 360,
+	.name = "err_msgr",
+	.fl_mgr = NULL
+};
+
+enum {
+	mmm_test50_ty = 9050,
+	mmm_test51_ty,
+};
+
+PACKED(
+struct mmm_test50 {
+	struct msg base;
+	uint32_t x;
+});
+
+PACKED(
+struct mmm_test51 {
+	struct msg base;
+	uint32_t x;
+	uint32_t flags;
+});
+
+static uint32_t g_localhost;
+
+/** Echo x and the message flags back to the sender */
+static void hedge_test_fast_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct mmm_test50 *m;
+	struct mmm_test51 *mout;
+
+	if ((tr->state != MTRAN_STATE_RECV) || IS_ERR(tr->m)) {
+		mtran_free(tr);
+		return;
+	}
+	m = (struct mmm_test50*)tr->m;
+	mout = calloc_msg(mmm_test51_ty, sizeof(struct mmm_test51));
+	if (!mout)
+		abort();
+	pack_to_be32(&mout->x, unpack_from_be32(&m->x));
+	pack_to_be32(&mout->flags, m->base.flags);
+	msg_release((struct msg*)m);
+	tr->m = NULL;
+	mtran_send_next(conn, tr, (struct msg*)mout, 60);
+}
+
+/** Answer every request with ENOENT */
+static void hedge_test_err_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct msg *mout;
+
+	if ((tr->state != MTRAN_STATE_RECV) || IS_ERR(tr->m)) {
+		mtran_free(tr);
+		return;
+	}
+	mout = resp_alloc(ENOENT);
+	if (!mout)
+		abort();
+	msg_release(tr->m);
+	tr->m = NULL;
+	mtran_send_next(conn, tr, mout, 60);
+}
+
+/** Swallow every request without replying */
+static void hedge_test_slow_cb(POSSIBLY_UNUSED(struct mconn *conn),
+		struct mtran *tr)
+{
+	mtran_free(tr);
+}
+
+static struct msgr *hedge_test_start_msgr(struct msgr_conf *conf,
+		msgr_cb_t cb, uint16_t port)
+{
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	struct listen_info linfo;
+	struct msgr *msgr;
+
+	conf->fl_mgr = g_fast_log_mgr;
+	msgr = msgr_init(err, err_len, conf);
+	if (err[0])
+		return NULL;
+	if (cb) {
+		memset(&linfo, 0, sizeof(linfo));
+		linfo.cb = cb;
+		linfo.priv = NULL;
+		linfo.port = port;
+		msgr_listen(msgr, &linfo, err, err_len);
+		if (err[0])
+			return NULL;
+	}
+	msgr_start(msgr, err, err_len);
+	if (err[0])
+		return NULL;
+	return msgr;
+}
+
+static void hedge_test_stop_msgr(struct msgr *msgr)
+{
+	msgr_shutdown(msgr);
+	msgr_free(msgr);
+}
+
+/** Send a request with hedge_send and check the reply
+ *
+ * @return		the index of the replica that answered, or a negative
+ *			error code
+ */
+static int hedge_test_send(struct rlat *rl, const struct hedge_conf *conf,
+		struct asend *ctx, struct msgr *msgr, const struct endpoint *ep,
+		int num_ep, uint32_t x)
+{
+	int idx = -1;
+	struct mmm_test50 *m;
+	struct mmm_test51 *resp;
+
+	m = calloc_msg(mmm_test50_ty, sizeof(struct mmm_test50));
+	if (!m)
+		return -ENOMEM;
+	pack_to_be32(&m->x, x);
+	m->base.flags = MSG_FLAG_MUSTDO;
+	resp = (struct mmm_test51*)hedge_send(rl, conf, ctx, msgr, 0,
+		(struct msg*)m, ep, num_ep, 2, &idx);
+	msg_release((struct msg*)m);
+	if (IS_ERR(resp))
+		return FORCE_NEGATIVE(PTR_ERR(resp));
+	if ((unpack_from_be16(&resp->base.ty) != mmm_test51_ty) ||
+			(unpack_from_be32(&resp->x) != x) ||
+			(unpack_from_be32(&resp->flags) != MSG_FLAG_MUSTDO)) {
+		msg_release((struct msg*)resp);
+		return -EIO;
+	}
+	msg_release((struct msg*)resp);
+	return idx;
+}
+
+static int hedge_test_rlat(void)
+{
+	int i, order[3];
+	struct rlat *rl;
+	struct endpoint ep[3];
+
+	rl = rlat_init();
+	EXPECT_NOT_ERRPTR(rl);
+	memset(ep, 0, sizeof(ep));
+	for (i = 0; i < 3; ++i) {
+		ep[i].ip = g_localhost;
+		ep[i].port = 9000 + i;
+	}
+	EXPECT_ZERO(rlat_get_pct(rl, ep[0].ip, ep[0].port, 50));
+	for (i = 0; i < 100; ++i)
+		rlat_record(rl, ep[0].ip, ep[0].port, 100);
+	for (i = 0; i < 90; ++i)
+		rlat_record(rl, ep[1].ip, ep[1].port, 10000);
+	for (i = 0; i < 10; ++i)
+		rlat_record(rl, ep[1].ip, ep[1].port, 1000000);
+	EXPECT_EQ(rlat_get_pct(rl, ep[0].ip, ep[0].port, 50), 128);
+	EXPECT_EQ(rlat_get_pct(rl, ep[0].ip, ep[0].port, 99), 128);
+	EXPECT_EQ(rlat_get_pct(rl, ep[1].ip, ep[1].port, 50), 16384);
+	EXPECT_EQ(rlat_get_pct(rl, ep[1].ip, ep[1].port, 95), 1048576);
+	/* The replica we know nothing about goes first, then the fast one. */
+	rlat_rank(rl, ep, 3, order);
+	EXPECT_EQ(order[0], 2);
+	EXPECT_EQ(order[1], 0);
+	EXPECT_EQ(order[2], 1);
+	/* Once a replica slows down, it falls behind. */
+	for (i = 0; i < 1000; ++i)
+		rlat_record(rl, ep[0].ip, ep[0].port, 100000);
+	for (i = 0; i < 1000; ++i)
+		rlat_record(rl, ep[2].ip, ep[2].port, 10);
+	rlat_rank(rl, ep, 3, order);
+	EXPECT_EQ(order[0], 2);
+	EXPECT_EQ(order[1], 1);
+	EXPECT_EQ(order[2], 0);
+	rlat_free(rl);
+	return 0;
+}
+
+static int hedge_test_send_all(void)
+{
+	struct msgr *foo_msgr, *fast_msgr, *slow_msgr, *err_msgr;
+	struct asend *ctx;
+	struct asend_call *reaped[1];
+	struct rlat *rl;
+	struct endpoint ep[2];
+	struct hedge_conf conf = {
+		.pct = 95,
+		.min_delay_us = 1000,
+		.max_delay_us = 50000,
+	};
+	uint64_t start;
+
+	foo_msgr = hedge_test_start_msgr(&g_std_foo_msgr_conf, NULL, 0);
+	EXPECT_NOT_EQ(foo_msgr, NULL);
+	fast_msgr = hedge_test_start_msgr(&g_std_fast_msgr_conf,
+		hedge_test_fast_cb, HEDGE_UNIT_FAST_PORT);
+	EXPECT_NOT_EQ(fast_msgr, NULL);
+	slow_msgr = hedge_test_start_msgr(&g_std_slow_msgr_conf,
+		hedge_test_slow_cb, HEDGE_UNIT_SLOW_PORT);
+	EXPECT_NOT_EQ(slow_msgr, NULL);
+	err_msgr = hedge_test_start_msgr(&g_std_err_msgr_conf,
+		hedge_test_err_cb, HEDGE_UNIT_ERR_PORT);
+	EXPECT_NOT_EQ(err_msgr, NULL);
+	ctx = asend_init();
+	EXPECT_NOT_ERRPTR(ctx);
+	rl = rlat_init();
+	EXPECT_NOT_ERRPTR(rl);
+	memset(ep, 0, sizeof(ep));
+
+	/* We know nothing about either replica, so the slow one gets asked
+	 * first.  After max_delay_us, we should hedge to the fast one, with
+	 * the same message flags. */
+	ep[0].ip = g_localhost;
+	ep[0].port = HEDGE_UNIT_SLOW_PORT;
+	ep[1].ip = g_localhost;
+	ep[1].port = HEDGE_UNIT_FAST_PORT;
+	start = mt_time_usec();
+	EXPECT_EQ(hedge_test_send(rl, &conf, ctx, foo_msgr, ep, 2, 123), 1);
+	EXPECT_GE(mt_time_usec() - start, conf.max_delay_us);
+	EXPECT_LT(mt_time_usec() - start, 1000000);
+	EXPECT_NOT_EQ(rlat_get_pct(rl, ep[1].ip, ep[1].port, 50), 0);
+
+	/* Now that we know which replica is fast, it gets asked first. */
+	start = mt_time_usec();
+	EXPECT_EQ(hedge_test_send(rl, &conf, ctx, foo_msgr, ep, 2, 456), 1);
+	EXPECT_LT(mt_time_usec() - start, conf.max_delay_us);
+
+	/* A replica that refuses the connection is skipped right away. */
+	ep[0].port = HEDGE_UNIT_DEAD_PORT;
+	rlat_free(rl);
+	rl = rlat_init();
+	EXPECT_NOT_ERRPTR(rl);
+	EXPECT_EQ(hedge_test_send(rl, &conf, ctx, foo_msgr, ep, 2, 789), 1);
+
+	/* If no replica answers, we get an error. */
+	EXPECT_EQ(hedge_test_send(rl, &conf, ctx, foo_msgr, ep, 1, 1),
+		-ECONNREFUSED);
+
+	/* An error reply doesn't win the race. */
+	ep[0].port = HEDGE_UNIT_ERR_PORT;
+	rlat_free(rl);
+	rl = rlat_init();
+	EXPECT_NOT_ERRPTR(rl);
+	EXPECT_EQ(hedge_test_send(rl, &conf, ctx, foo_msgr, ep, 2, 321), 1);
+	EXPECT_EQ(hedge_test_send(rl, &conf, ctx, foo_msgr, ep, 1, 2),
+		-ENOENT);
+
+	/* Wait for the abandoned request to the slow replica to time out. */
+	EXPECT_ZERO(asend_reap(ctx, reaped, 1, 1));
+	rlat_free(rl);
+	asend_free(ctx);
+	hedge_test_stop_msgr(foo_msgr);
+	hedge_test_stop_msgr(fast_msgr);
+	hedge_test_stop_msgr(slow_msgr);
+	hedge_test_stop_msgr(err_msgr);
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	timer_t timer;
+	time_t t;
+
+	EXPECT_ZERO(utility_ctx_init(argv[0]));
+	t = mt_time() + 600;
+	EXPECT_ZERO(mt_set_alarm(t, "hedge_unit timed out", &timer));
+	EXPECT_ZERO(get_localhost_ipv4(&g_localhost));
+	EXPECT_ZERO(hedge_test_rlat());
+	EXPECT_ZERO(hedge_test_send_all());
+	EXPECT_ZERO(mt_deactivate_alarm(timer));
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,447 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "msg/lpack.h"
+#include "msg/msg.h"
+#include "msg/mslab.h"
+#include "msg/types.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/string.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Length of the header at the start of the payload */
+#define LPACK_HDR_LEN (3 * sizeof(uint32_t))
+
+/** Longest possible varint */
+#define LPACK_VARINT_MAX 10
+
+/** Most bytes an entry can take up, not counting its path component */
+#define LPACK_ENTRY_MAX_OVERHEAD ((LPACK_VARINT_MAX * 9) + sizeof(uint16_t) + 1)
+
+/** Payload space to start out with */
+#define LPACK_INIT_CAP 2048
+
+/** String table space to start out with */
+#define LPACK_INIT_STRTAB_CAP 256
+
+/** Number of string hash table slots to start out with */
+#define LPACK_INIT_STRS_SIZE 16
+
+/** Largest payload we will encode */
+#define LPACK_MAX_LEN 0x7fffffffU
+
+static char *lpack_put_varint(char *p, uint64_t u)
+{
+	while (u >= 0x80) {
+		*p++ = (char)((u & 0x7f) | 0x80);
+		u >>= 7;
+	}
+	*p++ = (char)u;
+	return p;
+}
+
+/** Encode the difference between two values as a zigzag varint
+ *
+ * Small differences in either direction come out as short varints.
+ */
+static char *lpack_put_delta(char *p, uint64_t val, uint64_t prev)
+{
+	int64_t d = (int64_t)(val - prev);
+
+	return lpack_put_varint(p, (((uint64_t)d) << 1) ^ (uint64_t)(d >> 63));
+}
+
+static int lpack_get_varint(const char **pos, const char *end, uint64_t *u)
+{
+	int shift;
+	uint64_t v = 0;
+	const char *p = *pos;
+
+	for (shift = 0; shift < LPACK_VARINT_MAX * 7; shift += 7) {
+		if (p >= end)
+			return -EINVAL;
+		v |= ((uint64_t)(*p & 0x7f)) << shift;
+		if (!(*p++ & 0x80)) {
+			*u = v;
+			*pos = p;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int lpack_get_delta(const char **pos, const char *end, uint64_t prev,
+		uint64_t *val)
+{
+	uint64_t u;
+
+	if (lpack_get_varint(pos, end, &u))
+		return -EINVAL;
+	*val = prev + ((u >> 1) ^ (-(u & 1)));
+	return 0;
+}
+
+static int lpack_get_u32(const char **pos, const char *end, uint32_t *val)
+{
+	uint64_t u;
+
+	if (lpack_get_varint(pos, end, &u))
+		return -EINVAL;
+	if (u > 0xffffffffULL)
+		return -EINVAL;
+	*val = u;
+	return 0;
+}
+
+/** Decode a length-prefixed, NUL-terminated string
+ *
+ * @param pos		(inout) position
+ * @param end		end of the buffer
+ * @param str		(out param) the string
+ * @param len		(out param) the length of the string
+ *
+ * @return		0 on success; -EINVAL if the string is malformed
+ */
+static int lpack_get_str(const char **pos, const char *end, const char **str,
+		uint32_t *len)
+{
+	uint32_t l;
+
+	if (lpack_get_u32(pos, end, &l))
+		return -EINVAL;
+	if ((uint32_t)(end - *pos) <= l)
+		return -EINVAL;
+	if ((*pos)[l] != '\0')
+		return -EINVAL;
+	*str = *pos;
+	*len = l;
+	*pos += l + 1;
+	return 0;
+}
+
+int lpack_enc_init(struct lpack_enc *enc)
+{
+	memset(enc, 0, sizeof(struct lpack_enc));
+	enc->cap = LPACK_INIT_CAP;
+	enc->m = mslab_alloc(sizeof(struct msg) + enc->cap);
+	if (!enc->m)
+		goto error;
+	enc->len = LPACK_HDR_LEN;
+	enc->strtab_cap = LPACK_INIT_STRTAB_CAP;
+	enc->strtab = malloc(enc->strtab_cap);
+	if (!enc->strtab)
+		goto error_free_msg;
+	enc->strs_size = LPACK_INIT_STRS_SIZE;
+	enc->strs = calloc(enc->strs_size, sizeof(struct lpack_str));
+	if (!enc->strs)
+		goto error_free_strtab;
+	return 0;
+
+error_free_strtab:
+	free(enc->strtab);
+error_free_msg:
+	mslab_free(enc->m);
+error:
+	memset(enc, 0, sizeof(struct lpack_enc));
+	return -ENOMEM;
+}
+
+/** Make sure there is room for more bytes in the payload
+ *
+ * @param enc		The encoder
+ * @param len		Number of bytes we want to add
+ *
+ * @return		Pointer to the space, or an error pointer
+ */
+static char *lpack_enc_reserve(struct lpack_enc *enc, uint32_t len)
+{
+	uint32_t cap;
+	struct msg *m;
+
+	if (len > LPACK_MAX_LEN - enc->len)
+		return ERR_PTR(EINVAL);
+	if (enc->len + len > enc->cap) {
+		cap = enc->cap;
+		while (cap < enc->len + len) {
+			if (cap > LPACK_MAX_LEN / 2)
+				cap = LPACK_MAX_LEN;
+			else
+				cap *= 2;
+		}
+		m = mslab_realloc(enc->m, sizeof(struct msg) + cap);
+		if (!m)
+			return ERR_PTR(ENOMEM);
+		enc->m = m;
+		enc->cap = cap;
+	}
+	return enc->m->data + enc->len;
+}
+
+/** Double the size of the string hash table
+ *
+ * @param enc		The encoder
+ *
+ * @return		0 on success; -ENOMEM on OOM
+ */
+static int lpack_enc_grow_strs(struct lpack_enc *enc)
+{
+	uint32_t i, j, size, mask;
+	struct lpack_str *strs;
+
+	size = enc->strs_size * 2;
+	mask = size - 1;
+	strs = calloc(size, sizeof(struct lpack_str));
+	if (!strs)
+		return -ENOMEM;
+	for (i = 0; i < enc->strs_size; ++i) {
+		if (!enc->strs[i].idx)
+			continue;
+		j = enc->strs[i].hash & mask;
+		while (strs[j].idx)
+			j = (j + 1) & mask;
+		strs[j] = enc->strs[i];
+	}
+	free(enc->strs);
+	enc->strs = strs;
+	enc->strs_size = size;
+	return 0;
+}
+
+/** Find a string in the string table, adding it if it isn't there yet
+ *
+ * @param enc		The encoder
+ * @param str		The string
+ *
+ * @return		The index of the string, or a negative error code
+ */
+static int64_t lpack_enc_intern(struct lpack_enc *enc, const char *str)
+{
+	int ret;
+	uint32_t i, h, len, mask, cap;
+	char *strtab, *p;
+
+	h = ohash_str(str);
+	mask = enc->strs_size - 1;
+	for (i = h & mask; enc->strs[i].idx; i = (i + 1) & mask) {
+		if ((enc->strs[i].hash == h) &&
+				(!strcmp(enc->strtab + enc->strs[i].off, str)))
+			return enc->strs[i].idx - 1;
+	}
+	/* Not there yet.  Keep the hash table at most half full. */
+	if ((enc->num_str + 1) * 2 > enc->strs_size) {
+		ret = lpack_enc_grow_strs(enc);
+		if (ret)
+			return ret;
+		mask = enc->strs_size - 1;
+		for (i = h & mask; enc->strs[i].idx; i = (i + 1) & mask)
+			;
+	}
+	len = strlen(str);
+	if (len > LPACK_MAX_LEN - LPACK_VARINT_MAX - 1 - enc->strtab_len)
+		return -EINVAL;
+	if (enc->strtab_len + LPACK_VARINT_MAX + len + 1 > enc->strtab_cap) {
+		cap = enc->strtab_cap;
+		while (cap < enc->strtab_len + LPACK_VARINT_MAX + len + 1) {
+			if (cap > LPACK_MAX_LEN / 2)
+				cap = LPACK_MAX_LEN;
+			else
+				cap *= 2;
+		}
+		strtab = realloc(enc->strtab, cap);
+		if (!strtab)
+			return -ENOMEM;
+		enc->strtab = strtab;
+		enc->strtab_cap = cap;
+	}
+	p = lpack_put_varint(enc->strtab + enc->strtab_len, len);
+	memcpy(p, str, len + 1);
+	enc->strs[i].off = p - enc->strtab;
+	enc->strs[i].hash = h;
+	enc->strs[i].idx = ++enc->num_str;
+	enc->strtab_len = (p - enc->strtab) + len + 1;
+	return enc->num_str - 1;
+}
+
+int lpack_enc_add(struct lpack_enc *enc, const struct lpack_entry *e)
+{
+	int64_t uidx, gidx;
+	char *start, *p;
+
+	uidx = lpack_enc_intern(enc, e->user);
+	if (uidx < 0)
+		return uidx;
+	gidx = lpack_enc_intern(enc, e->group);
+	if (gidx < 0)
+		return gidx;
+	if (e->pcomp_len > LPACK_MAX_LEN - LPACK_ENTRY_MAX_OVERHEAD)
+		return -EINVAL;
+	start = lpack_enc_reserve(enc,
+		e->pcomp_len + LPACK_ENTRY_MAX_OVERHEAD);
+	if (IS_ERR(start))
+		return FORCE_NEGATIVE(PTR_ERR(start));
+	p = lpack_put_varint(start, e->pcomp_len);
+	memcpy(p, e->pcomp, e->pcomp_len);
+	p += e->pcomp_len;
+	*p++ = '\0';
+	p = lpack_put_delta(p, e->nid, enc->prev_nid);
+	p = lpack_put_delta(p, e->mtime, enc->prev_mtime);
+	p = lpack_put_delta(p, e->atime, e->mtime);
+	p = lpack_put_varint(p, e->length);
+	p = lpack_put_varint(p, e->block_sz);
+	pack_to_be16(p, e->mode_and_type);
+	p += sizeof(uint16_t);
+	p = lpack_put_varint(p, e->man_repl);
+	p = lpack_put_varint(p, uidx);
+	p = lpack_put_varint(p, gidx);
+	enc->len += p - start;
+	enc->num_ent++;
+	enc->prev_nid = e->nid;
+	enc->prev_mtime = e->mtime;
+	return 0;
+}
+
+struct msg *lpack_enc_finish(struct lpack_enc *enc)
+{
+	char *p;
+	struct msg *m;
+	uint32_t strtab_off;
+
+	strtab_off = enc->len;
+	p = lpack_enc_reserve(enc, enc->strtab_len);
+	if (IS_ERR(p)) {
+		lpack_enc_free(enc);
+		return (struct msg*)p;
+	}
+	memcpy(p, enc->strtab, enc->strtab_len);
+	enc->len += enc->strtab_len;
+	m = enc->m;
+	if ((enc->cap > MSLAB_MAX_CLASS_SIZE) && (enc->cap / 2 > enc->len)) {
+		/* Give back a lot of unused space.  If this fails, we can
+		 * just keep the space. */
+		m = mslab_realloc(enc->m, sizeof(struct msg) + enc->len);
+		if (!m)
+			m = enc->m;
+	}
+	memset(m, 0, sizeof(struct msg));
+	pack_to_be32(&m->len, sizeof(struct msg) + enc->len);
+	pack_to_be16(&m->ty, mmm_listdir_compact_resp_ty);
+	pack_to_8(&m->refcnt, 1);
+	pack_to_be32(m->data, enc->num_ent);
+	pack_to_be32(m->data + sizeof(uint32_t), enc->num_str);
+	pack_to_be32(m->data + (2 * sizeof(uint32_t)), strtab_off);
+	enc->m = NULL;
+	lpack_enc_free(enc);
+	return m;
+}
+
+void lpack_enc_free(struct lpack_enc *enc)
+{
+	mslab_free(enc->m);
+	free(enc->strtab);
+	free(enc->strs);
+	memset(enc, 0, sizeof(struct lpack_enc));
+}
+
+int lpack_dec_init(struct lpack_dec *dec, const struct msg *m)
+{
+	uint32_t i, xl, num_ent, num_str, strtab_off, len;
+	const char *p, *end;
+
+	memset(dec, 0, sizeof(struct lpack_dec));
+	xl = unpack_from_be32(&m->len) - sizeof(struct msg);
+	if ((xl > LPACK_MAX_LEN) || (xl < LPACK_HDR_LEN))
+		return -EINVAL;
+	num_ent = unpack_from_be32(m->data);
+	num_str = unpack_from_be32(m->data + sizeof(uint32_t));
+	strtab_off = unpack_from_be32(m->data + (2 * sizeof(uint32_t)));
+	if ((strtab_off < LPACK_HDR_LEN) || (strtab_off > xl))
+		return -EINVAL;
+	/* Every entry takes up at least 12 bytes, and every string at least
+	 * 2, so we don't have to trust these counts. */
+	if (num_ent > (strtab_off - LPACK_HDR_LEN) / 12)
+		return -EINVAL;
+	if (num_str > (xl - strtab_off) / 2)
+		return -EINVAL;
+	if (num_str) {
+		dec->strs = malloc(num_str * sizeof(char*));
+		if (!dec->strs)
+			return -ENOMEM;
+	}
+	p = m->data + strtab_off;
+	end = m->data + xl;
+	for (i = 0; i < num_str; ++i) {
+		if (lpack_get_str(&p, end, &dec->strs[i], &len)) {
+			lpack_dec_free(dec);
+			return -EINVAL;
+		}
+	}
+	dec->pos = m->data + LPACK_HDR_LEN;
+	dec->end = m->data + strtab_off;
+	dec->rem_ent = num_ent;
+	dec->num_str = num_str;
+	return num_ent;
+}
+
+int lpack_dec_next(struct lpack_dec *dec, struct lpack_entry *e)
+{
+	uint32_t uidx, gidx;
+
+	if (dec->rem_ent == 0)
+		return 0;
+	if (lpack_get_str(&dec->pos, dec->end, &e->pcomp, &e->pcomp_len))
+		return -EINVAL;
+	if (lpack_get_delta(&dec->pos, dec->end, dec->prev_nid, &e->nid))
+		return -EINVAL;
+	if (lpack_get_delta(&dec->pos, dec->end, dec->prev_mtime, &e->mtime))
+		return -EINVAL;
+	if (lpack_get_delta(&dec->pos, dec->end, e->mtime, &e->atime))
+		return -EINVAL;
+	if (lpack_get_varint(&dec->pos, dec->end, &e->length))
+		return -EINVAL;
+	if (lpack_get_varint(&dec->pos, dec->end, &e->block_sz))
+		return -EINVAL;
+	if (dec->end - dec->pos < (int)sizeof(uint16_t))
+		return -EINVAL;
+	e->mode_and_type = unpack_from_be16(dec->pos);
+	dec->pos += sizeof(uint16_t);
+	if (lpack_get_u32(&dec->pos, dec->end, &e->man_repl))
+		return -EINVAL;
+	if (lpack_get_u32(&dec->pos, dec->end, &uidx))
+		return -EINVAL;
+	if (lpack_get_u32(&dec->pos, dec->end, &gidx))
+		return -EINVAL;
+	if ((uidx >= dec->num_str) || (gidx >= dec->num_str))
+		return -EINVAL;
+	e->user = dec->strs[uidx];
+	e->group = dec->strs[gidx];
+	dec->prev_nid = e->nid;
+	dec->prev_mtime = e->mtime;
+	dec->rem_ent--;
+	return 1;
+}
+
+void lpack_dec_free(struct lpack_dec *dec)
+{
+	free(dec->strs);
+	dec->strs = NULL;
+}
@@ -0,0 +1,197 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_MSG_LPACK_DOT_H
+#define REDFISH_MSG_LPACK_DOT_H
+
+/*
+ * Compact listdir encoding
+ *
+ * An mmm_listdir_resp sends every field of every rf_stat as XDR, including
+ * the owner and group names, which are almost always the same few strings.
+ * mmm_listdir_compact_resp carries the same information in far fewer bytes:
+ *
+ * header	three big-endian 32-bit words: the number of entries, the
+ *		number of strings in the string table, and the offset of the
+ *		string table from the start of the payload
+ * entries	one after another, each made up of:
+ *		pcomp		varint length, the bytes, and a NUL
+ *		nid		zigzag varint, difference from the previous nid
+ *		mtime		zigzag varint, difference from the previous mtime
+ *		atime		zigzag varint, difference from this mtime
+ *		length		varint
+ *		block_sz	varint
+ *		mode_and_type	big-endian 16-bit
+ *		man_repl	varint
+ *		user		varint index into the string table
+ *		group		varint index into the string table
+ * string table	each string as a varint length, the bytes, and a NUL
+ *
+ * Varints are little-endian base 128, as in protocol buffers.  The first entry
+ * is diffed against zero.
+ *
+ * Because strings are NUL-terminated on the wire, the decoder can hand them
+ * back as pointers into the message without copying them.
+ */
+
+#include <stdint.h> /* for uint32_t, etc. */
+
+struct msg;
+
+/** A directory entry, as seen by the compact listdir encoder and decoder */
+struct lpack_entry {
+	/** Path component.  NUL-terminated. */
+	const char *pcomp;
+	/** Length of pcomp */
+	uint32_t pcomp_len;
+	uint64_t nid;
+	uint64_t mtime;
+	uint64_t atime;
+	uint64_t length;
+	uint64_t block_sz;
+	uint16_t mode_and_type;
+	uint32_t man_repl;
+	/** Owner name.  NUL-terminated. */
+	const char *user;
+	/** Group name.  NUL-terminated. */
+	const char *group;
+};
+
+/** A slot in the encoder's hash table of strings */
+struct lpack_str {
+	/** Offset of the string in the encoded string table */
+	uint32_t off;
+	/** Hash of the string */
+	uint32_t hash;
+	/** Index of the string in the table, plus one.  0 if this slot is
+	 * empty. */
+	uint32_t idx;
+};
+
+/** Builds a compact listdir response */
+struct lpack_enc {
+	/** The message being built */
+	struct msg *m;
+	/** Space available for the payload */
+	uint32_t cap;
+	/** Current length of the payload */
+	uint32_t len;
+	/** Number of entries so far */
+	uint32_t num_ent;
+	/** nid of the previous entry */
+	uint64_t prev_nid;
+	/** mtime of the previous entry */
+	uint64_t prev_mtime;
+	/** The encoded string table */
+	char *strtab;
+	/** Space available for strtab */
+	uint32_t strtab_cap;
+	/** Length of strtab */
+	uint32_t strtab_len;
+	/** Hash table of the strings in the string table */
+	struct lpack_str *strs;
+	/** Number of slots in strs.  Always a power of two. */
+	uint32_t strs_size;
+	/** Number of strings in the string table */
+	uint32_t num_str;
+};
+
+/** Reads a compact listdir response */
+struct lpack_dec {
+	/** Next byte to decode */
+	const char *pos;
+	/** End of the entries */
+	const char *end;
+	/** Number of entries left to decode */
+	uint32_t rem_ent;
+	/** Number of strings in the string table */
+	uint32_t num_str;
+	/** The strings in the string table */
+	const char **strs;
+	/** nid of the previous entry */
+	uint64_t prev_nid;
+	/** mtime of the previous entry */
+	uint64_t prev_mtime;
+};
+
+/** Start building a compact listdir response
+ *
+ * @param enc		The encoder
+ *
+ * @return		0 on success; -ENOMEM on OOM
+ */
+extern int lpack_enc_init(struct lpack_enc *enc);
+
+/** Add an entry to a compact listdir response
+ *
+ * The strings in the entry are copied, so they don't need to outlive this call.
+ *
+ * @param enc		The encoder
+ * @param e		The entry
+ *
+ * @return		0 on success; -ENOMEM on OOM; -EINVAL if the
+ *			response would be too big
+ */
+extern int lpack_enc_add(struct lpack_enc *enc, const struct lpack_entry *e);
+
+/** Finish building a compact listdir response
+ *
+ * Whether or not this succeeds, the encoder is freed.
+ *
+ * @param enc		The encoder
+ *
+ * @return		The mmm_listdir_compact_resp message, or an error pointer
+ */
+extern struct msg *lpack_enc_finish(struct lpack_enc *enc);
+
+/** Free an encoder without finishing the response
+ *
+ * @param enc		The encoder
+ */
+extern void lpack_enc_free(struct lpack_enc *enc);
+
+/** Start reading a compact listdir response
+ *
+ * @param dec		The decoder
+ * @param m		The message.  This must stay around until we're done
+ *			with the decoder and the entries it returns.
+ *
+ * @return		The number of entries in the response, or a negative
+ *			error code
+ */
+extern int lpack_dec_init(struct lpack_dec *dec, const struct msg *m);
+
+/** Read the next entry of a compact listdir response
+ *
+ * The strings in the entry point into the message.
+ *
+ * @param dec		The decoder
+ * @param e		(out param) the entry
+ *
+ * @return		1 if we read an entry; 0 if there are no more;
+ *			-EINVAL if the message is malformed
+ */
+extern int lpack_dec_next(struct lpack_dec *dec, struct lpack_entry *e);
+
+/** Free a decoder
+ *
+ * @param dec		The decoder
+ */
+extern void lpack_dec_free(struct lpack_dec *dec);
+
+#endif
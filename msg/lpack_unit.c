@@ -0,0 +1,273 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * limitations under the License.
+ */
+
+#include "core/process_ctx.h"
+#include "msg/lpack.h"
+#include "msg/msg.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LPACK_UNIT_MAX_ENT 10000
+
+static const char *g_users[] = { "hadoop", "hdfs", "alice" };
+
+static const char *g_groups[] = { "supergroup", "users" };
+
+/** Make up a directory entry
+ *
+ * @param i		Index of the entry
+ * @param pcomp		(out param) buffer for the path component
+ * @param e		(out param) the entry
+ */
+static void lpack_test_fill(int i, char *pcomp, struct lpack_entry *e)
+{
+	snprintf(pcomp, RF_PCOMP_MAX, "part-%05d", i);
+	e->pcomp = pcomp;
+	e->pcomp_len = strlen(pcomp);
+	/* Neighboring entries usually have nearby nids and times, but not
+	 * always in order. */
+	e->nid = 100000 + (i * 7) - ((i % 3) * 20);
+	e->mtime = 1334000000000ULL + (i * 1000) - ((i % 5) * 3000);
+	e->atime = e->mtime + (i % 7);
+	e->length = (i % 11) ? (64ULL * 1024 * 1024 * i) : 0;
+	e->block_sz = 64ULL * 1024 * 1024;
+	e->mode_and_type = (i % 13) ? 0644 : 040755;
+	e->man_repl = 3;
+	e->user = g_users[i % 3];
+	e->group = g_groups[(i / 3) % 2];
+}
+
+static int lpack_test_cmp(const struct lpack_entry *a,
+		const struct lpack_entry *b)
+{
+	EXPECT_EQ(a->pcomp_len, b->pcomp_len);
+	EXPECT_ZERO(strcmp(a->pcomp, b->pcomp));
+	EXPECT_EQ(a->nid, b->nid);
+	EXPECT_EQ(a->mtime, b->mtime);
+	EXPECT_EQ(a->atime, b->atime);
+	EXPECT_EQ(a->length, b->length);
+	EXPECT_EQ(a->block_sz, b->block_sz);
+	EXPECT_EQ(a->mode_and_type, b->mode_and_type);
+	EXPECT_EQ(a->man_repl, b->man_repl);
+	EXPECT_ZERO(strcmp(a->user, b->user));
+	EXPECT_ZERO(strcmp(a->group, b->group));
+	return 0;
+}
+
+/** Get the length of the same listing encoded as an mmm_listdir_resp */
+static uint32_t lpack_test_xdr_len(int num_ent)
+{
+	int i;
+	uint32_t len;
+	char pcomp[RF_PCOMP_MAX];
+	struct mmm_listdir_resp resp;
+	struct lpack_entry e;
+	struct rf_lentry *le;
+	struct msg *m;
+
+	le = calloc(num_ent, sizeof(struct rf_lentry));
+	if (!le)
+		return 0;
+	for (i = 0; i < num_ent; ++i) {
+		lpack_test_fill(i, pcomp, &e);
+		le[i].pcomp = strdup(pcomp);
+		le[i].stat.mtime = e.mtime;
+		le[i].stat.atime = e.atime;
+		le[i].stat.length = e.length;
+		le[i].stat.nid = e.nid;
+		le[i].stat.block_sz = e.block_sz;
+		le[i].stat.mode_and_type = e.mode_and_type;
+		le[i].stat.man_repl = e.man_repl;
+		le[i].stat.user = (char*)e.user;
+		le[i].stat.group = (char*)e.group;
+	}
+	resp.le.le_len = num_ent;
+	resp.le.le_val = le;
+	m = MSG_XDR_ALLOC(mmm_listdir_resp, &resp);
+	len = IS_ERR(m) ? 0 : unpack_from_be32(&m->len);
+	if (!IS_ERR(m))
+		msg_release(m);
+	for (i = 0; i < num_ent; ++i)
+		free(le[i].pcomp);
+	free(le);
+	return len;
+}
+
+static int lpack_test_round_trip(int num_ent)
+{
+	int i;
+	char pcomp[RF_PCOMP_MAX];
+	struct lpack_enc enc;
+	struct lpack_dec dec;
+	struct lpack_entry e, d;
+	struct msg *m;
+	uint32_t len, xdr_len;
+
+	EXPECT_ZERO(lpack_enc_init(&enc));
+	for (i = 0; i < num_ent; ++i) {
+		lpack_test_fill(i, pcomp, &e);
+		EXPECT_ZERO(lpack_enc_add(&enc, &e));
+	}
+	m = lpack_enc_finish(&enc);
+	EXPECT_NOT_ERRPTR(m);
+	EXPECT_EQ(unpack_from_be16(&m->ty), mmm_listdir_compact_resp_ty);
+	EXPECT_EQ(lpack_dec_init(&dec, m), num_ent);
+	for (i = 0; i < num_ent; ++i) {
+		lpack_test_fill(i, pcomp, &e);
+		EXPECT_EQ(lpack_dec_next(&dec, &d), 1);
+		EXPECT_ZERO(lpack_test_cmp(&e, &d));
+	}
+	EXPECT_ZERO(lpack_dec_next(&dec, &d));
+	lpack_dec_free(&dec);
+	len = unpack_from_be32(&m->len);
+	xdr_len = lpack_test_xdr_len(num_ent);
+	EXPECT_NOT_EQ(xdr_len, 0);
+	if (num_ent >= 100) {
+		/* The compact encoding should be well under half the size. */
+		EXPECT_LT(len * 2, xdr_len);
+	}
+	msg_release(m);
+	return 0;
+}
+
+static int lpack_test_extremes(void)
+{
+	struct lpack_enc enc;
+	struct lpack_dec dec;
+	struct lpack_entry e, d;
+	struct msg *m;
+
+	memset(&e, 0, sizeof(e));
+	e.pcomp = "";
+	e.user = "";
+	e.group = "";
+	EXPECT_ZERO(lpack_enc_init(&enc));
+	EXPECT_ZERO(lpack_enc_add(&enc, &e));
+	e.pcomp = "x";
+	e.pcomp_len = 1;
+	e.nid = 0xffffffffffffffffULL;
+	e.mtime = 0xffffffffffffffffULL;
+	e.atime = 0;
+	e.length = 0xffffffffffffffffULL;
+	e.block_sz = 0xffffffffffffffffULL;
+	e.mode_and_type = 0xffff;
+	e.man_repl = 0xffffffff;
+	e.user = "u";
+	e.group = "u";
+	EXPECT_ZERO(lpack_enc_add(&enc, &e));
+	m = lpack_enc_finish(&enc);
+	EXPECT_NOT_ERRPTR(m);
+	EXPECT_EQ(lpack_dec_init(&dec, m), 2);
+	EXPECT_EQ(dec.num_str, 2);
+	EXPECT_EQ(lpack_dec_next(&dec, &d), 1);
+	EXPECT_EQ(d.pcomp_len, 0);
+	EXPECT_EQ(d.nid, 0);
+	EXPECT_EQ(lpack_dec_next(&dec, &d), 1);
+	EXPECT_ZERO(lpack_test_cmp(&e, &d));
+	lpack_dec_free(&dec);
+	msg_release(m);
+	return 0;
+}
+
+static int lpack_test_malformed(void)
+{
+	int i;
+	char pcomp[RF_PCOMP_MAX];
+	struct lpack_enc enc;
+	struct lpack_dec dec;
+	struct lpack_entry e, d;
+	struct msg *m;
+	uint32_t len, num_str, strtab_off;
+
+	EXPECT_ZERO(lpack_enc_init(&enc));
+	for (i = 0; i < 10; ++i) {
+		lpack_test_fill(i, pcomp, &e);
+		EXPECT_ZERO(lpack_enc_add(&enc, &e));
+	}
+	m = lpack_enc_finish(&enc);
+	EXPECT_NOT_ERRPTR(m);
+	len = unpack_from_be32(&m->len);
+	num_str = unpack_from_be32(m->data + 4);
+	EXPECT_EQ(num_str, 5);
+	strtab_off = unpack_from_be32(m->data + 8);
+
+	/* Chop off the end of the string table */
+	pack_to_be32(&m->len, len - 1);
+	EXPECT_EQ(lpack_dec_init(&dec, m), -EINVAL);
+	pack_to_be32(&m->len, len);
+
+	/* Claim more entries than there are */
+	pack_to_be32(m->data, 11);
+	EXPECT_EQ(lpack_dec_init(&dec, m), 11);
+	for (i = 0; i < 10; ++i)
+		EXPECT_EQ(lpack_dec_next(&dec, &d), 1);
+	EXPECT_EQ(lpack_dec_next(&dec, &d), -EINVAL);
+	lpack_dec_free(&dec);
+	pack_to_be32(m->data, 0xffffffff);
+	EXPECT_EQ(lpack_dec_init(&dec, m), -EINVAL);
+	pack_to_be32(m->data, 10);
+
+	/* Claim more strings than there are */
+	pack_to_be32(m->data + 4, 0x10000000);
+	EXPECT_EQ(lpack_dec_init(&dec, m), -EINVAL);
+	pack_to_be32(m->data + 4, num_str + 1);
+	EXPECT_EQ(lpack_dec_init(&dec, m), -EINVAL);
+	pack_to_be32(m->data + 4, num_str);
+
+	/* Refer to strings that aren't in the table */
+	pack_to_be32(m->data + 4, 2);
+	EXPECT_EQ(lpack_dec_init(&dec, m), 10);
+	EXPECT_EQ(lpack_dec_next(&dec, &d), 1);
+	EXPECT_EQ(lpack_dec_next(&dec, &d), -EINVAL);
+	lpack_dec_free(&dec);
+	pack_to_be32(m->data + 4, num_str);
+
+	/* A string table that starts past the end of the message */
+	pack_to_be32(m->data + 8, len);
+	EXPECT_EQ(lpack_dec_init(&dec, m), -EINVAL);
+	pack_to_be32(m->data + 8, strtab_off);
+
+	/* Put everything back the way it was */
+	EXPECT_EQ(lpack_dec_init(&dec, m), 10);
+	lpack_dec_free(&dec);
+	msg_release(m);
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	EXPECT_ZERO(utility_ctx_init(argv[0]));
+	EXPECT_ZERO(lpack_test_round_trip(0));
+	EXPECT_ZERO(lpack_test_round_trip(1));
+	EXPECT_ZERO(lpack_test_round_trip(100));
+	EXPECT_ZERO(lpack_test_round_trip(LPACK_UNIT_MAX_ENT));
+	EXPECT_ZERO(lpack_test_extremes());
+	EXPECT_ZERO(lpack_test_malformed());
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
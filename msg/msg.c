@@ -15,6 +15,7 @@
  */
 
 #include "msg/msg.h"
+#include "msg/mslab.h"
 #include "msg/types.h"
 #include "msg/xdr.h"
 #include "util/error.h"
@@ -45,7 +46,7 @@ void *calloc_msg(uint32_t ty, uint32_t len)
 {
 	struct msg *m;
 
-	m = calloc(1, len);
+	m = mslab_zalloc(len);
 	if (!m)
 		return NULL;
 	pack_to_be32(&m->len, len);
@@ -76,7 +77,7 @@ struct msg *msg_shrink(struct msg *m, uint32_t amt)
 		abort();
 	new_len = cur_len - amt;
 	pack_to_be32(&m->len, new_len);
-	r = realloc(m, new_len);
+	r = mslab_realloc(m, new_len);
 	return r ? r : m;
 }
 
@@ -100,7 +101,7 @@ void msg_release(struct msg *msg)
 		abort();
 	--refcnt;
 	if (refcnt == 0) {
-		free(msg);
+		mslab_free(msg);
 	}
 	else {
 		pack_to_8(&msg->refcnt, refcnt);
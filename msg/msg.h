@@ -37,6 +37,17 @@ struct mtran;
  * succeed.  All messages from the primary to replicas should set this flag. */
 #define MSG_FLAG_MUSTDO		0x2
 
+/** Set by the messenger on every message it sends, to tell the peer that it
+ * can decompress messages compressed with LZ4.  See msgr_conf::compress_min.
+ * The receiving messenger clears this before delivering the message. */
+#define MSG_FLAG_LZ4_OK		0x4
+
+/** Set by the messenger when the body of a message is compressed with LZ4.
+ * The body is then the uncompressed body length, as a big-endian 32-bit
+ * integer, followed by an LZ4 block.  The receiving messenger decompresses
+ * the message before delivering it, so nobody else ever sees this flag. */
+#define MSG_FLAG_LZ4		0x8
+
 /** Represents a message sent or received over the network */
 PACKED(
 struct msg {
@@ -69,6 +80,25 @@ struct msg {
  */
 typedef void (*msgr_cb_t)(struct mconn *conn, struct mtran *tr);
 
+/** A message body which lives in a file rather than in memory.
+ *
+ * When one of these is attached to an outgoing transactor, the messenger sends
+ * the in-memory part of the message, followed by 'len' bytes of 'fd' starting
+ * at 'off'.  The file data is sent with do_sendfile, so it never has to be
+ * copied through user space.  The receiver sees an ordinary message.
+ */
+struct msg_fdbody {
+	/** File descriptor to send from */
+	int fd;
+	/** Offset in the file to start at */
+	uint64_t off;
+	/** Number of bytes to send */
+	uint32_t len;
+	/** Called exactly once, after the messenger is done with fd-- whether
+	 * the send succeeded or not.  May be called from any thread. */
+	void (*release)(struct msg_fdbody *fdb);
+};
+
 enum mtran_state {
 	MTRAN_STATE_IDLE = 0,
 	/** The mtran is in the 'pending' queue of an mconn.  It is waiting to
@@ -85,6 +115,12 @@ enum mtran_state {
 	MTRAN_STATE_RECV = 4,
 };
 
+/** Transactor flag: this transactor is part of a bulk data transfer, even if
+ * the message it is sending is small.  For example, a read request whose reply
+ * will be large.  On messengers with more than one connection per endpoint,
+ * bulk transactors are kept off of the connection used for small messages. */
+#define MTRAN_FLAG_BULK 0x1
+
 /** Transactor */
 struct mtran {
 	union {
@@ -132,8 +168,18 @@ struct mtran {
 	 * To get around this issue, we use circular comparisons whenever
 	 * comparing them. */
 	uint16_t timeo_id;
+	/** transactor flags (MTRAN_FLAG_*) */
+	uint16_t flags;
 	/** private data. */
 	void *priv;
+	/** If non-NULL, the file-backed tail of the message we're sending.
+	 * See mtran_attach_fdbody. */
+	struct msg_fdbody *fdb;
+	/** Monotonic time in microseconds at which mtran_send was called, or
+	 * 0 if we are not timing a round trip on this transactor */
+	uint64_t start_us;
+	/** Type of the message given to mtran_send */
+	uint16_t start_ty;
 };
 
 /** Convert an mtran state to a string
@@ -17,22 +17,30 @@
 #include "msg/fast_log.h"
 #include "msg/msg.h"
 #include "msg/msgr.h"
+#include "msg/mslab.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
 #include "util/circ_compare.h"
 #include "util/cram.h"
 #include "util/error.h"
 #include "util/fast_log.h"
 #include "util/fast_log_types.h"
+#include "util/lz4.h"
 #include "util/macro.h"
 #include "util/net.h"
 #include "util/packed.h"
 #include "util/platform/socket.h"
+#include "util/platform/uring.h"
 #include "util/queue.h"
 #include "util/thread.h"
+#include "util/time.h"
 #include "util/tree.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ev.h>
+#include <ifaddrs.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -50,9 +58,19 @@ static void run_msgr_timeout_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
                struct ev_timer *w, int revents);
 static void run_msgr_notify_cb(struct ev_loop *loop, struct ev_async *w,
 		int revents);
+static void run_msgr_local_fd_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
+		struct ev_io *w, int revents);
+static void mconn_want_read(struct mconn *conn);
+static void mconn_want_write(struct mconn *conn);
 static void mtran_deliver_netfail(struct mtran *tr, int err);
+static void mtran_release_fdbody(struct mtran *tr);
 static int mtran_compare_trid(struct mtran *a, struct mtran *b) PURE;
 static int mtran_compare_timeo(struct mtran *a, struct mtran *b) PURE;
+struct msgr_ep;
+static int msgr_ep_compare(struct msgr_ep *a, struct msgr_ep *b) PURE;
+static void mtran_handle_stats_req(struct mconn *conn, struct mtran *tr);
+static void mconn_lz4_compress(struct mconn *conn, struct mtran *tr);
+static int mconn_lz4_decompress(struct mconn *conn);
 
 /****************************** types ********************************/
 enum mconn_state_t {
@@ -98,10 +116,18 @@ struct mconn {
 	uint32_t ip;
 	/** remote port */
 	uint16_t port;
+	/** Which of the outgoing connections to this endpoint this is.  Lane 0
+	 * carries small messages; the others carry bulk transfers.  Incoming
+	 * connections always use lane 0. */
+	uint16_t lane;
 	/** state of this connection */
 	uint16_t state;
 	/** the socket, if connected. -1 if not */
 	int sock;
+	/** 1 if this connection uses a local socket rather than TCP */
+	int local;
+	/** number of bytes queued in pending_head and not yet sent */
+	uint64_t queued_bytes;
 	/** number of bytes sent */
 	int sent_cnt;
 	/** number of bytes received */
@@ -122,8 +148,112 @@ struct mconn {
 	struct timeo_tr timeo_head;
 	/** Number of timeout periods that have passed without any TCP traffic */
 	int timeout_cnt;
+	/** Nonzero if the peer has closed its end of the connection */
+	int read_eof;
+	/** Number of io_uring operations in flight for this connection */
+	int uring_inflight;
+	/** MCONN_URING_* flags */
+	int uring_flags;
+	/** Message that was being sent when the connection was torn down.  We
+	 * hold a reference until the kernel is done with it. */
+	struct msg *uring_send_msg;
+	/** Number of messages received */
+	uint64_t msgs_in;
+	/** Number of messages sent */
+	uint64_t msgs_out;
+	/** Number of bytes received in complete messages */
+	uint64_t bytes_in;
+	/** Number of bytes sent in complete messages */
+	uint64_t bytes_out;
+	/** Number of transactors that timed out on this connection */
+	uint32_t timeouts;
+	/** 1 if the peer can decompress LZ4 messages */
+	int peer_lz4;
+	/** Bodies of compressed messages received, before decompression */
+	uint64_t lz4_comp_in;
+	/** Bodies of compressed messages received, after decompression */
+	uint64_t lz4_raw_in;
+	/** Bodies of compressed messages sent, after compression */
+	uint64_t lz4_comp_out;
+	/** Bodies of compressed messages sent, before compression */
+	uint64_t lz4_raw_out;
 };
 
+/** An io_uring receive (or receive poll) is in flight */
+#define MCONN_URING_RECV_ARMED 0x1
+/** An io_uring send (or send poll) is in flight */
+#define MCONN_URING_SEND_ARMED 0x2
+/** The socket had no data last time; poll before receiving again */
+#define MCONN_URING_RECV_POLL 0x4
+/** The socket was full last time; poll before sending again */
+#define MCONN_URING_SEND_POLL 0x8
+/** The connection has been torn down, but operations are still in flight */
+#define MCONN_URING_DEAD 0x10
+
+/** io_uring operation types.  These are stored in the low bits of the
+ * user_data, next to the connection pointer. */
+enum mconn_uring_op {
+	MCONN_URING_OP_RECV = 0,
+	MCONN_URING_OP_SEND = 1,
+	MCONN_URING_OP_POLL_IN = 2,
+	MCONN_URING_OP_POLL_OUT = 3,
+};
+
+#define MCONN_URING_OP_MASK 0x3ULL
+
+/** Number of submission queue entries in the messenger's ring */
+#define MSGR_URING_ENTRIES 256
+
+/** Number of completions to reap at once */
+#define MSGR_URING_REAP_BATCH 64
+
+/** Statistics about one message type */
+struct msgr_ty_stats {
+	/** 1 if this slot is in use */
+	int in_use;
+	/** The message type */
+	uint16_t ty;
+	uint64_t msgs_in;
+	uint64_t msgs_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	/** Round-trip latency histogram for requests of this type.  See
+	 * MMM_MSGR_LAT_BUCKETS. */
+	uint32_t lat_hist[MMM_MSGR_LAT_BUCKETS];
+};
+
+/** Messenger statistics.
+ *
+ * These are only ever modified by the messenger thread, so they don't need any
+ * locking.  They are cheap enough that we always keep them.
+ */
+struct msgr_stats {
+	uint64_t msgs_in;
+	uint64_t msgs_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t conns_opened;
+	uint64_t conns_accepted;
+	uint64_t reconnects;
+	uint64_t teardowns;
+	uint64_t timeouts;
+	/** Per-type statistics.  This is an open-addressed hash table keyed
+	 * on message type.  Types that don't fit are only counted in the
+	 * totals. */
+	struct msgr_ty_stats ty[MMM_MSGR_STATS_MAX_TY];
+};
+
+/** A remote endpoint that we have opened an outgoing connection to */
+struct msgr_ep {
+	RB_ENTRY(msgr_ep) entry;
+	uint32_t ip;
+	uint16_t port;
+	uint16_t lane;
+};
+
+RB_HEAD(msgr_eps, msgr_ep);
+RB_GENERATE(msgr_eps, msgr_ep, entry, msgr_ep_compare);
+
 enum msgr_state_t {
 	MSGR_STATE_INIT,
 	MSGR_STATE_THREAD_STARTED,
@@ -147,6 +277,29 @@ struct msgr {
 	struct mlisten listen;
 	/** Watches listen_fd */
 	struct ev_io w_listen_fd;
+	/** Local socket we are listening on, or -1 */
+	int local_fd;
+	/** Watches local_fd */
+	struct ev_io w_local_fd;
+	/** 1 if we should use local sockets to reach messengers on this host */
+	int use_local;
+	/** IPv4 addresses of this host, other than loopback addresses */
+	uint32_t *local_addrs;
+	/** Number of entries in local_addrs */
+	int num_local_addrs;
+	/** Next port number to assign to an inbound local connection */
+	uint16_t next_local_port;
+	/** The I/O backend in use */
+	enum msgr_backend backend;
+	/** io_uring ring, or NULL if we're using readiness notification */
+	struct uring *ring;
+	/** Watches the ring for completions */
+	struct ev_io w_uring;
+	/** Submits queued io_uring operations before the loop blocks */
+	struct ev_prepare w_uring_prepare;
+	/** Number of torn-down connections waiting for io_uring operations to
+	 * finish */
+	int uring_dead;
 	/** connections to cancel */
 	struct conn_cancels conn_cancels_head;
 	/** Next transaction ID that will be given out */
@@ -159,7 +312,13 @@ struct msgr {
 	int cur_conn;
 	/** Maximum number of simultaneous connections to allow */
 	int max_conn;
-	/** TCP connections. Keyed on remote IP address */
+	/** Maximum number of outgoing connections per remote endpoint */
+	int conns_per_ep;
+	/** Messages at least this long are bulk transfers */
+	uint32_t bulk_min;
+	/** Message bodies at least this long are compressed, or 0 */
+	uint32_t compress_min;
+	/** TCP connections. Keyed on remote IP address, port, and lane */
 	struct msgr_conn conn_head;
 	/** Async watcher. Lets us know that another thread asked us to shut
 	 * down or send a message. */
@@ -177,6 +336,11 @@ struct msgr {
 	uint16_t timeo_id;
 	/** The name of this messenger */
 	char *name;
+	/** Messenger statistics */
+	struct msgr_stats stats;
+	/** Every endpoint we have opened an outgoing connection to.  Used to
+	 * count reconnects. */
+	struct msgr_eps eps_head;
 };
 
 /****************************** utility ********************************/
@@ -194,10 +358,346 @@ void fast_log_msgr(struct msgr *msgr, uint16_t ty,
 		port, ip, trid, rem_trid, event, event_data);
 }
 
+/** Find the IPv4 addresses of this host
+ *
+ * @param msgr		The messenger
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int msgr_get_local_addrs(struct msgr *msgr)
+{
+	struct ifaddrs *ifa_head, *ifa;
+	uint32_t *addrs;
+	int num_addrs = 0;
+
+	if (getifaddrs(&ifa_head))
+		return errno;
+	for (ifa = ifa_head; ifa; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr && (ifa->ifa_addr->sa_family == AF_INET))
+			num_addrs++;
+	}
+	addrs = calloc(num_addrs + 1, sizeof(uint32_t));
+	if (!addrs) {
+		freeifaddrs(ifa_head);
+		return ENOMEM;
+	}
+	num_addrs = 0;
+	for (ifa = ifa_head; ifa; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr && (ifa->ifa_addr->sa_family == AF_INET)) {
+			addrs[num_addrs++] = ntohl(((struct sockaddr_in*)
+				ifa->ifa_addr)->sin_addr.s_addr);
+		}
+	}
+	freeifaddrs(ifa_head);
+	msgr->local_addrs = addrs;
+	msgr->num_local_addrs = num_addrs;
+	return 0;
+}
+
+/** Determine whether an IPv4 address belongs to this host
+ *
+ * @param msgr		The messenger
+ * @param ip		The address
+ *
+ * @return		1 if we should try to use a local socket to reach ip;
+ *			0 otherwise
+ */
+static int msgr_ip_is_local(const struct msgr *msgr, uint32_t ip)
+{
+	int i;
+
+	if (!msgr->use_local)
+		return 0;
+	if ((ip >> 24) == IN_LOOPBACKNET)
+		return 1;
+	for (i = 0; i < msgr->num_local_addrs; ++i) {
+		if (msgr->local_addrs[i] == ip)
+			return 1;
+	}
+	return 0;
+}
+
+/****************************** stats ********************************/
+static int msgr_ep_compare(struct msgr_ep *a, struct msgr_ep *b)
+{
+	if (a->ip < b->ip)
+		return -1;
+	else if (a->ip > b->ip)
+		return 1;
+	if (a->port < b->port)
+		return -1;
+	else if (a->port > b->port)
+		return 1;
+	if (a->lane < b->lane)
+		return -1;
+	else if (a->lane > b->lane)
+		return 1;
+	return 0;
+}
+
+/** Find the statistics slot for a message type
+ *
+ * @param msgr		The messenger
+ * @param ty		The message type
+ *
+ * @return		The slot, or NULL if the table is full
+ */
+static struct msgr_ty_stats *msgr_get_ty_stats(struct msgr *msgr, uint16_t ty)
+{
+	int i, idx;
+	struct msgr_ty_stats *ts;
+
+	idx = ty % MMM_MSGR_STATS_MAX_TY;
+	for (i = 0; i < MMM_MSGR_STATS_MAX_TY; ++i) {
+		ts = &msgr->stats.ty[idx];
+		if (!ts->in_use) {
+			ts->in_use = 1;
+			ts->ty = ty;
+			return ts;
+		}
+		if (ts->ty == ty)
+			return ts;
+		idx = (idx + 1) % MMM_MSGR_STATS_MAX_TY;
+	}
+	return NULL;
+}
+
+/** Account for a message that has been completely sent
+ *
+ * @param conn		The connection
+ * @param m		The message
+ */
+static void mconn_stats_sent(struct mconn *conn, const struct msg *m)
+{
+	struct msgr *msgr = conn->msgr;
+	struct msgr_ty_stats *ts;
+	uint32_t len = be32toh(m->len);
+
+	conn->msgs_out++;
+	conn->bytes_out += len;
+	msgr->stats.msgs_out++;
+	msgr->stats.bytes_out += len;
+	ts = msgr_get_ty_stats(msgr, be16toh(m->ty));
+	if (ts) {
+		ts->msgs_out++;
+		ts->bytes_out += len;
+	}
+}
+
+/** Account for a message that has been completely received
+ *
+ * If the transactor sent a request with mtran_send, this is the reply, and we
+ * record how long the round trip took.
+ *
+ * @param conn		The connection
+ * @param tr		The transactor the message is being delivered to
+ * @param len		Length of the message as it came off the wire
+ */
+static void mconn_stats_recv(struct mconn *conn, struct mtran *tr,
+		uint32_t len)
+{
+	struct msgr *msgr = conn->msgr;
+	struct msgr_ty_stats *ts;
+	uint64_t usec;
+	int bucket;
+
+	conn->msgs_in++;
+	conn->bytes_in += len;
+	msgr->stats.msgs_in++;
+	msgr->stats.bytes_in += len;
+	ts = msgr_get_ty_stats(msgr, be16toh(tr->m->ty));
+	if (ts) {
+		ts->msgs_in++;
+		ts->bytes_in += len;
+	}
+	if (!tr->start_us)
+		return;
+	usec = mt_time_usec() - tr->start_us;
+	tr->start_us = 0;
+	ts = msgr_get_ty_stats(msgr, tr->start_ty);
+	if (!ts)
+		return;
+	bucket = (usec < 2) ? 0 : (63 - __builtin_clzll(usec));
+	if (bucket >= MMM_MSGR_LAT_BUCKETS)
+		bucket = MMM_MSGR_LAT_BUCKETS - 1;
+	ts->lat_hist[bucket]++;
+}
+
+/** Account for a new connection
+ *
+ * @param conn		The connection
+ * @param outbound	1 if we opened the connection; 0 if we accepted it
+ */
+static void mconn_stats_created(struct mconn *conn, int outbound)
+{
+	struct msgr *msgr = conn->msgr;
+	struct msgr_ep *ep, exemplar;
+
+	if (!outbound) {
+		msgr->stats.conns_accepted++;
+		return;
+	}
+	msgr->stats.conns_opened++;
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.ip = conn->ip;
+	exemplar.port = conn->port;
+	exemplar.lane = conn->lane;
+	if (RB_FIND(msgr_eps, &msgr->eps_head, &exemplar)) {
+		msgr->stats.reconnects++;
+		return;
+	}
+	ep = calloc(1, sizeof(struct msgr_ep));
+	if (!ep)
+		return;
+	ep->ip = conn->ip;
+	ep->port = conn->port;
+	ep->lane = conn->lane;
+	RB_INSERT(msgr_eps, &msgr->eps_head, ep);
+}
+
+/** Create a message describing the messenger's statistics
+ *
+ * @param msgr		The messenger
+ * @param flags		MMM_MSGR_STATS_* flags from the request
+ *
+ * @return		The message, or an error pointer
+ */
+static struct msg *msgr_stats_to_msg(struct msgr *msgr, int flags)
+{
+	struct mmm_msgr_stats_resp resp;
+	struct mmm_msgr_ty_stats *tys = NULL;
+	struct mmm_msgr_conn_stats *cs = NULL, *c;
+	struct msgr_ty_stats *ts;
+	struct mconn *conn;
+	struct mtran *tr;
+	char name[MMM_MSGR_NAME_MAX];
+	struct msg *m;
+	int i, num_ty = 0, num_conn = 0;
+
+	memset(&resp, 0, sizeof(resp));
+	snprintf(name, sizeof(name), "%s", msgr->name);
+	resp.name = name;
+	resp.backend = msgr->backend;
+	resp.msgs_in = msgr->stats.msgs_in;
+	resp.msgs_out = msgr->stats.msgs_out;
+	resp.bytes_in = msgr->stats.bytes_in;
+	resp.bytes_out = msgr->stats.bytes_out;
+	resp.conns_opened = msgr->stats.conns_opened;
+	resp.conns_accepted = msgr->stats.conns_accepted;
+	resp.reconnects = msgr->stats.reconnects;
+	resp.teardowns = msgr->stats.teardowns;
+	resp.timeouts = msgr->stats.timeouts;
+	tys = calloc(MMM_MSGR_STATS_MAX_TY, sizeof(struct mmm_msgr_ty_stats));
+	if (!tys) {
+		m = ERR_PTR(ENOMEM);
+		goto done;
+	}
+	for (i = 0; i < MMM_MSGR_STATS_MAX_TY; ++i) {
+		ts = &msgr->stats.ty[i];
+		if (!ts->in_use)
+			continue;
+		tys[num_ty].ty = ts->ty;
+		tys[num_ty].msgs_in = ts->msgs_in;
+		tys[num_ty].msgs_out = ts->msgs_out;
+		tys[num_ty].bytes_in = ts->bytes_in;
+		tys[num_ty].bytes_out = ts->bytes_out;
+		memcpy(tys[num_ty].lat_hist, ts->lat_hist,
+			sizeof(tys[num_ty].lat_hist));
+		num_ty++;
+	}
+	resp.ty.ty_len = num_ty;
+	resp.ty.ty_val = tys;
+	RB_FOREACH(conn, msgr_conn, &msgr->conn_head) {
+		resp.num_conn++;
+	}
+	if (flags & MMM_MSGR_STATS_CONNS) {
+		num_conn = (resp.num_conn > MMM_MSGR_STATS_MAX_CONN) ?
+			MMM_MSGR_STATS_MAX_CONN : resp.num_conn;
+		cs = calloc(num_conn + 1, sizeof(struct mmm_msgr_conn_stats));
+		if (!cs) {
+			m = ERR_PTR(ENOMEM);
+			goto done;
+		}
+		i = 0;
+		RB_FOREACH(conn, msgr_conn, &msgr->conn_head) {
+			if (i >= num_conn)
+				break;
+			c = &cs[i++];
+			c->ip = conn->ip;
+			c->port = conn->port;
+			c->lane = conn->lane;
+			if (conn->local)
+				c->flags |= MMM_MSGR_CONN_LOCAL;
+			if (conn->state == MCONN_ESTABLISHED)
+				c->flags |= MMM_MSGR_CONN_ESTABLISHED;
+			if (conn->read_eof)
+				c->flags |= MMM_MSGR_CONN_READ_EOF;
+			if (conn->peer_lz4)
+				c->flags |= MMM_MSGR_CONN_LZ4;
+			c->msgs_in = conn->msgs_in;
+			c->msgs_out = conn->msgs_out;
+			c->bytes_in = conn->bytes_in;
+			c->bytes_out = conn->bytes_out;
+			c->queued_bytes = conn->queued_bytes;
+			STAILQ_FOREACH(tr, &conn->pending_head,
+					u.pending_entry) {
+				c->pending++;
+			}
+			RB_FOREACH(tr, active_tr, &conn->active_head) {
+				c->active++;
+			}
+			c->timeouts = conn->timeouts;
+			c->lz4_comp_in = conn->lz4_comp_in;
+			c->lz4_raw_in = conn->lz4_raw_in;
+			c->lz4_comp_out = conn->lz4_comp_out;
+			c->lz4_raw_out = conn->lz4_raw_out;
+		}
+		resp.conn.conn_len = num_conn;
+		resp.conn.conn_val = cs;
+	}
+	m = MSG_XDR_ALLOC(mmm_msgr_stats_resp, &resp);
+done:
+	free(cs);
+	free(tys);
+	return m;
+}
+
+/** Answer a request for messenger statistics
+ *
+ * This is used as the transactor callback for incoming mmm_msgr_stats_req
+ * messages, instead of the listener's callback.
+ */
+static void mtran_handle_stats_req(struct mconn *conn, struct mtran *tr)
+{
+	struct mmm_msgr_stats_req req;
+	struct msg *m;
+	int flags = 0;
+
+	if ((tr->state != MTRAN_STATE_RECV) || IS_ERR(tr->m)) {
+		/* Either we sent the reply, or the connection went away. */
+		mtran_free(tr);
+		return;
+	}
+	memset(&req, 0, sizeof(req));
+	if (MSG_XDR_DECODE(mmm_msgr_stats_req, tr->m, &req) >= 0)
+		flags = req.flags;
+	msg_release(tr->m);
+	tr->m = NULL;
+	m = msgr_stats_to_msg(conn->msgr, flags);
+	if (IS_ERR(m)) {
+		m = resp_alloc(PTR_ERR(m));
+		if (IS_ERR(m)) {
+			mtran_free(tr);
+			return;
+		}
+	}
+	mtran_send_next(conn, tr, m, MSGR_INCOMING_TIMEO);
+}
+
 /****************************** mtran ********************************/
 void *mtran_alloc(struct msgr *msgr)
 {
-	struct mtran *tr = calloc(1, sizeof(struct mtran));
+	struct mtran *tr = mslab_zalloc(sizeof(struct mtran));
 	if (!tr)
 		return NULL;
 	// TODO: should really make this thread-local so we don't have to suffer
@@ -213,7 +713,27 @@ void mtran_free(struct mtran *tr)
 {
 	if (!IS_ERR(tr->m))
 		msg_release(tr->m);
-	free(tr);
+	mtran_release_fdbody(tr);
+	mslab_free(tr);
+}
+
+void mtran_attach_fdbody(struct mtran *tr, struct msg *m,
+			struct msg_fdbody *fdb)
+{
+	if (tr->fdb)
+		abort();
+	tr->fdb = fdb;
+	pack_to_be32(&m->len, unpack_from_be32(&m->len) + fdb->len);
+}
+
+static void mtran_release_fdbody(struct mtran *tr)
+{
+	struct msg_fdbody *fdb = tr->fdb;
+
+	if (!fdb)
+		return;
+	tr->fdb = NULL;
+	fdb->release(fdb);
 }
 
 static int mtran_compare_trid(struct mtran *a, struct mtran *b)
@@ -258,6 +778,8 @@ void mtran_send(struct msgr *msgr, struct mtran *tr,
 	tr->cb = cb;
 	tr->priv = priv;
 	tr->m = m;
+	tr->start_us = mt_time_usec();
+	tr->start_ty = be16toh(m->ty);
 	m->rem_trid = htobe32(tr->trid);
 	m->trid = htobe32(tr->rem_trid);
 	pthread_spin_lock(&msgr->lock);
@@ -294,12 +816,14 @@ void mtran_send_next(struct mconn *conn, struct mtran *tr, struct msg *m,
 	tr->timeo_id = (uint16_t)conn->msgr->timeo_id + (uint16_t)timeo;
 	m->rem_trid = htobe32(tr->trid);
 	m->trid = htobe32(tr->rem_trid);
+	mconn_lz4_compress(conn, tr);
+	conn->queued_bytes += be32toh(tr->m->len);
 	STAILQ_INSERT_TAIL(&conn->pending_head, tr, u.pending_entry);
 	RB_INSERT(timeo_tr, &conn->timeo_head, tr);
 	fast_log_msgr(conn->msgr, FAST_LOG_MSGR_DEBUG,
 		tr->port, tr->ip, tr->trid,
-		tr->rem_trid, FLME_MTRAN_SEND_NEXT, be16toh(m->ty));
-	ev_io_start(conn->msgr->loop, &conn->w_write);
+		tr->rem_trid, FLME_MTRAN_SEND_NEXT, be16toh(tr->m->ty));
+	mconn_want_write(conn);
 }
 
 void mtran_recv_next(struct mconn *conn, struct mtran *tr)
@@ -334,6 +858,11 @@ struct msgr *mconn_get_msgr(struct mconn *conn)
 	return conn->msgr;
 }
 
+enum msgr_backend msgr_get_backend(const struct msgr *msgr)
+{
+	return msgr->backend;
+}
+
 static void mtran_deliver_netfail(struct mtran *tr, int err)
 {
 	if (tr->state == MTRAN_STATE_SENDING)
@@ -342,13 +871,54 @@ static void mtran_deliver_netfail(struct mtran *tr, int err)
 		tr->state = MTRAN_STATE_RECV;
 	if (!IS_ERR(tr->m))
 		msg_release(tr->m);
+	mtran_release_fdbody(tr);
 	tr->m = ERR_PTR(FORCE_POSITIVE(err));
 	tr->cb(NULL, tr);
 }
 
 /****************************** mconn ********************************/
+/** Connect to a messenger on this host using a local socket
+ *
+ * @param conn		The connection
+ *
+ * @return		The new socket on success; a negative error code
+ *			otherwise
+ */
+static int mconn_connect_local(struct mconn *conn)
+{
+	int ret, res, sock;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+
+	ret = get_local_sockaddr(conn->port, &addr, &addr_len);
+	if (ret)
+		return ret;
+	sock = do_socket(AF_UNIX, SOCK_STREAM, 0,
+			WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+	if (sock < 0)
+		return sock;
+	/* Local connects either succeed or fail right away.  If nobody is
+	 * listening, or the listener's backlog is full, the caller will fall
+	 * back on TCP. */
+	RETRY_ON_EINTR(ret, connect(sock, (struct sockaddr*)&addr, addr_len));
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+	/* Anyone can bind the local address, not just the messenger that
+	 * owns the TCP port.  Don't send anything to a stranger. */
+	ret = check_local_peer(sock);
+	if (ret)
+		goto error;
+	return sock;
+
+error:
+	RETRY_ON_EINTR(res, close(sock));
+	return ret;
+}
+
 static struct mconn *mconn_create(struct msgr *msgr,
-		uint32_t ip, uint16_t port, int sock)
+		uint32_t ip, uint16_t port, uint16_t lane, int sock)
 {
 	int ret;
 	struct mconn *conn;
@@ -367,6 +937,8 @@ static struct mconn *mconn_create(struct msgr *msgr,
 	conn->msgr = msgr;
 	conn->ip = ip;
 	conn->port = port;
+	conn->lane = lane;
+	conn->queued_bytes = 0;
 	conn->sent_cnt = 0;
 	conn->recv_cnt = 0;
 	conn->inbound_tr = NULL;
@@ -375,9 +947,25 @@ static struct mconn *mconn_create(struct msgr *msgr,
 	RB_INIT(&conn->timeo_head);
 	STAILQ_INIT(&conn->pending_head);
 	RB_INSERT(msgr_conn, &msgr->conn_head, conn);
+	mconn_stats_created(conn, (sock < 0));
+	if ((sock < 0) && (msgr_ip_is_local(msgr, ip))) {
+		sock = mconn_connect_local(conn);
+		if (sock < 0) {
+			fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, port, ip, 0,
+				0, FLME_LOCAL_CONN_FAILED,
+				cram_into_u16(FORCE_POSITIVE(sock)));
+		}
+		else {
+			fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, port, ip, 0,
+				0, FLME_LOCAL_CONN_ESTABLISHED, 0);
+			conn->local = 1;
+		}
+	}
 	if (sock < 0) {
+		/* We always write whole messages, so there's nothing to be
+		 * gained by letting Nagle hold back the tail of one. */
 		conn->sock = do_socket(AF_INET, SOCK_STREAM, 0,
-				WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+			WANT_O_CLOEXEC | WANT_O_NONBLOCK | WANT_TCP_NODELAY);
 		if (conn->sock < 0) {
 			fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, port, ip, 0,
 				0, FLME_DO_SOCKET_FAILED,
@@ -411,7 +999,8 @@ static struct mconn *mconn_create(struct msgr *msgr,
 		}
 		ev_io_init(&conn->w_write, mconn_writable_cb,
 			conn->sock, EV_WRITE);
-		ev_io_start(msgr->loop, &conn->w_write);
+		if (conn->state == MCONN_CONNECTING)
+			ev_io_start(msgr->loop, &conn->w_write);
 	}
 	else {
 		conn->sock = sock;
@@ -421,19 +1010,68 @@ static struct mconn *mconn_create(struct msgr *msgr,
 	}
 	ev_io_init(&conn->w_read, mconn_readable_cb,
 		conn->sock, EV_READ);
-	ev_io_start(msgr->loop, &conn->w_read);
+	mconn_want_read(conn);
 	return conn;
 }
 
-static struct mconn* mconn_find(struct msgr* msgr, uint32_t ip, uint16_t port)
+static struct mconn* mconn_find(struct msgr* msgr, uint32_t ip, uint16_t port,
+		uint16_t lane)
 {
 	struct mconn exemplar;
 	memset(&exemplar, 0, sizeof(exemplar));
 	exemplar.ip = ip;
 	exemplar.port = port;
+	exemplar.lane = lane;
 	return RB_FIND(msgr_conn, &msgr->conn_head, &exemplar);
 }
 
+static int mtran_is_bulk(const struct msgr *msgr, const struct mtran *tr)
+{
+	uint32_t len;
+
+	if (tr->flags & MTRAN_FLAG_BULK)
+		return 1;
+	len = be32toh(tr->m->len);
+	return len >= msgr->bulk_min;
+}
+
+/** Choose which of the connections to an endpoint a transactor should use.
+ *
+ * Small messages always go out on lane 0, so that they never have to wait
+ * behind bulk data.  Bulk transfers go to an idle bulk connection if there is
+ * one, then to a bulk connection that hasn't been opened yet, and finally to
+ * whichever bulk connection has the least data queued.
+ *
+ * @param msgr		The messenger
+ * @param tr		The transactor
+ *
+ * @return		The lane to use
+ */
+static uint16_t msgr_choose_lane(struct msgr *msgr, const struct mtran *tr)
+{
+	int lane, unopened = -1, best = 1;
+	uint64_t best_queued = UINT64_MAX;
+	struct mconn *conn;
+
+	if ((msgr->conns_per_ep <= 1) || (!mtran_is_bulk(msgr, tr)))
+		return 0;
+	for (lane = 1; lane < msgr->conns_per_ep; ++lane) {
+		conn = mconn_find(msgr, tr->ip, tr->port, lane);
+		if (!conn) {
+			if (unopened < 0)
+				unopened = lane;
+			continue;
+		}
+		if (conn->queued_bytes == 0)
+			return lane;
+		if (conn->queued_bytes < best_queued) {
+			best_queued = conn->queued_bytes;
+			best = lane;
+		}
+	}
+	return (unopened < 0) ? best : unopened;
+}
+
 /** Tear down a connection.
  * Deliver failure messages to all pending and active transactors.
  *
@@ -449,9 +1087,24 @@ static void mconn_teardown(struct mconn *conn, int failcode)
 	 * here.  There isn't any reason to do it. */
 	RB_REMOVE(msgr_conn, &msgr->conn_head, conn);
 	conn->msgr->cur_conn--;
+	msgr->stats.teardowns++;
 	ev_io_stop(conn->msgr->loop, &conn->w_write);
 	ev_io_stop(conn->msgr->loop, &conn->w_read);
-	if (conn->inbound_msg) {
+	if (conn->uring_inflight) {
+		/* The kernel may still be receiving into inbound_msg, or
+		 * sending from the message at the head of the pending queue.
+		 * Hang on to both until the outstanding operations complete.
+		 * Shutting down the socket makes sure that happens soon. */
+		conn->uring_flags |= MCONN_URING_DEAD;
+		msgr->uring_dead++;
+		tr = STAILQ_FIRST(&conn->pending_head);
+		if (tr && (conn->uring_flags & MCONN_URING_SEND_ARMED)) {
+			msg_addref(tr->m);
+			conn->uring_send_msg = tr->m;
+		}
+		shutdown(conn->sock, SHUT_RDWR);
+	}
+	else if (conn->inbound_msg) {
 		msg_release(conn->inbound_msg);
 		conn->inbound_msg = NULL;
 	}
@@ -482,7 +1135,8 @@ static void mconn_teardown(struct mconn *conn, int failcode)
 		fast_log_msgr(msgr, severity, conn->port, conn->ip, 0, 0,
 			FLME_CONN_TIMED_OUT, cram_into_u16(num_failed));
 	}
-	free(conn);
+	if (!(conn->uring_flags & MCONN_URING_DEAD))
+		free(conn);
 }
 
 static int mconn_compare(struct mconn *a, struct mconn *b)
@@ -495,6 +1149,10 @@ static int mconn_compare(struct mconn *a, struct mconn *b)
 		return -1;
 	else if (a->port > b->port)
 		return 1;
+	if (a->lane < b->lane)
+		return -1;
+	else if (a->lane > b->lane)
+		return 1;
 	return 0;
 }
 
@@ -520,48 +1178,154 @@ static void mconn_handle_connect(struct msgr *msgr, struct mconn *conn)
 	fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, conn->port, conn->ip,
 		      0, 0, FLME_CONN_ESTABLISHED, 0);
 	conn->state = MCONN_ESTABLISHED;
+	if (msgr->ring) {
+		/* From now on, the ring takes care of this socket. */
+		ev_io_stop(msgr->loop, &conn->w_write);
+		ev_io_stop(msgr->loop, &conn->w_read);
+		mconn_want_read(conn);
+		if (STAILQ_FIRST(&conn->pending_head))
+			mconn_want_write(conn);
+	}
 }
 
-static void mconn_writable_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
-		struct ev_io *w, int revents)
+/** Compress a message that is about to be queued on a connection
+ *
+ * If the message is worth compressing and the peer can decompress it,
+ * tr->m is replaced with a compressed copy.  Otherwise, it is left alone.
+ *
+ * @param conn		The connection
+ * @param tr		The transactor
+ */
+static void mconn_lz4_compress(struct mconn *conn, struct mtran *tr)
 {
-	int ret;
-	int full, amt, res;
-	struct mconn *conn = GET_OUTER(w, struct mconn, w_write);
-	struct msgr *msgr = conn->msgr;
-	struct mtran *tr;
+	struct msg *m = tr->m, *cm;
+	uint32_t body_len, max_len;
+	int comp_len;
 
-	if (revents & EV_ERROR) {
-		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
-			conn->ip, 0, 0, FLME_EV_ERROR, 1);
-		mconn_teardown(conn, ENOMEDIUM);
+	m->flags |= MSG_FLAG_LZ4_OK;
+	if ((!conn->peer_lz4) || (!conn->msgr->compress_min) || tr->fdb)
 		return;
-	}
-	if (!(revents & EV_WRITE))
+	body_len = be32toh(m->len) - sizeof(struct msg);
+	if (body_len < conn->msgr->compress_min)
 		return;
-	conn->timeout_cnt = 0; /* register some activity */
-	if (conn->state == MCONN_CONNECTING) {
-		mconn_handle_connect(msgr, conn);
+	/* If we can't save at least an eighth, it's not worth making the
+	 * other side decompress it. */
+	max_len = body_len - (body_len / 8);
+	cm = mslab_alloc(sizeof(struct msg) + max_len);
+	if (!cm)
 		return;
-	}
-	/* let's send some data */
-	tr = STAILQ_FIRST(&conn->pending_head);
-	if (!tr) {
-		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR,
-			conn->port, conn->ip, 0, 0,
-			FLME_EXPECTED_PENDING_TRANSACTOR, 0);
-		ev_io_stop(msgr->loop, &conn->w_write);
+	comp_len = lz4_compress(m->data, body_len, cm->data + sizeof(uint32_t),
+		max_len - sizeof(uint32_t));
+	if (comp_len <= 0) {
+		mslab_free(cm);
 		return;
 	}
+	memcpy(cm, m, sizeof(struct msg));
+	pack_to_be32(&cm->len, sizeof(struct msg) + sizeof(uint32_t) +
+		comp_len);
+	pack_to_8(&cm->refcnt, 1);
+	cm->flags |= MSG_FLAG_LZ4;
+	pack_to_be32(cm->data, body_len);
+	conn->lz4_raw_out += body_len;
+	conn->lz4_comp_out += sizeof(uint32_t) + comp_len;
+	msg_release(m);
+	/* Give back the space that the compressed body didn't need. */
+	tr->m = msg_shrink(cm, 0);
+}
+
+/** Decompress the message that was just received on a connection
+ *
+ * @param conn		The connection
+ *
+ * @return		0 on success; -EINVAL if the message was malformed;
+ *			-ENOMEM on OOM
+ */
+static int mconn_lz4_decompress(struct mconn *conn)
+{
+	struct msg *m = conn->inbound_msg, *dm;
+	uint32_t comp_len, body_len;
+	int ret;
+
+	comp_len = be32toh(m->len) - sizeof(struct msg);
+	if (comp_len < sizeof(uint32_t))
+		return -EINVAL;
+	comp_len -= sizeof(uint32_t);
+	body_len = unpack_from_be32(m->data);
+	/* LZ4 can't expand anything by more than a factor of 255, so a
+	 * bigger claim than that is bogus. */
+	if ((body_len / 255 > comp_len) ||
+			(body_len > 0x7fffffff - sizeof(struct msg)))
+		return -EINVAL;
+	dm = mslab_alloc(sizeof(struct msg) + body_len);
+	if (!dm)
+		return -ENOMEM;
+	ret = lz4_decompress(m->data + sizeof(uint32_t), comp_len,
+		dm->data, body_len);
+	if (ret) {
+		mslab_free(dm);
+		return ret;
+	}
+	memcpy(dm, m, sizeof(struct msg));
+	pack_to_be32(&dm->len, sizeof(struct msg) + body_len);
+	dm->flags &= ~MSG_FLAG_LZ4;
+	conn->lz4_comp_in += sizeof(uint32_t) + comp_len;
+	conn->lz4_raw_in += body_len;
+	msg_release(m);
+	conn->inbound_msg = dm;
+	return 0;
+}
+
+/** Send as much of a transactor's message as the socket will take
+ *
+ * @param conn		The connection
+ * @param tr		The transactor at the head of the pending queue
+ *
+ * @return		The number of bytes sent, or a negative error code
+ */
+static int mconn_send_some(struct mconn *conn, struct mtran *tr)
+{
+	int full, mem_len, amt, res;
+
 	if (tr->state != MTRAN_STATE_SENDING)
 		abort();
 	full = be32toh(tr->m->len);
 	amt = full - conn->sent_cnt;
 	if (amt <= 0)
 		abort();
-	res = send(conn->sock, tr->m, amt, 0);
+	mem_len = tr->fdb ? (full - (int)tr->fdb->len) : full;
+	if (conn->sent_cnt < mem_len) {
+		res = send(conn->sock, ((char*)tr->m) + conn->sent_cnt,
+			mem_len - conn->sent_cnt, tr->fdb ? MSG_MORE : 0);
+		if (res < 0)
+			res = -errno;
+	}
+	else {
+		res = do_sendfile(conn->sock, tr->fdb->fd,
+			tr->fdb->off + (conn->sent_cnt - mem_len), amt);
+		/* The file must not be shorter than we promised the
+		 * receiver it would be. */
+		if (res == 0)
+			res = -EIO;
+	}
+	return res;
+}
+
+/** Account for the result of sending part of a transactor's message
+ *
+ * If the whole message has been sent, the transactor's callback is invoked.
+ *
+ * @param msgr		The messenger
+ * @param conn		The connection
+ * @param tr		The transactor at the head of the pending queue
+ * @param res		Number of bytes sent, or a negative error code
+ */
+static void mconn_send_done(struct msgr *msgr, struct mconn *conn,
+		struct mtran *tr, int res)
+{
+	int ret, full;
+
 	if (res < 0) {
-		ret = errno;
+		ret = -res;
 		if (is_temporary_socket_error(ret))
 			return;
 		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR,
@@ -571,20 +1335,56 @@ static void mconn_writable_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
 		mconn_teardown(conn, ret);
 		return;
 	}
+	full = be32toh(tr->m->len);
 	conn->sent_cnt += res;
 	if (conn->sent_cnt != full)
 		return;
 	conn->sent_cnt = 0;
+	conn->queued_bytes -= full;
 	STAILQ_REMOVE_HEAD(&conn->pending_head, u.pending_entry);
 	RB_REMOVE(timeo_tr, &conn->timeo_head, tr);
 	if (!STAILQ_FIRST(&conn->pending_head))
 		ev_io_stop(msgr->loop, &conn->w_write);
+	mconn_stats_sent(conn, tr->m);
 	msg_release(tr->m);
+	mtran_release_fdbody(tr);
 	tr->m = NULL;
 	tr->state = MTRAN_STATE_SENT;
 	tr->cb(conn, tr);
 }
 
+static void mconn_writable_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
+		struct ev_io *w, int revents)
+{
+	struct mconn *conn = GET_OUTER(w, struct mconn, w_write);
+	struct msgr *msgr = conn->msgr;
+	struct mtran *tr;
+
+	if (revents & EV_ERROR) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
+			conn->ip, 0, 0, FLME_EV_ERROR, 1);
+		mconn_teardown(conn, ENOMEDIUM);
+		return;
+	}
+	if (!(revents & EV_WRITE))
+		return;
+	conn->timeout_cnt = 0; /* register some activity */
+	if (conn->state == MCONN_CONNECTING) {
+		mconn_handle_connect(msgr, conn);
+		return;
+	}
+	/* let's send some data */
+	tr = STAILQ_FIRST(&conn->pending_head);
+	if (!tr) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR,
+			conn->port, conn->ip, 0, 0,
+			FLME_EXPECTED_PENDING_TRANSACTOR, 0);
+		ev_io_stop(msgr->loop, &conn->w_write);
+		return;
+	}
+	mconn_send_done(msgr, conn, tr, mconn_send_some(conn, tr));
+}
+
 static struct mtran* mconn_create_mtran(struct msgr *msgr, struct mconn *conn,
 					msgr_cb_t cb)
 {
@@ -616,7 +1416,7 @@ static void mtran_handle_orphan(POSSIBLY_UNUSED(struct mconn *conn),
 {
 	/* We ignore messages that were sent to an invalid transactor ID.
 	 * We already issued an error fast_log about the event in
-	 * mconn_read_msg_hdr, so there's nothing to do here.
+	 * mconn_handle_msg_hdr, so there's nothing to do here.
 	 *
 	 * The only reason we even bother to read these messages at all is to
 	 * get the data out of the socket, so that more possibly good data can
@@ -626,45 +1426,56 @@ static void mtran_handle_orphan(POSSIBLY_UNUSED(struct mconn *conn),
 	mtran_free(tr);
 }
 
-static int mconn_read_msg_hdr(struct msgr *msgr, struct mconn *conn)
+/** Find out where the next bytes received on a connection should go
+ *
+ * @param msgr		The messenger
+ * @param conn		The connection
+ * @param buf		(out param) where to receive into
+ * @param amt		(out param) the most bytes we want to receive
+ *
+ * @return		0 on success; -ENOMEM if we couldn't allocate a
+ *			buffer for the message header
+ */
+static int mconn_recv_target(struct msgr *msgr, struct mconn *conn,
+		char **buf, int *amt)
 {
-	struct mtran *tr;
-	struct msg *m;
-	int amt, res, ret;
-	uint32_t m_len, trid, rem_trid;
-
-	/* The message header tells us how long the complete message will be */
-	fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, conn->port,
-		conn->ip, 0, 0, FLME_READING_MSG_HEADER,
-		cram_into_u16(conn->recv_cnt));
-	if (!conn->inbound_msg) {
-		conn->inbound_msg = calloc(1, sizeof(struct msg));
-		if (!conn->inbound_msg) {
-			fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR,
-				conn->port, conn->ip, 0, 0, FLME_OOM, 2);
-			mconn_teardown(conn, ENOMEM);
-			return MSGR_RET_STOP;
-		}
-	}
-	amt = sizeof(struct msg) - conn->recv_cnt;
-	res = read(conn->sock,
-		((char*)conn->inbound_msg) + conn->recv_cnt, amt);
-	/* refcnt needs to stay at 1 so that if we shut down this connection,
-	 * the message gets properly freed. */
-	pack_to_8(&conn->inbound_msg->refcnt, 1);
-	if (res < 0) {
-		ret = errno;
-		if (is_temporary_socket_error(ret))
-			return MSGR_RET_STOP;
-		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
-			conn->ip, 0, 0, FLME_HDR_READ_ERROR, ret);
-		mconn_teardown(conn, ret);
-		return MSGR_RET_STOP;
-	}
-	conn->recv_cnt += res;
 	if (conn->recv_cnt < (int)sizeof(struct msg)) {
-		return MSGR_RET_STOP;
+		/* The message header tells us how long the complete message
+		 * will be */
+		fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, conn->port,
+			conn->ip, 0, 0, FLME_READING_MSG_HEADER,
+			cram_into_u16(conn->recv_cnt));
+		if (!conn->inbound_msg) {
+			conn->inbound_msg = mslab_zalloc(sizeof(struct msg));
+			if (!conn->inbound_msg)
+				return -ENOMEM;
+		}
+		*amt = sizeof(struct msg) - conn->recv_cnt;
+	}
+	else {
+		*amt = be32toh(conn->inbound_msg->len) - conn->recv_cnt;
 	}
+	*buf = ((char*)conn->inbound_msg) + conn->recv_cnt;
+	return 0;
+}
+
+/** Handle a complete message header
+ *
+ * Makes room for the rest of the message and finds the transactor it
+ * belongs to.
+ *
+ * @param msgr		The messenger
+ * @param conn		The connection
+ *
+ * @return		MSGR_RET_CONTINUE on success; MSGR_RET_STOP if the
+ *			connection was torn down.
+ */
+static int mconn_handle_msg_hdr(struct msgr *msgr, struct mconn *conn)
+{
+	struct mtran *tr;
+	struct msg *m;
+	uint32_t m_len, trid, rem_trid;
+
 	m_len = be32toh(conn->inbound_msg->len);
 	if (m_len < sizeof(struct msg)) {
 		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
@@ -672,7 +1483,7 @@ static int mconn_read_msg_hdr(struct msgr *msgr, struct mconn *conn)
 		mconn_teardown(conn, ENAMETOOLONG);
 		return MSGR_RET_STOP;
 	}
-	m = realloc(conn->inbound_msg, m_len);
+	m = mslab_realloc(conn->inbound_msg, m_len);
 	if (!m) {
 		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
 			conn->ip, 0, 0, FLME_OOM, 3);
@@ -683,8 +1494,13 @@ static int mconn_read_msg_hdr(struct msgr *msgr, struct mconn *conn)
 	trid = be32toh(conn->inbound_msg->trid);
 	if (trid == 0) {
 		/* A trid of 0 means that no transactor has been allocated yet
-		 * on this side of the connection. */
-		tr = mconn_create_mtran(msgr, conn, msgr->listen.cb);
+		 * on this side of the connection.  Requests for our statistics
+		 * are answered by the messenger itself. */
+		if (be16toh(conn->inbound_msg->ty) == mmm_msgr_stats_req_ty)
+			tr = mconn_create_mtran(msgr, conn,
+				mtran_handle_stats_req);
+		else
+			tr = mconn_create_mtran(msgr, conn, msgr->listen.cb);
 		if (IS_ERR(tr))
 			return PTR_ERR(tr);
 	}
@@ -713,14 +1529,102 @@ static int mconn_read_msg_hdr(struct msgr *msgr, struct mconn *conn)
 	return MSGR_RET_CONTINUE;
 }
 
+/** Account for the result of receiving part of a message
+ *
+ * If the whole message has arrived, it is delivered to its transactor.
+ *
+ * @param msgr		The messenger
+ * @param conn		The connection
+ * @param res		Number of bytes received, or a negative error code.
+ *			Temporary errors must be handled by the caller.
+ *
+ * @return		MSGR_RET_CONTINUE if more of the message is still
+ *			to come; MSGR_RET_STOP if the message was delivered or
+ *			the connection was torn down.
+ */
+static int mconn_recv_done(struct msgr *msgr, struct mconn *conn, int res)
+{
+	int ret, in_hdr = (conn->recv_cnt < (int)sizeof(struct msg));
+	struct mtran *tr;
+	uint32_t wire_len;
+
+	if (in_hdr) {
+		/* refcnt needs to stay at 1 so that if we shut down this
+		 * connection, the message gets properly freed. */
+		pack_to_8(&conn->inbound_msg->refcnt, 1);
+	}
+	if ((res == 0) && (conn->recv_cnt == 0)) {
+		/* The peer closed the connection between messages. */
+		fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, conn->port,
+			conn->ip, 0, 0, FLME_PEER_CLOSED, 0);
+		if (RB_EMPTY(&conn->active_head) &&
+				STAILQ_EMPTY(&conn->pending_head)) {
+			/* Nobody is using it, so get rid of it now rather
+			 * than holding on to the socket until it times out. */
+			mconn_teardown(conn, ECONNRESET);
+			return MSGR_RET_STOP;
+		}
+		/* Stop reading, and let the teardown timeout deal with the
+		 * transactors that are still waiting. */
+		conn->read_eof = 1;
+		ev_io_stop(msgr->loop, &conn->w_read);
+		return MSGR_RET_STOP;
+	}
+	if (res <= 0) {
+		/* EOF in the middle of a message is a reset as far as the
+		 * transactors are concerned. */
+		ret = (res == 0) ? ECONNRESET : -res;
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
+			conn->ip, 0, 0,
+			in_hdr ? FLME_HDR_READ_ERROR : FLME_READ_ERROR, ret);
+		mconn_teardown(conn, ret);
+		return MSGR_RET_STOP;
+	}
+	conn->recv_cnt += res;
+	if (in_hdr) {
+		if (conn->recv_cnt < (int)sizeof(struct msg))
+			return MSGR_RET_CONTINUE;
+		ret = mconn_handle_msg_hdr(msgr, conn);
+		if (ret != MSGR_RET_CONTINUE)
+			return ret;
+	}
+	wire_len = be32toh(conn->inbound_msg->len);
+	if (conn->recv_cnt != (int)wire_len)
+		return MSGR_RET_CONTINUE;
+	if (conn->inbound_msg->flags & MSG_FLAG_LZ4_OK)
+		conn->peer_lz4 = 1;
+	if (conn->inbound_msg->flags & MSG_FLAG_LZ4) {
+		ret = mconn_lz4_decompress(conn);
+		if (ret) {
+			fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
+				conn->ip, 0, 0, FLME_LZ4_BAD_MSG,
+				cram_into_u16(FORCE_POSITIVE(ret)));
+			mconn_teardown(conn, FORCE_POSITIVE(ret));
+			return MSGR_RET_STOP;
+		}
+	}
+	conn->inbound_msg->flags &= ~MSG_FLAG_LZ4_OK;
+	/* deliver the message */
+	tr = conn->inbound_tr;
+	conn->inbound_tr = NULL;
+	RB_REMOVE(active_tr, &conn->active_head, tr);
+	RB_REMOVE(timeo_tr, &conn->timeo_head, tr);
+	conn->recv_cnt = 0;
+	tr->m = conn->inbound_msg;
+	conn->inbound_msg = NULL;
+	mconn_stats_recv(conn, tr, wire_len);
+	tr->state = MTRAN_STATE_RECV;
+	tr->cb(conn, tr);
+	return MSGR_RET_STOP;
+}
+
 static void mconn_readable_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
 		struct ev_io *w, int revents)
 {
-	int amt, res;
+	int amt, res, ret;
+	char *buf;
 	struct mconn *conn = GET_OUTER(w, struct mconn, w_read);
 	struct msgr *msgr = conn->msgr;
-	struct mtran *tr;
-	uint32_t m_len;
 
 	if (revents & EV_ERROR) {
 		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
@@ -731,43 +1635,277 @@ static void mconn_readable_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
 	if (!(revents & EV_READ))
 		return;
 	conn->timeout_cnt = 0; /* register some activity */
-	if (conn->recv_cnt < (int)sizeof(struct msg)) {
-		if (mconn_read_msg_hdr(msgr, conn) != MSGR_RET_CONTINUE)
-			return;
-	}
-	/* read the remainder of the message body */
-	m_len = be32toh(conn->inbound_msg->len);
-	amt = m_len - conn->recv_cnt;
-	if (amt > 0) {
-		res = recv(conn->sock, conn->inbound_msg->data, amt, 0);
-		if (res <= 0) {
-			int ret = errno;
-			if (is_temporary_socket_error(ret))
-				return;
+	/* Read the header, and then as much of the body as is available. */
+	do {
+		if (mconn_recv_target(msgr, conn, &buf, &amt)) {
 			fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR,
-				conn->port, conn->ip, 0, 0,
-				FLME_READ_ERROR, ret);
-			mconn_teardown(conn, ret);
+				conn->port, conn->ip, 0, 0, FLME_OOM, 2);
+			mconn_teardown(conn, ENOMEM);
 			return;
 		}
-		conn->recv_cnt += res;
-		if (conn->recv_cnt != (int)m_len) {
+		res = recv(conn->sock, buf, amt, 0);
+		if (res < 0) {
+			res = -errno;
+			if (is_temporary_socket_error(-res))
+				return;
+		}
+		ret = mconn_recv_done(msgr, conn, res);
+	} while ((ret == MSGR_RET_CONTINUE) &&
+		 (conn->recv_cnt == (int)sizeof(struct msg)));
+}
+
+/****************************** io_uring ********************************/
+static uint64_t mconn_uring_data(struct mconn *conn, enum mconn_uring_op op)
+{
+	return ((uint64_t)(uintptr_t)conn) | op;
+}
+
+/** Queue the next receive on a connection
+ *
+ * @param conn		The connection
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int mconn_uring_arm_recv(struct mconn *conn)
+{
+	int ret, amt;
+	char *buf;
+	struct msgr *msgr = conn->msgr;
+
+	if (conn->uring_flags & MCONN_URING_RECV_POLL) {
+		ret = uring_prep_poll(msgr->ring, conn->sock, POLLIN,
+			mconn_uring_data(conn, MCONN_URING_OP_POLL_IN));
+	}
+	else {
+		ret = mconn_recv_target(msgr, conn, &buf, &amt);
+		if (ret)
+			return ret;
+		ret = uring_prep_recv(msgr->ring, conn->sock, buf, amt,
+			mconn_uring_data(conn, MCONN_URING_OP_RECV));
+	}
+	if (ret)
+		return ret;
+	conn->uring_flags |= MCONN_URING_RECV_ARMED;
+	conn->uring_inflight++;
+	return 0;
+}
+
+/** Queue the next send on a connection
+ *
+ * File-backed message bodies can't be sent by the ring, so for those we just
+ * wait for the socket to become writable, and then call sendfile.
+ *
+ * @param conn		The connection
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int mconn_uring_arm_send(struct mconn *conn)
+{
+	int ret, full, mem_len;
+	struct msgr *msgr = conn->msgr;
+	struct mtran *tr;
+
+	tr = STAILQ_FIRST(&conn->pending_head);
+	if (!tr)
+		return 0;
+	full = be32toh(tr->m->len);
+	mem_len = tr->fdb ? (full - (int)tr->fdb->len) : full;
+	if ((conn->uring_flags & MCONN_URING_SEND_POLL) ||
+			(conn->sent_cnt >= mem_len)) {
+		ret = uring_prep_poll(msgr->ring, conn->sock, POLLOUT,
+			mconn_uring_data(conn, MCONN_URING_OP_POLL_OUT));
+	}
+	else {
+		ret = uring_prep_send(msgr->ring, conn->sock,
+			((char*)tr->m) + conn->sent_cnt,
+			mem_len - conn->sent_cnt, tr->fdb ? MSG_MORE : 0,
+			mconn_uring_data(conn, MCONN_URING_OP_SEND));
+	}
+	if (ret)
+		return ret;
+	conn->uring_flags |= MCONN_URING_SEND_ARMED;
+	conn->uring_inflight++;
+	return 0;
+}
+
+/** Make sure that we will receive more data on a connection
+ *
+ * @param conn		The connection
+ */
+static void mconn_want_read(struct mconn *conn)
+{
+	int ret;
+	struct msgr *msgr = conn->msgr;
+
+	if (conn->read_eof)
+		return;
+	if (msgr->ring && (conn->state == MCONN_ESTABLISHED) &&
+			!ev_is_active(&conn->w_read)) {
+		if (conn->uring_flags & MCONN_URING_RECV_ARMED)
+			return;
+		ret = mconn_uring_arm_recv(conn);
+		if (!ret)
+			return;
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port, conn->ip,
+			0, 0, FLME_URING_ARM_FAILED,
+			cram_into_u16(FORCE_POSITIVE(ret)));
+	}
+	ev_io_start(msgr->loop, &conn->w_read);
+}
+
+/** Make sure that we will send the pending messages on a connection
+ *
+ * @param conn		The connection
+ */
+static void mconn_want_write(struct mconn *conn)
+{
+	int ret;
+	struct msgr *msgr = conn->msgr;
+
+	if (msgr->ring && (conn->state == MCONN_ESTABLISHED) &&
+			!ev_is_active(&conn->w_write)) {
+		if (conn->uring_flags & MCONN_URING_SEND_ARMED)
 			return;
+		ret = mconn_uring_arm_send(conn);
+		if (!ret)
+			return;
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port, conn->ip,
+			0, 0, FLME_URING_ARM_FAILED,
+			cram_into_u16(FORCE_POSITIVE(ret)));
+	}
+	ev_io_start(msgr->loop, &conn->w_write);
+}
+
+/** Free a connection which was torn down while it still had io_uring
+ * operations in flight.
+ *
+ * @param conn		The connection
+ */
+static void mconn_uring_free_dead(struct mconn *conn)
+{
+	if (conn->inbound_msg) {
+		/* The kernel may have scribbled over the refcnt. */
+		pack_to_8(&conn->inbound_msg->refcnt, 1);
+		msg_release(conn->inbound_msg);
+	}
+	if (conn->uring_send_msg)
+		msg_release(conn->uring_send_msg);
+	conn->msgr->uring_dead--;
+	free(conn);
+}
+
+static void mconn_uring_complete(struct msgr *msgr,
+		const struct uring_cqe_info *cqe)
+{
+	struct mconn *conn = (struct mconn*)(uintptr_t)
+		(cqe->user_data & ~MCONN_URING_OP_MASK);
+	enum mconn_uring_op op = cqe->user_data & MCONN_URING_OP_MASK;
+	struct mtran *tr;
+
+	/* The connection can't be freed while we're in here, because this
+	 * operation still counts towards uring_inflight. */
+	if (conn->uring_flags & MCONN_URING_DEAD)
+		goto done;
+	conn->timeout_cnt = 0; /* register some activity */
+	switch (op) {
+	case MCONN_URING_OP_RECV:
+		conn->uring_flags &= ~MCONN_URING_RECV_ARMED;
+		if (is_temporary_socket_error(-cqe->res)) {
+			conn->uring_flags |= MCONN_URING_RECV_POLL;
+			break;
+		}
+		mconn_recv_done(msgr, conn, cqe->res);
+		break;
+	case MCONN_URING_OP_POLL_IN:
+		/* If the poll failed, the next receive will tell us why. */
+		conn->uring_flags &= ~(MCONN_URING_RECV_ARMED |
+			MCONN_URING_RECV_POLL);
+		break;
+	case MCONN_URING_OP_SEND:
+		conn->uring_flags &= ~MCONN_URING_SEND_ARMED;
+		if (is_temporary_socket_error(-cqe->res)) {
+			conn->uring_flags |= MCONN_URING_SEND_POLL;
+			break;
 		}
+		tr = STAILQ_FIRST(&conn->pending_head);
+		mconn_send_done(msgr, conn, tr, cqe->res);
+		break;
+	case MCONN_URING_OP_POLL_OUT:
+		conn->uring_flags &= ~(MCONN_URING_SEND_ARMED |
+			MCONN_URING_SEND_POLL);
+		tr = STAILQ_FIRST(&conn->pending_head);
+		if (tr)
+			mconn_send_done(msgr, conn, tr,
+				mconn_send_some(conn, tr));
+		break;
+	}
+done:
+	conn->uring_inflight--;
+	if (conn->uring_flags & MCONN_URING_DEAD) {
+		if (conn->uring_inflight == 0)
+			mconn_uring_free_dead(conn);
+		return;
+	}
+	if ((op == MCONN_URING_OP_RECV) || (op == MCONN_URING_OP_POLL_IN))
+		mconn_want_read(conn);
+	else if (STAILQ_FIRST(&conn->pending_head))
+		mconn_want_write(conn);
+}
+
+static void msgr_uring_reap(struct msgr *msgr)
+{
+	int i, num;
+	struct uring_cqe_info cqes[MSGR_URING_REAP_BATCH];
+
+	do {
+		num = uring_reap(msgr->ring, cqes, MSGR_URING_REAP_BATCH);
+		for (i = 0; i < num; ++i)
+			mconn_uring_complete(msgr, &cqes[i]);
+	} while (num == MSGR_URING_REAP_BATCH);
+}
+
+static void run_msgr_uring_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
+		struct ev_io *w, int revents)
+{
+	struct msgr *msgr = GET_OUTER(w, struct msgr, w_uring);
+
+	if (revents & EV_ERROR) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, 0, 0, 0,
+			0, FLME_EV_ERROR, 6);
+		return;
+	}
+	msgr_uring_reap(msgr);
+}
+
+static void run_msgr_uring_prepare_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
+		struct ev_prepare *w, POSSIBLY_UNUSED(int revents))
+{
+	int ret;
+	struct msgr *msgr = GET_OUTER(w, struct msgr, w_uring_prepare);
+
+	/* Everything queued during this pass through the loop goes to the
+	 * kernel in one system call. */
+	ret = uring_submit(msgr->ring, 0);
+	if (ret) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, 0, 0, 0, 0,
+			FLME_URING_SUBMIT_FAILED,
+			cram_into_u16(FORCE_POSITIVE(ret)));
 	}
-	/* deliver the message */
-	tr = conn->inbound_tr;
-	conn->inbound_tr = NULL;
-	RB_REMOVE(active_tr, &conn->active_head, tr);
-	RB_REMOVE(timeo_tr, &conn->timeo_head, tr);
-	conn->recv_cnt = 0;
-	tr->m = conn->inbound_msg;
-	conn->inbound_msg = NULL;
-	tr->state = MTRAN_STATE_RECV;
-	tr->cb(conn, tr);
 }
 
 /****************************** msgr ********************************/
+static enum msgr_backend msgr_choose_backend(enum msgr_backend backend)
+{
+	const char *env;
+
+	if (backend != MSGR_BACKEND_DEFAULT)
+		return backend;
+	env = getenv(MSGR_BACKEND_ENV);
+	if (env && (!strcmp(env, "uring")))
+		return MSGR_BACKEND_URING;
+	return MSGR_BACKEND_EPOLL;
+}
+
 struct msgr *msgr_init(char *err, size_t err_len,
 	const struct msgr_conf *conf)
 {
@@ -793,6 +1931,7 @@ struct msgr *msgr_init(char *err, size_t err_len,
 	}
 	msgr->state = MSGR_STATE_INIT;
 	msgr->listen.fd = -1;
+	msgr->local_fd = -1;
 	msgr->next_trid = random();
 	if (msgr->next_trid == 0)
 		msgr->next_trid++;
@@ -800,9 +1939,22 @@ struct msgr *msgr_init(char *err, size_t err_len,
 	msgr->max_tran = conf->max_tran;
 	msgr->cur_conn = 0;
 	msgr->max_conn = conf->max_conn;
+	msgr->conns_per_ep = conf->conns_per_ep;
+	msgr->bulk_min = (conf->bulk_min > 0) ?
+		conf->bulk_min : MSGR_DEFAULT_BULK_MIN;
+	msgr->compress_min = (conf->compress_min > 0) ?
+		conf->compress_min : 0;
 	msgr->tcp_teardown_timeo = conf->tcp_teardown_timeo;
 	RB_INIT(&msgr->conn_head);
+	RB_INIT(&msgr->eps_head);
 	ev_init(&msgr->w_listen_fd, NULL);
+	ev_init(&msgr->w_local_fd, NULL);
+	if (!conf->no_local) {
+		/* If we can't enumerate our own addresses, we can still use
+		 * local sockets for loopback addresses. */
+		msgr_get_local_addrs(msgr);
+		msgr->use_local = 1;
+	}
 	STAILQ_INIT(&msgr->pending_tr_head);
 	ev_async_init(&msgr->w_notify, run_msgr_notify_cb);
 	ev_timer_init(&msgr->w_timeout, run_msgr_timeout_cb,
@@ -815,6 +1967,24 @@ struct msgr *msgr_init(char *err, size_t err_len,
 	}
 	ev_async_start(msgr->loop, &msgr->w_notify);
 	ev_timer_start(msgr->loop, &msgr->w_timeout);
+	ev_init(&msgr->w_uring, NULL);
+	ev_init(&msgr->w_uring_prepare, NULL);
+	msgr->backend = msgr_choose_backend(conf->backend);
+	if (msgr->backend == MSGR_BACKEND_URING) {
+		/* If the kernel can't do it, quietly fall back to epoll. */
+		if (uring_init(MSGR_URING_ENTRIES, &msgr->ring)) {
+			msgr->ring = NULL;
+			msgr->backend = MSGR_BACKEND_EPOLL;
+		}
+		else {
+			ev_io_init(&msgr->w_uring, run_msgr_uring_cb,
+				uring_get_fd(msgr->ring), EV_READ);
+			ev_io_start(msgr->loop, &msgr->w_uring);
+			ev_prepare_init(&msgr->w_uring_prepare,
+				run_msgr_uring_prepare_cb);
+			ev_prepare_start(msgr->loop, &msgr->w_uring_prepare);
+		}
+	}
 	msgr->fl_mgr = conf->fl_mgr;
 	return msgr;
 }
@@ -834,27 +2004,88 @@ void msgr_shutdown(struct msgr *msgr)
 		ev_async_send(msgr->loop, &msgr->w_notify);
 		redfish_thread_join(&msgr->rt);
 	}
+	/* mconn_teardown removes the connection from conn_head */
 	RB_FOREACH_SAFE(conn, msgr_conn, &msgr->conn_head, conn_tmp) {
-		RB_REMOVE(msgr_conn, &msgr->conn_head, conn);
 		mconn_teardown(conn, ECANCELED);
 	}
+	/* Wait for the kernel to finish with any connections that still had
+	 * operations in flight. */
+	while (msgr->uring_dead > 0) {
+		if (uring_submit(msgr->ring, 1))
+			break;
+		msgr_uring_reap(msgr);
+	}
 }
 
 void msgr_free(struct msgr *msgr)
 {
 	int res;
+	struct msgr_ep *ep, *ep_tmp;
 
 	pthread_spin_destroy(&msgr->lock);
 	ev_io_stop(msgr->loop, &msgr->w_listen_fd);
+	ev_io_stop(msgr->loop, &msgr->w_local_fd);
 	ev_async_stop(msgr->loop, &msgr->w_notify);
 	ev_timer_stop(msgr->loop, &msgr->w_timeout);
+	if (msgr->ring) {
+		ev_io_stop(msgr->loop, &msgr->w_uring);
+		ev_prepare_stop(msgr->loop, &msgr->w_uring_prepare);
+		uring_free(msgr->ring);
+	}
 	ev_loop_destroy(msgr->loop);
 	if (msgr->listen.fd > 0)
 		RETRY_ON_EINTR(res, close(msgr->listen.fd));
+	if (msgr->local_fd > 0)
+		RETRY_ON_EINTR(res, close(msgr->local_fd));
+	RB_FOREACH_SAFE(ep, msgr_eps, &msgr->eps_head, ep_tmp) {
+		RB_REMOVE(msgr_eps, &msgr->eps_head, ep);
+		free(ep);
+	}
+	free(msgr->local_addrs);
 	free(msgr->name);
 	free(msgr);
 }
 
+/** Listen on the local socket associated with a TCP port
+ *
+ * Clients on this host will try the local socket before TCP.  So if somebody
+ * else already holds the local address, we must not carry on as if nothing
+ * were wrong: they would get our traffic.
+ *
+ * @param port		TCP port number
+ *
+ * @return		The listening socket on success; -ENOTSUP if this
+ *			platform has no local sockets; another negative error
+ *			code otherwise
+ */
+static int msgr_listen_local(uint16_t port)
+{
+	int ret, res, fd;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+
+	ret = get_local_sockaddr(port, &addr, &addr_len);
+	if (ret)
+		return ret;
+	fd = do_socket(AF_UNIX, SOCK_STREAM, 0,
+			   WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+	if (fd < 0)
+		return fd;
+	if (bind(fd, (struct sockaddr*)&addr, addr_len)) {
+		ret = -errno;
+		goto error;
+	}
+	if (listen(fd, 32)) {
+		ret = -errno;
+		goto error;
+	}
+	return fd;
+
+error:
+	RETRY_ON_EINTR(res, close(fd));
+	return ret;
+}
+
 void msgr_listen(struct msgr *msgr, const struct listen_info *linfo,
 		char *err, size_t err_len)
 {
@@ -899,6 +2130,17 @@ void msgr_listen(struct msgr *msgr, const struct listen_info *linfo,
 		RETRY_ON_EINTR(res, close(fd));
 		return;
 	}
+	if (msgr->use_local) {
+		ret = msgr_listen_local(linfo->port);
+		if ((ret < 0) && (ret != -ENOTSUP)) {
+			snprintf(err, err_len, "msgr_listen: failed to listen "
+				 "on local socket for port %d: error %d",
+				 linfo->port, ret);
+			RETRY_ON_EINTR(res, close(fd));
+			return;
+		}
+		msgr->local_fd = ret;
+	}
 	msgr->listen.fd = fd;
 	msgr->listen.port = linfo->port;
 	msgr->listen.cb = linfo->cb;
@@ -943,12 +2185,26 @@ static void run_msgr_timeout_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
 				 * */
 				break;
 			}
+			if ((tr == STAILQ_FIRST(&conn->pending_head)) &&
+					((conn->sent_cnt > 0) ||
+					 (conn->uring_flags &
+					  MCONN_URING_SEND_ARMED))) {
+				/* Part of this message is already on the
+				 * wire, or the kernel is sending it right now.
+				 * Pulling it out of the queue would corrupt
+				 * the stream.  If the connection is stuck,
+				 * the TCP teardown timeout will catch it. */
+				continue;
+			}
 			/* Time out transactor */
 			RB_REMOVE(timeo_tr, &conn->timeo_head, tr);
 			if (!(RB_REMOVE(active_tr, &conn->active_head, tr))) {
 				STAILQ_REMOVE(&conn->pending_head, tr, mtran,
 					u.pending_entry);
+				conn->queued_bytes -= be32toh(tr->m->len);
 			}
+			conn->timeouts++;
+			msgr->stats.timeouts++;
 			mtran_deliver_netfail(tr, ETIMEDOUT);
 		}
 	}
@@ -976,7 +2232,8 @@ static void run_msgr_listen_fd_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
 		return;
 	}
 	fd = do_accept(msgr->listen.fd, (struct sockaddr*)&remote,
-		sizeof(remote), WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+		sizeof(remote),
+		WANT_O_CLOEXEC | WANT_O_NONBLOCK | WANT_TCP_NODELAY);
 	if (fd < 0) {
 		if (is_temporary_socket_error(-fd))
 			return;
@@ -987,13 +2244,13 @@ static void run_msgr_listen_fd_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
 	}
 	ip = ntohl(remote.sin_addr.s_addr);
 	port = ntohs(remote.sin_port);
-	conn = mconn_find(msgr, ip, port);
+	conn = mconn_find(msgr, ip, port, 0);
 	if (conn) {
 		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, conn->port,
 			      conn->ip, 0, 0, FLME_MTRAN_MULTI_CONN, 0);
 		goto error;
 	}
-	conn = mconn_create(msgr, ip, port, fd);
+	conn = mconn_create(msgr, ip, port, 0, fd);
 	if (IS_ERR(conn)) {
 		goto error;
 	}
@@ -1007,15 +2264,77 @@ error:
 	}
 }
 
+static void run_msgr_local_fd_cb(POSSIBLY_UNUSED(struct ev_loop *loop),
+		struct ev_io *w, int revents)
+{
+	int ret, fd = -1;
+	struct msgr *msgr;
+	struct mconn *conn;
+	struct sockaddr_un remote;
+	uint16_t port;
+
+	msgr = GET_OUTER(w, struct msgr, w_local_fd);
+	if (revents & EV_ERROR) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, 0, 0, 0,
+			0, FLME_EV_ERROR, 5);
+		return;
+	}
+	if (!(revents & EV_READ)) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, 0, 0, 0,
+			0, FLME_NO_EV_READ, 0);
+		return;
+	}
+	fd = do_accept(msgr->local_fd, (struct sockaddr*)&remote,
+		sizeof(remote), WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+	if (fd < 0) {
+		if (is_temporary_socket_error(-fd))
+			return;
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, 0, 0, 0,
+			0, FLME_ACCEPT_FAILED,
+			cram_into_u16(FORCE_POSITIVE(fd)));
+		goto error;
+	}
+	ret = check_local_peer(fd);
+	if (ret) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_ERROR, 0, 0, 0,
+			0, FLME_LOCAL_PEER_REJECTED,
+			cram_into_u16(FORCE_POSITIVE(ret)));
+		goto error;
+	}
+	/* Local peers don't have an address or port.  We key their
+	 * connections on IP address 0, which no TCP peer can have, and a port
+	 * number that we make up. */
+	do {
+		port = msgr->next_local_port++;
+	} while (mconn_find(msgr, 0, port, 0));
+	conn = mconn_create(msgr, 0, port, 0, fd);
+	if (IS_ERR(conn)) {
+		goto error;
+	}
+	conn->local = 1;
+	fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG, conn->port,
+		      conn->ip, 0, 0, FLME_INBOUND_CONN_CREATED, 1);
+	return;
+
+error:
+	if (fd > 0) {
+		RETRY_ON_EINTR(ret, close(fd));
+	}
+}
+
 static void run_msgr_setup_pending(struct msgr *msgr, struct mtran *tr)
 {
 	struct mconn *conn;
+	uint16_t lane;
 
-	conn = mconn_find(msgr, tr->ip, tr->port);
+	lane = msgr_choose_lane(msgr, tr);
+	conn = mconn_find(msgr, tr->ip, tr->port, lane);
 	if (!conn) {
-		conn = mconn_create(msgr, tr->ip, tr->port, -1);
-		if (IS_ERR(conn))
+		conn = mconn_create(msgr, tr->ip, tr->port, lane, -1);
+		if (IS_ERR(conn)) {
+			mtran_deliver_netfail(tr, PTR_ERR(conn));
 			return;
+		}
 		fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG,
 			tr->port, tr->ip, tr->trid, tr->rem_trid,
 			FLME_OUTBOUND_CONN_CREATED, be16toh(tr->m->ty));
@@ -1024,10 +2343,12 @@ static void run_msgr_setup_pending(struct msgr *msgr, struct mtran *tr)
 		fast_log_msgr(msgr, FAST_LOG_MSGR_DEBUG,
 			tr->port, tr->ip, tr->trid,
 			tr->rem_trid, FLME_CONN_REUSED, be16toh(tr->m->ty));
-		ev_io_start(msgr->loop, &conn->w_write);
 	}
 	RB_INSERT(timeo_tr, &conn->timeo_head, tr);
+	mconn_lz4_compress(conn, tr);
+	conn->queued_bytes += be32toh(tr->m->len);
 	STAILQ_INSERT_TAIL(&conn->pending_head, tr, u.pending_entry);
+	mconn_want_write(conn);
 }
 
 static void msgr_cancel_all_pending_tr(struct msgr *msgr)
@@ -1053,7 +2374,8 @@ static void run_msgr_notify_cb(struct ev_loop *loop, struct ev_async *w,
 	struct conn_cancels conn_cancels_head =
 		SLIST_HEAD_INITIALIZER(conn_cancels_head);
 	struct conn_cancel *cancel;
-	struct mconn exemplar, *conn;
+	struct mconn *conn;
+	int lane;
 
 	while (1) {
 		pthread_spin_lock(&msgr->lock);
@@ -1095,14 +2417,13 @@ static void run_msgr_notify_cb(struct ev_loop *loop, struct ev_async *w,
 			cancel = SLIST_FIRST(&conn_cancels_head);
 			if (!cancel)
 				break;
-			memset(&exemplar, 0, sizeof(exemplar));
-			exemplar.ip = cancel->addr;
-			exemplar.port = cancel->port;
-			conn = RB_FIND(msgr_conn, &msgr->conn_head, &exemplar);
-			if (!conn) {
-				continue;
+			for (lane = 0; (lane == 0) ||
+					(lane < msgr->conns_per_ep); ++lane) {
+				conn = mconn_find(msgr, cancel->addr,
+					cancel->port, lane);
+				if (conn)
+					mconn_teardown(conn, ECANCELED);
 			}
-			mconn_teardown(conn, ECANCELED);
 			SLIST_REMOVE_HEAD(&conn_cancels_head, entry);
 			free(cancel);
 		}
@@ -1125,6 +2446,10 @@ static int run_msgr(struct redfish_thread *rt)
 		fast_log_msgr(msgr, FAST_LOG_MSGR_INFO, 0,
 			0, 0, 0, FLME_LISTENING, msgr->listen.port);
 	}
+	if (msgr->ring) {
+		fast_log_msgr(msgr, FAST_LOG_MSGR_INFO, 0,
+			0, 0, 0, FLME_URING_ENABLED, 0);
+	}
 	ev_loop(msgr->loop, 0);
 	fast_log_msgr(msgr, FAST_LOG_MSGR_INFO, 0,
 		0, 0, 0, FLME_MSGR_SHUTDOWN, cram_into_u16(rt->thread_id));
@@ -1145,6 +2470,11 @@ void msgr_start(struct msgr *msgr, char *err, size_t err_len)
 			msgr->listen.fd, EV_WRITE | EV_READ);
 		ev_io_start(msgr->loop, &msgr->w_listen_fd);
 	}
+	if (msgr->local_fd > 0) {
+		ev_io_init(&msgr->w_local_fd, run_msgr_local_fd_cb,
+			msgr->local_fd, EV_READ);
+		ev_io_start(msgr->loop, &msgr->w_local_fd);
+	}
 	ret = redfish_thread_create(msgr->fl_mgr, &msgr->rt,
 				run_msgr, msgr);
 	if (ret) {
@@ -46,6 +46,21 @@ struct listen_info {
 	uint16_t port;
 };
 
+/** The mechanism a messenger uses to do socket I/O */
+enum msgr_backend {
+	/** Use the backend named by the REDFISH_MSGR_BACKEND environment
+	 * variable ("epoll" or "uring"), or epoll if it isn't set. */
+	MSGR_BACKEND_DEFAULT = 0,
+	/** Wait for sockets to become ready, then read and write them */
+	MSGR_BACKEND_EPOLL,
+	/** Queue reads and writes to the kernel with io_uring.  If the
+	 * platform doesn't support it, we use MSGR_BACKEND_EPOLL. */
+	MSGR_BACKEND_URING,
+};
+
+/** Environment variable which selects the default messenger backend */
+#define MSGR_BACKEND_ENV "REDFISH_MSGR_BACKEND"
+
 /** Configuration to use for a messenger */
 struct msgr_conf {
 	/** Maximum number of connections to allow. */
@@ -59,8 +74,34 @@ struct msgr_conf {
 	const char *name;
 	/** Fast log manager to use for fast logs.  Will be shallow-copied */
 	struct fast_log_mgr *fl_mgr;
+	/** Maximum number of outgoing TCP connections to open to each remote
+	 * endpoint.  0 or 1 means that all traffic to an endpoint shares one
+	 * connection.  Otherwise, the first connection carries only small
+	 * messages, and the others carry bulk transfers. */
+	int conns_per_ep;
+	/** Messages at least this many bytes long are treated as bulk
+	 * transfers.  0 means use MSGR_DEFAULT_BULK_MIN. */
+	int bulk_min;
+	/** If nonzero, always use TCP, even for messengers on this host.
+	 * Otherwise, we listen on a local socket as well as our TCP port, and
+	 * use local sockets to reach other messengers on this host where we
+	 * can. */
+	int no_local;
+	/** The I/O backend to use */
+	enum msgr_backend backend;
+	/** Message bodies at least this many bytes long are compressed with
+	 * LZ4 before being sent, on connections where the peer has told us
+	 * it can decompress them.  0 means never compress. */
+	int compress_min;
 };
 
+/** Default threshold at which a message is considered a bulk transfer */
+#define MSGR_DEFAULT_BULK_MIN 65536
+
+/** Suggested value for msgr_conf::compress_min on messengers which talk to
+ * clients over slow links */
+#define MSGR_DEFAULT_COMPRESS_MIN 4096
+
 /* The messenger
  *
  * Each messenger has a single thread which is handling potentially thousands of
@@ -84,6 +125,34 @@ struct msgr_conf {
  * it for other transactors. The messenger handles all these details behind the
  * scenes. If there is a network problem, the messenger will invoke the callback
  * with an error pointer set to the errno code.
+ *
+ * Messengers on the same host talk to each other over local (AF_UNIX) sockets
+ * rather than going through the TCP loopback path, unless this has been
+ * disabled in the configuration.  Apart from being faster, local connections
+ * behave exactly like TCP ones.  Inbound local connections show up with an IP
+ * address of 0.
+ *
+ * On Linux, the messenger can also use io_uring for established connections.
+ * Instead of waiting for a socket to become readable and then reading it, we
+ * queue a receive straight into the buffer for the next message, and likewise
+ * for sends.  Operations queued during one pass through the event loop are
+ * handed to the kernel in a single system call.  Connection setup, accept, and
+ * timeouts are still handled by the event loop.
+ *
+ * Every messenger keeps statistics about its connections and about each type
+ * of message it handles, including a histogram of how long it took to get a
+ * reply to each request sent with mtran_send.  Anyone can fetch these by
+ * sending an mmm_msgr_stats_req to the messenger's port.  The messenger
+ * answers that request itself; the listener callback never sees it.
+ *
+ * Messengers can compress large messages with LZ4 on the way out, which helps
+ * when the network is slower than the CPU.  Every messenger advertises that
+ * it can decompress by setting MSG_FLAG_LZ4_OK on what it sends, and we only
+ * compress on a connection once the peer has done so; older peers never see a
+ * compressed message.  Compression happens on the messenger thread, just
+ * before the message is queued on its connection.  Messages whose bodies don't
+ * shrink by at least an eighth are sent as they are.  Messages with a
+ * file-backed body are never compressed.
  */
 
 /** Initialize the messenger.
@@ -172,6 +241,20 @@ extern void mtran_send(struct msgr *msgr, struct mtran *tr,
 extern void mtran_send_next(struct mconn *conn, struct mtran *tr,
 			struct msg *m, int timeo);
 
+/** Attach a file-backed body to a message we are about to send
+ *
+ * The message length is increased by fdb->len.  The transactor takes
+ * ownership of fdb; fdb->release will be called once the message has been
+ * sent, once the send has failed, or when the transactor is freed, whichever
+ * happens first.
+ *
+ * @param tr		the transactor which will send m
+ * @param m		the message
+ * @param fdb		the file-backed body
+ */
+extern void mtran_attach_fdbody(struct mtran *tr, struct msg *m,
+			struct msg_fdbody *fdb);
+
 /** Register to receive a message from a currently open connection
  *
  * This must be called from the context of a msgr_cb_t function.
@@ -200,6 +283,14 @@ extern int mconn_cancel(struct msgr *msgr, uint32_t addr, uint16_t port);
  */
 extern struct msgr *mconn_get_msgr(struct mconn *conn);
 
+/** Get the I/O backend a messenger is actually using
+ *
+ * @param msgr		The messenger
+ *
+ * @return		MSGR_BACKEND_EPOLL or MSGR_BACKEND_URING
+ */
+extern enum msgr_backend msgr_get_backend(const struct msgr *msgr);
+
 /** Shut down a messenger.
  *
  * Shutdown will close all open connections and join the messenger thread.
@@ -0,0 +1,693 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/process_ctx.h"
+#include "msg/bsend.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/fast_log.h"
+#include "util/packed.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Messenger loopback benchmark
+ *
+ * Stands up two messengers on this host and measures how quickly they can
+ * talk to each other:
+ *
+ * rpc_latency	round-trip time of one small RPC at a time
+ * rpc_rate	small RPCs per second with several transactors in flight
+ * bulk		throughput of large requests, at several message sizes
+ * bsend	round trips through the blocking RPC interface, fanning out
+ *		several requests at a time
+ * conn_setup	connections per second, opening a new connection for each RPC
+ *
+ * Each test is run over TCP loopback and over the local transport, with each
+ * I/O backend.  Results are printed one per line, as space-separated
+ * key=value pairs, so that they can be compared between builds by a script.
+ *
+ * Bulk requests carry text that looks like a log file.  Running with -z turns
+ * on LZ4 compression for messages of at least that many bytes, so that bulk
+ * throughput can be compared with and without it.
+ */
+
+#define MSGR_BENCH_PORT 9096
+
+#define MSGR_BENCH_DEFAULT_NUM_RPC 20000
+
+#define MSGR_BENCH_DEFAULT_CONC 16
+
+#define MSGR_BENCH_DEFAULT_BULK_TOTAL (256 * 1024 * 1024)
+
+#define MSGR_BENCH_DEFAULT_NUM_CONN 1000
+
+#define MSGR_BENCH_DEFAULT_FANOUT 8
+
+/** Number of bulk requests to keep in flight at once */
+#define MSGR_BENCH_BULK_WINDOW 4
+
+/** Smallest number of messages to send for each bulk message size */
+#define MSGR_BENCH_BULK_MIN_COUNT 16
+
+/** Maximum number of transactors to keep in flight */
+#define MSGR_BENCH_MAX_CONC 500
+
+static const uint32_t g_bulk_sizes[] = {
+	4096,
+	65536,
+	1024 * 1024,
+	8 * 1024 * 1024,
+};
+
+enum {
+	MMM_BENCH_PING = 9000,
+	MMM_BENCH_PONG,
+};
+
+/** Options controlling a benchmark run */
+struct bench_opts {
+	/** Number of RPCs to time for rpc_latency, rpc_rate, and bsend */
+	int num_rpc;
+	/** Number of transactors to keep in flight for rpc_rate */
+	int conc;
+	/** Number of bytes to send for each bulk message size */
+	uint64_t bulk_total;
+	/** Number of connections to open for conn_setup */
+	int num_conn;
+	/** Number of requests in each bsend round */
+	int fanout;
+	/** msgr_conf::compress_min for both messengers */
+	int compress_min;
+};
+
+/** A client and server messenger talking to each other */
+struct bench_env {
+	struct msgr *cli;
+	struct msgr *srv;
+	enum msgr_backend backend;
+	const char *transport;
+};
+
+static sem_t g_bench_sem;
+
+static int g_bench_failed;
+
+static uint32_t g_localhost;
+
+/** Text to fill the bodies of bulk requests with */
+static char *g_bench_text;
+
+/** Length of g_bench_text */
+static uint32_t g_bench_text_len;
+
+static uint64_t get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	if (x < y)
+		return -1;
+	else if (x > y)
+		return 1;
+	return 0;
+}
+
+static const char *backend_to_str(enum msgr_backend backend)
+{
+	return (backend == MSGR_BACKEND_URING) ? "uring" : "epoll";
+}
+
+/** Print the start of a result line
+ *
+ * @param env		The benchmark environment
+ * @param test		Name of the test
+ */
+static void bench_result(const struct bench_env *env, const char *test)
+{
+	printf("test=%s transport=%s backend=%s", test, env->transport,
+		backend_to_str(env->backend));
+}
+
+/** Fill g_bench_text with something that looks like a log file
+ *
+ * @return		0 on success; ENOMEM on OOM
+ */
+static int bench_make_text(void)
+{
+	static const char *levels[] = { "INFO", "INFO", "INFO", "WARN" };
+	static const char *words[] = { "chunk", "replica", "client",
+		"written", "read", "osd", "block", "flushed" };
+	uint32_t i, off, len;
+
+	len = g_bulk_sizes[sizeof(g_bulk_sizes) / sizeof(g_bulk_sizes[0]) - 1];
+	g_bench_text = malloc(len);
+	if (!g_bench_text)
+		return ENOMEM;
+	g_bench_text_len = len;
+	for (i = 0, off = 0; off < len; ++i) {
+		off += snprintf(g_bench_text + off, len - off,
+			"2012-05-%02d 12:%02d:%02d,%03d %s %s %u %s %s %u\n",
+			1 + (i % 28), (i / 60) % 60, i % 60, (i * 37) % 1000,
+			levels[i % 4], words[i % 8], (i * 7919) % 100000,
+			words[(i / 8) % 8], words[(i / 3) % 8], i);
+	}
+	return 0;
+}
+
+static void bench_client_cb(struct mconn *conn, struct mtran *tr)
+{
+	if (tr->m && IS_ERR(tr->m)) {
+		fprintf(stderr, "bench_client_cb: got error %d\n",
+			PTR_ERR(tr->m));
+		g_bench_failed = 1;
+		mtran_free(tr);
+		sem_post(&g_bench_sem);
+		return;
+	}
+	if (tr->state == MTRAN_STATE_SENT) {
+		mtran_recv_next(conn, tr);
+		return;
+	}
+	mtran_free(tr);
+	sem_post(&g_bench_sem);
+}
+
+static void bench_server_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct msg *m;
+
+	if (tr->state == MTRAN_STATE_SENT) {
+		mtran_free(tr);
+		return;
+	}
+	if (IS_ERR(tr->m)) {
+		fprintf(stderr, "bench_server_cb: got error %d\n",
+			PTR_ERR(tr->m));
+		mtran_free(tr);
+		return;
+	}
+	m = calloc_msg(MMM_BENCH_PONG, sizeof(struct msg));
+	if (!m)
+		abort();
+	msg_release(tr->m);
+	tr->m = NULL;
+	mtran_send_next(conn, tr, m, 60);
+}
+
+/** Start an RPC from the client messenger
+ *
+ * When the response arrives, g_bench_sem is posted.
+ *
+ * @param env		The benchmark environment
+ * @param len		Length of the request
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int bench_rpc_start(struct bench_env *env, uint32_t len)
+{
+	struct mtran *tr;
+	struct msg *m;
+
+	tr = mtran_alloc(env->cli);
+	if (!tr)
+		return ENOMEM;
+	m = calloc_msg(MMM_BENCH_PING, len);
+	if (!m) {
+		mtran_free(tr);
+		return ENOMEM;
+	}
+	if (len > g_bench_text_len + sizeof(struct msg))
+		abort();
+	memcpy(m->data, g_bench_text, len - sizeof(struct msg));
+	tr->ip = g_localhost;
+	tr->port = MSGR_BENCH_PORT;
+	mtran_send(env->cli, tr, bench_client_cb, NULL, m, 60);
+	return 0;
+}
+
+/** Run an RPC from the client messenger and wait for the response
+ *
+ * @param env		The benchmark environment
+ * @param len		Length of the request
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int bench_rpc(struct bench_env *env, uint32_t len)
+{
+	int ret, res;
+
+	ret = bench_rpc_start(env, len);
+	if (ret)
+		return ret;
+	RETRY_ON_EINTR(res, sem_wait(&g_bench_sem));
+	return g_bench_failed ? EIO : 0;
+}
+
+/** Run a number of RPCs, keeping several of them in flight at once
+ *
+ * @param env		The benchmark environment
+ * @param len		Length of each request
+ * @param num		Number of RPCs to make
+ * @param window	Maximum number of RPCs to have in flight
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int bench_rpc_window(struct bench_env *env, uint32_t len, int num,
+		int window)
+{
+	int i, ret = 0, res, in_flight = 0;
+
+	for (i = 0; i < num; ++i) {
+		if (in_flight == window) {
+			RETRY_ON_EINTR(res, sem_wait(&g_bench_sem));
+			in_flight--;
+		}
+		ret = bench_rpc_start(env, len);
+		if (ret)
+			break;
+		in_flight++;
+	}
+	while (in_flight > 0) {
+		RETRY_ON_EINTR(res, sem_wait(&g_bench_sem));
+		in_flight--;
+	}
+	if (ret)
+		return ret;
+	return g_bench_failed ? EIO : 0;
+}
+
+static int bench_rpc_latency(struct bench_env *env,
+		const struct bench_opts *opts)
+{
+	int i, ret = 0, num = opts->num_rpc;
+	uint64_t *lat, start, total = 0;
+
+	lat = calloc(num, sizeof(uint64_t));
+	if (!lat)
+		return ENOMEM;
+	for (i = 0; i < num; ++i) {
+		start = get_ns();
+		ret = bench_rpc(env, sizeof(struct msg));
+		if (ret)
+			goto done;
+		lat[i] = get_ns() - start;
+		total += lat[i];
+	}
+	qsort(lat, num, sizeof(uint64_t), compare_u64);
+	bench_result(env, "rpc_latency");
+	printf(" count=%d avg_us=%.2f p50_us=%.2f p90_us=%.2f p99_us=%.2f "
+		"p999_us=%.2f max_us=%.2f\n", num,
+		(total / (double)num) / 1000.0,
+		lat[num / 2] / 1000.0,
+		lat[((uint64_t)num * 90) / 100] / 1000.0,
+		lat[((uint64_t)num * 99) / 100] / 1000.0,
+		lat[((uint64_t)num * 999) / 1000] / 1000.0,
+		lat[num - 1] / 1000.0);
+done:
+	free(lat);
+	return ret;
+}
+
+static int bench_rpc_rate(struct bench_env *env,
+		const struct bench_opts *opts)
+{
+	int ret;
+	uint64_t start, total;
+
+	start = get_ns();
+	ret = bench_rpc_window(env, sizeof(struct msg), opts->num_rpc,
+		opts->conc);
+	if (ret)
+		return ret;
+	total = get_ns() - start;
+	bench_result(env, "rpc_rate");
+	printf(" count=%d conc=%d rpc_per_sec=%.0f\n", opts->num_rpc,
+		opts->conc, opts->num_rpc / (total / 1000000000.0));
+	return 0;
+}
+
+static int bench_bulk(struct bench_env *env, const struct bench_opts *opts)
+{
+	int ret, num;
+	size_t i;
+	uint32_t len;
+	uint64_t start, total;
+
+	for (i = 0; i < sizeof(g_bulk_sizes) / sizeof(g_bulk_sizes[0]); ++i) {
+		len = g_bulk_sizes[i];
+		num = opts->bulk_total / len;
+		if (num < MSGR_BENCH_BULK_MIN_COUNT)
+			num = MSGR_BENCH_BULK_MIN_COUNT;
+		start = get_ns();
+		ret = bench_rpc_window(env, len, num, MSGR_BENCH_BULK_WINDOW);
+		if (ret)
+			return ret;
+		total = get_ns() - start;
+		bench_result(env, "bulk");
+		printf(" msg_len=%d count=%d compress_min=%d gb_per_sec=%.3f\n",
+			len, num, opts->compress_min,
+			((double)num * len) / (double)total);
+	}
+	return 0;
+}
+
+static int bench_bsend(struct bench_env *env, const struct bench_opts *opts)
+{
+	int i, j, ret = 0, num_rounds;
+	struct fast_log_buf *fb;
+	struct bsend *ctx;
+	struct mtran *tr;
+	struct msg *m;
+	uint64_t start, total;
+
+	fb = fast_log_create(g_fast_log_mgr, "bench_bsend");
+	if (IS_ERR(fb))
+		return PTR_ERR(fb);
+	ctx = bsend_init(fb, opts->fanout);
+	if (IS_ERR(ctx)) {
+		ret = PTR_ERR(ctx);
+		goto done_free_fb;
+	}
+	num_rounds = opts->num_rpc / opts->fanout;
+	if (num_rounds < 1)
+		num_rounds = 1;
+	start = get_ns();
+	for (i = 0; i < num_rounds; ++i) {
+		for (j = 0; j < opts->fanout; ++j) {
+			m = calloc_msg(MMM_BENCH_PING, sizeof(struct msg));
+			if (!m) {
+				ret = ENOMEM;
+				break;
+			}
+			ret = bsend_add(ctx, env->cli, BSF_RESP, m,
+				g_localhost, MSGR_BENCH_PORT, 60, NULL);
+			if (ret)
+				break;
+		}
+		/* Wait for whatever we managed to send, even on error. */
+		bsend_join(ctx);
+		if (ret)
+			goto done;
+		for (j = 0; j < opts->fanout; ++j) {
+			tr = bsend_get_mtran(ctx, j);
+			if (IS_ERR(tr->m)) {
+				ret = PTR_ERR(tr->m);
+				goto done;
+			}
+		}
+		bsend_reset(ctx);
+	}
+	total = get_ns() - start;
+	bench_result(env, "bsend");
+	printf(" rounds=%d fanout=%d round_us=%.2f rpc_per_sec=%.0f\n",
+		num_rounds, opts->fanout,
+		(total / (double)num_rounds) / 1000.0,
+		((double)num_rounds * opts->fanout) /
+			(total / 1000000000.0));
+done:
+	bsend_reset(ctx);
+	bsend_free(ctx);
+done_free_fb:
+	fast_log_free(fb);
+	return ret;
+}
+
+static int bench_conn_setup(struct bench_env *env,
+		const struct bench_opts *opts)
+{
+	int i, ret;
+	uint64_t start, total;
+
+	start = get_ns();
+	for (i = 0; i < opts->num_conn; ++i) {
+		/* The cancellation is handled before the next transactor is
+		 * set up, so every RPC has to open a new connection. */
+		ret = mconn_cancel(env->cli, g_localhost, MSGR_BENCH_PORT);
+		if (ret)
+			return ret;
+		ret = bench_rpc(env, sizeof(struct msg));
+		if (ret)
+			return ret;
+	}
+	total = get_ns() - start;
+	bench_result(env, "conn_setup");
+	printf(" count=%d conn_per_sec=%.0f\n", opts->num_conn,
+		opts->num_conn / (total / 1000000000.0));
+	return 0;
+}
+
+static struct msgr *bench_msgr_init(const char *name,
+		enum msgr_backend backend, int no_local,
+		const struct bench_opts *opts, char *err, size_t err_len)
+{
+	struct msgr_conf mconf;
+
+	memset(&mconf, 0, sizeof(mconf));
+	mconf.max_conn = 100;
+	mconf.max_tran = MSGR_BENCH_MAX_CONC * 2;
+	mconf.tcp_teardown_timeo = 360;
+	mconf.name = name;
+	mconf.fl_mgr = g_fast_log_mgr;
+	/* Keep bulk traffic off the small-message connection, the way the
+	 * clients do. */
+	mconf.conns_per_ep = 2;
+	mconf.no_local = no_local;
+	mconf.backend = backend;
+	mconf.compress_min = opts->compress_min;
+	return msgr_init(err, err_len, &mconf);
+}
+
+static int run_bench(enum msgr_backend backend, int no_local,
+		const struct bench_opts *opts)
+{
+	int ret;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	struct bench_env env;
+	struct listen_info linfo;
+
+	memset(&env, 0, sizeof(env));
+	env.backend = backend;
+	env.transport = no_local ? "tcp" : "local";
+	env.cli = bench_msgr_init("bench_cli", backend, no_local, opts,
+		err, err_len);
+	if (!env.cli)
+		goto error;
+	env.srv = bench_msgr_init("bench_srv", backend, no_local, opts,
+		err, err_len);
+	if (!env.srv)
+		goto error_free_cli;
+	if (msgr_get_backend(env.cli) != backend) {
+		fprintf(stderr, "msgr_bench: the %s backend is not supported "
+			"on this system.\n", backend_to_str(backend));
+		ret = 0;
+		goto done;
+	}
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = bench_server_cb;
+	linfo.port = MSGR_BENCH_PORT;
+	msgr_listen(env.srv, &linfo, err, err_len);
+	if (err[0])
+		goto error_free_srv;
+	msgr_start(env.srv, err, err_len);
+	if (err[0])
+		goto error_free_srv;
+	msgr_start(env.cli, err, err_len);
+	if (err[0])
+		goto error_free_srv;
+	/* warm up: establish the connection */
+	ret = bench_rpc(&env, sizeof(struct msg));
+	if (ret)
+		goto done;
+	ret = bench_rpc_latency(&env, opts);
+	if (ret)
+		goto done;
+	ret = bench_rpc_rate(&env, opts);
+	if (ret)
+		goto done;
+	ret = bench_bulk(&env, opts);
+	if (ret)
+		goto done;
+	ret = bench_bsend(&env, opts);
+	if (ret)
+		goto done;
+	ret = bench_conn_setup(&env, opts);
+	if (ret)
+		goto done;
+done:
+	if (ret) {
+		fprintf(stderr, "run_bench(%s/%s): error %d\n", env.transport,
+			backend_to_str(backend), ret);
+	}
+	msgr_shutdown(env.cli);
+	msgr_shutdown(env.srv);
+	msgr_free(env.cli);
+	msgr_free(env.srv);
+	return ret;
+
+error_free_srv:
+	msgr_shutdown(env.srv);
+	msgr_free(env.srv);
+error_free_cli:
+	msgr_shutdown(env.cli);
+	msgr_free(env.cli);
+error:
+	fprintf(stderr, "run_bench(%s/%s): %s\n", env.transport,
+		backend_to_str(backend), err);
+	return EINVAL;
+}
+
+static void usage(int exitstatus)
+{
+	fprintf(stderr,
+"msgr_bench: benchmark the messenger over TCP loopback and local sockets\n"
+"\n"
+"usage: msgr_bench [options]\n"
+"\n"
+"Results are printed to stdout, one per line, as key=value pairs.\n"
+"\n"
+"options:\n"
+"-b <bytes>   bytes to send for each bulk message size (default %d)\n"
+"-c <num>     transactors to keep in flight for rpc_rate (default %d)\n"
+"-e <name>    only benchmark this I/O backend (epoll or uring)\n"
+"-f <num>     requests per bsend round (default %d)\n"
+"-h           this help message\n"
+"-n <num>     number of small RPCs to time (default %d)\n"
+"-s <num>     number of connections to set up (default %d)\n"
+"-t <name>    only benchmark this transport (tcp or local)\n"
+"-z <bytes>   compress messages at least this long with LZ4 (default off)\n",
+	MSGR_BENCH_DEFAULT_BULK_TOTAL, MSGR_BENCH_DEFAULT_CONC,
+	MSGR_BENCH_DEFAULT_FANOUT, MSGR_BENCH_DEFAULT_NUM_RPC,
+	MSGR_BENCH_DEFAULT_NUM_CONN);
+	exit(exitstatus);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, j, ret;
+	struct bench_opts opts;
+	enum msgr_backend backends[] = { MSGR_BACKEND_EPOLL,
+		MSGR_BACKEND_URING };
+	int num_backends = 2;
+	int no_locals[] = { 1, 0 };
+	int num_transports = 2;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.num_rpc = MSGR_BENCH_DEFAULT_NUM_RPC;
+	opts.conc = MSGR_BENCH_DEFAULT_CONC;
+	opts.bulk_total = MSGR_BENCH_DEFAULT_BULK_TOTAL;
+	opts.num_conn = MSGR_BENCH_DEFAULT_NUM_CONN;
+	opts.fanout = MSGR_BENCH_DEFAULT_FANOUT;
+	while ((c = getopt(argc, argv, "b:c:e:f:hn:s:t:z:")) != -1) {
+		switch (c) {
+		case 'b':
+			opts.bulk_total = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			opts.conc = atoi(optarg);
+			break;
+		case 'e':
+			if (!strcmp(optarg, "epoll"))
+				backends[0] = MSGR_BACKEND_EPOLL;
+			else if (!strcmp(optarg, "uring"))
+				backends[0] = MSGR_BACKEND_URING;
+			else
+				usage(EXIT_FAILURE);
+			num_backends = 1;
+			break;
+		case 'f':
+			opts.fanout = atoi(optarg);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+		case 'n':
+			opts.num_rpc = atoi(optarg);
+			break;
+		case 's':
+			opts.num_conn = atoi(optarg);
+			break;
+		case 't':
+			if (!strcmp(optarg, "tcp"))
+				no_locals[0] = 1;
+			else if (!strcmp(optarg, "local"))
+				no_locals[0] = 0;
+			else
+				usage(EXIT_FAILURE);
+			num_transports = 1;
+			break;
+		case 'z':
+			opts.compress_min = atoi(optarg);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+	if ((opts.num_rpc <= 0) || (opts.conc <= 0) ||
+			(opts.conc > MSGR_BENCH_MAX_CONC) ||
+			(opts.num_conn <= 0) || (opts.fanout <= 0) ||
+			(opts.fanout > MSGR_BENCH_MAX_CONC) ||
+			(opts.compress_min < 0)) {
+		fprintf(stderr, "msgr_bench: invalid arguments\n");
+		usage(EXIT_FAILURE);
+	}
+	ret = utility_ctx_init(argv[0]);
+	if (ret) {
+		fprintf(stderr, "msgr_bench: utility_ctx_init failed with "
+			"error %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	if (get_localhost_ipv4(&g_localhost)) {
+		fprintf(stderr, "msgr_bench: failed to get localhost "
+			"address\n");
+		return EXIT_FAILURE;
+	}
+	if (bench_make_text()) {
+		fprintf(stderr, "msgr_bench: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if (sem_init(&g_bench_sem, 0, 0)) {
+		fprintf(stderr, "msgr_bench: sem_init failed\n");
+		return EXIT_FAILURE;
+	}
+	ret = 0;
+	for (i = 0; (i < num_backends) && (!ret); ++i) {
+		for (j = 0; (j < num_transports) && (!ret); ++j)
+			ret = run_bench(backends[i], no_locals[j], &opts);
+	}
+	sem_destroy(&g_bench_sem);
+	free(g_bench_text);
+	process_ctx_shutdown();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
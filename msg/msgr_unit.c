@@ -18,26 +18,47 @@
 #include "core/process_ctx.h"
 #include "msg/msg.h"
 #include "msg/msgr.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
 #include "util/compiler.h"
 #include "util/macro.h"
 #include "util/packed.h"
+#include "util/platform/socket.h"
+#include "util/tempfile.h"
 #include "util/test.h"
 #include "util/time.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <semaphore.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MSGR_UNIT_PORT 9095
 
+#define MSGR_UNIT_FDBODY_LEN (3 * 1024 * 1024 + 17)
+
+#define MSGR_UNIT_FDBODY_OFF 1000
+
+#define MSGR_UNIT_NUM_SMALL 20
+
+#define MSGR_UNIT_BULK_LEN (4 * 1024 * 1024)
+
+#define MSGR_UNIT_NUM_STATS_SENDS 50
+
+#define MSGR_UNIT_LZ4_LEN 100000
+
 enum {
 	MMM_TEST1 = 9000,
 	MMM_TEST2,
+	MMM_TEST3,
+	MMM_TEST4,
 };
 
 PACKED(
@@ -56,19 +77,24 @@ static uint32_t g_localhost;
 
 static sem_t g_msgr_test_simple_send_sem;
 
+/** IP address that bar_cb last received a message from */
+static uint32_t g_bar_recv_ip;
+
 static struct msgr *msgr_init_helper(int max_conn, int max_tran,
-		int tcp_teardown_timeo, const char *name)
+		int tcp_teardown_timeo, const char *name, int no_local)
 {
 	struct msgr *msgr;
 	struct msgr_conf mconf;
 	char err[512] = { 0 };
 	size_t err_len = sizeof(err);
 
+	memset(&mconf, 0, sizeof(mconf));
 	mconf.max_conn = max_conn;
 	mconf.max_tran = max_tran;
 	mconf.tcp_teardown_timeo = tcp_teardown_timeo;
 	mconf.name = name;
 	mconf.fl_mgr = g_fast_log_mgr;
+	mconf.no_local = no_local;
 	msgr = msgr_init(err, err_len, &mconf);
 	if (!msgr) {
 		fprintf(stderr, "msgr_init error: %s\n", err);
@@ -151,6 +177,7 @@ static void bar_cb(struct mconn *conn, struct mtran *tr)
 //	fprintf(stderr, "%02x %02x %02x %02x\n", m->base.data[0],
 //		m->base.data[1], m->base.data[2], m->base.data[3]);
 	i = unpack_from_be32(&m->i);
+	g_bar_recv_ip = tr->ip;
 	mout = calloc_msg(MMM_TEST2, sizeof(struct mmm_test2));
 	if (!mout) {
 		fprintf(stderr, "bar_cb: oom\n");
@@ -158,7 +185,7 @@ static void bar_cb(struct mconn *conn, struct mtran *tr)
 	}
 	pack_to_be32(&mout->i, i + 1);
 	mtran_send_next(conn, tr, (struct msg*)mout, 60);
-	free(m);
+	msg_release((struct msg*)m);
 }
 
 static int msgr_test_init_shutdown(int start)
@@ -167,8 +194,8 @@ static int msgr_test_init_shutdown(int start)
 	char err[512] = { 0 };
 	size_t err_len = sizeof(err);
 
-	foo_msgr = msgr_init_helper(10, 10, 360, "foo_msgr");
-	bar_msgr = msgr_init_helper(10, 10, 360, "bar_msgr");
+	foo_msgr = msgr_init_helper(10, 10, 360, "foo_msgr", 0);
+	bar_msgr = msgr_init_helper(10, 10, 360, "bar_msgr", 0);
 	if (start) {
 		msgr_start(foo_msgr, err, err_len);
 		if (err[0])
@@ -207,7 +234,42 @@ static int send_foo_tr(struct msgr* msgr, msgr_cb_t cb, uint32_t i)
 	return 0;
 }
 
-static int msgr_test_simple_send(int num_sends)
+static int msgr_test_local_squatter(void)
+{
+	struct msgr *msgr;
+	struct listen_info linfo;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	int res, fd;
+
+	if (get_local_sockaddr(MSGR_UNIT_PORT, &addr, &addr_len))
+		return 0;
+	/* Somebody else holds our local address.  Clients on this host would
+	 * end up talking to them, so we must refuse to listen. */
+	fd = do_socket(AF_UNIX, SOCK_STREAM, 0, WANT_O_CLOEXEC);
+	EXPECT_GT(fd, 0);
+	EXPECT_ZERO(bind(fd, (struct sockaddr*)&addr, addr_len));
+	EXPECT_ZERO(listen(fd, 1));
+	msgr = msgr_init_helper(10, 10, 360, "foo_msgr", 0);
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = foo_cb;
+	linfo.port = MSGR_UNIT_PORT;
+	msgr_listen(msgr, &linfo, err, err_len);
+	EXPECT_NOT_EQ(err[0], '\0');
+	RETRY_ON_EINTR(res, close(fd));
+
+	/* Once they're gone, we can listen. */
+	err[0] = '\0';
+	msgr_listen(msgr, &linfo, err, err_len);
+	EXPECT_EQ(err[0], '\0');
+	msgr_shutdown(msgr);
+	msgr_free(msgr);
+	return 0;
+}
+
+static int msgr_test_simple_send(int num_sends, int no_local)
 {
 	int i, res;
 	struct msgr *foo_msgr, *bar_msgr;
@@ -217,8 +279,8 @@ static int msgr_test_simple_send(int num_sends)
 
 	EXPECT_ZERO(sem_init(&g_msgr_test_simple_send_sem, 0, 0));
 
-	foo_msgr = msgr_init_helper(10, 10, 360, "foo_msgr");
-	bar_msgr = msgr_init_helper(10, 10, 360, "bar_msgr");
+	foo_msgr = msgr_init_helper(10, 10, 360, "foo_msgr", no_local);
+	bar_msgr = msgr_init_helper(10, 10, 360, "bar_msgr", no_local);
 	memset(&linfo, 0, sizeof(linfo));
 	linfo.cb = bar_cb;
 	linfo.priv = NULL;
@@ -239,6 +301,8 @@ static int msgr_test_simple_send(int num_sends)
 		RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_simple_send_sem));
 	}
 	EXPECT_ZERO(sem_destroy(&g_msgr_test_simple_send_sem));
+	/* Inbound local connections have no IP address */
+	EXPECT_EQ(g_bar_recv_ip, no_local ? g_localhost : 0);
 
 	msgr_shutdown(foo_msgr);
 	msgr_shutdown(bar_msgr);
@@ -303,8 +367,8 @@ static int msgr_test_conn_timeout(void)
 
 	EXPECT_ZERO(sem_init(&g_msgr_test_baz_sem, 0, 0));
 
-	baz1_msgr = msgr_init_helper(10, 10, 1, "baz1_msgr");
-	baz2_msgr = msgr_init_helper(10, 10, 1, "baz2_msgr");
+	baz1_msgr = msgr_init_helper(10, 10, 1, "baz1_msgr", 0);
+	baz2_msgr = msgr_init_helper(10, 10, 1, "baz2_msgr", 0);
 	memset(&linfo, 0, sizeof(linfo));
 	linfo.cb = baz_cb;
 	linfo.priv = NULL;
@@ -343,8 +407,8 @@ static int msgr_test_conn_shutdown(void)
 
 	EXPECT_ZERO(sem_init(&g_msgr_test_baz_sem, 0, 0));
 
-	baz1_msgr = msgr_init_helper(10, 10, 360, "baz1_msgr");
-	baz2_msgr = msgr_init_helper(10, 10, 360, "baz2_msgr");
+	baz1_msgr = msgr_init_helper(10, 10, 360, "baz1_msgr", 0);
+	baz2_msgr = msgr_init_helper(10, 10, 360, "baz2_msgr", 0);
 	memset(&linfo, 0, sizeof(linfo));
 	linfo.cb = baz_cb;
 	linfo.priv = NULL;
@@ -375,6 +439,552 @@ handle_error:
 	return 1;
 }
 
+static sem_t g_msgr_test_fdbody_sem;
+
+static int g_fdbody_released;
+
+static int g_fdbody_recv_ok;
+
+static char fdbody_byte(uint64_t off)
+{
+	return (char)((off * 7) + (off >> 12));
+}
+
+static void fdbody_release(struct msg_fdbody *fdb)
+{
+	g_fdbody_released++;
+	fdb->fd = -1;
+}
+
+static void fdbody_send_cb(POSSIBLY_UNUSED(struct mconn *conn),
+			struct mtran *tr)
+{
+	if ((tr->state != MTRAN_STATE_SENT) || (tr->m)) {
+		fprintf(stderr, "fdbody_send_cb: send failed\n");
+		abort();
+	}
+	mtran_free(tr);
+	sem_post(&g_msgr_test_fdbody_sem);
+}
+
+static void fdbody_recv_cb(POSSIBLY_UNUSED(struct mconn *conn),
+			struct mtran *tr)
+{
+	struct mmm_test1 *m = (struct mmm_test1*)tr->m;
+	uint32_t i, len;
+
+	if (tr->state != MTRAN_STATE_RECV)
+		abort();
+	len = unpack_from_be32(&m->base.len);
+	g_fdbody_recv_ok = (len == sizeof(struct mmm_test1) +
+		MSGR_UNIT_FDBODY_LEN) && (unpack_from_be32(&m->i) == 123);
+	for (i = 0; g_fdbody_recv_ok && (i < MSGR_UNIT_FDBODY_LEN); ++i) {
+		if (((char*)(m + 1))[i] !=
+				fdbody_byte(MSGR_UNIT_FDBODY_OFF + i))
+			g_fdbody_recv_ok = 0;
+	}
+	mtran_free(tr);
+	sem_post(&g_msgr_test_fdbody_sem);
+}
+
+static int msgr_test_fdbody(void)
+{
+	int res, fd;
+	uint64_t i;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct mtran *tr;
+	struct mmm_test1 *mout;
+	struct msg_fdbody fdb;
+	struct listen_info linfo;
+	char err[512] = { 0 }, tempdir[PATH_MAX], path[PATH_MAX], buf[4096];
+	size_t err_len = sizeof(err);
+
+	EXPECT_ZERO(get_tempdir(tempdir, sizeof(tempdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tempdir));
+	snprintf(path, sizeof(path), "%s/fdbody", tempdir);
+	fd = open(path, O_CREAT | O_RDWR, 0644);
+	EXPECT_GE(fd, 0);
+	for (i = 0; i < MSGR_UNIT_FDBODY_OFF + MSGR_UNIT_FDBODY_LEN;
+			i += sizeof(buf)) {
+		int j;
+		for (j = 0; j < (int)sizeof(buf); ++j)
+			buf[j] = fdbody_byte(i + j);
+		EXPECT_EQ(write(fd, buf, sizeof(buf)), sizeof(buf));
+	}
+	EXPECT_ZERO(sem_init(&g_msgr_test_fdbody_sem, 0, 0));
+	foo_msgr = msgr_init_helper(10, 10, 360, "foo_msgr", 0);
+	bar_msgr = msgr_init_helper(10, 10, 360, "bar_msgr", 0);
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = fdbody_recv_cb;
+	linfo.port = MSGR_UNIT_PORT;
+	msgr_listen(bar_msgr, &linfo, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(foo_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(bar_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+
+	tr = mtran_alloc(foo_msgr);
+	EXPECT_NOT_EQ(tr, NULL);
+	mout = calloc_msg(MMM_TEST3, sizeof(struct mmm_test1));
+	EXPECT_NOT_EQ(mout, NULL);
+	pack_to_be32(&mout->i, 123);
+	fdb.fd = fd;
+	fdb.off = MSGR_UNIT_FDBODY_OFF;
+	fdb.len = MSGR_UNIT_FDBODY_LEN;
+	fdb.release = fdbody_release;
+	tr->ip = g_localhost;
+	tr->port = MSGR_UNIT_PORT;
+	mtran_attach_fdbody(tr, (struct msg*)mout, &fdb);
+	mtran_send(foo_msgr, tr, fdbody_send_cb, NULL, (struct msg*)mout, 60);
+	RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_fdbody_sem));
+	RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_fdbody_sem));
+	EXPECT_EQ(g_fdbody_released, 1);
+	EXPECT_EQ(g_fdbody_recv_ok, 1);
+	EXPECT_ZERO(sem_destroy(&g_msgr_test_fdbody_sem));
+
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+	RETRY_ON_EINTR(res, close(fd));
+	return 0;
+
+handle_error:
+	fprintf(stderr, "msgr_test_fdbody: got error %s\n", err);
+	return 1;
+}
+
+static sem_t g_msgr_test_lanes_sem;
+
+/** Remote ports that small and bulk messages arrived from */
+static uint16_t g_small_ports[MSGR_UNIT_NUM_SMALL], g_bulk_ports[2];
+
+static int g_num_small, g_num_bulk;
+
+static void lanes_send_cb(POSSIBLY_UNUSED(struct mconn *conn),
+			struct mtran *tr)
+{
+	if ((tr->state != MTRAN_STATE_SENT) || (tr->m)) {
+		fprintf(stderr, "lanes_send_cb: send failed\n");
+		abort();
+	}
+	mtran_free(tr);
+}
+
+static void lanes_recv_cb(POSSIBLY_UNUSED(struct mconn *conn),
+			struct mtran *tr)
+{
+	struct mmm_test1 *m = (struct mmm_test1*)tr->m;
+
+	if (tr->state != MTRAN_STATE_RECV)
+		abort();
+	if (unpack_from_be16(&m->base.ty) == MMM_TEST4)
+		g_bulk_ports[g_num_bulk++] = tr->port;
+	else
+		g_small_ports[g_num_small++] = tr->port;
+	mtran_free(tr);
+	sem_post(&g_msgr_test_lanes_sem);
+}
+
+static int send_lanes_tr(struct msgr *msgr, uint16_t ty, uint32_t len,
+		uint16_t flags)
+{
+	struct mtran *tr;
+	struct msg *m;
+
+	tr = mtran_alloc(msgr);
+	if (!tr)
+		return -ENOMEM;
+	m = calloc_msg(ty, len);
+	if (!m) {
+		mtran_free(tr);
+		return -ENOMEM;
+	}
+	tr->ip = g_localhost;
+	tr->port = MSGR_UNIT_PORT;
+	tr->flags = flags;
+	mtran_send(msgr, tr, lanes_send_cb, NULL, m, 60);
+	return 0;
+}
+
+static int msgr_test_lanes(void)
+{
+	int i, res;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct msgr_conf mconf;
+	struct listen_info linfo;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+
+	EXPECT_ZERO(sem_init(&g_msgr_test_lanes_sem, 0, 0));
+	memset(&mconf, 0, sizeof(mconf));
+	mconf.max_conn = 10;
+	mconf.max_tran = 100;
+	mconf.tcp_teardown_timeo = 360;
+	mconf.name = "foo_msgr";
+	mconf.fl_mgr = g_fast_log_mgr;
+	mconf.conns_per_ep = 3;
+	foo_msgr = msgr_init(err, err_len, &mconf);
+	EXPECT_NOT_EQ(foo_msgr, NULL);
+	bar_msgr = msgr_init_helper(10, 100, 360, "bar_msgr", 0);
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = lanes_recv_cb;
+	linfo.port = MSGR_UNIT_PORT;
+	msgr_listen(bar_msgr, &linfo, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(foo_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(bar_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+	/* One bulk transfer because of its size, and one because it is
+	 * flagged as bulk.  The small messages must travel separately. */
+	EXPECT_ZERO(send_lanes_tr(foo_msgr, MMM_TEST4, MSGR_UNIT_BULK_LEN, 0));
+	EXPECT_ZERO(send_lanes_tr(foo_msgr, MMM_TEST4,
+		sizeof(struct mmm_test1), MTRAN_FLAG_BULK));
+	for (i = 0; i < MSGR_UNIT_NUM_SMALL; ++i) {
+		EXPECT_ZERO(send_lanes_tr(foo_msgr, MMM_TEST1,
+			sizeof(struct mmm_test1), 0));
+	}
+	for (i = 0; i < MSGR_UNIT_NUM_SMALL + 2; ++i) {
+		RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_lanes_sem));
+	}
+	EXPECT_EQ(g_num_small, MSGR_UNIT_NUM_SMALL);
+	EXPECT_EQ(g_num_bulk, 2);
+	for (i = 1; i < MSGR_UNIT_NUM_SMALL; ++i)
+		EXPECT_EQ(g_small_ports[i], g_small_ports[0]);
+	EXPECT_NOT_EQ(g_bulk_ports[0], g_small_ports[0]);
+	EXPECT_NOT_EQ(g_bulk_ports[1], g_small_ports[0]);
+	EXPECT_ZERO(sem_destroy(&g_msgr_test_lanes_sem));
+
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+	return 0;
+
+handle_error:
+	fprintf(stderr, "msgr_test_lanes: got error %s\n", err);
+	return 1;
+}
+
+static sem_t g_msgr_test_stats_sem;
+
+/** The last messenger statistics response we received */
+static struct mmm_msgr_stats_resp g_stats_resp;
+
+static void stats_cb(struct mconn *conn, struct mtran *tr)
+{
+	if (tr->state == MTRAN_STATE_SENT) {
+		if (tr->m) {
+			fprintf(stderr, "stats_cb: send error %d\n",
+				PTR_ERR(tr->m));
+			abort();
+		}
+		mtran_recv_next(conn, tr);
+		return;
+	}
+	if (IS_ERR(tr->m)) {
+		fprintf(stderr, "stats_cb: got unexpected error %d\n",
+			PTR_ERR(tr->m));
+		abort();
+	}
+	memset(&g_stats_resp, 0, sizeof(g_stats_resp));
+	if (MSG_XDR_DECODE(mmm_msgr_stats_resp, tr->m, &g_stats_resp) < 0) {
+		fprintf(stderr, "stats_cb: failed to decode response\n");
+		abort();
+	}
+	mtran_free(tr);
+	sem_post(&g_msgr_test_stats_sem);
+}
+
+static int get_msgr_stats(struct msgr *msgr, uint16_t port)
+{
+	int res;
+	struct mtran *tr;
+	struct msg *m;
+	struct mmm_msgr_stats_req req;
+
+	tr = mtran_alloc(msgr);
+	if (!tr)
+		return -ENOMEM;
+	req.flags = MMM_MSGR_STATS_CONNS;
+	m = MSG_XDR_ALLOC(mmm_msgr_stats_req, &req);
+	if (IS_ERR(m)) {
+		mtran_free(tr);
+		return -ENOMEM;
+	}
+	tr->ip = g_localhost;
+	tr->port = port;
+	mtran_send(msgr, tr, stats_cb, NULL, m, 60);
+	RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_stats_sem));
+	return 0;
+}
+
+static const struct mmm_msgr_ty_stats *find_ty_stats(uint16_t ty)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_stats_resp.ty.ty_len; ++i) {
+		if (g_stats_resp.ty.ty_val[i].ty == ty)
+			return &g_stats_resp.ty.ty_val[i];
+	}
+	return NULL;
+}
+
+static int msgr_test_stats(void)
+{
+	int i, res;
+	uint32_t lat_total;
+	struct msgr *foo_msgr, *bar_msgr;
+	const struct mmm_msgr_ty_stats *ts;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	struct listen_info linfo;
+
+	EXPECT_ZERO(sem_init(&g_msgr_test_simple_send_sem, 0, 0));
+	EXPECT_ZERO(sem_init(&g_msgr_test_stats_sem, 0, 0));
+	foo_msgr = msgr_init_helper(10, 10, 360, "foo_msgr", 0);
+	bar_msgr = msgr_init_helper(10, 10, 360, "bar_msgr", 0);
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = bar_cb;
+	linfo.port = MSGR_UNIT_PORT;
+	msgr_listen(bar_msgr, &linfo, err, err_len);
+	if (err[0])
+		goto handle_error;
+	/* foo listens too, so that it can answer its own stats request.
+	 * Nothing else should ever reach its listener. */
+	linfo.cb = NULL;
+	linfo.port = MSGR_UNIT_PORT + 1;
+	msgr_listen(foo_msgr, &linfo, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(foo_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(bar_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+	for (i = 0; i < MSGR_UNIT_NUM_STATS_SENDS; ++i) {
+		EXPECT_ZERO(send_foo_tr(foo_msgr, foo_cb, i + 1));
+	}
+	for (i = 0; i < MSGR_UNIT_NUM_STATS_SENDS; ++i) {
+		RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_simple_send_sem));
+	}
+
+	/* bar received the requests and sent the replies */
+	EXPECT_ZERO(get_msgr_stats(foo_msgr, MSGR_UNIT_PORT));
+	EXPECT_ZERO(strcmp(g_stats_resp.name, "bar_msgr"));
+	EXPECT_GE(g_stats_resp.conns_accepted, 1);
+	EXPECT_EQ(g_stats_resp.conns_opened, 0);
+	EXPECT_EQ(g_stats_resp.timeouts, 0);
+	ts = find_ty_stats(MMM_TEST1);
+	EXPECT_NOT_EQ(ts, NULL);
+	EXPECT_EQ(ts->msgs_in, MSGR_UNIT_NUM_STATS_SENDS);
+	EXPECT_EQ(ts->bytes_in,
+		MSGR_UNIT_NUM_STATS_SENDS * sizeof(struct mmm_test1));
+	EXPECT_EQ(ts->msgs_out, 0);
+	ts = find_ty_stats(MMM_TEST2);
+	EXPECT_NOT_EQ(ts, NULL);
+	EXPECT_EQ(ts->msgs_out, MSGR_UNIT_NUM_STATS_SENDS);
+	ts = find_ty_stats(mmm_msgr_stats_req_ty);
+	EXPECT_NOT_EQ(ts, NULL);
+	EXPECT_EQ(ts->msgs_in, 1);
+	EXPECT_EQ(g_stats_resp.num_conn, 1);
+	EXPECT_EQ(g_stats_resp.conn.conn_len, 1);
+	EXPECT_EQ(g_stats_resp.conn.conn_val[0].msgs_in,
+		MSGR_UNIT_NUM_STATS_SENDS + 1);
+	EXPECT_EQ(g_stats_resp.conn.conn_val[0].msgs_out,
+		MSGR_UNIT_NUM_STATS_SENDS);
+	XDR_REQ_FREE(mmm_msgr_stats_resp, &g_stats_resp);
+
+	/* foo sent the requests, and timed the round trips */
+	EXPECT_ZERO(get_msgr_stats(foo_msgr, MSGR_UNIT_PORT + 1));
+	EXPECT_ZERO(strcmp(g_stats_resp.name, "foo_msgr"));
+	EXPECT_GE(g_stats_resp.conns_opened, 2);
+	EXPECT_EQ(g_stats_resp.reconnects, 0);
+	ts = find_ty_stats(MMM_TEST1);
+	EXPECT_NOT_EQ(ts, NULL);
+	EXPECT_EQ(ts->msgs_out, MSGR_UNIT_NUM_STATS_SENDS);
+	lat_total = 0;
+	for (i = 0; i < MMM_MSGR_LAT_BUCKETS; ++i)
+		lat_total += ts->lat_hist[i];
+	EXPECT_EQ(lat_total, MSGR_UNIT_NUM_STATS_SENDS);
+	ts = find_ty_stats(mmm_msgr_stats_resp_ty);
+	EXPECT_NOT_EQ(ts, NULL);
+	EXPECT_EQ(ts->msgs_in, 1);
+	XDR_REQ_FREE(mmm_msgr_stats_resp, &g_stats_resp);
+
+	EXPECT_ZERO(sem_destroy(&g_msgr_test_simple_send_sem));
+	EXPECT_ZERO(sem_destroy(&g_msgr_test_stats_sem));
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+	return 0;
+
+handle_error:
+	fprintf(stderr, "msgr_test_stats: got error %s\n", err);
+	return 1;
+}
+
+static sem_t g_msgr_test_lz4_sem;
+
+/** Body of the last message sent in msgr_test_lz4 */
+static char g_lz4_body[MSGR_UNIT_LZ4_LEN];
+
+/** 1 if the last reply matched what we sent */
+static int g_lz4_reply_ok;
+
+static void lz4_echo_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct msg *m;
+	uint32_t len;
+
+	if (tr->state == MTRAN_STATE_SENT) {
+		mtran_free(tr);
+		return;
+	}
+	if (IS_ERR(tr->m))
+		abort();
+	/* The messenger should have taken care of the compression flags. */
+	if (tr->m->flags & (MSG_FLAG_LZ4 | MSG_FLAG_LZ4_OK))
+		abort();
+	len = unpack_from_be32(&tr->m->len);
+	m = calloc_msg(MMM_TEST2, len);
+	if (!m)
+		abort();
+	memcpy(m->data, tr->m->data, len - sizeof(struct msg));
+	msg_release(tr->m);
+	tr->m = NULL;
+	mtran_send_next(conn, tr, m, 60);
+}
+
+static void lz4_client_cb(struct mconn *conn, struct mtran *tr)
+{
+	if (tr->state == MTRAN_STATE_SENT) {
+		if (tr->m)
+			abort();
+		mtran_recv_next(conn, tr);
+		return;
+	}
+	if (IS_ERR(tr->m))
+		abort();
+	g_lz4_reply_ok = (unpack_from_be32(&tr->m->len) ==
+			sizeof(struct msg) + MSGR_UNIT_LZ4_LEN) &&
+		(!(tr->m->flags & (MSG_FLAG_LZ4 | MSG_FLAG_LZ4_OK))) &&
+		(!memcmp(tr->m->data, g_lz4_body, MSGR_UNIT_LZ4_LEN));
+	mtran_free(tr);
+	sem_post(&g_msgr_test_lz4_sem);
+}
+
+/** Send g_lz4_body from one messenger to the other, and wait for it to come
+ * back */
+static int send_lz4_tr(struct msgr *msgr)
+{
+	int res;
+	struct mtran *tr;
+	struct msg *m;
+
+	tr = mtran_alloc(msgr);
+	EXPECT_NOT_EQ(tr, NULL);
+	m = calloc_msg(MMM_TEST1, sizeof(struct msg) + MSGR_UNIT_LZ4_LEN);
+	EXPECT_NOT_EQ(m, NULL);
+	memcpy(m->data, g_lz4_body, MSGR_UNIT_LZ4_LEN);
+	tr->ip = g_localhost;
+	tr->port = MSGR_UNIT_PORT;
+	g_lz4_reply_ok = 0;
+	mtran_send(msgr, tr, lz4_client_cb, NULL, m, 60);
+	RETRY_ON_EINTR(res, sem_wait(&g_msgr_test_lz4_sem));
+	EXPECT_EQ(g_lz4_reply_ok, 1);
+	return 0;
+}
+
+static int msgr_test_lz4(void)
+{
+	int i;
+	uint64_t raw_in, raw_out;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct msgr_conf mconf;
+	const struct mmm_msgr_conn_stats *cs;
+	struct listen_info linfo;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+
+	EXPECT_ZERO(sem_init(&g_msgr_test_lz4_sem, 0, 0));
+	EXPECT_ZERO(sem_init(&g_msgr_test_stats_sem, 0, 0));
+	memset(&mconf, 0, sizeof(mconf));
+	mconf.max_conn = 10;
+	mconf.max_tran = 100;
+	mconf.tcp_teardown_timeo = 360;
+	mconf.name = "foo_msgr";
+	mconf.fl_mgr = g_fast_log_mgr;
+	mconf.no_local = 1;
+	mconf.compress_min = MSGR_DEFAULT_COMPRESS_MIN;
+	foo_msgr = msgr_init(err, err_len, &mconf);
+	EXPECT_NOT_EQ(foo_msgr, NULL);
+	mconf.name = "bar_msgr";
+	bar_msgr = msgr_init(err, err_len, &mconf);
+	EXPECT_NOT_EQ(bar_msgr, NULL);
+	memset(&linfo, 0, sizeof(linfo));
+	linfo.cb = lz4_echo_cb;
+	linfo.port = MSGR_UNIT_PORT;
+	msgr_listen(bar_msgr, &linfo, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(foo_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+	msgr_start(bar_msgr, err, err_len);
+	if (err[0])
+		goto handle_error;
+
+	for (i = 0; i < MSGR_UNIT_LZ4_LEN; ++i)
+		g_lz4_body[i] = "redfish "[(i / 3) % 8];
+	/* foo doesn't know yet whether bar can decompress, so the first
+	 * request goes out as it is.  bar knows about foo by the time it
+	 * replies, and after that, everything is compressed. */
+	EXPECT_ZERO(send_lz4_tr(foo_msgr));
+	EXPECT_ZERO(send_lz4_tr(foo_msgr));
+	/* Random data isn't worth compressing. */
+	srandom(1);
+	for (i = 0; i < MSGR_UNIT_LZ4_LEN; ++i)
+		g_lz4_body[i] = random();
+	EXPECT_ZERO(send_lz4_tr(foo_msgr));
+
+	EXPECT_ZERO(get_msgr_stats(foo_msgr, MSGR_UNIT_PORT));
+	EXPECT_EQ(g_stats_resp.conn.conn_len, 1);
+	cs = &g_stats_resp.conn.conn_val[0];
+	EXPECT_NOT_EQ(cs->flags & MMM_MSGR_CONN_LZ4, 0);
+	raw_in = cs->lz4_raw_in;
+	raw_out = cs->lz4_raw_out;
+	EXPECT_EQ(raw_in, MSGR_UNIT_LZ4_LEN);
+	EXPECT_EQ(raw_out, 2 * MSGR_UNIT_LZ4_LEN);
+	EXPECT_LT(cs->lz4_comp_in * 4, raw_in);
+	EXPECT_LT(cs->lz4_comp_out * 4, raw_out);
+	/* Byte counts are for what actually went over the wire. */
+	EXPECT_LT(cs->bytes_in, 3 * MSGR_UNIT_LZ4_LEN);
+	XDR_REQ_FREE(mmm_msgr_stats_resp, &g_stats_resp);
+
+	EXPECT_ZERO(sem_destroy(&g_msgr_test_lz4_sem));
+	EXPECT_ZERO(sem_destroy(&g_msgr_test_stats_sem));
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+	return 0;
+
+handle_error:
+	fprintf(stderr, "msgr_test_lz4: got error %s\n", err);
+	return 1;
+}
+
 int main(POSSIBLY_UNUSED(int argc), char **argv)
 {
 	timer_t timer;
@@ -386,10 +996,17 @@ int main(POSSIBLY_UNUSED(int argc), char **argv)
 	EXPECT_ZERO(get_localhost_ipv4(&g_localhost));
 	EXPECT_ZERO(msgr_test_init_shutdown(0));
 	EXPECT_ZERO(msgr_test_init_shutdown(1));
-	EXPECT_ZERO(msgr_test_simple_send(1));
-	EXPECT_ZERO(msgr_test_simple_send(100));
+	EXPECT_ZERO(msgr_test_local_squatter());
+	EXPECT_ZERO(msgr_test_simple_send(1, 0));
+	EXPECT_ZERO(msgr_test_simple_send(100, 0));
+	EXPECT_ZERO(msgr_test_simple_send(1, 1));
+	EXPECT_ZERO(msgr_test_simple_send(100, 1));
 	EXPECT_ZERO(msgr_test_conn_timeout());
 	EXPECT_ZERO(msgr_test_conn_shutdown());
+	EXPECT_ZERO(msgr_test_fdbody());
+	EXPECT_ZERO(msgr_test_lanes());
+	EXPECT_ZERO(msgr_test_stats());
+	EXPECT_ZERO(msgr_test_lz4());
 	EXPECT_ZERO(mt_deactivate_alarm(timer));
 	process_ctx_shutdown();
 
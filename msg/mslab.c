@@ -0,0 +1,409 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "msg/mslab.h"
+#include "util/compiler.h"
+#include "util/macro.h"
+#include "util/queue.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Number of size classes.  Class N holds objects of up to
+ * (MSLAB_MIN_CLASS_SIZE << N) bytes. */
+#define MSLAB_NUM_CLASS 7
+
+/** Smallest size class */
+#define MSLAB_MIN_CLASS_SIZE 64
+
+/** Class ID used for objects too big for any size class */
+#define MSLAB_CLS_LARGE 0xff
+
+/** Approximate number of bytes each thread will cache per size class */
+#define MSLAB_CACHE_BYTES (256 * 1024)
+
+/** Maximum number of objects the depot holds per size class, as a multiple
+ * of the per-thread cache limit */
+#define MSLAB_DEPOT_MULT 8
+
+#define MSLAB_MAGIC 0x51abf00dU
+#define MSLAB_MAGIC_FREE 0xdeadf00dU
+
+/** The header that precedes every object we hand out.  Its size is a multiple
+ * of 16 so that the object itself stays suitably aligned. */
+struct mslab_obj {
+	/** Next object on the free list.  Only valid while the object is
+	 * free. */
+	struct mslab_obj *next;
+	/** Size class, or MSLAB_CLS_LARGE */
+	uint32_t cls;
+	/** MSLAB_MAGIC while allocated, MSLAB_MAGIC_FREE while cached */
+	uint32_t magic;
+};
+
+BUILD_BUG_ON(sizeof(struct mslab_obj) % 16 != 0);
+
+struct mslab_list {
+	struct mslab_obj *head;
+	int cnt;
+};
+
+struct mslab_cache {
+	LIST_ENTRY(mslab_cache) entry;
+	struct mslab_list lists[MSLAB_NUM_CLASS];
+	struct mslab_stats stats;
+};
+
+struct mslab_depot {
+	pthread_spinlock_t lock;
+	struct mslab_list list;
+};
+
+LIST_HEAD(mslab_cache_list, mslab_cache);
+
+/** Protects g_mslab_caches and g_mslab_retired */
+static pthread_mutex_t g_mslab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** All thread caches currently in existence */
+static struct mslab_cache_list g_mslab_caches =
+	LIST_HEAD_INITIALIZER(g_mslab_caches);
+
+/** Statistics accumulated by threads that have already exited */
+static struct mslab_stats g_mslab_retired;
+
+static struct mslab_depot g_mslab_depot[MSLAB_NUM_CLASS];
+
+static pthread_once_t g_mslab_once = PTHREAD_ONCE_INIT;
+
+static pthread_key_t g_mslab_key;
+
+/** The calling thread's cache, or NULL if it hasn't allocated one yet */
+static __thread struct mslab_cache *g_mslab_cache;
+
+static void mslab_cache_destroy(void *v);
+
+static void mslab_init_once(void)
+{
+	int i;
+
+	for (i = 0; i < MSLAB_NUM_CLASS; ++i) {
+		if (pthread_spin_init(&g_mslab_depot[i].lock, 0))
+			abort();
+	}
+	if (pthread_key_create(&g_mslab_key, mslab_cache_destroy))
+		abort();
+}
+
+static size_t mslab_cls_to_size(int cls)
+{
+	return ((size_t)MSLAB_MIN_CLASS_SIZE) << cls;
+}
+
+static int mslab_len_to_cls(size_t len)
+{
+	int cls;
+
+	for (cls = 0; cls < MSLAB_NUM_CLASS; ++cls) {
+		if (len <= mslab_cls_to_size(cls))
+			return cls;
+	}
+	return MSLAB_CLS_LARGE;
+}
+
+/** Maximum number of objects a thread will cache for a size class */
+static int mslab_cache_limit(int cls)
+{
+	return MSLAB_CACHE_BYTES / mslab_cls_to_size(cls);
+}
+
+/** Number of objects moved to or from the depot at once */
+static int mslab_batch_size(int cls)
+{
+	return mslab_cache_limit(cls) / 2;
+}
+
+static struct mslab_obj *mslab_ptr_to_obj(void *ptr)
+{
+	struct mslab_obj *obj = ((struct mslab_obj*)ptr) - 1;
+	if (obj->magic != MSLAB_MAGIC) {
+		/* Either a double free, or somebody is trying to free memory
+		 * that we never allocated. */
+		abort();
+	}
+	return obj;
+}
+
+static struct mslab_cache *mslab_get_cache(void)
+{
+	struct mslab_cache *c;
+
+	if (g_mslab_cache)
+		return g_mslab_cache;
+	pthread_once(&g_mslab_once, mslab_init_once);
+	c = calloc(1, sizeof(struct mslab_cache));
+	if (!c)
+		return NULL;
+	if (pthread_setspecific(g_mslab_key, c)) {
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_lock(&g_mslab_lock);
+	LIST_INSERT_HEAD(&g_mslab_caches, c, entry);
+	pthread_mutex_unlock(&g_mslab_lock);
+	g_mslab_cache = c;
+	return c;
+}
+
+/** Move up to 'cnt' objects from the thread cache into the depot.  If the
+ * depot is full, free them instead.
+ */
+static void mslab_cache_drain(struct mslab_cache *c, int cls, int cnt)
+{
+	struct mslab_list *l = &c->lists[cls];
+	struct mslab_depot *depot = &g_mslab_depot[cls];
+	struct mslab_obj *head, *tail, *obj;
+	int i;
+
+	head = tail = l->head;
+	if (!head)
+		return;
+	for (i = 1; (i < cnt) && tail->next; ++i)
+		tail = tail->next;
+	l->head = tail->next;
+	l->cnt -= i;
+	tail->next = NULL;
+
+	pthread_spin_lock(&depot->lock);
+	if (depot->list.cnt + i <=
+			mslab_cache_limit(cls) * MSLAB_DEPOT_MULT) {
+		tail->next = depot->list.head;
+		depot->list.head = head;
+		depot->list.cnt += i;
+		pthread_spin_unlock(&depot->lock);
+		c->stats.depot_put++;
+		return;
+	}
+	pthread_spin_unlock(&depot->lock);
+	while (head) {
+		obj = head;
+		head = head->next;
+		free(obj);
+	}
+	c->stats.free_release += i;
+}
+
+/** Refill an empty thread cache list from the depot */
+static void mslab_cache_refill(struct mslab_cache *c, int cls)
+{
+	struct mslab_list *l = &c->lists[cls];
+	struct mslab_depot *depot = &g_mslab_depot[cls];
+	struct mslab_obj *head, *tail;
+	int i, cnt;
+
+	cnt = mslab_batch_size(cls);
+	pthread_spin_lock(&depot->lock);
+	head = tail = depot->list.head;
+	if (!head) {
+		pthread_spin_unlock(&depot->lock);
+		return;
+	}
+	for (i = 1; (i < cnt) && tail->next; ++i)
+		tail = tail->next;
+	depot->list.head = tail->next;
+	depot->list.cnt -= i;
+	pthread_spin_unlock(&depot->lock);
+	tail->next = l->head;
+	l->head = head;
+	l->cnt += i;
+	c->stats.depot_get++;
+}
+
+static void mslab_stats_add(struct mslab_stats *dst,
+		const struct mslab_stats *src)
+{
+	dst->alloc += src->alloc;
+	dst->alloc_miss += src->alloc_miss;
+	dst->alloc_large += src->alloc_large;
+	dst->free += src->free;
+	dst->free_release += src->free_release;
+	dst->depot_get += src->depot_get;
+	dst->depot_put += src->depot_put;
+}
+
+static void mslab_cache_destroy(void *v)
+{
+	struct mslab_cache *c = (struct mslab_cache*)v;
+	int cls;
+
+	for (cls = 0; cls < MSLAB_NUM_CLASS; ++cls) {
+		while (c->lists[cls].head)
+			mslab_cache_drain(c, cls, mslab_batch_size(cls));
+	}
+	pthread_mutex_lock(&g_mslab_lock);
+	LIST_REMOVE(c, entry);
+	mslab_stats_add(&g_mslab_retired, &c->stats);
+	pthread_mutex_unlock(&g_mslab_lock);
+	free(c);
+	g_mslab_cache = NULL;
+}
+
+void *mslab_alloc(size_t len)
+{
+	struct mslab_cache *c;
+	struct mslab_list *l;
+	struct mslab_obj *obj;
+	int cls;
+
+	c = mslab_get_cache();
+	cls = mslab_len_to_cls(len);
+	if (cls == MSLAB_CLS_LARGE) {
+		obj = malloc(sizeof(struct mslab_obj) + len);
+		if (!obj)
+			return NULL;
+		if (c) {
+			c->stats.alloc++;
+			c->stats.alloc_large++;
+		}
+		goto done;
+	}
+	if (c) {
+		c->stats.alloc++;
+		l = &c->lists[cls];
+		if (!l->head)
+			mslab_cache_refill(c, cls);
+		if (l->head) {
+			obj = l->head;
+			l->head = obj->next;
+			l->cnt--;
+			goto done;
+		}
+		c->stats.alloc_miss++;
+	}
+	obj = malloc(sizeof(struct mslab_obj) + mslab_cls_to_size(cls));
+	if (!obj)
+		return NULL;
+done:
+	obj->next = NULL;
+	obj->cls = cls;
+	obj->magic = MSLAB_MAGIC;
+	return obj + 1;
+}
+
+void *mslab_zalloc(size_t len)
+{
+	void *ptr;
+
+	ptr = mslab_alloc(len);
+	if (!ptr)
+		return NULL;
+	memset(ptr, 0, len);
+	return ptr;
+}
+
+void *mslab_realloc(void *ptr, size_t len)
+{
+	struct mslab_obj *obj, *nobj;
+	void *nptr;
+	size_t cur;
+
+	obj = mslab_ptr_to_obj(ptr);
+	if (obj->cls == MSLAB_CLS_LARGE) {
+		nobj = realloc(obj, sizeof(struct mslab_obj) + len);
+		if (!nobj)
+			return NULL;
+		return nobj + 1;
+	}
+	cur = mslab_cls_to_size(obj->cls);
+	if (len <= cur)
+		return ptr;
+	nptr = mslab_alloc(len);
+	if (!nptr)
+		return NULL;
+	memcpy(nptr, ptr, cur);
+	mslab_free(ptr);
+	return nptr;
+}
+
+void mslab_free(void *ptr)
+{
+	struct mslab_cache *c;
+	struct mslab_list *l;
+	struct mslab_obj *obj;
+
+	if (!ptr)
+		return;
+	obj = mslab_ptr_to_obj(ptr);
+	c = mslab_get_cache();
+	if (!c) {
+		free(obj);
+		return;
+	}
+	c->stats.free++;
+	if (obj->cls == MSLAB_CLS_LARGE) {
+		c->stats.free_release++;
+		free(obj);
+		return;
+	}
+	obj->magic = MSLAB_MAGIC_FREE;
+	l = &c->lists[obj->cls];
+	obj->next = l->head;
+	l->head = obj;
+	l->cnt++;
+	if (l->cnt > mslab_cache_limit(obj->cls))
+		mslab_cache_drain(c, obj->cls, mslab_batch_size(obj->cls));
+}
+
+void mslab_thread_flush(void)
+{
+	struct mslab_cache *c = g_mslab_cache;
+	int cls;
+
+	if (!c)
+		return;
+	for (cls = 0; cls < MSLAB_NUM_CLASS; ++cls) {
+		while (c->lists[cls].head)
+			mslab_cache_drain(c, cls, mslab_batch_size(cls));
+	}
+}
+
+void mslab_get_stats(struct mslab_stats *st)
+{
+	struct mslab_cache *c;
+
+	pthread_mutex_lock(&g_mslab_lock);
+	memcpy(st, &g_mslab_retired, sizeof(struct mslab_stats));
+	LIST_FOREACH(c, &g_mslab_caches, entry) {
+		mslab_stats_add(st, &c->stats);
+	}
+	pthread_mutex_unlock(&g_mslab_lock);
+}
+
+void mslab_stats_to_str(const struct mslab_stats *st, char *buf,
+		size_t buf_len)
+{
+	snprintf(buf, buf_len, "{alloc=%" PRIu64 ", alloc_miss=%" PRIu64
+		", alloc_large=%" PRIu64 ", free=%" PRIu64
+		", free_release=%" PRIu64 ", depot_get=%" PRIu64
+		", depot_put=%" PRIu64 "}",
+		st->alloc, st->alloc_miss, st->alloc_large, st->free,
+		st->free_release, st->depot_get, st->depot_put);
+}
@@ -0,0 +1,127 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_MSG_MSLAB_DOT_H
+#define REDFISH_MSG_MSLAB_DOT_H
+
+#include <stdint.h> /* for uint64_t */
+#include <unistd.h> /* for size_t */
+
+/*
+ * The messenger slab allocator.
+ *
+ * Transactors and small messages are allocated and freed at a very high rate
+ * on the messenger and recv_pool threads.  Rather than going to malloc for
+ * each one, we keep per-thread free lists of objects, segregated by size
+ * class.  Allocating and freeing from the calling thread's cache doesn't take
+ * any locks.
+ *
+ * Objects are often freed on a different thread than the one that allocated
+ * them-- for example, replies are allocated by recv_pool threads and freed by
+ * the messenger thread once they have been sent.  When a thread's cache for a
+ * size class gets too full, it moves a batch of objects to a shared depot.
+ * Threads that run out of objects refill from the depot before falling back
+ * on malloc.
+ *
+ * Objects that are too large for any size class are simply malloc'ed.  Either
+ * way, every object carries a small header, so it must be freed with
+ * mslab_free, never with plain free().
+ */
+
+/** Largest object size that will be served from a size class */
+#define MSLAB_MAX_CLASS_SIZE 4096
+
+struct mslab_stats {
+	/** Total number of allocations */
+	uint64_t alloc;
+	/** Allocations that had to go to malloc */
+	uint64_t alloc_miss;
+	/** Allocations that were too large for any size class */
+	uint64_t alloc_large;
+	/** Total number of frees */
+	uint64_t free;
+	/** Frees that went back to the system allocator */
+	uint64_t free_release;
+	/** Number of batches taken from the shared depot */
+	uint64_t depot_get;
+	/** Number of batches put into the shared depot */
+	uint64_t depot_put;
+};
+
+/** Allocate an object
+ *
+ * The memory is not initialized.
+ *
+ * @param len		Length of the object
+ *
+ * @return		The object, or NULL on OOM
+ */
+extern void *mslab_alloc(size_t len);
+
+/** Allocate a zeroed object
+ *
+ * @param len		Length of the object
+ *
+ * @return		The object, or NULL on OOM
+ */
+extern void *mslab_zalloc(size_t len);
+
+/** Change the size of an object
+ *
+ * Like realloc, the contents are preserved up to the lesser of the old and new
+ * sizes.  Unlike realloc, ptr may not be NULL.
+ *
+ * @param ptr		The object
+ * @param len		New length of the object
+ *
+ * @return		The object (possibly moved), or NULL on OOM.  On OOM,
+ *			the original object is left untouched.
+ */
+extern void *mslab_realloc(void *ptr, size_t len);
+
+/** Free an object allocated by mslab_alloc or mslab_zalloc
+ *
+ * @param ptr		The object, or NULL
+ */
+extern void mslab_free(void *ptr);
+
+/** Release all objects cached by the calling thread
+ *
+ * Threads that exit release their caches automatically.
+ */
+extern void mslab_thread_flush(void);
+
+/** Get the allocator statistics, summed over all threads
+ *
+ * The counters of running threads are read without synchronization, so the
+ * result is only approximate while other threads are allocating.
+ *
+ * @param st		(out param) the statistics
+ */
+extern void mslab_get_stats(struct mslab_stats *st);
+
+/** Dump allocator statistics in human-readable form.
+ *
+ * @param st		The statistics
+ * @param buf		(out param) output buffer
+ * @param buf_len	length of buf
+ */
+extern void mslab_stats_to_str(const struct mslab_stats *st, char *buf,
+		size_t buf_len);
+
+#endif
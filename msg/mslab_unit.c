@@ -0,0 +1,192 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/process_ctx.h"
+#include "msg/msg.h"
+#include "msg/mslab.h"
+#include "msg/xdr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/test.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSLAB_UNIT_NUM_THREADS 4
+#define MSLAB_UNIT_NUM_OBJ 5000
+
+static int mslab_test_alloc_free(void)
+{
+	int i;
+	char *p, *q;
+	struct mslab_stats st1, st2;
+
+	mslab_get_stats(&st1);
+	p = mslab_alloc(100);
+	EXPECT_NOT_EQ(p, NULL);
+	memset(p, 0xaa, 100);
+	mslab_free(p);
+	/* The next allocation of the same size class should come straight out
+	 * of our thread cache. */
+	q = mslab_alloc(120);
+	EXPECT_EQ(p, q);
+	mslab_free(q);
+	mslab_get_stats(&st2);
+	EXPECT_EQ(st2.alloc - st1.alloc, 2);
+	EXPECT_EQ(st2.free - st1.free, 2);
+
+	p = mslab_zalloc(MSLAB_MAX_CLASS_SIZE + 1);
+	EXPECT_NOT_EQ(p, NULL);
+	for (i = 0; i < MSLAB_MAX_CLASS_SIZE + 1; ++i)
+		EXPECT_ZERO(p[i]);
+	mslab_free(p);
+	mslab_get_stats(&st1);
+	EXPECT_EQ(st1.alloc_large - st2.alloc_large, 1);
+	mslab_free(NULL);
+	return 0;
+}
+
+static int mslab_test_realloc(void)
+{
+	int i;
+	char *p;
+
+	p = mslab_alloc(10);
+	EXPECT_NOT_EQ(p, NULL);
+	for (i = 0; i < 10; ++i)
+		p[i] = i;
+	/* grow within the size class, into the next class, and past the
+	 * largest class */
+	p = mslab_realloc(p, 60);
+	EXPECT_NOT_EQ(p, NULL);
+	p = mslab_realloc(p, 1000);
+	EXPECT_NOT_EQ(p, NULL);
+	p = mslab_realloc(p, MSLAB_MAX_CLASS_SIZE * 3);
+	EXPECT_NOT_EQ(p, NULL);
+	p = mslab_realloc(p, 20);
+	EXPECT_NOT_EQ(p, NULL);
+	for (i = 0; i < 10; ++i)
+		EXPECT_EQ(p[i], i);
+	mslab_free(p);
+	return 0;
+}
+
+static int mslab_test_msg(void)
+{
+	struct msg *m;
+
+	m = calloc_msg(1234, 200);
+	EXPECT_NOT_EQ(m, NULL);
+	EXPECT_EQ(unpack_from_be32(&m->len), 200);
+	msg_addref(m);
+	msg_release(m);
+	m = msg_shrink(m, 100);
+	EXPECT_EQ(unpack_from_be32(&m->len), 100);
+	msg_release(m);
+	m = resp_alloc(-5);
+	EXPECT_NOT_ERRPTR(m);
+	EXPECT_EQ(msg_xdr_decode_as_generic(m), 5);
+	msg_release(m);
+	return 0;
+}
+
+static void *g_objs[MSLAB_UNIT_NUM_THREADS][MSLAB_UNIT_NUM_OBJ];
+
+static pthread_barrier_t g_barrier;
+
+static void *mslab_test_thread(void *v)
+{
+	int i, j, idx = (int)(uintptr_t)v;
+	void **objs = g_objs[idx];
+
+	/* Free the objects the previous thread allocated, and allocate some
+	 * of our own for the next thread to free. */
+	for (i = 0; i < MSLAB_UNIT_NUM_OBJ; ++i) {
+		mslab_free(objs[i]);
+		objs[i] = NULL;
+	}
+	pthread_barrier_wait(&g_barrier);
+	objs = g_objs[(idx + 1) % MSLAB_UNIT_NUM_THREADS];
+	for (i = 0; i < MSLAB_UNIT_NUM_OBJ; ++i) {
+		objs[i] = mslab_alloc(16 + (i % 1000));
+		if (!objs[i])
+			return (void*)(uintptr_t)1;
+		for (j = 0; j < 16; ++j)
+			((char*)objs[i])[j] = idx;
+	}
+	return NULL;
+}
+
+static int mslab_test_cross_thread(void)
+{
+	int i, j, round;
+	void *ret;
+	pthread_t threads[MSLAB_UNIT_NUM_THREADS];
+	struct mslab_stats st;
+	char buf[512];
+
+	memset(g_objs, 0, sizeof(g_objs));
+	EXPECT_ZERO(pthread_barrier_init(&g_barrier, NULL,
+		MSLAB_UNIT_NUM_THREADS));
+	for (round = 0; round < 3; ++round) {
+		for (i = 0; i < MSLAB_UNIT_NUM_THREADS; ++i) {
+			EXPECT_ZERO(pthread_create(&threads[i], NULL,
+				mslab_test_thread, (void*)(uintptr_t)i));
+		}
+		for (i = 0; i < MSLAB_UNIT_NUM_THREADS; ++i) {
+			EXPECT_ZERO(pthread_join(threads[i], &ret));
+			EXPECT_EQ(ret, NULL);
+		}
+		for (i = 0; i < MSLAB_UNIT_NUM_THREADS; ++i) {
+			for (j = 0; j < MSLAB_UNIT_NUM_OBJ; ++j) {
+				EXPECT_EQ(((char*)g_objs[i][j])[0],
+					(i + MSLAB_UNIT_NUM_THREADS - 1) %
+						MSLAB_UNIT_NUM_THREADS);
+			}
+		}
+	}
+	for (i = 0; i < MSLAB_UNIT_NUM_THREADS; ++i) {
+		for (j = 0; j < MSLAB_UNIT_NUM_OBJ; ++j)
+			mslab_free(g_objs[i][j]);
+	}
+	EXPECT_ZERO(pthread_barrier_destroy(&g_barrier));
+	mslab_thread_flush();
+	mslab_get_stats(&st);
+	EXPECT_EQ(st.alloc, st.free);
+	EXPECT_GT(st.depot_put, 0);
+	EXPECT_GT(st.depot_get, 0);
+	mslab_stats_to_str(&st, buf, sizeof(buf));
+	fprintf(stderr, "mslab stats: %s\n", buf);
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	EXPECT_ZERO(utility_ctx_init(argv[0]));
+	EXPECT_ZERO(mslab_test_alloc_free());
+	EXPECT_ZERO(mslab_test_realloc());
+	EXPECT_ZERO(mslab_test_msg());
+	EXPECT_ZERO(mslab_test_cross_thread());
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
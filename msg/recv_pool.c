@@ -24,9 +24,11 @@
 #include "util/error.h"
 #include "util/fast_log.h"
 #include "util/macro.h"
+#include "util/packed.h"
 
 #include <errno.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -36,68 +38,234 @@
 
 #define RECV_POOL_MAX_BSEND_TR 100000
 
+/** Number of times an idle thread looks for work before going to sleep */
+#define RECV_POOL_SPIN 50
+
+/** Maximum number of transactors to take from another thread at once */
+#define RECV_POOL_STEAL_MAX 16
+
+/** Size of a cache line.  Each queue gets its own. */
+#define RECV_POOL_CACHE_LINE 64
+
 STAILQ_HEAD(pending_tr, mtran);
 
-struct recv_pool {
-	/** recv_pool lock */
+/** The queue of incoming transactors belonging to one thread */
+ALIGNED(RECV_POOL_CACHE_LINE,
+struct recv_pool_queue {
+	/** Protects pending_head, num_pending, credit, and parked */
 	pthread_mutex_t lock;
-	/** Condition variable to wait on */
+	/** Signalled when a sleeping thread should wake up */
 	pthread_cond_t cond;
-	/** List of incoming transactors with messages */
-	struct pending_tr pending_head;
+	/** Incoming transactors with messages, one list per priority class */
+	struct pending_tr pending_head[RECV_POOL_NUM_PRIO];
+	/** Number of transactors in all of the pending_head lists.  Other
+	 * threads peek at this without taking the lock to decide whether there
+	 * is anything to take. */
+	volatile int num_pending;
+	/** Number of transactors each class may still hand out in the current
+	 * round */
+	int credit[RECV_POOL_NUM_PRIO];
+	/** 1 if the thread is asleep, waiting on cond */
+	volatile int parked;
+});
+
+struct recv_pool {
+	/** Protects thread creation and cancel */
+	pthread_mutex_t lock;
 	/** recv_pool has been cancelled */
-	int cancel;
+	volatile int cancel;
+	/** RECV_POOL_FLAG_* flags */
+	int flags;
 	/** Name of receive pool */
 	char *name;
 	/** Number of threads */
-	int num_threads;
+	volatile int num_threads;
+	/** Number of threads that are asleep */
+	int num_parked;
+	/** Next queue to hand a transactor to */
+	unsigned int next_queue;
+	/** Decides which class incoming messages go in.  If this is NULL,
+	 * they all go in RECV_POOL_PRIO_NORMAL. */
+	recv_pool_classify_fn_t classify;
+	/** Priority class configuration */
+	struct recv_pool_prio_conf prio[RECV_POOL_NUM_PRIO];
+	/** Number of transactors waiting in each class, across all queues */
+	int class_pending[RECV_POOL_NUM_PRIO];
+	/** Number of requests turned away in each class */
+	uint64_t rejected[RECV_POOL_NUM_PRIO];
 	/** Array of pointers to threads */
-	struct recv_pool_thread **threads;
+	struct recv_pool_thread *threads[RECV_POOL_MAX_THREADS];
+	/** Per-thread queues.  Messages that arrive before any threads have
+	 * been created wait in queue 0. */
+	struct recv_pool_queue queues[RECV_POOL_MAX_THREADS];
 };
 
-struct recv_pool *recv_pool_init(const char *name)
+struct recv_pool *recv_pool_init(const char *name, int flags)
 {
-	int ret;
+	int i, p, ret;
 	struct recv_pool *rpool;
+	struct recv_pool_queue *q;
 
-	rpool = calloc(1, sizeof(struct recv_pool));
-	if (!rpool) {
+	ret = posix_memalign((void**)&rpool, RECV_POOL_CACHE_LINE,
+		sizeof(struct recv_pool));
+	if (ret) {
 		ret = -ENOMEM;
 		goto error;
 	}
+	memset(rpool, 0, sizeof(struct recv_pool));
 	rpool->name = strdup(name);
 	if (!rpool->name) {
 		ret = -ENOMEM;
 		goto error_free_rp;
 	}
+	rpool->flags = flags;
 	rpool->num_threads = 0;
-	rpool->threads = 0;
-	STAILQ_INIT(&rpool->pending_head);
+	for (p = 0; p < RECV_POOL_NUM_PRIO; ++p)
+		rpool->prio[p].weight = 1;
 	ret = pthread_mutex_init(&rpool->lock, NULL);
 	if (ret)
 		goto error_free_rp_name;
-	ret = pthread_cond_init_mt(&rpool->cond);
-	if (ret)
-		goto error_destroy_lock;
+	for (i = 0; i < RECV_POOL_MAX_THREADS; ++i) {
+		q = &rpool->queues[i];
+		for (p = 0; p < RECV_POOL_NUM_PRIO; ++p)
+			STAILQ_INIT(&q->pending_head[p]);
+		ret = pthread_mutex_init(&q->lock, NULL);
+		if (ret)
+			goto error_destroy_queues;
+		ret = pthread_cond_init_mt(&q->cond);
+		if (ret) {
+			pthread_mutex_destroy(&q->lock);
+			goto error_destroy_queues;
+		}
+	}
 	return rpool;
 
-error_destroy_lock:
+error_destroy_queues:
+	while (--i >= 0) {
+		pthread_cond_destroy(&rpool->queues[i].cond);
+		pthread_mutex_destroy(&rpool->queues[i].lock);
+	}
 	pthread_mutex_destroy(&rpool->lock);
 error_free_rp_name:
 	free(rpool->name);
 error_free_rp:
 	free(rpool);
 error:
-	return ERR_PTR(ret);
+	return ERR_PTR(FORCE_POSITIVE(ret));
+}
+
+int recv_pool_set_prio(struct recv_pool *rpool,
+		recv_pool_classify_fn_t classify,
+		const struct recv_pool_prio_conf *conf)
+{
+	int p;
+
+	for (p = 0; p < RECV_POOL_NUM_PRIO; ++p) {
+		if ((conf[p].weight < 1) || (conf[p].max_pending < 0))
+			return -EINVAL;
+	}
+	rpool->classify = classify;
+	memcpy(rpool->prio, conf, sizeof(rpool->prio));
+	return 0;
+}
+
+/** Find out which priority class a transactor belongs in
+ *
+ * @param rpool		The receive pool
+ * @param tr		The transactor.  tr->m must be a valid message.
+ *
+ * @return		The priority class
+ */
+static int recv_pool_classify(const struct recv_pool *rpool,
+		const struct mtran *tr)
+{
+	int prio;
+
+	if (!rpool->classify)
+		return RECV_POOL_PRIO_NORMAL;
+	prio = rpool->classify(unpack_from_be16(&tr->m->ty));
+	if ((prio < 0) || (prio >= RECV_POOL_NUM_PRIO))
+		return RECV_POOL_PRIO_NORMAL;
+	return prio;
+}
+
+/** Wake up one sleeping thread, if there are any
+ *
+ * @param rpool		The receive pool
+ */
+static void recv_pool_wake_one(struct recv_pool *rpool)
+{
+	int i, num_threads = rpool->num_threads;
+	struct recv_pool_queue *q;
+
+	for (i = 0; i < num_threads; ++i) {
+		q = &rpool->queues[i];
+		if (!q->parked)
+			continue;
+		pthread_mutex_lock(&q->lock);
+		if (q->parked) {
+			q->parked = 0;
+			__sync_fetch_and_sub(&rpool->num_parked, 1);
+			pthread_cond_signal(&q->cond);
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/** Choose the queue that an incoming transactor should go on
+ *
+ * @param rpool		The receive pool
+ * @param tr		The transactor
+ *
+ * @return		The queue index
+ */
+static int recv_pool_choose_queue(struct recv_pool *rpool,
+		const struct mtran *tr)
+{
+	unsigned int num_threads = rpool->num_threads;
+
+	if (num_threads <= 1)
+		return 0;
+	if (rpool->flags & RECV_POOL_FLAG_CONN_ORDER) {
+		return ((tr->ip * 2654435761U) ^ tr->port) % num_threads;
+	}
+	return __sync_fetch_and_add(&rpool->next_queue, 1) % num_threads;
+}
+
+/** Turn away an incoming request because there is too much work waiting
+ *
+ * The sender gets an mmm_resp carrying EAGAIN.  Once that has been sent,
+ * recv_pool_cb will free the transactor.
+ *
+ * @param conn		The connection the request arrived on
+ * @param tr		The transactor
+ */
+static void recv_pool_reject(struct mconn *conn, struct mtran *tr)
+{
+	struct msg *m;
+
+	msg_release(tr->m);
+	tr->m = NULL;
+	m = resp_alloc(EAGAIN);
+	if (IS_ERR(m)) {
+		mtran_free(tr);
+		return;
+	}
+	mtran_send_next(conn, tr, m, MSGR_INCOMING_TIMEO);
 }
 
 static void recv_pool_cb(struct mconn *conn, struct mtran *tr)
 {
 	struct recv_pool *rpool = tr->priv;
+	struct recv_pool_queue *q;
+	int woke, prio, max_pending;
 
-	if (IS_ERR(tr->m)) {
-		/* The incoming message could not be completely received for
-		 * some reason.  Nothing we can do here. */
+	if ((tr->state != MTRAN_STATE_RECV) || IS_ERR(tr->m)) {
+		/* Either we have finished turning away a request, or the
+		 * incoming message could not be completely received for some
+		 * reason.  Nothing more to do here. */
 		mtran_free(tr);
 		return;
 	}
@@ -105,15 +273,40 @@ static void recv_pool_cb(struct mconn *conn, struct mtran *tr)
 	 * Instead, store a pointer to the messenger that sent this message, in
 	 * case we want to send a reply later.  */
 	tr->priv = mconn_get_msgr(conn);
-	pthread_mutex_lock(&rpool->lock);
 	if (rpool->cancel) {
-		pthread_mutex_unlock(&rpool->lock);
 		mtran_free(tr);
 		return;
 	}
-	STAILQ_INSERT_TAIL(&rpool->pending_head, tr, u.pending_entry);
-	pthread_cond_signal(&rpool->cond);
-	pthread_mutex_unlock(&rpool->lock);
+	prio = recv_pool_classify(rpool, tr);
+	max_pending = rpool->prio[prio].max_pending;
+	/* Messages which must be acted on, such as the operations that the
+	 * primary MDS passes on to its replicas, are never turned away.  They
+	 * still count towards the limit. */
+	if ((__sync_add_and_fetch(&rpool->class_pending[prio], 1) >
+			max_pending) && (max_pending != 0) &&
+			(!(tr->m->flags & MSG_FLAG_MUSTDO))) {
+		__sync_fetch_and_sub(&rpool->class_pending[prio], 1);
+		__sync_fetch_and_add(&rpool->rejected[prio], 1);
+		recv_pool_reject(conn, tr);
+		return;
+	}
+	q = &rpool->queues[recv_pool_choose_queue(rpool, tr)];
+	pthread_mutex_lock(&q->lock);
+	STAILQ_INSERT_TAIL(&q->pending_head[prio], tr, u.pending_entry);
+	q->num_pending++;
+	woke = q->parked;
+	if (woke) {
+		q->parked = 0;
+		__sync_fetch_and_sub(&rpool->num_parked, 1);
+		pthread_cond_signal(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (woke || (rpool->flags & RECV_POOL_FLAG_CONN_ORDER))
+		return;
+	/* The owner of the queue is busy.  If some other thread is asleep,
+	 * wake it up so that it can take the transactor. */
+	if (__sync_fetch_and_add(&rpool->num_parked, 0) > 0)
+		recv_pool_wake_one(rpool);
 }
 
 void recv_pool_msgr_listen(struct recv_pool *rpool, struct msgr *msgr,
@@ -128,6 +321,203 @@ void recv_pool_msgr_listen(struct recv_pool *rpool, struct msgr *msgr,
 	msgr_listen(msgr, &linfo, err, err_len);
 }
 
+/** Take the next transactor from a queue, in weighted round-robin order
+ *
+ * In each round, every class can hand out as many transactors as its weight.
+ * A new round starts once none of the classes with work waiting have any
+ * credit left.
+ *
+ * @param rpool		The receive pool
+ * @param q		The queue.  Must be locked.
+ *
+ * @return		The transactor, or NULL if the queue is empty
+ */
+static struct mtran *recv_pool_queue_pop_locked(const struct recv_pool *rpool,
+		struct recv_pool_queue *q)
+{
+	struct mtran *tr;
+	int p, round;
+
+	for (round = 0; round < 2; ++round) {
+		for (p = 0; p < RECV_POOL_NUM_PRIO; ++p) {
+			if (q->credit[p] <= 0)
+				continue;
+			tr = STAILQ_FIRST(&q->pending_head[p]);
+			if (!tr)
+				continue;
+			STAILQ_REMOVE_HEAD(&q->pending_head[p],
+				u.pending_entry);
+			q->credit[p]--;
+			q->num_pending--;
+			return tr;
+		}
+		for (p = 0; p < RECV_POOL_NUM_PRIO; ++p)
+			q->credit[p] = rpool->prio[p].weight;
+	}
+	return NULL;
+}
+
+/** Take the next transactor from a queue
+ *
+ * @param rpool		The receive pool
+ * @param q		The queue
+ *
+ * @return		The transactor, or NULL if the queue is empty
+ */
+static struct mtran *recv_pool_queue_pop(const struct recv_pool *rpool,
+		struct recv_pool_queue *q)
+{
+	struct mtran *tr;
+
+	if (!q->num_pending)
+		return NULL;
+	pthread_mutex_lock(&q->lock);
+	tr = recv_pool_queue_pop_locked(rpool, q);
+	pthread_mutex_unlock(&q->lock);
+	return tr;
+}
+
+/** Take work from other threads' queues
+ *
+ * We take up to half of the first non-empty queue we find, in one go, in the
+ * order that its owner would have handled them.  The first transactor is
+ * returned; the rest go on our own queue, where other threads can take them in
+ * turn.
+ *
+ * @param rpool		The receive pool
+ * @param idx		Index of our own queue
+ *
+ * @return		A transactor, or NULL if there was nothing to take
+ */
+static struct mtran *recv_pool_steal(struct recv_pool *rpool, int idx)
+{
+	struct recv_pool_queue *victim, *q = &rpool->queues[idx];
+	struct pending_tr stolen = STAILQ_HEAD_INITIALIZER(stolen);
+	struct mtran *tr, *str;
+	int i, n, amt, num_threads = rpool->num_threads;
+
+	for (i = 1; i < num_threads; ++i) {
+		victim = &rpool->queues[(idx + i) % num_threads];
+		if (!victim->num_pending)
+			continue;
+		pthread_mutex_lock(&victim->lock);
+		amt = (victim->num_pending + 1) / 2;
+		if (amt > RECV_POOL_STEAL_MAX)
+			amt = RECV_POOL_STEAL_MAX;
+		for (n = 0; n < amt; ++n) {
+			tr = recv_pool_queue_pop_locked(rpool, victim);
+			STAILQ_INSERT_TAIL(&stolen, tr, u.pending_entry);
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (amt == 0)
+			continue;
+		tr = STAILQ_FIRST(&stolen);
+		STAILQ_REMOVE_HEAD(&stolen, u.pending_entry);
+		if (amt > 1) {
+			pthread_mutex_lock(&q->lock);
+			while ((str = STAILQ_FIRST(&stolen))) {
+				STAILQ_REMOVE_HEAD(&stolen, u.pending_entry);
+				STAILQ_INSERT_TAIL(&q->pending_head[
+					recv_pool_classify(rpool, str)],
+					str, u.pending_entry);
+			}
+			q->num_pending += amt - 1;
+			pthread_mutex_unlock(&q->lock);
+		}
+		return tr;
+	}
+	return NULL;
+}
+
+/** Determine whether any queue in the pool has work in it
+ *
+ * @param rpool		The receive pool
+ *
+ * @return		1 if there is work to be had; 0 otherwise
+ */
+static int recv_pool_any_pending(const struct recv_pool *rpool)
+{
+	int i, num_threads = rpool->num_threads;
+
+	for (i = 0; i < num_threads; ++i) {
+		if (rpool->queues[i].num_pending)
+			return 1;
+	}
+	return 0;
+}
+
+/** Put a thread to sleep until there is more work for it
+ *
+ * @param rpool		The receive pool
+ * @param q		The thread's queue
+ */
+static void recv_pool_park(struct recv_pool *rpool, struct recv_pool_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->num_pending || rpool->cancel) {
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+	q->parked = 1;
+	__sync_fetch_and_add(&rpool->num_parked, 1);
+	pthread_mutex_unlock(&q->lock);
+	/* Someone may have queued work on a busy thread just before they
+	 * could see that we were going to sleep.  Look around once more. */
+	if (!(rpool->flags & RECV_POOL_FLAG_CONN_ORDER) &&
+			recv_pool_any_pending(rpool)) {
+		pthread_mutex_lock(&q->lock);
+		if (q->parked) {
+			q->parked = 0;
+			__sync_fetch_and_sub(&rpool->num_parked, 1);
+		}
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+	pthread_mutex_lock(&q->lock);
+	while (q->parked && (!rpool->cancel)) {
+		pthread_cond_wait(&q->cond, &q->lock);
+	}
+	if (q->parked) {
+		q->parked = 0;
+		__sync_fetch_and_sub(&rpool->num_parked, 1);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+/** Get the next transactor for a thread to handle
+ *
+ * @param rpool		The receive pool
+ * @param idx		Index of the thread's queue
+ *
+ * @return		The next transactor, or NULL if the pool has been
+ *			cancelled
+ */
+static struct mtran *recv_pool_next(struct recv_pool *rpool, int idx)
+{
+	struct recv_pool_queue *q = &rpool->queues[idx];
+	struct mtran *tr;
+	int spin = 0;
+
+	while (1) {
+		if (rpool->cancel)
+			return NULL;
+		tr = recv_pool_queue_pop(rpool, q);
+		if ((!tr) && (!(rpool->flags & RECV_POOL_FLAG_CONN_ORDER)))
+			tr = recv_pool_steal(rpool, idx);
+		if (tr) {
+			__sync_fetch_and_sub(&rpool->class_pending[
+				recv_pool_classify(rpool, tr)], 1);
+			return tr;
+		}
+		if (spin++ < RECV_POOL_SPIN) {
+			sched_yield();
+			continue;
+		}
+		recv_pool_park(rpool, q);
+		spin = 0;
+	}
+}
+
 static int recv_pool_thread_trampoline(struct redfish_thread *rt)
 {
 	int ret;
@@ -145,24 +535,15 @@ static int recv_pool_thread_trampoline(struct redfish_thread *rt)
 		return PTR_ERR(ctx);
 	}
 	rrt->ctx = ctx;
-	pthread_mutex_lock(&rpool->lock);
 	while (1) {
-		if (rpool->cancel) {
-			pthread_mutex_unlock(&rpool->lock);
+		tr = recv_pool_next(rpool, rrt->idx);
+		if (!tr) {
 			ret = 0;
 			break;
 		}
-		tr = STAILQ_FIRST(&rpool->pending_head);
-		if (!tr) {
-			pthread_cond_wait(&rpool->cond, &rpool->lock);
-			continue;
-		}
-		STAILQ_REMOVE_HEAD(&rpool->pending_head, u.pending_entry);
-		pthread_mutex_unlock(&rpool->lock);
 		ret = handler(rrt, tr);
 		if (ret)
 			break;
-		pthread_mutex_lock(&rpool->lock);
 	}
 	bsend_free(ctx);
 	return ret;
@@ -172,7 +553,6 @@ int recv_pool_thread_create(struct recv_pool *rpool, struct fast_log_mgr *mgr,
 		recv_pool_handler_fn_t handler, void *priv)
 {
 	int ret;
-	struct recv_pool_thread **threads;
 	struct recv_pool_thread *rt;
 
 	/* create the Redfish thread */
@@ -181,22 +561,18 @@ int recv_pool_thread_create(struct recv_pool *rpool, struct fast_log_mgr *mgr,
 		pthread_mutex_unlock(&rpool->lock);
 		return -ECANCELED;
 	}
-	threads = realloc(rpool->threads,
-		sizeof (struct recv_pool_thread*) * rpool->num_threads + 1);
-	if (!threads) {
+	if (rpool->num_threads >= RECV_POOL_MAX_THREADS) {
 		pthread_mutex_unlock(&rpool->lock);
-		return -ENOMEM;
+		return -ENOSPC;
 	}
-	rpool->threads = threads;
 	rt = calloc(1, sizeof(struct recv_pool_thread));
 	if (!rt) {
 		pthread_mutex_unlock(&rpool->lock);
 		return -ENOMEM;
 	}
-	threads[rpool->num_threads] = rt;
-	memset(rt, 0, sizeof(struct recv_pool_thread));
 	rt->rpool = rpool;
 	rt->handler = handler;
+	rt->idx = rpool->num_threads;
 	ret = redfish_thread_create(mgr, (struct redfish_thread*)rt,
 			recv_pool_thread_trampoline, priv);
 	if (ret) {
@@ -204,20 +580,39 @@ int recv_pool_thread_create(struct recv_pool *rpool, struct fast_log_mgr *mgr,
 		pthread_mutex_unlock(&rpool->lock);
 		return ret;
 	}
-	rpool->num_threads++;
+	rpool->threads[rt->idx] = rt;
+	/* Only start handing out work to the new queue once the thread that
+	 * owns it exists. */
+	__sync_fetch_and_add(&rpool->num_threads, 1);
 	pthread_mutex_unlock(&rpool->lock);
 	return 0;
 }
 
+void recv_pool_get_stats(struct recv_pool *rpool, struct recv_pool_stats *st)
+{
+	int p;
+
+	for (p = 0; p < RECV_POOL_NUM_PRIO; ++p) {
+		st->pending[p] = __sync_fetch_and_add(
+			&rpool->class_pending[p], 0);
+		st->rejected[p] = __sync_fetch_and_add(&rpool->rejected[p], 0);
+	}
+}
+
 void recv_pool_join(struct recv_pool *rpool)
 {
 	int i, POSSIBLY_UNUSED(ret);
+	struct recv_pool_queue *q;
 
 	pthread_mutex_lock(&rpool->lock);
 	rpool->cancel = 1;
-	pthread_cond_broadcast(&rpool->cond);
 	pthread_mutex_unlock(&rpool->lock);
-
+	for (i = 0; i < RECV_POOL_MAX_THREADS; ++i) {
+		q = &rpool->queues[i];
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
 	for (i = 0; i < rpool->num_threads; ++i) {
 		ret = redfish_thread_join((struct redfish_thread*)
 			rpool->threads[i]);
@@ -226,9 +621,26 @@ void recv_pool_join(struct recv_pool *rpool)
 
 void recv_pool_free(struct recv_pool *rp)
 {
-	pthread_cond_destroy(&rp->cond);
+	int i, p;
+	struct recv_pool_queue *q;
+	struct mtran *tr;
+
+	for (i = 0; i < RECV_POOL_MAX_THREADS; ++i) {
+		q = &rp->queues[i];
+		/* Nobody is going to handle these now. */
+		for (p = 0; p < RECV_POOL_NUM_PRIO; ++p) {
+			while ((tr = STAILQ_FIRST(&q->pending_head[p]))) {
+				STAILQ_REMOVE_HEAD(&q->pending_head[p],
+					u.pending_entry);
+				mtran_free(tr);
+			}
+		}
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+	}
+	for (i = 0; i < rp->num_threads; ++i)
+		free(rp->threads[i]);
 	pthread_mutex_destroy(&rp->lock);
-	free(rp->threads);
 	free(rp->name);
 	free(rp);
 }
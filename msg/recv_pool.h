@@ -25,6 +25,8 @@
 
 #include "util/thread.h" /* for struct redfish_thread */
 
+#include <stdint.h> /* for uint16_t, uint64_t */
+
 struct fast_log_buf;
 struct msgr;
 struct mtran;
@@ -34,20 +36,105 @@ struct recv_pool_thread;
 typedef int (*recv_pool_handler_fn_t)(struct recv_pool_thread *rt,
 			struct mtran *tr);
 
+/** Receive pool priority classes.  Lower numbers are more urgent. */
+enum recv_pool_prio {
+	/** Small, latency-sensitive requests such as heartbeats and stats */
+	RECV_POOL_PRIO_HIGH = 0,
+	/** Everything else.  This is the default class. */
+	RECV_POOL_PRIO_NORMAL = 1,
+	/** Expensive requests which may take a long time to handle */
+	RECV_POOL_PRIO_BULK = 2,
+	RECV_POOL_NUM_PRIO = 3,
+};
+
+/** Decide which priority class an incoming message belongs in
+ *
+ * This is called from the messenger thread, so it must be quick.
+ *
+ * @param ty		The message type
+ *
+ * @return		A recv_pool_prio
+ */
+typedef int (*recv_pool_classify_fn_t)(uint16_t ty);
+
+/** Configuration for a receive pool priority class */
+struct recv_pool_prio_conf {
+	/** How many transactors of this class a thread handles in each round
+	 * when there is work waiting in other classes.  Must be at least 1. */
+	int weight;
+	/** Maximum number of transactors of this class that may be waiting in
+	 * the pool.  Further requests are answered with EAGAIN.  0 means no
+	 * limit. */
+	int max_pending;
+};
+
+/** Receive pool statistics */
+struct recv_pool_stats {
+	/** Number of transactors waiting in each class */
+	int pending[RECV_POOL_NUM_PRIO];
+	/** Number of requests turned away in each class */
+	uint64_t rejected[RECV_POOL_NUM_PRIO];
+};
+
 struct recv_pool_thread {
 	struct redfish_thread base;
 	struct recv_pool *rpool;
 	recv_pool_handler_fn_t handler;
 	struct bsend *ctx;
+	/** Index of this thread's queue in the pool */
+	int idx;
 };
 
+/** Maximum number of threads in a receive pool */
+#define RECV_POOL_MAX_THREADS 64
+
+/** Receive pool flag: handle all messages from a given connection on the same
+ * thread, in the order they arrived within each priority class.  Without this
+ * flag, idle threads take work from busy ones, so messages from one connection
+ * may be handled out of order.  The ordering guarantee only holds once all
+ * threads have been created. */
+#define RECV_POOL_FLAG_CONN_ORDER 0x1
+
+/*
+ * Each thread in a receive pool has its own queue of incoming transactors.
+ * The messenger hands each message to one of the queues, and only wakes up the
+ * owner if it is asleep.  A thread that runs out of work takes a batch of
+ * transactors from another thread's queue, and looks around for a little
+ * while before going to sleep.
+ *
+ * Each queue is divided into priority classes.  Threads take work from the
+ * classes in weighted round-robin order, so that a flood of expensive requests
+ * can't starve cheap ones, and vice versa.  Each class can also have a limit
+ * on how much work may be waiting in the pool.  Once it is reached, the pool
+ * replies to new requests in that class with an mmm_resp carrying EAGAIN,
+ * rather than letting the backlog grow without bound.  Senders should back
+ * off and try again later.  Messages with MSG_FLAG_MUSTDO set are always
+ * queued.
+ */
+
 /** Create an RPC receive thread pool
  *
  * @param name		Name of the receive pool.  This will be deep-copied.
+ * @param flags		RECV_POOL_FLAG_* flags
  *
  * @return		Pointer to a valid recv_pool, or an error pointer
  */
-extern struct recv_pool *recv_pool_init(const char *name);
+extern struct recv_pool *recv_pool_init(const char *name, int flags);
+
+/** Set up priority classes for a receive pool
+ *
+ * This must be called before the receive pool is hooked up to any messengers.
+ * Without it, every message goes in RECV_POOL_PRIO_NORMAL and there are no
+ * limits.
+ *
+ * @param rpool		The receive pool
+ * @param classify	Function which decides what class a message belongs in
+ * @param conf		Array of RECV_POOL_NUM_PRIO class configurations
+ *
+ * @return		0 on success; -EINVAL if the configuration is invalid
+ */
+extern int recv_pool_set_prio(struct recv_pool *rpool,
+	recv_pool_classify_fn_t classify, const struct recv_pool_prio_conf *conf);
 
 /** Hook up a messenger to a receive pool
  *
@@ -67,11 +154,21 @@ extern void recv_pool_msgr_listen(struct recv_pool *rpool, struct msgr *msgr,
  * @param handler	The handler function to invoke on each RPC
  * @param priv		Pointer to put in rt->base.priv
  *
- * @return		0 on success; error code otherwise
+ * @return		0 on success; error code otherwise.  -ENOSPC means
+ *			that the pool already has RECV_POOL_MAX_THREADS
+ *			threads.
  */
 extern int recv_pool_thread_create(struct recv_pool *rpool,
 	struct fast_log_mgr *mgr, recv_pool_handler_fn_t handler, void *priv);
 
+/** Get statistics about a receive pool
+ *
+ * @param rpool		The receive pool
+ * @param st		(out param) the statistics
+ */
+extern void recv_pool_get_stats(struct recv_pool *rpool,
+	struct recv_pool_stats *st);
+
 /** Join all threads in a receive pool
  *
  * @rpool		The receive pool
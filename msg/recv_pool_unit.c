@@ -17,9 +17,11 @@
  */
 
 #include "core/process_ctx.h"
+#include "msg/bsend.h"
 #include "msg/recv_pool.h"
 #include "msg/msg.h"
 #include "msg/msgr.h"
+#include "msg/xdr.h"
 #include "util/compiler.h"
 #include "util/fast_log.h"
 #include "util/macro.h"
@@ -35,12 +37,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MSGR_UNIT_PORT 9096
 #define RECV_POOL_UNIT_RT_MAX 32
 
 enum {
 	mmm_test40_ty = 9040,
+	mmm_test41_ty = 9041,
+	mmm_test42_ty = 9042,
 };
 
 PACKED(
@@ -55,7 +60,7 @@ static int recv_pool_test_init_shutdown(void)
 {
 	struct recv_pool *rpool;
 
-	rpool = recv_pool_init("my_tpool");
+	rpool = recv_pool_init("my_tpool", 0);
 	EXPECT_NOT_ERRPTR(rpool);
 	recv_pool_join(rpool);
 	recv_pool_free(rpool);
@@ -151,7 +156,7 @@ static int recv_pool_test_recv(int nthreads, int niter)
 	EXPECT_ZERO(pthread_cond_init(&g_full_set_cond, NULL));
 	EXPECT_ZERO(pthread_mutex_init(&g_full_set_lock, NULL));
 	g_current_iter_lowest = 0;
-	rpool = recv_pool_init("my_tpool");
+	rpool = recv_pool_init("my_tpool", 0);
 	EXPECT_NOT_ERRPTR(rpool);
 	foo_msgr = msgr_init(err, err_len, &foo_msgr_conf);
 	EXPECT_ZERO(err[0]);
@@ -196,6 +201,302 @@ static int recv_pool_test_recv(int nthreads, int niter)
 	return 0;
 }
 
+static sem_t g_stream_sem;
+static int g_stream_bad;
+static int g_stream_thread_idx;
+static uint32_t g_stream_next_q;
+
+static int recv_pool_test_stream_handler(struct recv_pool_thread *rt,
+		struct mtran *tr)
+{
+	struct mmm_test40 *m = (struct mmm_test40 *)tr->m;
+	uint32_t q;
+
+	q = unpack_from_be32(&m->q);
+	/* With RECV_POOL_FLAG_CONN_ORDER, every message from our one
+	 * connection must be handled by the same thread, in order.  So there
+	 * is no need for locking here. */
+	if (g_stream_thread_idx < 0)
+		g_stream_thread_idx = rt->idx;
+	if ((rt->idx != g_stream_thread_idx) || (q != g_stream_next_q))
+		g_stream_bad = 1;
+	g_stream_next_q = q + 1;
+	mtran_free(tr);
+	sem_post(&g_stream_sem);
+	return 0;
+}
+
+static int recv_pool_test_handler_count(
+		POSSIBLY_UNUSED(struct recv_pool_thread *rt), struct mtran *tr)
+{
+	mtran_free(tr);
+	sem_post(&g_stream_sem);
+	return 0;
+}
+
+static int recv_pool_test_stream(int nthreads, int nmsgs, int flags)
+{
+	int i;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct recv_pool *rpool;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	struct msgr_conf foo_msgr_conf = {
+		.max_conn = 10,
+		.max_tran = 10,
+		.tcp_teardown_timeo = 10,
+		.name = "foo_msgr",
+		.fl_mgr = NULL,
+	};
+	struct msgr_conf bar_msgr_conf = {
+		.max_conn = 10,
+		.max_tran = 10,
+		.tcp_teardown_timeo = 10,
+		.name = "bar_msgr",
+		.fl_mgr = NULL,
+	};
+	foo_msgr_conf.fl_mgr = g_fast_log_mgr;
+	bar_msgr_conf.fl_mgr = g_fast_log_mgr;
+
+	EXPECT_ZERO(sem_init(&g_stream_sem, 0, 0));
+	g_stream_bad = 0;
+	g_stream_thread_idx = -1;
+	g_stream_next_q = 0;
+	rpool = recv_pool_init("my_tpool", flags);
+	EXPECT_NOT_ERRPTR(rpool);
+	foo_msgr = msgr_init(err, err_len, &foo_msgr_conf);
+	EXPECT_ZERO(err[0]);
+	bar_msgr = msgr_init(err, err_len, &bar_msgr_conf);
+	EXPECT_ZERO(err[0]);
+	recv_pool_msgr_listen(rpool, bar_msgr,
+			MSGR_UNIT_PORT, err, sizeof(err));
+	EXPECT_ZERO(err[0]);
+	for (i = 0; i < nthreads; ++i) {
+		EXPECT_ZERO(recv_pool_thread_create(rpool, g_fast_log_mgr,
+			(flags & RECV_POOL_FLAG_CONN_ORDER) ?
+				recv_pool_test_stream_handler :
+				recv_pool_test_handler_count, NULL));
+	}
+	msgr_start(foo_msgr, err, err_len);
+	EXPECT_ZERO(err[0]);
+	msgr_start(bar_msgr, err, err_len);
+	EXPECT_ZERO(err[0]);
+	for (i = 0; i < nmsgs; ++i) {
+		EXPECT_ZERO(send_foo_tr(foo_msgr, foo_cb, i));
+	}
+	for (i = 0; i < nmsgs; ++i) {
+		sem_wait(&g_stream_sem);
+	}
+	EXPECT_ZERO(g_stream_bad);
+	recv_pool_join(rpool);
+	recv_pool_free(rpool);
+
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+	sem_destroy(&g_stream_sem);
+	return 0;
+}
+
+#define PRIO_TEST_NUM_HIGH 8
+#define PRIO_TEST_NUM_BULK 6
+#define PRIO_TEST_MAX_BULK 4
+#define PRIO_TEST_NUM_REPLIES (2 + PRIO_TEST_NUM_HIGH + PRIO_TEST_NUM_BULK)
+
+static sem_t g_prio_started_sem;
+static sem_t g_prio_gate_sem;
+static sem_t g_prio_reply_sem;
+static char g_prio_order[PRIO_TEST_NUM_REPLIES + 1];
+static int g_prio_order_len;
+static int g_prio_num_ok;
+static int g_prio_num_again;
+static int g_prio_bad;
+
+static int prio_test_classify(uint16_t ty)
+{
+	switch (ty) {
+	case mmm_test40_ty:
+		return RECV_POOL_PRIO_BULK;
+	case mmm_test41_ty:
+		return RECV_POOL_PRIO_HIGH;
+	default:
+		return RECV_POOL_PRIO_NORMAL;
+	}
+}
+
+static int recv_pool_test_prio_handler(struct recv_pool_thread *rt,
+		struct mtran *tr)
+{
+	uint16_t ty;
+
+	ty = unpack_from_be16(&tr->m->ty);
+	msg_release(tr->m);
+	tr->m = NULL;
+	if (ty == mmm_test42_ty) {
+		/* Hold up the only thread until the test has filled up the
+		 * queue. */
+		sem_post(&g_prio_started_sem);
+		sem_wait(&g_prio_gate_sem);
+	}
+	else {
+		g_prio_order[g_prio_order_len++] =
+			(ty == mmm_test41_ty) ? 'H' : 'B';
+	}
+	return bsend_std_reply(rt->base.fb, rt->ctx, tr, 0);
+}
+
+static void prio_cb(struct mconn *conn, struct mtran *tr)
+{
+	int ret;
+
+	if (tr->state == MTRAN_STATE_SENT) {
+		mtran_recv_next(conn, tr);
+		return;
+	}
+	if (IS_ERR(tr->m))
+		ret = -PTR_ERR(tr->m);
+	else
+		ret = msg_xdr_decode_as_generic(tr->m);
+	if (ret == 0)
+		__sync_fetch_and_add(&g_prio_num_ok, 1);
+	else if (ret == EAGAIN)
+		__sync_fetch_and_add(&g_prio_num_again, 1);
+	else
+		g_prio_bad = 1;
+	mtran_free(tr);
+	sem_post(&g_prio_reply_sem);
+}
+
+static int send_prio_tr(struct msgr *msgr, uint16_t ty, uint8_t flags)
+{
+	struct mtran *tr;
+	struct mmm_test40 *mout;
+
+	tr = mtran_alloc(msgr);
+	if (!tr)
+		return -ENOMEM;
+	mout = calloc_msg(ty, sizeof(struct mmm_test40));
+	if (!mout) {
+		mtran_free(tr);
+		return -ENOMEM;
+	}
+	mout->base.flags = flags;
+	tr->ip = g_localhost;
+	tr->port = MSGR_UNIT_PORT;
+	mtran_send(msgr, tr, prio_cb, NULL, (struct msg*)mout, 60);
+	return 0;
+}
+
+static int recv_pool_test_prio(void)
+{
+	int i;
+	struct msgr *foo_msgr, *bar_msgr;
+	struct recv_pool *rpool;
+	struct recv_pool_stats st;
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	struct msgr_conf foo_msgr_conf = {
+		.max_conn = 10,
+		.max_tran = 100,
+		.tcp_teardown_timeo = 10,
+		.name = "foo_msgr",
+		.fl_mgr = NULL,
+	};
+	struct msgr_conf bar_msgr_conf = {
+		.max_conn = 10,
+		.max_tran = 100,
+		.tcp_teardown_timeo = 10,
+		.name = "bar_msgr",
+		.fl_mgr = NULL,
+	};
+	struct recv_pool_prio_conf prio_conf[RECV_POOL_NUM_PRIO] = {
+		[RECV_POOL_PRIO_HIGH] = { .weight = 2, .max_pending = 0 },
+		[RECV_POOL_PRIO_NORMAL] = { .weight = 1, .max_pending = 0 },
+		[RECV_POOL_PRIO_BULK] = { .weight = 1,
+			.max_pending = PRIO_TEST_MAX_BULK },
+	};
+	struct recv_pool_prio_conf bad_conf[RECV_POOL_NUM_PRIO] = {
+		{ .weight = 1 }, { .weight = 0 }, { .weight = 1 },
+	};
+	foo_msgr_conf.fl_mgr = g_fast_log_mgr;
+	bar_msgr_conf.fl_mgr = g_fast_log_mgr;
+
+	EXPECT_ZERO(sem_init(&g_prio_started_sem, 0, 0));
+	EXPECT_ZERO(sem_init(&g_prio_gate_sem, 0, 0));
+	EXPECT_ZERO(sem_init(&g_prio_reply_sem, 0, 0));
+	memset(g_prio_order, 0, sizeof(g_prio_order));
+	g_prio_order_len = 0;
+	g_prio_num_ok = 0;
+	g_prio_num_again = 0;
+	g_prio_bad = 0;
+	rpool = recv_pool_init("my_tpool", 0);
+	EXPECT_NOT_ERRPTR(rpool);
+	EXPECT_EQ(recv_pool_set_prio(rpool, prio_test_classify, bad_conf),
+		-EINVAL);
+	EXPECT_ZERO(recv_pool_set_prio(rpool, prio_test_classify,
+		prio_conf));
+	foo_msgr = msgr_init(err, err_len, &foo_msgr_conf);
+	EXPECT_ZERO(err[0]);
+	bar_msgr = msgr_init(err, err_len, &bar_msgr_conf);
+	EXPECT_ZERO(err[0]);
+	recv_pool_msgr_listen(rpool, bar_msgr,
+			MSGR_UNIT_PORT, err, sizeof(err));
+	EXPECT_ZERO(err[0]);
+	EXPECT_ZERO(recv_pool_thread_create(rpool, g_fast_log_mgr,
+		recv_pool_test_prio_handler, NULL));
+	msgr_start(foo_msgr, err, err_len);
+	EXPECT_ZERO(err[0]);
+	msgr_start(bar_msgr, err, err_len);
+	EXPECT_ZERO(err[0]);
+
+	/* Occupy the thread, then queue up a mix of bulk and high-priority
+	 * requests behind it.  The bulk requests arrive first, and the last
+	 * few of them should be turned away, except for the one that must be
+	 * done. */
+	EXPECT_ZERO(send_prio_tr(foo_msgr, mmm_test42_ty, 0));
+	sem_wait(&g_prio_started_sem);
+	for (i = 0; i < PRIO_TEST_NUM_BULK; ++i)
+		EXPECT_ZERO(send_prio_tr(foo_msgr, mmm_test40_ty, 0));
+	EXPECT_ZERO(send_prio_tr(foo_msgr, mmm_test40_ty, MSG_FLAG_MUSTDO));
+	for (i = 0; i < PRIO_TEST_NUM_HIGH; ++i)
+		EXPECT_ZERO(send_prio_tr(foo_msgr, mmm_test41_ty, 0));
+	while (1) {
+		recv_pool_get_stats(rpool, &st);
+		if ((st.pending[RECV_POOL_PRIO_HIGH] == PRIO_TEST_NUM_HIGH) &&
+		    (st.pending[RECV_POOL_PRIO_BULK] ==
+				PRIO_TEST_MAX_BULK + 1) &&
+		    (st.rejected[RECV_POOL_PRIO_BULK] ==
+				PRIO_TEST_NUM_BULK - PRIO_TEST_MAX_BULK))
+			break;
+		usleep(1000);
+	}
+	EXPECT_ZERO(st.rejected[RECV_POOL_PRIO_HIGH]);
+	sem_post(&g_prio_gate_sem);
+	for (i = 0; i < PRIO_TEST_NUM_REPLIES; ++i)
+		sem_wait(&g_prio_reply_sem);
+	EXPECT_ZERO(g_prio_bad);
+	EXPECT_EQ(g_prio_num_again, PRIO_TEST_NUM_BULK - PRIO_TEST_MAX_BULK);
+	EXPECT_EQ(g_prio_num_ok, 2 + PRIO_TEST_NUM_HIGH + PRIO_TEST_MAX_BULK);
+	/* High-priority requests get two turns for every one that bulk
+	 * requests get, even though the bulk requests arrived first. */
+	EXPECT_ZERO(strcmp(g_prio_order, "HHBHHBHHBHHBB"));
+	recv_pool_get_stats(rpool, &st);
+	for (i = 0; i < RECV_POOL_NUM_PRIO; ++i)
+		EXPECT_ZERO(st.pending[i]);
+	recv_pool_join(rpool);
+	recv_pool_free(rpool);
+
+	msgr_shutdown(foo_msgr);
+	msgr_shutdown(bar_msgr);
+	msgr_free(foo_msgr);
+	msgr_free(bar_msgr);
+	sem_destroy(&g_prio_started_sem);
+	sem_destroy(&g_prio_gate_sem);
+	sem_destroy(&g_prio_reply_sem);
+	return 0;
+}
+
 int main(POSSIBLY_UNUSED(int argc), char **argv)
 {
 	EXPECT_ZERO(utility_ctx_init(argv[0]));
@@ -204,6 +505,9 @@ int main(POSSIBLY_UNUSED(int argc), char **argv)
 	EXPECT_ZERO(recv_pool_test_recv(1, 1));
 	EXPECT_ZERO(recv_pool_test_recv(3, 1));
 	EXPECT_ZERO(recv_pool_test_recv(10, 5));
+	EXPECT_ZERO(recv_pool_test_stream(8, 2000, 0));
+	EXPECT_ZERO(recv_pool_test_stream(4, 500, RECV_POOL_FLAG_CONN_ORDER));
+	EXPECT_ZERO(recv_pool_test_prio());
 	process_ctx_shutdown();
 
 	return EXIT_SUCCESS;
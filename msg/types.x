@@ -83,6 +83,11 @@ enum fish_msg_ty {
 	mmm_remove_user_from_group_ty,
 	/** Client request to get user info */
 	mmm_get_user_info_req_ty,
+	/** get messenger statistics.  This is answered by the messenger
+	 * itself, so every daemon supports it. */
+	mmm_msgr_stats_req_ty,
+	/** response to mmm_msgr_stats_req */
+	mmm_msgr_stats_resp_ty,
 	/** client request to create a new file */
 	mmm_create_file_req_ty = 2000,
 	/** client request to open a new file */
@@ -107,6 +112,11 @@ enum fish_msg_ty {
 	mmm_rename_req_ty,
 	/** Locate blocks in a file */
 	mmm_locate_req_ty,
+	/** list all files in a directory, with a compact response.  The
+	 * payload is an mmm_listdir_req. */
+	mmm_listdir_compact_req_ty,
+	/** get the progress of chunk re-replication */
+	mmm_rerep_stats_req_ty,
 
 	/* ============== mds messages ============== */
 	/** current mds status */
@@ -125,6 +135,11 @@ enum fish_msg_ty {
 	mmm_get_user_info_resp_ty,
 	/** response to locate request */
 	mmm_locate_resp_ty,
+	/** mds response to a compact 'list directory' request.  This is not
+	 * XDR-encoded; see msg/lpack.h for the format. */
+	mmm_listdir_compact_resp_ty,
+	/** response to mmm_rerep_stats_req */
+	mmm_rerep_stats_resp_ty,
 
 	/* ============== osd messages ============== */
 	/** request to read from the osd */
@@ -138,7 +153,18 @@ enum fish_msg_ty {
 	/** osd response to chunk report request */
 	mmm_osd_chunkrep_resp_ty,
 	/** mds request to unlink a chunk */
-	mmm_osd_unlink_req_ty
+	mmm_osd_unlink_req_ty,
+	/** osd report of chunks which failed their checksums.  No response is
+	 * sent. */
+	mmm_osd_corrupt_chunks_ty,
+	/** mds request to copy a chunk to another osd */
+	mmm_osd_chunk_copy_req_ty,
+	/** osd response to a successful chunk copy */
+	mmm_osd_chunk_copy_resp_ty,
+	/** request for the checksum of a whole chunk */
+	mmm_osd_chunk_csum_req_ty,
+	/** osd response to mmm_osd_chunk_csum_req */
+	mmm_osd_chunk_csum_resp_ty
 };
 
 /* ============== Common ============== */
@@ -155,6 +181,102 @@ struct mmm_status_req {
 	int flags;
 };
 
+/** Number of buckets in a messenger latency histogram.  Bucket 0 counts
+ * round trips that took less than 2 microseconds; bucket N counts those that
+ * took [2**N, 2**(N+1)) microseconds.  The last bucket also counts anything
+ * slower. */
+const MMM_MSGR_LAT_BUCKETS = 24;
+
+/** Maximum number of message types in a messenger statistics response */
+const MMM_MSGR_STATS_MAX_TY = 64;
+
+/** Maximum number of connections in a messenger statistics response */
+const MMM_MSGR_STATS_MAX_CONN = 4096;
+
+/** Maximum length of a messenger name, including terminating NULL */
+const MMM_MSGR_NAME_MAX = 64;
+
+/** mmm_msgr_stats_req flag: include per-connection statistics */
+const MMM_MSGR_STATS_CONNS = 0x1;
+
+/** mmm_msgr_conn_stats flag: the connection uses a local socket */
+const MMM_MSGR_CONN_LOCAL = 0x1;
+/** mmm_msgr_conn_stats flag: the connection has been established */
+const MMM_MSGR_CONN_ESTABLISHED = 0x2;
+/** mmm_msgr_conn_stats flag: the peer has closed its end */
+const MMM_MSGR_CONN_READ_EOF = 0x4;
+/** mmm_msgr_conn_stats flag: the peer can decompress LZ4 messages */
+const MMM_MSGR_CONN_LZ4 = 0x8;
+
+struct mmm_msgr_stats_req {
+	int flags;
+};
+
+/** Statistics about one message type */
+struct mmm_msgr_ty_stats {
+	unsigned int ty;
+	unsigned hyper msgs_in;
+	unsigned hyper msgs_out;
+	unsigned hyper bytes_in;
+	unsigned hyper bytes_out;
+	/** Time from mtran_send to the reply being delivered, for requests of
+	 * this type that we sent */
+	unsigned int lat_hist[MMM_MSGR_LAT_BUCKETS];
+};
+
+/** Statistics about one connection */
+struct mmm_msgr_conn_stats {
+	unsigned int ip;
+	unsigned int port;
+	unsigned int lane;
+	unsigned int flags;
+	unsigned hyper msgs_in;
+	unsigned hyper msgs_out;
+	unsigned hyper bytes_in;
+	unsigned hyper bytes_out;
+	/** Bytes waiting to be sent */
+	unsigned hyper queued_bytes;
+	/** Transactors waiting to send */
+	unsigned int pending;
+	/** Transactors waiting to receive */
+	unsigned int active;
+	/** Transactors that timed out on this connection */
+	unsigned int timeouts;
+	/** Compressed message bodies received, before decompression */
+	unsigned hyper lz4_comp_in;
+	/** Compressed message bodies received, after decompression */
+	unsigned hyper lz4_raw_in;
+	/** Compressed message bodies sent, after compression */
+	unsigned hyper lz4_comp_out;
+	/** Compressed message bodies sent, before compression */
+	unsigned hyper lz4_raw_out;
+};
+
+struct mmm_msgr_stats_resp {
+	string name<MMM_MSGR_NAME_MAX>;
+	unsigned int backend;
+	unsigned hyper msgs_in;
+	unsigned hyper msgs_out;
+	unsigned hyper bytes_in;
+	unsigned hyper bytes_out;
+	/** Outbound connections we have opened */
+	unsigned hyper conns_opened;
+	/** Inbound connections we have accepted */
+	unsigned hyper conns_accepted;
+	/** Outbound connections opened to an endpoint we had been connected to
+	 * before */
+	unsigned hyper reconnects;
+	/** Connections torn down for any reason */
+	unsigned hyper teardowns;
+	/** Transactors that timed out */
+	unsigned hyper timeouts;
+	/** Number of connections currently open.  This may be more than the
+	 * number of entries in conn. */
+	unsigned int num_conn;
+	struct mmm_msgr_ty_stats ty<MMM_MSGR_STATS_MAX_TY>;
+	struct mmm_msgr_conn_stats conn<MMM_MSGR_STATS_MAX_CONN>;
+};
+
 /* ============== Client Requests ============== */
 struct mmm_set_primary_user_group {
 	string user<RF_USER_MAX>;
@@ -271,6 +393,37 @@ struct mmm_mds_status_resp {
 	int pri_mid;
 };
 
+struct mmm_rerep_stats_req {
+	int flags;
+};
+
+/** Progress of chunk re-replication on the primary MDS.  The chunk counts are
+ * as of the last scan, less the chunks that have been fixed since. */
+struct mmm_rerep_stats_resp {
+	/** Nonzero if this MDS is the one doing re-replication */
+	int active;
+	/** Number of OSDs that we think are down */
+	unsigned int osds_down;
+	/** Number of times the chunk table has been scanned */
+	unsigned hyper scans;
+	/** Time that the last scan finished, in seconds since the epoch */
+	unsigned hyper last_scan;
+	/** Chunks with fewer live replicas than they should have */
+	unsigned hyper under_rep;
+	/** Chunks with only one live replica */
+	unsigned hyper one_left;
+	/** Chunks with no live replicas at all.  These can't be fixed. */
+	unsigned hyper lost;
+	/** Copies being made right now */
+	unsigned int in_flight;
+	/** Copies that have succeeded */
+	unsigned hyper copies_done;
+	/** Copies that have failed */
+	unsigned hyper copies_failed;
+	/** Bytes copied so far */
+	unsigned hyper bytes_copied;
+};
+
 struct mmm_chunkalloc_resp {
 	unsigned hyper cid;
 	struct endpoint ep<RF_MAX_OID>;
@@ -307,12 +460,20 @@ struct mmm_locate_resp {
 };
 
 /* ============== OSD messages ============== */
+/** Ask the OSD to append the CRC32C of the data to the response, so that the
+ * client can check that it wasn't damaged on the way. */
+const MMM_OSD_READ_FLAG_CRC = 0x1;
+
 struct mmm_osd_read_req {
 	unsigned hyper cid;
 	unsigned hyper start;
 	int len;
+	int flags;
 };
 
+/** The data in the response is followed by its big-endian CRC32C */
+const MMM_OSD_READ_RESP_FLAG_CRC = 0x1;
+
 struct mmm_osd_read_resp {
 	int flags;
 	/* next: data */
@@ -320,9 +481,23 @@ struct mmm_osd_read_resp {
 
 const MMM_OSD_HFLUSH_DATA_MAX = 2147483648;
 
+/** The data is the start of the chunk.  Any copy of the chunk that the OSD
+ * already has is thrown away first.  This is how chunks are re-replicated. */
+const MMM_OSD_HFLUSH_FLAG_REPLACE = 0x1;
+
+/** Append data to a chunk.
+ *
+ * If chain is not empty, the OSD passes the data on to the first OSD in it,
+ * along with the rest of the chain, while writing it locally.  The OSD replies
+ * once its own write is done and the next OSD has replied, so a successful
+ * reply means that every OSD in the chain has the data.  This way, the client
+ * only sends each byte once, however many replicas there are.
+ */
 struct mmm_osd_hflush_req {
 	unsigned hyper cid;
 	int flags;
+	/** IDs of the OSDs to pass the data on to, in order */
+	unsigned int chain<RF_MAX_OID>;
 	/* next: data */
 };
 
@@ -340,6 +515,42 @@ struct mmm_osd_unlink_req {
 	unsigned hyper cid;
 };
 
+struct mmm_osd_corrupt_chunks {
+	unsigned int oid;
+	/* next: big-endian 64-bit chunk IDs */
+};
+
+/** Copy a chunk to another OSD.
+ *
+ * The OSD sends the chunk to dst as a series of hflushes, the first of which
+ * has MMM_OSD_HFLUSH_FLAG_REPLACE set, and replies once dst has written all of
+ * them.  The OSD checks the chunk against its own checksums before sending
+ * it.  Failures get a generic response.
+ */
+struct mmm_osd_chunk_copy_req {
+	unsigned hyper cid;
+	unsigned int dst;
+};
+
+struct mmm_osd_chunk_copy_resp {
+	/** Number of bytes copied */
+	unsigned hyper len;
+	/** CRC32C of the bytes copied */
+	unsigned int crc;
+};
+
+/** Get the length and CRC32C of a whole chunk.  This is how a copy made by
+ * mmm_osd_chunk_copy_req is checked before the MDS relies on it.  Failures
+ * get a generic response. */
+struct mmm_osd_chunk_csum_req {
+	unsigned hyper cid;
+};
+
+struct mmm_osd_chunk_csum_resp {
+	unsigned hyper len;
+	unsigned int crc;
+};
+
 struct mmm_create_file_resp {
 	uint64_t nid;
 };
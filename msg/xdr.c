@@ -17,6 +17,7 @@
  */
 
 #include "msg/msg.h"
+#include "msg/mslab.h"
 #include "msg/types.h"
 #include "msg/xdr.h"
 #include "util/compiler.h"
@@ -31,6 +32,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct msg* msg_xdr_alloc(uint16_t ty, xdrproc_t xdrproc, void *payload)
 {
@@ -38,30 +40,229 @@ struct msg* msg_xdr_alloc(uint16_t ty, xdrproc_t xdrproc, void *payload)
 	return msg_xdr_extalloc(ty, xdrproc, payload, 0, &v);
 }
 
+/** Payload space to start out with when encoding a message.  Most messages
+ * fit in this. */
+#define MSG_XDR_INIT_CAP 256
+
+/** Largest XDR payload we will encode */
+#define MSG_XDR_MAX_CAP 0x7fffffffU
+
+/* libtirpc doesn't constify the argument to x_getpostn */
+#ifdef _TIRPC_XDR_H
+#define XDR_GETPOSTN_CONST
+#else
+#define XDR_GETPOSTN_CONST const
+#endif
+
+/** An XDR stream which encodes into a message, growing it as needed
+ *
+ * This lets us encode a message in a single pass, rather than running the
+ * encoder once with xdr_sizeof to find out how big the message will be.
+ */
+struct xdr_grow {
+	/** The message being encoded */
+	struct msg *m;
+	/** Space available for the payload */
+	uint32_t cap;
+	/** Current position in the payload */
+	uint32_t pos;
+	/** Set if we failed to grow the message */
+	int oom;
+};
+
+/** Make sure there is space to encode some more bytes
+ *
+ * @param g		The stream
+ * @param len		Number of bytes we want to encode
+ *
+ * @return		Pointer to the space, or NULL on error
+ */
+static char *xdr_grow_reserve(struct xdr_grow *g, u_int len)
+{
+	uint32_t cap;
+	struct msg *m;
+	char *p;
+
+	if (len > MSG_XDR_MAX_CAP - g->pos)
+		return NULL;
+	if (g->pos + len > g->cap) {
+		cap = g->cap;
+		while (cap < g->pos + len) {
+			if (cap > MSG_XDR_MAX_CAP / 2)
+				cap = MSG_XDR_MAX_CAP;
+			else
+				cap *= 2;
+		}
+		m = mslab_realloc(g->m, sizeof(struct msg) + cap);
+		if (!m) {
+			g->oom = 1;
+			return NULL;
+		}
+		g->m = m;
+		g->cap = cap;
+	}
+	p = g->m->data + g->pos;
+	g->pos += len;
+	return p;
+}
+
+static bool_t xdr_grow_getlong(POSSIBLY_UNUSED(XDR *xdrs),
+		POSSIBLY_UNUSED(long *lp))
+{
+	return FALSE;
+}
+
+static bool_t xdr_grow_putlong(XDR *xdrs, const long *lp)
+{
+	char *p;
+
+	p = xdr_grow_reserve((struct xdr_grow*)xdrs->x_private,
+		sizeof(uint32_t));
+	if (!p)
+		return FALSE;
+	pack_to_be32(p, (uint32_t)*lp);
+	return TRUE;
+}
+
+static bool_t xdr_grow_getbytes(POSSIBLY_UNUSED(XDR *xdrs),
+		POSSIBLY_UNUSED(char *addr), POSSIBLY_UNUSED(u_int len))
+{
+	return FALSE;
+}
+
+static bool_t xdr_grow_putbytes(XDR *xdrs, const char *addr, u_int len)
+{
+	char *p;
+
+	p = xdr_grow_reserve((struct xdr_grow*)xdrs->x_private, len);
+	if (!p)
+		return FALSE;
+	memcpy(p, addr, len);
+	return TRUE;
+}
+
+static u_int xdr_grow_getpostn(XDR_GETPOSTN_CONST XDR *xdrs)
+{
+	return ((struct xdr_grow*)xdrs->x_private)->pos;
+}
+
+static bool_t xdr_grow_setpostn(XDR *xdrs, u_int pos)
+{
+	struct xdr_grow *g = (struct xdr_grow*)xdrs->x_private;
+
+	if (pos > g->cap)
+		return FALSE;
+	g->pos = pos;
+	return TRUE;
+}
+
+static int32_t *xdr_grow_inline(XDR *xdrs, u_int len)
+{
+	struct xdr_grow *g = (struct xdr_grow*)xdrs->x_private;
+	uint32_t pos = g->pos;
+
+	if (!xdr_grow_reserve(g, len))
+		return NULL;
+	if (((uintptr_t)(g->m->data + pos)) & (sizeof(int32_t) - 1)) {
+		/* The caller will fall back on the ordinary functions. */
+		g->pos = pos;
+		return NULL;
+	}
+	return (int32_t*)(g->m->data + pos);
+}
+
+static void xdr_grow_destroy(POSSIBLY_UNUSED(XDR *xdrs))
+{
+}
+
+#ifdef _TIRPC_XDR_H
+static bool_t xdr_grow_control(POSSIBLY_UNUSED(XDR *xdrs),
+		POSSIBLY_UNUSED(int request), POSSIBLY_UNUSED(void *info))
+{
+	return FALSE;
+}
+#else
+static bool_t xdr_grow_getint32(POSSIBLY_UNUSED(XDR *xdrs),
+		POSSIBLY_UNUSED(int32_t *ip))
+{
+	return FALSE;
+}
+
+static bool_t xdr_grow_putint32(XDR *xdrs, const int32_t *ip)
+{
+	char *p;
+
+	p = xdr_grow_reserve((struct xdr_grow*)xdrs->x_private,
+		sizeof(uint32_t));
+	if (!p)
+		return FALSE;
+	pack_to_be32(p, (uint32_t)*ip);
+	return TRUE;
+}
+#endif
+
+static const struct xdr_ops g_xdr_grow_ops = {
+	.x_getlong = xdr_grow_getlong,
+	.x_putlong = xdr_grow_putlong,
+	.x_getbytes = xdr_grow_getbytes,
+	.x_putbytes = xdr_grow_putbytes,
+	.x_getpostn = xdr_grow_getpostn,
+	.x_setpostn = xdr_grow_setpostn,
+	.x_inline = xdr_grow_inline,
+	.x_destroy = xdr_grow_destroy,
+#ifdef _TIRPC_XDR_H
+	.x_control = xdr_grow_control,
+#else
+	.x_getint32 = xdr_grow_getint32,
+	.x_putint32 = xdr_grow_putint32,
+#endif
+};
+
 struct msg* msg_xdr_extalloc(uint16_t ty, xdrproc_t xdrproc, void *payload,
 		size_t extra_len, void **extra)
 {
 	struct msg *m;
-	size_t xl;
+	struct xdr_grow g;
 	uint32_t len;
 	XDR xdrs;
 
-	xl = xdr_sizeof(xdrproc, payload);
-	len = sizeof(struct msg) + xl + extra_len;
-	m = calloc(1, len);
-	if (!m)
+	if (extra_len > MSG_XDR_MAX_CAP)
+		return ERR_PTR(EINVAL);
+	memset(&g, 0, sizeof(g));
+	g.cap = MSG_XDR_INIT_CAP;
+	g.m = mslab_alloc(sizeof(struct msg) + g.cap);
+	if (!g.m)
 		return ERR_PTR(ENOMEM);
-	pack_to_be32(&m->len, len);
-	pack_to_be16(&m->ty, ty);
-	pack_to_8(&m->refcnt, 1);
-	xdrmem_create(&xdrs, (void*)&m->data, xl, XDR_ENCODE);
+	memset(&xdrs, 0, sizeof(xdrs));
+	xdrs.x_op = XDR_ENCODE;
+	xdrs.x_ops = (struct xdr_ops*)&g_xdr_grow_ops;
+	xdrs.x_private = (void*)&g;
 	if (!xdrproc(&xdrs, (void*)payload)) {
-		free(m);
-		xdr_destroy(&xdrs);
+		mslab_free(g.m);
+		return ERR_PTR(g.oom ? ENOMEM : EINVAL);
+	}
+	if (extra_len > MSG_XDR_MAX_CAP - g.pos) {
+		mslab_free(g.m);
 		return ERR_PTR(EINVAL);
 	}
-	xdr_destroy(&xdrs);
-	*extra = m->data + xl;
+	len = sizeof(struct msg) + g.pos + extra_len;
+	m = g.m;
+	if ((g.pos + extra_len > g.cap) || ((g.cap > MSLAB_MAX_CLASS_SIZE) &&
+			(g.cap / 2 > g.pos + extra_len))) {
+		/* Make room for the extra space, or give back a lot of
+		 * unused space from a large message. */
+		m = mslab_realloc(g.m, len);
+		if (!m) {
+			mslab_free(g.m);
+			return ERR_PTR(ENOMEM);
+		}
+	}
+	memset(m, 0, sizeof(struct msg));
+	pack_to_be32(&m->len, len);
+	pack_to_be16(&m->ty, ty);
+	pack_to_8(&m->refcnt, 1);
+	*extra = m->data + g.pos;
+	memset(*extra, 0, extra_len);
 	return m;
 }
 
@@ -82,7 +283,12 @@ int32_t msg_xdr_extdecode(xdrproc_t xdrproc, const struct msg *m,
 	}
 	cl = xdr_getpos(&xdrs);
 	xdr_destroy(&xdrs);
-	*extra = ((char*)out) + cl;
+	if (cl > xl) {
+		xdr_free(xdrproc, out);
+		return -EINVAL;
+	}
+	/* The extra data follows the XDR part in the message itself */
+	*extra = m->data + cl;
 	return xl - cl;
 }
 
@@ -93,6 +299,120 @@ int32_t msg_xdr_decode(xdrproc_t xdrproc, const struct msg *m,
 	return msg_xdr_extdecode(xdrproc, m, out, &extra);
 }
 
+int xdr_cursor_init(struct xdr_cursor *cur, struct msg *m)
+{
+	uint32_t xl;
+
+	xl = unpack_from_be32(&m->len) - sizeof(struct msg);
+	if (xl > 0x7fffffff)
+		return -EINVAL;
+	cur->pos = m->data;
+	cur->rem = xl;
+	return 0;
+}
+
+int xdr_cursor_get_u32(struct xdr_cursor *cur, uint32_t *u)
+{
+	if (cur->rem < sizeof(uint32_t))
+		return -EINVAL;
+	*u = unpack_from_be32(cur->pos);
+	cur->pos += sizeof(uint32_t);
+	cur->rem -= sizeof(uint32_t);
+	return 0;
+}
+
+int xdr_cursor_get_u64(struct xdr_cursor *cur, uint64_t *u)
+{
+	if (cur->rem < sizeof(uint64_t))
+		return -EINVAL;
+	*u = unpack_from_be64(cur->pos);
+	cur->pos += sizeof(uint64_t);
+	cur->rem -= sizeof(uint64_t);
+	return 0;
+}
+
+int xdr_cursor_get_opaque(struct xdr_cursor *cur, uint32_t max,
+		struct xdr_view *v)
+{
+	uint32_t len, plen;
+
+	if (xdr_cursor_get_u32(cur, &len))
+		return -EINVAL;
+	if (len > max)
+		return -EINVAL;
+	/* XDR pads everything out to a multiple of 4 bytes */
+	plen = (len + 3) & ~3;
+	if ((plen < len) || (cur->rem < plen))
+		return -EINVAL;
+	v->buf = cur->pos;
+	v->len = len;
+	cur->pos += plen;
+	cur->rem -= plen;
+	return 0;
+}
+
+int xdr_cursor_get_string(struct xdr_cursor *cur, uint32_t max,
+		struct xdr_view *v)
+{
+	if (xdr_cursor_get_opaque(cur, max, v))
+		return -EINVAL;
+	if (v->len & 3) {
+		/* There is at least one byte of padding after the string,
+		 * and padding is supposed to be zero anyway. */
+		v->buf[v->len] = '\0';
+	}
+	else {
+		/* No padding.  Slide the string back over the last byte of
+		 * its length, which we have already decoded. */
+		memmove(v->buf - 1, v->buf, v->len);
+		v->buf--;
+		v->buf[v->len] = '\0';
+	}
+	return 0;
+}
+
+int32_t msg_xdr_view_mmm_path_stat_req(struct msg *m,
+		struct mmm_path_stat_req_view *out)
+{
+	struct xdr_cursor cur;
+
+	if (xdr_cursor_init(&cur, m))
+		return -EINVAL;
+	if (xdr_cursor_get_string(&cur, RF_PATH_MAX, &out->path))
+		return -EINVAL;
+	if (xdr_cursor_get_string(&cur, RF_USER_MAX, &out->user))
+		return -EINVAL;
+	return cur.rem;
+}
+
+int32_t msg_xdr_view_mmm_listdir_req(struct msg *m,
+		struct mmm_listdir_req_view *out)
+{
+	struct xdr_cursor cur;
+
+	if (xdr_cursor_init(&cur, m))
+		return -EINVAL;
+	if (xdr_cursor_get_string(&cur, RF_PATH_MAX, &out->path))
+		return -EINVAL;
+	if (xdr_cursor_get_string(&cur, RF_USER_MAX, &out->user))
+		return -EINVAL;
+	return cur.rem;
+}
+
+int32_t msg_xdr_view_mmm_nid_stat_req(struct msg *m,
+		struct mmm_nid_stat_req_view *out)
+{
+	struct xdr_cursor cur;
+
+	if (xdr_cursor_init(&cur, m))
+		return -EINVAL;
+	if (xdr_cursor_get_u64(&cur, &out->nid))
+		return -EINVAL;
+	if (xdr_cursor_get_string(&cur, RF_USER_MAX, &out->user))
+		return -EINVAL;
+	return cur.rem;
+}
+
 int32_t msg_xdr_decode_as_generic(const struct msg *m)
 {
 	int32_t ret;
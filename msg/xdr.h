@@ -27,6 +27,46 @@
 #include <unistd.h> /* for size_t */
 #include <rpc/xdr.h> /* for xdrproc_t */
 
+struct msg;
+
+/** A string or variable-length opaque array inside a received message
+ *
+ * This points directly into the message buffer, so it is only valid for as long
+ * as the message is.
+ */
+struct xdr_view {
+	/** Start of the data.  For strings, this is NUL-terminated. */
+	char *buf;
+	/** Length of the data, not including the NUL terminator */
+	uint32_t len;
+};
+
+/** Position within the XDR payload of a received message */
+struct xdr_cursor {
+	/** Next byte to decode */
+	char *pos;
+	/** Number of bytes left in the payload */
+	uint32_t rem;
+};
+
+/** View of an mmm_path_stat_req */
+struct mmm_path_stat_req_view {
+	struct xdr_view path;
+	struct xdr_view user;
+};
+
+/** View of an mmm_listdir_req */
+struct mmm_listdir_req_view {
+	struct xdr_view path;
+	struct xdr_view user;
+};
+
+/** View of an mmm_nid_stat_req */
+struct mmm_nid_stat_req_view {
+	uint64_t nid;
+	struct xdr_view user;
+};
+
 /** Allocate a message with an XDR payload
  *
  * @param ty		The message type
@@ -121,6 +161,95 @@ extern int32_t msg_xdr_decode(xdrproc_t xdrproc,
 	xdr_free((xdrproc_t)xdr_##t, (void*)__p); \
 } while (0);
 
+/** Start decoding the XDR payload of a message in place
+ *
+ * The xdr_cursor functions decode without allocating or copying anything.
+ * Strings and opaque arrays come back as views into the message buffer.
+ *
+ * In order to NUL-terminate strings, decoding a string may modify the message
+ * buffer.  Once you have started decoding a message this way, you can't decode
+ * it again, or send it on.
+ *
+ * @param cur		(out param) the cursor
+ * @param m		The message
+ *
+ * @return		0 on success; -EINVAL if the message is malformed
+ */
+extern int xdr_cursor_init(struct xdr_cursor *cur, struct msg *m);
+
+/** Decode an unsigned int or int
+ *
+ * @param cur		The cursor
+ * @param u		(out param) the value
+ *
+ * @return		0 on success; -EINVAL if the payload is too short
+ */
+extern int xdr_cursor_get_u32(struct xdr_cursor *cur, uint32_t *u);
+
+/** Decode an unsigned hyper or hyper
+ *
+ * @param cur		The cursor
+ * @param u		(out param) the value
+ *
+ * @return		0 on success; -EINVAL if the payload is too short
+ */
+extern int xdr_cursor_get_u64(struct xdr_cursor *cur, uint64_t *u);
+
+/** Decode a string
+ *
+ * @param cur		The cursor
+ * @param max		Maximum string length
+ * @param v		(out param) the string
+ *
+ * @return		0 on success; -EINVAL if the payload is too short or
+ *			the string is too long
+ */
+extern int xdr_cursor_get_string(struct xdr_cursor *cur, uint32_t max,
+		struct xdr_view *v);
+
+/** Decode a variable-length opaque array
+ *
+ * @param cur		The cursor
+ * @param max		Maximum array length
+ * @param v		(out param) the array
+ *
+ * @return		0 on success; -EINVAL if the payload is too short or
+ *			the array is too long
+ */
+extern int xdr_cursor_get_opaque(struct xdr_cursor *cur, uint32_t max,
+		struct xdr_view *v);
+
+/** Decode a message in place
+ *
+ * These are the in-place equivalents of msg_xdr_decode for request types
+ * which the servers only read from.  Nothing needs to be freed afterwards, but
+ * the view is only valid for as long as the message is.  See xdr_cursor_init.
+ *
+ * @param m		The message
+ * @param out		(out param) the view
+ *
+ * @return		negative error code on error, or the number of extra
+ *			bytes at the end of this message.
+ */
+extern int32_t msg_xdr_view_mmm_path_stat_req(struct msg *m,
+		struct mmm_path_stat_req_view *out);
+extern int32_t msg_xdr_view_mmm_listdir_req(struct msg *m,
+		struct mmm_listdir_req_view *out);
+extern int32_t msg_xdr_view_mmm_nid_stat_req(struct msg *m,
+		struct mmm_nid_stat_req_view *out);
+
+/** Decode a message in place
+ *
+ * @param t		The message type
+ * @param m		The message
+ * @param out		(out param) The view structure.  Does not need to be
+ *			freed.
+ *
+ * @return		A negative error code on error, 0 or higher otherwise
+ */
+#define MSG_XDR_VIEW(t, m, out) \
+	(msg_xdr_view_##t(m, out))
+
 /** Try to decode a message as a generic response
  *
  * @param m		The message
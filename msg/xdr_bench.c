@@ -0,0 +1,318 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/process_ctx.h"
+#include "msg/msg.h"
+#include "msg/mslab.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/packed.h"
+
+#include <errno.h>
+#include <rpc/xdr.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * XDR encoding benchmark
+ *
+ * Encodes messages of several of the types in msg/types.x, and measures how
+ * long it takes:
+ *
+ * two_pass	the old way: measure the message with xdr_sizeof, allocate it,
+ *		then encode it into a memory stream
+ * one_pass	msg_xdr_alloc, which encodes straight into a growable message
+ *
+ * Results are printed one per line, as space-separated key=value pairs, so
+ * that they can be compared between builds by a script.
+ */
+
+/** Default number of small messages to encode for each test.  Large messages
+ * are encoded proportionally fewer times. */
+#define XDR_BENCH_DEFAULT_NUM_MSG 200000
+
+/** Number of listdir entries in each listdir response we try */
+static const int g_listdir_sizes[] = { 10, 1000, 10000 };
+
+/** A message to encode */
+struct bench_msg {
+	/** Name of the test */
+	const char *name;
+	/** Message type */
+	uint16_t ty;
+	/** Serialization function */
+	xdrproc_t xdrproc;
+	/** The payload */
+	void *payload;
+	/** Number of times to encode the message */
+	int count;
+};
+
+static uint64_t get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/** Encode a message the way msg_xdr_alloc used to, in two passes
+ *
+ * @param ty		The message type
+ * @param xdrproc	The serialization function to use
+ * @param payload	The data to serialize
+ *
+ * @return		the message, or an error pointer on error
+ */
+static struct msg *two_pass_alloc(uint16_t ty, xdrproc_t xdrproc,
+		void *payload)
+{
+	struct msg *m;
+	size_t xl;
+	uint32_t len;
+	XDR xdrs;
+
+	xl = xdr_sizeof(xdrproc, payload);
+	len = sizeof(struct msg) + xl;
+	m = mslab_zalloc(len);
+	if (!m)
+		return ERR_PTR(ENOMEM);
+	pack_to_be32(&m->len, len);
+	pack_to_be16(&m->ty, ty);
+	pack_to_8(&m->refcnt, 1);
+	xdrmem_create(&xdrs, (void*)&m->data, xl, XDR_ENCODE);
+	if (!xdrproc(&xdrs, (void*)payload)) {
+		mslab_free(m);
+		xdr_destroy(&xdrs);
+		return ERR_PTR(EINVAL);
+	}
+	xdr_destroy(&xdrs);
+	return m;
+}
+
+/** Time encoding a message over and over
+ *
+ * @param bm		The message to encode
+ * @param one_pass	1 to use msg_xdr_alloc; 0 to use two_pass_alloc
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int bench_encode(const struct bench_msg *bm, int one_pass)
+{
+	int i;
+	uint32_t len = 0;
+	uint64_t start, elapsed;
+	struct msg *m;
+
+	start = get_ns();
+	for (i = 0; i < bm->count; ++i) {
+		if (one_pass)
+			m = msg_xdr_alloc(bm->ty, bm->xdrproc, bm->payload);
+		else
+			m = two_pass_alloc(bm->ty, bm->xdrproc, bm->payload);
+		if (IS_ERR(m)) {
+			fprintf(stderr, "bench_encode(%s): error %d\n",
+				bm->name, PTR_ERR(m));
+			return PTR_ERR(m);
+		}
+		len = unpack_from_be32(&m->len);
+		msg_release(m);
+	}
+	elapsed = get_ns() - start;
+	printf("test=%s encoder=%s msg_len=%d count=%d ns_per_msg=%.1f "
+		"mb_per_sec=%.1f\n", bm->name,
+		one_pass ? "one_pass" : "two_pass", len, bm->count,
+		(double)elapsed / bm->count,
+		((double)len * bm->count * 1000.0) / elapsed);
+	return 0;
+}
+
+static int bench_pair(const struct bench_msg *bm)
+{
+	int ret;
+
+	ret = bench_encode(bm, 0);
+	if (ret)
+		return ret;
+	return bench_encode(bm, 1);
+}
+
+/** Fill in a stat structure with plausible values */
+static void bench_fill_stat(struct rf_stat *stat, int i)
+{
+	stat->mtime = 1334000000000ULL + i;
+	stat->atime = 1334000000000ULL + i;
+	stat->length = 64ULL * 1024 * 1024 * i;
+	stat->nid = 1000 + i;
+	stat->block_sz = 64ULL * 1024 * 1024;
+	stat->mode_and_type = 0644;
+	stat->man_repl = 3;
+	stat->user = "hadoop";
+	stat->group = "supergroup";
+}
+
+static int run_bench(int num_msg)
+{
+	int i, j, ret, num_le;
+	char pcomp[64];
+	struct bench_msg bm;
+	struct mmm_resp resp;
+	struct mmm_path_stat_req path_stat_req;
+	struct mmm_stat_resp stat_resp;
+	struct mmm_locate_resp locate_resp;
+	struct mmm_redfish_block_loc locs[16];
+	struct endpoint ep[16][3];
+	struct mmm_listdir_resp listdir_resp;
+	struct rf_lentry *le;
+
+	memset(&bm, 0, sizeof(bm));
+	memset(&resp, 0, sizeof(resp));
+	resp.error = 0;
+	bm.name = "mmm_resp";
+	bm.ty = mmm_resp_ty;
+	bm.xdrproc = (xdrproc_t)xdr_mmm_resp;
+	bm.payload = &resp;
+	bm.count = num_msg;
+	ret = bench_pair(&bm);
+	if (ret)
+		return ret;
+
+	path_stat_req.path = "/user/hadoop/warehouse/logs/2012/04/part-00000";
+	path_stat_req.user = "hadoop";
+	bm.name = "mmm_path_stat_req";
+	bm.ty = mmm_path_stat_req_ty;
+	bm.xdrproc = (xdrproc_t)xdr_mmm_path_stat_req;
+	bm.payload = &path_stat_req;
+	ret = bench_pair(&bm);
+	if (ret)
+		return ret;
+
+	bench_fill_stat(&stat_resp.stat, 1);
+	bm.name = "mmm_stat_resp";
+	bm.ty = mmm_stat_resp_ty;
+	bm.xdrproc = (xdrproc_t)xdr_mmm_stat_resp;
+	bm.payload = &stat_resp;
+	ret = bench_pair(&bm);
+	if (ret)
+		return ret;
+
+	memset(locs, 0, sizeof(locs));
+	memset(ep, 0, sizeof(ep));
+	for (i = 0; i < 16; ++i) {
+		locs[i].start = 64ULL * 1024 * 1024 * i;
+		locs[i].len = 64ULL * 1024 * 1024;
+		for (j = 0; j < 3; ++j) {
+			ep[i][j].ip = 0x0a000001 + i + j;
+			ep[i][j].port = 9000 + j;
+		}
+		locs[i].ep.ep_len = 3;
+		locs[i].ep.ep_val = ep[i];
+	}
+	locate_resp.locs.locs_len = 16;
+	locate_resp.locs.locs_val = locs;
+	bm.name = "mmm_locate_resp";
+	bm.ty = mmm_locate_resp_ty;
+	bm.xdrproc = (xdrproc_t)xdr_mmm_locate_resp;
+	bm.payload = &locate_resp;
+	bm.count = num_msg / 10;
+	ret = bench_pair(&bm);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < (int)(sizeof(g_listdir_sizes) /
+			sizeof(g_listdir_sizes[0])); ++i) {
+		num_le = g_listdir_sizes[i];
+		le = calloc(num_le, sizeof(struct rf_lentry));
+		if (!le)
+			return ENOMEM;
+		for (j = 0; j < num_le; ++j) {
+			snprintf(pcomp, sizeof(pcomp), "part-%05d", j);
+			le[j].pcomp = strdup(pcomp);
+			if (!le[j].pcomp)
+				return ENOMEM;
+			bench_fill_stat(&le[j].stat, j);
+		}
+		listdir_resp.le.le_len = num_le;
+		listdir_resp.le.le_val = le;
+		snprintf(pcomp, sizeof(pcomp), "mmm_listdir_resp_%d", num_le);
+		bm.name = pcomp;
+		bm.ty = mmm_listdir_resp_ty;
+		bm.xdrproc = (xdrproc_t)xdr_mmm_listdir_resp;
+		bm.payload = &listdir_resp;
+		bm.count = (num_msg / num_le) + 1;
+		ret = bench_pair(&bm);
+		for (j = 0; j < num_le; ++j)
+			free(le[j].pcomp);
+		free(le);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void usage(int exitstatus)
+{
+	fprintf(stderr,
+"xdr_bench: benchmark XDR message encoding\n"
+"\n"
+"usage: xdr_bench [options]\n"
+"\n"
+"Results are printed to stdout, one per line, as key=value pairs.\n"
+"\n"
+"options:\n"
+"-h           this help message\n"
+"-n <num>     number of small messages to encode (default %d)\n",
+	XDR_BENCH_DEFAULT_NUM_MSG);
+	exit(exitstatus);
+}
+
+int main(int argc, char **argv)
+{
+	int c, ret, num_msg = XDR_BENCH_DEFAULT_NUM_MSG;
+
+	while ((c = getopt(argc, argv, "hn:")) != -1) {
+		switch (c) {
+		case 'h':
+			usage(EXIT_SUCCESS);
+		case 'n':
+			num_msg = atoi(optarg);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+	if (num_msg < 10) {
+		fprintf(stderr, "xdr_bench: invalid arguments\n");
+		usage(EXIT_FAILURE);
+	}
+	ret = utility_ctx_init(argv[0]);
+	if (ret) {
+		fprintf(stderr, "xdr_bench: utility_ctx_init failed with "
+			"error %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	ret = run_bench(num_msg);
+	process_ctx_shutdown();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,293 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * limitations under the License.
+ */
+
+#include "core/process_ctx.h"
+#include "msg/msg.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "util/compiler.h"
+#include "util/crc32c.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Check that viewing an mmm_path_stat_req gives back what was encoded
+ *
+ * @param plen		Length of the path to use
+ * @param ulen		Length of the user name to use
+ *
+ * @return		0 on success
+ */
+static int xdr_test_view_path_stat(uint32_t plen, uint32_t ulen)
+{
+	char path[RF_PATH_MAX + 1], user[RF_USER_MAX + 1];
+	struct mmm_path_stat_req req;
+	struct mmm_path_stat_req_view view;
+	struct msg *m;
+
+	memset(path, 'p', plen);
+	path[plen] = '\0';
+	memset(user, 'u', ulen);
+	user[ulen] = '\0';
+	req.path = path;
+	req.user = user;
+	m = MSG_XDR_ALLOC(mmm_path_stat_req, &req);
+	EXPECT_NOT_ERRPTR(m);
+	EXPECT_ZERO(MSG_XDR_VIEW(mmm_path_stat_req, m, &view));
+	EXPECT_EQ(view.path.len, plen);
+	EXPECT_ZERO(strcmp(view.path.buf, path));
+	EXPECT_EQ(view.user.len, ulen);
+	EXPECT_ZERO(strcmp(view.user.buf, user));
+	/* The views point into the message itself. */
+	EXPECT_GE(view.path.buf, m->data);
+	EXPECT_LT(view.user.buf, ((char*)m) + unpack_from_be32(&m->len));
+	msg_release(m);
+	return 0;
+}
+
+static int xdr_test_view_nid_stat(void)
+{
+	struct mmm_nid_stat_req req;
+	struct mmm_nid_stat_req_view view;
+	struct msg *m;
+
+	req.nid = 0x0123456789abcdefULL;
+	req.user = "root";
+	m = MSG_XDR_ALLOC(mmm_nid_stat_req, &req);
+	EXPECT_NOT_ERRPTR(m);
+	EXPECT_ZERO(MSG_XDR_VIEW(mmm_nid_stat_req, m, &view));
+	EXPECT_EQ(view.nid, 0x0123456789abcdefULL);
+	EXPECT_EQ(view.user.len, 4);
+	EXPECT_ZERO(strcmp(view.user.buf, "root"));
+	msg_release(m);
+	return 0;
+}
+
+/** Check that a message encoded by msg_xdr_extalloc matches what the stock
+ * XDR memory stream produces
+ *
+ * @param num_le	Number of entries in the listdir response
+ * @param extra_len	Amount of extra space to ask for
+ *
+ * @return		0 on success
+ */
+static int xdr_test_encode_listdir(int num_le, size_t extra_len)
+{
+	int i;
+	char *buf, pcomp[32], *extra;
+	const char *dextra;
+	struct mmm_listdir_resp resp, out;
+	struct rf_lentry *le;
+	struct msg *m;
+	size_t xl;
+	XDR xdrs;
+
+	le = calloc(num_le, sizeof(struct rf_lentry));
+	EXPECT_NOT_EQ(le, NULL);
+	for (i = 0; i < num_le; ++i) {
+		snprintf(pcomp, sizeof(pcomp), "file%d", i);
+		le[i].pcomp = strdup(pcomp);
+		EXPECT_NOT_EQ(le[i].pcomp, NULL);
+		le[i].stat.length = i * 1000ULL;
+		le[i].stat.nid = i;
+		le[i].stat.mode_and_type = 0644;
+		le[i].stat.user = "alice";
+		le[i].stat.group = "users";
+	}
+	resp.le.le_len = num_le;
+	resp.le.le_val = le;
+	m = msg_xdr_extalloc(mmm_listdir_resp_ty,
+		(xdrproc_t)xdr_mmm_listdir_resp, &resp, extra_len,
+		(void**)&extra);
+	EXPECT_NOT_ERRPTR(m);
+	xl = xdr_sizeof((xdrproc_t)xdr_mmm_listdir_resp, &resp);
+	EXPECT_EQ(unpack_from_be32(&m->len), sizeof(struct msg) + xl +
+		extra_len);
+	EXPECT_EQ(unpack_from_be16(&m->ty), mmm_listdir_resp_ty);
+	EXPECT_EQ(extra, m->data + xl);
+	for (i = 0; i < (int)extra_len; ++i) {
+		EXPECT_ZERO(extra[i]);
+		extra[i] = 'a' + (i % 26);
+	}
+	buf = calloc(1, xl);
+	EXPECT_NOT_EQ(buf, NULL);
+	xdrmem_create(&xdrs, buf, xl, XDR_ENCODE);
+	EXPECT_NONZERO(xdr_mmm_listdir_resp(&xdrs, &resp));
+	xdr_destroy(&xdrs);
+	EXPECT_ZERO(memcmp(buf, m->data, xl));
+	free(buf);
+	memset(&out, 0, sizeof(out));
+	EXPECT_EQ(msg_xdr_extdecode((xdrproc_t)xdr_mmm_listdir_resp, m, &out,
+		(const void**)&dextra), (int32_t)extra_len);
+	/* The extra data must be the bytes that followed the XDR part */
+	EXPECT_EQ(dextra, m->data + xl);
+	for (i = 0; i < (int)extra_len; ++i)
+		EXPECT_EQ(dextra[i], 'a' + (i % 26));
+	EXPECT_EQ(out.le.le_len, (u_int)num_le);
+	if (num_le > 0)
+		EXPECT_ZERO(strcmp(out.le.le_val[num_le - 1].pcomp,
+			le[num_le - 1].pcomp));
+	XDR_REQ_FREE(mmm_listdir_resp, &out);
+	msg_release(m);
+	for (i = 0; i < num_le; ++i)
+		free(le[i].pcomp);
+	free(le);
+	return 0;
+}
+
+static int xdr_test_view_malformed(void)
+{
+	char *p;
+	struct mmm_path_stat_req req;
+	struct mmm_path_stat_req_view view;
+	struct xdr_cursor cur;
+	struct xdr_view v;
+	struct msg *m;
+	uint32_t u;
+
+	/* A truncated message */
+	req.path = "/a/b/c";
+	req.user = "bob";
+	m = MSG_XDR_ALLOC(mmm_path_stat_req, &req);
+	EXPECT_NOT_ERRPTR(m);
+	pack_to_be32(&m->len, unpack_from_be32(&m->len) - 4);
+	EXPECT_EQ(MSG_XDR_VIEW(mmm_path_stat_req, m, &view), -EINVAL);
+	msg_release(m);
+
+	/* A string which claims to be longer than the maximum, or longer than
+	 * the message */
+	m = calloc_msg(mmm_path_stat_req_ty, sizeof(struct msg) + 16);
+	EXPECT_NOT_EQ(m, NULL);
+	p = m->data;
+	pack_to_be32(p, 12);
+	memcpy(p + 4, "abcdefghijkl", 12);
+	EXPECT_ZERO(xdr_cursor_init(&cur, m));
+	EXPECT_EQ(xdr_cursor_get_string(&cur, 11, &v), -EINVAL);
+	EXPECT_ZERO(xdr_cursor_init(&cur, m));
+	EXPECT_ZERO(xdr_cursor_get_string(&cur, 12, &v));
+	EXPECT_EQ(v.len, 12);
+	EXPECT_ZERO(strcmp(v.buf, "abcdefghijkl"));
+	EXPECT_EQ(cur.rem, 0);
+	EXPECT_EQ(xdr_cursor_get_u32(&cur, &u), -EINVAL);
+	pack_to_be32(p, 13);
+	EXPECT_ZERO(xdr_cursor_init(&cur, m));
+	EXPECT_EQ(xdr_cursor_get_opaque(&cur, 100, &v), -EINVAL);
+	pack_to_be32(p, 0xffffffff);
+	EXPECT_ZERO(xdr_cursor_init(&cur, m));
+	EXPECT_EQ(xdr_cursor_get_opaque(&cur, 0xffffffff, &v), -EINVAL);
+	msg_release(m);
+	return 0;
+}
+
+/** Check that the payloads which follow the XDR part of OSD messages are
+ * decoded the way their receivers use them
+ *
+ * @param num		Number of chunk IDs and data bytes to send
+ *
+ * @return		0 on success
+ */
+static int xdr_test_extdecode_payloads(int num)
+{
+	int i;
+	int32_t dlen;
+	char *data;
+	const char *extra;
+	uint64_t *cids;
+	const uint64_t *dcids;
+	struct mmm_osd_corrupt_chunks cc, dcc;
+	struct mmm_osd_read_resp rr, drr;
+	struct msg *m;
+
+	/* Corrupt chunk reports, as the MDS reads them */
+	cc.oid = 7;
+	m = msg_xdr_extalloc(mmm_osd_corrupt_chunks_ty,
+		(xdrproc_t)xdr_mmm_osd_corrupt_chunks, &cc,
+		num * sizeof(uint64_t), (void**)&cids);
+	EXPECT_NOT_ERRPTR(m);
+	for (i = 0; i < num; ++i)
+		pack_to_be64(&cids[i], 0x123456789aULL + i);
+	memset(&dcc, 0, sizeof(dcc));
+	dlen = msg_xdr_extdecode((xdrproc_t)xdr_mmm_osd_corrupt_chunks, m,
+		&dcc, (const void**)&dcids);
+	EXPECT_EQ(dlen, (int32_t)(num * sizeof(uint64_t)));
+	EXPECT_EQ(dcc.oid, 7);
+	for (i = 0; i < num; ++i)
+		EXPECT_EQ(unpack_from_be64(&dcids[i]), 0x123456789aULL + i);
+	xdr_free((xdrproc_t)xdr_mmm_osd_corrupt_chunks, (void*)&dcc);
+	msg_release(m);
+
+	/* Read replies with a CRC after the data, as fishtool checks them */
+	rr.flags = MMM_OSD_READ_RESP_FLAG_CRC;
+	m = msg_xdr_extalloc(mmm_osd_read_resp_ty,
+		(xdrproc_t)xdr_mmm_osd_read_resp, &rr,
+		num + sizeof(uint32_t), (void**)&data);
+	EXPECT_NOT_ERRPTR(m);
+	for (i = 0; i < num; ++i)
+		data[i] = 'A' + (i % 26);
+	pack_to_be32(data + num, crc32c(0, data, num));
+	memset(&drr, 0, sizeof(drr));
+	dlen = msg_xdr_extdecode((xdrproc_t)xdr_mmm_osd_read_resp, m,
+		&drr, (const void**)&extra);
+	EXPECT_EQ(dlen, (int32_t)(num + sizeof(uint32_t)));
+	EXPECT_EQ(drr.flags, MMM_OSD_READ_RESP_FLAG_CRC);
+	dlen -= sizeof(uint32_t);
+	for (i = 0; i < num; ++i)
+		EXPECT_EQ(extra[i], 'A' + (i % 26));
+	EXPECT_EQ(crc32c(0, extra, dlen), unpack_from_be32(extra + dlen));
+	xdr_free((xdrproc_t)xdr_mmm_osd_read_resp, (void*)&drr);
+
+	/* A message too short to hold its XDR part has no payload */
+	pack_to_be32(&m->len, sizeof(struct msg) + 2);
+	EXPECT_EQ(msg_xdr_extdecode((xdrproc_t)xdr_mmm_osd_read_resp, m,
+		&drr, (const void**)&extra), -EINVAL);
+	msg_release(m);
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	int i;
+	const int lens[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 64 };
+
+	EXPECT_ZERO(utility_ctx_init(argv[0]));
+	for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); ++i) {
+		EXPECT_ZERO(xdr_test_view_path_stat(lens[i], lens[i]));
+		EXPECT_ZERO(xdr_test_view_path_stat(lens[i] + 13,
+			RF_USER_MAX - lens[i]));
+	}
+	EXPECT_ZERO(xdr_test_view_path_stat(RF_PATH_MAX, RF_USER_MAX));
+	EXPECT_ZERO(xdr_test_view_nid_stat());
+	EXPECT_ZERO(xdr_test_view_malformed());
+	EXPECT_ZERO(xdr_test_encode_listdir(0, 0));
+	EXPECT_ZERO(xdr_test_encode_listdir(1, 0));
+	EXPECT_ZERO(xdr_test_encode_listdir(1, 7));
+	EXPECT_ZERO(xdr_test_encode_listdir(100, 0));
+	EXPECT_ZERO(xdr_test_encode_listdir(5000, 0));
+	EXPECT_ZERO(xdr_test_encode_listdir(5000, 100000));
+	for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); ++i)
+		EXPECT_ZERO(xdr_test_extdecode_payloads(lens[i]));
+	EXPECT_ZERO(xdr_test_extdecode_payloads(100000));
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
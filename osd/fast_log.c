@@ -125,6 +125,16 @@ void fast_log_ostor_dump(struct fast_log_entry *f, char *buf)
 			"[chunk 0x%"PRIx64"] %sallocating chunk with fd %d\n",
 			fe->cid, flos_err(fe->error, b, b_len), fe->data);
 		break;
+	case FLOS_OCHUNK_PIN:
+		snprintf(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"[chunk 0x%"PRIx64"] %spinning chunk\n",
+			fe->cid, flos_err(fe->error, b, b_len));
+		break;
+	case FLOS_OCHUNK_SCRUB:
+		snprintf(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"[chunk 0x%"PRIx64"] %sscrubbed %"PRIu64" bytes\n",
+			fe->cid, flos_err(fe->error, b, b_len), fe->off);
+		break;
 	case FLOS_LRU_SLEEP:
 		snprintf(buf, FAST_LOG_PRETTY_PRINTED_MAX,
 			"ostor lru thread sleeping.  need_lru=%d\n", fe->data);
@@ -133,6 +143,12 @@ void fast_log_ostor_dump(struct fast_log_entry *f, char *buf)
 		snprintf(buf, FAST_LOG_PRETTY_PRINTED_MAX,
 			"ostor lru thread waking.  need_lru=%d\n", fe->data);
 		break;
+	case FLOS_PACK_COMPACT:
+		snprintf(buf, FAST_LOG_PRETTY_PRINTED_MAX,
+			"[disk %"PRIu64"] %scompacted the pack store, freeing "
+			"%d segments\n", fe->off, flos_err(fe->error, b, b_len),
+			fe->data);
+		break;
 	default:
 		snappend(buf, FAST_LOG_PRETTY_PRINTED_MAX,
 			 "(unknown ostor event %d)\n", fe->event);
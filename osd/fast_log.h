@@ -30,8 +30,11 @@ enum fast_log_osd_event {
 	FLOS_OCHUNK_UNLINK,
 	FLOS_OCHUNK_WAIT,
 	FLOS_OCHUNK_ALLOC,
+	FLOS_OCHUNK_PIN,
+	FLOS_OCHUNK_SCRUB,
 	FLOS_LRU_SLEEP,
 	FLOS_LRU_WAKE,
+	FLOS_PACK_COMPACT,
 	FLOS_MAX,
 };
 
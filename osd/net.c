@@ -18,6 +18,7 @@
 
 #include "common/cluster_map.h"
 #include "common/config/mdsc.h"
+#include "common/config/ostorc.h"
 #include "common/config/unitaryc.h"
 #include "core/glitch_log.h"
 #include "core/process_ctx.h"
@@ -32,15 +33,18 @@
 #include "osd/net.h"
 #include "osd/ostor.h"
 #include "util/compiler.h"
+#include "util/crc32c.h"
 #include "util/error.h"
 #include "util/fast_log.h"
 #include "util/fast_log_types.h"
+#include "util/macro.h"
 #include "util/packed.h"
 #include "util/string.h"
 #include "util/thread.h"
 #include "util/time.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <rpc/xdr.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -55,6 +59,83 @@
 
 #define OSD_HB_SEND_IVAL 3
 
+/** Maximum number of chunks which reads have found to be corrupt to report
+ * with each heartbeat.  The rest wait for the next one. */
+#define OSD_HB_MAX_CORRUPT 256
+
+/** Reads at least this big are sent straight from the chunk file with
+ * sendfile, rather than being copied into the reply message first. */
+#define OSD_READ_ZCOPY_MIN 32768
+
+/** Chunks are copied to other OSDs in hflushes of at most this many bytes, so
+ * that the receiver never has to hold more than this in memory, and each
+ * reply timeout only has to cover one piece. */
+#define OSD_COPY_PIECE_LEN (4 * 1024 * 1024)
+
+/** A chunk range that we're sending with sendfile */
+struct osd_read_pin {
+	struct msg_fdbody fdb;
+	struct ochunk *ch;
+};
+
+/** A read or hflush that is waiting for the disk */
+struct osd_aio {
+	struct ostor_aio aio;
+	/** The transactor to reply on */
+	struct mtran *tr;
+	/** For reads: the reply, which the data is read into */
+	struct msg *r;
+	/** For reads: the number of bytes asked for */
+	int32_t len;
+	/** For reads: where the data goes in the reply */
+	char *footer;
+	/** For reads: nonzero if the client asked for a CRC of the data */
+	int crc;
+	/** For hflushes: the request, which holds the data being written */
+	struct msg *m;
+	/** For hflushes: the chunk ID */
+	uint64_t cid;
+	/** For hflushes: number of parts still to finish.  The local write is
+	 * one, and passing the data on down the chain is the other.  Accessed
+	 * atomically. */
+	int pending;
+	/** For hflushes: the first error that a part finished with.  Accessed
+	 * atomically. */
+	int err;
+};
+
+/** A chunk that we are copying to another OSD for the MDS */
+struct osd_copy {
+	/** The transactor to reply to the MDS on */
+	struct mtran *tr;
+	/** The chunk ID */
+	uint64_t cid;
+	/** The OSD we are copying to */
+	uint32_t dst;
+	/** Address of the OSD we are copying to */
+	uint32_t ip;
+	/** Port of the OSD we are copying to */
+	uint16_t port;
+	/** Number of bytes being copied */
+	uint64_t len;
+	/** CRC32C of the bytes being copied */
+	uint32_t crc;
+	/** Number of bytes handed to the messenger so far */
+	uint64_t off;
+	/** The chunk, which stays pinned until the copy is done, or NULL if it
+	 * couldn't be pinned */
+	struct ochunk *ch;
+	/** Where the chunk's data is */
+	struct ostor_extent ext;
+	/** The chunk's data, if it couldn't be pinned */
+	char *buf;
+	/** The piece that is being sent */
+	struct msg_fdbody fdb;
+	/** One reference for the copy itself, plus one while the messenger
+	 * is sending a piece */
+	int refs;
+};
+
 /** recv_pool for doing I/O operations for clients and other OSDs */
 static struct recv_pool *g_io_rpool;
 
@@ -76,12 +157,149 @@ static struct msgr *g_msgr[RF_ENTITY_TY_NUM];
 /** Thread which sends heartbeat messages */
 static struct redfish_thread g_osd_send_hb_thread;
 
+/** Thread which scrubs the object store */
+static struct redfish_thread g_osd_scrub_thread;
+
+/** Maximum number of bytes per second that the scrubber may read */
+static uint64_t g_scrub_rate;
+
+/** Number of seconds between scrubs */
+static int g_scrub_ival;
+
+/** Corrupt chunks to report to the MDSes */
+struct osd_scrub_report {
+	uint64_t *cids;
+	int num_cid;
+	int max_cid;
+};
+
+static void osd_read_pin_release(struct msg_fdbody *fdb)
+{
+	struct osd_read_pin *pin = GET_OUTER(fdb, struct osd_read_pin, fdb);
+
+	ostor_unpin(g_ostor, pin->ch);
+	free(pin);
+}
+
+/** Send a read reply whose payload comes straight from the chunk file.
+ *
+ * The chunk stays pinned until the messenger has finished sending it.
+ *
+ * @return		1 if the chunk can't be pinned, and no reply was sent;
+ *			otherwise, what bsend_reply returned
+ */
+static int osd_read_zcopy(struct recv_pool_thread *rt, struct mtran *tr,
+		const struct mmm_osd_read_req *req)
+{
+	int ret;
+	struct mmm_osd_read_resp resp;
+	struct osd_read_pin *pin;
+	struct ochunk *ch;
+	struct msg *r;
+	struct ostor_extent ext;
+	uint64_t len;
+
+	/* Chunks are append-only, so once we have pinned the chunk, the data
+	 * in the extent will still be there when the messenger gets to it. */
+	ch = ostor_pin(g_ostor, rt->base.fb, req->cid, &ext);
+	if (IS_ERR(ch) && (PTR_ERR(ch) == EXDEV))
+		return 1;
+	if (IS_ERR(ch))
+		return bsend_std_reply(rt->base.fb, rt->ctx, tr, PTR_ERR(ch));
+	len = 0;
+	if (ext.len > req->start)
+		len = ext.len - req->start;
+	if (len > (uint64_t)req->len)
+		len = req->len;
+	/* sendfile doesn't let us look at the data, so check it against the
+	 * chunk's checksums before we send it */
+	ret = ostor_verify_pinned(g_ostor, ch, &ext, req->start, len);
+	if (ret)
+		goto error_unpin;
+	resp.flags = 0;
+	r = MSG_XDR_ALLOC(mmm_osd_read_resp, &resp);
+	if (IS_ERR(r)) {
+		ret = PTR_ERR(r);
+		goto error_unpin;
+	}
+	if (len == 0) {
+		ostor_unpin(g_ostor, ch);
+		return bsend_reply(rt->base.fb, rt->ctx, tr, r);
+	}
+	pin = calloc(1, sizeof(struct osd_read_pin));
+	if (!pin) {
+		msg_release(r);
+		ret = -ENOMEM;
+		goto error_unpin;
+	}
+	pin->ch = ch;
+	pin->fdb.fd = ext.fd;
+	pin->fdb.off = ext.off + req->start;
+	pin->fdb.len = len;
+	pin->fdb.release = osd_read_pin_release;
+	mtran_attach_fdbody(tr, r, &pin->fdb);
+	return bsend_reply(rt->base.fb, rt->ctx, tr, r);
+
+error_unpin:
+	ostor_unpin(g_ostor, ch);
+	return bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
+}
+
+static void osd_reply_sent_cb(POSSIBLY_UNUSED(struct mconn *conn),
+		struct mtran *tr)
+{
+	if (tr->m && IS_ERR(tr->m)) {
+		glitch_log("osd_reply_sent_cb: error %d sending reply\n",
+			PTR_ERR(tr->m));
+	}
+	mtran_free(tr);
+}
+
+/** Send a reply from an I/O completion
+ *
+ * Unlike bsend_reply, this doesn't wait for the message to be sent.
+ *
+ * @param tr		The transactor to reply on.  tr->priv holds the
+ *			messenger that the request came in on.
+ * @param r		The reply, or NULL if we ran out of memory building it
+ */
+static void osd_aio_reply(struct mtran *tr, struct msg *r)
+{
+	struct msgr *msgr = tr->priv;
+
+	if (!r) {
+		glitch_log("osd_aio_reply: out of memory\n");
+		mtran_free(tr);
+		return;
+	}
+	mtran_send(msgr, tr, osd_reply_sent_cb, NULL, r, 0);
+}
+
+static void osd_read_done(struct ostor_aio *aio, int res)
+{
+	struct osd_aio *oaio = GET_OUTER(aio, struct osd_aio, aio);
+
+	if (res < 0) {
+		msg_release(oaio->r);
+		osd_aio_reply(oaio->tr, resp_alloc(res));
+	}
+	else {
+		/* The CRC, if there is one, goes right after the data */
+		if (oaio->crc)
+			pack_to_be32(oaio->footer + res,
+				crc32c(0, oaio->footer, res));
+		osd_aio_reply(oaio->tr, msg_shrink(oaio->r, oaio->len - res));
+	}
+	free(oaio);
+}
+
 static int handle_mmm_get_osd_read_req(struct recv_pool_thread *rt,
 		struct mtran *tr, const struct msg *m)
 {
-	int32_t ret;
+	int32_t ret, crc;
 	struct mmm_osd_read_req req;
 	struct mmm_osd_read_resp resp;
+	struct osd_aio *oaio;
 	struct msg *r;
 	char *footer;
 
@@ -92,52 +310,273 @@ static int handle_mmm_get_osd_read_req(struct recv_pool_thread *rt,
 		ret = -EINVAL;
 		goto send_resp;
 	}
-	resp.flags = 0;
+	/* Data sent with sendfile never passes through our hands, so we can't
+	 * checksum it. */
+	crc = !!(req.flags & MMM_OSD_READ_FLAG_CRC);
+	if ((req.len >= OSD_READ_ZCOPY_MIN) && (!crc)) {
+		ret = osd_read_zcopy(rt, tr, &req);
+		if (ret != 1) {
+			XDR_REQ_FREE(mmm_osd_read_req, &req);
+			return ret;
+		}
+		/* A packed chunk in several pieces has to be read into a
+		 * buffer */
+	}
+	oaio = calloc(1, sizeof(struct osd_aio));
+	if (!oaio) {
+		ret = -ENOMEM;
+		goto send_resp;
+	}
+	resp.flags = crc ? MMM_OSD_READ_RESP_FLAG_CRC : 0;
 	r = msg_xdr_extalloc(mmm_osd_read_resp_ty,
-		(xdrproc_t)xdr_mmm_osd_read_resp, &resp, req.len,
-		(void**)&footer);
+		(xdrproc_t)xdr_mmm_osd_read_resp, &resp,
+		req.len + (crc ? sizeof(uint32_t) : 0), (void**)&footer);
 	if (IS_ERR(r)) {
 		ret = PTR_ERR(r);
-		goto send_resp;
+		goto free_oaio;
 	}
-	ret = ostor_read(g_ostor, rt->base.fb, req.cid, req.start,
-		footer, req.len);
-	if (ret < 0) {
+	oaio->aio.cb = osd_read_done;
+	oaio->tr = tr;
+	oaio->r = r;
+	oaio->len = req.len;
+	oaio->footer = footer;
+	oaio->crc = crc;
+	/* The reply is sent from osd_read_done once the data is in. */
+	ret = ostor_read_async(g_ostor, rt->base.fb, req.cid, req.start,
+		footer, req.len, &oaio->aio);
+	if (ret) {
 		msg_release(r);
-		goto send_resp;
+		goto free_oaio;
 	}
-	r = msg_shrink(r, req.len - ret);
-	ret = 0;
+	XDR_REQ_FREE(mmm_osd_read_req, &req);
+	return 0;
 
+free_oaio:
+	free(oaio);
 send_resp:
-	if (ret)
-		ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
-	else
-		ret = bsend_reply(rt->base.fb, rt->ctx, tr, r);
+	ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
 	XDR_REQ_FREE(mmm_osd_read_req, &req);
 	return ret;
 }
 
+/** Finish one part of an hflush
+ *
+ * The reply is sent upstream once the local write is done and the next OSD in
+ * the chain has replied, carrying the first error from either.  This may be
+ * called from an I/O engine thread or from the messenger thread.
+ *
+ * @param oaio		The hflush
+ * @param res		The result of this part
+ */
+static void osd_hflush_finish(struct osd_aio *oaio, int res)
+{
+	int zero = 0;
+
+	if (res) {
+		__atomic_compare_exchange_n(&oaio->err, &zero, res, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+	if (__atomic_sub_fetch(&oaio->pending, 1, __ATOMIC_ACQ_REL))
+		return;
+	osd_aio_reply(oaio->tr,
+		resp_alloc(__atomic_load_n(&oaio->err, __ATOMIC_ACQUIRE)));
+	free(oaio);
+}
+
+static void osd_hflush_done(struct ostor_aio *aio, int res)
+{
+	struct osd_aio *oaio = GET_OUTER(aio, struct osd_aio, aio);
+
+	msg_release(oaio->m);
+	oaio->m = NULL;
+	osd_hflush_finish(oaio, res);
+}
+
+/** Find out how a request that we sent to another OSD went
+ *
+ * Call this from the request's callback.  If the request has only just been
+ * sent, this starts waiting for the reply.
+ *
+ * @param conn		The connection
+ * @param tr		The transactor
+ * @param res		(out param) the result of the request
+ *
+ * @return		0 if we are still waiting for the reply; 1 if the
+ *			request is done and *res is set
+ */
+static int osd_peer_reply(struct mconn *conn, struct mtran *tr, int *res)
+{
+	if (tr->state == MTRAN_STATE_SENT) {
+		if (!IS_ERR(tr->m)) {
+			mtran_recv_next(conn, tr);
+			return 0;
+		}
+		*res = FORCE_NEGATIVE(PTR_ERR(tr->m));
+	}
+	else if (IS_ERR(tr->m)) {
+		*res = FORCE_NEGATIVE(PTR_ERR(tr->m));
+	}
+	else {
+		*res = msg_xdr_decode_as_generic(tr->m);
+	}
+	return 1;
+}
+
+static void osd_hflush_fwd_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct osd_aio *oaio = tr->priv;
+	int ret;
+
+	if (!osd_peer_reply(conn, tr, &ret))
+		return;
+	if (ret) {
+		glitch_log("osd_hflush_fwd_cb: error %d passing on hflush of "
+			"chunk 0x%016" PRIx64 "\n", ret, oaio->cid);
+	}
+	mtran_free(tr);
+	osd_hflush_finish(oaio, ret);
+}
+
+/** Pass an hflush on to the next OSD in its chain
+ *
+ * The next OSD gets its own copy of the data, along with the rest of the
+ * chain.  osd_hflush_finish is called when it replies.
+ *
+ * @param oaio		The hflush
+ * @param req		The hflush request.  Its chain must not be empty.
+ * @param data		The data
+ * @param dlen		Length of data
+ * @param di		The next OSD
+ *
+ * @return		0 if the hflush is on its way; a negative error code
+ *			otherwise
+ */
+static int osd_hflush_forward(struct osd_aio *oaio,
+		const struct mmm_osd_hflush_req *req, const char *data,
+		int32_t dlen, const struct daemon_info *di)
+{
+	struct mmm_osd_hflush_req fwd;
+	struct mtran *tr;
+	struct msg *fm;
+	char *extra;
+
+	fwd.cid = req->cid;
+	fwd.flags = req->flags;
+	fwd.chain.chain_len = req->chain.chain_len - 1;
+	fwd.chain.chain_val = req->chain.chain_val + 1;
+	fm = msg_xdr_extalloc(mmm_osd_hflush_req_ty,
+		(xdrproc_t)xdr_mmm_osd_hflush_req, &fwd, dlen,
+		(void**)&extra);
+	if (IS_ERR(fm))
+		return FORCE_NEGATIVE(PTR_ERR(fm));
+	memcpy(extra, data, dlen);
+	tr = mtran_alloc(g_msgr[RF_ENTITY_TY_OSD]);
+	if (!tr) {
+		msg_release(fm);
+		return -ENOMEM;
+	}
+	tr->ip = di->ip;
+	tr->port = di->port[RF_ENTITY_TY_OSD];
+	tr->flags |= MTRAN_FLAG_BULK;
+	/* Every OSD further down the chain has to reply before the next one
+	 * does, so give it longer. */
+	mtran_send(g_msgr[RF_ENTITY_TY_OSD], tr, osd_hflush_fwd_cb, oaio, fm,
+		OSD_REPLY_TIMEO * req->chain.chain_len);
+	return 0;
+}
+
+/** Handle an hflush request
+ *
+ * This takes over the caller's reference to the request, since the data we
+ * are writing lives in it.  It is released once the write is done.
+ *
+ * If the request has a chain of OSDs, the data is sent on to the next one
+ * before we start writing it, so that the network transfer and the disk
+ * write overlap.
+ */
 static int handle_mmm_osd_hflush_req(struct recv_pool_thread *rt,
-		struct mtran *tr, const struct msg *m)
+		struct mtran *tr, struct msg *m)
 {
 	int32_t dlen, ret;
+	uint32_t next;
 	struct mmm_osd_hflush_req req;
+	struct osd_aio *oaio;
+	struct daemon_info *di = NULL;
 	const char *footer;
 
 	dlen = msg_xdr_extdecode((xdrproc_t)xdr_mmm_osd_hflush_req,
 		m, &req, (const void**)&footer);
 	if (dlen < 0) {
+		msg_release(m);
 		return dlen;
 	}
-	// TODO: check flags
-	ret = ostor_write(g_ostor, rt->base.fb, req.cid, footer, dlen);
-	if (ret) {
+	if (req.flags & ~MMM_OSD_HFLUSH_FLAG_REPLACE) {
+		ret = -EINVAL;
+		goto send_resp;
+	}
+	if (req.chain.chain_len > 0) {
+		/* A chain that came back to an OSD would have it append the
+		 * same data to the chunk more than once. */
+		if (cmap_check_oid_chain(g_oid, req.chain.chain_val,
+				req.chain.chain_len)) {
+			glitch_log("handle_mmm_osd_hflush_req: chain for "
+				"chunk 0x%016" PRIx64 " contains OSD %" PRIu32
+				" or a repeated OSD\n", req.cid, g_oid);
+			ret = -EINVAL;
+			goto send_resp;
+		}
+		next = req.chain.chain_val[0];
+		di = cmap_get_oinfo(g_cmap, next);
+		if (!di) {
+			glitch_log("handle_mmm_osd_hflush_req: can't pass "
+				"hflush of chunk 0x%016" PRIx64 " on to OSD "
+				"%" PRIu32 "\n", req.cid, next);
+			ret = -EINVAL;
+			goto send_resp;
+		}
+	}
+	oaio = calloc(1, sizeof(struct osd_aio));
+	if (!oaio) {
+		ret = -ENOMEM;
 		goto send_resp;
 	}
+	oaio->aio.cb = osd_hflush_done;
+	oaio->tr = tr;
+	oaio->m = m;
+	oaio->cid = req.cid;
+	oaio->pending = 1;
+	if (di) {
+		oaio->pending = 2;
+		ret = osd_hflush_forward(oaio, &req, footer, dlen, di);
+		if (ret) {
+			free(oaio);
+			goto send_resp;
+		}
+	}
+	ret = 0;
+	if (req.flags & MMM_OSD_HFLUSH_FLAG_REPLACE) {
+		/* Whatever we have is left over from an earlier copy that
+		 * didn't finish. */
+		ret = ostor_unlink(g_ostor, rt->base.fb, req.cid);
+		if (ret == -ENOENT)
+			ret = 0;
+	}
+	if (ret == 0) {
+		ret = ostor_write_async(g_ostor, rt->base.fb, req.cid, footer,
+			dlen, &oaio->aio);
+	}
+	if (ret) {
+		/* The data may already be on its way down the chain, so the
+		 * reply has to wait for that. */
+		osd_hflush_done(&oaio->aio, ret);
+	}
+	XDR_REQ_FREE(mmm_osd_hflush_req, &req);
+	return 0;
+
 send_resp:
 	ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
 	XDR_REQ_FREE(mmm_osd_hflush_req, &req);
+	msg_release(m);
 	return ret;
 }
 
@@ -198,6 +637,237 @@ static int handle_mmm_osd_unlink_req(struct recv_pool_thread *rt,
 	return ret;
 }
 
+static void osd_copy_put(struct osd_copy *cp)
+{
+	if (__atomic_sub_fetch(&cp->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (cp->ch)
+		ostor_unpin(g_ostor, cp->ch);
+	free(cp->buf);
+	free(cp);
+}
+
+static void osd_copy_piece_release(struct msg_fdbody *fdb)
+{
+	osd_copy_put(GET_OUTER(fdb, struct osd_copy, fdb));
+}
+
+static void osd_copy_cb(struct mconn *conn, struct mtran *tr);
+
+/** Send the next piece of a chunk that we are copying to another OSD
+ *
+ * The first piece replaces whatever copy of the chunk the other OSD has; the
+ * rest are appended to it.  osd_copy_cb is called when the other OSD replies.
+ *
+ * @param cp		The copy
+ *
+ * @return		0 if the piece is on its way; a negative error code
+ *			otherwise
+ */
+static int osd_copy_send_piece(struct osd_copy *cp)
+{
+	struct mmm_osd_hflush_req fwd;
+	struct mtran *ftr;
+	struct msg *fm;
+	uint64_t plen;
+	char *data;
+
+	memset(&fwd, 0, sizeof(fwd));
+	fwd.cid = cp->cid;
+	fwd.flags = (cp->off == 0) ? MMM_OSD_HFLUSH_FLAG_REPLACE : 0;
+	plen = cp->len - cp->off;
+	if (plen > OSD_COPY_PIECE_LEN)
+		plen = OSD_COPY_PIECE_LEN;
+	if (cp->buf) {
+		/* The piece goes in the message itself */
+		fm = msg_xdr_extalloc(mmm_osd_hflush_req_ty,
+			(xdrproc_t)xdr_mmm_osd_hflush_req, &fwd, plen,
+			(void**)&data);
+		if (IS_ERR(fm))
+			return FORCE_NEGATIVE(PTR_ERR(fm));
+		memcpy(data, cp->buf + cp->off, plen);
+	}
+	else {
+		fm = MSG_XDR_ALLOC(mmm_osd_hflush_req, &fwd);
+		if (IS_ERR(fm))
+			return FORCE_NEGATIVE(PTR_ERR(fm));
+	}
+	ftr = mtran_alloc(g_msgr[RF_ENTITY_TY_OSD]);
+	if (!ftr) {
+		msg_release(fm);
+		return -ENOMEM;
+	}
+	ftr->ip = cp->ip;
+	ftr->port = cp->port;
+	ftr->flags |= MTRAN_FLAG_BULK;
+	if ((plen > 0) && (!cp->buf)) {
+		/* The messenger drops this reference once the piece has been
+		 * sent */
+		__atomic_add_fetch(&cp->refs, 1, __ATOMIC_ACQ_REL);
+		cp->fdb.fd = cp->ext.fd;
+		cp->fdb.off = cp->ext.off + cp->off;
+		cp->fdb.len = plen;
+		cp->fdb.release = osd_copy_piece_release;
+		mtran_attach_fdbody(ftr, fm, &cp->fdb);
+	}
+	cp->off += plen;
+	mtran_send(g_msgr[RF_ENTITY_TY_OSD], ftr, osd_copy_cb, cp, fm,
+		OSD_REPLY_TIMEO);
+	return 0;
+}
+
+static void osd_copy_cb(struct mconn *conn, struct mtran *tr)
+{
+	struct osd_copy *cp = tr->priv;
+	struct mmm_osd_chunk_copy_resp resp;
+	struct msg *r;
+	int ret;
+
+	if (!osd_peer_reply(conn, tr, &ret))
+		return;
+	mtran_free(tr);
+	if ((ret == 0) && (cp->off < cp->len)) {
+		ret = osd_copy_send_piece(cp);
+		if (ret == 0)
+			return;
+	}
+	if (ret) {
+		glitch_log("osd_copy_cb: error %d copying chunk 0x%016" PRIx64
+			" to OSD %" PRIu32 "\n", ret, cp->cid, cp->dst);
+		r = resp_alloc(ret);
+	}
+	else {
+		resp.len = cp->len;
+		resp.crc = cp->crc;
+		r = MSG_XDR_ALLOC(mmm_osd_chunk_copy_resp, &resp);
+		if (IS_ERR(r))
+			r = NULL;
+	}
+	osd_aio_reply(cp->tr, r);
+	osd_copy_put(cp);
+}
+
+/** Handle a request from the MDS to copy a chunk to another OSD
+ *
+ * The chunk is sent straight from disk with sendfile, OSD_COPY_PIECE_LEN bytes
+ * at a time, and the MDS gets its reply once the other OSD has written all of
+ * it.  sendfile never shows us the data, so the whole chunk is read and checked
+ * against its checksums first.  A packed chunk which can't be pinned is small,
+ * and is read into a buffer and sent from there instead.  That way we never spread a corrupt replica,
+ * and the MDS gets a CRC to check the new replica against.
+ */
+static int handle_mmm_osd_chunk_copy_req(struct recv_pool_thread *rt,
+		struct mtran *tr, const struct msg *m)
+{
+	int ret;
+	struct mmm_osd_chunk_copy_req req;
+	struct daemon_info *di = NULL;
+	struct osd_copy *cp;
+
+	ret = MSG_XDR_DECODE(mmm_osd_chunk_copy_req, m, &req);
+	if (ret < 0)
+		return ret;
+	if (req.dst != g_oid)
+		di = cmap_get_oinfo(g_cmap, req.dst);
+	if (!di) {
+		ret = -EINVAL;
+		goto send_resp;
+	}
+	cp = calloc(1, sizeof(struct osd_copy));
+	if (!cp) {
+		ret = -ENOMEM;
+		goto send_resp;
+	}
+	ret = ostor_checksum(g_ostor, rt->base.fb, req.cid, &cp->len,
+		&cp->crc);
+	if (ret)
+		goto free_cp;
+	/* Chunks are append-only, so everything we checked will still be
+	 * there when the messenger gets to it.  Anything appended since then
+	 * isn't copied. */
+	cp->ch = ostor_pin(g_ostor, rt->base.fb, req.cid, &cp->ext);
+	if (IS_ERR(cp->ch) && (PTR_ERR(cp->ch) == EXDEV)) {
+		/* A packed chunk in several pieces has to be sent from a
+		 * buffer.  Packed chunks are small. */
+		cp->ch = NULL;
+		cp->buf = malloc(cp->len ? cp->len : 1);
+		if (!cp->buf) {
+			ret = -ENOMEM;
+			goto free_cp;
+		}
+		ret = ostor_read(g_ostor, rt->base.fb, req.cid, 0, cp->buf,
+			cp->len);
+		if (ret < 0)
+			goto free_cp;
+		if ((uint64_t)ret < cp->len) {
+			/* The chunk was replaced after we checked it */
+			ret = -EAGAIN;
+			goto free_cp;
+		}
+	}
+	else if (IS_ERR(cp->ch)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(cp->ch));
+		goto free_cp;
+	}
+	else if (cp->ext.len < cp->len) {
+		/* The chunk was replaced after we checked it */
+		ostor_unpin(g_ostor, cp->ch);
+		ret = -EAGAIN;
+		goto free_cp;
+	}
+	cp->tr = tr;
+	cp->cid = req.cid;
+	cp->dst = req.dst;
+	cp->ip = di->ip;
+	cp->port = di->port[RF_ENTITY_TY_OSD];
+	cp->refs = 1;
+	ret = osd_copy_send_piece(cp);
+	if (ret) {
+		osd_copy_put(cp);
+		goto send_resp;
+	}
+	XDR_REQ_FREE(mmm_osd_chunk_copy_req, &req);
+	return 0;
+
+free_cp:
+	free(cp->buf);
+	free(cp);
+send_resp:
+	ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
+	XDR_REQ_FREE(mmm_osd_chunk_copy_req, &req);
+	return ret;
+}
+
+static int handle_mmm_osd_chunk_csum_req(struct recv_pool_thread *rt,
+		struct mtran *tr, const struct msg *m)
+{
+	int ret;
+	struct mmm_osd_chunk_csum_req req;
+	struct mmm_osd_chunk_csum_resp resp;
+	struct msg *r;
+
+	ret = MSG_XDR_DECODE(mmm_osd_chunk_csum_req, m, &req);
+	if (ret < 0)
+		return ret;
+	memset(&resp, 0, sizeof(resp));
+	ret = ostor_checksum(g_ostor, rt->base.fb, req.cid, &resp.len,
+		&resp.crc);
+	if (ret) {
+		ret = bsend_std_reply(rt->base.fb, rt->ctx, tr, ret);
+		goto done;
+	}
+	r = MSG_XDR_ALLOC(mmm_osd_chunk_csum_resp, &resp);
+	if (IS_ERR(r)) {
+		ret = bsend_std_reply(rt->base.fb, rt->ctx, tr,
+			FORCE_NEGATIVE(PTR_ERR(r)));
+		goto done;
+	}
+	ret = bsend_reply(rt->base.fb, rt->ctx, tr, r);
+done:
+	XDR_REQ_FREE(mmm_osd_chunk_csum_req, &req);
+	return ret;
+}
+
 /** Handle an incoming message.
  *
  * Notes:
@@ -223,7 +893,9 @@ static int osd_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 		ret = handle_mmm_get_osd_read_req(rt, tr, m);
 		break;
 	case mmm_osd_hflush_req_ty:
+		/* The handler takes over our reference to m */
 		ret = handle_mmm_osd_hflush_req(rt, tr, m);
+		m = NULL;
 		break;
 	case mmm_osd_chunkrep_req_ty:
 		ret = handle_mmm_osd_chunkrep_req(rt, tr, m);
@@ -231,6 +903,12 @@ static int osd_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 	case mmm_osd_unlink_req_ty:
 		ret = handle_mmm_osd_unlink_req(rt, tr, m);
 		break;
+	case mmm_osd_chunk_copy_req_ty:
+		ret = handle_mmm_osd_chunk_copy_req(rt, tr, m);
+		break;
+	case mmm_osd_chunk_csum_req_ty:
+		ret = handle_mmm_osd_chunk_csum_req(rt, tr, m);
+		break;
 	default:
 		glitch_log("osd_net_handle_mds_tr: unhandled message "
 			   "type %d from %s\n", ty, ep_buf);
@@ -238,7 +916,8 @@ static int osd_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 		ret = -ENOSYS;
 		break;
 	}
-	msg_release(m);
+	if (m)
+		msg_release(m);
 	if (ret) {
 		glitch_log("osd_net_handle_mds_tr: error %d handling "
 			   "message type %d from %s\n", ret, ty, ep_buf);
@@ -246,12 +925,17 @@ static int osd_net_handle_tr(struct recv_pool_thread *rt, struct mtran *tr)
 	return 0;
 }
 
+static void osd_send_corrupt_chunks(struct bsend *ctx,
+		const struct osd_scrub_report *rep);
+
 static int osd_send_hb_thread(struct redfish_thread *rt)
 {
 	struct mmm_heartbeat resp;
 	struct msg *r;
 	struct daemon_info *di;
 	struct bsend *ctx;
+	struct osd_scrub_report rep;
+	uint64_t corrupt[OSD_HB_MAX_CORRUPT];
 	int i;
 	time_t until;
 
@@ -264,7 +948,7 @@ static int osd_send_hb_thread(struct redfish_thread *rt)
 	}
 	resp.ty = RF_ENTITY_TY_OSD;
 	resp.id = g_oid;
-	r = MSG_XDR_ALLOC(mmm_resp, &resp);
+	r = MSG_XDR_ALLOC(mmm_heartbeat, &resp);
 	if (IS_ERR(r)) {
 		abort();
 	}
@@ -281,6 +965,14 @@ static int osd_send_hb_thread(struct redfish_thread *rt)
 		}
 		bsend_join(ctx);
 		bsend_reset(ctx);
+		/* Report the corrupt chunks that reads have turned up, so that
+		 * they get replaced without waiting for the scrubber */
+		rep.cids = corrupt;
+		rep.max_cid = OSD_HB_MAX_CORRUPT;
+		rep.num_cid = ostor_take_corrupt(g_ostor, corrupt,
+			OSD_HB_MAX_CORRUPT);
+		if (rep.num_cid > 0)
+			osd_send_corrupt_chunks(ctx, &rep);
 		mt_sleep_until(until);
 	}
 	msg_release(r);
@@ -288,6 +980,107 @@ static int osd_send_hb_thread(struct redfish_thread *rt)
 	return 0;
 }
 
+static void osd_scrub_found_cb(void *priv, uint64_t cid)
+{
+	struct osd_scrub_report *rep = priv;
+	uint64_t *cids;
+	int max_cid;
+
+	if (rep->num_cid == rep->max_cid) {
+		max_cid = rep->max_cid ? (2 * rep->max_cid) : 16;
+		cids = realloc(rep->cids, max_cid * sizeof(uint64_t));
+		if (!cids) {
+			glitch_log("osd_scrub_found_cb: out of memory.  Not "
+				"reporting chunk 0x%016" PRIx64 "\n", cid);
+			return;
+		}
+		rep->cids = cids;
+		rep->max_cid = max_cid;
+	}
+	rep->cids[rep->num_cid++] = cid;
+}
+
+/** Tell the metadata servers about corrupt chunks, so that they can be
+ * replaced with good copies from elsewhere.
+ *
+ * @param ctx		The bsend context to use
+ * @param rep		The corrupt chunks
+ */
+static void osd_send_corrupt_chunks(struct bsend *ctx,
+		const struct osd_scrub_report *rep)
+{
+	int i, j, n;
+	struct mmm_osd_corrupt_chunks cc;
+	struct daemon_info *di;
+	struct msg *r;
+	uint64_t *cids;
+
+	cc.oid = g_oid;
+	for (i = 0; i < rep->num_cid; i += n) {
+		n = rep->num_cid - i;
+		if (n > MMM_OSD_CHUNKREP_MAX_CHUNKS)
+			n = MMM_OSD_CHUNKREP_MAX_CHUNKS;
+		r = msg_xdr_extalloc(mmm_osd_corrupt_chunks_ty,
+			(xdrproc_t)xdr_mmm_osd_corrupt_chunks, &cc,
+			n * sizeof(uint64_t), (void**)&cids);
+		if (IS_ERR(r)) {
+			glitch_log("osd_send_corrupt_chunks: failed to "
+				"allocate message: error %d\n", PTR_ERR(r));
+			return;
+		}
+		for (j = 0; j < n; ++j)
+			pack_to_be64(&cids[j], rep->cids[i + j]);
+		for (j = 0; j < g_cmap->num_mds; ++j) {
+			di = &g_cmap->minfo[j];
+			if (!di->in)
+				continue;
+			msg_addref(r);
+			bsend_add(ctx, g_msgr[RF_ENTITY_TY_MDS], 0, r,
+				di->ip, di->port[RF_ENTITY_TY_OSD],
+				OSD_REPLY_TIMEO, NULL);
+		}
+		bsend_join(ctx);
+		bsend_reset(ctx);
+		msg_release(r);
+	}
+}
+
+static int osd_scrub_thread(struct redfish_thread *rt)
+{
+	int ret;
+	struct bsend *ctx;
+	struct osd_scrub_report rep;
+
+	ctx = bsend_init(rt->fb, RF_MAX_MDS);
+	if (IS_ERR(ctx)) {
+		glitch_log("osd_scrub_thread: failed to allocate "
+			"an RPC context for the scrub thread: "
+			"error %d\n", PTR_ERR(ctx));
+		abort();
+	}
+	while (1) {
+		mt_sleep_until(mt_time() + g_scrub_ival);
+		memset(&rep, 0, sizeof(rep));
+		ret = ostor_scrub(g_ostor, rt->fb, g_scrub_rate,
+			osd_scrub_found_cb, &rep);
+		if (ret < 0) {
+			glitch_log("osd_scrub_thread: scrub failed with error "
+				"%d\n", ret);
+		}
+		else {
+			glitch_log("osd_scrub_thread: scrub found %d corrupt "
+				"chunk(s)\n", ret);
+		}
+		if (rep.num_cid > 0)
+			osd_send_corrupt_chunks(ctx, &rep);
+		free(rep.cids);
+		if (ret == -ESHUTDOWN)
+			break;
+	}
+	bsend_free(ctx);
+	return 0;
+}
+
 void osd_net_init(struct unitaryc *conf, uint16_t oid,
 		char *err, size_t err_len)
 {
@@ -306,6 +1099,7 @@ void osd_net_init(struct unitaryc *conf, uint16_t oid,
 			.tcp_teardown_timeo = 900,
 			.name = "osd_msgr",
 			.fl_mgr = g_fast_log_mgr,
+			.conns_per_ep = 3,
 		},
 		{
 			.max_conn = 65535,
@@ -313,6 +1107,7 @@ void osd_net_init(struct unitaryc *conf, uint16_t oid,
 			.tcp_teardown_timeo = 300,
 			.name = "cli_msgr",
 			.fl_mgr = g_fast_log_mgr,
+			.compress_min = MSGR_DEFAULT_COMPRESS_MIN,
 		},
 	};
 	int i, ret;
@@ -338,13 +1133,13 @@ void osd_net_init(struct unitaryc *conf, uint16_t oid,
 				entity_ty_to_short_str(i), err);
 		}
 	}
-	g_mds_rpool = recv_pool_init("mds_rpool");
+	g_mds_rpool = recv_pool_init("mds_rpool", 0);
 	if (IS_ERR(g_mds_rpool)) {
 		glitch_log("osd_net_init: failed to create mds_rpool: "
 			   "error %d\n", PTR_ERR(g_mds_rpool));
 		abort();
 	}
-	g_io_rpool = recv_pool_init("io_rpool");
+	g_io_rpool = recv_pool_init("io_rpool", 0);
 	if (IS_ERR(g_io_rpool)) {
 		glitch_log("osd_net_init: failed to create io_rpool: "
 			   "error %d\n", PTR_ERR(g_io_rpool));
@@ -405,6 +1200,18 @@ void osd_net_init(struct unitaryc *conf, uint16_t oid,
 			"g_osd_send_hb_thread: error %d\n", ret);
 		abort();
 	}
+	/* A scrub rate of 0 turns the scrubber off */
+	if (osdc->oc->ostor_scrub_rate > 0) {
+		g_scrub_rate = (uint64_t)osdc->oc->ostor_scrub_rate * 1024;
+		g_scrub_ival = osdc->oc->ostor_scrub_ival;
+		ret = redfish_thread_create(g_fast_log_mgr,
+			&g_osd_scrub_thread, osd_scrub_thread, NULL);
+		if (ret) {
+			glitch_log("osd_net_init: failed to create "
+				"g_osd_scrub_thread: error %d\n", ret);
+			abort();
+		}
+	}
 }
 
 int osd_net_main_loop(void)
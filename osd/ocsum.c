@@ -0,0 +1,396 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "osd/ocsum.h"
+#include "util/crc32c.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/safe_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Number of checksum entries we read or write at once */
+#define OCSUM_BATCH 256
+
+/** Size of the buffer used to read chunk data back when recomputing
+ * checksums */
+#define OCSUM_READ_BUF_SZ (16 * OCSUM_BLOCK_SZ)
+
+static uint64_t ocsum_ent_off(uint64_t idx)
+{
+	return OCSUM_HDR_LEN + (idx * sizeof(uint32_t));
+}
+
+static int ocsum_write_hdr(int csum_fd, uint64_t cid)
+{
+	char hdr[OCSUM_HDR_LEN];
+
+	pack_to_be32(hdr, OCSUM_MAGIC);
+	pack_to_be32(hdr + 4, OCSUM_BLOCK_SZ);
+	pack_to_be64(hdr + 8, cid);
+	return safe_pwrite(csum_fd, hdr, OCSUM_HDR_LEN, 0);
+}
+
+int ocsum_read_hdr(int csum_fd, uint64_t *cid)
+{
+	int ret;
+	char hdr[OCSUM_HDR_LEN];
+
+	ret = safe_pread_exact(csum_fd, hdr, OCSUM_HDR_LEN, 0);
+	if (ret == -EDOM)
+		return -EBADMSG;
+	else if (ret)
+		return ret;
+	if (unpack_from_be32(hdr) != OCSUM_MAGIC)
+		return -EBADMSG;
+	if (unpack_from_be32(hdr + 4) != OCSUM_BLOCK_SZ)
+		return -EBADMSG;
+	*cid = unpack_from_be64(hdr + 8);
+	return 0;
+}
+
+static int ocsum_fstat_size(int fd, uint64_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+	*size = st.st_size;
+	return 0;
+}
+
+/** Add data to the checksums, writing out the entries for any blocks that it
+ * completes
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param st		(inout) the checksum state
+ * @param data		Data that follows the data covered by st
+ * @param dlen		Length of data
+ *
+ * @return		0 on success; a negative error code on I/O error
+ */
+static int ocsum_feed(int csum_fd, struct ocsum_state *st,
+		const char *data, uint64_t dlen)
+{
+	int ret;
+	uint32_t n, num_ent = 0;
+	uint64_t first = st->len / OCSUM_BLOCK_SZ;
+	char ent[OCSUM_BATCH * sizeof(uint32_t)];
+
+	while (dlen > 0) {
+		n = OCSUM_BLOCK_SZ - (st->len % OCSUM_BLOCK_SZ);
+		if (n > dlen)
+			n = dlen;
+		st->tail_crc = crc32c(st->tail_crc, data, n);
+		st->len += n;
+		data += n;
+		dlen -= n;
+		if (st->len % OCSUM_BLOCK_SZ)
+			continue;
+		pack_to_be32(ent + (num_ent * sizeof(uint32_t)),
+			st->tail_crc);
+		st->tail_crc = 0;
+		if (++num_ent < OCSUM_BATCH)
+			continue;
+		ret = safe_pwrite(csum_fd, ent, num_ent * sizeof(uint32_t),
+			ocsum_ent_off(first));
+		if (ret)
+			return ret;
+		first += num_ent;
+		num_ent = 0;
+	}
+	if (num_ent == 0)
+		return 0;
+	return safe_pwrite(csum_fd, ent, num_ent * sizeof(uint32_t),
+		ocsum_ent_off(first));
+}
+
+/** Bring the checksums up to date by reading back chunk data
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param data_fd	The chunk data file descriptor
+ * @param st		(inout) the checksum state
+ * @param end		Offset in the chunk to checksum up to
+ *
+ * @return		0 on success; a negative error code on I/O error
+ */
+static int ocsum_catch_up(int csum_fd, int data_fd, struct ocsum_state *st,
+		uint64_t end)
+{
+	int ret;
+	uint64_t n;
+	char *buf;
+
+	if (st->len >= end)
+		return 0;
+	buf = malloc(OCSUM_READ_BUF_SZ);
+	if (!buf)
+		return -ENOMEM;
+	ret = 0;
+	while (st->len < end) {
+		n = end - st->len;
+		if (n > OCSUM_READ_BUF_SZ)
+			n = OCSUM_READ_BUF_SZ;
+		ret = safe_pread_exact(data_fd, buf, n, st->len);
+		if (ret == -EDOM)
+			ret = -EIO;
+		if (ret)
+			break;
+		ret = ocsum_feed(csum_fd, st, buf, n);
+		if (ret)
+			break;
+	}
+	free(buf);
+	return ret;
+}
+
+int ocsum_open(const char *path, int data_fd, uint64_t cid,
+		int *csum_fd, struct ocsum_state *st)
+{
+	int ret, fd;
+	uint64_t dsize, csize, num_ent, hcid;
+
+	memset(st, 0, sizeof(*st));
+	*csum_fd = -1;
+	ret = ocsum_fstat_size(data_fd, &dsize);
+	if (ret)
+		return ret;
+	RETRY_ON_EINTR(fd, open(path, O_RDWR | O_CLOEXEC | O_NOATIME));
+	if (fd < 0) {
+		ret = errno;
+		if (ret != ENOENT)
+			return -ret;
+		/* A chunk with data but no checksum file was written before
+		 * we kept checksums. */
+		if (dsize != 0)
+			return 0;
+		RETRY_ON_EINTR(fd, open(path, O_CREAT | O_RDWR | O_CLOEXEC |
+				O_NOATIME, 0660));
+		if (fd < 0)
+			return -errno;
+	}
+	ret = ocsum_fstat_size(fd, &csize);
+	if (ret)
+		goto error_close_fd;
+	if (csize < OCSUM_HDR_LEN) {
+		/* We must have crashed while creating the checksum file */
+		if (dsize != 0) {
+			ret = -EBADMSG;
+			goto error_close_fd;
+		}
+		ret = ocsum_write_hdr(fd, cid);
+		if (ret)
+			goto error_close_fd;
+		*csum_fd = fd;
+		return 0;
+	}
+	ret = ocsum_read_hdr(fd, &hcid);
+	if (ret)
+		goto error_close_fd;
+	if (hcid != cid) {
+		ret = -EBADMSG;
+		goto error_close_fd;
+	}
+	num_ent = (csize - OCSUM_HDR_LEN) / sizeof(uint32_t);
+	if (ocsum_ent_off(num_ent) != csize) {
+		/* Get rid of a partly written entry */
+		if (ftruncate(fd, ocsum_ent_off(num_ent))) {
+			ret = -errno;
+			goto error_close_fd;
+		}
+	}
+	if (num_ent > (dsize / OCSUM_BLOCK_SZ)) {
+		/* The chunk has lost data that we had checksummed */
+		ret = -EBADMSG;
+		goto error_close_fd;
+	}
+	/* Fill in the entries for any blocks that were written out before we
+	 * crashed, and work out the CRC of the tail. */
+	st->len = num_ent * OCSUM_BLOCK_SZ;
+	ret = ocsum_catch_up(fd, data_fd, st, dsize);
+	if (ret)
+		goto error_close_fd;
+	*csum_fd = fd;
+	return 0;
+
+error_close_fd:
+	safe_close(fd);
+	memset(st, 0, sizeof(*st));
+	return ret;
+}
+
+int ocsum_update(int csum_fd, int data_fd, struct ocsum_state *st,
+		const char *data, uint32_t dlen)
+{
+	int ret;
+	uint64_t dsize;
+
+	ret = ocsum_fstat_size(data_fd, &dsize);
+	if (ret)
+		return ret;
+	if (dsize < st->len)
+		return -EIO;
+	if (dsize == st->len + dlen)
+		return ocsum_feed(csum_fd, st, data, dlen);
+	return ocsum_catch_up(csum_fd, data_fd, st, dsize);
+}
+
+/** Read the stored checksums of some blocks
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param first		Index of the first block
+ * @param num		Number of blocks.  At most OCSUM_BATCH.
+ * @param ent		(out param) the entries
+ *
+ * @return		0 on success; -EBADMSG if the entries are missing;
+ *			another negative error code on I/O error
+ */
+static int ocsum_read_ent(int csum_fd, uint64_t first, uint32_t num,
+		uint32_t *ent)
+{
+	int ret;
+	uint32_t i;
+	char buf[OCSUM_BATCH * sizeof(uint32_t)];
+
+	ret = safe_pread_exact(csum_fd, buf, num * sizeof(uint32_t),
+			ocsum_ent_off(first));
+	if (ret == -EDOM)
+		return -EBADMSG;
+	else if (ret)
+		return ret;
+	for (i = 0; i < num; ++i)
+		ent[i] = unpack_from_be32(buf + (i * sizeof(uint32_t)));
+	return 0;
+}
+
+int ocsum_verify(int csum_fd, int data_fd, const struct ocsum_state *st,
+		uint64_t off, const char *data, uint32_t dlen)
+{
+	int ret;
+	uint32_t crc, expect, ent[OCSUM_BATCH];
+	uint64_t b, bstart, bend, bfull, ent_first, ent_num;
+	uint64_t end, start, stop, dend;
+	char buf[OCSUM_BLOCK_SZ];
+
+	dend = off + dlen;
+	end = (dend < st->len) ? dend : st->len;
+	if (off >= end)
+		return 0;
+	bstart = off / OCSUM_BLOCK_SZ;
+	bend = (end + OCSUM_BLOCK_SZ - 1) / OCSUM_BLOCK_SZ;
+	bfull = st->len / OCSUM_BLOCK_SZ;
+	ent_first = bstart;
+	ent_num = 0;
+	for (b = bstart; b < bend; ++b) {
+		start = b * OCSUM_BLOCK_SZ;
+		stop = start + OCSUM_BLOCK_SZ;
+		if (stop > st->len)
+			stop = st->len;
+		/* Parts of the block that weren't read come from the file */
+		crc = 0;
+		if (start < off) {
+			ret = safe_pread_exact(data_fd, buf, off - start,
+					start);
+			if (ret)
+				return (ret == -EDOM) ? -EBADMSG : ret;
+			crc = crc32c(crc, buf, off - start);
+			start = off;
+		}
+		if (stop <= dend) {
+			crc = crc32c(crc, data + (start - off), stop - start);
+		}
+		else {
+			crc = crc32c(crc, data + (start - off), dend - start);
+			ret = safe_pread_exact(data_fd, buf, stop - dend,
+					dend);
+			if (ret)
+				return (ret == -EDOM) ? -EBADMSG : ret;
+			crc = crc32c(crc, buf, stop - dend);
+		}
+		if (b >= bfull) {
+			expect = st->tail_crc;
+		}
+		else {
+			if (b >= ent_first + ent_num) {
+				ent_first = b;
+				ent_num = bfull - b;
+				if (ent_num > OCSUM_BATCH)
+					ent_num = OCSUM_BATCH;
+				ret = ocsum_read_ent(csum_fd, ent_first,
+						ent_num, ent);
+				if (ret)
+					return ret;
+			}
+			expect = ent[b - ent_first];
+		}
+		if (crc != expect)
+			return -EBADMSG;
+	}
+	return 0;
+}
+
+int ocsum_scrub(int csum_fd, int data_fd, char *buf, uint32_t blen,
+		uint64_t *off)
+{
+	int ret;
+	uint32_t i, n, ent[OCSUM_BATCH];
+	uint64_t b, dsize = 0, csize = 0, num_ent;
+
+	ret = ocsum_fstat_size(csum_fd, &csize);
+	if (ret)
+		return ret;
+	ret = ocsum_fstat_size(data_fd, &dsize);
+	if (ret)
+		return ret;
+	if (csize < OCSUM_HDR_LEN)
+		return -EBADMSG;
+	/* Entries are written after the data they cover, so a block with an
+	 * entry is always complete. */
+	num_ent = (csize - OCSUM_HDR_LEN) / sizeof(uint32_t);
+	if (num_ent > (dsize / OCSUM_BLOCK_SZ))
+		return -EBADMSG;
+	b = *off / OCSUM_BLOCK_SZ;
+	if (b >= num_ent)
+		return 0;
+	n = blen / OCSUM_BLOCK_SZ;
+	if (n > OCSUM_BATCH)
+		n = OCSUM_BATCH;
+	if (n > num_ent - b)
+		n = num_ent - b;
+	ret = ocsum_read_ent(csum_fd, b, n, ent);
+	if (ret)
+		return ret;
+	ret = safe_pread_exact(data_fd, buf, n * OCSUM_BLOCK_SZ,
+			b * OCSUM_BLOCK_SZ);
+	if (ret)
+		return (ret == -EDOM) ? -EBADMSG : ret;
+	for (i = 0; i < n; ++i) {
+		if (crc32c(0, buf + (i * OCSUM_BLOCK_SZ), OCSUM_BLOCK_SZ) !=
+				ent[i])
+			return -EBADMSG;
+	}
+	*off = (b + n) * OCSUM_BLOCK_SZ;
+	return (b + n < num_ent) ? 1 : 0;
+}
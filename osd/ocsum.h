@@ -0,0 +1,156 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_OSD_OCSUM_DOT_H
+#define REDFISH_OSD_OCSUM_DOT_H
+
+/*
+ * Chunk checksums
+ *
+ * Every chunk file has a checksum file next to it, with the same name plus
+ * OCSUM_SUFFIX.  The checksum file is made up of:
+ *
+ * header	OCSUM_MAGIC, the block size, and the chunk ID, as big-endian
+ *		32-, 32- and 64-bit words
+ * entries	the CRC32C of each complete OCSUM_BLOCK_SZ block of the chunk,
+ *		as a big-endian 32-bit word
+ *
+ * Chunks only ever grow at the end, so once a block is complete, its entry
+ * never changes.  The CRC of the last, partial block is kept in memory, and
+ * recomputed from the data when the chunk is opened again.
+ *
+ * Keeping the chunk ID in the header lets the scrubber find out which chunk a
+ * file belongs to without relying on the file name.
+ *
+ * Chunks written before checksums existed have no checksum file.  They can
+ * still be read and appended to, but they aren't verified.
+ */
+
+#include <stdint.h> /* for uint64_t, etc. */
+
+/** Size of a checksummed block */
+#define OCSUM_BLOCK_SZ 4096
+
+/** Length of the checksum file header */
+#define OCSUM_HDR_LEN 16
+
+/** Magic number at the start of a checksum file: "RFCS" */
+#define OCSUM_MAGIC 0x52464353
+
+/** Suffix of checksum file names */
+#define OCSUM_SUFFIX ".crc"
+
+/** How much of a chunk is checksummed */
+struct ocsum_state {
+	/** Number of bytes of the chunk covered by the checksums */
+	uint64_t len;
+	/** CRC32C of the last, partial block, or 0 if len is a multiple of
+	 * OCSUM_BLOCK_SZ */
+	uint32_t tail_crc;
+};
+
+/** Open the checksum file for a chunk
+ *
+ * If the checksum file is missing entries, because we crashed between writing
+ * the data and its checksums, they are filled in from the data.
+ *
+ * @param path		Path to the checksum file
+ * @param data_fd	Open file descriptor for the chunk data
+ * @param cid		The chunk ID
+ * @param csum_fd	(out param) the checksum file descriptor, or -1 if the
+ *			chunk has no checksums
+ * @param st		(out param) the checksum state
+ *
+ * @return		0 on success; -EBADMSG if the checksum file doesn't
+ *			match the chunk; another negative error code on I/O
+ *			error
+ */
+extern int ocsum_open(const char *path, int data_fd, uint64_t cid,
+		int *csum_fd, struct ocsum_state *st);
+
+/** Update the checksums after data has been appended to a chunk
+ *
+ * Appends to a chunk may finish in any order, so the checksums are brought up
+ * to date with whatever is in the chunk file now.  If that is exactly the
+ * checksummed data followed by the new data, the new data is checksummed
+ * straight from the buffer.  Otherwise, the missing part of the chunk is read
+ * back from the file.
+ *
+ * Calls for the same chunk must be serialized.
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param data_fd	The chunk data file descriptor
+ * @param st		(inout) the checksum state.  On return, this covers
+ *			the whole chunk file.
+ * @param data		The data which was appended
+ * @param dlen		Length of data
+ *
+ * @return		0 on success; a negative error code on I/O error
+ */
+extern int ocsum_update(int csum_fd, int data_fd, struct ocsum_state *st,
+		const char *data, uint32_t dlen);
+
+/** Verify data which was read from a chunk
+ *
+ * Blocks which are only partly inside the buffer are completed by reading the
+ * rest of them from the chunk.  Data beyond st->len isn't verified.
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param data_fd	The chunk data file descriptor
+ * @param st		The checksum state, taken before the data was read
+ * @param off		Offset in the chunk that the data was read from
+ * @param data		The data
+ * @param dlen		Length of data
+ *
+ * @return		0 if the data is good; -EBADMSG if it is corrupt;
+ *			another negative error code on I/O error
+ */
+extern int ocsum_verify(int csum_fd, int data_fd,
+		const struct ocsum_state *st, uint64_t off,
+		const char *data, uint32_t dlen);
+
+/** Read the header of a checksum file
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param cid		(out param) the chunk ID
+ *
+ * @return		0 on success; -EBADMSG if the header is bad; another
+ *			negative error code on I/O error
+ */
+extern int ocsum_read_hdr(int csum_fd, uint64_t *cid);
+
+/** Verify the next few complete blocks of a chunk
+ *
+ * Only blocks which have both data and a checksum are verified, so this is
+ * safe to use on a chunk which is being appended to.
+ *
+ * @param csum_fd	The checksum file descriptor
+ * @param data_fd	The chunk data file descriptor
+ * @param buf		Buffer to read the data into.  Its length must be a
+ *			multiple of OCSUM_BLOCK_SZ.
+ * @param blen		Length of buf
+ * @param off		(inout) offset of the next block to verify
+ *
+ * @return		1 if there are more blocks to verify; 0 if we have
+ *			reached the end; -EBADMSG if a block is corrupt;
+ *			another negative error code on I/O error
+ */
+extern int ocsum_scrub(int csum_fd, int data_fd, char *buf, uint32_t blen,
+		uint64_t *off);
+
+#endif
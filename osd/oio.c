@@ -0,0 +1,570 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/glitch_log.h"
+#include "core/process_ctx.h"
+#include "osd/oio.h"
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/platform/pipe2.h"
+#include "util/platform/uring.h"
+#include "util/queue.h"
+#include "util/safe_io.h"
+#include "util/thread.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Maximum number of completions to reap from a ring at once */
+#define OIO_URING_MAX_REAP 32
+
+/** user_data of the poll operation on a disk's self-pipe.  Requests are
+ * identified by their addresses, so this can't collide with one. */
+#define OIO_URING_WAKE_DATA 0
+
+STAILQ_HEAD(oio_req_queue, oio_req);
+
+struct oio_disk {
+	/** The engine this disk belongs to */
+	struct oio *oio;
+	/** Lock which protects everything below */
+	pthread_mutex_t lock;
+	/** Requests waiting to be started */
+	struct oio_req_queue queue;
+	/** Statistics.  queued and inflight are also used to decide when we
+	 * can start more operations. */
+	struct oio_stats stats;
+	/** If nonzero, we are shutting down */
+	int shutdown;
+	/** Condition variable which is signalled when there are requests in
+	 * the queue.  Only used with OIO_BACKEND_THREADS. */
+	pthread_cond_t cond;
+	/** The ring.  Only used with OIO_BACKEND_URING. */
+	struct uring *ring;
+	/** Self-pipe used to wake up the ring thread when it is waiting for
+	 * completions.  Only used with OIO_BACKEND_URING. */
+	int pipefd[2];
+	/** Nonzero if the ring thread may be waiting for completions */
+	int sleeping;
+	/** Nonzero if we have already written to the self-pipe since the ring
+	 * thread last drained it */
+	int woken;
+	/** Threads servicing this disk */
+	struct redfish_thread *threads;
+	/** Length of threads */
+	int num_threads;
+};
+
+struct oio {
+	/** How we service the disks */
+	enum oio_backend backend;
+	/** Maximum number of operations outstanding on each disk */
+	int depth;
+	/** Number of disks */
+	int num_disk;
+	/** The disks */
+	struct oio_disk *disks;
+};
+
+/************************** common *******************************/
+/** Account for a finished operation
+ *
+ * Should be called with the disk lock held.
+ *
+ * @param disk		The disk
+ * @param req		The request, with req->res filled in
+ */
+static void oio_disk_account(struct oio_disk *disk, const struct oio_req *req)
+{
+	int bucket;
+	uint64_t usec;
+	struct oio_stats *st = &disk->stats;
+
+	st->inflight--;
+	st->completed++;
+	if (req->res < 0)
+		st->errors++;
+	else if (req->op == OIO_OP_READ)
+		st->bytes_read += req->res;
+	else
+		st->bytes_written += req->len;
+	usec = mt_time_usec() - req->start_us;
+	st->total_us += usec;
+	bucket = (usec < 2) ? 0 : (63 - __builtin_clzll(usec));
+	if (bucket >= OIO_LAT_BUCKETS)
+		bucket = OIO_LAT_BUCKETS - 1;
+	st->lat_hist[bucket]++;
+}
+
+/** Invoke the callbacks of a list of finished requests
+ *
+ * Should be called with the disk lock released.
+ *
+ * @param done		The requests
+ */
+static void oio_run_callbacks(struct oio_req_queue *done)
+{
+	struct oio_req *req;
+
+	while (1) {
+		req = STAILQ_FIRST(done);
+		if (!req)
+			break;
+		STAILQ_REMOVE_HEAD(done, entry);
+		/* The callback may free req, so we must be done with it. */
+		req->cb(req);
+	}
+}
+
+/************************** threads *******************************/
+static int oio_thread_main(struct redfish_thread *rt)
+{
+	struct oio_disk *disk = rt->priv;
+	struct oio_req *req;
+
+	pthread_mutex_lock(&disk->lock);
+	while (1) {
+		req = STAILQ_FIRST(&disk->queue);
+		if (!req) {
+			if (disk->shutdown)
+				break;
+			pthread_cond_wait(&disk->cond, &disk->lock);
+			continue;
+		}
+		STAILQ_REMOVE_HEAD(&disk->queue, entry);
+		disk->stats.queued--;
+		disk->stats.inflight++;
+		pthread_mutex_unlock(&disk->lock);
+		if (req->op == OIO_OP_READ) {
+			req->res = safe_pread(req->fd, req->buf,
+				req->len, req->off);
+		}
+		else {
+			req->res = safe_pwrite(req->fd, req->buf,
+				req->len, req->off);
+		}
+		pthread_mutex_lock(&disk->lock);
+		oio_disk_account(disk, req);
+		pthread_mutex_unlock(&disk->lock);
+		req->cb(req);
+		pthread_mutex_lock(&disk->lock);
+	}
+	pthread_mutex_unlock(&disk->lock);
+	return 0;
+}
+
+/************************** uring *******************************/
+/** Queue the rest of a request on the ring
+ *
+ * @param disk		The disk
+ * @param req		The request
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int oio_uring_prep(struct oio_disk *disk, struct oio_req *req)
+{
+	if (req->op == OIO_OP_READ) {
+		return uring_prep_read(disk->ring, req->fd,
+			req->buf + req->done, req->len - req->done,
+			req->off + req->done, (uintptr_t)req);
+	}
+	else {
+		return uring_prep_write(disk->ring, req->fd,
+			req->buf + req->done, req->len - req->done,
+			req->off + req->done, (uintptr_t)req);
+	}
+}
+
+/** Handle the completion of an operation on the ring
+ *
+ * The kernel may read or write less than we asked for.  If so, we queue the
+ * rest of the request again, just like safe_pread and safe_pwrite would.
+ *
+ * @param disk		The disk
+ * @param req		The request
+ * @param res		The result of the operation
+ *
+ * @return		1 if the request is finished; 0 if it was requeued
+ */
+static int oio_uring_advance(struct oio_disk *disk, struct oio_req *req,
+		int res)
+{
+	int ret;
+
+	if (res < 0) {
+		req->res = res;
+		return 1;
+	}
+	req->done += res;
+	if (req->done >= req->len) {
+		req->res = (req->op == OIO_OP_READ) ? (int)req->done : 0;
+		return 1;
+	}
+	if (res == 0) {
+		/* End-of-file.  That's fine for a read, but a write which
+		 * makes no progress will never finish. */
+		req->res = (req->op == OIO_OP_READ) ? (int)req->done : -EIO;
+		return 1;
+	}
+	ret = oio_uring_prep(disk, req);
+	if (ret) {
+		req->res = ret;
+		return 1;
+	}
+	return 0;
+}
+
+/** Wake up the ring thread
+ *
+ * @param disk		The disk.  Must be locked.
+ */
+static void oio_uring_notify(struct oio_disk *disk)
+{
+	char c = 0;
+	ssize_t POSSIBLY_UNUSED(res);
+
+	/* The pipe is non-blocking, and it doesn't matter if it's full. */
+	RETRY_ON_EINTR(res, write(disk->pipefd[PIPE_WRITE], &c, 1));
+}
+
+static void oio_uring_drain(struct oio_disk *disk)
+{
+	char buf[16];
+	ssize_t res;
+
+	do {
+		RETRY_ON_EINTR(res, read(disk->pipefd[PIPE_READ],
+				buf, sizeof(buf)));
+	} while (res > 0);
+}
+
+/** Start as many queued requests as the queue depth allows
+ *
+ * Should be called with the disk lock held.
+ *
+ * @param disk		The disk
+ * @param done		(out param) requests which could not be started are
+ *			added to this list
+ */
+static void oio_uring_start(struct oio_disk *disk, struct oio_req_queue *done)
+{
+	int ret;
+	struct oio_req *req;
+
+	while (disk->stats.inflight < disk->oio->depth) {
+		req = STAILQ_FIRST(&disk->queue);
+		if (!req)
+			break;
+		STAILQ_REMOVE_HEAD(&disk->queue, entry);
+		disk->stats.queued--;
+		disk->stats.inflight++;
+		ret = oio_uring_prep(disk, req);
+		if (ret) {
+			req->res = ret;
+			oio_disk_account(disk, req);
+			STAILQ_INSERT_TAIL(done, req, entry);
+		}
+	}
+}
+
+static int oio_uring_main(struct redfish_thread *rt)
+{
+	int i, num, ret, wait, polling = 0;
+	struct oio_disk *disk = rt->priv;
+	struct uring_cqe_info cqes[OIO_URING_MAX_REAP];
+	struct oio_req_queue done;
+	struct oio_req *req;
+
+	STAILQ_INIT(&done);
+	pthread_mutex_lock(&disk->lock);
+	while (1) {
+		oio_uring_start(disk, &done);
+		if (disk->shutdown && STAILQ_EMPTY(&disk->queue) &&
+				(disk->stats.inflight == 0))
+			break;
+		/* If we have callbacks to run, just collect whatever has
+		 * finished in the meantime rather than waiting. */
+		wait = STAILQ_EMPTY(&done);
+		disk->sleeping = wait;
+		pthread_mutex_unlock(&disk->lock);
+		oio_run_callbacks(&done);
+		if (!polling) {
+			ret = uring_prep_poll(disk->ring,
+				disk->pipefd[PIPE_READ], POLLIN,
+				OIO_URING_WAKE_DATA);
+			if (ret == 0)
+				polling = 1;
+		}
+		ret = uring_submit(disk->ring, wait);
+		if (ret) {
+			glitch_log("oio_uring_main: uring_submit failed with "
+				"error %d\n", ret);
+			mt_msleep(1);
+		}
+		num = uring_reap(disk->ring, cqes, OIO_URING_MAX_REAP);
+		pthread_mutex_lock(&disk->lock);
+		disk->sleeping = 0;
+		for (i = 0; i < num; ++i) {
+			if (cqes[i].user_data == OIO_URING_WAKE_DATA) {
+				oio_uring_drain(disk);
+				disk->woken = 0;
+				polling = 0;
+				continue;
+			}
+			req = (struct oio_req*)(uintptr_t)cqes[i].user_data;
+			if (!oio_uring_advance(disk, req, cqes[i].res))
+				continue;
+			oio_disk_account(disk, req);
+			STAILQ_INSERT_TAIL(&done, req, entry);
+		}
+	}
+	pthread_mutex_unlock(&disk->lock);
+	oio_run_callbacks(&done);
+	return 0;
+}
+
+/************************** oio *******************************/
+static int oio_disk_init(struct oio *oio, struct oio_disk *disk)
+{
+	int i, ret, POSSIBLY_UNUSED(res);
+
+	disk->oio = oio;
+	STAILQ_INIT(&disk->queue);
+	disk->pipefd[PIPE_READ] = -1;
+	disk->pipefd[PIPE_WRITE] = -1;
+	ret = pthread_mutex_init(&disk->lock, NULL);
+	if (ret)
+		goto error;
+	ret = pthread_cond_init_mt(&disk->cond);
+	if (ret)
+		goto error_destroy_lock;
+	if (oio->backend == OIO_BACKEND_URING) {
+		ret = do_pipe2(disk->pipefd, WANT_O_CLOEXEC | WANT_O_NONBLOCK);
+		if (ret)
+			goto error_destroy_cond;
+		/* Leave room for the poll operation on the self-pipe */
+		ret = uring_init(oio->depth + 1, &disk->ring);
+		if (ret)
+			goto error_close_pipe;
+		disk->num_threads = 1;
+	}
+	else {
+		disk->num_threads = oio->depth;
+	}
+	disk->threads = calloc(disk->num_threads,
+			sizeof(struct redfish_thread));
+	if (!disk->threads) {
+		ret = -ENOMEM;
+		goto error_free_ring;
+	}
+	for (i = 0; i < disk->num_threads; ++i) {
+		ret = redfish_thread_create(g_fast_log_mgr, &disk->threads[i],
+			(oio->backend == OIO_BACKEND_URING) ?
+				oio_uring_main : oio_thread_main, disk);
+		if (ret)
+			goto error_stop_threads;
+	}
+	return 0;
+
+error_stop_threads:
+	pthread_mutex_lock(&disk->lock);
+	disk->shutdown = 1;
+	pthread_cond_broadcast(&disk->cond);
+	if (oio->backend == OIO_BACKEND_URING)
+		oio_uring_notify(disk);
+	pthread_mutex_unlock(&disk->lock);
+	for (--i; i >= 0; --i)
+		redfish_thread_join(&disk->threads[i]);
+	free(disk->threads);
+error_free_ring:
+	if (disk->ring)
+		uring_free(disk->ring);
+error_close_pipe:
+	if (disk->pipefd[PIPE_READ] >= 0) {
+		RETRY_ON_EINTR(res, close(disk->pipefd[PIPE_READ]));
+		RETRY_ON_EINTR(res, close(disk->pipefd[PIPE_WRITE]));
+	}
+error_destroy_cond:
+	pthread_cond_destroy(&disk->cond);
+error_destroy_lock:
+	pthread_mutex_destroy(&disk->lock);
+error:
+	return FORCE_NEGATIVE(ret);
+}
+
+static void oio_disk_shutdown(struct oio_disk *disk)
+{
+	int i;
+
+	pthread_mutex_lock(&disk->lock);
+	disk->shutdown = 1;
+	pthread_cond_broadcast(&disk->cond);
+	if (disk->oio->backend == OIO_BACKEND_URING)
+		oio_uring_notify(disk);
+	pthread_mutex_unlock(&disk->lock);
+	for (i = 0; i < disk->num_threads; ++i)
+		redfish_thread_join(&disk->threads[i]);
+	disk->num_threads = 0;
+}
+
+static void oio_disk_free(struct oio_disk *disk)
+{
+	int POSSIBLY_UNUSED(res);
+
+	free(disk->threads);
+	if (disk->ring)
+		uring_free(disk->ring);
+	if (disk->pipefd[PIPE_READ] >= 0) {
+		RETRY_ON_EINTR(res, close(disk->pipefd[PIPE_READ]));
+		RETRY_ON_EINTR(res, close(disk->pipefd[PIPE_WRITE]));
+	}
+	pthread_cond_destroy(&disk->cond);
+	pthread_mutex_destroy(&disk->lock);
+}
+
+/** Find out whether we can use io_uring for disk I/O on this system
+ *
+ * @return		1 if we can; 0 if not
+ */
+static int oio_uring_supported(void)
+{
+	int ret;
+	struct uring *ring;
+
+	ret = uring_init(1, &ring);
+	if (ret)
+		return 0;
+	uring_free(ring);
+	return 1;
+}
+
+struct oio *oio_init(const struct oio_conf *conf)
+{
+	int i, ret;
+	struct oio *oio;
+
+	if ((conf->num_disk <= 0) || (conf->depth <= 0))
+		return ERR_PTR(EINVAL);
+	oio = calloc(1, sizeof(struct oio));
+	if (!oio) {
+		ret = ENOMEM;
+		goto error;
+	}
+	oio->depth = conf->depth;
+	oio->num_disk = conf->num_disk;
+	if (conf->use_uring && oio_uring_supported())
+		oio->backend = OIO_BACKEND_URING;
+	else
+		oio->backend = OIO_BACKEND_THREADS;
+	oio->disks = calloc(oio->num_disk, sizeof(struct oio_disk));
+	if (!oio->disks) {
+		ret = ENOMEM;
+		goto error_free_oio;
+	}
+	for (i = 0; i < oio->num_disk; ++i) {
+		ret = oio_disk_init(oio, &oio->disks[i]);
+		if (ret)
+			goto error_free_disks;
+	}
+	return oio;
+
+error_free_disks:
+	for (--i; i >= 0; --i) {
+		oio_disk_shutdown(&oio->disks[i]);
+		oio_disk_free(&oio->disks[i]);
+	}
+	free(oio->disks);
+error_free_oio:
+	free(oio);
+error:
+	return ERR_PTR(FORCE_POSITIVE(ret));
+}
+
+enum oio_backend oio_get_backend(const struct oio *oio)
+{
+	return oio->backend;
+}
+
+int oio_submit(struct oio *oio, int disk_idx, struct oio_req *req)
+{
+	struct oio_disk *disk;
+	struct oio_stats *st;
+
+	if ((disk_idx < 0) || (disk_idx >= oio->num_disk))
+		return -EINVAL;
+	disk = &oio->disks[disk_idx];
+	st = &disk->stats;
+	req->res = 0;
+	req->done = 0;
+	req->start_us = mt_time_usec();
+	pthread_mutex_lock(&disk->lock);
+	if (disk->shutdown) {
+		pthread_mutex_unlock(&disk->lock);
+		return -ESHUTDOWN;
+	}
+	STAILQ_INSERT_TAIL(&disk->queue, req, entry);
+	st->queued++;
+	if (st->queued + st->inflight > st->max_depth)
+		st->max_depth = st->queued + st->inflight;
+	if (oio->backend == OIO_BACKEND_THREADS) {
+		pthread_cond_signal(&disk->cond);
+	}
+	else if (disk->sleeping && !disk->woken) {
+		disk->woken = 1;
+		oio_uring_notify(disk);
+	}
+	pthread_mutex_unlock(&disk->lock);
+	return 0;
+}
+
+int oio_get_stats(struct oio *oio, int disk_idx, struct oio_stats *st)
+{
+	struct oio_disk *disk;
+
+	if ((disk_idx < 0) || (disk_idx >= oio->num_disk))
+		return -EINVAL;
+	disk = &oio->disks[disk_idx];
+	pthread_mutex_lock(&disk->lock);
+	memcpy(st, &disk->stats, sizeof(struct oio_stats));
+	pthread_mutex_unlock(&disk->lock);
+	return 0;
+}
+
+void oio_shutdown(struct oio *oio)
+{
+	int i;
+
+	for (i = 0; i < oio->num_disk; ++i)
+		oio_disk_shutdown(&oio->disks[i]);
+}
+
+void oio_free(struct oio *oio)
+{
+	int i;
+
+	for (i = 0; i < oio->num_disk; ++i)
+		oio_disk_free(&oio->disks[i]);
+	free(oio->disks);
+	free(oio);
+}
@@ -0,0 +1,192 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_OSD_OIO_DOT_H
+#define REDFISH_OSD_OIO_DOT_H
+
+/*
+ * The OSD disk I/O engine
+ *
+ * Chunk reads and writes are handed to the engine rather than being done on
+ * the thread that received the request.  Each disk has its own submission
+ * queue, so a slow disk only holds up the requests that are waiting for it.
+ * When an operation finishes, the engine invokes the request's callback, which
+ * can send the reply straight to the messenger.
+ *
+ * Each disk is serviced either by an io_uring, driven by one thread, or, where
+ * io_uring isn't available, by a pool of threads doing ordinary pread and
+ * pwrite calls.  Either way, at most 'depth' operations are outstanding on a
+ * disk at once; the rest wait in the queue.
+ */
+
+#include "util/queue.h"
+
+#include <stdint.h> /* for uint64_t, etc. */
+
+struct oio;
+struct oio_req;
+
+/** Number of buckets in a latency histogram.  Bucket i holds operations that
+ * took less than 2^(i+1) microseconds. */
+#define OIO_LAT_BUCKETS 24
+
+/** Read from the file.  The result is the number of bytes read, which is less
+ * than len only at end-of-file. */
+#define OIO_OP_READ 0
+
+/** Write to the file.  The result is 0 once all len bytes are written. */
+#define OIO_OP_WRITE 1
+
+/** How the engine services its disks */
+enum oio_backend {
+	OIO_BACKEND_URING = 0,
+	OIO_BACKEND_THREADS = 1,
+};
+
+/** Called when an operation finishes
+ *
+ * This is invoked on one of the engine's threads, so it must not block for
+ * long.  It may free the request, and it may submit more requests.
+ *
+ * @param req		The request
+ */
+typedef void (*oio_cb_t)(struct oio_req *req);
+
+/** A disk I/O request
+ *
+ * The caller owns the request, and typically embeds it in a larger structure.
+ * It must stay around until the callback has been invoked.
+ */
+struct oio_req {
+	STAILQ_ENTRY(oio_req) entry;
+	/** OIO_OP_* */
+	int op;
+	/** File descriptor to do I/O on */
+	int fd;
+	/** Buffer to read into or write from */
+	char *buf;
+	/** Number of bytes to read or write */
+	uint32_t len;
+	/** Offset in the file.  Ignored when writing to a file opened with
+	 * O_APPEND. */
+	uint64_t off;
+	/** Callback to invoke when the operation finishes */
+	oio_cb_t cb;
+	/** Private data for the callback */
+	void *priv;
+	/** (out) result of the operation: see OIO_OP_*.  Negative error
+	 * codes mean failure. */
+	int res;
+	/** Number of bytes transferred so far.  Used by the engine. */
+	uint32_t done;
+	/** Time at which the request was submitted, in microseconds.  Used by
+	 * the engine. */
+	uint64_t start_us;
+};
+
+/** Configuration for the I/O engine */
+struct oio_conf {
+	/** Number of disks */
+	int num_disk;
+	/** Maximum number of operations outstanding on each disk */
+	int depth;
+	/** If nonzero, use io_uring when we can.  Otherwise, always use
+	 * threads. */
+	int use_uring;
+};
+
+/** Statistics for one disk */
+struct oio_stats {
+	/** Number of requests waiting in the queue */
+	int queued;
+	/** Number of operations in progress */
+	int inflight;
+	/** Largest value that queued + inflight has reached */
+	int max_depth;
+	/** Number of operations that have finished */
+	uint64_t completed;
+	/** Number of operations that finished with an error */
+	uint64_t errors;
+	/** Number of bytes read */
+	uint64_t bytes_read;
+	/** Number of bytes written */
+	uint64_t bytes_written;
+	/** Sum of the latencies of finished operations, in microseconds.
+	 * Latency includes the time spent in the queue. */
+	uint64_t total_us;
+	/** Latency histogram */
+	uint32_t lat_hist[OIO_LAT_BUCKETS];
+};
+
+/** Create the I/O engine
+ *
+ * @param conf		The configuration
+ *
+ * @return		The engine, or an error pointer
+ */
+extern struct oio *oio_init(const struct oio_conf *conf);
+
+/** Find out how the engine services its disks
+ *
+ * @param oio		The engine
+ *
+ * @return		An oio_backend
+ */
+extern enum oio_backend oio_get_backend(const struct oio *oio);
+
+/** Queue a request
+ *
+ * @param oio		The engine
+ * @param disk		Index of the disk that req->fd lives on
+ * @param req		The request.  All fields that aren't used by the engine
+ *			must be filled in.
+ *
+ * @return		0 on success, in which case the callback will be
+ *			invoked later; -ESHUTDOWN if the engine is shutting
+ *			down; -EINVAL if the disk index is bad.  On failure,
+ *			the callback will never be invoked.
+ */
+extern int oio_submit(struct oio *oio, int disk, struct oio_req *req);
+
+/** Get the statistics for a disk
+ *
+ * @param oio		The engine
+ * @param disk		Index of the disk
+ * @param st		(out param) the statistics
+ *
+ * @return		0 on success; -EINVAL if the disk index is bad
+ */
+extern int oio_get_stats(struct oio *oio, int disk, struct oio_stats *st);
+
+/** Shut down the I/O engine
+ *
+ * Requests which have already been queued are carried out, and their
+ * callbacks are invoked, before this returns.  Further calls to oio_submit
+ * fail.
+ *
+ * @param oio		The engine
+ */
+extern void oio_shutdown(struct oio *oio);
+
+/** Free the I/O engine
+ *
+ * @param oio		The engine.  It must have been shut down.
+ */
+extern void oio_free(struct oio *oio);
+
+#endif
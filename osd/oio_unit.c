@@ -0,0 +1,230 @@
+/*
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "core/alarm.h"
+#include "core/process_ctx.h"
+#include "osd/oio.h"
+#include "util/error.h"
+#include "util/tempfile.h"
+#include "util/test.h"
+#include "util/time.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OIOU_NUM_BLOCKS 64
+
+#define OIOU_BLOCK_SZ 4096
+
+/** Tracks how many requests have finished */
+struct oiou_waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int num_done;
+};
+
+static struct oiou_waiter g_waiter = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	0,
+};
+
+static void oiou_cb(POSSIBLY_UNUSED(struct oio_req *req))
+{
+	pthread_mutex_lock(&g_waiter.lock);
+	g_waiter.num_done++;
+	pthread_cond_signal(&g_waiter.cond);
+	pthread_mutex_unlock(&g_waiter.lock);
+}
+
+static void oiou_wait(int num_done)
+{
+	pthread_mutex_lock(&g_waiter.lock);
+	while (g_waiter.num_done < num_done)
+		pthread_cond_wait(&g_waiter.cond, &g_waiter.lock);
+	g_waiter.num_done = 0;
+	pthread_mutex_unlock(&g_waiter.lock);
+}
+
+static void oiou_init_req(struct oio_req *req, int op, int fd, char *buf,
+		uint32_t len, uint64_t off)
+{
+	memset(req, 0, sizeof(*req));
+	req->op = op;
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+	req->cb = oiou_cb;
+}
+
+static int oiou_test_read_write(const char *tdir, int use_uring, int depth)
+{
+	int i, fd;
+	char path[PATH_MAX], *wbuf, *rbuf;
+	struct oio_conf conf;
+	struct oio *oio;
+	struct oio_req *reqs;
+	struct oio_stats st;
+
+	snprintf(path, sizeof(path), "%s/rw.%d.%d", tdir, use_uring, depth);
+	fd = open(path, O_CREAT | O_RDWR, 0644);
+	EXPECT_GE(fd, 0);
+	wbuf = malloc(OIOU_NUM_BLOCKS * OIOU_BLOCK_SZ);
+	EXPECT_NOT_EQ(wbuf, NULL);
+	rbuf = calloc(1, (OIOU_NUM_BLOCKS + 1) * OIOU_BLOCK_SZ);
+	EXPECT_NOT_EQ(rbuf, NULL);
+	reqs = calloc(OIOU_NUM_BLOCKS + 1, sizeof(struct oio_req));
+	EXPECT_NOT_EQ(reqs, NULL);
+	for (i = 0; i < OIOU_NUM_BLOCKS; ++i)
+		memset(wbuf + (i * OIOU_BLOCK_SZ), 'a' + (i % 26),
+			OIOU_BLOCK_SZ);
+
+	memset(&conf, 0, sizeof(conf));
+	conf.num_disk = 1;
+	conf.depth = depth;
+	conf.use_uring = use_uring;
+	oio = oio_init(&conf);
+	EXPECT_NOT_ERRPTR(oio);
+	if (!use_uring)
+		EXPECT_EQ(oio_get_backend(oio), OIO_BACKEND_THREADS);
+
+	/* Write every block at once, then read them all back */
+	for (i = 0; i < OIOU_NUM_BLOCKS; ++i) {
+		oiou_init_req(&reqs[i], OIO_OP_WRITE, fd,
+			wbuf + (i * OIOU_BLOCK_SZ), OIOU_BLOCK_SZ,
+			i * OIOU_BLOCK_SZ);
+		EXPECT_ZERO(oio_submit(oio, 0, &reqs[i]));
+	}
+	oiou_wait(OIOU_NUM_BLOCKS);
+	for (i = 0; i < OIOU_NUM_BLOCKS; ++i)
+		EXPECT_ZERO(reqs[i].res);
+	for (i = 0; i < OIOU_NUM_BLOCKS; ++i) {
+		oiou_init_req(&reqs[i], OIO_OP_READ, fd,
+			rbuf + (i * OIOU_BLOCK_SZ), OIOU_BLOCK_SZ,
+			i * OIOU_BLOCK_SZ);
+		EXPECT_ZERO(oio_submit(oio, 0, &reqs[i]));
+	}
+	/* A read that runs off the end of the file comes up short */
+	oiou_init_req(&reqs[OIOU_NUM_BLOCKS], OIO_OP_READ, fd,
+		rbuf + (OIOU_NUM_BLOCKS * OIOU_BLOCK_SZ), OIOU_BLOCK_SZ,
+		(OIOU_NUM_BLOCKS * OIOU_BLOCK_SZ) - 10);
+	EXPECT_ZERO(oio_submit(oio, 0, &reqs[OIOU_NUM_BLOCKS]));
+	oiou_wait(OIOU_NUM_BLOCKS + 1);
+	for (i = 0; i < OIOU_NUM_BLOCKS; ++i)
+		EXPECT_EQ(reqs[i].res, OIOU_BLOCK_SZ);
+	EXPECT_ZERO(memcmp(rbuf, wbuf, OIOU_NUM_BLOCKS * OIOU_BLOCK_SZ));
+	EXPECT_EQ(reqs[OIOU_NUM_BLOCKS].res, 10);
+
+	/* Errors are passed back to the callback */
+	oiou_init_req(&reqs[0], OIO_OP_READ, -1, rbuf, 1, 0);
+	EXPECT_ZERO(oio_submit(oio, 0, &reqs[0]));
+	oiou_wait(1);
+	EXPECT_EQ(reqs[0].res, -EBADF);
+
+	EXPECT_ZERO(oio_get_stats(oio, 0, &st));
+	EXPECT_ZERO(st.queued);
+	EXPECT_ZERO(st.inflight);
+	EXPECT_GT(st.max_depth, 0);
+	EXPECT_EQ(st.completed, (2 * OIOU_NUM_BLOCKS) + 2);
+	EXPECT_EQ(st.errors, 1);
+	EXPECT_EQ(st.bytes_written, OIOU_NUM_BLOCKS * OIOU_BLOCK_SZ);
+	EXPECT_EQ(st.bytes_read, (OIOU_NUM_BLOCKS * OIOU_BLOCK_SZ) + 10);
+	EXPECT_EQ(oio_get_stats(oio, 1, &st), -EINVAL);
+
+	oio_shutdown(oio);
+	oio_free(oio);
+	free(reqs);
+	free(rbuf);
+	free(wbuf);
+	EXPECT_ZERO(close(fd));
+	return 0;
+}
+
+static int oiou_test_disks(const char *tdir, int use_uring)
+{
+	int i, fd[2];
+	char path[PATH_MAX], buf[2][128];
+	struct oio_conf conf;
+	struct oio *oio;
+	struct oio_req reqs[2];
+	struct oio_stats st;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.num_disk = 2;
+	conf.depth = 1;
+	conf.use_uring = use_uring;
+	oio = oio_init(&conf);
+	EXPECT_NOT_ERRPTR(oio);
+	for (i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), "%s/disk.%d.%d",
+			tdir, use_uring, i);
+		fd[i] = open(path, O_CREAT | O_RDWR | O_APPEND, 0644);
+		EXPECT_GE(fd[i], 0);
+		snprintf(buf[i], sizeof(buf[i]), "disk %d", i);
+		oiou_init_req(&reqs[i], OIO_OP_WRITE, fd[i], buf[i],
+			strlen(buf[i]), 0);
+		EXPECT_ZERO(oio_submit(oio, i, &reqs[i]));
+	}
+	oiou_wait(2);
+	for (i = 0; i < 2; ++i) {
+		EXPECT_ZERO(reqs[i].res);
+		EXPECT_ZERO(oio_get_stats(oio, i, &st));
+		EXPECT_EQ(st.completed, 1);
+		EXPECT_EQ(st.bytes_written, strlen(buf[i]));
+		EXPECT_ZERO(st.bytes_read);
+	}
+	EXPECT_EQ(oio_submit(oio, 2, &reqs[0]), -EINVAL);
+	oio_shutdown(oio);
+	/* Nothing can be queued after shutdown */
+	EXPECT_EQ(oio_submit(oio, 0, &reqs[0]), -ESHUTDOWN);
+	oio_free(oio);
+	for (i = 0; i < 2; ++i)
+		EXPECT_ZERO(close(fd[i]));
+	return 0;
+}
+
+int main(POSSIBLY_UNUSED(int argc), char **argv)
+{
+	char tdir[PATH_MAX];
+	timer_t timer;
+	time_t t;
+
+	EXPECT_ZERO(utility_ctx_init(argv[0])); /* for g_fast_log_mgr */
+	t = mt_time() + 600;
+	EXPECT_ZERO(mt_set_alarm(t, "oio_unit timed out", &timer));
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+
+	EXPECT_ZERO(oiou_test_read_write(tdir, 0, 1));
+	EXPECT_ZERO(oiou_test_read_write(tdir, 0, 8));
+	EXPECT_ZERO(oiou_test_read_write(tdir, 1, 1));
+	EXPECT_ZERO(oiou_test_read_write(tdir, 1, 8));
+	EXPECT_ZERO(oiou_test_disks(tdir, 0));
+	EXPECT_ZERO(oiou_test_disks(tdir, 1));
+
+	EXPECT_ZERO(mt_deactivate_alarm(timer));
+	process_ctx_shutdown();
+
+	return EXIT_SUCCESS;
+}
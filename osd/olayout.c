@@ -0,0 +1,716 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/config/ostorc.h"
+#include "osd/ocsum.h"
+#include "osd/olayout.h"
+#include "util/error.h"
+#include "util/platform/readdir.h"
+#include "util/safe_io.h"
+#include "util/simple_io.h"
+#include "util/string.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Length of a chunk file name */
+#define OLAYOUT_NAME_LEN 16
+
+/** Length of a chunk file name in the legacy layout */
+#define OLAYOUT_LEGACY_NAME_LEN 14
+
+/** Length of a directory name in the legacy layout */
+#define OLAYOUT_LEGACY_DIR_LEN 2
+
+/** Maximum number of files with the same name that we'll put in
+ * OLAYOUT_LOST_DIR */
+#define OLAYOUT_MAX_LOST_DUPS 1000
+
+/** State of a migration */
+struct olayout_mig {
+	/** The data directory */
+	const char *base;
+	/** The new layout */
+	const struct olayout *lay;
+	/** Statistics */
+	struct olayout_migrate_stats *st;
+};
+
+static uint64_t olayout_hash(uint64_t cid)
+{
+	/* Chunk IDs are handed out in order, so every bit of the ID has to
+	 * affect every level of the tree.  This is the splitmix64 finalizer. */
+	cid = (cid ^ (cid >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	cid = (cid ^ (cid >> 27)) * 0x94d049bb133111ebULL;
+	return cid ^ (cid >> 31);
+}
+
+/** Find out whether a name is made up of lowercase hex digits
+ *
+ * @param name		The name
+ * @param len		Number of characters of the name to look at
+ *
+ * @return		1 if the first len characters are hex digits; 0
+ *			otherwise
+ */
+static int olayout_is_hex(const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (!(((name[i] >= '0') && (name[i] <= '9')) ||
+				((name[i] >= 'a') && (name[i] <= 'f'))))
+			return 0;
+	}
+	return 1;
+}
+
+/** Find out whether a name could be a directory in some layout
+ *
+ * @param name		The name
+ *
+ * @return		1 if it could; 0 otherwise
+ */
+static int olayout_is_dir_name(const char *name)
+{
+	int len = strlen(name);
+
+	if ((len == 0) || (len > ((OSTORC_MAX_DIR_BITS + 3) / 4)))
+		return 0;
+	return olayout_is_hex(name, len);
+}
+
+static int olayout_valid(const struct olayout *lay)
+{
+	if ((lay->levels < 1) || (lay->levels > OSTORC_MAX_DIR_LEVELS))
+		return 0;
+	if ((lay->bits < 1) || (lay->bits > OSTORC_MAX_DIR_BITS))
+		return 0;
+	return 1;
+}
+
+/** Get the path of one of the directories above a chunk
+ *
+ * @param lay		The layout.  Must not be the legacy layout.
+ * @param base		The data directory
+ * @param cid		The chunk ID
+ * @param depth		Number of levels to go down
+ * @param dpath		(out param) the directory path
+ * @param dpath_len	Length of dpath
+ */
+static void olayout_get_dpath_at(const struct olayout *lay, const char *base,
+		uint64_t cid, int depth, char *dpath, size_t dpath_len)
+{
+	uint64_t h, mask;
+	size_t off;
+	int i, digits;
+
+	h = olayout_hash(cid);
+	mask = (1ULL << lay->bits) - 1;
+	digits = (lay->bits + 3) / 4;
+	off = snprintf(dpath, dpath_len, "%s", base);
+	for (i = 0; (i < depth) && (off < dpath_len); ++i) {
+		off += snprintf(dpath + off, dpath_len - off, "/%0*x", digits,
+			(unsigned int)((h >> (64 - (lay->bits * (i + 1)))) &
+				mask));
+	}
+}
+
+void olayout_get_dpath(const struct olayout *lay, const char *base,
+		uint64_t cid, char *dpath, size_t dpath_len)
+{
+	if (lay->levels == 0) {
+		snprintf(dpath, dpath_len, "%s/%02x", base,
+			(int)(cid & 0xff));
+		return;
+	}
+	olayout_get_dpath_at(lay, base, cid, lay->levels, dpath, dpath_len);
+}
+
+void olayout_get_path(const struct olayout *lay, const char *base,
+		uint64_t cid, char *path, size_t path_len)
+{
+	size_t off;
+
+	if (lay->levels == 0) {
+		snprintf(path, path_len, "%s/%02x/%014" PRIx64, base,
+			(int)(cid & 0xff), cid >> 16);
+		return;
+	}
+	olayout_get_dpath_at(lay, base, cid, lay->levels, path, path_len);
+	off = strlen(path);
+	snprintf(path + off, path_len - off, "/%016" PRIx64, cid);
+}
+
+void olayout_get_legacy_path(const char *base, uint64_t cid,
+		char *path, size_t path_len)
+{
+	snprintf(path, path_len, "%s/%s/%02x/%014" PRIx64, base,
+		OLAYOUT_LEGACY_DIR, (int)(cid & 0xff), cid >> 16);
+}
+
+int olayout_mkdirs(const struct olayout *lay, const char *base, uint64_t cid)
+{
+	int i, ret;
+	char dpath[PATH_MAX];
+
+	/* Usually only the last level is missing */
+	olayout_get_dpath(lay, base, cid, dpath, sizeof(dpath));
+	if (mkdir(dpath, 0770) == 0)
+		return 0;
+	ret = errno;
+	if (ret == EEXIST)
+		return 0;
+	if ((ret != ENOENT) || (lay->levels == 0))
+		return -ret;
+	for (i = 1; i <= lay->levels; ++i) {
+		olayout_get_dpath_at(lay, base, cid, i, dpath, sizeof(dpath));
+		if (mkdir(dpath, 0770) < 0) {
+			/* Someone else may be creating a chunk in the same
+			 * directory right now. */
+			ret = errno;
+			if (ret != EEXIST)
+				return -ret;
+		}
+	}
+	return 0;
+}
+
+int olayout_equal(const struct olayout *a, const struct olayout *b)
+{
+	if (a->levels != b->levels)
+		return 0;
+	if (a->levels == 0)
+		return 1;
+	return (a->bits == b->bits);
+}
+
+/** Read a layout file
+ *
+ * @param path		Path to the layout file
+ * @param lay		(out param) the layout
+ *
+ * @return		0 on success; -EINVAL if the file is bad; another
+ *			negative error code on I/O error
+ */
+static int olayout_read_file(const char *path, struct olayout *lay)
+{
+	char buf[128];
+	ssize_t res;
+
+	res = simple_io_read_whole_file_zt(path, buf, sizeof(buf));
+	if (res < 0)
+		return res;
+	if (sscanf(buf, "levels %d bits %d", &lay->levels, &lay->bits) != 2)
+		return -EINVAL;
+	if (!olayout_valid(lay))
+		return -EINVAL;
+	return 0;
+}
+
+/** Write a layout file, replacing it atomically if it exists
+ *
+ * @param base		The data directory
+ * @param name		Name of the layout file
+ * @param lay		The layout
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_write_file(const char *base, const char *name,
+		const struct olayout *lay)
+{
+	char path[PATH_MAX], tpath[PATH_MAX], buf[128];
+	int ret, fd, len;
+
+	if (zsnprintf(path, sizeof(path), "%s/%s", base, name))
+		return -ENAMETOOLONG;
+	if (zsnprintf(tpath, sizeof(tpath), "%s.tmp", path))
+		return -ENAMETOOLONG;
+	len = snprintf(buf, sizeof(buf), "levels %d\nbits %d\n",
+		lay->levels, lay->bits);
+	RETRY_ON_EINTR(fd, open(tpath, O_CREAT | O_TRUNC | O_WRONLY |
+			O_CLOEXEC, 0660));
+	if (fd < 0)
+		return -errno;
+	ret = safe_write(fd, buf, len);
+	if (ret)
+		goto error_close;
+	if (fsync(fd) < 0) {
+		ret = -errno;
+		goto error_close;
+	}
+	ret = safe_close(fd);
+	if (ret)
+		goto error_unlink;
+	if (rename(tpath, path) < 0) {
+		ret = -errno;
+		goto error_unlink;
+	}
+	return 0;
+
+error_close:
+	safe_close(fd);
+error_unlink:
+	unlink(tpath);
+	return FORCE_NEGATIVE(ret);
+}
+
+/** Find out whether a data directory has any legacy chunk directories
+ *
+ * @param base		The data directory
+ *
+ * @return		1 if it does; 0 if it doesn't; a negative error code
+ *			on I/O error
+ */
+static int olayout_has_legacy_dirs(const char *base)
+{
+	int ret;
+	struct redfish_dirp *dp;
+	struct dirent *de;
+
+	ret = do_opendir(base, &dp);
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	while (1) {
+		de = do_readdir(dp);
+		if (!de)
+			break;
+		if ((strlen(de->d_name) == OLAYOUT_LEGACY_DIR_LEN) &&
+				olayout_is_hex(de->d_name,
+					OLAYOUT_LEGACY_DIR_LEN)) {
+			ret = 1;
+			break;
+		}
+	}
+	do_closedir(dp);
+	return ret;
+}
+
+int olayout_load(const char *base, struct olayout *lay)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (zsnprintf(path, sizeof(path), "%s/%s", base,
+			OLAYOUT_MIGRATE_FILE))
+		return -ENAMETOOLONG;
+	if (access(path, F_OK) == 0)
+		return -EINPROGRESS;
+	if (errno != ENOENT)
+		return -errno;
+	if (zsnprintf(path, sizeof(path), "%s/%s", base, OLAYOUT_FILE))
+		return -ENAMETOOLONG;
+	ret = olayout_read_file(path, lay);
+	if (ret != -ENOENT)
+		return ret;
+	ret = olayout_has_legacy_dirs(base);
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		return -ENOENT;
+	lay->levels = 0;
+	lay->bits = 8;
+	return 0;
+}
+
+int olayout_store(const char *base, const struct olayout *lay)
+{
+	if (!olayout_valid(lay))
+		return -EINVAL;
+	return olayout_write_file(base, OLAYOUT_FILE, lay);
+}
+
+/** Walk one directory of a data directory
+ *
+ * @param dpath		Path to the directory
+ * @param depth		Number of directory levels between this directory and
+ *			the chunk files
+ * @param cb		The callback
+ * @param priv		Private data for the callback
+ *
+ * @return		Like olayout_walk
+ */
+static int olayout_walk_dir(const char *dpath, int depth,
+		olayout_walk_cb_t cb, void *priv)
+{
+	int ret;
+	struct redfish_dirp *dp;
+	struct dirent *de;
+	char path[PATH_MAX];
+
+	ret = do_opendir(dpath, &dp);
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	while (1) {
+		de = do_readdir(dp);
+		if (!de)
+			break;
+		if (depth > 0) {
+			if (!olayout_is_dir_name(de->d_name))
+				continue;
+		}
+		else if (strchr(de->d_name, '.')) {
+			/* Chunk files have no dots in their names, unlike
+			 * '.', '..' and checksum files. */
+			continue;
+		}
+		if (zsnprintf(path, sizeof(path), "%s/%s", dpath, de->d_name))
+			continue;
+		if (depth == 0) {
+			ret = cb(priv, path);
+			if (ret)
+				break;
+			continue;
+		}
+		ret = olayout_walk_dir(path, depth - 1, cb, priv);
+		if ((ret == -ENOENT) || (ret == -ENOTDIR))
+			ret = 0;
+		if (ret)
+			break;
+	}
+	do_closedir(dp);
+	return ret;
+}
+
+int olayout_walk(const struct olayout *lay, const char *base,
+		olayout_walk_cb_t cb, void *priv)
+{
+	return olayout_walk_dir(base, lay->levels ? lay->levels : 1, cb, priv);
+}
+
+/** Read the chunk ID from a checksum file
+ *
+ * @param path		Path to the checksum file
+ * @param cid		(out param) the chunk ID
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_csum_cid(const char *path, uint64_t *cid)
+{
+	int ret, fd;
+
+	RETRY_ON_EINTR(fd, open(path, O_RDONLY | O_CLOEXEC));
+	if (fd < 0)
+		return -errno;
+	ret = ocsum_read_hdr(fd, cid);
+	safe_close(fd);
+	return ret;
+}
+
+/** Put a file that we can't place in OLAYOUT_LOST_DIR
+ *
+ * @param mig		The migration
+ * @param path		Path to the file
+ * @param dname		Name of the directory the file is in
+ * @param name		Name of the file
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_migrate_lost(struct olayout_mig *mig, const char *path,
+		const char *dname, const char *name)
+{
+	int i;
+	char dst[PATH_MAX];
+
+	if (zsnprintf(dst, sizeof(dst), "%s/%s", mig->base, OLAYOUT_LOST_DIR))
+		return -ENAMETOOLONG;
+	if ((mkdir(dst, 0770) < 0) && (errno != EEXIST))
+		return -errno;
+	/* Legacy chunk directories can all have files with the same names */
+	for (i = 0; i < OLAYOUT_MAX_LOST_DUPS; ++i) {
+		if (zsnprintf(dst, sizeof(dst), "%s/%s/%s-%s.%d", mig->base,
+				OLAYOUT_LOST_DIR, dname, name, i))
+			return -ENAMETOOLONG;
+		if (access(dst, F_OK) == 0)
+			continue;
+		if (rename(path, dst) < 0)
+			return -errno;
+		mig->st->lost++;
+		return 0;
+	}
+	return -EEXIST;
+}
+
+/** Keep a legacy chunk file that we can't identify in OLAYOUT_LEGACY_DIR
+ *
+ * @param mig		The migration
+ * @param path		Path to the file
+ * @param dname		Name of the legacy directory the file is in
+ * @param name		Name of the file
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_migrate_keep(struct olayout_mig *mig, const char *path,
+		const char *dname, const char *name)
+{
+	char dst[PATH_MAX];
+
+	if (zsnprintf(dst, sizeof(dst), "%s/%s", mig->base,
+			OLAYOUT_LEGACY_DIR))
+		return -ENAMETOOLONG;
+	if ((mkdir(dst, 0770) < 0) && (errno != EEXIST))
+		return -errno;
+	if (zsnprintf(dst, sizeof(dst), "%s/%s/%s", mig->base,
+			OLAYOUT_LEGACY_DIR, dname))
+		return -ENAMETOOLONG;
+	if ((mkdir(dst, 0770) < 0) && (errno != EEXIST))
+		return -errno;
+	if (zsnprintf(dst, sizeof(dst), "%s/%s/%s/%s", mig->base,
+			OLAYOUT_LEGACY_DIR, dname, name))
+		return -ENAMETOOLONG;
+	if (access(dst, F_OK) == 0)
+		return olayout_migrate_lost(mig, path, dname, name);
+	if (rename(path, dst) < 0)
+		return -errno;
+	mig->st->kept++;
+	return 0;
+}
+
+/** Move a chunk file, or a checksum file, to where the new layout wants it
+ *
+ * @param mig		The migration
+ * @param cid		The chunk ID
+ * @param path		Path to the file
+ * @param dname		Name of the directory the file is in
+ * @param name		Name of the file
+ * @param suffix	"" for a chunk file, or OCSUM_SUFFIX
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_migrate_move(struct olayout_mig *mig, uint64_t cid,
+		const char *path, const char *dname, const char *name,
+		const char *suffix)
+{
+	int ret;
+	char dst[PATH_MAX];
+	size_t off;
+
+	olayout_get_path(mig->lay, mig->base, cid, dst, sizeof(dst));
+	off = strlen(dst);
+	if (zsnprintf(dst + off, sizeof(dst) - off, "%s", suffix))
+		return -ENAMETOOLONG;
+	if (!strcmp(path, dst))
+		return 0;
+	if (access(dst, F_OK) == 0) {
+		/* Two files claim to be the same chunk.  Keep the one that
+		 * is already in place. */
+		return olayout_migrate_lost(mig, path, dname, name);
+	}
+	ret = olayout_mkdirs(mig->lay, mig->base, cid);
+	if (ret)
+		return ret;
+	if (rename(path, dst) < 0)
+		return -errno;
+	mig->st->moved++;
+	return 0;
+}
+
+/** Migrate a file in a data directory
+ *
+ * @param mig		The migration
+ * @param dpath		Path to the directory the file is in
+ * @param dname		Name of the directory the file is in
+ * @param name		Name of the file
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_migrate_file(struct olayout_mig *mig, const char *dpath,
+		const char *dname, const char *name)
+{
+	int ret, len, slen, is_csum;
+	uint64_t cid, hcid;
+	char path[PATH_MAX], cpath[PATH_MAX], cname[PATH_MAX];
+
+	len = strlen(name);
+	slen = strlen(OCSUM_SUFFIX);
+	is_csum = 0;
+	if ((len > slen) && (!strcmp(name + len - slen, OCSUM_SUFFIX))) {
+		is_csum = 1;
+		len -= slen;
+	}
+	if ((len != OLAYOUT_NAME_LEN) && (len != OLAYOUT_LEGACY_NAME_LEN))
+		return 0;
+	if (!olayout_is_hex(name, len))
+		return 0;
+	if (zsnprintf(path, sizeof(path), "%s/%s", dpath, name))
+		return -ENAMETOOLONG;
+	if (is_csum) {
+		/* Checksum files are moved right after their chunk files.  If
+		 * the chunk file is still here, it will take care of this. */
+		snprintf(cpath, sizeof(cpath), "%s", path);
+		cpath[strlen(path) - slen] = '\0';
+		if (access(cpath, F_OK) == 0)
+			return 0;
+		/* We must have been interrupted between moving a chunk file
+		 * and its checksum file. */
+		if (olayout_csum_cid(path, &cid))
+			return olayout_migrate_lost(mig, path, dname, name);
+		return olayout_migrate_move(mig, cid, path, dname, name,
+			OCSUM_SUFFIX);
+	}
+	if (zsnprintf(cpath, sizeof(cpath), "%s" OCSUM_SUFFIX, path))
+		return -ENAMETOOLONG;
+	snprintf(cname, sizeof(cname), "%s" OCSUM_SUFFIX, name);
+	if (len == OLAYOUT_NAME_LEN) {
+		cid = strtoull(name, NULL, 16);
+	}
+	else {
+		/* A legacy chunk file name leaves out bits 8 to 15 of the
+		 * chunk ID.  Only the checksum file has all of it. */
+		ret = olayout_csum_cid(cpath, &hcid);
+		if ((ret == 0) && ((hcid >> 16) == strtoull(name, NULL, 16)) &&
+				(strlen(dname) == OLAYOUT_LEGACY_DIR_LEN) &&
+				((hcid & 0xff) == strtoull(dname, NULL, 16))) {
+			cid = hcid;
+		}
+		else {
+			/* The ostor can still find the chunk in the legacy
+			 * directory, as long as it's in a legacy chunk
+			 * directory now.  A checksum file that doesn't match
+			 * would only make reads of it fail. */
+			if (strlen(dname) == OLAYOUT_LEGACY_DIR_LEN)
+				ret = olayout_migrate_keep(mig, path, dname,
+					name);
+			else
+				ret = olayout_migrate_lost(mig, path, dname,
+					name);
+			if (ret)
+				return ret;
+			if (access(cpath, F_OK))
+				return 0;
+			return olayout_migrate_lost(mig, cpath, dname, cname);
+		}
+	}
+	ret = olayout_migrate_move(mig, cid, path, dname, name, "");
+	if (ret)
+		return ret;
+	if (access(cpath, F_OK))
+		return 0;
+	return olayout_migrate_move(mig, cid, cpath, dname, cname,
+		OCSUM_SUFFIX);
+}
+
+/** Migrate a directory in a data directory, and everything under it
+ *
+ * Directories which are empty afterwards are removed.
+ *
+ * @param mig		The migration
+ * @param dpath		Path to the directory
+ * @param dname		Name of the directory
+ * @param depth		Maximum number of directory levels to go down
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int olayout_migrate_dir(struct olayout_mig *mig, const char *dpath,
+		const char *dname, int depth)
+{
+	int ret;
+	struct redfish_dirp *dp;
+	struct dirent *de;
+	char path[PATH_MAX];
+	struct stat st;
+
+	ret = do_opendir(dpath, &dp);
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	while (1) {
+		de = do_readdir(dp);
+		if (!de)
+			break;
+		if ((depth > 0) && olayout_is_dir_name(de->d_name)) {
+			if (zsnprintf(path, sizeof(path), "%s/%s", dpath,
+					de->d_name)) {
+				ret = -ENAMETOOLONG;
+				break;
+			}
+			if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+				ret = olayout_migrate_dir(mig, path,
+					de->d_name, depth - 1);
+				if (ret)
+					break;
+				/* This fails if the directory isn't empty,
+				 * which is fine. */
+				rmdir(path);
+				continue;
+			}
+		}
+		ret = olayout_migrate_file(mig, dpath, dname, de->d_name);
+		if (ret)
+			break;
+	}
+	do_closedir(dp);
+	return ret;
+}
+
+int olayout_migrate(const char *base, const struct olayout *lay,
+		struct olayout_migrate_stats *st)
+{
+	int ret;
+	char path[PATH_MAX];
+	struct olayout old;
+	struct olayout_mig mig;
+
+	memset(st, 0, sizeof(*st));
+	if (!olayout_valid(lay))
+		return -EINVAL;
+	if (zsnprintf(path, sizeof(path), "%s/%s", base,
+			OLAYOUT_MIGRATE_FILE))
+		return -ENAMETOOLONG;
+	ret = olayout_load(base, &old);
+	if (ret == -EINPROGRESS) {
+		/* Finish the migration that was interrupted, but only if
+		 * we're going to the same layout. */
+		ret = olayout_read_file(path, &old);
+		if (ret)
+			return ret;
+		if (!olayout_equal(&old, lay))
+			return -EINPROGRESS;
+	}
+	else if (ret == 0) {
+		if (olayout_equal(&old, lay))
+			return 0;
+	}
+	else if (ret != -ENOENT) {
+		return ret;
+	}
+	ret = olayout_write_file(base, OLAYOUT_MIGRATE_FILE, lay);
+	if (ret)
+		return ret;
+	mig.base = base;
+	mig.lay = lay;
+	mig.st = st;
+	ret = olayout_migrate_dir(&mig, base, "", OSTORC_MAX_DIR_LEVELS);
+	if (ret)
+		return ret;
+	ret = olayout_write_file(base, OLAYOUT_FILE, lay);
+	if (ret)
+		return ret;
+	if (unlink(path) < 0)
+		return -errno;
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_OSD_OLAYOUT_DOT_H
+#define REDFISH_OSD_OLAYOUT_DOT_H
+
+/*
+ * Chunk directory layout
+ *
+ * Chunk files are spread over a tree of directories, so that no directory gets
+ * big enough to make lookups slow, no matter how many chunks there are.  The
+ * chunk ID is hashed, and each level of the tree is named after the next few
+ * bits of the hash, in hex.  With 2 levels of 8 bits, chunk 0x1234 lives in
+ * something like
+ *
+ *	<data dir>/a7/3c/0000000000001234
+ *
+ * and its checksum file next to it.
+ *
+ * The layout of a data directory is recorded in its OLAYOUT_FILE, so that
+ * changing the configuration doesn't lose track of existing chunks.  Data
+ * directories without one, but with chunks in them, were written before
+ * there was a choice of layouts.  They use the legacy layout: one level of
+ * 256 directories, named after the low byte of the chunk ID, holding files
+ * named after bits 16 and up.  Bits 8 to 15 are left out, so different chunks
+ * can end up with the same file name.  olayout_migrate moves a data directory
+ * to a new layout.
+ */
+
+#include <stdint.h> /* for uint64_t, etc. */
+#include <unistd.h> /* for size_t */
+
+/** Name of the file in each data directory which records its layout */
+#define OLAYOUT_FILE "layout"
+
+/** Name of the file which exists while a data directory is being migrated to
+ * a new layout.  It records the new layout. */
+#define OLAYOUT_MIGRATE_FILE "layout.migrate"
+
+/** Directory where migration puts files that it can't place anywhere else */
+#define OLAYOUT_LOST_DIR "lost+found"
+
+/** Directory where migration keeps legacy chunk files whose chunk IDs can't
+ * be worked out.  They keep their legacy names, and the ostor still looks for
+ * chunks there. */
+#define OLAYOUT_LEGACY_DIR "legacy"
+
+/** Number of directory levels to use if the configuration doesn't say */
+#define OLAYOUT_DEFAULT_LEVELS 2
+
+/** Number of bits per directory level to use if the configuration doesn't
+ * say */
+#define OLAYOUT_DEFAULT_BITS 8
+
+/** How the chunk files in a data directory are arranged */
+struct olayout {
+	/** Number of directory levels above each chunk file, or 0 for the
+	 * legacy layout */
+	int levels;
+	/** Number of bits of the chunk ID hash used to pick the directory at
+	 * each level.  Unused in the legacy layout. */
+	int bits;
+};
+
+/** Statistics from olayout_migrate */
+struct olayout_migrate_stats {
+	/** Chunk and checksum files which were moved */
+	uint64_t moved;
+	/** Chunk files which were kept in OLAYOUT_LEGACY_DIR */
+	uint64_t kept;
+	/** Chunk and checksum files which were put in OLAYOUT_LOST_DIR */
+	uint64_t lost;
+};
+
+/** Get the path of the directory that holds a chunk
+ *
+ * @param lay		The layout
+ * @param base		The data directory
+ * @param cid		The chunk ID
+ * @param dpath		(out param) the directory path
+ * @param dpath_len	Length of dpath
+ */
+extern void olayout_get_dpath(const struct olayout *lay, const char *base,
+		uint64_t cid, char *dpath, size_t dpath_len);
+
+/** Get the path of a chunk file
+ *
+ * @param lay		The layout
+ * @param base		The data directory
+ * @param cid		The chunk ID
+ * @param path		(out param) the path
+ * @param path_len	Length of path
+ */
+extern void olayout_get_path(const struct olayout *lay, const char *base,
+		uint64_t cid, char *path, size_t path_len);
+
+/** Get the path a chunk file would have in OLAYOUT_LEGACY_DIR
+ *
+ * As in the legacy layout, the chunk IDs which only differ in bits 8 to 15 all
+ * get the same path.
+ *
+ * @param base		The data directory
+ * @param cid		The chunk ID
+ * @param path		(out param) the path
+ * @param path_len	Length of path
+ */
+extern void olayout_get_legacy_path(const char *base, uint64_t cid,
+		char *path, size_t path_len);
+
+/** Create the directories that a chunk file lives in, if they don't exist
+ *
+ * @param lay		The layout
+ * @param base		The data directory
+ * @param cid		The chunk ID
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+extern int olayout_mkdirs(const struct olayout *lay, const char *base,
+		uint64_t cid);
+
+/** Compare two layouts
+ *
+ * @return		1 if the layouts put every chunk in the same place; 0
+ *			otherwise
+ */
+extern int olayout_equal(const struct olayout *a, const struct olayout *b);
+
+/** Find out what layout a data directory uses
+ *
+ * @param base		The data directory
+ * @param lay		(out param) the layout
+ *
+ * @return		0 on success; -ENOENT if the data directory has no
+ *			chunks and no layout yet; -EINPROGRESS if a migration
+ *			was started and hasn't finished; -EINVAL if the layout
+ *			file is bad; another negative error code on I/O error
+ */
+extern int olayout_load(const char *base, struct olayout *lay);
+
+/** Record the layout of a data directory
+ *
+ * @param base		The data directory
+ * @param lay		The layout
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+extern int olayout_store(const char *base, const struct olayout *lay);
+
+/** Callback for olayout_walk
+ *
+ * @param priv		Private data
+ * @param path		Path to a chunk file
+ *
+ * @return		0 to keep walking; anything else to stop
+ */
+typedef int (*olayout_walk_cb_t)(void *priv, const char *path);
+
+/** Call a function for every chunk file in a data directory
+ *
+ * Checksum files are skipped.
+ *
+ * @param lay		The layout of the data directory
+ * @param base		The data directory
+ * @param cb		The callback
+ * @param priv		Private data for the callback
+ *
+ * @return		0 if we walked the whole data directory; the value
+ *			the callback returned if it stopped us; a negative
+ *			error code if the data directory couldn't be read
+ */
+extern int olayout_walk(const struct olayout *lay, const char *base,
+		olayout_walk_cb_t cb, void *priv);
+
+/** Move the chunks in a data directory to a new layout
+ *
+ * Nothing else may use the data directory while this runs.  If it is
+ * interrupted, the data directory can't be used until it is run again with
+ * the same layout.
+ *
+ * Chunks in the legacy layout are identified by the chunk ID in their checksum
+ * file.  Those without a checksum file can't be identified.  They are kept
+ * under their legacy names in OLAYOUT_LEGACY_DIR, where the ostor can still
+ * find them.  Files which would overwrite another file are put in
+ * OLAYOUT_LOST_DIR.
+ *
+ * @param base		The data directory
+ * @param lay		The new layout
+ * @param st		(out param) statistics
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+extern int olayout_migrate(const char *base, const struct olayout *lay,
+		struct olayout_migrate_stats *st);
+
+#endif
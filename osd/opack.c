@@ -0,0 +1,1562 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "osd/opack.h"
+#include "util/crc32c.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/platform/readdir.h"
+#include "util/queue.h"
+#include "util/safe_io.h"
+#include "util/string.h"
+#include "util/tree.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Index log entry: a chunk was created, with no data */
+#define OPACK_LOG_CREATE 1
+
+/** Index log entry: an extent was appended to a chunk */
+#define OPACK_LOG_APPEND 2
+
+/** Index log entry: a chunk was replaced by a single extent */
+#define OPACK_LOG_SET 3
+
+/** Index log entry: a chunk was unlinked */
+#define OPACK_LOG_DEL 4
+
+/** Prefix of segment file names.  The rest of the name is the segment number,
+ * in hex. */
+#define OPACK_SEG_PREFIX "seg-"
+
+/** Length of a segment file name */
+#define OPACK_SEG_NAME_LEN (sizeof(OPACK_SEG_PREFIX) - 1 + 8)
+
+/** Name of the file that the index log is rewritten into */
+#define OPACK_INDEX_TMP_FILE OPACK_INDEX_FILE ".tmp"
+
+/** Number of index log entries we read or write at once */
+#define OPACK_LOG_BATCH 256
+
+/** The index log is rewritten once it has this many more entries than twice
+ * the number of extents in the index */
+#define OPACK_LOG_SLACK 4096
+
+/** One of the segment files */
+struct opack_seg {
+	TAILQ_ENTRY(opack_seg) entry;
+	/** Segment number */
+	uint32_t id;
+	/** Open file descriptor */
+	int fd;
+	/** Size of the segment.  Only changed by the writer, with the pack
+	 * lock held. */
+	uint64_t size;
+	/** Number of bytes of the segment which hold live extents.  Protected
+	 * by the pack lock. */
+	uint64_t live;
+	/** Number of readers and pins using the segment.  Protected by the
+	 * pack lock. */
+	int refcnt;
+	/** Nonzero once compaction has emptied the segment.  It is deleted
+	 * when the last reference to it goes away.  Protected by the pack
+	 * lock. */
+	int dead;
+};
+
+/** Part of a packed chunk */
+struct opack_ext {
+	/** The segment which holds the extent */
+	struct opack_seg *seg;
+	/** Offset of the extent's record in the segment */
+	uint32_t off;
+	/** Length of the extent's data */
+	uint32_t len;
+};
+
+/** A packed chunk.
+ *
+ * Entries are only changed by the writer, with the pack lock held.  So the
+ * writer may look at them without taking the lock.
+ */
+struct opack_ent {
+	RB_ENTRY(opack_ent) entry;
+	/** The chunk ID */
+	uint64_t cid;
+	/** Length of the chunk */
+	uint32_t len;
+	/** Number of extents */
+	int num_ext;
+	/** Number of extents there is room for in ext */
+	int max_ext;
+	/** The extents, in the order they appear in the chunk */
+	struct opack_ext *ext;
+	/** Nonzero while the chunk is being moved out of the pack store */
+	int busy;
+	/** Nonzero if the index log referred to data which isn't there, or
+	 * the data turned out to be corrupt.  The chunk can't be read, only
+	 * unlinked. */
+	int bad;
+};
+
+/** A copy of the extents of a chunk, taken so that it can be read without
+ * holding the pack lock */
+struct opack_snap {
+	/** Length of the chunk */
+	uint32_t len;
+	/** Number of extents */
+	int num_ext;
+	/** The extents.  We hold a reference to each one's segment. */
+	struct opack_ext ext[OPACK_MAX_EXT];
+};
+
+RB_HEAD(opack_ents, opack_ent);
+TAILQ_HEAD(opack_segs, opack_seg);
+
+/** A pack store
+ *
+ * There is at most one writer at a time: the thread which holds wlock.  Only
+ * the writer changes the index, writes to the segments, or writes to the index
+ * log.  It also takes lock when it changes anything that readers look at.
+ * Readers only take lock.  If both locks are needed, wlock must be taken
+ * first.
+ */
+struct opack {
+	/** Path to the pack store directory */
+	char *dir;
+	/** Largest chunk we keep */
+	uint32_t max_chunk;
+	/** Size at which we start a new segment */
+	uint64_t seg_sz;
+	/** Lock which protects the index, the list of segments, and the
+	 * statistics */
+	pthread_mutex_t lock;
+	/** Broadcast when a chunk stops being busy */
+	pthread_cond_t cond;
+	/** Lock held by the writer */
+	pthread_mutex_t wlock;
+	/** The index, by chunk ID */
+	struct opack_ents ents;
+	/** The segments, oldest first.  The last one is the one we are
+	 * appending to. */
+	struct opack_segs segs;
+	/** Number of the next segment to create.  Only used by the writer. */
+	uint32_t next_seg;
+	/** Open file descriptor of the index log.  Only used by the
+	 * writer. */
+	int log_fd;
+	/** Size of the index log.  Only used by the writer. */
+	uint64_t log_size;
+	/** Number of extents in the index */
+	uint64_t num_ext;
+	/** Number of chunks in the index */
+	uint64_t num_chunk;
+	/** Total length of the chunks in the index */
+	uint64_t chunk_bytes;
+	/** Number of segments that compaction has deleted */
+	uint64_t compacted;
+};
+
+static int compare_opack_ent(struct opack_ent *a, struct opack_ent *b)
+{
+	if (a->cid < b->cid)
+		return -1;
+	if (a->cid > b->cid)
+		return 1;
+	return 0;
+}
+
+RB_GENERATE(opack_ents, opack_ent, entry, compare_opack_ent);
+
+/************************** segments *******************************/
+static int opack_seg_path(const struct opack *pk, uint32_t id,
+		char *path, size_t path_len)
+{
+	return zsnprintf(path, path_len, "%s/" OPACK_SEG_PREFIX "%08x",
+		pk->dir, id);
+}
+
+/** Open a segment file
+ *
+ * @param pk		The pack store
+ * @param id		The segment number
+ * @param create	If nonzero, create the segment.  It must not already
+ *			exist.
+ *
+ * @return		The segment, or an error pointer
+ */
+static struct opack_seg *opack_seg_open(struct opack *pk, uint32_t id,
+		int create)
+{
+	int ret, fd, flags;
+	char path[PATH_MAX];
+	struct opack_seg *seg;
+	struct stat st;
+
+	if (opack_seg_path(pk, id, path, sizeof(path)))
+		return ERR_PTR(ENAMETOOLONG);
+	seg = calloc(1, sizeof(struct opack_seg));
+	if (!seg)
+		return ERR_PTR(ENOMEM);
+	flags = O_RDWR | O_CLOEXEC | O_NOATIME;
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+	RETRY_ON_EINTR(fd, open(path, flags, 0660));
+	if (fd < 0) {
+		ret = errno;
+		goto error_free_seg;
+	}
+	if (fstat(fd, &st)) {
+		ret = errno;
+		goto error_close;
+	}
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = st.st_size;
+	return seg;
+
+error_close:
+	safe_close(fd);
+	if (create)
+		unlink(path);
+error_free_seg:
+	free(seg);
+	return ERR_PTR(ret);
+}
+
+/** Delete a segment which has been taken off the list
+ *
+ * @param pk		The pack store
+ * @param seg		The segment
+ */
+static void opack_seg_destroy(struct opack *pk, struct opack_seg *seg)
+{
+	char path[PATH_MAX];
+
+	safe_close(seg->fd);
+	if (opack_seg_path(pk, seg->id, path, sizeof(path)) == 0)
+		unlink(path);
+	free(seg);
+}
+
+/** Drop a reference to a segment
+ *
+ * Should be called with the pack lock released.
+ *
+ * @param pk		The pack store
+ * @param seg		The segment
+ */
+static void opack_seg_put(struct opack *pk, struct opack_seg *seg)
+{
+	int destroy;
+
+	pthread_mutex_lock(&pk->lock);
+	seg->refcnt--;
+	destroy = (seg->dead && (seg->refcnt == 0));
+	if (destroy)
+		TAILQ_REMOVE(&pk->segs, seg, entry);
+	pthread_mutex_unlock(&pk->lock);
+	if (destroy)
+		opack_seg_destroy(pk, seg);
+}
+
+/** Append a record to the active segment, starting a new one if it is full
+ *
+ * Should be called by the writer, with the pack lock released.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param coff		Offset of the data in the chunk
+ * @param data		The data
+ * @param dlen		Length of data
+ * @param seg		(out param) the segment the record was written to
+ * @param off		(out param) the offset of the record in the segment
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int opack_write_rec(struct opack *pk, uint64_t cid, uint32_t coff,
+		const char *data, uint32_t dlen, struct opack_seg **seg,
+		uint32_t *off)
+{
+	int ret;
+	char *buf;
+	uint32_t rlen = OPACK_REC_HDR_LEN + dlen;
+	struct opack_seg *s;
+
+	s = TAILQ_LAST(&pk->segs, opack_segs);
+	if ((!s) || ((s->size > 0) && (s->size + rlen > pk->seg_sz))) {
+		/* Make sure the full segment is on disk before compaction
+		 * can delete the records that it replaces. */
+		if (s && fdatasync(s->fd))
+			return -errno;
+		s = opack_seg_open(pk, pk->next_seg, 1);
+		if (IS_ERR(s))
+			return FORCE_NEGATIVE(PTR_ERR(s));
+		pk->next_seg++;
+		pthread_mutex_lock(&pk->lock);
+		TAILQ_INSERT_TAIL(&pk->segs, s, entry);
+		pthread_mutex_unlock(&pk->lock);
+	}
+	buf = malloc(rlen);
+	if (!buf)
+		return -ENOMEM;
+	pack_to_be32(buf, OPACK_REC_MAGIC);
+	pack_to_be32(buf + 4, crc32c(0, data, dlen));
+	pack_to_be64(buf + 8, cid);
+	pack_to_be32(buf + 16, coff);
+	pack_to_be32(buf + 20, dlen);
+	memcpy(buf + OPACK_REC_HDR_LEN, data, dlen);
+	ret = safe_pwrite(s->fd, buf, rlen, s->size);
+	free(buf);
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	*seg = s;
+	*off = s->size;
+	pthread_mutex_lock(&pk->lock);
+	s->size += rlen;
+	pthread_mutex_unlock(&pk->lock);
+	return 0;
+}
+
+/** Read an extent of a chunk, and check it against its record header
+ *
+ * @param ext		The extent
+ * @param cid		The chunk ID
+ * @param coff		Offset of the extent in the chunk
+ * @param data		(out param) buffer to read the data into.  Must be
+ *			ext->len bytes long.
+ *
+ * @return		0 on success; -EBADMSG if the extent is corrupt; another
+ *			negative error code on I/O error
+ */
+static int opack_read_ext(const struct opack_ext *ext, uint64_t cid,
+		uint32_t coff, char *data)
+{
+	int ret;
+	char hdr[OPACK_REC_HDR_LEN];
+
+	ret = safe_pread_exact(ext->seg->fd, hdr, OPACK_REC_HDR_LEN, ext->off);
+	if (ret == 0) {
+		ret = safe_pread_exact(ext->seg->fd, data, ext->len,
+			ext->off + OPACK_REC_HDR_LEN);
+	}
+	if (ret == -EDOM)
+		return -EBADMSG;
+	else if (ret)
+		return ret;
+	if ((unpack_from_be32(hdr) != OPACK_REC_MAGIC) ||
+			(unpack_from_be64(hdr + 8) != cid) ||
+			(unpack_from_be32(hdr + 16) != coff) ||
+			(unpack_from_be32(hdr + 20) != ext->len))
+		return -EBADMSG;
+	if (unpack_from_be32(hdr + 4) != crc32c(0, data, ext->len))
+		return -EBADMSG;
+	return 0;
+}
+
+/************************** index *******************************/
+static struct opack_ent *opack_find(struct opack *pk, uint64_t cid)
+{
+	struct opack_ent exemplar;
+
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.cid = cid;
+	return RB_FIND(opack_ents, &pk->ents, &exemplar);
+}
+
+/** Add a chunk to the index
+ *
+ * Should be called with the pack lock held.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ *
+ * @return		The new, empty entry, or NULL on OOM
+ */
+static struct opack_ent *opack_ent_alloc(struct opack *pk, uint64_t cid)
+{
+	struct opack_ent *ent;
+
+	ent = calloc(1, sizeof(struct opack_ent));
+	if (!ent)
+		return NULL;
+	ent->cid = cid;
+	RB_INSERT(opack_ents, &pk->ents, ent);
+	pk->num_chunk++;
+	return ent;
+}
+
+/** Make sure that a chunk has room for another extent
+ *
+ * @param ent		The chunk
+ *
+ * @return		0 on success; -ENOMEM on OOM
+ */
+static int opack_ent_reserve(struct opack_ent *ent)
+{
+	int max_ext;
+	struct opack_ext *ext;
+
+	if (ent->num_ext < ent->max_ext)
+		return 0;
+	max_ext = ent->max_ext ? (ent->max_ext * 2) : 1;
+	if (max_ext > OPACK_MAX_EXT)
+		max_ext = OPACK_MAX_EXT;
+	ext = realloc(ent->ext, max_ext * sizeof(struct opack_ext));
+	if (!ext)
+		return -ENOMEM;
+	ent->ext = ext;
+	ent->max_ext = max_ext;
+	return 0;
+}
+
+/** Add an extent to the end of a chunk
+ *
+ * Should be called with the pack lock held, after opack_ent_reserve.
+ *
+ * @param pk		The pack store
+ * @param ent		The chunk
+ * @param seg		The segment that holds the extent
+ * @param off		Offset of the extent's record in the segment
+ * @param len		Length of the extent's data
+ */
+static void opack_ent_add_ext(struct opack *pk, struct opack_ent *ent,
+		struct opack_seg *seg, uint32_t off, uint32_t len)
+{
+	struct opack_ext *ext = &ent->ext[ent->num_ext++];
+
+	ext->seg = seg;
+	ext->off = off;
+	ext->len = len;
+	seg->live += OPACK_REC_HDR_LEN + len;
+	ent->len += len;
+	pk->chunk_bytes += len;
+	pk->num_ext++;
+}
+
+/** Forget about all of a chunk's extents
+ *
+ * Should be called with the pack lock held.
+ *
+ * @param pk		The pack store
+ * @param ent		The chunk
+ */
+static void opack_ent_clear(struct opack *pk, struct opack_ent *ent)
+{
+	int i;
+	struct opack_ext *ext;
+
+	for (i = 0; i < ent->num_ext; ++i) {
+		ext = &ent->ext[i];
+		ext->seg->live -= OPACK_REC_HDR_LEN + ext->len;
+	}
+	pk->num_ext -= ent->num_ext;
+	pk->chunk_bytes -= ent->len;
+	ent->num_ext = 0;
+	ent->len = 0;
+}
+
+/** Remove a chunk from the index
+ *
+ * Should be called with the pack lock held.
+ *
+ * @param pk		The pack store
+ * @param ent		The chunk
+ */
+static void opack_ent_free(struct opack *pk, struct opack_ent *ent)
+{
+	opack_ent_clear(pk, ent);
+	RB_REMOVE(opack_ents, &pk->ents, ent);
+	pk->num_chunk--;
+	free(ent->ext);
+	free(ent);
+}
+
+/** Become the writer, and find a chunk which isn't busy
+ *
+ * If the chunk is busy, we wait for it to stop being busy.
+ *
+ * Should be called with no locks held.  Returns with the writer lock and the
+ * pack lock held.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ *
+ * @return		The chunk, or NULL if it isn't in the pack store
+ */
+static struct opack_ent *opack_lock_ent(struct opack *pk, uint64_t cid)
+{
+	struct opack_ent *ent;
+
+	while (1) {
+		pthread_mutex_lock(&pk->wlock);
+		pthread_mutex_lock(&pk->lock);
+		ent = opack_find(pk, cid);
+		if ((!ent) || (!ent->busy))
+			return ent;
+		pthread_mutex_unlock(&pk->wlock);
+		/* The chunk may be gone by the time we wake up, so look it
+		 * up again each time. */
+		while (ent && ent->busy) {
+			pthread_cond_wait(&pk->cond, &pk->lock);
+			ent = opack_find(pk, cid);
+		}
+		pthread_mutex_unlock(&pk->lock);
+	}
+}
+
+static void opack_unlock(struct opack *pk)
+{
+	pthread_mutex_unlock(&pk->lock);
+	pthread_mutex_unlock(&pk->wlock);
+}
+
+/** Take a copy of a chunk's extents, so that we can read them
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param snap		(out param) the copy.  Release it with
+ *			opack_snap_put.
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't in the pack
+ *			store; -EBADMSG if it can't be read
+ */
+static int opack_snap_get(struct opack *pk, uint64_t cid,
+		struct opack_snap *snap)
+{
+	int i;
+	struct opack_ent *ent;
+
+	pthread_mutex_lock(&pk->lock);
+	ent = opack_find(pk, cid);
+	if (!ent) {
+		pthread_mutex_unlock(&pk->lock);
+		return -ENOENT;
+	}
+	if (ent->bad) {
+		pthread_mutex_unlock(&pk->lock);
+		return -EBADMSG;
+	}
+	snap->len = ent->len;
+	snap->num_ext = ent->num_ext;
+	for (i = 0; i < ent->num_ext; ++i) {
+		snap->ext[i] = ent->ext[i];
+		snap->ext[i].seg->refcnt++;
+	}
+	pthread_mutex_unlock(&pk->lock);
+	return 0;
+}
+
+static void opack_snap_put(struct opack *pk, struct opack_snap *snap)
+{
+	int i;
+
+	for (i = 0; i < snap->num_ext; ++i)
+		opack_seg_put(pk, snap->ext[i].seg);
+}
+
+/** Read the whole of a chunk
+ *
+ * Should be called by the writer, with the pack lock released.
+ *
+ * @param ent		The chunk
+ * @param data		(out param) buffer to read into.  Must be ent->len
+ *			bytes long.
+ *
+ * @return		0 on success; -EBADMSG if the chunk is corrupt; another
+ *			negative error code on I/O error
+ */
+static int opack_ent_read(const struct opack_ent *ent, char *data)
+{
+	int i, ret;
+	uint32_t coff = 0;
+
+	for (i = 0; i < ent->num_ext; ++i) {
+		ret = opack_read_ext(&ent->ext[i], ent->cid, coff, data + coff);
+		if (ret)
+			return ret;
+		coff += ent->ext[i].len;
+	}
+	return 0;
+}
+
+/************************** index log *******************************/
+/** Append an entry to the index log
+ *
+ * If the write fails, the log is cut back to where it was, so that replaying
+ * it doesn't stop at a torn entry in the middle.
+ *
+ * Should be called by the writer.
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int opack_log(struct opack *pk, uint32_t type, uint64_t cid,
+		const struct opack_seg *seg, uint32_t off, uint32_t len,
+		uint32_t coff)
+{
+	int ret;
+	char rec[OPACK_LOG_REC_LEN];
+
+	memset(rec, 0, sizeof(rec));
+	pack_to_be32(rec + 4, type);
+	pack_to_be64(rec + 8, cid);
+	pack_to_be32(rec + 16, seg ? seg->id : 0);
+	pack_to_be32(rec + 20, off);
+	pack_to_be32(rec + 24, len);
+	pack_to_be32(rec + 28, coff);
+	pack_to_be32(rec, crc32c(0, rec + 4, OPACK_LOG_REC_LEN - 4));
+	ret = safe_write(pk->log_fd, rec, OPACK_LOG_REC_LEN);
+	if (ret) {
+		if (ftruncate(pk->log_fd, pk->log_size))
+			return -EIO;
+		return FORCE_NEGATIVE(ret);
+	}
+	pk->log_size += OPACK_LOG_REC_LEN;
+	return 0;
+}
+
+/** Find a segment by number in a sorted array
+ *
+ * @return		The segment, or NULL if there is no such segment
+ */
+static struct opack_seg *opack_seg_find(struct opack_seg **segs,
+		int num_seg, uint32_t id)
+{
+	int lo = 0, hi = num_seg - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (segs[mid]->id == id)
+			return segs[mid];
+		if (segs[mid]->id < id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+/** Apply an index log entry while replaying the log
+ *
+ * Entries which refer to data that isn't there mark the chunk as bad, so
+ * that the scrubber reports it.
+ *
+ * @param pk		The pack store
+ * @param segs		The segments, sorted by number
+ * @param num_seg	Number of segments
+ * @param rec		The entry
+ *
+ * @return		0 on success; -ENOMEM on OOM; -EINVAL if the entry
+ *			type is unknown
+ */
+static int opack_replay_rec(struct opack *pk, struct opack_seg **segs,
+		int num_seg, const char *rec)
+{
+	uint32_t type, off, len, coff;
+	uint64_t cid;
+	struct opack_ent *ent;
+	struct opack_seg *seg;
+
+	type = unpack_from_be32(rec + 4);
+	cid = unpack_from_be64(rec + 8);
+	off = unpack_from_be32(rec + 20);
+	len = unpack_from_be32(rec + 24);
+	coff = unpack_from_be32(rec + 28);
+	ent = opack_find(pk, cid);
+	if (type == OPACK_LOG_DEL) {
+		if (ent)
+			opack_ent_free(pk, ent);
+		return 0;
+	}
+	if ((type != OPACK_LOG_CREATE) && (type != OPACK_LOG_APPEND) &&
+			(type != OPACK_LOG_SET))
+		return -EINVAL;
+	if (!ent) {
+		ent = opack_ent_alloc(pk, cid);
+		if (!ent)
+			return -ENOMEM;
+	}
+	if (type != OPACK_LOG_APPEND) {
+		opack_ent_clear(pk, ent);
+		ent->bad = 0;
+		if (type == OPACK_LOG_CREATE)
+			return 0;
+	}
+	if (ent->bad)
+		return 0;
+	seg = opack_seg_find(segs, num_seg, unpack_from_be32(rec + 16));
+	if ((!seg) || (coff != ent->len) || (ent->num_ext >= OPACK_MAX_EXT) ||
+			(off + (uint64_t)OPACK_REC_HDR_LEN + len > seg->size)) {
+		opack_ent_clear(pk, ent);
+		ent->bad = 1;
+		return 0;
+	}
+	if (opack_ent_reserve(ent))
+		return -ENOMEM;
+	opack_ent_add_ext(pk, ent, seg, off, len);
+	return 0;
+}
+
+/** Replay the index log
+ *
+ * A torn or corrupt entry ends the log.  It, and anything after it, is cut
+ * off.
+ *
+ * @param pk		The pack store
+ * @param segs		The segments, sorted by number
+ * @param num_seg	Number of segments
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int opack_replay(struct opack *pk, struct opack_seg **segs,
+		int num_seg)
+{
+	int i, n, ret;
+	ssize_t res;
+	char *buf, *rec;
+	uint64_t off = 0;
+
+	buf = malloc(OPACK_LOG_BATCH * OPACK_LOG_REC_LEN);
+	if (!buf)
+		return -ENOMEM;
+	while (1) {
+		res = safe_pread(pk->log_fd, buf,
+			OPACK_LOG_BATCH * OPACK_LOG_REC_LEN, off);
+		if (res < 0) {
+			ret = res;
+			goto done;
+		}
+		n = res / OPACK_LOG_REC_LEN;
+		for (i = 0; i < n; ++i) {
+			rec = buf + (i * OPACK_LOG_REC_LEN);
+			if (unpack_from_be32(rec) != crc32c(0, rec + 4,
+					OPACK_LOG_REC_LEN - 4))
+				break;
+			ret = opack_replay_rec(pk, segs, num_seg, rec);
+			if (ret == -EINVAL)
+				break;
+			else if (ret)
+				goto done;
+			off += OPACK_LOG_REC_LEN;
+		}
+		if ((i < n) || (res < OPACK_LOG_BATCH * OPACK_LOG_REC_LEN))
+			break;
+	}
+	/* Cut off whatever is left over from a crash */
+	ret = 0;
+	if (ftruncate(pk->log_fd, off))
+		ret = -errno;
+	pk->log_size = off;
+done:
+	free(buf);
+	return ret;
+}
+
+/** Rewrite the index log, if it has got too long
+ *
+ * Should be called by the writer, with the pack lock released.
+ *
+ * @param pk		The pack store
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int opack_log_rewrite(struct opack *pk)
+{
+	int i, n, ret, fd;
+	char path[PATH_MAX], tpath[PATH_MAX], *buf, *rec;
+	struct opack_ent *ent;
+	struct opack_ext *ext;
+	uint32_t coff;
+
+	if (pk->log_size / OPACK_LOG_REC_LEN <=
+			(2 * pk->num_ext) + OPACK_LOG_SLACK)
+		return 0;
+	if (zsnprintf(path, sizeof(path), "%s/%s", pk->dir, OPACK_INDEX_FILE))
+		return -ENAMETOOLONG;
+	if (zsnprintf(tpath, sizeof(tpath), "%s/%s", pk->dir,
+			OPACK_INDEX_TMP_FILE))
+		return -ENAMETOOLONG;
+	buf = malloc(OPACK_LOG_BATCH * OPACK_LOG_REC_LEN);
+	if (!buf)
+		return -ENOMEM;
+	RETRY_ON_EINTR(fd, open(tpath, O_CREAT | O_TRUNC | O_WRONLY |
+			O_CLOEXEC, 0660));
+	if (fd < 0) {
+		ret = -errno;
+		goto error_free_buf;
+	}
+	/* Only the writer changes the index, so we can walk it without the
+	 * pack lock.  Bad chunks are left out; they look missing from now
+	 * on, rather than corrupt. */
+	n = 0;
+	RB_FOREACH(ent, opack_ents, &pk->ents) {
+		if (ent->bad)
+			continue;
+		coff = 0;
+		for (i = 0; (i < ent->num_ext) || (i == 0); ++i) {
+			ext = (i < ent->num_ext) ? &ent->ext[i] : NULL;
+			rec = buf + (n * OPACK_LOG_REC_LEN);
+			memset(rec, 0, OPACK_LOG_REC_LEN);
+			if (!ext)
+				pack_to_be32(rec + 4, OPACK_LOG_CREATE);
+			else if (i == 0)
+				pack_to_be32(rec + 4, OPACK_LOG_SET);
+			else
+				pack_to_be32(rec + 4, OPACK_LOG_APPEND);
+			pack_to_be64(rec + 8, ent->cid);
+			if (ext) {
+				pack_to_be32(rec + 16, ext->seg->id);
+				pack_to_be32(rec + 20, ext->off);
+				pack_to_be32(rec + 24, ext->len);
+				pack_to_be32(rec + 28, coff);
+				coff += ext->len;
+			}
+			pack_to_be32(rec, crc32c(0, rec + 4,
+				OPACK_LOG_REC_LEN - 4));
+			if (++n < OPACK_LOG_BATCH)
+				continue;
+			ret = safe_write(fd, buf, n * OPACK_LOG_REC_LEN);
+			if (ret)
+				goto error_close;
+			n = 0;
+		}
+	}
+	ret = safe_write(fd, buf, n * OPACK_LOG_REC_LEN);
+	if (ret)
+		goto error_close;
+	if (fsync(fd)) {
+		ret = -errno;
+		goto error_close;
+	}
+	ret = safe_close(fd);
+	if (ret)
+		goto error_unlink;
+	if (rename(tpath, path)) {
+		ret = -errno;
+		goto error_unlink;
+	}
+	/* From here on, the new log is the one that counts.  If we can't
+	 * open it, we can't carry on. */
+	RETRY_ON_EINTR(fd, open(path, O_WRONLY | O_APPEND | O_CLOEXEC));
+	if (fd < 0) {
+		ret = -errno;
+		goto error_free_buf;
+	}
+	safe_close(pk->log_fd);
+	pk->log_fd = fd;
+	pk->log_size = 0;
+	for (ent = RB_MIN(opack_ents, &pk->ents); ent;
+			ent = RB_NEXT(opack_ents, &pk->ents, ent)) {
+		if (ent->bad)
+			continue;
+		pk->log_size += OPACK_LOG_REC_LEN *
+			(ent->num_ext ? ent->num_ext : 1);
+	}
+	free(buf);
+	return 0;
+
+error_close:
+	safe_close(fd);
+error_unlink:
+	unlink(tpath);
+error_free_buf:
+	free(buf);
+	return FORCE_NEGATIVE(ret);
+}
+
+/************************** opack *******************************/
+static int compare_opack_seg_id(const void *a, const void *b)
+{
+	const struct opack_seg *sa = *(struct opack_seg * const *)a;
+	const struct opack_seg *sb = *(struct opack_seg * const *)b;
+
+	if (sa->id < sb->id)
+		return -1;
+	if (sa->id > sb->id)
+		return 1;
+	return 0;
+}
+
+/** Open all of the segment files in the pack store directory
+ *
+ * @param pk		The pack store
+ * @param segs		(out param) a malloc'ed array of the segments, sorted
+ *			by number.  The segments are also put on pk->segs.
+ * @param num_seg	(out param) number of segments
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int opack_load_segs(struct opack *pk, struct opack_seg ***segs,
+		int *num_seg)
+{
+	int i, ret, n = 0, max = 0;
+	char *end;
+	unsigned long id;
+	struct redfish_dirp *dp;
+	struct dirent *de;
+	struct opack_seg *seg, **s = NULL, **ns;
+
+	ret = do_opendir(pk->dir, &dp);
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	while ((de = do_readdir(dp))) {
+		if ((strlen(de->d_name) != OPACK_SEG_NAME_LEN) ||
+				strncmp(de->d_name, OPACK_SEG_PREFIX,
+					sizeof(OPACK_SEG_PREFIX) - 1))
+			continue;
+		id = strtoul(de->d_name + sizeof(OPACK_SEG_PREFIX) - 1,
+			&end, 16);
+		if (*end)
+			continue;
+		if (n == max) {
+			max = max ? (max * 2) : 16;
+			ns = realloc(s, max * sizeof(struct opack_seg *));
+			if (!ns) {
+				ret = -ENOMEM;
+				goto error;
+			}
+			s = ns;
+		}
+		seg = opack_seg_open(pk, id, 0);
+		if (IS_ERR(seg)) {
+			ret = FORCE_NEGATIVE(PTR_ERR(seg));
+			goto error;
+		}
+		s[n++] = seg;
+	}
+	do_closedir(dp);
+	qsort(s, n, sizeof(struct opack_seg *), compare_opack_seg_id);
+	for (i = 0; i < n; ++i)
+		TAILQ_INSERT_TAIL(&pk->segs, s[i], entry);
+	pk->next_seg = n ? (s[n - 1]->id + 1) : 0;
+	*segs = s;
+	*num_seg = n;
+	return 0;
+
+error:
+	do_closedir(dp);
+	for (i = 0; i < n; ++i) {
+		safe_close(s[i]->fd);
+		free(s[i]);
+	}
+	free(s);
+	return ret;
+}
+
+struct opack *opack_open(const char *base, uint32_t max_chunk,
+		uint64_t seg_sz)
+{
+	int ret, num_seg = 0;
+	char path[PATH_MAX];
+	struct opack *pk;
+	struct opack_seg **segs = NULL;
+
+	if ((seg_sz > OPACK_MAX_SEG_SZ) ||
+			(OPACK_REC_HDR_LEN + (uint64_t)max_chunk > seg_sz))
+		return ERR_PTR(EINVAL);
+	pk = calloc(1, sizeof(struct opack));
+	if (!pk)
+		return ERR_PTR(ENOMEM);
+	pk->max_chunk = max_chunk;
+	pk->seg_sz = seg_sz;
+	pk->log_fd = -1;
+	RB_INIT(&pk->ents);
+	TAILQ_INIT(&pk->segs);
+	if (zsnprintf(path, sizeof(path), "%s/%s", base, OPACK_DIR)) {
+		ret = ENAMETOOLONG;
+		goto error_free_pk;
+	}
+	pk->dir = strdup(path);
+	if (!pk->dir) {
+		ret = ENOMEM;
+		goto error_free_pk;
+	}
+	if ((mkdir(pk->dir, 0770) < 0) && (errno != EEXIST)) {
+		ret = errno;
+		goto error_free_dir;
+	}
+	ret = pthread_mutex_init(&pk->lock, NULL);
+	if (ret)
+		goto error_free_dir;
+	ret = pthread_mutex_init(&pk->wlock, NULL);
+	if (ret)
+		goto error_free_lock;
+	ret = pthread_cond_init(&pk->cond, NULL);
+	if (ret)
+		goto error_free_wlock;
+	ret = opack_load_segs(pk, &segs, &num_seg);
+	if (ret)
+		goto error_free_cond;
+	if (zsnprintf(path, sizeof(path), "%s/%s", pk->dir,
+			OPACK_INDEX_FILE)) {
+		ret = ENAMETOOLONG;
+		goto error_free_segs;
+	}
+	RETRY_ON_EINTR(pk->log_fd, open(path, O_CREAT | O_RDWR | O_APPEND |
+			O_CLOEXEC, 0660));
+	if (pk->log_fd < 0) {
+		ret = errno;
+		goto error_free_segs;
+	}
+	ret = opack_replay(pk, segs, num_seg);
+	if (ret)
+		goto error_free_segs;
+	free(segs);
+	return pk;
+
+error_free_segs:
+	free(segs);
+	opack_close(pk);
+	return ERR_PTR(FORCE_POSITIVE(ret));
+error_free_cond:
+	pthread_cond_destroy(&pk->cond);
+error_free_wlock:
+	pthread_mutex_destroy(&pk->wlock);
+error_free_lock:
+	pthread_mutex_destroy(&pk->lock);
+error_free_dir:
+	free(pk->dir);
+error_free_pk:
+	free(pk);
+	return ERR_PTR(FORCE_POSITIVE(ret));
+}
+
+void opack_close(struct opack *pk)
+{
+	struct opack_ent *ent, *ent_tmp;
+	struct opack_seg *seg, *seg_tmp;
+
+	RB_FOREACH_SAFE(ent, opack_ents, &pk->ents, ent_tmp) {
+		RB_REMOVE(opack_ents, &pk->ents, ent);
+		free(ent->ext);
+		free(ent);
+	}
+	TAILQ_FOREACH_SAFE(seg, &pk->segs, entry, seg_tmp) {
+		safe_close(seg->fd);
+		free(seg);
+	}
+	if (pk->log_fd >= 0)
+		safe_close(pk->log_fd);
+	pthread_cond_destroy(&pk->cond);
+	pthread_mutex_destroy(&pk->wlock);
+	pthread_mutex_destroy(&pk->lock);
+	free(pk->dir);
+	free(pk);
+}
+
+int opack_lookup(struct opack *pk, uint64_t cid)
+{
+	int ret;
+
+	pthread_mutex_lock(&pk->lock);
+	ret = (opack_find(pk, cid) != NULL);
+	pthread_mutex_unlock(&pk->lock);
+	return ret;
+}
+
+/** Rewrite a chunk as a single record, optionally appending to it
+ *
+ * Should be called by the writer, with the pack lock released.
+ *
+ * @param pk		The pack store
+ * @param ent		The chunk
+ * @param data		Data to append, or NULL
+ * @param dlen		Length of data
+ *
+ * @return		0 on success; -EBADMSG if the chunk is corrupt; another
+ *			negative error code otherwise
+ */
+static int opack_rewrite(struct opack *pk, struct opack_ent *ent,
+		const char *data, uint32_t dlen)
+{
+	int ret;
+	char *buf;
+	uint32_t off, len = ent->len + dlen;
+	struct opack_seg *seg;
+
+	buf = malloc(len ? len : 1);
+	if (!buf)
+		return -ENOMEM;
+	ret = opack_ent_read(ent, buf);
+	if (ret)
+		goto done;
+	if (dlen > 0)
+		memcpy(buf + ent->len, data, dlen);
+	ret = opack_write_rec(pk, ent->cid, 0, buf, len, &seg, &off);
+	if (ret)
+		goto done;
+	ret = opack_log(pk, OPACK_LOG_SET, ent->cid, seg, off, len, 0);
+	if (ret)
+		goto done;
+	pthread_mutex_lock(&pk->lock);
+	opack_ent_clear(pk, ent);
+	opack_ent_add_ext(pk, ent, seg, off, len);
+	pthread_mutex_unlock(&pk->lock);
+done:
+	free(buf);
+	return ret;
+}
+
+int opack_append(struct opack *pk, uint64_t cid, const char *data,
+		uint32_t dlen, int create)
+{
+	int ret, created = 0;
+	uint32_t off;
+	struct opack_ent *ent;
+	struct opack_seg *seg;
+
+	ent = opack_lock_ent(pk, cid);
+	if (!ent) {
+		if (!create) {
+			ret = -ENOENT;
+			goto done;
+		}
+		if (dlen > pk->max_chunk) {
+			ret = -EFBIG;
+			goto done;
+		}
+		ent = opack_ent_alloc(pk, cid);
+		if (!ent) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		created = 1;
+	}
+	if (ent->bad) {
+		ret = -EBADMSG;
+		goto done;
+	}
+	if ((uint64_t)ent->len + dlen > pk->max_chunk) {
+		ret = -EFBIG;
+		goto done;
+	}
+	if ((dlen == 0) && (!created)) {
+		ret = 0;
+		goto done;
+	}
+	ret = opack_ent_reserve(ent);
+	if (ret)
+		goto done;
+	pthread_mutex_unlock(&pk->lock);
+	if (dlen == 0) {
+		ret = opack_log(pk, OPACK_LOG_CREATE, cid, NULL, 0, 0, 0);
+	}
+	else if (ent->num_ext == OPACK_MAX_EXT) {
+		ret = opack_rewrite(pk, ent, data, dlen);
+	}
+	else {
+		ret = opack_write_rec(pk, cid, ent->len, data, dlen,
+			&seg, &off);
+		if (ret == 0) {
+			ret = opack_log(pk, OPACK_LOG_APPEND, cid, seg, off,
+				dlen, ent->len);
+		}
+		if (ret == 0) {
+			pthread_mutex_lock(&pk->lock);
+			opack_ent_add_ext(pk, ent, seg, off, dlen);
+			pthread_mutex_unlock(&pk->lock);
+		}
+	}
+	pthread_mutex_lock(&pk->lock);
+done:
+	if (ret && created)
+		opack_ent_free(pk, ent);
+	opack_unlock(pk);
+	return ret;
+}
+
+int32_t opack_read(struct opack *pk, uint64_t cid, uint64_t off,
+		char *data, int32_t dlen)
+{
+	int i, ret;
+	uint32_t coff, start, end;
+	char *buf = NULL;
+	struct opack_snap snap;
+	struct opack_ext *ext;
+
+	ret = opack_snap_get(pk, cid, &snap);
+	if (ret)
+		return ret;
+	if (off >= snap.len) {
+		ret = 0;
+		goto done;
+	}
+	if ((uint64_t)dlen > snap.len - off)
+		dlen = snap.len - off;
+	/* Each extent has to be read whole to check its CRC */
+	coff = 0;
+	for (i = 0; i < snap.num_ext; ++i, coff += ext->len) {
+		ext = &snap.ext[i];
+		if ((coff + ext->len <= off) || (coff >= off + dlen))
+			continue;
+		if (!buf) {
+			buf = malloc(snap.len);
+			if (!buf) {
+				ret = -ENOMEM;
+				goto done;
+			}
+		}
+		ret = opack_read_ext(ext, cid, coff, buf);
+		if (ret)
+			goto done;
+		start = (off > coff) ? (off - coff) : 0;
+		end = ext->len;
+		if (coff + end > off + dlen)
+			end = off + dlen - coff;
+		memcpy(data + (coff + start - off), buf + start, end - start);
+	}
+	ret = dlen;
+done:
+	free(buf);
+	opack_snap_put(pk, &snap);
+	return ret;
+}
+
+int opack_verify(struct opack *pk, uint64_t cid, uint32_t *len)
+{
+	int i, ret;
+	uint32_t coff;
+	char *buf;
+	struct opack_snap snap;
+
+	ret = opack_snap_get(pk, cid, &snap);
+	if (ret)
+		return ret;
+	*len = snap.len;
+	buf = malloc(snap.len ? snap.len : 1);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	coff = 0;
+	for (i = 0; i < snap.num_ext; ++i) {
+		ret = opack_read_ext(&snap.ext[i], cid, coff, buf + coff);
+		if (ret)
+			break;
+		coff += snap.ext[i].len;
+	}
+	free(buf);
+done:
+	opack_snap_put(pk, &snap);
+	return ret;
+}
+
+int opack_unlink(struct opack *pk, uint64_t cid)
+{
+	int ret;
+	struct opack_ent *ent;
+
+	ent = opack_lock_ent(pk, cid);
+	if (!ent) {
+		opack_unlock(pk);
+		return -ENOENT;
+	}
+	pthread_mutex_unlock(&pk->lock);
+	ret = opack_log(pk, OPACK_LOG_DEL, cid, NULL, 0, 0, 0);
+	pthread_mutex_lock(&pk->lock);
+	if (ret == 0)
+		opack_ent_free(pk, ent);
+	opack_unlock(pk);
+	return ret;
+}
+
+int opack_evict_start(struct opack *pk, uint64_t cid, char **data,
+		uint32_t *len)
+{
+	int ret;
+	char *buf = NULL;
+	struct opack_ent *ent;
+
+	ent = opack_lock_ent(pk, cid);
+	if (!ent) {
+		ret = -ENOENT;
+		goto done;
+	}
+	if (ent->bad) {
+		ret = -EBADMSG;
+		goto done;
+	}
+	ent->busy = 1;
+	pthread_mutex_unlock(&pk->lock);
+	ret = 0;
+	if (ent->len > 0) {
+		buf = malloc(ent->len);
+		if (!buf)
+			ret = -ENOMEM;
+		else
+			ret = opack_ent_read(ent, buf);
+	}
+	pthread_mutex_lock(&pk->lock);
+	if (ret) {
+		free(buf);
+		ent->busy = 0;
+		pthread_cond_broadcast(&pk->cond);
+		goto done;
+	}
+	*data = buf;
+	*len = ent->len;
+done:
+	opack_unlock(pk);
+	return ret;
+}
+
+int opack_evict_finish(struct opack *pk, uint64_t cid, int moved)
+{
+	int ret = 0;
+	struct opack_ent *ent;
+
+	/* The chunk is busy, so nobody else can have removed it */
+	pthread_mutex_lock(&pk->wlock);
+	pthread_mutex_lock(&pk->lock);
+	ent = opack_find(pk, cid);
+	if (moved) {
+		pthread_mutex_unlock(&pk->lock);
+		ret = opack_log(pk, OPACK_LOG_DEL, cid, NULL, 0, 0, 0);
+		pthread_mutex_lock(&pk->lock);
+	}
+	if (moved && (ret == 0)) {
+		opack_ent_free(pk, ent);
+	}
+	else {
+		ent->busy = 0;
+	}
+	pthread_cond_broadcast(&pk->cond);
+	opack_unlock(pk);
+	return ret;
+}
+
+int opack_pin(struct opack *pk, uint64_t cid, int *fd, uint64_t *off,
+		uint64_t *len, struct opack_seg **seg)
+{
+	int ret;
+	char *buf;
+	struct opack_snap snap;
+
+	ret = opack_snap_get(pk, cid, &snap);
+	if (ret)
+		return ret;
+	if (snap.num_ext > 1) {
+		ret = -EXDEV;
+		goto error_put;
+	}
+	*len = snap.len;
+	if (snap.num_ext == 0) {
+		*fd = -1;
+		*off = 0;
+		*seg = NULL;
+		return 0;
+	}
+	/* The caller won't see the data, so check its CRC here */
+	buf = malloc(snap.len);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto error_put;
+	}
+	ret = opack_read_ext(&snap.ext[0], cid, 0, buf);
+	free(buf);
+	if (ret)
+		goto error_put;
+	/* The snapshot's reference to the segment becomes the pin's */
+	*fd = snap.ext[0].seg->fd;
+	*off = snap.ext[0].off + OPACK_REC_HDR_LEN;
+	*seg = snap.ext[0].seg;
+	return 0;
+
+error_put:
+	opack_snap_put(pk, &snap);
+	return ret;
+}
+
+int opack_mark_bad(struct opack *pk, uint64_t cid)
+{
+	struct opack_ent *ent;
+
+	ent = opack_lock_ent(pk, cid);
+	if (!ent) {
+		opack_unlock(pk);
+		return -ENOENT;
+	}
+	opack_ent_clear(pk, ent);
+	ent->bad = 1;
+	opack_unlock(pk);
+	return 0;
+}
+
+void opack_unpin(struct opack *pk, struct opack_seg *seg)
+{
+	if (seg)
+		opack_seg_put(pk, seg);
+}
+
+int opack_next(struct opack *pk, uint64_t start, uint64_t *cid)
+{
+	struct opack_ent exemplar, *ent;
+
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.cid = start;
+	pthread_mutex_lock(&pk->lock);
+	ent = RB_NFIND(opack_ents, &pk->ents, &exemplar);
+	if (ent)
+		*cid = ent->cid;
+	pthread_mutex_unlock(&pk->lock);
+	return ent ? 0 : -ENOENT;
+}
+
+/** Copy the live chunks out of a segment
+ *
+ * Chunks which are busy being evicted are left where they are; we'll get them
+ * next time.  Chunks which turn out to be corrupt are marked as bad, rather
+ * than holding up compaction forever.
+ *
+ * Should be called by the writer, with the pack lock released.
+ *
+ * @param pk		The pack store
+ * @param victim	The segment
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int opack_compact_seg(struct opack *pk, struct opack_seg *victim)
+{
+	int i, ret;
+	struct opack_ent *ent;
+
+	/* Only the writer changes the index, so we can walk it without the
+	 * pack lock. */
+	RB_FOREACH(ent, opack_ents, &pk->ents) {
+		if (ent->busy)
+			continue;
+		for (i = 0; i < ent->num_ext; ++i) {
+			if (ent->ext[i].seg == victim)
+				break;
+		}
+		if (i == ent->num_ext)
+			continue;
+		ret = opack_rewrite(pk, ent, NULL, 0);
+		if (ret == -EBADMSG) {
+			pthread_mutex_lock(&pk->lock);
+			opack_ent_clear(pk, ent);
+			ent->bad = 1;
+			pthread_mutex_unlock(&pk->lock);
+		}
+		else if (ret) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+int opack_compact(struct opack *pk, int *freed)
+{
+	int i, ret, num_victim;
+	struct opack_seg *seg, *active, **victims;
+	struct opack_segs dead;
+
+	*freed = 0;
+	TAILQ_INIT(&dead);
+	pthread_mutex_lock(&pk->wlock);
+	pthread_mutex_lock(&pk->lock);
+	num_victim = 0;
+	TAILQ_FOREACH(seg, &pk->segs, entry)
+		num_victim++;
+	victims = calloc(num_victim + 1, sizeof(struct opack_seg *));
+	if (!victims) {
+		opack_unlock(pk);
+		return -ENOMEM;
+	}
+	/* We never compact the segment we're appending to */
+	num_victim = 0;
+	active = TAILQ_LAST(&pk->segs, opack_segs);
+	TAILQ_FOREACH(seg, &pk->segs, entry) {
+		if ((seg != active) && (!seg->dead) &&
+				(seg->live * 2 < seg->size))
+			victims[num_victim++] = seg;
+	}
+	pthread_mutex_unlock(&pk->lock);
+	for (i = 0; i < num_victim; ++i) {
+		ret = opack_compact_seg(pk, victims[i]);
+		if (ret)
+			goto done;
+	}
+	/* The copies, and the index log entries that point to them, must be
+	 * on disk before we delete the originals. */
+	if (num_victim > 0) {
+		active = TAILQ_LAST(&pk->segs, opack_segs);
+		if (active && fdatasync(active->fd)) {
+			ret = -errno;
+			goto done;
+		}
+		if (fdatasync(pk->log_fd)) {
+			ret = -errno;
+			goto done;
+		}
+	}
+	pthread_mutex_lock(&pk->lock);
+	for (i = 0; i < num_victim; ++i) {
+		seg = victims[i];
+		if (seg->live > 0)
+			continue;
+		seg->dead = 1;
+		(*freed)++;
+		pk->compacted++;
+		if (seg->refcnt == 0) {
+			TAILQ_REMOVE(&pk->segs, seg, entry);
+			TAILQ_INSERT_TAIL(&dead, seg, entry);
+		}
+	}
+	pthread_mutex_unlock(&pk->lock);
+	while ((seg = TAILQ_FIRST(&dead))) {
+		TAILQ_REMOVE(&dead, seg, entry);
+		opack_seg_destroy(pk, seg);
+	}
+	ret = opack_log_rewrite(pk);
+done:
+	pthread_mutex_unlock(&pk->wlock);
+	free(victims);
+	return ret;
+}
+
+void opack_get_stats(struct opack *pk, struct opack_stats *st)
+{
+	struct opack_seg *seg;
+
+	memset(st, 0, sizeof(*st));
+	pthread_mutex_lock(&pk->lock);
+	st->num_chunk = pk->num_chunk;
+	st->chunk_bytes = pk->chunk_bytes;
+	st->compacted = pk->compacted;
+	TAILQ_FOREACH(seg, &pk->segs, entry) {
+		if (seg->dead)
+			continue;
+		st->num_seg++;
+		st->seg_bytes += seg->size;
+		st->live_bytes += seg->live;
+	}
+	pthread_mutex_unlock(&pk->lock);
+}
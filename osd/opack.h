@@ -0,0 +1,295 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_OSD_OPACK_DOT_H
+#define REDFISH_OSD_OPACK_DOT_H
+
+/*
+ * The pack store
+ *
+ * Keeping every chunk in a file of its own costs an inode, a directory entry,
+ * and, while the chunk is in use, a couple of file descriptors.  For big
+ * chunks, that doesn't matter.  But millions of tiny chunks waste inodes, and
+ * thrash the ostor's file descriptor cache.  So chunks which are smaller than
+ * a threshold can be packed into large segment files instead.  Each disk has
+ * a pack store of its own, in the OPACK_DIR subdirectory of its data
+ * directory.
+ *
+ * Segments are only ever appended to.  Each append to a packed chunk adds a
+ * record to the end of the newest segment:
+ *
+ * header	OPACK_REC_MAGIC, the CRC32C of the data, the chunk ID, the
+ *		offset of the data in the chunk, and the length of the data, as
+ *		big-endian 32-, 32-, 64-, 32- and 32-bit words
+ * data		the data
+ *
+ * So a packed chunk is a list of extents, each of which is a record in some
+ * segment.  The list is kept in memory, and persisted in the index log,
+ * OPACK_INDEX_FILE.  Each entry in the log is OPACK_LOG_REC_LEN bytes long,
+ * and records that a chunk was created empty, that an extent was appended to
+ * it, that it was replaced by a single extent, or that it was unlinked.  When
+ * the pack store is opened, the log is replayed.  A torn entry at the end of
+ * the log, left over from a crash, is discarded.  Once the log has grown much
+ * longer than the index, it is rewritten.
+ *
+ * A chunk which gets more than OPACK_MAX_EXT extents is rewritten as a single
+ * record, so a read never has to gather more than that many pieces.  A chunk
+ * which would grow past the threshold can't stay in the pack store; the
+ * ostor moves it to a file of its own.
+ *
+ * Unlinking or rewriting a chunk leaves dead records behind.  opack_compact
+ * copies the live chunks out of segments which are mostly dead, and then
+ * deletes the segments.
+ *
+ * Appends, unlinks and compaction are serialized per pack store.  Reads only
+ * take the lock for long enough to look up the chunk.
+ */
+
+#include <stdint.h> /* for uint64_t, etc. */
+
+struct opack;
+struct opack_seg;
+
+/** Name of the directory inside a data directory that holds the pack store */
+#define OPACK_DIR "pack"
+
+/** Name of the index log in OPACK_DIR */
+#define OPACK_INDEX_FILE "index"
+
+/** Length of an index log entry */
+#define OPACK_LOG_REC_LEN 32
+
+/** Magic number at the start of each segment record: "RFPK" */
+#define OPACK_REC_MAGIC 0x5246504b
+
+/** Length of a segment record header */
+#define OPACK_REC_HDR_LEN 24
+
+/** Maximum number of extents a packed chunk may have */
+#define OPACK_MAX_EXT 8
+
+/** Largest segment we support.  Offsets in segments are 32 bits. */
+#define OPACK_MAX_SEG_SZ (1ULL << 31)
+
+/** Statistics for a pack store */
+struct opack_stats {
+	/** Number of chunks in the pack store */
+	uint64_t num_chunk;
+	/** Total length of the chunks */
+	uint64_t chunk_bytes;
+	/** Number of segments */
+	uint64_t num_seg;
+	/** Total size of the segments */
+	uint64_t seg_bytes;
+	/** Number of bytes of the segments which are still in use */
+	uint64_t live_bytes;
+	/** Number of segments that compaction has deleted */
+	uint64_t compacted;
+};
+
+/** Open a pack store, creating it if it doesn't exist
+ *
+ * @param base		The data directory
+ * @param max_chunk	Largest chunk to keep in the pack store
+ * @param seg_sz	Size at which to start a new segment.  At most
+ *			OPACK_MAX_SEG_SZ.
+ *
+ * @return		The pack store, or an error pointer
+ */
+extern struct opack *opack_open(const char *base, uint32_t max_chunk,
+		uint64_t seg_sz);
+
+/** Close a pack store
+ *
+ * There must be no operations in progress, and no chunks pinned.
+ *
+ * @param pk		The pack store
+ */
+extern void opack_close(struct opack *pk);
+
+/** Find out whether a chunk is in the pack store
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ *
+ * @return		1 if it is; 0 if it isn't
+ */
+extern int opack_lookup(struct opack *pk, uint64_t cid);
+
+/** Append to a packed chunk
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param data		The data to append
+ * @param dlen		Length of data
+ * @param create	If nonzero, create the chunk if it isn't in the pack
+ *			store
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't in the pack
+ *			store and create was not set; -EFBIG if the chunk
+ *			would grow too big for the pack store; another
+ *			negative error code on error
+ */
+extern int opack_append(struct opack *pk, uint64_t cid, const char *data,
+		uint32_t dlen, int create);
+
+/** Read from a packed chunk
+ *
+ * The data read is verified against the CRCs of the records it came from.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param off		Offset to read from
+ * @param data		(out param) buffer to read into
+ * @param dlen		Length of data
+ *
+ * @return		The number of bytes read on success; -ENOENT if the
+ *			chunk isn't in the pack store; -EBADMSG if the data is
+ *			corrupt; another negative error code on I/O error
+ */
+extern int32_t opack_read(struct opack *pk, uint64_t cid, uint64_t off,
+		char *data, int32_t dlen);
+
+/** Verify a whole packed chunk
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param len		(out param) the length of the chunk
+ *
+ * @return		0 if the chunk is good; -ENOENT if it isn't in the
+ *			pack store; -EBADMSG if it is corrupt; another negative
+ *			error code on I/O error
+ */
+extern int opack_verify(struct opack *pk, uint64_t cid, uint32_t *len);
+
+/** Unlink a packed chunk
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't in the pack
+ *			store; another negative error code on error
+ */
+extern int opack_unlink(struct opack *pk, uint64_t cid);
+
+/** Start moving a chunk out of the pack store
+ *
+ * The chunk stays readable until opack_evict_finish is called, but appends,
+ * unlinks and other evictions wait until then.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param data		(out param) a malloc'ed copy of the chunk's data, or
+ *			NULL if it is empty
+ * @param len		(out param) the length of the chunk
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't in the pack
+ *			store; -EBADMSG if it is corrupt; another negative
+ *			error code on error
+ */
+extern int opack_evict_start(struct opack *pk, uint64_t cid, char **data,
+		uint32_t *len);
+
+/** Finish moving a chunk out of the pack store
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param moved		If nonzero, the chunk has been copied elsewhere, and is
+ *			removed from the pack store.  Otherwise, it stays.
+ *
+ * @return		0 on success; a negative error code if we couldn't
+ *			remove the chunk, in which case it stays
+ */
+extern int opack_evict_finish(struct opack *pk, uint64_t cid, int moved);
+
+/** Pin a packed chunk
+ *
+ * Only chunks which are in a single record can be pinned.  The record is read
+ * and checked against its CRC first, since the caller won't look at the data.
+ * The segment it is in won't be deleted until it is unpinned.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ * @param fd		(out param) file descriptor of the segment, or -1 if
+ *			the chunk is empty
+ * @param off		(out param) offset of the chunk's data in the segment
+ * @param len		(out param) length of the chunk
+ * @param seg		(out param) the segment, to pass to opack_unpin
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't in the pack
+ *			store; -EXDEV if it is in more than one record, and
+ *			has to be read with opack_read instead; -EBADMSG if it
+ *			is corrupt; another negative error code on error
+ */
+extern int opack_pin(struct opack *pk, uint64_t cid, int *fd,
+		uint64_t *off, uint64_t *len, struct opack_seg **seg);
+
+/** Mark a packed chunk as corrupt
+ *
+ * Its data is dropped, and it can't be read any more, only unlinked.
+ *
+ * @param pk		The pack store
+ * @param cid		The chunk ID
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't in the pack
+ *			store
+ */
+extern int opack_mark_bad(struct opack *pk, uint64_t cid);
+
+/** Unpin a chunk pinned by opack_pin
+ *
+ * This may be called from any thread.
+ *
+ * @param pk		The pack store
+ * @param seg		The segment, or NULL if the chunk was empty
+ */
+extern void opack_unpin(struct opack *pk, struct opack_seg *seg);
+
+/** Find the first packed chunk whose ID is at least a given one
+ *
+ * This is used to iterate over the pack store without holding it locked.
+ *
+ * @param pk		The pack store
+ * @param start		The chunk ID to start at
+ * @param cid		(out param) the chunk ID found
+ *
+ * @return		0 on success; -ENOENT if there are no more chunks
+ */
+extern int opack_next(struct opack *pk, uint64_t start, uint64_t *cid);
+
+/** Compact the pack store
+ *
+ * Live chunks are copied out of segments which are less than half full, and
+ * the segments are deleted.  The index log is rewritten if it has grown too
+ * long.
+ *
+ * @param pk		The pack store
+ * @param freed		(out param) number of segments deleted
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+extern int opack_compact(struct opack *pk, int *freed);
+
+/** Get statistics for a pack store
+ *
+ * @param pk		The pack store
+ * @param st		(out param) the statistics
+ */
+extern void opack_get_stats(struct opack *pk, struct opack_stats *st);
+
+#endif
@@ -24,11 +24,18 @@
 #include "jorm/jorm_const.h"
 #include "mds/const.h"
 #include "osd/fast_log.h"
+#include "osd/ocsum.h"
+#include "osd/olayout.h"
+#include "osd/opack.h"
 #include "osd/ostor.h"
 #include "util/compiler.h"
+#include "util/crc32c.h"
 #include "util/error.h"
 #include "util/fast_log.h"
 #include "util/fast_log_types.h"
+#include "util/macro.h"
+#include "util/platform/fileio.h"
+#include "util/queue.h"
 #include "util/safe_io.h"
 #include "util/string.h"
 #include "util/terror.h"
@@ -39,12 +46,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 
 #define OSTOR_LRU_LONG_PERIOD_SEC 60
@@ -53,111 +62,373 @@
 
 #define OSTOR_TEST_DIR "test.tmp"
 
+/** Number of shards in the ochunk cache, as a power of two */
+#define OSTOR_SHARD_SHIFT 4
+
+#define OSTOR_NUM_SHARDS (1 << OSTOR_SHARD_SHIFT)
+
+/** Size of the buffer the scrubber reads chunk data into */
+#define OSTOR_SCRUB_BUF_SZ (64 * OCSUM_BLOCK_SZ)
+
+/** Maximum number of corrupt chunks found by reads to remember until
+ * ostor_take_corrupt is called */
+#define OSTOR_MAX_CORRUPT 1024
+
+/** Number of disk errors after which a disk is failed, even if it still
+ * passes ostor_probe_disk */
+#define OSTOR_DISK_MAX_ERR 32
+
+/** Default size of the pack stores' segment files, in megabytes */
+#define OSTOR_DEFAULT_PACK_SEG_MB 64
+
+/** Default number of seconds between pack store compactions */
+#define OSTOR_DEFAULT_PACK_IVAL 60
+
 struct ochunk {
 	RB_ENTRY(ochunk) by_cid_entry;
-	RB_ENTRY(ochunk) by_atime_entry;
+	TAILQ_ENTRY(ochunk) clock_entry;
 	/** chunk id */
 	uint64_t cid;
-	/** last access time */
+	/** index of the disk which holds the chunk */
+	int disk;
+	/** Approximate last access time.  This is only updated when the chunk
+	 * is released, and only to the nearest second. */
 	time_t atime;
 	/** open file descriptor */
 	int fd;
+	/** open file descriptor for the checksum file, or -1 if the chunk has
+	 * no checksums */
+	int csum_fd;
+	/** How much of the chunk the checksums cover.  Protected by the shard
+	 * lock. */
+	struct ocsum_state csum;
+	/** Nonzero if the chunk's file is in OLAYOUT_LEGACY_DIR, where
+	 * migration left it because it couldn't be identified */
+	int legacy;
+	/** Nonzero if the checksum file doesn't match the chunk.  Reads of the
+	 * chunk fail until it is replaced.  Protected by the shard lock. */
+	int csum_bad;
+	/** Nonzero while a write to the chunk is in progress.  The thread
+	 * which set this is the chunk's writer until it clears it.  Protected
+	 * by the shard lock. */
+	int wbusy;
+	/** Appends waiting for the write in progress to finish, linked
+	 * through wnext.  Protected by the shard lock. */
+	struct ostor_aio *wq_head;
+	/** Last entry in the write queue.  Protected by the shard lock. */
+	struct ostor_aio *wq_tail;
+	/** Size of the chunk's file.  Only touched by the chunk's writer. */
+	uint64_t wsize;
+	/** End of the disk space reserved for the chunk.  Only touched by the
+	 * chunk's writer. */
+	uint64_t prealloc_end;
+	/** Nonzero if we can't reserve space for this chunk.  Only touched by
+	 * the chunk's writer. */
+	int no_prealloc;
+	/** File descriptor for writing the chunk with direct I/O, or -1 if it
+	 * hasn't been opened.  Only touched by the chunk's writer. */
+	int dfd;
+	/** Nonzero if we can't do direct I/O on this chunk.  Only touched by
+	 * the chunk's writer. */
+	int no_direct;
 	/** Reference count.  If this is -1, the chunk is in the process of
 	 * being created or being destroyed.  */
 	int32_t refcnt;
+	/** Nonzero if the chunk has been used since the LRU thread last
+	 * looked at it */
+	int referenced;
+	/** Nonzero if this is a pin of a packed chunk.  These are made by
+	 * ostor_pin, and are never in the cache. */
+	int packed;
+	/** The segment that a packed chunk is pinned in, or NULL if the chunk
+	 * is empty */
+	struct opack_seg *pseg;
 };
 
 static int compare_ochunk_by_cid(struct ochunk *ch_a,
 		struct ochunk *ch_b) PURE;
-static int compare_ochunk_by_atime(struct ochunk *ch_a,
-		struct ochunk *ch_b) PURE;
+static struct ostor_shard *ostor_cid_to_shard(struct ostor *ostor,
+		uint64_t cid);
+static void ostor_put_fd(struct ostor *ostor, int disk);
+static int ostor_move_fd(struct ostor *ostor, int from, int to);
+static void ostor_shard_wake(struct ostor_shard *sh);
+static int ostor_place_cid(struct ostor *ostor, uint64_t cid, int *order);
+static void ostor_check_disk_error(struct ostor *ostor, int disk, int err);
 static struct ochunk *ostor_get_ochunk(struct ostor *ostor,
-		struct fast_log_buf *fb, uint64_t cid, int create);
+		struct ostor_shard *sh, struct fast_log_buf *fb,
+		uint64_t cid, int create);
 static int ostor_lru_thread(struct redfish_thread *rt);
+static int ostor_pack_thread(struct redfish_thread *rt);
+static void ostor_wbatch_done(struct oio_req *req);
+static int ostor_write_file(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, const char *data, int32_t dlen);
+static int ostor_aio_start(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, int op, uint64_t off, char *data, int32_t dlen,
+		struct ostor_aio *aio);
+static int ostor_unlink_file(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid);
 
 RB_HEAD(ochunks_by_cid, ochunk);
 RB_GENERATE(ochunks_by_cid, ochunk, by_cid_entry, compare_ochunk_by_cid);
-RB_HEAD(ochunks_by_atime, ochunk);
-RB_GENERATE(ochunks_by_atime, ochunk, by_atime_entry, compare_ochunk_by_atime);
+TAILQ_HEAD(ochunks_clock, ochunk);
+
+/** A shard of the ochunk cache.
+ *
+ * Each chunk ID maps to exactly one shard.  Looking up, referencing and
+ * releasing a chunk only ever takes the shard lock, so I/O to chunks in
+ * different shards doesn't contend.
+ */
+ALIGNED(64, struct ostor_shard {
+	/** lock which protects everything in this shard, including the
+	 * refcnt, atime and referenced fields of its chunks */
+	pthread_mutex_t lock;
+	/** tree of open chunks sorted by chunk id */
+	struct ochunks_by_cid cid_head;
+	/** All of the chunks in this shard, in the order that the LRU thread
+	 * will look at them.  Using a chunk doesn't move it in this list;
+	 * it just sets ch->referenced. */
+	struct ochunks_clock clock_head;
+	/** number of chunks in clock_head */
+	int num_chunk;
+	/** Condition variable which is broadcast when a chunk in this shard
+	 * finishes being created or destroyed, or becomes unreferenced.  This
+	 * is shared by all of the shard's chunks, so waiters must re-check
+	 * whatever they were waiting for. */
+	pthread_cond_t wait_cond;
+	/** number of threads waiting on wait_cond */
+	int num_waiters;
+	/** Held while deciding whether a new chunk in this shard gets packed
+	 * or gets a file, and creating it there.  Taken before the shard
+	 * lock. */
+	pthread_mutex_t create_lock;
+});
+
+/** One of the ostor's data directories.  Normally, each one is on a disk of
+ * its own.
+ */
+struct ostor_disk {
+	/** Path to the data directory */
+	char *path;
+	/** How the chunk files in the data directory are arranged */
+	struct olayout layout;
+	/** Nonzero if the data directory has an OLAYOUT_LEGACY_DIR */
+	int has_legacy;
+	/** This disk's share of new chunks, relative to the other disks */
+	uint64_t weight;
+	/** Nonzero if the disk has failed.  Once a disk fails, we never touch
+	 * it again, and the chunks on it are treated as missing.  Accessed
+	 * atomically. */
+	int failed;
+	/** Number of errors which looked like the disk's fault, but which the
+	 * disk survived.  Accessed atomically. */
+	int num_err;
+	/** Nonzero while a thread is probing the disk.  Accessed atomically. */
+	int probing;
+	/** current number of files that are open on this disk */
+	int num_open;
+	/** maximum number of files to open on this disk */
+	int max_open;
+	/** number of threads waiting for a file descriptor on this disk */
+	int need_lru;
+	/** Copy of need_lru taken at the start of each sweep.  Only used by
+	 * the LRU thread. */
+	int lru_need;
+	/** The disk's pack store, or NULL if it has none */
+	struct opack *pack;
+};
 
 /** The backend store for the osd's data.  Basically, this is where we put chunk
  * data.
  *
- * Most of the complexity here comes from three things:
+ * Most of the complexity here comes from four things:
  * 1. We don't want to do an open/modify/close cycle on each operation, since
- * there is a high overhead for open and close.  So we keep an LRU
- * (least-recently-used) cache of open file descriptors.
+ * there is a high overhead for open and close.  So we keep a cache of open
+ * file descriptors, and close the ones that haven't been used lately.
  *
  * 2. We don't want to perform blocking system calls, like
- * read/write/open/close/unlink, while holding ostor->lock.
+ * read/write/open/close/unlink, while holding a lock.
  *
  * 3. We also want to limit the number of open file descriptors.  Using too many
  * file descriptors could cause problems for other processes on this machine.
  * It could also lead to us geting EMFILE, which would be very awkward to handle.
  *
- * This design accomplishes all three of those things.  See ostorc.jorm for
+ * 4. Every read and write goes through the cache, so finding a chunk must not
+ * serialize the whole OSD.  The cache is split into OSTOR_NUM_SHARDS shards by
+ * chunk ID, each with its own lock.  Rather than keeping a strict LRU order,
+ * which would mean moving the chunk on every access, each shard keeps its
+ * chunks in a CLOCK list.  Releasing a chunk just records an approximate
+ * access time and sets a referenced bit.  The LRU thread sweeps the lists,
+ * closing chunks which have been idle for longer than atime_timeo, or, when
+ * someone is waiting for a file descriptor, the first unused chunk which
+ * hasn't been referenced since the last sweep.
+ *
+ * ostor->lock protects only the file descriptor budgets.  It is taken when a
+ * chunk is opened or closed, never on the fast path.  If both locks are
+ * needed, the shard lock must be taken first.
+ *
+ * The chunks are spread over one or more data directories, each normally on
+ * its own disk.  Each disk has its own file descriptor budget and its own I/O
+ * engine queue, so a busy disk can't starve the others.  A chunk lives on the
+ * disk chosen by weighted rendezvous hashing on its chunk ID, skipping any
+ * disks which have failed.  Adding or losing a disk only moves the chunks
+ * that have to move.  When a disk returns an I/O error, we check whether the
+ * disk as a whole still works by creating and removing a directory on it.  If
+ * it doesn't, or if it has returned too many errors, it is marked as failed,
+ * and from then on its chunks are reported as missing, rather than taking the
+ * whole OSD down.  Otherwise the error only affects the chunk it came from.
+ *
+ * This design accomplishes all of those things.  See ostorc.jorm for
  * tunables.
  *
- * The busy-waiting could be eliminated by using per-chunk condition variables
- * and locks, but I doubt that that would be worth it.  We only really have to
- * busy-wait when block creations and deletions are racing-- NOT a common
- * scenario.  If we had per-chunk condition variables and mutexes, we'd have to
- * pay the cost of using them all the time.
+ * Sometimes we have to wait for a chunk: while it is being opened or closed by
+ * another thread, or, in ostor_unlink, until nobody is using it.  Rather than
+ * giving every chunk its own condition variable, the waiters sleep on their
+ * shard's wait_cond.  Only the threads which change a chunk's state look at
+ * num_waiters, and they only broadcast if someone is actually waiting, so the
+ * fast path pays nothing for this.
+ *
+ * Small chunks may be packed into a pack store on their disk instead of
+ * getting files of their own.  Every operation looks in the pack stores
+ * first, and goes on to the chunk's file if the chunk isn't there.  A chunk
+ * is never in both places for long: when a packed chunk outgrows pack_max, it
+ * is copied into a file and then dropped from the pack store, while the pack
+ * store holds back other writes to it.  The pack stores have their own locks,
+ * and packed chunks never go through the cache.  A new chunk is packed or
+ * given a file under its shard's create_lock, so two first writes to the same
+ * chunk can't put it in both places.
  */
 struct ostor {
-	/** Path to the ostor directory */
-	char *dir_path;
+	/** The data directories */
+	struct ostor_disk *disks;
+	/** Number of data directories */
+	int num_disk;
 	/** If nonzero, we are shutting down */
 	int shutdown;
-	/** current number of files that are open */
-	int num_open;
-	/** maximum number of files to open */
-	int max_open;
 	/** maximum number of seconds to leave a file open once it's unused */
 	time_t atime_timeo;
-	/** lock which protects num_open, chunk_head */
+	/** lock which protects shutdown, need_lru, corrupt, num_corrupt, and
+	 * the num_open and need_lru fields of each disk */
 	pthread_mutex_t lock;
 	/** condition variable used to signal that the garbage collector thread
 	 * should wake up */
 	pthread_cond_t lru_cond;
-	/** minimum number of files we need to close to make way for new ones */
+	/** minimum number of files we need to close to make way for new ones.
+	 * This is the sum of need_lru over all of the disks. */
 	int need_lru;
 	/** condition variable used to signal that more ochunks are allowed to
 	 * be opened */
 	pthread_cond_t alloc_cond;
-	/** tree of open chunks sorted by chunk id */
-	struct ochunks_by_cid cid_head;
-	/** tree of open chunks sorted by last access time */
-	struct ochunks_by_atime atime_head;
+	/** the shards of the ochunk cache */
+	struct ostor_shard shards[OSTOR_NUM_SHARDS];
+	/** Corrupt chunks that reads have found, which the owner of the ostor
+	 * hasn't collected yet */
+	uint64_t corrupt[OSTOR_MAX_CORRUPT];
+	/** Number of entries in corrupt */
+	int num_corrupt;
+	/** the next shard for the LRU thread to sweep.  Only used by the LRU
+	 * thread. */
+	int clock_hand;
+	/** the disk I/O engine, which does asynchronous reads and writes */
+	struct oio *oio;
+	/** Maximum number of bytes of queued appends to write at once */
+	uint32_t coalesce_max;
+	/** Size of the extents to reserve disk space for chunks in, or 0 not
+	 * to reserve space */
+	uint64_t prealloc_sz;
+	/** How big we expect chunks to get */
+	uint64_t chunk_sz;
+	/** Minimum size of a write to do with direct I/O, or 0 never to use
+	 * direct I/O */
+	uint32_t direct_min;
+	/** Largest chunk to pack, or 0 not to pack new chunks */
+	uint32_t pack_max;
+	/** Number of disks with pack stores */
+	int num_pack;
+	/** Number of seconds between pack store compactions */
+	int pack_ival;
+	/** condition variable used to signal that the pack thread should wake
+	 * up */
+	pthread_cond_t pack_cond;
 	/** the lru thread */
 	struct redfish_thread lru_thread;
+	/** the pack thread, which compacts the pack stores.  Only started if
+	 * num_pack is nonzero. */
+	struct redfish_thread pack_thread;
 };
 
+/** Remember that a chunk is corrupt, until the owner of the ostor collects
+ * the list with ostor_take_corrupt.
+ *
+ * Should be called with the shard lock released.
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ */
+static void ostor_report_corrupt(struct ostor *ostor, uint64_t cid)
+{
+	int i;
+
+	pthread_mutex_lock(&ostor->lock);
+	for (i = 0; i < ostor->num_corrupt; ++i) {
+		if (ostor->corrupt[i] == cid)
+			break;
+	}
+	if (i == ostor->num_corrupt) {
+		if (ostor->num_corrupt < OSTOR_MAX_CORRUPT) {
+			ostor->corrupt[ostor->num_corrupt++] = cid;
+		}
+		else {
+			glitch_log("ostor_report_corrupt: too many corrupt "
+				"chunks.  Not reporting chunk 0x%016" PRIx64
+				"\n", cid);
+		}
+	}
+	pthread_mutex_unlock(&ostor->lock);
+}
+
 /************************** ochunk *******************************/
-static void ochunk_get_dpath(const struct ostor *ostor, char *dpath,
-		size_t dpath_len, uint64_t cid)
+static void ochunk_get_path(const struct ostor *ostor, int disk,
+		char *path, size_t path_len, uint64_t cid)
 {
-	snprintf(dpath, dpath_len, "%s/%02x", ostor->dir_path,
-		 (int)(cid & 0xff));
+	olayout_get_path(&ostor->disks[disk].layout, ostor->disks[disk].path,
+		cid, path, path_len);
+}
+
+static void ochunk_get_file_path(const struct ostor *ostor,
+		const struct ochunk *ch, char *path, size_t path_len)
+{
+	if (ch->legacy) {
+		olayout_get_legacy_path(ostor->disks[ch->disk].path, ch->cid,
+			path, path_len);
+		return;
+	}
+	ochunk_get_path(ostor, ch->disk, path, path_len, ch->cid);
 }
 
-static void ochunk_get_path(const struct ostor *ostor, char *path,
-		size_t path_len, uint64_t cid)
+static void ochunk_get_csum_path(const struct ostor *ostor,
+		const struct ochunk *ch, char *path, size_t path_len)
 {
-	snprintf(path, path_len, "%s/%02x/%014" PRIx64, ostor->dir_path,
-		 (int)(cid & 0xff), cid >> 16);
+	size_t off;
+
+	ochunk_get_file_path(ostor, ch, path, path_len);
+	off = strlen(path);
+	snprintf(path + off, path_len - off, "%s", OCSUM_SUFFIX);
 }
 
 /** Allocate an ostor chunk.
  *
- * Create the data structure in memory for a chunk.
+ * Create the data structure in memory for a chunk.  The caller must already
+ * have accounted for the chunk in the disk's num_open.
  *
- * Should be called with the ostor lock held.
+ * Should be called with the shard lock held.
  *
- * @param ostor		The ostor
+ * @param sh		The shard
  * @param cid		The chunk ID
+ * @param disk		The disk whose file descriptor budget the chunk is
+ *			accounted to
  */
-static struct ochunk *ochunk_alloc(struct ostor *ostor, uint64_t cid)
+static struct ochunk *ochunk_alloc(struct ostor_shard *sh, uint64_t cid,
+		int disk)
 {
 	struct ochunk *ch;
 
@@ -165,95 +436,427 @@ static struct ochunk *ochunk_alloc(struct ostor *ostor, uint64_t cid)
 	if (!ch)
 		return ERR_PTR(ENOMEM);
 	ch->cid = cid;
+	ch->disk = disk;
 	ch->fd = -1;
+	ch->csum_fd = -1;
+	ch->dfd = -1;
 	ch->atime = 0;
 	ch->refcnt = -1;
-	ostor->num_open++;
-	RB_INSERT(ochunks_by_cid, &ostor->cid_head, ch);
+	RB_INSERT(ochunks_by_cid, &sh->cid_head, ch);
+	TAILQ_INSERT_TAIL(&sh->clock_head, ch, clock_entry);
+	sh->num_chunk++;
 	return ch;
 }
 
-/** Open the file backing an ostor chunk.
- *
- * Should be called with the ostor lock __released__.
+/** Open the file backing a chunk on a particular disk.
  *
- * @param ostor		The current monotonic time
- * @param cur_time	The current monotonic time
+ * @param ostor		The ostor
+ * @param disk		The disk
+ * @param cid		The chunk ID
  * @param create	If nonzero, create the chunk if it doesn't exist.
+ * @param fd		(out param) the file descriptor
+ *
+ * @return		0 on success; a positive error code otherwise
  */
-static int ochunk_open(struct ostor *ostor, struct ochunk *ch, int create)
+static int ochunk_open_on(struct ostor *ostor, int disk, uint64_t cid,
+		int create, int *fd)
 {
 	int ret, open_flags;
-	char path[PATH_MAX], dpath[PATH_MAX];
+	char path[PATH_MAX];
 
-	ochunk_get_path(ostor, path, sizeof(path), ch->cid);
+	ochunk_get_path(ostor, disk, path, sizeof(path), cid);
 	open_flags = create ? O_CREAT : 0;
 	open_flags |= O_APPEND | O_RDWR | O_CLOEXEC | O_NOATIME;
-	RETRY_ON_EINTR(ch->fd, open(path, open_flags, 0660));
-	if (ch->fd >= 0)
+	RETRY_ON_EINTR(*fd, open(path, open_flags, 0660));
+	if (*fd >= 0)
 		return 0;
 	ret = errno;
 	if ((ret != ENOENT) || (!create)) {
 		return ret;
 	}
-	ochunk_get_dpath(ostor, dpath, sizeof(dpath), ch->cid);
-	if (mkdir(dpath, 0770) < 0) {
-		ret = -errno;
-		return ret;
+	ret = olayout_mkdirs(&ostor->disks[disk].layout,
+		ostor->disks[disk].path, cid);
+	if (ret)
+		return FORCE_POSITIVE(ret);
+	RETRY_ON_EINTR(*fd, open(path, open_flags, 0660));
+	if (*fd >= 0)
+		return 0;
+	ret = errno;
+	return ret;
+}
+
+/** Open a chunk file that migration kept in OLAYOUT_LEGACY_DIR.
+ *
+ * Legacy chunk files don't record bits 8 to 15 of their chunk IDs, so this is
+ * only used to find existing chunks, never to create new ones, which might
+ * share a file name with an old one.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param disk		The disk to look on
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ochunk_open_legacy(struct ostor *ostor, struct ochunk *ch,
+		int disk)
+{
+	int ret;
+	char path[PATH_MAX];
+
+	if (!ostor->disks[disk].has_legacy)
+		return ENOENT;
+	olayout_get_legacy_path(ostor->disks[disk].path, ch->cid, path,
+		sizeof(path));
+	RETRY_ON_EINTR(ch->fd, open(path,
+		O_APPEND | O_RDWR | O_CLOEXEC | O_NOATIME));
+	if (ch->fd >= 0) {
+		ch->legacy = 1;
+		return 0;
 	}
-	RETRY_ON_EINTR(ch->fd, open(path, open_flags, 0660));
+	ret = errno;
+	if (ret != ENOENT)
+		ostor_check_disk_error(ostor, disk, ret);
+	return ret;
+}
+
+/** Account an open chunk to the disk that its file turned up on.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk.  ch->fd must be open.
+ * @param disk		The disk the chunk's file is on
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ochunk_move(struct ostor *ostor, struct ochunk *ch, int disk)
+{
+	int ret;
+	char path[PATH_MAX];
+
+	if (disk == ch->disk)
+		return 0;
+	/* Don't keep the file open while we wait for room on its disk. */
+	RETRY_ON_EINTR(ret, close(ch->fd));
+	ch->fd = -1;
+	ret = ostor_move_fd(ostor, ch->disk, disk);
+	ch->disk = disk;
+	if (ret)
+		return ret;
+	ochunk_get_file_path(ostor, ch, path, sizeof(path));
+	RETRY_ON_EINTR(ch->fd, open(path,
+		O_APPEND | O_RDWR | O_CLOEXEC | O_NOATIME));
 	if (ch->fd >= 0)
 		return 0;
-	ret = -errno;
+	ret = errno;
+	ostor_check_disk_error(ostor, disk, ret);
+	return ret;
+}
+
+/** Open the file backing an ostor chunk.
+ *
+ * A chunk normally lives on the first disk that ostor_place_cid picks for it.
+ * But if disks have failed or been added since the chunk was written, it may
+ * be on one of the others, so we look there before giving up or creating a
+ * new chunk.  An error on one disk doesn't stop us from looking on the rest,
+ * but it does stop us from creating a new chunk, since the chunk may be on the
+ * disk we couldn't look at.  Chunks which aren't anywhere else may be in a
+ * disk's OLAYOUT_LEGACY_DIR.  If the chunk turns up on a different disk than
+ * the one it is accounted to, its file descriptor is moved to that disk's
+ * budget.
+ *
+ * Should be called with the shard lock __released__.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk.  ch->disk must be the disk which
+ *			ostor_place_cid put first.
+ * @param create	If nonzero, create the chunk if it doesn't exist.
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ochunk_open(struct ostor *ostor, struct ochunk *ch, int create)
+{
+	int i, ret, err = 0, num_disk, order[OSTORC_MAX_DISK];
+
+	if (ostor->num_disk == 1) {
+		ret = ochunk_open_on(ostor, 0, ch->cid, create, &ch->fd);
+		ostor_check_disk_error(ostor, 0, ret);
+		if ((ret == ENOENT) && (!create))
+			ret = ochunk_open_legacy(ostor, ch, 0);
+		return ret;
+	}
+	num_disk = ostor_place_cid(ostor, ch->cid, order);
+	for (i = 0; i < num_disk; ++i) {
+		ret = ochunk_open_on(ostor, order[i], ch->cid, 0, &ch->fd);
+		if (ret == 0)
+			return ochunk_move(ostor, ch, order[i]);
+		if (ret == ENOENT)
+			continue;
+		/* The chunk may still be on one of the other disks */
+		ostor_check_disk_error(ostor, order[i], ret);
+		if (!err)
+			err = ret;
+	}
+	/* If we couldn't look on one of the disks, the chunk may be there, so
+	 * we mustn't create another copy of it. */
+	if (err)
+		return err;
+	if (!create) {
+		for (i = 0; i < num_disk; ++i) {
+			ret = ochunk_open_legacy(ostor, ch, order[i]);
+			if (ret == 0)
+				return ochunk_move(ostor, ch, order[i]);
+			if (ret != ENOENT)
+				return ret;
+		}
+		return ENOENT;
+	}
+	ret = ochunk_open_on(ostor, ch->disk, ch->cid, 1, &ch->fd);
+	ostor_check_disk_error(ostor, ch->disk, ret);
+	return ret;
+}
+
+/** Open the checksum file of an ostor chunk.
+ *
+ * If the checksum file doesn't match the chunk, the chunk is marked as bad,
+ * rather than failing to open, so that it can still be unlinked.
+ *
+ * Should be called with the shard lock __released__, after ochunk_open.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ochunk_open_csum(struct ostor *ostor, struct ochunk *ch)
+{
+	int ret;
+	char path[PATH_MAX];
+
+	ochunk_get_csum_path(ostor, ch, path, sizeof(path));
+	ret = ocsum_open(path, ch->fd, ch->cid, &ch->csum_fd, &ch->csum);
+	if (ret == -EBADMSG) {
+		glitch_log("ostor error: the checksums of chunk 0x%016" PRIx64
+			" don't match its data.\n", ch->cid);
+		ch->csum_bad = 1;
+		ostor_report_corrupt(ostor, ch->cid);
+		return 0;
+	}
+	ostor_check_disk_error(ostor, ch->disk, ret);
+	return FORCE_POSITIVE(ret);
+}
+
+/** Find out how big a chunk's file is.
+ *
+ * We also find out whether disk space is reserved past the end of it.  That
+ * happens if we crashed before the chunk was evicted.  It will be given back
+ * when the chunk is evicted this time.
+ *
+ * Should be called with the shard lock released, after ochunk_open, or by the
+ * chunk's writer.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ochunk_stat(struct ostor *ostor, struct ochunk *ch)
+{
+	int ret;
+	struct stat st;
+	uint64_t alloc, blksz;
+
+	if (fstat(ch->fd, &st)) {
+		ret = errno;
+		ostor_check_disk_error(ostor, ch->disk, ret);
+		return ret;
+	}
+	ch->wsize = st.st_size;
+	ch->prealloc_end = ch->wsize;
+	alloc = (uint64_t)st.st_blocks * 512;
+	blksz = (st.st_blksize > 0) ? st.st_blksize : DIRECT_IO_ALIGN;
+	if (alloc > ((ch->wsize + blksz - 1) / blksz) * blksz)
+		ch->prealloc_end = alloc;
+	return 0;
+}
+
+/** Update the checksums of a chunk after appending to it.
+ *
+ * If this fails, the chunk is marked as bad, since we can no longer vouch for
+ * it.
+ *
+ * Should be called with the shard lock released, by the chunk's writer.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param data		The data which was appended
+ * @param dlen		Length of data
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int ochunk_update_csum(struct ostor *ostor, struct ochunk *ch,
+		const char *data, uint32_t dlen)
+{
+	int ret;
+	struct ocsum_state st;
+	struct ostor_shard *sh;
+
+	if (ch->csum_fd < 0)
+		return 0;
+	sh = ostor_cid_to_shard(ostor, ch->cid);
+	pthread_mutex_lock(&sh->lock);
+	if (ch->csum_bad) {
+		pthread_mutex_unlock(&sh->lock);
+		return 0;
+	}
+	st = ch->csum;
+	pthread_mutex_unlock(&sh->lock);
+	ret = ocsum_update(ch->csum_fd, ch->fd, &st, data, dlen);
+	if (ret) {
+		glitch_log("ostor error: failed to update the checksums of "
+			"chunk 0x%016" PRIx64 ": error %d (%s)\n", ch->cid,
+			ret, terror(ret));
+		ostor_check_disk_error(ostor, ch->disk, ret);
+	}
+	pthread_mutex_lock(&sh->lock);
+	if (ret)
+		ch->csum_bad = 1;
+	else
+		ch->csum = st;
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+/** Verify data read from a chunk against its checksums.
+ *
+ * If the data is corrupt, the chunk is marked as bad, so that nothing more is
+ * read from it, and reported with ostor_report_corrupt, so that it can be
+ * replaced.
+ *
+ * Should be called with the shard lock released.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param st		The chunk's checksum state from before the read
+ * @param off		Offset the data was read from
+ * @param data		The data
+ * @param dlen		Length of data
+ *
+ * @return		0 if the data is good; -EIO if it is corrupt; a
+ *			negative error code otherwise
+ */
+static int ochunk_verify_csum(struct ostor *ostor, struct ochunk *ch,
+		const struct ocsum_state *st, uint64_t off,
+		const char *data, uint32_t dlen)
+{
+	int ret;
+	struct ostor_shard *sh;
+
+	if (ch->csum_fd < 0)
+		return 0;
+	ret = ocsum_verify(ch->csum_fd, ch->fd, st, off, data, dlen);
+	if (ret == -EBADMSG) {
+		glitch_log("ostor error: chunk 0x%016" PRIx64 " is corrupt "
+			"near offset %" PRId64 ".\n", ch->cid, off);
+		sh = ostor_cid_to_shard(ostor, ch->cid);
+		pthread_mutex_lock(&sh->lock);
+		ch->csum_bad = 1;
+		pthread_mutex_unlock(&sh->lock);
+		ostor_report_corrupt(ostor, ch->cid);
+		return -EIO;
+	}
+	ostor_check_disk_error(ostor, ch->disk, ret);
 	return ret;
 }
 
+/** Take a reference to an ochunk.
+ *
+ * Should be called with the shard lock held.
+ *
+ * @param ch		The chunk
+ */
+static void ochunk_acquire(struct ochunk *ch)
+{
+	if (ch->refcnt == -1)
+		abort();
+	ch->refcnt++;
+}
+
+/** Drop a reference to an ochunk.
+ *
+ * This doesn't move the chunk anywhere; the LRU thread will notice the new
+ * atime and referenced bit the next time it sweeps the shard.  If this was
+ * the last reference, wake up anyone waiting to unlink the chunk.
+ *
+ * Should be called with the shard lock released.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ */
 static void ochunk_release(struct ostor *ostor, struct ochunk *ch)
 {
 	time_t t;
+	struct ostor_shard *sh;
 
 	t = mt_time();
-	pthread_mutex_lock(&ostor->lock);
-	ch->atime = t;
-	if (ch->refcnt == -1)
+	sh = ostor_cid_to_shard(ostor, ch->cid);
+	pthread_mutex_lock(&sh->lock);
+	if (ch->refcnt <= 0)
 		abort();
 	ch->refcnt--;
-	RB_INSERT(ochunks_by_atime, &ostor->atime_head, ch);
-	pthread_mutex_unlock(&ostor->lock);
+	ch->atime = t;
+	ch->referenced = 1;
+	if (ch->refcnt == 0)
+		ostor_shard_wake(sh);
+	pthread_mutex_unlock(&sh->lock);
 }
 
 /** Close the file associated with an ochunk, and flush the ochunk data
  * structure from memory.
  *
- * Should be called with the ostor lock held.
+ * Should be called with the shard lock held.
  *
  * @param ostor		The ostor
- * @param cid		The chunk ID
+ * @param sh		The shard which the chunk belongs to
+ * @param fb		The fast log buffer
+ * @param ch		The chunk
  */
-static void ochunk_evict(struct ostor *ostor, struct fast_log_buf *fb,
-		struct ochunk *ch)
+static void ochunk_evict(struct ostor *ostor, struct ostor_shard *sh,
+		struct fast_log_buf *fb, struct ochunk *ch)
 {
-	int res = 0, fd = ch->fd;
+	int res = 0, fd = ch->fd, disk = ch->disk;
 	uint64_t cid = ch->cid;
 
 	if (ch->refcnt != -1)
 		abort();
-	if (fd > 0) {
-		pthread_mutex_unlock(&ostor->lock);
-		RETRY_ON_EINTR(res, close(fd));
-		if (res) {
-			glitch_log("ostor error: failed to close fd %d: error "
-				"%d (%s)\n", fd, res, terror(res));
+	if ((fd > 0) || (ch->csum_fd >= 0)) {
+		pthread_mutex_unlock(&sh->lock);
+		if (fd > 0) {
+			/* Give back the space we reserved but didn't use */
+			if (ch->prealloc_end > ch->wsize)
+				do_unprealloc(fd, ch->wsize);
+			RETRY_ON_EINTR(res, close(fd));
+			if (res) {
+				glitch_log("ostor error: failed to close fd "
+					"%d: error %d (%s)\n", fd, res,
+					terror(res));
+			}
+			ch->fd = -1;
 		}
-		ch->fd = -1;
-		pthread_mutex_lock(&ostor->lock);
+		if (ch->csum_fd >= 0) {
+			safe_close(ch->csum_fd);
+			ch->csum_fd = -1;
+		}
+		if (ch->dfd >= 0) {
+			safe_close(ch->dfd);
+			ch->dfd = -1;
+		}
+		pthread_mutex_lock(&sh->lock);
 	}
-	RB_REMOVE(ochunks_by_cid, &ostor->cid_head, ch);
+	RB_REMOVE(ochunks_by_cid, &sh->cid_head, ch);
+	TAILQ_REMOVE(&sh->clock_head, ch, clock_entry);
+	sh->num_chunk--;
 	free(ch);
-	if (ostor->need_lru > 0)
-		ostor->need_lru--;
-	ostor->num_open--;
-	pthread_cond_signal(&ostor->alloc_cond);
+	ostor_shard_wake(sh);
+	ostor_put_fd(ostor, disk);
 	fast_log_ostor(fb, FLOS_OCHUNK_EVICT, cid, 0, res, fd);
 }
 
@@ -266,69 +869,549 @@ static int compare_ochunk_by_cid(struct ochunk *ch_a, struct ochunk *ch_b)
 	return 0;
 }
 
-static int compare_ochunk_by_atime(struct ochunk *ch_a, struct ochunk *ch_b)
+/************************** ostor *******************************/
+static struct ostor_shard *ostor_cid_to_shard(struct ostor *ostor,
+		uint64_t cid)
 {
-	if (ch_a->atime < ch_b->atime)
-		return -1;
-	if (ch_a->atime > ch_b->atime)
-		return 1;
-	return compare_ochunk_by_cid(ch_a, ch_b);
+	uint64_t h;
+
+	/* Chunk IDs are handed out sequentially, so mix the bits before
+	 * picking a shard. */
+	h = cid * 0x9e3779b97f4a7c15ULL;
+	return &ostor->shards[h >> (64 - OSTOR_SHARD_SHIFT)];
 }
 
-/************************** ostor *******************************/
-struct ostor *ostor_init(const struct ostorc *oconf)
+static int ostor_is_shutdown(struct ostor *ostor)
 {
-	int ret;
-	struct ostor *ostor;
-	char tpath[PATH_MAX];
+	return __atomic_load_n(&ostor->shutdown, __ATOMIC_ACQUIRE);
+}
 
-	/* create the ostor directory if it doesn't already exist. */
-	if (mkdir(oconf->ostor_path, 0770) < 0) {
-		ret = errno;
-		if (ret != EEXIST) {
-			glitch_log("ostor_init: Failed to create directory "
-				"'%s': error %d (%s)\n", oconf->ostor_path,
-				ret, terror(ret));
-			goto error;
-		}
+static int ostor_disk_is_failed(struct ostor *ostor, int disk)
+{
+	return __atomic_load_n(&ostor->disks[disk].failed, __ATOMIC_ACQUIRE);
+}
+
+/** Give back a file descriptor to a disk's budget, and wake up anyone
+ * waiting for one.
+ *
+ * May be called with a shard lock held.
+ *
+ * @param ostor		The ostor
+ * @param disk		The disk
+ */
+static void ostor_put_fd(struct ostor *ostor, int disk)
+{
+	struct ostor_disk *d = &ostor->disks[disk];
+
+	pthread_mutex_lock(&ostor->lock);
+	if (d->need_lru > 0) {
+		d->need_lru--;
+		ostor->need_lru--;
 	}
-	ret = zsnprintf(tpath, sizeof(tpath), "%s/%s",
-		oconf->ostor_path, OSTOR_TEST_DIR);
-	if (ret) {
-		glitch_log("ostor_init: oconf->ostor_path was too long at %Zd "
-			"bytes!\n", strlen(oconf->ostor_path));
-		goto error;
+	d->num_open--;
+	/* The waiters may be waiting for different disks, so wake them all */
+	pthread_cond_broadcast(&ostor->alloc_cond);
+	pthread_mutex_unlock(&ostor->lock);
+}
+
+/** Move a file descriptor from one disk's budget to another's.
+ *
+ * The descriptor is given back to the old disk first, and then we wait until
+ * the new disk has room for it, so that we never hold one disk's descriptor
+ * while waiting for another's.  If we are shutting down, or the new disk
+ * fails, we stop waiting and take the descriptor anyway.  The chunk will be
+ * evicted soon after, giving it back.
+ *
+ * Should be called with no locks held.
+ *
+ * @param ostor		The ostor
+ * @param from		The disk the file descriptor was accounted to
+ * @param to		The disk it should be accounted to
+ *
+ * @return		0 on success; ESHUTDOWN or ENOENT if we stopped waiting
+ */
+static int ostor_move_fd(struct ostor *ostor, int from, int to)
+{
+	int ret = 0;
+	struct ostor_disk *d = &ostor->disks[to];
+
+	ostor_put_fd(ostor, from);
+	pthread_mutex_lock(&ostor->lock);
+	while (d->num_open >= d->max_open) {
+		if (ostor->shutdown) {
+			ret = ESHUTDOWN;
+			break;
+		}
+		if (ostor_disk_is_failed(ostor, to)) {
+			ret = ENOENT;
+			break;
+		}
+		d->need_lru++;
+		ostor->need_lru++;
+		pthread_cond_signal(&ostor->lru_cond);
+		pthread_cond_wait(&ostor->alloc_cond, &ostor->lock);
 	}
-	if (mkdir(tpath, 0770) < 0) {
-		ret = errno;
-		glitch_log("ostor_init: failed to create directory '%s'.  "
-			"Error %d: %s.  Have you set appropriate permissions "
-			"on the ostor_path?\n", tpath, ret, terror(ret));
-		goto error;
+	d->num_open++;
+	pthread_mutex_unlock(&ostor->lock);
+	return ret;
+}
+
+static uint64_t ostor_mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/** Rank the working disks by how much a chunk wants to live on them.
+ *
+ * This is weighted rendezvous hashing.  Each disk draws a pseudo-random
+ * number u in (0, 1) from the chunk ID and its own index, and scores
+ * weight / -ln(u).  The disk with the highest score wins.  Each disk wins
+ * in proportion to its weight, and removing a disk only moves the chunks
+ * which were on it.
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ * @param order		(out param) indices of the disks which haven't failed,
+ *			best first.  Must have room for ostor->num_disk
+ *			entries.
+ *
+ * @return		The number of entries in order
+ */
+static int ostor_place_cid(struct ostor *ostor, uint64_t cid, int *order)
+{
+	int i, j, num = 0;
+	double u, sc, score[OSTORC_MAX_DISK];
+
+	for (i = 0; i < ostor->num_disk; ++i) {
+		if (ostor_disk_is_failed(ostor, i))
+			continue;
+		u = ((ostor_mix64(cid ^ ostor_mix64(i + 1)) >> 11) + 0.5) /
+			9007199254740992.0;
+		sc = ostor->disks[i].weight / -log(u);
+		for (j = num; (j > 0) && (score[j - 1] < sc); --j) {
+			score[j] = score[j - 1];
+			order[j] = order[j - 1];
+		}
+		score[j] = sc;
+		order[j] = i;
+		num++;
+	}
+	return num;
+}
+
+/** Check whether a disk as a whole still works.
+ *
+ * We look at the data directory, then create and remove a directory in it.
+ *
+ * Should be called with no locks held.
+ *
+ * @param ostor		The ostor
+ * @param disk		The disk
+ *
+ * @return		0 if the disk works; a positive error code otherwise
+ */
+static int ostor_probe_disk(struct ostor *ostor, int disk)
+{
+	struct stat st;
+	char tpath[PATH_MAX];
+	const char *path = ostor->disks[disk].path;
+
+	if (stat(path, &st))
+		return errno;
+	if (!S_ISDIR(st.st_mode))
+		return ENOTDIR;
+	if (zsnprintf(tpath, sizeof(tpath), "%s/%s", path, OSTOR_TEST_DIR))
+		return ENAMETOOLONG;
+	/* We may have crashed in the middle of a probe before */
+	if (rmdir(tpath) && (errno != ENOENT))
+		return errno;
+	if (mkdir(tpath, 0770))
+		return errno;
+	if (rmdir(tpath))
+		return errno;
+	return 0;
+}
+
+/** Mark a disk as failed if an error looks like the disk's fault.
+ *
+ * A bad sector only breaks the chunks that are on it, so an error alone isn't
+ * enough.  We probe the disk, and only fail it if the probe fails too, or if
+ * the disk has returned more than OSTOR_DISK_MAX_ERR errors.  If another
+ * thread is already probing the disk, we leave the decision to it.
+ *
+ * Should be called with no locks held.
+ *
+ * @param ostor		The ostor
+ * @param disk		The disk
+ * @param err		An error code, positive or negative.  0 is ignored.
+ */
+static void ostor_check_disk_error(struct ostor *ostor, int disk, int err)
+{
+	int ret, num_err;
+	struct ostor_disk *d = &ostor->disks[disk];
+
+	err = FORCE_POSITIVE(err);
+	switch (err) {
+	case EIO:
+	case EROFS:
+	case ENODEV:
+	case ENXIO:
+		break;
+	default:
+		return;
+	}
+	if (ostor_disk_is_failed(ostor, disk))
+		return;
+	num_err = __atomic_add_fetch(&d->num_err, 1, __ATOMIC_ACQ_REL);
+	if (num_err > OSTOR_DISK_MAX_ERR) {
+		glitch_log("ostor: disk %d (%s) has returned %d errors.\n",
+			disk, d->path, num_err);
+		ostor_fail_disk(ostor, disk);
+		return;
+	}
+	if (__atomic_exchange_n(&d->probing, 1, __ATOMIC_ACQ_REL))
+		return;
+	ret = ostor_probe_disk(ostor, disk);
+	__atomic_store_n(&d->probing, 0, __ATOMIC_RELEASE);
+	if (ret) {
+		glitch_log("ostor: got error %d (%s) from disk %d (%s), and "
+			"then it failed a probe with error %d (%s).\n",
+			err, terror(err), disk, d->path, ret, terror(ret));
+		ostor_fail_disk(ostor, disk);
+		return;
+	}
+	glitch_log("ostor: got error %d (%s) from disk %d (%s), but it passed "
+		"a probe.  Treating it as an error in one chunk.\n",
+		err, terror(err), disk, d->path);
+}
+
+/** Handle an error reading a chunk's data.
+ *
+ * If the disk survives the error, the chunk is reported as corrupt, so that
+ * it can be replaced from another replica.
+ *
+ * Should be called with no locks held.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param err		An error code, positive or negative
+ */
+static void ochunk_check_read_error(struct ostor *ostor, struct ochunk *ch,
+		int err)
+{
+	ostor_check_disk_error(ostor, ch->disk, err);
+	if ((FORCE_POSITIVE(err) == EIO) &&
+			(!ostor_disk_is_failed(ostor, ch->disk)))
+		ostor_report_corrupt(ostor, ch->cid);
+}
+
+static int ostor_shard_init(struct ostor_shard *sh)
+{
+	int ret;
+
+	ret = pthread_mutex_init(&sh->lock, NULL);
+	if (ret)
+		return ret;
+	ret = pthread_cond_init_mt(&sh->wait_cond);
+	if (ret) {
+		pthread_mutex_destroy(&sh->lock);
+		return ret;
+	}
+	ret = pthread_mutex_init(&sh->create_lock, NULL);
+	if (ret) {
+		pthread_cond_destroy(&sh->wait_cond);
+		pthread_mutex_destroy(&sh->lock);
+		return ret;
+	}
+	RB_INIT(&sh->cid_head);
+	TAILQ_INIT(&sh->clock_head);
+	sh->num_chunk = 0;
+	sh->num_waiters = 0;
+	return 0;
+}
+
+/** Wait for the state of a chunk in this shard to change.
+ *
+ * Should be called with the shard lock held.
+ *
+ * @param sh		The shard
+ */
+static void ostor_shard_wait(struct ostor_shard *sh)
+{
+	sh->num_waiters++;
+	pthread_cond_wait(&sh->wait_cond, &sh->lock);
+	sh->num_waiters--;
+}
+
+/** Wake up anyone waiting for the state of a chunk in this shard to change.
+ *
+ * Should be called with the shard lock held.
+ *
+ * @param sh		The shard
+ */
+static void ostor_shard_wake(struct ostor_shard *sh)
+{
+	if (sh->num_waiters > 0)
+		pthread_cond_broadcast(&sh->wait_cond);
+}
+
+static void ostor_shard_free(struct ostor_shard *sh)
+{
+	int res;
+	struct ochunk *ch, *ch_tmp;
+
+	TAILQ_FOREACH_SAFE(ch, &sh->clock_head, clock_entry, ch_tmp) {
+		if (ch->fd >= 0)
+			RETRY_ON_EINTR(res, close(ch->fd));
+		if (ch->csum_fd >= 0)
+			safe_close(ch->csum_fd);
+		if (ch->dfd >= 0)
+			safe_close(ch->dfd);
+		free(ch);
+	}
+	pthread_mutex_destroy(&sh->create_lock);
+	pthread_cond_destroy(&sh->wait_cond);
+	pthread_mutex_destroy(&sh->lock);
+}
+
+/** Set up one of the ostor's data directories.
+ *
+ * If the directory can't be used, this fails, but disk->path is still filled
+ * in.
+ *
+ * @param disk		(out param) the disk
+ * @param path		Path to the data directory
+ * @param weight	The disk's weight, or 0 to use the size of the
+ *			filesystem
+ * @param lay		The configured layout.  Data directories which
+ *			already have chunks keep their own layout.
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ostor_disk_init(struct ostor_disk *disk, const char *path,
+		int weight, const struct olayout *lay)
+{
+	int ret;
+	struct statvfs vfs;
+	char tpath[PATH_MAX];
+
+	disk->path = strdup(path);
+	if (!disk->path)
+		return ENOMEM;
+	disk->weight = 1;
+	/* create the ostor directory if it doesn't already exist. */
+	if (mkdir(path, 0770) < 0) {
+		ret = errno;
+		if (ret != EEXIST) {
+			glitch_log("ostor_init: Failed to create directory "
+				"'%s': error %d (%s)\n", path,
+				ret, terror(ret));
+			return ret;
+		}
+	}
+	ret = zsnprintf(tpath, sizeof(tpath), "%s/%s",
+		path, OSTOR_TEST_DIR);
+	if (ret) {
+		glitch_log("ostor_init: ostor path was too long at %Zd "
+			"bytes!\n", strlen(path));
+		return ENAMETOOLONG;
+	}
+	if (mkdir(tpath, 0770) < 0) {
+		ret = errno;
+		glitch_log("ostor_init: failed to create directory '%s'.  "
+			"Error %d: %s.  Have you set appropriate permissions "
+			"on the ostor_path?\n", tpath, ret, terror(ret));
+		return ret;
 	}
 	if (rmdir(tpath)) {
 		ret = errno;
 		glitch_log("ostor_init: failed to remove directory '%s'. "
 			"Error %d: %s.\n", tpath, ret, terror(ret));
+		return ret;
+	}
+	ret = zsnprintf(tpath, sizeof(tpath), "%s/%s", path,
+		OLAYOUT_LEGACY_DIR);
+	if (ret)
+		return ENAMETOOLONG;
+	disk->has_legacy = (access(tpath, F_OK) == 0);
+	ret = olayout_load(path, &disk->layout);
+	if (ret == -ENOENT) {
+		disk->layout = *lay;
+		ret = olayout_store(path, lay);
+		if (ret) {
+			glitch_log("ostor_init: failed to record the layout "
+				"of '%s'.  Error %d: %s.\n", path, ret,
+				terror(ret));
+			return FORCE_POSITIVE(ret);
+		}
+	}
+	else if (ret == -EINPROGRESS) {
+		glitch_log("ostor_init: moving '%s' to a new layout was "
+			"interrupted.  Run fishrelayout on it again.\n", path);
+		return EINPROGRESS;
+	}
+	else if (ret) {
+		glitch_log("ostor_init: failed to read the layout of '%s'. "
+			"Error %d: %s.\n", path, ret, terror(ret));
+		return FORCE_POSITIVE(ret);
+	}
+	else if (disk->layout.levels == 0) {
+		glitch_log("ostor_init: '%s' uses the legacy layout, in which "
+			"some chunks can't be told apart.  Run fishrelayout "
+			"on it to move it to the configured layout.\n", path);
+	}
+	else if (!olayout_equal(&disk->layout, lay)) {
+		glitch_log("ostor_init: '%s' has %d directory levels of %d "
+			"bits, rather than the configured %d levels of %d "
+			"bits.  Keeping its layout.  Run fishrelayout on it to "
+			"change it.\n", path, disk->layout.levels,
+			disk->layout.bits, lay->levels, lay->bits);
+	}
+	if (weight > 0) {
+		disk->weight = weight;
+	}
+	else if (statvfs(path, &vfs) == 0) {
+		/* Weigh the disk by its size in megabytes */
+		disk->weight = ((uint64_t)vfs.f_blocks * vfs.f_frsize) >> 20;
+		if (disk->weight == 0)
+			disk->weight = 1;
+	}
+	return 0;
+}
+
+/** Open the pack store of one of the ostor's data directories.
+ *
+ * If we aren't packing new chunks, the pack store is only opened if it already
+ * exists, so that the chunks which were packed earlier can still be found.
+ *
+ * @param disk		The disk
+ * @param pack_max	Largest chunk to pack, or 0 not to pack new chunks
+ * @param seg_sz	Size of the pack store's segment files
+ *
+ * @return		0 on success; a positive error code otherwise
+ */
+static int ostor_disk_open_pack(struct ostor_disk *disk, uint32_t pack_max,
+		uint64_t seg_sz)
+{
+	int ret;
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (pack_max == 0) {
+		if (zsnprintf(path, sizeof(path), "%s/%s", disk->path,
+				OPACK_DIR))
+			return ENAMETOOLONG;
+		if (stat(path, &st))
+			return 0;
+	}
+	disk->pack = opack_open(disk->path, pack_max, seg_sz);
+	if (IS_ERR(disk->pack)) {
+		ret = PTR_ERR(disk->pack);
+		disk->pack = NULL;
+		glitch_log("ostor_init: failed to open the pack store in '%s'. "
+			"Error %d: %s.\n", disk->path, ret, terror(ret));
+		return ret;
+	}
+	return 0;
+}
+
+struct ostor *ostor_init(const struct ostorc *oconf)
+{
+	int i, ret, num_disk, num_ok, fds_per_chunk;
+	struct ostor *ostor;
+	struct oio_conf ioconf;
+	struct ostor_disk *disk;
+	struct olayout lay;
+	uint64_t pack_seg_sz;
+
+	num_disk = 0;
+	if (oconf->ostor_disk) {
+		while (oconf->ostor_disk[num_disk])
+			num_disk++;
+	}
+	if (num_disk > OSTORC_MAX_DISK) {
+		ret = EINVAL;
 		goto error;
 	}
 	ostor = calloc(1, sizeof(struct ostor)); 
 	if (!ostor) {
-		ret = -ENOMEM;
+		ret = ENOMEM;
 		goto error;
 	}
-	ostor->dir_path = strdup(oconf->ostor_path);
-	if (!ostor->dir_path) {
-		ret = -ENOMEM;
+	/* If no disks were listed, use ostor_path */
+	ostor->num_disk = num_disk ? num_disk : 1;
+	ostor->disks = calloc(ostor->num_disk, sizeof(struct ostor_disk));
+	if (!ostor->disks) {
+		ret = ENOMEM;
 		goto error_free_ostor;
 	}
+	lay.levels = (oconf->ostor_dir_levels > 0) ?
+		oconf->ostor_dir_levels : OLAYOUT_DEFAULT_LEVELS;
+	lay.bits = (oconf->ostor_dir_bits > 0) ?
+		oconf->ostor_dir_bits : OLAYOUT_DEFAULT_BITS;
+	if (oconf->ostor_pack_kb > 0)
+		ostor->pack_max = (uint32_t)oconf->ostor_pack_kb * 1024;
+	pack_seg_sz = (oconf->ostor_pack_seg_mb > 0) ?
+		oconf->ostor_pack_seg_mb : OSTOR_DEFAULT_PACK_SEG_MB;
+	pack_seg_sz <<= 20;
+	ostor->pack_ival = (oconf->ostor_pack_ival > 0) ?
+		oconf->ostor_pack_ival : OSTOR_DEFAULT_PACK_IVAL;
+	/* A disk that we can't use is marked as failed, rather than stopping
+	 * the OSD from starting.  But we need at least one disk. */
+	num_ok = 0;
+	for (i = 0; i < ostor->num_disk; ++i) {
+		disk = &ostor->disks[i];
+		if (num_disk) {
+			ret = ostor_disk_init(disk,
+				oconf->ostor_disk[i]->path,
+				oconf->ostor_disk[i]->weight, &lay);
+		}
+		else {
+			ret = ostor_disk_init(disk, oconf->ostor_path, 0,
+				&lay);
+		}
+		if (!disk->path)
+			goto error_free_disks;
+		if (ret == 0) {
+			ret = ostor_disk_open_pack(disk, ostor->pack_max,
+				pack_seg_sz);
+		}
+		if (ret) {
+			disk->failed = 1;
+			continue;
+		}
+		if (disk->pack)
+			ostor->num_pack++;
+		num_ok++;
+	}
+	if (num_ok == 0)
+		goto error_free_disks;
+	if (oconf->ostor_coalesce_kb > 0)
+		ostor->coalesce_max = (uint32_t)oconf->ostor_coalesce_kb * 1024;
+	if (oconf->ostor_prealloc_kb > 0)
+		ostor->prealloc_sz = (uint64_t)oconf->ostor_prealloc_kb * 1024;
+	if (oconf->ostor_chunk_kb > 0)
+		ostor->chunk_sz = (uint64_t)oconf->ostor_chunk_kb * 1024;
+	if (oconf->ostor_direct_kb > 0)
+		ostor->direct_min = (uint32_t)oconf->ostor_direct_kb * 1024;
+	/* Each open chunk uses two file descriptors: one for the data, and one
+	 * for the checksums.  With direct I/O, it may use a third for writing
+	 * the data. */
+	fds_per_chunk = ostor->direct_min ? 3 : 2;
+	for (i = 0; i < ostor->num_disk; ++i) {
+		disk = &ostor->disks[i];
+		disk->max_open = oconf->ostor_max_open /
+			(fds_per_chunk * ostor->num_disk);
+		if (disk->max_open < 1)
+			disk->max_open = 1;
+	}
 	ostor->shutdown = 0;
-	ostor->num_open = 0;
-	ostor->max_open = oconf->ostor_max_open;
 	ostor->atime_timeo = oconf->ostor_timeo;
 	ret = pthread_mutex_init(&ostor->lock, NULL);
 	if (ret) {
-		goto error_free_dir_path;
+		goto error_free_disks;
 	}
 	ret = pthread_cond_init_mt(&ostor->lru_cond);
 	if (ret) {
@@ -339,161 +1422,1405 @@ struct ostor *ostor_init(const struct ostorc *oconf)
 	if (ret) {
 		goto error_free_lru_cond;
 	}
-	RB_INIT(&ostor->cid_head);
-	RB_INIT(&ostor->atime_head);
+	ret = pthread_cond_init_mt(&ostor->pack_cond);
+	if (ret) {
+		goto error_free_alloc_cond;
+	}
+	for (i = 0; i < OSTOR_NUM_SHARDS; ++i) {
+		ret = ostor_shard_init(&ostor->shards[i]);
+		if (ret)
+			goto error_free_shards;
+	}
+	ostor->clock_hand = 0;
+	memset(&ioconf, 0, sizeof(ioconf));
+	ioconf.num_disk = ostor->num_disk;
+	ioconf.depth = oconf->ostor_io_depth;
+	ioconf.use_uring = oconf->ostor_io_uring;
+	ostor->oio = oio_init(&ioconf);
+	if (IS_ERR(ostor->oio)) {
+		ret = PTR_ERR(ostor->oio);
+		glitch_log("ostor_init: failed to create the I/O engine: "
+			"error %d (%s)\n", ret, terror(ret));
+		goto error_free_shards;
+	}
 	ret = redfish_thread_create(g_fast_log_mgr, &ostor->lru_thread,
 		ostor_lru_thread, ostor);
 	if (ret) {
-		goto error_free_alloc_cond;
+		goto error_free_oio;
+	}
+	if (ostor->num_pack > 0) {
+		ret = redfish_thread_create(g_fast_log_mgr,
+			&ostor->pack_thread, ostor_pack_thread, ostor);
+		if (ret) {
+			goto error_join_lru;
+		}
 	}
 	return ostor;
 
-error_free_alloc_cond:
-	pthread_cond_destroy(&ostor->alloc_cond);
-error_free_lru_cond:
-	pthread_cond_destroy(&ostor->lru_cond);
-error_free_lock:
-	pthread_mutex_destroy(&ostor->lock);
-error_free_dir_path:
-	free(ostor->dir_path);
-error_free_ostor:
-	free(ostor);
-error:
-	return ERR_PTR(ret);
+error_join_lru:
+	pthread_mutex_lock(&ostor->lock);
+	__atomic_store_n(&ostor->shutdown, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&ostor->lru_cond);
+	pthread_mutex_unlock(&ostor->lock);
+	redfish_thread_join(&ostor->lru_thread);
+error_free_oio:
+	oio_shutdown(ostor->oio);
+	oio_free(ostor->oio);
+error_free_shards:
+	for (--i; i >= 0; --i)
+		ostor_shard_free(&ostor->shards[i]);
+	pthread_cond_destroy(&ostor->pack_cond);
+error_free_alloc_cond:
+	pthread_cond_destroy(&ostor->alloc_cond);
+error_free_lru_cond:
+	pthread_cond_destroy(&ostor->lru_cond);
+error_free_lock:
+	pthread_mutex_destroy(&ostor->lock);
+error_free_disks:
+	for (i = 0; i < ostor->num_disk; ++i) {
+		if (ostor->disks[i].pack)
+			opack_close(ostor->disks[i].pack);
+		free(ostor->disks[i].path);
+	}
+	free(ostor->disks);
+error_free_ostor:
+	free(ostor);
+error:
+	return ERR_PTR(ret);
+}
+
+void ostor_shutdown(struct ostor *ostor)
+{
+	int i;
+	struct ostor_shard *sh;
+
+	/* Let the I/O that's already in progress finish, so that its chunks
+	 * are released. */
+	oio_shutdown(ostor->oio);
+	pthread_mutex_lock(&ostor->lock);
+	__atomic_store_n(&ostor->shutdown, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&ostor->lru_cond);
+	pthread_cond_broadcast(&ostor->alloc_cond);
+	pthread_cond_broadcast(&ostor->pack_cond);
+	pthread_mutex_unlock(&ostor->lock);
+	for (i = 0; i < OSTOR_NUM_SHARDS; ++i) {
+		sh = &ostor->shards[i];
+		pthread_mutex_lock(&sh->lock);
+		ostor_shard_wake(sh);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	redfish_thread_join(&ostor->lru_thread);
+	if (ostor->num_pack > 0)
+		redfish_thread_join(&ostor->pack_thread);
+}
+
+void ostor_free(struct ostor *ostor)
+{
+	int i;
+
+	oio_free(ostor->oio);
+	for (i = 0; i < OSTOR_NUM_SHARDS; ++i)
+		ostor_shard_free(&ostor->shards[i]);
+	pthread_cond_destroy(&ostor->pack_cond);
+	pthread_cond_destroy(&ostor->alloc_cond);
+	pthread_cond_destroy(&ostor->lru_cond);
+	pthread_mutex_destroy(&ostor->lock);
+	for (i = 0; i < ostor->num_disk; ++i) {
+		if (ostor->disks[i].pack)
+			opack_close(ostor->disks[i].pack);
+		free(ostor->disks[i].path);
+	}
+	free(ostor->disks);
+	free(ostor);
+}
+
+/************************** pack *******************************/
+/** Find the disk whose pack store holds a chunk
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ *
+ * @return		The index of the disk, or -1 if the chunk isn't packed
+ *			or the ostor is shutting down
+ */
+static int ostor_pack_find(struct ostor *ostor, uint64_t cid)
+{
+	int disk;
+
+	if ((ostor->num_pack == 0) || ostor_is_shutdown(ostor))
+		return -1;
+	for (disk = 0; disk < ostor->num_disk; ++disk) {
+		if ((!ostor->disks[disk].pack) ||
+				ostor_disk_is_failed(ostor, disk))
+			continue;
+		if (opack_lookup(ostor->disks[disk].pack, cid))
+			return disk;
+	}
+	return -1;
+}
+
+/** Find out whether a chunk has a file of its own
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ *
+ * @return		1 if it has; 0 if it hasn't
+ */
+static int ostor_has_file(struct ostor *ostor, uint64_t cid)
+{
+	int disk;
+	char path[PATH_MAX];
+	struct ochunk exemplar, *ch;
+	struct ostor_shard *sh;
+
+	memset(&exemplar, 0, sizeof(exemplar));
+	exemplar.cid = cid;
+	sh = ostor_cid_to_shard(ostor, cid);
+	pthread_mutex_lock(&sh->lock);
+	ch = RB_FIND(ochunks_by_cid, &sh->cid_head, &exemplar);
+	pthread_mutex_unlock(&sh->lock);
+	if (ch)
+		return 1;
+	for (disk = 0; disk < ostor->num_disk; ++disk) {
+		if (ostor_disk_is_failed(ostor, disk))
+			continue;
+		ochunk_get_path(ostor, disk, path, sizeof(path), cid);
+		if (access(path, F_OK) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/** Translate an error from a pack store
+ *
+ * A corrupt chunk is marked as bad in its pack store, so that nobody reads it
+ * again, and reported through ostor_take_corrupt, so that it gets replaced.
+ *
+ * @param ostor		The ostor
+ * @param disk		The disk the pack store is on
+ * @param cid		The chunk ID
+ * @param err		The error
+ *
+ * @return		The error to return to our caller
+ */
+static int ostor_pack_error(struct ostor *ostor, int disk, uint64_t cid,
+		int err)
+{
+	if (err == -EBADMSG) {
+		glitch_log("ostor error: packed chunk 0x%016" PRIx64 " on disk "
+			"%d is corrupt.\n", cid, disk);
+		opack_mark_bad(ostor->disks[disk].pack, cid);
+		ostor_report_corrupt(ostor, cid);
+		return -EIO;
+	}
+	ostor_check_disk_error(ostor, disk, err);
+	return err;
+}
+
+/** Move a packed chunk into a file of its own, and append to it
+ *
+ * While the chunk is being moved, the pack store holds back other writes to
+ * it.  Reads still find it in the pack store until the move is done.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param disk		The disk whose pack store holds the chunk
+ * @param cid		The chunk ID
+ * @param data		The data to append
+ * @param dlen		Length of data
+ *
+ * @return		0 on success; -ENOENT if the chunk is no longer packed;
+ *			a negative error code otherwise
+ */
+static int ostor_pack_evict(struct ostor *ostor, struct fast_log_buf *fb,
+		int disk, uint64_t cid, const char *data, int32_t dlen)
+{
+	int ret;
+	char *old = NULL, *buf;
+	uint32_t olen = 0;
+	struct opack *pk = ostor->disks[disk].pack;
+
+	ret = opack_evict_start(pk, cid, &old, &olen);
+	if (ret == -ENOENT)
+		return ret;
+	else if (ret)
+		return ostor_pack_error(ostor, disk, cid, ret);
+	buf = realloc(old, (size_t)olen + dlen);
+	if (!buf) {
+		free(old);
+		opack_evict_finish(pk, cid, 0);
+		return -ENOMEM;
+	}
+	memcpy(buf + olen, data, dlen);
+	/* If we crashed while moving the chunk before, there may be part of
+	 * a copy left over. */
+	ret = ostor_unlink_file(ostor, fb, cid);
+	if ((ret == 0) || (ret == -ENOENT))
+		ret = ostor_write_file(ostor, fb, cid, buf, olen + dlen);
+	free(buf);
+	if (ret) {
+		opack_evict_finish(pk, cid, 0);
+		ostor_unlink_file(ostor, fb, cid);
+		return ret;
+	}
+	ret = opack_evict_finish(pk, cid, 1);
+	if (ret) {
+		/* Don't leave the chunk in two places */
+		ostor_unlink_file(ostor, fb, cid);
+		return ostor_pack_error(ostor, disk, cid, ret);
+	}
+	return 0;
+}
+
+/** Decide where a chunk that isn't packed should go, and create it there
+ *
+ * If the chunk doesn't have a file either, it is new.  Small new chunks are
+ * packed.  Other new chunks get an empty file before the create lock is
+ * dropped, so that a small write racing with this one sees the file and
+ * doesn't pack the chunk as well.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param data		The data to write
+ * @param dlen		Length of the data to write
+ *
+ * @return		1 if the write should go to the chunk's file; 0 if the
+ *			chunk was packed; -ENOENT if someone else packed the
+ *			chunk first; a negative error code otherwise
+ */
+static int ostor_pack_create(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, const char *data, int32_t dlen)
+{
+	int ret, disk, order[OSTORC_MAX_DISK];
+	struct ostor_shard *sh;
+	struct ochunk *ch;
+
+	if ((ostor->pack_max == 0) || ostor_is_shutdown(ostor))
+		return 1;
+	if (ostor_has_file(ostor, cid))
+		return 1;
+	sh = ostor_cid_to_shard(ostor, cid);
+	pthread_mutex_lock(&sh->create_lock);
+	if (ostor_pack_find(ostor, cid) >= 0) {
+		ret = -ENOENT;
+		goto done;
+	}
+	if (ostor_has_file(ostor, cid)) {
+		ret = 1;
+		goto done;
+	}
+	if (ostor_place_cid(ostor, cid, order) == 0) {
+		ret = 1;
+		goto done;
+	}
+	disk = order[0];
+	ret = -EFBIG;
+	if (((uint32_t)dlen <= ostor->pack_max) && ostor->disks[disk].pack) {
+		ret = opack_append(ostor->disks[disk].pack, cid, data, dlen, 1);
+		if (ret && (ret != -EFBIG) && (ret != -ENOENT))
+			ret = ostor_pack_error(ostor, disk, cid, ret);
+	}
+	if (ret == -EFBIG) {
+		pthread_mutex_lock(&sh->lock);
+		ch = ostor_get_ochunk(ostor, sh, fb, cid, 1);
+		pthread_mutex_unlock(&sh->lock);
+		ret = IS_ERR(ch) ? FORCE_NEGATIVE(PTR_ERR(ch)) : 1;
+	}
+done:
+	pthread_mutex_unlock(&sh->create_lock);
+	return ret;
+}
+
+/** Write to a packed chunk, or pack a new one
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param data		The data to write
+ * @param dlen		Length of the data to write
+ *
+ * @return		1 if the chunk isn't packed, and shouldn't be, so the
+ *			write should go to its file; 0 on success; a negative
+ *			error code otherwise
+ */
+static int ostor_pack_write(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, const char *data, int32_t dlen)
+{
+	int ret, disk;
+
+	if ((ostor->num_pack == 0) || (dlen < 0) || (cid == RF_INVAL_CID))
+		return 1;
+	while (1) {
+		disk = ostor_pack_find(ostor, cid);
+		if (disk < 0) {
+			ret = ostor_pack_create(ostor, fb, cid, data, dlen);
+		}
+		else {
+			ret = opack_append(ostor->disks[disk].pack, cid,
+				data, dlen, 0);
+			if (ret == -EFBIG) {
+				ret = ostor_pack_evict(ostor, fb, disk, cid,
+					data, dlen);
+			}
+			else if (ret && (ret != -ENOENT)) {
+				ret = ostor_pack_error(ostor, disk, cid, ret);
+			}
+		}
+		/* If the chunk was moved, unlinked or packed while we weren't
+		 * looking, start again. */
+		if (ret != -ENOENT)
+			return ret;
+	}
+}
+
+/** Read from a packed chunk
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ * @param off		The offset to read from
+ * @param data		(out param) The buffer to read into
+ * @param dlen		The amount to read
+ *
+ * @return		the number of bytes read on success; -ENOENT if the
+ *			chunk isn't packed; a negative error code otherwise
+ */
+static int32_t ostor_pack_read(struct ostor *ostor, uint64_t cid,
+		uint64_t off, char *data, int32_t dlen)
+{
+	int disk;
+	int32_t ret;
+
+	disk = ostor_pack_find(ostor, cid);
+	if (disk < 0)
+		return -ENOENT;
+	ret = opack_read(ostor->disks[disk].pack, cid, off, data, dlen);
+	if ((ret < 0) && (ret != -ENOENT))
+		ret = ostor_pack_error(ostor, disk, cid, ret);
+	return ret;
+}
+
+/** Unlink a packed chunk
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ *
+ * @return		0 on success; -ENOENT if the chunk isn't packed; a
+ *			negative error code otherwise
+ */
+static int ostor_pack_unlink(struct ostor *ostor, uint64_t cid)
+{
+	int ret, disk;
+
+	disk = ostor_pack_find(ostor, cid);
+	if (disk < 0)
+		return -ENOENT;
+	ret = opack_unlink(ostor->disks[disk].pack, cid);
+	if (ret && (ret != -ENOENT))
+		ret = ostor_pack_error(ostor, disk, cid, ret);
+	return ret;
+}
+
+/** Pin a packed chunk
+ *
+ * @param ostor		The ostor
+ * @param cid		The chunk ID
+ * @param ext		(out param) The part of the segment file that holds
+ *			the chunk
+ *
+ * @return		The pinned chunk on success; ERR_PTR(ENOENT) if the
+ *			chunk isn't packed; ERR_PTR(EXDEV) if it can't be
+ *			pinned; another error pointer otherwise
+ */
+static struct ochunk *ostor_pack_pin(struct ostor *ostor, uint64_t cid,
+		struct ostor_extent *ext)
+{
+	int ret, disk;
+	struct ochunk *ch;
+
+	disk = ostor_pack_find(ostor, cid);
+	if (disk < 0)
+		return ERR_PTR(ENOENT);
+	ch = calloc(1, sizeof(struct ochunk));
+	if (!ch)
+		return ERR_PTR(ENOMEM);
+	ch->cid = cid;
+	ch->disk = disk;
+	ch->fd = -1;
+	ch->csum_fd = -1;
+	ch->dfd = -1;
+	ch->packed = 1;
+	ret = opack_pin(ostor->disks[disk].pack, cid, &ext->fd, &ext->off,
+		&ext->len, &ch->pseg);
+	if (ret) {
+		free(ch);
+		if (ret != -ENOENT)
+			ret = ostor_pack_error(ostor, disk, cid, ret);
+		return ERR_PTR(FORCE_POSITIVE(ret));
+	}
+	return ch;
+}
+
+int ostor_compact(struct ostor *ostor, struct fast_log_buf *fb)
+{
+	int ret, disk, freed, total = 0;
+
+	for (disk = 0; disk < ostor->num_disk; ++disk) {
+		if (ostor_is_shutdown(ostor))
+			return -ESHUTDOWN;
+		if ((!ostor->disks[disk].pack) ||
+				ostor_disk_is_failed(ostor, disk))
+			continue;
+		ret = opack_compact(ostor->disks[disk].pack, &freed);
+		fast_log_ostor(fb, FLOS_PACK_COMPACT, 0, disk, ret, freed);
+		if (ret) {
+			glitch_log("ostor_compact: failed to compact the pack "
+				"store on disk %d: error %d (%s)\n", disk, ret,
+				terror(ret));
+			ostor_check_disk_error(ostor, disk, ret);
+		}
+		total += freed;
+	}
+	return total;
+}
+
+int ostor_get_pack_stats(struct ostor *ostor, int disk,
+		struct opack_stats *st)
+{
+	if ((disk < 0) || (disk >= ostor->num_disk))
+		return -EINVAL;
+	if (!ostor->disks[disk].pack)
+		return -ENOENT;
+	opack_get_stats(ostor->disks[disk].pack, st);
+	return 0;
+}
+
+static int ostor_pack_thread(struct redfish_thread *rt)
+{
+	int res;
+	struct timespec ts;
+	struct ostor *ostor = rt->priv;
+
+	while (1) {
+		res = clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (res)
+			abort();
+		timespec_add_sec(&ts, ostor->pack_ival);
+		pthread_mutex_lock(&ostor->lock);
+		res = 0;
+		while ((!ostor->shutdown) && (res != ETIMEDOUT)) {
+			res = pthread_cond_timedwait(&ostor->pack_cond,
+				&ostor->lock, &ts);
+		}
+		if (ostor->shutdown) {
+			pthread_mutex_unlock(&ostor->lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&ostor->lock);
+		ostor_compact(ostor, rt->fb);
+	}
+}
+
+/************************** writes *******************************/
+/*
+ * Appends to a chunk are serialized.  At most one write to a chunk is in
+ * progress at once.  The thread which starts it becomes the chunk's writer,
+ * and owns the write-side fields of struct ochunk until the write finishes.
+ * Appends which arrive in the meantime wait in the chunk's write queue.  When
+ * the write finishes, the writer takes everything in the queue, up to
+ * coalesce_max bytes, and appends it with a single write.
+ *
+ * So a stream of small appends to one chunk costs one write, and one
+ * checksum update, per disk round trip, rather than one per append.  An
+ * append never waits for more than the one write ahead of it.
+ */
+
+/** Part of a write batch which is written with a single I/O */
+struct ostor_wseg {
+	/** Offset of the segment in the batch */
+	uint32_t start;
+	/** Length of the segment */
+	uint32_t len;
+	/** Nonzero if the segment is written with direct I/O */
+	int direct;
+};
+
+/** A batch of appends to one chunk, which are written together */
+struct ostor_wbatch {
+	/** The disk I/O request for the segment being written */
+	struct oio_req req;
+	/** The ostor */
+	struct ostor *ostor;
+	/** The chunk */
+	struct ochunk *ch;
+	/** The appends in the batch, linked through wnext */
+	struct ostor_aio *aios;
+	/** Buffer we allocated to gather the appends into, or NULL if we are
+	 * writing straight from the caller's buffer */
+	char *buf;
+	/** The data to append */
+	char *data;
+	/** Length of data */
+	uint32_t len;
+	/** Offset in the chunk that the data is appended at */
+	uint64_t off;
+	/** The segments that the batch is written in.  Only the part of the
+	 * batch between the first and last block boundaries can be written
+	 * with direct I/O, so there are at most three. */
+	struct ostor_wseg segs[3];
+	/** Number of segments */
+	int num_seg;
+	/** Index of the segment being written */
+	int cur_seg;
+};
+
+/** Reserve disk space for a chunk before appending to it.
+ *
+ * Chunks grow by many small appends.  Reserving space for them in large
+ * extents keeps them from being fragmented, and spares the filesystem from
+ * allocating blocks on every append.  We don't reserve space past the size we
+ * expect the chunk to reach, unless it has already grown past that.
+ *
+ * Errors are ignored.  If we can't reserve the space, the write will find out
+ * whether there is any.
+ *
+ * Should only be called by the chunk's writer.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param end		The size that the chunk will be after the append
+ */
+static void ochunk_prealloc(struct ostor *ostor, struct ochunk *ch,
+		uint64_t end)
+{
+	int ret;
+	uint64_t start, target;
+
+	if ((ostor->prealloc_sz == 0) || ch->no_prealloc)
+		return;
+	if (end <= ch->prealloc_end)
+		return;
+	target = ((end + ostor->prealloc_sz - 1) / ostor->prealloc_sz) *
+		ostor->prealloc_sz;
+	if ((end <= ostor->chunk_sz) && (target > ostor->chunk_sz))
+		target = ostor->chunk_sz;
+	start = (ch->prealloc_end > ch->wsize) ? ch->prealloc_end : ch->wsize;
+	ret = do_prealloc(ch->fd, start, target - start);
+	if (ret == 0)
+		ch->prealloc_end = target;
+	else if (ret == -EOPNOTSUPP)
+		ch->no_prealloc = 1;
+}
+
+/** Open a chunk for direct I/O, if it isn't already.
+ *
+ * Should only be called by the chunk's writer.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ *
+ * @return		1 if we can write the chunk with direct I/O; 0
+ *			otherwise
+ */
+static int ochunk_open_direct(struct ostor *ostor, struct ochunk *ch)
+{
+	int fd;
+	char path[PATH_MAX];
+
+	if (ch->dfd >= 0)
+		return 1;
+	if (ch->no_direct)
+		return 0;
+	ochunk_get_file_path(ostor, ch, path, sizeof(path));
+	fd = do_open_direct(path, O_WRONLY | O_CLOEXEC | O_NOATIME);
+	if (fd < 0) {
+		/* Fall back on buffered I/O for this chunk */
+		if (fd != -EOPNOTSUPP) {
+			glitch_log("ostor error: failed to open %s for direct "
+				"I/O: error %d (%s)\n", path, fd, terror(fd));
+			ostor_check_disk_error(ostor, ch->disk, fd);
+		}
+		ch->no_direct = 1;
+		return 0;
+	}
+	ch->dfd = fd;
+	return 1;
+}
+
+/** Start writing the current segment of a write batch
+ *
+ * @param wb		The batch
+ *
+ * @return		0 if the write was started; a negative error code
+ *			otherwise
+ */
+static int ostor_wbatch_submit(struct ostor_wbatch *wb)
+{
+	struct ostor_wseg *seg = &wb->segs[wb->cur_seg];
+
+	memset(&wb->req, 0, sizeof(wb->req));
+	wb->req.op = OIO_OP_WRITE;
+	wb->req.fd = seg->direct ? wb->ch->dfd : wb->ch->fd;
+	wb->req.buf = wb->data + seg->start;
+	wb->req.len = seg->len;
+	wb->req.off = wb->off + seg->start;
+	wb->req.cb = ostor_wbatch_done;
+	return oio_submit(wb->ostor->oio, wb->ch->disk, &wb->req);
+}
+
+/** Start writing a batch of appends to a chunk
+ *
+ * Large batches are written with direct I/O, if it is enabled, so that
+ * data which is about to be sent to the next replica and never read again
+ * doesn't push more useful pages out of the page cache.  Direct I/O needs
+ * aligned buffers, so those batches are always copied.
+ *
+ * Should only be called by the chunk's writer, with the shard lock released.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param aios		The appends, linked through wnext
+ *
+ * @return		0 if the write was started; a negative error code
+ *			otherwise
+ */
+static int ostor_wbatch_start(struct ostor *ostor, struct ochunk *ch,
+		struct ostor_aio *aios)
+{
+	int ret, n;
+	uint32_t len, head, mid, pad;
+	char *d;
+	struct ostor_aio *aio;
+	struct ostor_wbatch *wb;
+
+	wb = calloc(1, sizeof(struct ostor_wbatch));
+	if (!wb)
+		return -ENOMEM;
+	len = 0;
+	for (aio = aios; aio; aio = aio->wnext)
+		len += aio->req.len;
+	wb->ostor = ostor;
+	wb->ch = ch;
+	wb->aios = aios;
+	wb->len = len;
+	wb->off = ch->wsize;
+	head = (DIRECT_IO_ALIGN - (wb->off % DIRECT_IO_ALIGN)) %
+		DIRECT_IO_ALIGN;
+	mid = 0;
+	if ((ostor->direct_min > 0) && (len >= ostor->direct_min) &&
+			(len - head >= DIRECT_IO_ALIGN) &&
+			ochunk_open_direct(ostor, ch)) {
+		mid = ((len - head) / DIRECT_IO_ALIGN) * DIRECT_IO_ALIGN;
+	}
+	if ((mid == 0) && ((aios->wnext == NULL) || (len == 0))) {
+		/* There's nothing to gather */
+		wb->data = aios->req.buf;
+	}
+	else {
+		pad = 0;
+		if (mid) {
+			/* Line the direct part of the data up with the start
+			 * of a page */
+			pad = (DIRECT_IO_ALIGN - head) % DIRECT_IO_ALIGN;
+			if (posix_memalign((void**)&wb->buf, DIRECT_IO_ALIGN,
+					pad + len))
+				wb->buf = NULL;
+		}
+		else {
+			wb->buf = malloc(len);
+		}
+		if (!wb->buf) {
+			ret = -ENOMEM;
+			goto error_free_wb;
+		}
+		wb->data = wb->buf + pad;
+		d = wb->data;
+		for (aio = aios; aio; aio = aio->wnext) {
+			memcpy(d, aio->req.buf, aio->req.len);
+			d += aio->req.len;
+		}
+	}
+	n = 0;
+	if (mid == 0) {
+		wb->segs[n].start = 0;
+		wb->segs[n++].len = len;
+	}
+	else {
+		if (head > 0) {
+			wb->segs[n].start = 0;
+			wb->segs[n++].len = head;
+		}
+		wb->segs[n].start = head;
+		wb->segs[n].len = mid;
+		wb->segs[n++].direct = 1;
+		if (len > head + mid) {
+			wb->segs[n].start = head + mid;
+			wb->segs[n++].len = len - head - mid;
+		}
+	}
+	wb->num_seg = n;
+	wb->cur_seg = 0;
+	ochunk_prealloc(ostor, ch, wb->off + len);
+	ret = ostor_wbatch_submit(wb);
+	if (ret)
+		goto error_free_buf;
+	return 0;
+
+error_free_buf:
+	free(wb->buf);
+error_free_wb:
+	free(wb);
+	return ret;
+}
+
+/** Pop the next batch of appends off a chunk's write queue
+ *
+ * Should be called with the shard lock held, by the chunk's writer.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ *
+ * @return		The appends, linked through wnext, or NULL if the
+ *			queue is empty
+ */
+static struct ostor_aio *ochunk_wq_pop(struct ostor *ostor,
+		struct ochunk *ch)
+{
+	uint64_t len;
+	struct ostor_aio *head, *aio;
+
+	head = ch->wq_head;
+	if (!head)
+		return NULL;
+	len = head->req.len;
+	aio = head;
+	while (aio->wnext &&
+			(len + aio->wnext->req.len <= ostor->coalesce_max)) {
+		aio = aio->wnext;
+		len += aio->req.len;
+	}
+	ch->wq_head = aio->wnext;
+	if (!ch->wq_head)
+		ch->wq_tail = NULL;
+	aio->wnext = NULL;
+	return head;
+}
+
+/** Start the next write to a chunk, and finish the appends which are done.
+ *
+ * If the write queue is empty, we stop being the chunk's writer.  Once the
+ * finished appends have been released, the chunk may be evicted, so we must
+ * not touch it after that.
+ *
+ * Should be called with the shard lock released, by the chunk's writer.
+ *
+ * @param ostor		The ostor
+ * @param ch		The chunk
+ * @param done		The finished appends, linked through wnext, with their
+ *			results in req.res
+ */
+static void ochunk_write_next(struct ostor *ostor, struct ochunk *ch,
+		struct ostor_aio *done)
+{
+	int ret;
+	struct ostor_aio *next, *aio;
+	struct ostor_shard *sh;
+
+	sh = ostor_cid_to_shard(ostor, ch->cid);
+	while (1) {
+		pthread_mutex_lock(&sh->lock);
+		next = ochunk_wq_pop(ostor, ch);
+		if (!next)
+			ch->wbusy = 0;
+		pthread_mutex_unlock(&sh->lock);
+		if (!next)
+			break;
+		ret = ostor_wbatch_start(ostor, ch, next);
+		if (ret == 0)
+			break;
+		/* Fail the batch, and try the one after it */
+		for (aio = next; aio->wnext; aio = aio->wnext)
+			aio->req.res = ret;
+		aio->req.res = ret;
+		aio->wnext = done;
+		done = next;
+	}
+	while (done) {
+		aio = done;
+		done = aio->wnext;
+		ochunk_release(ostor, ch);
+		aio->cb(aio, aio->req.res);
+	}
+}
+
+static void ostor_wbatch_done(struct oio_req *req)
+{
+	struct ostor_wbatch *wb = GET_OUTER(req, struct ostor_wbatch, req);
+	struct ostor *ostor = wb->ostor;
+	struct ochunk *ch = wb->ch;
+	struct ostor_aio *aio;
+	int ret;
+
+	ret = req->res;
+	if ((ret == 0) && (++wb->cur_seg < wb->num_seg)) {
+		ret = ostor_wbatch_submit(wb);
+		if (ret == 0)
+			return;
+	}
+	if (ret == 0) {
+		ch->wsize += wb->len;
+		ret = ochunk_update_csum(ostor, ch, wb->data, wb->len);
+	}
+	else {
+		ostor_check_disk_error(ostor, ch->disk, ret);
+		/* We don't know how much of the batch made it to the disk */
+		ochunk_stat(ostor, ch);
+	}
+	for (aio = wb->aios; aio; aio = aio->wnext)
+		aio->req.res = ret;
+	aio = wb->aios;
+	free(wb->buf);
+	free(wb);
+	ochunk_write_next(ostor, ch, aio);
+}
+
+/** Append to a chunk, or queue the append if the chunk is being written.
+ *
+ * Should be called with the shard lock held, and a reference to the chunk
+ * taken on behalf of the append.  Returns with the shard lock released.
+ *
+ * @param ostor		The ostor
+ * @param sh		The shard
+ * @param ch		The chunk
+ * @param aio		The append
+ *
+ * @return		0 if the append was started or queued; a negative
+ *			error code otherwise, in which case the chunk
+ *			reference has been dropped
+ */
+static int ochunk_append(struct ostor *ostor, struct ostor_shard *sh,
+		struct ochunk *ch, struct ostor_aio *aio)
+{
+	int ret;
+
+	aio->wnext = NULL;
+	if (ch->wbusy) {
+		if (ch->wq_tail)
+			ch->wq_tail->wnext = aio;
+		else
+			ch->wq_head = aio;
+		ch->wq_tail = aio;
+		pthread_mutex_unlock(&sh->lock);
+		return 0;
+	}
+	ch->wbusy = 1;
+	pthread_mutex_unlock(&sh->lock);
+	ret = ostor_wbatch_start(ostor, ch, aio);
+	if (ret) {
+		/* Other appends may have been queued behind ours. */
+		ochunk_write_next(ostor, ch, NULL);
+		ochunk_release(ostor, ch);
+	}
+	return ret;
+}
+
+/** Waits for an append on behalf of ostor_write */
+struct ostor_sync_write {
+	struct ostor_aio aio;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	int res;
+};
+
+static void ostor_sync_write_cb(struct ostor_aio *aio, int res)
+{
+	struct ostor_sync_write *sw =
+		GET_OUTER(aio, struct ostor_sync_write, aio);
+
+	pthread_mutex_lock(&sw->lock);
+	sw->res = res;
+	sw->done = 1;
+	pthread_cond_signal(&sw->cond);
+	pthread_mutex_unlock(&sw->lock);
+}
+
+/** Append to a chunk's file, and wait for the append to finish
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param data		The data to write
+ * @param dlen		Length of the data to write
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int ostor_write_file(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, const char *data, int32_t dlen)
+{
+	int ret;
+	struct ostor_sync_write sw;
+
+	/* Synchronous writes go through the write queue too, so that they
+	 * are ordered with the asynchronous ones, and can be coalesced with
+	 * them. */
+	memset(&sw, 0, sizeof(sw));
+	ret = pthread_mutex_init(&sw.lock, NULL);
+	if (ret)
+		return FORCE_NEGATIVE(ret);
+	ret = pthread_cond_init(&sw.cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&sw.lock);
+		return FORCE_NEGATIVE(ret);
+	}
+	sw.aio.cb = ostor_sync_write_cb;
+	ret = ostor_aio_start(ostor, fb, cid, OIO_OP_WRITE, 0,
+			(char*)data, dlen, &sw.aio);
+	if (ret == 0) {
+		pthread_mutex_lock(&sw.lock);
+		while (!sw.done)
+			pthread_cond_wait(&sw.cond, &sw.lock);
+		ret = sw.res;
+		pthread_mutex_unlock(&sw.lock);
+	}
+	pthread_cond_destroy(&sw.cond);
+	pthread_mutex_destroy(&sw.lock);
+	return ret;
+}
+
+int ostor_write(struct ostor *ostor, struct fast_log_buf *fb, uint64_t cid,
+		const char *data, int32_t dlen)
+{
+	int ret;
+
+	ret = ostor_pack_write(ostor, fb, cid, data, dlen);
+	if (ret == 1)
+		ret = ostor_write_file(ostor, fb, cid, data, dlen);
+	fast_log_ostor(fb, FLOS_OCHUNK_WRITE, cid, 0, ret, dlen);
+	return ret;
+}
+
+int32_t ostor_read(struct ostor *ostor, struct fast_log_buf *fb, uint64_t cid,
+		uint64_t off, char *data, int32_t dlen)
+{
+	int ret, res;
+	struct ochunk *ch;
+	struct ostor_shard *sh;
+	struct ocsum_state st;
+
+	if (dlen < 0) {
+		ret = -EINVAL;
+		goto done;
+	}
+	if (cid == RF_INVAL_CID) {
+		ret = -EINVAL;
+		goto done;
+	}
+	ret = ostor_pack_read(ostor, cid, off, data, dlen);
+	if (ret != -ENOENT)
+		goto done;
+	sh = ostor_cid_to_shard(ostor, cid);
+	pthread_mutex_lock(&sh->lock);
+	ch = ostor_get_ochunk(ostor, sh, fb, cid, 0);
+	if (IS_ERR(ch)) {
+		pthread_mutex_unlock(&sh->lock);
+		ret = FORCE_NEGATIVE(PTR_ERR(ch));
+		goto done;
+	}
+	if (ch->csum_bad) {
+		pthread_mutex_unlock(&sh->lock);
+		ret = -EIO;
+		goto done;
+	}
+	ochunk_acquire(ch);
+	st = ch->csum;
+	pthread_mutex_unlock(&sh->lock);
+	ret = safe_pread(ch->fd, data, dlen, off);
+	if (ret < 0) {
+		ochunk_check_read_error(ostor, ch, ret);
+	}
+	else {
+		res = ochunk_verify_csum(ostor, ch, &st, off, data, ret);
+		if (res)
+			ret = res;
+	}
+	ochunk_release(ostor, ch);
+done:
+	if (ret < 0)
+		fast_log_ostor(fb, FLOS_OCHUNK_READ, cid, off, ret, dlen);
+	else
+		fast_log_ostor(fb, FLOS_OCHUNK_READ, cid, off, 0, ret);
+	return ret;
+}
+
+static void ostor_aio_done(struct oio_req *req)
+{
+	struct ostor_aio *aio = GET_OUTER(req, struct ostor_aio, req);
+	struct ochunk *ch = aio->ch;
+	int ret;
+
+	if (req->res < 0) {
+		if (req->op == OIO_OP_READ)
+			ochunk_check_read_error(aio->ostor, ch, req->res);
+		else
+			ostor_check_disk_error(aio->ostor, ch->disk, req->res);
+	}
+	else {
+		ret = ochunk_verify_csum(aio->ostor, ch, &aio->csum,
+			req->off, req->buf, req->res);
+		if (ret)
+			req->res = ret;
+	}
+	ochunk_release(aio->ostor, ch);
+	aio->cb(aio, req->res);
+}
+
+/** Start an asynchronous read or write
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param op		OIO_OP_READ or OIO_OP_WRITE
+ * @param off		Offset to read from.  Ignored for writes, which always
+ *			append.
+ * @param data		The buffer
+ * @param dlen		Length of the buffer
+ * @param aio		The request
+ *
+ * @return		0 if the I/O was started; a negative error code
+ *			otherwise
+ */
+static int ostor_aio_start(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, int op, uint64_t off, char *data, int32_t dlen,
+		struct ostor_aio *aio)
+{
+	int ret;
+	struct ochunk *ch;
+	struct ostor_shard *sh;
+
+	if (dlen < 0)
+		return -EINVAL;
+	if (cid == RF_INVAL_CID)
+		return -EINVAL;
+	sh = ostor_cid_to_shard(ostor, cid);
+	pthread_mutex_lock(&sh->lock);
+	ch = ostor_get_ochunk(ostor, sh, fb, cid, (op == OIO_OP_WRITE));
+	if (IS_ERR(ch)) {
+		pthread_mutex_unlock(&sh->lock);
+		return FORCE_NEGATIVE(PTR_ERR(ch));
+	}
+	if ((op == OIO_OP_READ) && ch->csum_bad) {
+		pthread_mutex_unlock(&sh->lock);
+		return -EIO;
+	}
+	ochunk_acquire(ch);
+	memset(&aio->req, 0, sizeof(aio->req));
+	aio->req.op = op;
+	aio->req.fd = ch->fd;
+	aio->req.buf = data;
+	aio->req.len = dlen;
+	aio->req.off = off;
+	aio->req.cb = ostor_aio_done;
+	aio->ostor = ostor;
+	aio->ch = ch;
+	if (op == OIO_OP_WRITE)
+		return ochunk_append(ostor, sh, ch, aio);
+	aio->csum = ch->csum;
+	pthread_mutex_unlock(&sh->lock);
+	ret = oio_submit(ostor->oio, ch->disk, &aio->req);
+	if (ret)
+		ochunk_release(ostor, ch);
+	return ret;
+}
+
+int ostor_write_async(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, const char *data, int32_t dlen,
+		struct ostor_aio *aio)
+{
+	int ret;
+
+	ret = ostor_pack_write(ostor, fb, cid, data, dlen);
+	if (ret == 1) {
+		ret = ostor_aio_start(ostor, fb, cid, OIO_OP_WRITE, 0,
+				(char*)data, dlen, aio);
+		fast_log_ostor(fb, FLOS_OCHUNK_WRITE, cid, 0, ret, dlen);
+		return ret;
+	}
+	fast_log_ostor(fb, FLOS_OCHUNK_WRITE, cid, 0, ret, dlen);
+	if (ret)
+		return ret;
+	/* Packed chunks are written right away */
+	aio->ostor = ostor;
+	aio->ch = NULL;
+	aio->cb(aio, 0);
+	return 0;
+}
+
+int ostor_read_async(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, uint64_t off, char *data, int32_t dlen,
+		struct ostor_aio *aio)
+{
+	int ret;
+
+	ret = -ENOENT;
+	if ((dlen >= 0) && (cid != RF_INVAL_CID))
+		ret = ostor_pack_read(ostor, cid, off, data, dlen);
+	if (ret == -ENOENT) {
+		ret = ostor_aio_start(ostor, fb, cid, OIO_OP_READ, off,
+				data, dlen, aio);
+		fast_log_ostor(fb, FLOS_OCHUNK_READ, cid, off, ret, dlen);
+		return ret;
+	}
+	fast_log_ostor(fb, FLOS_OCHUNK_READ, cid, off,
+		(ret < 0) ? ret : 0, dlen);
+	if (ret < 0)
+		return ret;
+	/* Packed chunks are read right away */
+	aio->ostor = ostor;
+	aio->ch = NULL;
+	aio->cb(aio, ret);
+	return 0;
+}
+
+int ostor_get_io_stats(struct ostor *ostor, int disk, struct oio_stats *st)
+{
+	return oio_get_stats(ostor->oio, disk, st);
 }
 
-void ostor_shutdown(struct ostor *ostor)
+int ostor_get_num_disk(const struct ostor *ostor)
+{
+	return ostor->num_disk;
+}
+
+int ostor_fail_disk(struct ostor *ostor, int disk)
 {
+	struct ostor_disk *d;
+
+	if ((disk < 0) || (disk >= ostor->num_disk))
+		return -EINVAL;
+	d = &ostor->disks[disk];
+	if (__atomic_exchange_n(&d->failed, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	glitch_log("ostor: disk %d (%s) has failed.  The chunks on it will "
+		"be treated as missing.\n", disk, d->path);
+	/* Nobody will get a file descriptor on this disk now, so stop asking
+	 * the LRU thread to find one, and wake up the waiters so that they
+	 * can go elsewhere. */
 	pthread_mutex_lock(&ostor->lock);
-	ostor->shutdown = 1;
-	pthread_cond_broadcast(&ostor->lru_cond);
+	ostor->need_lru -= d->need_lru;
+	d->need_lru = 0;
 	pthread_cond_broadcast(&ostor->alloc_cond);
 	pthread_mutex_unlock(&ostor->lock);
-	redfish_thread_join(&ostor->lru_thread);
+	return 0;
 }
 
-void ostor_free(struct ostor *ostor)
+int ostor_is_disk_failed(struct ostor *ostor, int disk)
 {
-	pthread_cond_destroy(&ostor->alloc_cond);
-	pthread_cond_destroy(&ostor->lru_cond);
-	pthread_mutex_destroy(&ostor->lock);
-	free(ostor->dir_path);
-	free(ostor);
+	if ((disk < 0) || (disk >= ostor->num_disk))
+		return -EINVAL;
+	return ostor_disk_is_failed(ostor, disk);
 }
 
-int ostor_write(struct ostor *ostor, struct fast_log_buf *fb, uint64_t cid,
-		const char *data, int32_t dlen)
+struct ochunk *ostor_pin(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, struct ostor_extent *ext)
 {
 	int ret;
 	struct ochunk *ch;
+	struct ostor_shard *sh;
+	struct stat st;
 
-	if (dlen < 0) {
-		ret = -EINVAL;
-		goto done;
-	}
 	if (cid == RF_INVAL_CID) {
-		ret = -EINVAL;
+		ch = ERR_PTR(EINVAL);
 		goto done;
 	}
-	pthread_mutex_lock(&ostor->lock);
-	ch = ostor_get_ochunk(ostor, fb, cid, 1);
+	ch = ostor_pack_pin(ostor, cid, ext);
+	if ((!IS_ERR(ch)) || (PTR_ERR(ch) != ENOENT))
+		goto done;
+	sh = ostor_cid_to_shard(ostor, cid);
+	pthread_mutex_lock(&sh->lock);
+	ch = ostor_get_ochunk(ostor, sh, fb, cid, 0);
 	if (IS_ERR(ch)) {
-		pthread_mutex_unlock(&ostor->lock);
-		ret = FORCE_NEGATIVE(PTR_ERR(ch));
+		pthread_mutex_unlock(&sh->lock);
 		goto done;
 	}
-	RB_REMOVE(ochunks_by_atime, &ostor->atime_head, ch);
-	ch->refcnt++;
-	pthread_mutex_unlock(&ostor->lock);
-	ret = safe_write(ch->fd, data, dlen);
-	ochunk_release(ostor, ch);
+	if (ch->csum_bad) {
+		/* Corrupt chunks can't be read, however they are read */
+		pthread_mutex_unlock(&sh->lock);
+		ch = ERR_PTR(EIO);
+		goto done;
+	}
+	ochunk_acquire(ch);
+	pthread_mutex_unlock(&sh->lock);
+	if (fstat(ch->fd, &st)) {
+		ret = errno;
+		ostor_check_disk_error(ostor, ch->disk, ret);
+		ochunk_release(ostor, ch);
+		ch = ERR_PTR(ret);
+		goto done;
+	}
+	ext->fd = ch->fd;
+	ext->off = 0;
+	ext->len = st.st_size;
 done:
-	fast_log_ostor(fb, FLOS_OCHUNK_WRITE, cid, 0, ret, dlen);
-	return ret;
+	fast_log_ostor(fb, FLOS_OCHUNK_PIN, cid, 0,
+		IS_ERR(ch) ? FORCE_NEGATIVE(PTR_ERR(ch)) : 0, 0);
+	return ch;
 }
 
-int32_t ostor_read(struct ostor *ostor, struct fast_log_buf *fb, uint64_t cid,
-		uint64_t off, char *data, int32_t dlen)
+int ostor_verify_pinned(struct ostor *ostor, struct ochunk *ch,
+		const struct ostor_extent *ext, uint64_t off, uint64_t len)
 {
 	int ret;
-	struct ochunk *ch;
+	int32_t res, amt;
+	char *buf;
+	struct ocsum_state st;
+	struct ostor_shard *sh;
 
-	if (dlen < 0) {
-		ret = -EINVAL;
-		goto done;
-	}
-	if (cid == RF_INVAL_CID) {
-		ret = -EINVAL;
-		goto done;
+	/* Packed chunks are checked when they are pinned */
+	if ((ch->packed) || (ch->csum_fd < 0) || (len == 0))
+		return 0;
+	if ((off > ext->len) || (len > ext->len - off))
+		return -EINVAL;
+	sh = ostor_cid_to_shard(ostor, ch->cid);
+	pthread_mutex_lock(&sh->lock);
+	ret = ch->csum_bad ? -EIO : 0;
+	st = ch->csum;
+	pthread_mutex_unlock(&sh->lock);
+	if (ret)
+		return ret;
+	buf = malloc(OSTOR_SCRUB_BUF_SZ);
+	if (!buf)
+		return -ENOMEM;
+	/* ocsum_verify reads the rest of any block that is only partly in the
+	 * range, so every block that overlaps it is checked. */
+	while (len > 0) {
+		amt = (len > OSTOR_SCRUB_BUF_SZ) ? OSTOR_SCRUB_BUF_SZ : len;
+		res = safe_pread(ch->fd, buf, amt, off);
+		if (res < 0) {
+			ochunk_check_read_error(ostor, ch, res);
+			ret = res;
+			break;
+		}
+		if (res != amt) {
+			/* The extent is past the end of the file */
+			ret = -EIO;
+			break;
+		}
+		ret = ochunk_verify_csum(ostor, ch, &st, off, buf, amt);
+		if (ret)
+			break;
+		off += amt;
+		len -= amt;
 	}
+	free(buf);
+	return ret;
+}
+
+int ostor_take_corrupt(struct ostor *ostor, uint64_t *cids, int max_cid)
+{
+	int n;
+
 	pthread_mutex_lock(&ostor->lock);
-	ch = ostor_get_ochunk(ostor, fb, cid, 0);
-	if (IS_ERR(ch)) {
-		pthread_mutex_unlock(&ostor->lock);
-		ret = FORCE_NEGATIVE(PTR_ERR(ch));
-		goto done;
-	}
-	RB_REMOVE(ochunks_by_atime, &ostor->atime_head, ch);
-	ch->refcnt++;
+	n = ostor->num_corrupt;
+	if (n > max_cid)
+		n = max_cid;
+	memcpy(cids, ostor->corrupt, n * sizeof(uint64_t));
+	memmove(ostor->corrupt, ostor->corrupt + n,
+		(ostor->num_corrupt - n) * sizeof(uint64_t));
+	ostor->num_corrupt -= n;
 	pthread_mutex_unlock(&ostor->lock);
-	ret = safe_pread(ch->fd, data, dlen, off);
+	return n;
+}
+
+void ostor_unpin(struct ostor *ostor, struct ochunk *ch)
+{
+	if (ch->packed) {
+		opack_unpin(ostor->disks[ch->disk].pack, ch->pseg);
+		free(ch);
+		return;
+	}
 	ochunk_release(ostor, ch);
-done:
-	if (ret < 0)
-		fast_log_ostor(fb, FLOS_OCHUNK_READ, cid, off, ret, dlen);
-	else
-		fast_log_ostor(fb, FLOS_OCHUNK_READ, cid, off, 0, ret);
-	return ret;
 }
 
-int ostor_unlink(struct ostor *ostor, struct fast_log_buf *fb, uint64_t cid)
+/** Unlink a chunk's file
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ *
+ * @return		0 on success; a negative error code otherwise
+ */
+static int ostor_unlink_file(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid)
 {
-	int ret, res;
+	int res;
 	struct ochunk *ch;
+	struct ostor_shard *sh;
 	char path[PATH_MAX];
 
-	if (cid == RF_INVAL_CID) {
-		ret = -EINVAL;
-		goto done;
-	}
+	sh = ostor_cid_to_shard(ostor, cid);
 	/* Wait for the reference count to go to 0 before unlinking and freeing
-	 * the chunk.  The lock/unlock calls invoke memory barriers, making the
-	 * other threads' changes to ch->refcnt visible to us. */
+	 * the chunk.  ochunk_release will wake us up when it does.  While we
+	 * sleep, the chunk could be evicted or unlinked by someone else, so we
+	 * have to look it up again each time. */
+	pthread_mutex_lock(&sh->lock);
 	while (1) {
-		pthread_mutex_lock(&ostor->lock);
-		ch = ostor_get_ochunk(ostor, fb, cid, 0);
+		ch = ostor_get_ochunk(ostor, sh, fb, cid, 0);
 		if (IS_ERR(ch)) {
-			pthread_mutex_unlock(&ostor->lock);
-			ret = FORCE_NEGATIVE(PTR_ERR(ch));
-			goto done;
-		}
-		if (ch->refcnt == -1) {
-			pthread_mutex_unlock(&ostor->lock);
-			ret = -ENOENT;
-			goto done;
+			pthread_mutex_unlock(&sh->lock);
+			return FORCE_NEGATIVE(PTR_ERR(ch));
 		}
 		if (ch->refcnt == 0)
 			break;
-		pthread_mutex_unlock(&ostor->lock);
-		mt_msleep(1);
+		fast_log_ostor(fb, FLOS_OCHUNK_WAIT, cid, 0, -EBUSY,
+			ch->refcnt);
+		ostor_shard_wait(sh);
 	}
 	ch->refcnt = -1;
-	RB_REMOVE(ochunks_by_atime, &ostor->atime_head, ch);
-	pthread_mutex_unlock(&ostor->lock);
-	ochunk_get_path(ostor, path, sizeof(path), ch->cid);
+	pthread_mutex_unlock(&sh->lock);
+	/* There's no point in giving back the chunk's reserved space when
+	 * we're about to delete it. */
+	ch->prealloc_end = 0;
+	ochunk_get_file_path(ostor, ch, path, sizeof(path));
 	RETRY_ON_EINTR(res, unlink(path));
 	if (res) {
+		res = errno;
 		glitch_log("ostor error: failed to unlink %s: error %d\n",
 			path, res);
+		ostor_check_disk_error(ostor, ch->disk, res);
 	}
-	pthread_mutex_lock(&ostor->lock);
+	ochunk_get_csum_path(ostor, ch, path, sizeof(path));
+	RETRY_ON_EINTR(res, unlink(path));
+	if (res) {
+		res = errno;
+		/* Older chunks have no checksum file */
+		if (res != ENOENT) {
+			glitch_log("ostor error: failed to unlink %s: error "
+				"%d\n", path, res);
+			ostor_check_disk_error(ostor, ch->disk, res);
+		}
+	}
+	pthread_mutex_lock(&sh->lock);
 	/* Now that the backing file has been deleted, we can evict the chunk
 	 * from memory.  We couldn't do this earlier because then someone else
 	 * might re-create the chunk.  His open() would then race with our
 	 * unlink() operation. */
-	ochunk_evict(ostor, fb, ch);
-	pthread_mutex_unlock(&ostor->lock);
-	ret = 0;
+	ochunk_evict(ostor, sh, fb, ch);
+	pthread_mutex_unlock(&sh->lock);
+	return 0;
+}
+
+int ostor_unlink(struct ostor *ostor, struct fast_log_buf *fb, uint64_t cid)
+{
+	int ret;
+
+	if (cid == RF_INVAL_CID) {
+		ret = -EINVAL;
+		goto done;
+	}
+	ret = ostor_pack_unlink(ostor, cid);
+	if (ret == -ENOENT)
+		ret = ostor_unlink_file(ostor, fb, cid);
 done:
 	fast_log_ostor(fb, FLOS_OCHUNK_UNLINK, cid, 0, ret, 0);
 	return ret;
@@ -502,105 +2829,467 @@ done:
 int ostor_verify(struct ostor *ostor, struct fast_log_buf *fb,
 		uint64_t cid)
 {
-	/* TODO: fancier things, like verifying checksums */
+	/* Opening the chunk checks that its checksum file is consistent with
+	 * it.  Reading the whole thing is left to the scrubber. */
 	char data[1] = { 0 };
 	return ostor_read(ostor, fb, cid, 0, data, 0);
 }
 
-static struct ochunk *ostor_get_ochunk(struct ostor *ostor,
-		struct fast_log_buf *fb, uint64_t cid, int create)
+int ostor_checksum(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, uint64_t *len, uint32_t *crc)
+{
+	int32_t res;
+	uint64_t off = 0;
+	uint32_t c = 0;
+	char *buf;
+
+	buf = malloc(OSTOR_SCRUB_BUF_SZ);
+	if (!buf)
+		return -ENOMEM;
+	/* ostor_read checks each block against the chunk's own checksums as
+	 * it goes */
+	do {
+		res = ostor_read(ostor, fb, cid, off, buf, OSTOR_SCRUB_BUF_SZ);
+		if (res < 0) {
+			free(buf);
+			return res;
+		}
+		c = crc32c(c, buf, res);
+		off += res;
+	} while (res == OSTOR_SCRUB_BUF_SZ);
+	free(buf);
+	*len = off;
+	*crc = c;
+	return 0;
+}
+
+/************************** scrub *******************************/
+/** State of a scrub in progress */
+struct ostor_scrub {
+	struct ostor *ostor;
+	struct fast_log_buf *fb;
+	/** Maximum number of bytes to read per second, or 0 for no limit */
+	uint64_t rate;
+	/** Callback to invoke for each corrupt chunk */
+	ostor_scrub_cb_t cb;
+	/** Private data for the callback */
+	void *priv;
+	/** Buffer to read chunk data into */
+	char *buf;
+	/** Monotonic time at which the scrub started, in microseconds */
+	uint64_t start_us;
+	/** Number of bytes read so far */
+	uint64_t bytes;
+	/** Number of corrupt chunks found so far */
+	int num_bad;
+	/** The disk being scrubbed */
+	int disk;
+};
+
+/** Sleep until the scrub is back within its rate limit.
+ *
+ * @param sc		The scrub
+ *
+ * @return		0 on success; -ESHUTDOWN if the ostor is shutting down
+ */
+static int ostor_scrub_throttle(struct ostor_scrub *sc)
+{
+	uint64_t due, now, ms;
+
+	if (ostor_is_shutdown(sc->ostor))
+		return -ESHUTDOWN;
+	if (sc->rate == 0)
+		return 0;
+	due = sc->start_us + ((sc->bytes / sc->rate) * 1000000) +
+		(((sc->bytes % sc->rate) * 1000000) / sc->rate);
+	while (1) {
+		now = mt_time_usec();
+		if (now >= due)
+			return 0;
+		/* Sleep in short steps, so that we notice a shutdown */
+		ms = ((due - now) / 1000) + 1;
+		if (ms > 100)
+			ms = 100;
+		mt_msleep(ms);
+		if (ostor_is_shutdown(sc->ostor))
+			return -ESHUTDOWN;
+	}
+}
+
+/** Scrub one chunk file.
+ *
+ * @param sc		The scrub
+ * @param disk		The disk the chunk is on
+ * @param path		Path to the chunk file
+ *
+ * @return		0 on success; -ESHUTDOWN if the ostor is shutting down
+ */
+static int ostor_scrub_chunk(struct ostor_scrub *sc, int disk,
+		const char *path)
+{
+	int ret, data_fd, csum_fd;
+	uint64_t cid, off, prev;
+	char csum_path[PATH_MAX];
+
+	if (zsnprintf(csum_path, sizeof(csum_path), "%s" OCSUM_SUFFIX, path))
+		return 0;
+	RETRY_ON_EINTR(data_fd, open(path, O_RDONLY | O_CLOEXEC | O_NOATIME));
+	if (data_fd < 0) {
+		/* The chunk may have been unlinked while we weren't looking */
+		ostor_check_disk_error(sc->ostor, disk, errno);
+		return 0;
+	}
+	RETRY_ON_EINTR(csum_fd, open(csum_path,
+			O_RDONLY | O_CLOEXEC | O_NOATIME));
+	if (csum_fd < 0) {
+		/* Chunks written before we kept checksums have none */
+		ostor_check_disk_error(sc->ostor, disk, errno);
+		safe_close(data_fd);
+		return 0;
+	}
+	ret = ocsum_read_hdr(csum_fd, &cid);
+	if (ret) {
+		glitch_log("ostor_scrub: can't read the checksum header of "
+			"%s: error %d (%s)\n", path, ret, terror(ret));
+		ostor_check_disk_error(sc->ostor, disk, ret);
+		ret = 0;
+		goto done;
+	}
+	off = 0;
+	while (1) {
+		prev = off;
+		ret = ocsum_scrub(csum_fd, data_fd, sc->buf,
+			OSTOR_SCRUB_BUF_SZ, &off);
+		if (ret < 0)
+			break;
+		sc->bytes += off - prev;
+		if (ret == 0)
+			break;
+		ret = ostor_scrub_throttle(sc);
+		if (ret)
+			break;
+	}
+	fast_log_ostor(sc->fb, FLOS_OCHUNK_SCRUB, cid, off, ret, 0);
+	if (ret == -EBADMSG) {
+		glitch_log("ostor_scrub: chunk 0x%016" PRIx64 " is corrupt "
+			"near offset %" PRIu64 ".\n", cid, off);
+		sc->num_bad++;
+		sc->cb(sc->priv, cid);
+		ret = 0;
+	}
+	else if (ret < 0) {
+		ostor_check_disk_error(sc->ostor, disk, ret);
+		if (ret != -ESHUTDOWN)
+			ret = 0;
+	}
+done:
+	safe_close(csum_fd);
+	safe_close(data_fd);
+	return ret;
+}
+
+/** Scrub a chunk file that olayout_walk found.
+ *
+ * @param priv		The scrub
+ * @param path		Path to the chunk file
+ *
+ * @return		0 to keep going; 1 if the disk has failed; -ESHUTDOWN
+ *			if the ostor is shutting down
+ */
+static int ostor_scrub_walk_cb(void *priv, const char *path)
+{
+	struct ostor_scrub *sc = priv;
+
+	if (ostor_is_shutdown(sc->ostor))
+		return -ESHUTDOWN;
+	if (ostor_disk_is_failed(sc->ostor, sc->disk))
+		return 1;
+	return ostor_scrub_chunk(sc, sc->disk, path);
+}
+
+/** Scrub the chunks in a disk's pack store.
+ *
+ * @param sc		The scrub
+ * @param disk		The disk
+ *
+ * @return		0 on success; -ESHUTDOWN if the ostor is shutting down
+ */
+static int ostor_scrub_pack(struct ostor_scrub *sc, int disk)
 {
 	int ret;
+	uint32_t len;
+	uint64_t cid = 0;
+	struct opack *pk = sc->ostor->disks[disk].pack;
+
+	while (opack_next(pk, cid, &cid) == 0) {
+		if (ostor_disk_is_failed(sc->ostor, disk))
+			return 0;
+		len = 0;
+		ret = opack_verify(pk, cid, &len);
+		sc->bytes += len;
+		fast_log_ostor(sc->fb, FLOS_OCHUNK_SCRUB, cid, len, ret, 0);
+		if (ret == -EBADMSG) {
+			glitch_log("ostor_scrub: packed chunk 0x%016" PRIx64
+				" is corrupt.\n", cid);
+			sc->num_bad++;
+			sc->cb(sc->priv, cid);
+		}
+		else if (ret < 0) {
+			/* The chunk may have been unlinked while we weren't
+			 * looking */
+			ostor_check_disk_error(sc->ostor, disk, ret);
+		}
+		ret = ostor_scrub_throttle(sc);
+		if (ret)
+			return ret;
+		if (cid == UINT64_MAX)
+			break;
+		cid++;
+	}
+	return 0;
+}
+
+int ostor_scrub(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t rate, ostor_scrub_cb_t cb, void *priv)
+{
+	int ret, disk;
+	struct ostor_scrub sc;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.ostor = ostor;
+	sc.fb = fb;
+	sc.rate = rate;
+	sc.cb = cb;
+	sc.priv = priv;
+	sc.buf = malloc(OSTOR_SCRUB_BUF_SZ);
+	if (!sc.buf)
+		return -ENOMEM;
+	sc.start_us = mt_time_usec();
+	ret = 0;
+	for (disk = 0; disk < ostor->num_disk; ++disk) {
+		if (ostor_disk_is_failed(ostor, disk))
+			continue;
+		sc.disk = disk;
+		ret = olayout_walk(&ostor->disks[disk].layout,
+			ostor->disks[disk].path, ostor_scrub_walk_cb, &sc);
+		if (ret == -ESHUTDOWN)
+			goto done;
+		if (ret < 0)
+			ostor_check_disk_error(ostor, disk, ret);
+		if (ostor->disks[disk].pack) {
+			ret = ostor_scrub_pack(&sc, disk);
+			if (ret == -ESHUTDOWN)
+				goto done;
+		}
+		ret = 0;
+	}
+done:
+	free(sc.buf);
+	return ret ? ret : sc.num_bad;
+}
+
+/** Find a chunk in the cache, or open it if it isn't there.
+ *
+ * Should be called with the shard lock held.  The lock may be dropped and
+ * re-taken while we wait.
+ *
+ * @param ostor		The ostor
+ * @param sh		The shard which cid belongs to
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param create	If nonzero, create the chunk if it doesn't exist.
+ *
+ * @return		The chunk, or an error pointer
+ */
+static struct ochunk *ostor_get_ochunk(struct ostor *ostor,
+		struct ostor_shard *sh, struct fast_log_buf *fb,
+		uint64_t cid, int create)
+{
+	int ret, num_open, disk, order[OSTORC_MAX_DISK];
 	struct ochunk exemplar, *ch;
+	struct ostor_disk *d;
 
 	memset(&exemplar, 0, sizeof(exemplar));
 	exemplar.cid = cid;
 	while (1) {
-		if (ostor->shutdown) {
+		if (ostor_is_shutdown(ostor)) {
 			ch = ERR_PTR(ESHUTDOWN);
 			break;
 		}
-		ch = RB_FIND(ochunks_by_cid, &ostor->cid_head, &exemplar);
+		ch = RB_FIND(ochunks_by_cid, &sh->cid_head, &exemplar);
 		if (ch) {
 			if (ch->refcnt != -1) {
-				/* The chunk exists in memory and is ready to use */
-				break;
-			}
-			if (!create) {
-				/* We're trying to read from something
-				 * which either doesn't exist yet, or is
-				 * in the process of being destroyed.
-				 * ENOENT. */
-				ch = ERR_PTR(ENOENT);
+				/* The chunk exists in memory and is ready to
+				 * use, unless its disk has failed, in which
+				 * case it is missing. */
+				if (ostor_disk_is_failed(ostor, ch->disk))
+					ch = ERR_PTR(ENOENT);
 				break;
 			}
-			/* Busy-wait until the chunk is either fully
-			 * created or fully destroyed.  Busy-waiting
-			 * sucks, but we should not hit this case very
-			 * often. */
-			pthread_mutex_unlock(&ostor->lock);
+			/* Someone else is opening or closing the chunk.  Wait
+			 * until they're done, then look again.  If the chunk
+			 * was being unlinked, we'll find out when we try to
+			 * open it. */
 			fast_log_ostor(fb, FLOS_OCHUNK_WAIT, cid,
 				0, -EBUSY, 0);
-			mt_msleep(1);
-			pthread_mutex_lock(&ostor->lock);
+			ostor_shard_wait(sh);
 			continue;
 		}
-		if (ostor->num_open < ostor->max_open) {
-			ch = ochunk_alloc(ostor, cid);
-			if (IS_ERR(ch))
-				break;
+		if (ostor_place_cid(ostor, cid, order) == 0) {
+			/* Every disk has failed */
+			ch = ERR_PTR(EIO);
+			break;
+		}
+		disk = order[0];
+		d = &ostor->disks[disk];
+		pthread_mutex_lock(&ostor->lock);
+		if (d->num_open < d->max_open) {
+			d->num_open++;
 			pthread_mutex_unlock(&ostor->lock);
+			ch = ochunk_alloc(sh, cid, disk);
+			if (IS_ERR(ch)) {
+				ostor_put_fd(ostor, disk);
+				break;
+			}
+			pthread_mutex_unlock(&sh->lock);
 			ret = ochunk_open(ostor, ch, create);
+			if (ret == 0)
+				ret = ochunk_open_csum(ostor, ch);
+			if (ret == 0)
+				ret = ochunk_stat(ostor, ch);
 			fast_log_ostor(fb, FLOS_OCHUNK_ALLOC, cid,
 				0, ret, ch->fd);
-			pthread_mutex_lock(&ostor->lock);
+			pthread_mutex_lock(&sh->lock);
 			if (ret) {
-				ochunk_evict(ostor, fb, ch);
+				ochunk_evict(ostor, sh, fb, ch);
 				ch = ERR_PTR(ret);
 				break;
 			}
 			/* The ochunk is now ready to use. */
 			ch->refcnt = 0;
+			ch->atime = mt_time();
+			ostor_shard_wake(sh);
 			break;
 		}
-		fast_log_ostor(fb, FLOS_OCHUNK_WAIT, cid, 0, -EMFILE,
-			ostor->num_open);
+		/* This disk is out of file descriptors.  Ask the LRU thread to
+		 * close something on it, and wait for it.  We must not hold
+		 * the shard lock while we sleep, since the LRU thread needs
+		 * it. */
+		num_open = d->num_open;
+		d->need_lru++;
 		ostor->need_lru++;
 		pthread_cond_signal(&ostor->lru_cond);
-		pthread_cond_wait(&ostor->alloc_cond, &ostor->lock);
+		pthread_mutex_unlock(&sh->lock);
+		fast_log_ostor(fb, FLOS_OCHUNK_WAIT, cid, 0, -EMFILE,
+			num_open);
+		if ((!ostor->shutdown) && (!ostor_disk_is_failed(ostor, disk)))
+			pthread_cond_wait(&ostor->alloc_cond, &ostor->lock);
+		pthread_mutex_unlock(&ostor->lock);
+		pthread_mutex_lock(&sh->lock);
 	}
 	return ch;
 }
 
 /************************** lru *******************************/
-static struct ochunk *ostor_find_dispoable_chunk(struct ostor *ostor,
-			time_t cur_time)
+/** Find a chunk in a shard which can be evicted.
+ *
+ * This is a CLOCK sweep.  Every chunk we look at is moved to the back of the
+ * shard's list, so the next sweep starts where this one left off.  A chunk
+ * which has been idle for longer than atime_timeo can always be evicted.
+ * If we're desperate, we'll also take an unused chunk which hasn't been
+ * referenced since the last time we looked at it, clearing the referenced bits
+ * as we go.  We only do that for chunks on disks which someone is waiting for,
+ * since closing a file on one disk doesn't help a thread waiting on another.
+ * Chunks on failed disks are no use to anyone, so they can always be evicted.
+ *
+ * Should be called with the shard lock held.
+ *
+ * @param ostor		The ostor
+ * @param sh		The shard
+ * @param cur_time	The current monotonic time
+ * @param desperate	Nonzero if someone is waiting for a file descriptor
+ *
+ * @return		The chunk, or NULL if there is nothing to evict
+ */
+static struct ochunk *ostor_find_disposable_chunk(struct ostor *ostor,
+		struct ostor_shard *sh, time_t cur_time, int desperate)
 {
+	int i, max;
 	struct ochunk *ch;
 
-	ch = RB_MIN(ochunks_by_atime, &ostor->atime_head);
-	while (ch) {
+	/* Twice around is enough to clear every referenced bit */
+	max = desperate ? (2 * sh->num_chunk) : sh->num_chunk;
+	for (i = 0; i < max; ++i) {
+		ch = TAILQ_FIRST(&sh->clock_head);
+		TAILQ_REMOVE(&sh->clock_head, ch, clock_entry);
+		TAILQ_INSERT_TAIL(&sh->clock_head, ch, clock_entry);
 		/* We can't remove a chunk that someone is using */
-		if (ch->refcnt != 0) {
-			ch = RB_NEXT(ochunks_by_atime, &ostor->atime_head, ch);
+		if (ch->refcnt != 0)
+			continue;
+		if ((ch->atime + ostor->atime_timeo) <= cur_time)
+			return ch;
+		if (ostor_disk_is_failed(ostor, ch->disk))
+			return ch;
+		if (!desperate)
+			continue;
+		if (ostor->disks[ch->disk].lru_need == 0)
+			continue;
+		if (ch->referenced) {
+			ch->referenced = 0;
 			continue;
 		}
-		/* If we're not desperate to evict something, make sure the
-		 * chunk is old enough to evict. */
-		if ((ostor->need_lru == 0) &&
-				((ch->atime + ostor->atime_timeo) > cur_time))
-			return NULL;
 		return ch;
 	}
 	return NULL;
 }
 
+/** Sweep the shards, evicting chunks as needed.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cur_time	The current monotonic time
+ * @param desperate	Nonzero if someone is waiting for a file descriptor
+ *
+ * @return		The number of chunks evicted
+ */
+static int ostor_lru_sweep(struct ostor *ostor, struct fast_log_buf *fb,
+		time_t cur_time, int desperate)
+{
+	int i, num_evicted = 0;
+	struct ostor_shard *sh;
+	struct ochunk *ch;
+
+	for (i = 0; i < OSTOR_NUM_SHARDS; ++i) {
+		sh = &ostor->shards[ostor->clock_hand];
+		ostor->clock_hand = (ostor->clock_hand + 1) % OSTOR_NUM_SHARDS;
+		pthread_mutex_lock(&sh->lock);
+		while (1) {
+			ch = ostor_find_disposable_chunk(ostor, sh,
+					cur_time, desperate);
+			if (!ch)
+				break;
+			if (ostor->disks[ch->disk].lru_need > 0)
+				ostor->disks[ch->disk].lru_need--;
+			ch->refcnt = -1;
+			ochunk_evict(ostor, sh, fb, ch);
+			num_evicted++;
+			if (desperate)
+				break;
+		}
+		pthread_mutex_unlock(&sh->lock);
+		/* Evict one chunk at a time when desperate, so that the
+		 * shards share the pain. */
+		if (desperate && (num_evicted > 0))
+			break;
+	}
+	return num_evicted;
+}
+
 static int ostor_lru_thread(struct redfish_thread *rt)
 {
-	int res;
+	int i, res, need_lru;
 	struct timespec ts;
 	struct ostor *ostor = rt->priv;
-	struct ochunk *ch;
 
 	pthread_mutex_lock(&ostor->lock);
 	while (1) {
@@ -608,25 +3297,25 @@ static int ostor_lru_thread(struct redfish_thread *rt)
 			pthread_mutex_unlock(&ostor->lock);
 			return 0;
 		}
+		need_lru = ostor->need_lru;
+		for (i = 0; i < ostor->num_disk; ++i)
+			ostor->disks[i].lru_need = ostor->disks[i].need_lru;
+		pthread_mutex_unlock(&ostor->lock);
 		res = clock_gettime(CLOCK_MONOTONIC, &ts);
 		if (res)
 			abort();
-		ch = ostor_find_dispoable_chunk(ostor, ts.tv_sec);
-		if (!ch) {
-			if (ostor->need_lru == 0)
-				timespec_add_sec(&ts, OSTOR_LRU_LONG_PERIOD_SEC);
-			else
-				timespec_add_nsec(&ts, OSTOR_LRU_SHORT_PERIOD_NSEC);
-			fast_log_ostor(rt->fb, FLOS_LRU_SLEEP, 0, 0,
-				0, ostor->need_lru);
-			pthread_cond_timedwait(&ostor->lru_cond,
-					&ostor->lock, &ts);
-			fast_log_ostor(rt->fb, FLOS_LRU_WAKE, 0, 0,
-				0, ostor->need_lru);
+		res = ostor_lru_sweep(ostor, rt->fb, ts.tv_sec, need_lru > 0);
+		pthread_mutex_lock(&ostor->lock);
+		if ((res > 0) && (ostor->need_lru > 0))
 			continue;
-		}
-		ch->refcnt = -1;
-		RB_REMOVE(ochunks_by_atime, &ostor->atime_head, ch);
-		ochunk_evict(ostor, rt->fb, ch);
+		if (ostor->need_lru == 0)
+			timespec_add_sec(&ts, OSTOR_LRU_LONG_PERIOD_SEC);
+		else
+			timespec_add_nsec(&ts, OSTOR_LRU_SHORT_PERIOD_NSEC);
+		fast_log_ostor(rt->fb, FLOS_LRU_SLEEP, 0, 0,
+			0, ostor->need_lru);
+		pthread_cond_timedwait(&ostor->lru_cond, &ostor->lock, &ts);
+		fast_log_ostor(rt->fb, FLOS_LRU_WAKE, 0, 0,
+			0, ostor->need_lru);
 	}
 }
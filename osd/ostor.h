@@ -19,17 +19,79 @@
 #ifndef REDFISH_OSD_OSTOR_DOT_H
 #define REDFISH_OSD_OSTOR_DOT_H
 
+#include "osd/ocsum.h" /* for struct ocsum_state */
+#include "osd/oio.h" /* for struct oio_req */
+#include "osd/opack.h" /* for struct opack_stats */
+
 #include <stdint.h> /* for uint64_t, etc. */
 
 struct fast_log_buf;
+struct ochunk;
 struct ostor;
+struct ostor_aio;
 struct ostorc;
 
+/** Called when an asynchronous read or write finishes
+ *
+ * This is invoked on an I/O engine thread, so it must not block for long.
+ *
+ * @param aio		The request
+ * @param res		The result, as ostor_read or ostor_write would have
+ *			returned it
+ */
+typedef void (*ostor_aio_cb_t)(struct ostor_aio *aio, int res);
+
+/** Called by ostor_scrub for each corrupt chunk it finds
+ *
+ * @param priv		The private data passed to ostor_scrub
+ * @param cid		The chunk ID
+ */
+typedef void (*ostor_scrub_cb_t)(void *priv, uint64_t cid);
+
+/** An asynchronous chunk read or write.
+ *
+ * The caller owns this, and typically embeds it in a larger structure.  It
+ * must stay around until the callback has been invoked.
+ */
+struct ostor_aio {
+	/** The disk I/O request.  Used by the ostor. */
+	struct oio_req req;
+	/** The ostor.  Used by the ostor. */
+	struct ostor *ostor;
+	/** The chunk, which stays referenced until the I/O is done.  Used by
+	 * the ostor. */
+	struct ochunk *ch;
+	/** The chunk's checksum state when the I/O was started.  Used by the
+	 * ostor. */
+	struct ocsum_state csum;
+	/** Next append in the chunk's write queue.  Used by the ostor. */
+	struct ostor_aio *wnext;
+	/** Callback to invoke when the I/O is done */
+	ostor_aio_cb_t cb;
+	/** Private data for the callback */
+	void *priv;
+};
+
+/** The part of a file that holds a pinned chunk */
+struct ostor_extent {
+	/** File descriptor, or -1 if the chunk is empty */
+	int fd;
+	/** Offset of the chunk data in the file */
+	uint64_t off;
+	/** Length of the chunk data */
+	uint64_t len;
+};
+
 /* The object storage for the osd
  *
  * The OSD stores its objects on the local filesystem.  It makes an attempt to
  * keep recently used file descriptors open, to avoid the overhead of doing an
  * open() and a close() for each operation.
+ *
+ * If ostor_pack_kb is set, new chunks which start out no bigger than that are
+ * packed into large segment files, rather than each getting a file of its own.
+ * See opack.h.  A packed chunk which grows past ostor_pack_kb is moved out into
+ * a file of its own.
  */
 
 /** Create the object store
@@ -43,7 +105,8 @@ extern struct ostor *ostor_init(const struct ostorc *oconf);
 /** Shut down the object store.
  *
  * After this function has been called, all further calls to the ostor will
- * return ESHUTDOWN.
+ * return ESHUTDOWN.  Asynchronous reads and writes which have already been
+ * started are finished, and their callbacks invoked, before this returns.
  *
  * @param ostor		The ostor
  */
@@ -58,6 +121,9 @@ extern void ostor_shutdown(struct ostor *ostor);
 extern void ostor_free(struct ostor *ostor);
 
 /** Write to a chunk
+ *
+ * Writes always append.  Appends to the same chunk are done in the order they
+ * were started, whether they are synchronous or asynchronous.
  *
  * @param ostor		The ostor
  * @param fb		The fast log buffer
@@ -80,12 +146,178 @@ extern int ostor_write(struct ostor *ostor, struct fast_log_buf *fb,
  *			dlen bytes long.
  * @param dlen		The amount to read
  *
- * @return		the number of bytes read on success; a negative error
- *			code otherwise
+ * @return		the number of bytes read on success; -EIO if the data
+ *			doesn't match its checksums; a negative error code
+ *			otherwise
  */
 extern int32_t ostor_read(struct ostor *ostor, struct fast_log_buf *fb,
 		uint64_t cid, uint64_t off, char *data, int32_t dlen);
 
+/** Start writing to a chunk
+ *
+ * Like ostor_write, except that the write is done by the I/O engine, and
+ * aio->cb is invoked when it has finished.  The data must stay around until
+ * then.  Writes to packed chunks are done right away, and aio->cb is invoked
+ * before this returns.
+ *
+ * While a write to the chunk is in progress, further appends are queued, and
+ * written together when it finishes.  See ostorc.jorm for tunables.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param data		The data to write
+ * @param dlen		Length of the data to write
+ * @param aio		The request.  aio->cb and aio->priv must be filled in.
+ *
+ * @return		0 if the write was started; a negative error code
+ *			otherwise, in which case the callback will not be
+ *			invoked
+ */
+extern int ostor_write_async(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, const char *data, int32_t dlen,
+		struct ostor_aio *aio);
+
+/** Start reading from a chunk
+ *
+ * Like ostor_read, except that the read is done by the I/O engine, and
+ * aio->cb is invoked when it has finished.  Reads of packed chunks are done
+ * right away, and aio->cb is invoked before this returns.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param off		The offset to read from
+ * @param data		(out param) The buffer to read into.  Must be at least
+ *			dlen bytes long.
+ * @param dlen		The amount to read
+ * @param aio		The request.  aio->cb and aio->priv must be filled in.
+ *
+ * @return		0 if the read was started; a negative error code
+ *			otherwise, in which case the callback will not be
+ *			invoked
+ */
+extern int ostor_read_async(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, uint64_t off, char *data, int32_t dlen,
+		struct ostor_aio *aio);
+
+/** Get the I/O engine statistics for one of the ostor's disks
+ *
+ * @param ostor		The ostor
+ * @param disk		Index of the disk
+ * @param st		(out param) the statistics
+ *
+ * @return		0 on success; -EINVAL if there is no such disk
+ */
+extern int ostor_get_io_stats(struct ostor *ostor, int disk,
+		struct oio_stats *st);
+
+/** Get the number of data directories the ostor has
+ *
+ * Disks are numbered from 0 to one less than this.
+ *
+ * @param ostor		The ostor
+ *
+ * @return		The number of disks
+ */
+extern int ostor_get_num_disk(const struct ostor *ostor);
+
+/** Mark one of the ostor's disks as failed
+ *
+ * The ostor does this by itself when a disk returns an I/O error and then
+ * fails a probe, or when it has returned too many errors.  An error which
+ * the disk survives only affects the chunk it came from.  Once a disk has
+ * failed, the chunks on it are missing, just as if they had never been
+ * written, new chunks are placed on the remaining disks, and the disk is never
+ * touched again.
+ *
+ * @param ostor		The ostor
+ * @param disk		Index of the disk
+ *
+ * @return		0 on success; -EINVAL if the disk index is bad
+ */
+extern int ostor_fail_disk(struct ostor *ostor, int disk);
+
+/** Find out whether one of the ostor's disks has failed
+ *
+ * @param ostor		The ostor
+ * @param disk		Index of the disk
+ *
+ * @return		1 if the disk has failed; 0 if it hasn't; -EINVAL if
+ *			the disk index is bad
+ */
+extern int ostor_is_disk_failed(struct ostor *ostor, int disk);
+
+/** Pin a chunk's backing file
+ *
+ * This is used to read from a chunk without copying the data into a buffer
+ * first.  The file descriptor stays valid until ostor_unpin is called.  Chunks
+ * which are pinned will not be evicted, and ostor_unlink will wait for them to
+ * be unpinned.  The file must not be written to through the returned file
+ * descriptor.
+ *
+ * A packed chunk is only part of its file, so the caller must stay within the
+ * returned extent.  Anything appended to the chunk after it was pinned is not
+ * part of the extent.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param ext		(out param) The part of the backing file that holds
+ *			the chunk
+ *
+ * @return		The pinned chunk on success; an error pointer otherwise.
+ *			Chunks which are known to be corrupt give EIO.  Packed
+ *			chunks which aren't in one piece give EXDEV, and must
+ *			be read with ostor_read instead.
+ */
+extern struct ochunk *ostor_pin(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, struct ostor_extent *ext);
+
+/** Check part of a pinned chunk against its checksums
+ *
+ * Data sent straight from the file never passes through our hands, so this
+ * has to be done before it is sent.  Every block which overlaps the range is
+ * read and verified, the same way ostor_read does it, and a corrupt chunk is
+ * marked and reported the same way too.
+ *
+ * @param ostor		The ostor
+ * @param ch		The pinned chunk
+ * @param ext		The extent which ostor_pin returned
+ * @param off		Offset of the range within the chunk
+ * @param len		Length of the range.  It must lie within ext.
+ *
+ * @return		0 if the data is good; -EIO if it is corrupt; a
+ *			negative error code otherwise
+ */
+extern int ostor_verify_pinned(struct ostor *ostor, struct ochunk *ch,
+		const struct ostor_extent *ext, uint64_t off, uint64_t len);
+
+/** Collect the chunks which reads have found to be corrupt
+ *
+ * Reads, pins and checks of chunks whose data doesn't match their checksums,
+ * or which get an I/O error that the disk survives, remember the chunk, so
+ * that the caller can report it to the MDS and get it replaced.  The scrubber reports what it finds through its own callback.
+ * Each chunk is returned once.
+ *
+ * @param ostor		The ostor
+ * @param cids		(out param) the chunk IDs
+ * @param max_cid	Maximum number of chunk IDs to return
+ *
+ * @return		The number of chunk IDs returned
+ */
+extern int ostor_take_corrupt(struct ostor *ostor, uint64_t *cids,
+		int max_cid);
+
+/** Unpin a chunk pinned by ostor_pin
+ *
+ * This may be called from any thread.
+ *
+ * @param ostor		The ostor
+ * @param ch		The pinned chunk
+ */
+extern void ostor_unpin(struct ostor *ostor, struct ochunk *ch);
+
 /** Unlink a chunk
  *
  * After this call has returned, reads from the chunk will fail with -ENOENT.
@@ -101,15 +333,82 @@ extern int ostor_unlink(struct ostor *ostor, struct fast_log_buf *fb,
 		uint64_t cid);
 
 /** Validate a chunk
+ *
+ * This is cheap: it checks that the chunk exists and that its checksum file
+ * is consistent with it, but doesn't read all of the data.  See ostor_scrub
+ * for that.
  *
  * @param ostor		The ostor
  * @param fb		The fast log buffer
  * @param cid		The chunk ID
  *
- * @return		0 if the chunk exists; -ENOENT if it does not;
- *			other error code on I/O error
+ * @return		0 if the chunk exists; -ENOENT if it does not; -EIO if
+ *			its checksums are bad; other error code on I/O error
  */
 extern int ostor_verify(struct ostor *ostor, struct fast_log_buf *fb,
 		uint64_t cid);
 
+/** Compute the CRC32C of a whole chunk
+ *
+ * Every byte of the chunk is read, and checked against the chunk's own
+ * checksums on the way.  This is how a copy of a chunk is compared with the
+ * original.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param cid		The chunk ID
+ * @param len		(out param) the length of the chunk
+ * @param crc		(out param) the CRC32C of the chunk's data
+ *
+ * @return		0 on success; -ENOENT if the chunk does not exist; -EIO
+ *			if it is corrupt; other error code on I/O error
+ */
+extern int ostor_checksum(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t cid, uint64_t *len, uint32_t *crc);
+
+/** Verify the checksums of every chunk in the ostor
+ *
+ * This reads every complete block of every chunk on every working disk, so it
+ * is slow.  It is meant to be run in the background, and is rate limited so
+ * that it doesn't hog the disks.  Chunks written before we kept checksums are
+ * skipped.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ * @param rate		Maximum number of bytes to read per second, or 0 for
+ *			no limit
+ * @param cb		Callback to invoke for each corrupt chunk
+ * @param priv		Private data for the callback
+ *
+ * @return		The number of corrupt chunks found; -ESHUTDOWN if the
+ *			ostor was shut down before the scrub finished;
+ *			-ENOMEM on OOM
+ */
+extern int ostor_scrub(struct ostor *ostor, struct fast_log_buf *fb,
+		uint64_t rate, ostor_scrub_cb_t cb, void *priv);
+
+/** Compact the pack stores on all of the working disks
+ *
+ * The ostor does this by itself every ostor_pack_ival seconds.
+ *
+ * @param ostor		The ostor
+ * @param fb		The fast log buffer
+ *
+ * @return		The number of segment files freed; -ESHUTDOWN if the
+ *			ostor is shutting down
+ */
+extern int ostor_compact(struct ostor *ostor, struct fast_log_buf *fb);
+
+/** Get the statistics of one of the ostor's pack stores
+ *
+ * @param ostor		The ostor
+ * @param disk		Index of the disk
+ * @param st		(out param) the statistics
+ *
+ * @return		0 on success; -EINVAL if there is no such disk; -ENOENT
+ *			if the disk has no pack store
+ */
+extern int ostor_get_pack_stats(struct ostor *ostor, int disk,
+		struct opack_stats *st);
+
 #endif
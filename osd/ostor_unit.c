@@ -19,9 +19,15 @@
 #include "core/alarm.h"
 #include "common/config/ostorc.h"
 #include "core/process_ctx.h"
+#include "osd/ocsum.h"
+#include "osd/olayout.h"
 #include "osd/ostor.h"
+#include "util/compiler.h"
+#include "util/crc32c.h"
 #include "util/error.h"
 #include "util/fast_log.h"
+#include "util/macro.h"
+#include "util/platform/fileio.h"
 #include "util/string.h"
 #include "util/tempfile.h"
 #include "util/test.h"
@@ -29,6 +35,7 @@
 #include "util/time.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
@@ -37,6 +44,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static const char TEST_DATA1[] = "1234567890";
 
@@ -44,6 +53,11 @@ static const char TEST_DATA2[] = "here is some test data!";
 
 static const char TEST_DATA3[] = "";
 
+static const struct olayout DEFAULT_LAYOUT = {
+	.levels = OLAYOUT_DEFAULT_LEVELS,
+	.bits = OLAYOUT_DEFAULT_BITS,
+};
+
 static int ostoru_test_open_close(const char *ostor_path)
 {
 	struct ostorc *oconf;
@@ -53,6 +67,8 @@ static int ostoru_test_open_close(const char *ostor_path)
 	EXPECT_NOT_ERRPTR(oconf);
 	oconf->ostor_max_open = 10;
 	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
 	oconf->ostor_path = strdup(ostor_path);
 	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
 	ostor = ostor_init(oconf);
@@ -68,6 +84,8 @@ static int ostoru_simple_test(const char *ostor_path, struct fast_log_buf *fb,
 {
 	struct ostorc *oconf;
 	struct ostor *ostor;
+	struct ochunk *ch;
+	struct ostor_extent ext;
 	int32_t amt;
 	char buf[1024];
 
@@ -75,6 +93,8 @@ static int ostoru_simple_test(const char *ostor_path, struct fast_log_buf *fb,
 	EXPECT_NOT_ERRPTR(oconf);
 	oconf->ostor_max_open = max_open;
 	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
 	oconf->ostor_path = strdup(ostor_path);
 	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
 	ostor = ostor_init(oconf);
@@ -94,6 +114,15 @@ static int ostoru_simple_test(const char *ostor_path, struct fast_log_buf *fb,
 	EXPECT_ZERO(memcmp(buf, TEST_DATA2 + 1, strlen(TEST_DATA2) - 1));
 	amt = ostor_read(ostor, fb, 333, 0, buf, sizeof(buf));
 	EXPECT_EQ(amt, -ENOENT);
+	ch = ostor_pin(ostor, fb, 456, &ext);
+	EXPECT_NOT_ERRPTR(ch);
+	EXPECT_ZERO(ext.off);
+	EXPECT_EQ(ext.len, strlen(TEST_DATA2));
+	memset(buf, 0, sizeof(buf));
+	EXPECT_EQ(pread(ext.fd, buf, sizeof(buf), 0), strlen(TEST_DATA2));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA2, strlen(TEST_DATA2)));
+	ostor_unpin(ostor, ch);
+	EXPECT_EQ(PTR_ERR(ostor_pin(ostor, fb, 333, &ext)), ENOENT);
 	EXPECT_ZERO(ostor_unlink(ostor, fb, 123));
 	EXPECT_EQ(ostor_unlink(ostor, fb, 123), -ENOENT);
 	amt = ostor_read(ostor, fb, 123, 0, buf, sizeof(buf));
@@ -106,6 +135,1084 @@ static int ostoru_simple_test(const char *ostor_path, struct fast_log_buf *fb,
 	return 0;
 }
 
+struct ostoru_aio {
+	struct ostor_aio aio;
+	sem_t sem;
+	int res;
+};
+
+static void ostoru_aio_cb(struct ostor_aio *aio, int res)
+{
+	struct ostoru_aio *oaio = GET_OUTER(aio, struct ostoru_aio, aio);
+
+	oaio->res = res;
+	sem_post(&oaio->sem);
+}
+
+static int ostoru_async_test(const char *ostor_path, struct fast_log_buf *fb,
+		int use_uring)
+{
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct ostoru_aio oaio;
+	char buf[1024];
+
+	oconf = JORM_INIT_ostorc();
+	EXPECT_NOT_ERRPTR(oconf);
+	oconf->ostor_max_open = 10;
+	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 2;
+	oconf->ostor_io_uring = use_uring;
+	oconf->ostor_path = strdup(ostor_path);
+	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(sem_init(&oaio.sem, 0, 0));
+	oaio.aio.cb = ostoru_aio_cb;
+
+	EXPECT_ZERO(ostor_write_async(ostor, fb, 123, TEST_DATA1,
+			strlen(TEST_DATA1), &oaio.aio));
+	EXPECT_ZERO(sem_wait(&oaio.sem));
+	EXPECT_ZERO(oaio.res);
+	EXPECT_ZERO(ostor_write_async(ostor, fb, 123, TEST_DATA2,
+			strlen(TEST_DATA2), &oaio.aio));
+	EXPECT_ZERO(sem_wait(&oaio.sem));
+	EXPECT_ZERO(oaio.res);
+	memset(buf, 0, sizeof(buf));
+	EXPECT_ZERO(ostor_read_async(ostor, fb, 123, 0, buf, sizeof(buf),
+			&oaio.aio));
+	EXPECT_ZERO(sem_wait(&oaio.sem));
+	EXPECT_EQ(oaio.res, strlen(TEST_DATA1) + strlen(TEST_DATA2));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA1, strlen(TEST_DATA1)));
+	EXPECT_ZERO(memcmp(buf + strlen(TEST_DATA1), TEST_DATA2,
+			strlen(TEST_DATA2)));
+	/* The synchronous and asynchronous interfaces see the same data */
+	EXPECT_EQ(ostor_read(ostor, fb, 123, 0, buf, sizeof(buf)),
+		oaio.res);
+	EXPECT_EQ(ostor_read_async(ostor, fb, 456, 0, buf, sizeof(buf),
+			&oaio.aio), -ENOENT);
+	EXPECT_EQ(ostor_read_async(ostor, fb, 123, 0, buf, -1,
+			&oaio.aio), -EINVAL);
+	/* The chunk must have been released when the I/O finished */
+	EXPECT_ZERO(ostor_unlink(ostor, fb, 123));
+
+	ostor_shutdown(ostor);
+	EXPECT_EQ(ostor_write_async(ostor, fb, 123, TEST_DATA1,
+			strlen(TEST_DATA1), &oaio.aio), -ESHUTDOWN);
+	ostor_free(ostor);
+	EXPECT_ZERO(sem_destroy(&oaio.sem));
+	JORM_FREE_ostorc(oconf);
+	return 0;
+}
+
+#define OSTORU_JBOD_NUM_DISK 3
+
+#define OSTORU_JBOD_NUM_CHUNK 300
+
+static uint64_t ostoru_jbod_cid(int i)
+{
+	/* Sequential, like the chunk IDs that the MDS hands out */
+	return i;
+}
+
+static struct ostorc *ostoru_jbod_conf(const char *tdir, int max_open)
+{
+	static const int weights[OSTORU_JBOD_NUM_DISK] = { 1, 1, 2 };
+	int i;
+	char path[PATH_MAX];
+	struct ostorc *oconf;
+	struct ostor_diskc *dconf;
+
+	oconf = JORM_INIT_ostorc();
+	if (!oconf)
+		return NULL;
+	oconf->ostor_max_open = max_open;
+	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
+	for (i = 0; i < OSTORU_JBOD_NUM_DISK; ++i) {
+		dconf = JORM_OARRAY_APPEND_ostor_diskc(&oconf->ostor_disk);
+		if (!dconf)
+			return NULL;
+		if (zsnprintf(path, sizeof(path), "%s/disk%d", tdir, i))
+			return NULL;
+		dconf->path = strdup(path);
+		if (!dconf->path)
+			return NULL;
+		dconf->weight = weights[i];
+	}
+	return oconf;
+}
+
+/** Find out which disk a chunk was put on
+ *
+ * @return		The disk index, or -1 if the chunk isn't anywhere
+ */
+static int ostoru_jbod_find(const char *tdir, uint64_t cid)
+{
+	int i;
+	char dpath[PATH_MAX], path[PATH_MAX];
+
+	for (i = 0; i < OSTORU_JBOD_NUM_DISK; ++i) {
+		snprintf(dpath, sizeof(dpath), "%s/disk%d", tdir, i);
+		olayout_get_path(&DEFAULT_LAYOUT, dpath, cid, path,
+			sizeof(path));
+		if (access(path, F_OK) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int ostoru_jbod_test(const char *tdir, struct fast_log_buf *fb)
+{
+	int i, disk, num_missing, count[OSTORU_JBOD_NUM_DISK];
+	char buf[64], bad_path[PATH_MAX], path[PATH_MAX];
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	uint64_t cid;
+	FILE *fp;
+
+	/* Two open chunks per disk, each with two file descriptors */
+	oconf = ostoru_jbod_conf(tdir, 4 * OSTORU_JBOD_NUM_DISK);
+	EXPECT_NOT_EQ(oconf, NULL);
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_get_num_disk(ostor), OSTORU_JBOD_NUM_DISK);
+
+	/* Chunks are spread over the disks according to their weights */
+	memset(count, 0, sizeof(count));
+	for (i = 1; i <= OSTORU_JBOD_NUM_CHUNK; ++i) {
+		cid = ostoru_jbod_cid(i);
+		EXPECT_ZERO(ostor_write(ostor, fb, cid, TEST_DATA1,
+			strlen(TEST_DATA1)));
+		disk = ostoru_jbod_find(tdir, cid);
+		EXPECT_GE(disk, 0);
+		count[disk]++;
+	}
+	EXPECT_GT(count[0], 0);
+	EXPECT_GT(count[1], 0);
+	EXPECT_GT(count[2], count[0]);
+	EXPECT_GT(count[2], count[1]);
+
+	/* When a disk fails, its chunks go missing, but the rest are fine */
+	EXPECT_ZERO(ostor_is_disk_failed(ostor, 0));
+	EXPECT_ZERO(ostor_fail_disk(ostor, 0));
+	EXPECT_EQ(ostor_is_disk_failed(ostor, 0), 1);
+	EXPECT_EQ(ostor_fail_disk(ostor, OSTORU_JBOD_NUM_DISK), -EINVAL);
+	for (i = 1; i <= OSTORU_JBOD_NUM_CHUNK; ++i) {
+		cid = ostoru_jbod_cid(i);
+		if (ostoru_jbod_find(tdir, cid) == 0) {
+			EXPECT_EQ(ostor_read(ostor, fb, cid, 0, buf,
+				sizeof(buf)), -ENOENT);
+			EXPECT_NONZERO(ostor_verify(ostor, fb, cid));
+		}
+		else {
+			EXPECT_EQ(ostor_read(ostor, fb, cid, 0, buf,
+				sizeof(buf)), (int)strlen(TEST_DATA1));
+			EXPECT_ZERO(ostor_verify(ostor, fb, cid));
+		}
+	}
+	/* New chunks only go to the disks that are left */
+	for (i = OSTORU_JBOD_NUM_CHUNK + 1; i <= 2 * OSTORU_JBOD_NUM_CHUNK;
+			++i) {
+		cid = ostoru_jbod_cid(i);
+		EXPECT_ZERO(ostor_write(ostor, fb, cid, TEST_DATA2,
+			strlen(TEST_DATA2)));
+		EXPECT_GT(ostoru_jbod_find(tdir, cid), 0);
+	}
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+
+	/* After a restart with all the disks working, every chunk is found,
+	 * including the ones that were put elsewhere while disk 0 was out.
+	 * Something that can't be opened where they would be on disk 0 doesn't
+	 * stop us from looking on the other disks, or fail disk 0. */
+	EXPECT_ZERO(zsnprintf(bad_path, sizeof(bad_path), "%s/disk0", tdir));
+	for (i = OSTORU_JBOD_NUM_CHUNK + 1; i <= 2 * OSTORU_JBOD_NUM_CHUNK;
+			++i) {
+		cid = ostoru_jbod_cid(i);
+		EXPECT_ZERO(olayout_mkdirs(&DEFAULT_LAYOUT, bad_path, cid));
+		olayout_get_path(&DEFAULT_LAYOUT, bad_path, cid, path,
+			sizeof(path));
+		EXPECT_ZERO(mkdir(path, 0770));
+	}
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(ostor_is_disk_failed(ostor, 0));
+	for (i = 1; i <= 2 * OSTORU_JBOD_NUM_CHUNK; ++i) {
+		cid = ostoru_jbod_cid(i);
+		memset(buf, 0, sizeof(buf));
+		if (i <= OSTORU_JBOD_NUM_CHUNK) {
+			EXPECT_EQ(ostor_read(ostor, fb, cid, 0, buf,
+				sizeof(buf)), (int)strlen(TEST_DATA1));
+			EXPECT_ZERO(strcmp(buf, TEST_DATA1));
+		}
+		else {
+			EXPECT_EQ(ostor_read(ostor, fb, cid, 0, buf,
+				sizeof(buf)), (int)strlen(TEST_DATA2));
+			EXPECT_ZERO(strcmp(buf, TEST_DATA2));
+		}
+	}
+	EXPECT_ZERO(ostor_is_disk_failed(ostor, 0));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+
+	/* A disk that can't be used at startup is marked as failed */
+	EXPECT_ZERO(zsnprintf(bad_path, sizeof(bad_path), "%s/not_a_dir",
+		tdir));
+	fp = fopen(bad_path, "w");
+	EXPECT_NOT_EQ(fp, NULL);
+	EXPECT_ZERO(fclose(fp));
+	free(oconf->ostor_disk[0]->path);
+	oconf->ostor_disk[0]->path = strdupcat(bad_path, "/disk0");
+	EXPECT_NOT_EQ(oconf->ostor_disk[0]->path, NULL);
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_is_disk_failed(ostor, 0), 1);
+	EXPECT_ZERO(ostor_is_disk_failed(ostor, 1));
+	num_missing = 0;
+	for (i = 1; i <= OSTORU_JBOD_NUM_CHUNK; ++i) {
+		cid = ostoru_jbod_cid(i);
+		if (ostor_read(ostor, fb, cid, 0, buf, sizeof(buf)) ==
+				(int)strlen(TEST_DATA1))
+			continue;
+		EXPECT_ZERO(ostoru_jbod_find(tdir, cid));
+		num_missing++;
+	}
+	EXPECT_EQ(num_missing, count[0]);
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+
+	/* But there must be at least one working disk */
+	for (i = 1; i < OSTORU_JBOD_NUM_DISK; ++i) {
+		free(oconf->ostor_disk[i]->path);
+		oconf->ostor_disk[i]->path = strdupcat(bad_path, "/disk");
+		EXPECT_NOT_EQ(oconf->ostor_disk[i]->path, NULL);
+	}
+	EXPECT_ERRPTR(ostor_init(oconf));
+	JORM_FREE_ostorc(oconf);
+	return 0;
+}
+
+#define OSTORU_CSUM_LEN ((3 * OCSUM_BLOCK_SZ) + 100)
+
+#define OSTORU_CSUM_CID 0x30003
+
+#define OSTORU_LEGACY_CID 0x40004
+
+#define OSTORU_CRASH_CID 0x50005
+
+static void ostoru_chunk_path(const char *tdir, uint64_t cid,
+		char *path, size_t path_len)
+{
+	olayout_get_path(&DEFAULT_LAYOUT, tdir, cid, path, path_len);
+}
+
+/** Set up an ostor in tdir for a test
+ *
+ * @param tdir		The directory to keep the chunks in
+ * @param adjust	If non-NULL, called to change the test's own settings
+ *			before the ostor is created
+ * @param priv		Passed to adjust
+ * @param oc		(out param) the configuration, which the caller must
+ *			free after freeing the ostor
+ *
+ * @return		The ostor, or an error pointer
+ */
+static struct ostor *ostoru_init(const char *tdir,
+		void (*adjust)(struct ostorc *oconf, const void *priv),
+		const void *priv, struct ostorc **oc)
+{
+	struct ostorc *oconf;
+	struct ostor *ostor;
+
+	oconf = JORM_INIT_ostorc();
+	if (!oconf)
+		return ERR_PTR(ENOMEM);
+	oconf->ostor_max_open = 10;
+	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
+	if (adjust)
+		adjust(oconf, priv);
+	oconf->ostor_path = strdup(tdir);
+	if (!oconf->ostor_path) {
+		JORM_FREE_ostorc(oconf);
+		return ERR_PTR(ENOMEM);
+	}
+	ostor = ostor_init(oconf);
+	if (IS_ERR(ostor)) {
+		JORM_FREE_ostorc(oconf);
+		return ostor;
+	}
+	*oc = oconf;
+	return ostor;
+}
+
+static void ostoru_scrub_cb(void *priv, uint64_t cid)
+{
+	uint64_t *found = priv;
+
+	*found = cid;
+}
+
+static int ostoru_csum_test(const char *tdir, struct fast_log_buf *fb)
+{
+	int i, fd;
+	char *data, *buf, path[PATH_MAX], csum_path[PATH_MAX];
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct ostoru_aio oaio;
+	struct stat st;
+	struct ochunk *ch;
+	struct ostor_extent ext;
+	uint64_t found, len;
+	uint32_t crc;
+
+	data = malloc(OSTORU_CSUM_LEN);
+	EXPECT_NOT_EQ(data, NULL);
+	buf = calloc(1, OSTORU_CSUM_LEN);
+	EXPECT_NOT_EQ(buf, NULL);
+	for (i = 0; i < OSTORU_CSUM_LEN; ++i)
+		data[i] = 'a' + (i % 23);
+	ostor = ostoru_init(tdir, NULL, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(sem_init(&oaio.sem, 0, 0));
+	oaio.aio.cb = ostoru_aio_cb;
+
+	/* Write in pieces that don't line up with the checksum blocks, some
+	 * synchronously and some asynchronously. */
+	for (i = 0; i < OSTORU_CSUM_LEN; i += 1000) {
+		int len = OSTORU_CSUM_LEN - i;
+		if (len > 1000)
+			len = 1000;
+		if ((i / 1000) % 2) {
+			EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_CSUM_CID,
+				data + i, len));
+			continue;
+		}
+		EXPECT_ZERO(ostor_write_async(ostor, fb, OSTORU_CSUM_CID,
+			data + i, len, &oaio.aio));
+		EXPECT_ZERO(sem_wait(&oaio.sem));
+		EXPECT_ZERO(oaio.res);
+	}
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CSUM_CID, 0, buf,
+		OSTORU_CSUM_LEN), OSTORU_CSUM_LEN);
+	EXPECT_ZERO(memcmp(buf, data, OSTORU_CSUM_LEN));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CSUM_CID, 5000, buf, 3000),
+		3000);
+	EXPECT_ZERO(memcmp(buf, data + 5000, 3000));
+	ostoru_chunk_path(tdir, OSTORU_CSUM_CID, path, sizeof(path));
+	EXPECT_ZERO(zsnprintf(csum_path, sizeof(csum_path), "%s" OCSUM_SUFFIX,
+		path));
+	EXPECT_ZERO(stat(csum_path, &st));
+	EXPECT_EQ(st.st_size, OCSUM_HDR_LEN + (3 * sizeof(uint32_t)));
+	EXPECT_ZERO(ostor_scrub(ostor, fb, 0, ostoru_scrub_cb, &found));
+	/* The checksum of the whole chunk is the checksum of what we wrote */
+	EXPECT_ZERO(ostor_checksum(ostor, fb, OSTORU_CSUM_CID, &len, &crc));
+	EXPECT_EQ(len, (uint64_t)OSTORU_CSUM_LEN);
+	EXPECT_EQ(crc, crc32c(0, data, OSTORU_CSUM_LEN));
+	EXPECT_EQ(ostor_checksum(ostor, fb, OSTORU_LEGACY_CID, &len, &crc),
+		-ENOENT);
+
+	/* Damage the second block behind the ostor's back, while the chunk
+	 * is pinned */
+	ch = ostor_pin(ostor, fb, OSTORU_CSUM_CID, &ext);
+	EXPECT_NOT_ERRPTR(ch);
+	EXPECT_EQ(ext.len, (uint64_t)OSTORU_CSUM_LEN);
+	fd = open(path, O_WRONLY);
+	EXPECT_GE(fd, 0);
+	EXPECT_EQ(pwrite(fd, "!", 1, OCSUM_BLOCK_SZ + 4), 1);
+	EXPECT_ZERO(close(fd));
+	/* Nobody has noticed yet, so the other blocks are still readable */
+	EXPECT_ZERO(ostor_take_corrupt(ostor, &found, 1));
+	EXPECT_ZERO(ostor_verify_pinned(ostor, ch, &ext, 0, OCSUM_BLOCK_SZ));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CSUM_CID,
+		2 * OCSUM_BLOCK_SZ, buf, OSTORU_CSUM_LEN),
+		OSTORU_CSUM_LEN - (2 * OCSUM_BLOCK_SZ));
+	/* Checking a range checks the whole of every block it touches */
+	EXPECT_EQ(ostor_verify_pinned(ostor, ch, &ext, OCSUM_BLOCK_SZ + 10,
+		10), -EIO);
+	ostor_unpin(ostor, ch);
+	/* Now the chunk is bad, and is waiting to be reported, once */
+	EXPECT_EQ(ostor_take_corrupt(ostor, &found, 1), 1);
+	EXPECT_EQ(found, OSTORU_CSUM_CID);
+	EXPECT_ZERO(ostor_take_corrupt(ostor, &found, 1));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CSUM_CID, 0, buf,
+		OCSUM_BLOCK_SZ), -EIO);
+	EXPECT_EQ(ostor_read_async(ostor, fb, OSTORU_CSUM_CID, 0, buf,
+		OSTORU_CSUM_LEN, &oaio.aio), -EIO);
+	EXPECT_ERRPTR(ostor_pin(ostor, fb, OSTORU_CSUM_CID, &ext));
+	EXPECT_EQ(ostor_checksum(ostor, fb, OSTORU_CSUM_CID, &len, &crc),
+		-EIO);
+	EXPECT_EQ(ostor_verify(ostor, fb, OSTORU_CSUM_CID), -EIO);
+	/* An ordinary read finds the damage, too */
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	ostor = ostoru_init(tdir, NULL, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CSUM_CID, 0, buf,
+		OCSUM_BLOCK_SZ), OCSUM_BLOCK_SZ);
+	EXPECT_ZERO(ostor_read_async(ostor, fb, OSTORU_CSUM_CID,
+		OCSUM_BLOCK_SZ + 10, buf, 10, &oaio.aio));
+	EXPECT_ZERO(sem_wait(&oaio.sem));
+	EXPECT_EQ(oaio.res, -EIO);
+	EXPECT_EQ(ostor_take_corrupt(ostor, &found, 1), 1);
+	EXPECT_EQ(found, OSTORU_CSUM_CID);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CSUM_CID, 0, buf,
+		OCSUM_BLOCK_SZ), -EIO);
+	found = 0;
+	EXPECT_EQ(ostor_scrub(ostor, fb, 0, ostoru_scrub_cb, &found), 1);
+	EXPECT_EQ(found, OSTORU_CSUM_CID);
+
+	/* A chunk written before we kept checksums can still be used, and
+	 * the scrubber leaves it alone. */
+	EXPECT_ZERO(olayout_mkdirs(&DEFAULT_LAYOUT, tdir, OSTORU_LEGACY_CID));
+	ostoru_chunk_path(tdir, OSTORU_LEGACY_CID, path, sizeof(path));
+	fd = open(path, O_CREAT | O_WRONLY, 0644);
+	EXPECT_GE(fd, 0);
+	EXPECT_EQ(write(fd, data, 5000), 5000);
+	EXPECT_ZERO(close(fd));
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_LEGACY_CID, data, 10));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LEGACY_CID, 0, buf,
+		OSTORU_CSUM_LEN), 5010);
+	EXPECT_ZERO(memcmp(buf, data, 5000));
+	EXPECT_EQ(ostor_scrub(ostor, fb, 0, ostoru_scrub_cb, &found), 1);
+	EXPECT_ZERO(ostor_verify(ostor, fb, OSTORU_LEGACY_CID));
+
+	/* Unlinking a chunk gets rid of its checksums too */
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_CSUM_CID));
+	EXPECT_EQ(stat(csum_path, &st), -1);
+	EXPECT_EQ(errno, ENOENT);
+
+	/* If we crash after writing data but before writing its checksums,
+	 * the checksums are filled in when the chunk is next opened. */
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_CRASH_CID, data, 5000));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	ostoru_chunk_path(tdir, OSTORU_CRASH_CID, path, sizeof(path));
+	EXPECT_ZERO(zsnprintf(csum_path, sizeof(csum_path), "%s" OCSUM_SUFFIX,
+		path));
+	EXPECT_ZERO(truncate(csum_path, OCSUM_HDR_LEN + 2));
+	fd = open(path, O_WRONLY | O_APPEND);
+	EXPECT_GE(fd, 0);
+	EXPECT_EQ(write(fd, data + 5000, 5000), 5000);
+	EXPECT_ZERO(close(fd));
+	ostor = ostoru_init(tdir, NULL, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CRASH_CID, 0, buf,
+		OSTORU_CSUM_LEN), 10000);
+	EXPECT_ZERO(memcmp(buf, data, 10000));
+	EXPECT_ZERO(stat(csum_path, &st));
+	EXPECT_EQ(st.st_size, OCSUM_HDR_LEN + (2 * sizeof(uint32_t)));
+	EXPECT_ZERO(ostor_verify(ostor, fb, OSTORU_CRASH_CID));
+	EXPECT_ZERO(ostor_scrub(ostor, fb, 0, ostoru_scrub_cb, &found));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+
+	/* A chunk which has lost data that was checksummed is bad */
+	EXPECT_ZERO(truncate(path, 100));
+	ostor = ostoru_init(tdir, NULL, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_verify(ostor, fb, OSTORU_CRASH_CID), -EIO);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CRASH_CID, 0, buf, 10), -EIO);
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_CRASH_CID));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_CRASH_CID, 0, buf, 10),
+		-ENOENT);
+	ostor_shutdown(ostor);
+	/* The scrubber stops when the ostor shuts down */
+	EXPECT_EQ(ostor_scrub(ostor, fb, 1, ostoru_scrub_cb, &found),
+		-ESHUTDOWN);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	EXPECT_ZERO(sem_destroy(&oaio.sem));
+	free(buf);
+	free(data);
+	return 0;
+}
+
+/* These two chunks got the same file in the legacy layout */
+#define OSTORU_LAYOUT_CID1 0x10000
+
+#define OSTORU_LAYOUT_CID2 0x10100
+
+#define OSTORU_LAYOUT_LEGACY_CID1 0x20002
+
+#define OSTORU_LAYOUT_LEGACY_CID2 0x30003
+
+#define OSTORU_LAYOUT_LOST_CID 0x40004
+
+/** Use the struct olayout in priv for the ostor's data directory */
+static void ostoru_layout_conf(struct ostorc *oconf, const void *priv)
+{
+	const struct olayout *lay = priv;
+
+	oconf->ostor_dir_levels = lay->levels;
+	oconf->ostor_dir_bits = lay->bits;
+}
+
+static int ostoru_layout_test(const char *tdir, struct fast_log_buf *fb)
+{
+	int fd;
+	char ddir[PATH_MAX], path[PATH_MAX], buf[1024];
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct olayout lay, small = { .levels = 3, .bits = 4 };
+	struct olayout_migrate_stats st;
+
+	/* A fresh data directory gets the configured layout */
+	EXPECT_ZERO(zsnprintf(ddir, sizeof(ddir), "%s/hashed", tdir));
+	EXPECT_ZERO(mkdir(ddir, 0755));
+	ostor = ostoru_init(ddir, ostoru_layout_conf, &small, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_LAYOUT_CID1, TEST_DATA1,
+		strlen(TEST_DATA1)));
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_LAYOUT_CID2, TEST_DATA2,
+		strlen(TEST_DATA2)));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_CID1, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA1));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA1, strlen(TEST_DATA1)));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_CID2, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA2));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA2, strlen(TEST_DATA2)));
+	olayout_get_path(&small, ddir, OSTORU_LAYOUT_CID1, path, sizeof(path));
+	EXPECT_ZERO(access(path, F_OK));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	EXPECT_ZERO(olayout_load(ddir, &lay));
+	EXPECT_EQ(olayout_equal(&lay, &small), 1);
+
+	/* Changing the configuration doesn't strand the chunks we have */
+	ostor = ostoru_init(ddir, ostoru_layout_conf, &DEFAULT_LAYOUT,
+		&oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_CID2, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA2));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA2, strlen(TEST_DATA2)));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+
+	/* A data directory from before we had layouts keeps the legacy
+	 * layout until it is migrated. */
+	EXPECT_ZERO(zsnprintf(ddir, sizeof(ddir), "%s/legacy", tdir));
+	EXPECT_ZERO(mkdir(ddir, 0755));
+	EXPECT_ZERO(zsnprintf(path, sizeof(path), "%s/00", ddir));
+	EXPECT_ZERO(mkdir(path, 0755));
+	ostor = ostoru_init(ddir, ostoru_layout_conf, &DEFAULT_LAYOUT,
+		&oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_LAYOUT_LEGACY_CID1,
+		TEST_DATA1, strlen(TEST_DATA1)));
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_LAYOUT_LEGACY_CID2,
+		TEST_DATA2, strlen(TEST_DATA2)));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	EXPECT_ZERO(olayout_load(ddir, &lay));
+	EXPECT_ZERO(lay.levels);
+	olayout_get_path(&lay, ddir, OSTORU_LAYOUT_LEGACY_CID1, path,
+		sizeof(path));
+	EXPECT_ZERO(access(path, F_OK));
+
+	/* Without checksums, there's no way to tell which chunk this is, but
+	 * it can still be found under its legacy name */
+	EXPECT_ZERO(olayout_mkdirs(&lay, ddir, OSTORU_LAYOUT_LOST_CID));
+	olayout_get_path(&lay, ddir, OSTORU_LAYOUT_LOST_CID, path,
+		sizeof(path));
+	fd = open(path, O_CREAT | O_WRONLY, 0644);
+	EXPECT_GE(fd, 0);
+	EXPECT_EQ(write(fd, TEST_DATA1, strlen(TEST_DATA1)),
+		strlen(TEST_DATA1));
+	EXPECT_ZERO(close(fd));
+
+	memset(&st, 0, sizeof(st));
+	EXPECT_ZERO(olayout_migrate(ddir, &DEFAULT_LAYOUT, &st));
+	EXPECT_EQ(st.moved, 4);
+	EXPECT_EQ(st.kept, 1);
+	EXPECT_ZERO(st.lost);
+	EXPECT_ZERO(olayout_load(ddir, &lay));
+	EXPECT_EQ(olayout_equal(&lay, &DEFAULT_LAYOUT), 1);
+	ostor = ostoru_init(ddir, ostoru_layout_conf, &DEFAULT_LAYOUT,
+		&oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_LEGACY_CID1, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA1));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA1, strlen(TEST_DATA1)));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_LEGACY_CID2, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA2));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA2, strlen(TEST_DATA2)));
+	EXPECT_ZERO(ostor_verify(ostor, fb, OSTORU_LAYOUT_LEGACY_CID2));
+	olayout_get_legacy_path(ddir, OSTORU_LAYOUT_LOST_CID, path,
+		sizeof(path));
+	EXPECT_ZERO(access(path, F_OK));
+	memset(buf, 0, sizeof(buf));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_LOST_CID, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA1));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA1, strlen(TEST_DATA1)));
+	/* But new chunks never go there */
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_LAYOUT_LOST_CID ^ 0x100,
+		TEST_DATA2, strlen(TEST_DATA2)));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_LAYOUT_LOST_CID, 0, buf,
+		sizeof(buf)), strlen(TEST_DATA1));
+	EXPECT_ZERO(memcmp(buf, TEST_DATA1, strlen(TEST_DATA1)));
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_LAYOUT_LOST_CID));
+	EXPECT_NONZERO(access(path, F_OK));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+
+	/* Migrating again doesn't do anything */
+	memset(&st, 0, sizeof(st));
+	EXPECT_ZERO(olayout_migrate(ddir, &DEFAULT_LAYOUT, &st));
+	EXPECT_ZERO(st.moved);
+	EXPECT_ZERO(st.kept);
+	EXPECT_ZERO(st.lost);
+	return 0;
+}
+
+#define OSTORU_PACK_NUM 600
+
+#define OSTORU_PACK_CID 0x80000
+
+#define OSTORU_PACK_GROW_CID 0x90009
+
+#define OSTORU_PACK_EMPTY_CID 0xa000a
+
+#define OSTORU_PACK_NEW_CID 0xb000b
+
+#define OSTORU_PACK_BUF_SZ 8192
+
+static int ostoru_pack_len(int i)
+{
+	return 2000 + ((i % 7) * 100);
+}
+
+static void ostoru_pack_conf(struct ostorc *oconf,
+		POSSIBLY_UNUSED(const void *priv))
+{
+	oconf->ostor_pack_kb = 4;
+	oconf->ostor_pack_seg_mb = 1;
+	/* We compact by hand */
+	oconf->ostor_pack_ival = 3600;
+}
+
+/** Check that the chunks which should have survived ostoru_pack_test are
+ * still there */
+static int ostoru_pack_check(struct ostor *ostor, struct fast_log_buf *fb,
+		const char *data, char *buf)
+{
+	int i;
+
+	for (i = 0; i < OSTORU_PACK_NUM; ++i) {
+		if ((i == 0) || (i % 4)) {
+			EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_CID + i, 0,
+				buf, OSTORU_PACK_BUF_SZ), -ENOENT);
+			continue;
+		}
+		EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_CID + i, 0, buf,
+			OSTORU_PACK_BUF_SZ), ostoru_pack_len(i));
+		EXPECT_ZERO(memcmp(buf, data + i, ostoru_pack_len(i)));
+	}
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_GROW_CID, 0, buf,
+		OSTORU_PACK_BUF_SZ), 5200);
+	EXPECT_ZERO(memcmp(buf, data, 5200));
+	return 0;
+}
+
+static int ostoru_pack_test(const char *tdir, struct fast_log_buf *fb)
+{
+	int i, fd;
+	char *data, *buf, path[PATH_MAX];
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct ostoru_aio oaio;
+	struct ochunk *ch;
+	struct ostor_extent ext;
+	struct opack_stats st;
+	struct stat sb;
+	uint64_t found, live;
+
+	data = malloc(OSTORU_PACK_BUF_SZ + OSTORU_PACK_NUM);
+	EXPECT_NOT_EQ(data, NULL);
+	buf = calloc(1, OSTORU_PACK_BUF_SZ);
+	EXPECT_NOT_EQ(buf, NULL);
+	for (i = 0; i < OSTORU_PACK_BUF_SZ + OSTORU_PACK_NUM; ++i)
+		data[i] = 'a' + (i % 23);
+	ostor = ostoru_init(tdir, ostoru_pack_conf, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(sem_init(&oaio.sem, 0, 0));
+	oaio.aio.cb = ostoru_aio_cb;
+
+	/* Small chunks are packed, rather than getting files of their own */
+	for (i = 0; i < OSTORU_PACK_NUM; ++i) {
+		EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_PACK_CID + i,
+			data + i, ostoru_pack_len(i)));
+	}
+	ostoru_chunk_path(tdir, OSTORU_PACK_CID, path, sizeof(path));
+	EXPECT_EQ(access(path, F_OK), -1);
+	EXPECT_ZERO(ostor_get_pack_stats(ostor, 0, &st));
+	EXPECT_EQ(st.num_chunk, OSTORU_PACK_NUM);
+	EXPECT_GE(st.num_seg, 2);
+	EXPECT_EQ(st.live_bytes, st.seg_bytes);
+	EXPECT_EQ(ostor_get_pack_stats(ostor, 1, &st), -EINVAL);
+	for (i = 0; i < OSTORU_PACK_NUM; ++i) {
+		EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_CID + i, 0, buf,
+			OSTORU_PACK_BUF_SZ), ostoru_pack_len(i));
+		EXPECT_ZERO(memcmp(buf, data + i, ostoru_pack_len(i)));
+	}
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_CID + 3, 17, buf, 100),
+		100);
+	EXPECT_ZERO(memcmp(buf, data + 3 + 17, 100));
+	/* Reads of packed chunks are done before ostor_read_async returns */
+	EXPECT_ZERO(ostor_read_async(ostor, fb, OSTORU_PACK_CID + 5,
+		ostoru_pack_len(5) - 50, buf, 100, &oaio.aio));
+	EXPECT_ZERO(sem_trywait(&oaio.sem));
+	EXPECT_EQ(oaio.res, 50);
+	EXPECT_ZERO(memcmp(buf, data + 5 + ostoru_pack_len(5) - 50, 50));
+
+	/* A packed chunk can be appended to many times */
+	for (i = 0; i < 12; ++i) {
+		if (i % 2) {
+			EXPECT_ZERO(ostor_write(ostor, fb,
+				OSTORU_PACK_GROW_CID, data + (i * 100), 100));
+			continue;
+		}
+		EXPECT_ZERO(ostor_write_async(ostor, fb, OSTORU_PACK_GROW_CID,
+			data + (i * 100), 100, &oaio.aio));
+		EXPECT_ZERO(sem_wait(&oaio.sem));
+		EXPECT_ZERO(oaio.res);
+	}
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_GROW_CID, 50, buf,
+		OSTORU_PACK_BUF_SZ), 1150);
+	EXPECT_ZERO(memcmp(buf, data + 50, 1150));
+	EXPECT_ZERO(ostor_verify(ostor, fb, OSTORU_PACK_GROW_CID));
+	/* It is in many records now, so it can't be pinned, and trying
+	 * doesn't write anything */
+	EXPECT_ZERO(ostor_get_pack_stats(ostor, 0, &st));
+	EXPECT_EQ(PTR_ERR(ostor_pin(ostor, fb, OSTORU_PACK_GROW_CID, &ext)),
+		EXDEV);
+	live = st.live_bytes;
+	EXPECT_ZERO(ostor_get_pack_stats(ostor, 0, &st));
+	EXPECT_EQ(st.live_bytes, live);
+
+	/* Once it outgrows ostor_pack_kb, it is moved into a file */
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_PACK_GROW_CID, data + 1200,
+		4000));
+	ostoru_chunk_path(tdir, OSTORU_PACK_GROW_CID, path, sizeof(path));
+	EXPECT_ZERO(access(path, F_OK));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_GROW_CID, 0, buf,
+		OSTORU_PACK_BUF_SZ), 5200);
+	EXPECT_ZERO(memcmp(buf, data, 5200));
+	ch = ostor_pin(ostor, fb, OSTORU_PACK_GROW_CID, &ext);
+	EXPECT_NOT_ERRPTR(ch);
+	EXPECT_ZERO(ext.off);
+	EXPECT_EQ(ext.len, 5200);
+	ostor_unpin(ostor, ch);
+
+	/* Empty chunks can be packed too */
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_PACK_EMPTY_CID, data, 0));
+	EXPECT_ZERO(ostor_read(ostor, fb, OSTORU_PACK_EMPTY_CID, 0, buf,
+		OSTORU_PACK_BUF_SZ));
+	EXPECT_ZERO(ostor_verify(ostor, fb, OSTORU_PACK_EMPTY_CID));
+	ch = ostor_pin(ostor, fb, OSTORU_PACK_EMPTY_CID, &ext);
+	EXPECT_NOT_ERRPTR(ch);
+	EXPECT_ZERO(ext.len);
+	ostor_unpin(ostor, ch);
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_PACK_EMPTY_CID));
+	EXPECT_EQ(ostor_verify(ostor, fb, OSTORU_PACK_EMPTY_CID), -ENOENT);
+
+	/* Compaction frees segments which are mostly unlinked chunks */
+	for (i = 0; i < OSTORU_PACK_NUM; ++i) {
+		if (i % 4)
+			EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_PACK_CID + i));
+	}
+	EXPECT_EQ(ostor_unlink(ostor, fb, OSTORU_PACK_CID + 1), -ENOENT);
+	EXPECT_GE(ostor_compact(ostor, fb), 1);
+	EXPECT_ZERO(ostor_get_pack_stats(ostor, 0, &st));
+	EXPECT_EQ(st.num_chunk, OSTORU_PACK_NUM / 4);
+	EXPECT_GE(st.compacted, 1);
+
+	/* Damage a packed chunk behind the ostor's back.  Pinning it checks
+	 * it, since the caller never sees the data.  The chunk is marked as
+	 * bad and reported. */
+	ch = ostor_pin(ostor, fb, OSTORU_PACK_CID, &ext);
+	EXPECT_NOT_ERRPTR(ch);
+	EXPECT_EQ(ext.len, (uint64_t)ostoru_pack_len(0));
+	EXPECT_EQ(pwrite(ext.fd, "!", 1, ext.off + 5), 1);
+	ostor_unpin(ostor, ch);
+	EXPECT_ZERO(ostor_take_corrupt(ostor, &found, 1));
+	EXPECT_EQ(PTR_ERR(ostor_pin(ostor, fb, OSTORU_PACK_CID, &ext)), EIO);
+	EXPECT_EQ(ostor_take_corrupt(ostor, &found, 1), 1);
+	EXPECT_EQ(found, OSTORU_PACK_CID);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_CID, 0, buf, 10), -EIO);
+	found = 0;
+	EXPECT_EQ(ostor_scrub(ostor, fb, 0, ostoru_scrub_cb, &found), 1);
+	EXPECT_EQ(found, OSTORU_PACK_CID);
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_PACK_CID));
+
+	/* Churn makes the index log long enough to be rewritten */
+	for (i = 0; i < 3000; ++i) {
+		EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_PACK_NEW_CID,
+			data, 10));
+		EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_PACK_NEW_CID));
+	}
+	EXPECT_GE(ostor_compact(ostor, fb), 0);
+	EXPECT_ZERO(zsnprintf(path, sizeof(path), "%s/%s/%s", tdir, OPACK_DIR,
+		OPACK_INDEX_FILE));
+	EXPECT_ZERO(stat(path, &sb));
+	EXPECT_LT(sb.st_size, 1000 * OPACK_LOG_REC_LEN);
+	EXPECT_ZERO(ostoru_pack_check(ostor, fb, data, buf));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+
+	/* The index log brings everything back */
+	ostor = ostoru_init(tdir, ostoru_pack_conf, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(ostoru_pack_check(ostor, fb, data, buf));
+	EXPECT_ZERO(ostor_scrub(ostor, fb, 0, ostoru_scrub_cb, &found));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+
+	/* A torn entry at the end of the index log is cut off */
+	fd = open(path, O_WRONLY | O_APPEND);
+	EXPECT_GE(fd, 0);
+	EXPECT_EQ(write(fd, data, 10), 10);
+	EXPECT_ZERO(close(fd));
+	ostor = ostoru_init(tdir, ostoru_pack_conf, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(ostoru_pack_check(ostor, fb, data, buf));
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_PACK_NEW_CID, data, 100));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	ostor = ostoru_init(tdir, ostoru_pack_conf, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(ostoru_pack_check(ostor, fb, data, buf));
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_NEW_CID, 0, buf,
+		OSTORU_PACK_BUF_SZ), 100);
+	EXPECT_ZERO(memcmp(buf, data, 100));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	EXPECT_ZERO(sem_destroy(&oaio.sem));
+	free(buf);
+	free(data);
+	return 0;
+}
+
+#define OSTORU_PACK_RACE_CID 0xc0000
+
+#define OSTORU_PACK_RACE_ROUNDS 300
+
+/** A thread which makes the first write to each of a series of chunks */
+struct ostoru_pack_racer {
+	struct ostor *ostor;
+	const char *data;
+	int32_t len;
+};
+
+static pthread_barrier_t ostoru_pack_race_bar;
+
+static int ostoru_pack_race_thread(struct redfish_thread *rt)
+{
+	int i;
+	struct ostoru_pack_racer *racer = rt->priv;
+
+	for (i = 0; i < OSTORU_PACK_RACE_ROUNDS; ++i) {
+		pthread_barrier_wait(&ostoru_pack_race_bar);
+		EXPECT_ZERO(ostor_write(racer->ostor, rt->fb,
+			OSTORU_PACK_RACE_CID + i, racer->data, racer->len));
+	}
+	return 0;
+}
+
+/** Race a small first write to a chunk, which would pack it, against a big
+ * one, which would give it a file.  The chunk must end up in one place. */
+static int ostoru_pack_race_test(const char *tdir, struct fast_log_buf *fb)
+{
+	int i;
+	char *data, *buf;
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct ostoru_pack_racer racers[2];
+	struct redfish_thread threads[2];
+
+	data = calloc(1, OSTORU_PACK_BUF_SZ);
+	EXPECT_NOT_EQ(data, NULL);
+	buf = calloc(1, OSTORU_PACK_BUF_SZ);
+	EXPECT_NOT_EQ(buf, NULL);
+	ostor = ostoru_init(tdir, ostoru_pack_conf, NULL, &oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	EXPECT_ZERO(pthread_barrier_init(&ostoru_pack_race_bar, NULL, 2));
+	racers[0].ostor = ostor;
+	racers[0].data = data;
+	racers[0].len = 100;
+	racers[1].ostor = ostor;
+	racers[1].data = data;
+	racers[1].len = 5000;
+	for (i = 0; i < 2; ++i) {
+		EXPECT_ZERO(redfish_thread_create(g_fast_log_mgr, &threads[i],
+				ostoru_pack_race_thread, &racers[i]));
+	}
+	for (i = 0; i < 2; ++i)
+		EXPECT_ZERO(redfish_thread_join(&threads[i]));
+	for (i = 0; i < OSTORU_PACK_RACE_ROUNDS; ++i) {
+		EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_RACE_CID + i, 0,
+			buf, OSTORU_PACK_BUF_SZ), 5100);
+		EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_PACK_RACE_CID + i));
+		EXPECT_EQ(ostor_read(ostor, fb, OSTORU_PACK_RACE_CID + i, 0,
+			buf, OSTORU_PACK_BUF_SZ), -ENOENT);
+	}
+	EXPECT_ZERO(pthread_barrier_destroy(&ostoru_pack_race_bar));
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	free(buf);
+	free(data);
+	return 0;
+}
+
+#define OSTORU_COALESCE_NUM 64
+
+#define OSTORU_COALESCE_CID 0x60006
+
+#define OSTORU_COALESCE_OTHER_CID 0x70007
+
+#define OSTORU_COALESCE_BIG 20000
+
+static sem_t ostoru_coalesce_entered;
+static sem_t ostoru_coalesce_go;
+
+/** Holds up the disk's I/O engine thread until we say go */
+static void ostoru_coalesce_block_cb(struct ostor_aio *aio, int res)
+{
+	ostoru_aio_cb(aio, res);
+	sem_post(&ostoru_coalesce_entered);
+	sem_wait(&ostoru_coalesce_go);
+}
+
+static int ostoru_coalesce_len(int i)
+{
+	return 1 + ((i * 337) % 700);
+}
+
+static int ostoru_coalesce_test(const char *tdir, struct fast_log_buf *fb,
+		int direct)
+{
+	int i, fd, len, total, can_prealloc;
+	char *data, *buf, path[PATH_MAX];
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct ostoru_aio *oaio;
+	struct oio_stats ost;
+	struct stat st;
+
+	/* See if the filesystem lets us reserve space */
+	EXPECT_ZERO(zsnprintf(path, sizeof(path), "%s/prealloc", tdir));
+	fd = open(path, O_CREAT | O_RDWR, 0644);
+	EXPECT_GT(fd, -1);
+	can_prealloc = (do_prealloc(fd, 0, 4096) == 0);
+	EXPECT_ZERO(close(fd));
+	EXPECT_ZERO(unlink(path));
+
+	total = OSTORU_COALESCE_BIG;
+	for (i = 0; i < OSTORU_COALESCE_NUM; ++i)
+		total += ostoru_coalesce_len(i);
+	data = malloc(total);
+	EXPECT_NOT_EQ(data, NULL);
+	buf = calloc(1, total);
+	EXPECT_NOT_EQ(buf, NULL);
+	for (i = 0; i < total; ++i)
+		data[i] = 'a' + (i % 19);
+	oaio = calloc(OSTORU_COALESCE_NUM, sizeof(struct ostoru_aio));
+	EXPECT_NOT_EQ(oaio, NULL);
+	EXPECT_ZERO(sem_init(&ostoru_coalesce_entered, 0, 0));
+	EXPECT_ZERO(sem_init(&ostoru_coalesce_go, 0, 0));
+
+	oconf = JORM_INIT_ostorc();
+	EXPECT_NOT_ERRPTR(oconf);
+	/* Room for just one open chunk */
+	oconf->ostor_max_open = direct ? 3 : 2;
+	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 1;
+	oconf->ostor_io_uring = 1;
+	oconf->ostor_coalesce_kb = 16;
+	oconf->ostor_prealloc_kb = 64;
+	oconf->ostor_chunk_kb = 128;
+	oconf->ostor_direct_kb = direct ? 8 : 0;
+	oconf->ostor_path = strdup(tdir);
+	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+
+	/* Park the I/O engine in the callback of the first write, so that the
+	 * rest pile up behind the second. */
+	len = 0;
+	for (i = 0; i < OSTORU_COALESCE_NUM; ++i) {
+		EXPECT_ZERO(sem_init(&oaio[i].sem, 0, 0));
+		oaio[i].aio.cb = (i == 0) ? ostoru_coalesce_block_cb :
+			ostoru_aio_cb;
+		EXPECT_ZERO(ostor_write_async(ostor, fb, OSTORU_COALESCE_CID,
+			data + len, ostoru_coalesce_len(i), &oaio[i].aio));
+		len += ostoru_coalesce_len(i);
+		if (i == 0)
+			EXPECT_ZERO(sem_wait(&ostoru_coalesce_entered));
+	}
+	EXPECT_ZERO(sem_post(&ostoru_coalesce_go));
+	for (i = 0; i < OSTORU_COALESCE_NUM; ++i) {
+		EXPECT_ZERO(sem_wait(&oaio[i].sem));
+		EXPECT_ZERO(oaio[i].res);
+	}
+	/* A big write, which is done with direct I/O if it's enabled */
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_COALESCE_CID, data + len,
+		OSTORU_COALESCE_BIG));
+	EXPECT_ZERO(ostor_get_io_stats(ostor, 0, &ost));
+	EXPECT_EQ(ost.bytes_written, (uint64_t)total);
+	/* One write each for the first two appends, two for the rest, and one
+	 * for the big write.  Direct I/O may split each of them in three. */
+	EXPECT_LT(ost.completed, 3 * 5 + 1);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_COALESCE_CID, 0, buf, total),
+		total);
+	EXPECT_ZERO(memcmp(buf, data, total));
+
+	ostoru_chunk_path(tdir, OSTORU_COALESCE_CID, path, sizeof(path));
+	EXPECT_ZERO(stat(path, &st));
+	EXPECT_EQ(st.st_size, total);
+	if (can_prealloc) {
+		EXPECT_GE((uint64_t)st.st_blocks * 512, 64 * 1024);
+	}
+	/* Opening another chunk evicts this one, which gives back the space
+	 * it didn't use. */
+	EXPECT_ZERO(ostor_write(ostor, fb, OSTORU_COALESCE_OTHER_CID,
+		TEST_DATA1, strlen(TEST_DATA1)));
+	EXPECT_ZERO(stat(path, &st));
+	EXPECT_LT((uint64_t)st.st_blocks * 512, 64 * 1024);
+	EXPECT_EQ(ostor_read(ostor, fb, OSTORU_COALESCE_CID, 0, buf, total),
+		total);
+	EXPECT_ZERO(memcmp(buf, data, total));
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_COALESCE_CID));
+	EXPECT_ZERO(ostor_unlink(ostor, fb, OSTORU_COALESCE_OTHER_CID));
+
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	for (i = 0; i < OSTORU_COALESCE_NUM; ++i)
+		EXPECT_ZERO(sem_destroy(&oaio[i].sem));
+	EXPECT_ZERO(sem_destroy(&ostoru_coalesce_go));
+	EXPECT_ZERO(sem_destroy(&ostoru_coalesce_entered));
+	free(oaio);
+	free(buf);
+	free(data);
+	return 0;
+}
+
 static sem_t ostoru_threaded_test_sem1;
 static sem_t ostoru_threaded_test_sem2;
 
@@ -170,6 +1277,8 @@ static int ostoru_threaded_test(const char *ostor_path, int max_open)
 	EXPECT_NOT_ERRPTR(oconf);
 	oconf->ostor_max_open = max_open;
 	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
 	oconf->ostor_path = strdup(ostor_path);
 	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
 	ostor = ostor_init(oconf);
@@ -187,6 +1296,201 @@ static int ostoru_threaded_test(const char *ostor_path, int max_open)
 	return 0;
 }
 
+#define OSTORU_STRESS_THREADS 4
+
+#define OSTORU_STRESS_CHUNKS 40
+
+#define OSTORU_STRESS_ITERS 3
+
+static int ostoru_stress_thread(struct redfish_thread *rt)
+{
+	int i, j;
+	uint64_t cid;
+	char buf[1024];
+	struct ostor *ostor = rt->priv;
+
+	/* Every thread writes to its own chunks, but they are spread over all
+	 * of the shards, so threads keep taking file descriptors from each
+	 * other. */
+	for (i = 0; i < OSTORU_STRESS_ITERS; ++i) {
+		for (j = 0; j < OSTORU_STRESS_CHUNKS; ++j) {
+			cid = ((uint64_t)rt->thread_id << 32) | (j + 1);
+			EXPECT_ZERO(ostor_write(ostor, rt->fb, cid,
+				TEST_DATA1, strlen(TEST_DATA1)));
+			EXPECT_EQ(ostor_read(ostor, rt->fb, cid, 0, buf,
+				sizeof(buf)), (i + 1) * (int)strlen(TEST_DATA1));
+		}
+	}
+	for (j = 0; j < OSTORU_STRESS_CHUNKS; ++j) {
+		cid = ((uint64_t)rt->thread_id << 32) | (j + 1);
+		EXPECT_ZERO(ostor_unlink(ostor, rt->fb, cid));
+		EXPECT_EQ(ostor_read(ostor, rt->fb, cid, 0, buf,
+			sizeof(buf)), -ENOENT);
+	}
+	return 0;
+}
+
+static int ostoru_stress_test(const char *ostor_path, int max_open)
+{
+	int i;
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct redfish_thread threads[OSTORU_STRESS_THREADS];
+
+	oconf = JORM_INIT_ostorc();
+	EXPECT_NOT_ERRPTR(oconf);
+	oconf->ostor_max_open = max_open;
+	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
+	oconf->ostor_path = strdup(ostor_path);
+	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	for (i = 0; i < OSTORU_STRESS_THREADS; ++i) {
+		EXPECT_ZERO(redfish_thread_create(g_fast_log_mgr, &threads[i],
+				ostoru_stress_thread, ostor));
+	}
+	for (i = 0; i < OSTORU_STRESS_THREADS; ++i) {
+		EXPECT_ZERO(redfish_thread_join(&threads[i]));
+	}
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	return 0;
+}
+
+#define OSTORU_RACE_THREADS 6
+
+#define OSTORU_RACE_CHUNKS 3
+
+#define OSTORU_RACE_ITERS 3000
+
+static int ostoru_check_data(const char *buf, int32_t amt)
+{
+	int32_t i;
+	size_t len = strlen(TEST_DATA1);
+
+	/* Chunks only ever have TEST_DATA1 appended to them, so whatever we
+	 * read must be a prefix of TEST_DATA1 repeated. */
+	for (i = 0; i < amt; ++i) {
+		if (buf[i] != TEST_DATA1[i % len])
+			return -EIO;
+	}
+	return 0;
+}
+
+static int ostoru_race_thread(struct redfish_thread *rt)
+{
+	int i;
+	int32_t amt;
+	unsigned int seed;
+	uint64_t cid;
+	struct ochunk *ch;
+	struct ostor_extent ext;
+	char buf[65536];
+	struct ostor *ostor = rt->priv;
+
+	/* All of the threads create, read, pin and unlink the same few chunks
+	 * at random.  Nothing should ever fail except with ENOENT. */
+	seed = rt->thread_id;
+	for (i = 0; i < OSTORU_RACE_ITERS; ++i) {
+		cid = 1 + (rand_r(&seed) % OSTORU_RACE_CHUNKS);
+		switch (rand_r(&seed) % 4) {
+		case 0:
+			EXPECT_ZERO(ostor_write(ostor, rt->fb, cid,
+				TEST_DATA1, strlen(TEST_DATA1)));
+			break;
+		case 1:
+			amt = ostor_read(ostor, rt->fb, cid, 0,
+				buf, sizeof(buf));
+			if (amt != -ENOENT) {
+				EXPECT_GE(amt, 0);
+				EXPECT_ZERO(ostoru_check_data(buf, amt));
+			}
+			break;
+		case 2:
+			ch = ostor_pin(ostor, rt->fb, cid, &ext);
+			if (IS_ERR(ch) && (PTR_ERR(ch) == EXDEV)) {
+				/* Packed in pieces; read it instead */
+				amt = ostor_read(ostor, rt->fb, cid, 0,
+					buf, sizeof(buf));
+				if (amt != -ENOENT) {
+					EXPECT_GE(amt, 0);
+					EXPECT_ZERO(ostoru_check_data(buf,
+						amt));
+				}
+				break;
+			}
+			if (IS_ERR(ch)) {
+				EXPECT_EQ(PTR_ERR(ch), ENOENT);
+				break;
+			}
+			if (ext.len > sizeof(buf))
+				ext.len = sizeof(buf);
+			amt = 0;
+			if (ext.len > 0)
+				amt = pread(ext.fd, buf, ext.len, ext.off);
+			EXPECT_EQ((uint64_t)amt, ext.len);
+			EXPECT_ZERO(ostoru_check_data(buf, amt));
+			ostor_unpin(ostor, ch);
+			break;
+		default:
+			amt = ostor_unlink(ostor, rt->fb, cid);
+			if (amt != -ENOENT)
+				EXPECT_ZERO(amt);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int ostoru_race_test(const char *ostor_path, int max_open,
+		int pack_kb)
+{
+	int i;
+	uint64_t cid;
+	char buf[1024];
+	struct ostorc *oconf;
+	struct ostor *ostor;
+	struct fast_log_buf *fb;
+	struct redfish_thread threads[OSTORU_RACE_THREADS];
+
+	fb = fast_log_create(g_fast_log_mgr, "ostoru_race_test");
+	EXPECT_NOT_ERRPTR(fb);
+	oconf = JORM_INIT_ostorc();
+	EXPECT_NOT_ERRPTR(oconf);
+	oconf->ostor_max_open = max_open;
+	oconf->ostor_timeo = 10;
+	oconf->ostor_io_depth = 4;
+	oconf->ostor_io_uring = 1;
+	oconf->ostor_pack_kb = pack_kb;
+	oconf->ostor_path = strdup(ostor_path);
+	EXPECT_NOT_EQ(oconf->ostor_path, NULL);
+	ostor = ostor_init(oconf);
+	EXPECT_NOT_ERRPTR(ostor);
+	for (i = 0; i < OSTORU_RACE_THREADS; ++i) {
+		EXPECT_ZERO(redfish_thread_create(g_fast_log_mgr, &threads[i],
+				ostoru_race_thread, ostor));
+	}
+	for (i = 0; i < OSTORU_RACE_THREADS; ++i) {
+		EXPECT_ZERO(redfish_thread_join(&threads[i]));
+	}
+	/* Once the dust settles, unlinking everything should leave nothing
+	 * behind. */
+	for (cid = 1; cid <= OSTORU_RACE_CHUNKS; ++cid) {
+		ostor_unlink(ostor, fb, cid);
+		EXPECT_EQ(ostor_read(ostor, fb, cid, 0, buf, sizeof(buf)),
+			-ENOENT);
+		EXPECT_EQ(ostor_unlink(ostor, fb, cid), -ENOENT);
+	}
+	ostor_shutdown(ostor);
+	ostor_free(ostor);
+	JORM_FREE_ostorc(oconf);
+	fast_log_free(fb);
+	return 0;
+}
+
 int main(POSSIBLY_UNUSED(int argc), char **argv)
 {
 	char tdir[PATH_MAX];
@@ -216,6 +1520,58 @@ int main(POSSIBLY_UNUSED(int argc), char **argv)
 	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
 	EXPECT_ZERO(ostoru_threaded_test(tdir, 10));
 
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_async_test(tdir, fb, 0));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_async_test(tdir, fb, 1));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_jbod_test(tdir, fb));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_csum_test(tdir, fb));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_layout_test(tdir, fb));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_pack_test(tdir, fb));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_pack_race_test(tdir, fb));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_coalesce_test(tdir, fb, 0));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_coalesce_test(tdir, fb, 1));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_stress_test(tdir, 3));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_race_test(tdir, 100, 0));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_race_test(tdir, 1, 0));
+
+	EXPECT_ZERO(get_tempdir(tdir, sizeof(tdir), 0755));
+	EXPECT_ZERO(register_tempdir_for_cleanup(tdir));
+	EXPECT_ZERO(ostoru_race_test(tdir, 100, 1));
+
 	EXPECT_ZERO(mt_deactivate_alarm(timer));
 	fast_log_free(fb);
 	process_ctx_shutdown();
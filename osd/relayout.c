@@ -0,0 +1,156 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/config/ostorc.h"
+#include "core/glitch_log.h"
+#include "core/process_ctx.h"
+#include "osd/olayout.h"
+#include "util/error.h"
+#include "util/str_to_int.h"
+#include "util/string.h"
+#include "util/terror.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(int exitstatus)
+{
+	static const char *usage_lines[] = {
+"fishrelayout: moves the chunks in Redfish OSD data directories to a new",
+"directory layout",
+"See http://www.club.cc.cmu.edu/~cmccabe/redfish.html for the most up-to-date",
+"information about Redfish.",
+"",
+"usage:",
+"fishrelayout [options] <data-dir> [more data dirs...]",
+"",
+"The OSD which owns the data directories must not be running.  If this is",
+"interrupted, run it again with the same options to finish the job.",
+"",
+"Chunks in the legacy layout which have no checksum file can't be",
+"identified.  They are kept under their old names in the legacy",
+"directory, where the OSD still finds them.  New chunks are never put",
+"there.  Files which would overwrite another file are put in the",
+"lost+found directory, and can be re-replicated from other OSDs.",
+"",
+"options:",
+"-b <bits>",
+"    Number of bits of the chunk ID hash to use for each directory level",
+"    [default: 8].  This should match ostor_dir_bits.",
+"-h",
+"    Show this help message",
+"-l <levels>",
+"    Number of directory levels [default: 2].  This should match",
+"    ostor_dir_levels.",
+NULL
+	};
+	print_lines(stderr, usage_lines);
+	exit(exitstatus);
+}
+
+static int parse_int_opt(const char *str, int min, int max)
+{
+	char err[128] = { 0 };
+	int val;
+
+	val = str_to_int(str, err, sizeof(err));
+	if (err[0]) {
+		glitch_log("error parsing '%s': %s\n", str, err);
+		usage(EXIT_FAILURE);
+	}
+	if ((val < min) || (val > max)) {
+		glitch_log("'%s' must be between %d and %d\n", str, min, max);
+		usage(EXIT_FAILURE);
+	}
+	return val;
+}
+
+static void parse_argv(int argc, char **argv, struct olayout *lay)
+{
+	int c;
+
+	lay->levels = OLAYOUT_DEFAULT_LEVELS;
+	lay->bits = OLAYOUT_DEFAULT_BITS;
+	while ((c = getopt(argc, argv, "b:hl:")) != -1) {
+		switch (c) {
+		case 'b':
+			lay->bits = parse_int_opt(optarg, 1,
+				OSTORC_MAX_DIR_BITS);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		case 'l':
+			lay->levels = parse_int_opt(optarg, 1,
+				OSTORC_MAX_DIR_LEVELS);
+			break;
+		case '?':
+			glitch_log("error parsing options.\n\n");
+			usage(EXIT_FAILURE);
+		}
+	}
+	if (optind == argc) {
+		glitch_log("You must supply at least one data directory.  "
+			"Type -h for help.\n");
+		usage(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret, num_failed = 0;
+	struct olayout lay;
+	struct olayout_migrate_stats st;
+
+	parse_argv(argc, argv, &lay);
+	if (utility_ctx_init(argv[0]))
+		return EXIT_FAILURE;
+	for (i = optind; i < argc; ++i) {
+		ret = olayout_migrate(argv[i], &lay, &st);
+		if (ret == -EINPROGRESS) {
+			glitch_log("%s: a move to a different layout was "
+				"interrupted.  Finish that one first.\n",
+				argv[i]);
+			num_failed++;
+			continue;
+		}
+		else if (ret) {
+			glitch_log("%s: error %d (%s).  Moved %" PRIu64
+				" files before the error.\n", argv[i], ret,
+				terror(ret), st.moved);
+			num_failed++;
+			continue;
+		}
+		printf("%s: moved %" PRIu64 " files", argv[i], st.moved);
+		if (st.kept)
+			printf(", kept %" PRIu64 " files that couldn't be "
+				"identified in %s", st.kept,
+				OLAYOUT_LEGACY_DIR);
+		if (st.lost)
+			printf(", put %" PRIu64 " files that couldn't be "
+				"placed in %s", st.lost, OLAYOUT_LOST_DIR);
+		printf("\n");
+	}
+	process_ctx_shutdown();
+	return num_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
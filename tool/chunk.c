@@ -27,6 +27,7 @@
 #include "msg/xdr.h"
 #include "tool/common.h"
 #include "tool/tool.h"
+#include "util/crc32c.h"
 #include "util/error.h"
 #include "util/packed.h"
 #include "util/safe_io.h"
@@ -57,6 +58,10 @@ struct chunk_op_ctx {
 	int oid;
 	int fd;
 	struct osdc *osdc;
+	/** OSDs which the first OSD should pass writes on to */
+	uint32_t chain[RF_MAX_OID];
+	/** Number of entries in chain */
+	int chain_len;
 };
 
 static struct chunk_op_ctx *chunk_op_ctx_alloc(struct fishtool_params *params)
@@ -145,14 +150,18 @@ static int do_chunk_write(struct chunk_op_ctx *cct, const char *buf,
 		return -EINVAL;
 	req.cid = cct->cid;
 	req.flags = 0;
+	req.chain.chain_len = cct->chain_len;
+	req.chain.chain_val = cct->chain;
 	m = msg_xdr_extalloc(mmm_osd_hflush_req_ty,
 		(xdrproc_t)xdr_mmm_osd_hflush_req,
 		&req, buf_len, (void**)&extra);
 	if (IS_ERR(m))
 		return FORCE_NEGATIVE(PTR_ERR(m));
 	memcpy(extra, buf, buf_len);
+	/* The reply has to wait for every OSD in the chain */
 	bsend_add(cct->rrc->ctx, cct->rrc->msgr, BSF_RESP, m,
-		oinfo->ip, oinfo->port[RF_ENTITY_TY_CLI], TOOL_TIMEO, NULL);
+		oinfo->ip, oinfo->port[RF_ENTITY_TY_CLI],
+		TOOL_TIMEO * (1 + cct->chain_len), NULL);
 	bsend_join(cct->rrc->ctx);
 	tr = bsend_get_mtran(cct->rrc->ctx, 0);
 	if (IS_ERR(tr->m)) {
@@ -173,17 +182,67 @@ static int do_chunk_write(struct chunk_op_ctx *cct, const char *buf,
 	return ret;
 }
 
+/** Parse a comma-separated list of OSD IDs to pass writes on to
+ *
+ * @param cct		The chunk operation context
+ * @param str		The list
+ *
+ * @return		0 on success; -EINVAL if the list is bad
+ */
+static int parse_chunk_chain(struct chunk_op_ctx *cct, const char *str)
+{
+	char err[512] = { 0 };
+	char *buf, *tok, *state = NULL;
+	int ret = 0;
+
+	buf = strdup(str);
+	if (!buf)
+		return -ENOMEM;
+	for (tok = strtok_r(buf, ",", &state); tok;
+			tok = strtok_r(NULL, ",", &state)) {
+		if (cct->chain_len >= RF_MAX_OID) {
+			glitch_log("You can give at most %d OSDs to pass "
+				"the data on to.\n", RF_MAX_OID);
+			ret = -EINVAL;
+			break;
+		}
+		cct->chain[cct->chain_len] = str_to_int(tok, err, sizeof(err));
+		if (err[0]) {
+			glitch_log("error parsing OSD ID '%s': %s\n",
+				tok, err);
+			ret = -EINVAL;
+			break;
+		}
+		cct->chain_len++;
+	}
+	free(buf);
+	if ((ret == 0) && cmap_check_oid_chain(cct->oid, cct->chain,
+			cct->chain_len)) {
+		glitch_log("The OSDs to pass the data on to must all be "
+			"different, and must not include the OSD given "
+			"with -k.\n");
+		ret = -EINVAL;
+	}
+	return ret;
+}
+
 int fishtool_chunk_write(struct fishtool_params *params)
 {
 	int ret;
 	struct chunk_op_ctx *cct = NULL;
-	const char *local;
+	const char *local, *chain;
 
 	cct = chunk_op_ctx_alloc(params);
 	if (!cct) {
 		ret = -EIO;
 		goto done;
 	}
+	chain = params->lowercase_args[ALPHA_IDX('r')];
+	if (chain) {
+		ret = parse_chunk_chain(cct, chain);
+		if (ret)
+			goto done;
+	}
 	local = params->lowercase_args[ALPHA_IDX('i')];
 	if (local) {
 		cct->fd = open(local, O_RDONLY);
@@ -236,20 +295,24 @@ static const char *fishtool_chunk_write_usage[] = {
 	"-i <file>      input file",
 	"               If no local file is given, stdin will be used.",
 	"-k <oid>       OSD ID to contact",
+	"-r <oid>[,<oid>...]",
+	"               OSDs which the first OSD should pass the data on to,",
+	"               in order.  It replies once they all have it.",
 	NULL,
 };
 
 struct fishtool_act g_fishtool_chunk_write = {
 	.name = "chunk_write",
 	.fn = fishtool_chunk_write,
-	.getopt_str = "i:k:",
+	.getopt_str = "i:k:r:",
 	.usage = fishtool_chunk_write_usage,
 };
 
 static int do_chunk_read(struct chunk_op_ctx *cct, const char *fname,
-		int fd, uint64_t start, uint32_t len)
+		int fd, uint64_t start, uint32_t len, int verify)
 {
 	int32_t ret, m_len;
+	uint32_t crc;
 	struct mmm_osd_read_req req;
 	struct msg *m;
 	struct mmm_osd_read_resp rr;
@@ -263,10 +326,11 @@ static int do_chunk_read(struct chunk_op_ctx *cct, const char *fname,
 	req.cid = cct->cid;
 	req.start = start;
 	req.len = len;
+	req.flags = verify ? MMM_OSD_READ_FLAG_CRC : 0;
 	m = MSG_XDR_ALLOC(mmm_osd_read_req, &req);
 	if (IS_ERR(m))
 		return PTR_ERR(m);
-	bsend_add(cct->rrc->ctx, cct->rrc->msgr, BSF_RESP, m,
+	bsend_add(cct->rrc->ctx, cct->rrc->msgr, BSF_RESP | BSF_BULK, m,
 		oinfo->ip, oinfo->port[RF_ENTITY_TY_CLI], TOOL_TIMEO, NULL);
 	bsend_join(cct->rrc->ctx);
 	tr = bsend_get_mtran(cct->rrc->ctx, 0);
@@ -288,7 +352,24 @@ static int do_chunk_read(struct chunk_op_ctx *cct, const char *fname,
 			"response type %d\n", unpack_from_be16(&tr->m->ty));
 		goto done;
 	}
+	if (verify) {
+		if ((!(rr.flags & MMM_OSD_READ_RESP_FLAG_CRC)) ||
+				(m_len < (int32_t)sizeof(uint32_t))) {
+			ret = -EIO;
+			glitch_log("the server didn't send a checksum\n");
+			goto free_rr;
+		}
+		m_len -= sizeof(uint32_t);
+		crc = unpack_from_be32(extra + m_len);
+		if (crc32c(0, extra, m_len) != crc) {
+			ret = -EIO;
+			glitch_log("checksum mismatch reading %d bytes from "
+				"offset 0x%"PRIx64"\n", m_len, start);
+			goto free_rr;
+		}
+	}
 	ret = FORCE_NEGATIVE(safe_write(fd, extra, m_len));
+free_rr:
 	xdr_free((xdrproc_t)xdr_mmm_osd_read_resp, (void*)&rr);
 	if (ret) {
 		glitch_log("error writing to %s: error %d (%s)\n",
@@ -303,7 +384,7 @@ done:
 
 int fishtool_chunk_read(struct fishtool_params *params)
 {
-	int ret;
+	int ret, verify;
 	char err[512] = { 0 };
 	size_t err_len = sizeof(err);
 	struct chunk_op_ctx *cct = NULL;
@@ -317,6 +398,7 @@ int fishtool_chunk_read(struct fishtool_params *params)
 		ret = -EIO;
 		goto done;
 	}
+	verify = !!params->lowercase_args[ALPHA_IDX('v')];
 	start_str = params->lowercase_args[ALPHA_IDX('s')];
 	if (start_str) {
 		start = str_to_u64(start_str, err, err_len);
@@ -361,7 +443,7 @@ int fishtool_chunk_read(struct fishtool_params *params)
 		char buf[8192];
 
 		amt = (len > sizeof(buf)) ? sizeof(buf) : len;
-		ret = do_chunk_read(cct, local, cct->fd, start, amt);
+		ret = do_chunk_read(cct, local, cct->fd, start, amt, verify);
 		if (ret < 0) {
 			glitch_log("do_chunk_read: error reading "
 				"%d bytes to from offset 0x%"PRIx64": %d\n",
@@ -392,12 +474,177 @@ static const char *fishtool_chunk_read_usage[] = {
 	"-o <file>      output file",
 	"               If no local file is given, stdout will be used.",
 	"-s <start>     starting offset within the chunk (default: 0)",
+	"-v             have the OSD send a CRC32C of the data, and check it",
 	NULL,
 };
 
 struct fishtool_act g_fishtool_chunk_read = {
 	.name = "chunk_read",
 	.fn = fishtool_chunk_read,
-	.getopt_str = "k:l:o:s:",
+	.getopt_str = "k:l:o:s:v",
 	.usage = fishtool_chunk_read_usage,
 };
+
+int fishtool_chunk_copy(struct fishtool_params *params)
+{
+	int ret;
+	char err[512] = { 0 };
+	struct chunk_op_ctx *cct = NULL;
+	struct mmm_osd_chunk_copy_req req;
+	struct mmm_osd_chunk_copy_resp resp;
+	struct daemon_info *oinfo;
+	struct mtran *tr;
+	struct msg *m;
+	const char *dst_str;
+
+	cct = chunk_op_ctx_alloc(params);
+	if (!cct) {
+		ret = -EIO;
+		goto done;
+	}
+	dst_str = params->lowercase_args[ALPHA_IDX('d')];
+	if (!dst_str) {
+		glitch_log("You must specify what osd to copy the chunk "
+			"to.  -h for help.\n");
+		ret = -EINVAL;
+		goto done;
+	}
+	req.cid = cct->cid;
+	req.dst = str_to_int(dst_str, err, sizeof(err));
+	if (err[0]) {
+		glitch_log("error parsing OSD ID: %s", err);
+		ret = -EINVAL;
+		goto done;
+	}
+	oinfo = cmap_get_oinfo(cct->rrc->cmap, cct->oid);
+	if (!oinfo) {
+		ret = -EINVAL;
+		goto done;
+	}
+	m = MSG_XDR_ALLOC(mmm_osd_chunk_copy_req, &req);
+	if (IS_ERR(m)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(m));
+		goto done;
+	}
+	bsend_add(cct->rrc->ctx, cct->rrc->msgr, BSF_RESP, m,
+		oinfo->ip, oinfo->port[RF_ENTITY_TY_CLI], TOOL_TIMEO, NULL);
+	bsend_join(cct->rrc->ctx);
+	tr = bsend_get_mtran(cct->rrc->ctx, 0);
+	if (IS_ERR(tr->m)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(tr->m));
+		glitch_log("error sending mmm_osd_chunk_copy_req: error %d\n",
+			ret);
+		goto reset;
+	}
+	if (MSG_XDR_DECODE(mmm_osd_chunk_copy_resp, tr->m, &resp) < 0) {
+		ret = FORCE_NEGATIVE(msg_xdr_decode_as_generic(tr->m));
+		if (ret == 0)
+			ret = -EIO;
+		glitch_log("error copying chunk: error %d (%s)\n",
+			ret, terror(ret));
+		goto reset;
+	}
+	printf("copied %" PRIu64 " bytes with crc32c 0x%08x\n",
+		(uint64_t)resp.len, resp.crc);
+	XDR_REQ_FREE(mmm_osd_chunk_copy_resp, &resp);
+	ret = 0;
+reset:
+	bsend_reset(cct->rrc->ctx);
+done:
+	if (cct)
+		chunk_op_ctx_free(cct);
+	return ret;
+}
+
+static const char *fishtool_chunk_copy_usage[] = {
+	"chunk copy: have an OSD copy one of its chunks to another OSD.",
+	"",
+	"usage:",
+	"chunk_copy [options] <chunk-ID>",
+	"",
+	"options:",
+	"-d <oid>       OSD ID to copy the chunk to",
+	"-k <oid>       OSD ID to copy the chunk from",
+	NULL,
+};
+
+struct fishtool_act g_fishtool_chunk_copy = {
+	.name = "chunk_copy",
+	.fn = fishtool_chunk_copy,
+	.getopt_str = "d:k:",
+	.usage = fishtool_chunk_copy_usage,
+};
+
+int fishtool_chunk_csum(struct fishtool_params *params)
+{
+	int ret;
+	struct chunk_op_ctx *cct = NULL;
+	struct mmm_osd_chunk_csum_req req;
+	struct mmm_osd_chunk_csum_resp resp;
+	struct daemon_info *oinfo;
+	struct mtran *tr;
+	struct msg *m;
+
+	cct = chunk_op_ctx_alloc(params);
+	if (!cct) {
+		ret = -EIO;
+		goto done;
+	}
+	req.cid = cct->cid;
+	oinfo = cmap_get_oinfo(cct->rrc->cmap, cct->oid);
+	if (!oinfo) {
+		ret = -EINVAL;
+		goto done;
+	}
+	m = MSG_XDR_ALLOC(mmm_osd_chunk_csum_req, &req);
+	if (IS_ERR(m)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(m));
+		goto done;
+	}
+	bsend_add(cct->rrc->ctx, cct->rrc->msgr, BSF_RESP, m,
+		oinfo->ip, oinfo->port[RF_ENTITY_TY_CLI], TOOL_TIMEO, NULL);
+	bsend_join(cct->rrc->ctx);
+	tr = bsend_get_mtran(cct->rrc->ctx, 0);
+	if (IS_ERR(tr->m)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(tr->m));
+		glitch_log("error sending mmm_osd_chunk_csum_req: error %d\n",
+			ret);
+		goto reset;
+	}
+	if (MSG_XDR_DECODE(mmm_osd_chunk_csum_resp, tr->m, &resp) < 0) {
+		ret = FORCE_NEGATIVE(msg_xdr_decode_as_generic(tr->m));
+		if (ret == 0)
+			ret = -EIO;
+		glitch_log("error checksumming chunk: error %d (%s)\n",
+			ret, terror(ret));
+		goto reset;
+	}
+	printf("%" PRIu64 " bytes with crc32c 0x%08x\n",
+		(uint64_t)resp.len, resp.crc);
+	XDR_REQ_FREE(mmm_osd_chunk_csum_resp, &resp);
+	ret = 0;
+reset:
+	bsend_reset(cct->rrc->ctx);
+done:
+	if (cct)
+		chunk_op_ctx_free(cct);
+	return ret;
+}
+
+static const char *fishtool_chunk_csum_usage[] = {
+	"chunk csum: have an OSD read a whole chunk and print its CRC32C.",
+	"",
+	"usage:",
+	"chunk_csum [options] <chunk-ID>",
+	"",
+	"options:",
+	"-k <oid>       OSD ID to contact",
+	NULL,
+};
+
+struct fishtool_act g_fishtool_chunk_csum = {
+	.name = "chunk_csum",
+	.fn = fishtool_chunk_csum,
+	.getopt_str = "k:",
+	.usage = fishtool_chunk_csum_usage,
+};
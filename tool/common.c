@@ -50,6 +50,8 @@ struct tool_rrctx *tool_rrctx_alloc(const char *cpath)
 		.tcp_teardown_timeo = 10,
 		.name = "tool_rrctx_msgr",
 		.fl_mgr = g_fast_log_mgr,
+		.conns_per_ep = 2,
+		.compress_min = MSGR_DEFAULT_COMPRESS_MIN,
 	};
 	struct tool_rrctx *rrc;
 
@@ -0,0 +1,299 @@
+/*
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/cluster_map.h"
+#include "common/entity_type.h"
+#include "core/glitch_log.h"
+#include "msg/bsend.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "tool/common.h"
+#include "tool/tool.h"
+#include "util/error.h"
+#include "util/net.h"
+#include "util/packed.h"
+#include "util/str_to_int.h"
+#include "util/terror.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOOL_TIMEO 60
+
+/** Find the daemon to ask for statistics
+ *
+ * @param params	The fishtool parameters
+ * @param cmap		The cluster map
+ *
+ * @return		The daemon info, or NULL if the parameters don't
+ *			describe a daemon in the cluster map
+ */
+static struct daemon_info *msgrstat_get_dinfo(
+		const struct fishtool_params *params, struct cmap *cmap)
+{
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	const char *oid_str, *mid_str;
+	int id;
+
+	oid_str = params->lowercase_args[ALPHA_IDX('k')];
+	mid_str = params->lowercase_args[ALPHA_IDX('m')];
+	if ((!oid_str) == (!mid_str)) {
+		glitch_log("You must specify either an OSD with -k, or an "
+			"MDS with -m.  -h for help.\n");
+		return NULL;
+	}
+	id = str_to_int(oid_str ? oid_str : mid_str, err, err_len);
+	if (err[0]) {
+		glitch_log("error parsing daemon ID: %s\n", err);
+		return NULL;
+	}
+	if (oid_str) {
+		if ((id < 0) || (id >= cmap->num_osd)) {
+			glitch_log("Error: no such OSD as %d\n", id);
+			return NULL;
+		}
+		return &cmap->oinfo[id];
+	}
+	if ((id < 0) || (id >= cmap->num_mds)) {
+		glitch_log("Error: no such MDS as %d\n", id);
+		return NULL;
+	}
+	return &cmap->minfo[id];
+}
+
+/** Find out which of a daemon's messengers to ask
+ *
+ * @param params	The fishtool parameters
+ *
+ * @return		The entity type, or a negative error code
+ */
+static int msgrstat_get_entity_ty(const struct fishtool_params *params)
+{
+	const char *ety_str;
+	int ety;
+
+	ety_str = params->lowercase_args[ALPHA_IDX('e')];
+	if (!ety_str)
+		return RF_ENTITY_TY_CLI;
+	for (ety = 0; ety < RF_ENTITY_TY_NUM; ++ety) {
+		if (!strcmp(ety_str, entity_ty_to_short_str(ety)))
+			return ety;
+	}
+	glitch_log("Unknown entity type '%s'.  -h for help.\n", ety_str);
+	return -EINVAL;
+}
+
+/** Get an approximate percentile from a latency histogram
+ *
+ * @param hist		The histogram
+ * @param pct		The percentile, from 0 to 100
+ *
+ * @return		The upper bound, in microseconds, of the bucket
+ *			containing the percentile, or 0 if the histogram is
+ *			empty.
+ */
+static uint64_t msgrstat_hist_pct(const unsigned int *hist, int pct)
+{
+	uint64_t total = 0, seen = 0, target;
+	int i;
+
+	for (i = 0; i < MMM_MSGR_LAT_BUCKETS; ++i)
+		total += hist[i];
+	if (total == 0)
+		return 0;
+	target = ((total * pct) + 99) / 100;
+	for (i = 0; i < MMM_MSGR_LAT_BUCKETS - 1; ++i) {
+		seen += hist[i];
+		if (seen >= target)
+			break;
+	}
+	return 2ULL << i;
+}
+
+/** Compute a compression ratio
+ *
+ * @param raw		Bytes before compression
+ * @param comp		Bytes after compression
+ *
+ * @return		raw / comp, or 1 if nothing was compressed
+ */
+static double msgrstat_ratio(uint64_t raw, uint64_t comp)
+{
+	if (comp == 0)
+		return 1.0;
+	return (double)raw / (double)comp;
+}
+
+static void msgrstat_print(const struct mmm_msgr_stats_resp *resp)
+{
+	const struct mmm_msgr_ty_stats *ts;
+	const struct mmm_msgr_conn_stats *cs;
+	char ip_str[INET_ADDRSTRLEN];
+	unsigned int i;
+
+	printf("messenger %s (%s)\n", resp->name,
+		(resp->backend == MSGR_BACKEND_URING) ? "io_uring" : "epoll");
+	printf("msgs_in=%" PRIu64 " msgs_out=%" PRIu64
+		" bytes_in=%" PRIu64 " bytes_out=%" PRIu64 "\n",
+		resp->msgs_in, resp->msgs_out, resp->bytes_in,
+		resp->bytes_out);
+	printf("conns=%u opened=%" PRIu64 " accepted=%" PRIu64
+		" reconnects=%" PRIu64 " teardowns=%" PRIu64
+		" timeouts=%" PRIu64 "\n",
+		resp->num_conn, resp->conns_opened, resp->conns_accepted,
+		resp->reconnects, resp->teardowns, resp->timeouts);
+	printf("\n%-6s %10s %10s %14s %14s %10s %10s %10s\n",
+		"TYPE", "MSGS_IN", "MSGS_OUT", "BYTES_IN", "BYTES_OUT",
+		"P50_US", "P99_US", "MAX_US");
+	for (i = 0; i < resp->ty.ty_len; ++i) {
+		ts = &resp->ty.ty_val[i];
+		printf("%-6u %10" PRIu64 " %10" PRIu64 " %14" PRIu64
+			" %14" PRIu64 " %10" PRIu64 " %10" PRIu64
+			" %10" PRIu64 "\n",
+			ts->ty, ts->msgs_in, ts->msgs_out, ts->bytes_in,
+			ts->bytes_out, msgrstat_hist_pct(ts->lat_hist, 50),
+			msgrstat_hist_pct(ts->lat_hist, 99),
+			msgrstat_hist_pct(ts->lat_hist, 100));
+	}
+	if (resp->conn.conn_len == 0)
+		return;
+	printf("\n%-21s %4s %5s %10s %10s %14s %14s %10s %7s %7s %8s "
+		"%6s %6s\n",
+		"PEER", "LANE", "FLAGS", "MSGS_IN", "MSGS_OUT", "BYTES_IN",
+		"BYTES_OUT", "QUEUED", "PENDING", "ACTIVE", "TIMEOUTS",
+		"LZ4_IN", "LZ4_OUT");
+	for (i = 0; i < resp->conn.conn_len; ++i) {
+		cs = &resp->conn.conn_val[i];
+		if (cs->ip == 0)
+			snprintf(ip_str, sizeof(ip_str), "local");
+		else
+			ipv4_to_str(cs->ip, ip_str, sizeof(ip_str));
+		printf("%15s:%-5u %4u %c%c%c%c  %10" PRIu64 " %10" PRIu64
+			" %14" PRIu64 " %14" PRIu64 " %10" PRIu64
+			" %7u %7u %8u %6.2f %6.2f\n",
+			ip_str, cs->port, cs->lane,
+			(cs->flags & MMM_MSGR_CONN_LOCAL) ? 'L' : '-',
+			(cs->flags & MMM_MSGR_CONN_ESTABLISHED) ? 'E' : '-',
+			(cs->flags & MMM_MSGR_CONN_READ_EOF) ? 'C' : '-',
+			(cs->flags & MMM_MSGR_CONN_LZ4) ? 'Z' : '-',
+			cs->msgs_in, cs->msgs_out, cs->bytes_in,
+			cs->bytes_out, cs->queued_bytes, cs->pending,
+			cs->active, cs->timeouts,
+			msgrstat_ratio(cs->lz4_raw_in, cs->lz4_comp_in),
+			msgrstat_ratio(cs->lz4_raw_out, cs->lz4_comp_out));
+	}
+	if (resp->conn.conn_len < resp->num_conn) {
+		printf("(%u more connections not shown)\n",
+			resp->num_conn - resp->conn.conn_len);
+	}
+}
+
+int fishtool_msgrstat(struct fishtool_params *params)
+{
+	int ret, ety;
+	struct tool_rrctx *rrc;
+	struct daemon_info *dinfo;
+	struct mmm_msgr_stats_req req;
+	struct mmm_msgr_stats_resp resp;
+	struct msg *m;
+	struct mtran *tr;
+
+	rrc = tool_rrctx_alloc(params->cpath);
+	if (IS_ERR(rrc)) {
+		ret = PTR_ERR(rrc);
+		glitch_log("fishtool_msgrstat: error allocating "
+			"rrctx: error %d (%s)\n", ret, terror(ret));
+		return -ret;
+	}
+	ety = msgrstat_get_entity_ty(params);
+	if (ety < 0) {
+		ret = ety;
+		goto done;
+	}
+	dinfo = msgrstat_get_dinfo(params, rrc->cmap);
+	if (!dinfo) {
+		ret = -EINVAL;
+		goto done;
+	}
+	memset(&req, 0, sizeof(req));
+	if (params->lowercase_args[ALPHA_IDX('v')])
+		req.flags |= MMM_MSGR_STATS_CONNS;
+	m = MSG_XDR_ALLOC(mmm_msgr_stats_req, &req);
+	if (IS_ERR(m)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(m));
+		goto done;
+	}
+	bsend_add(rrc->ctx, rrc->msgr, BSF_RESP, m,
+		dinfo->ip, dinfo->port[ety], TOOL_TIMEO, NULL);
+	bsend_join(rrc->ctx);
+	tr = bsend_get_mtran(rrc->ctx, 0);
+	if (IS_ERR(tr->m)) {
+		ret = PTR_ERR(tr->m);
+		glitch_log("error sending mmm_msgr_stats_req: error %d "
+			"(%s)\n", ret, terror(ret));
+		ret = -ret;
+		goto done_reset;
+	}
+	memset(&resp, 0, sizeof(resp));
+	if (MSG_XDR_DECODE(mmm_msgr_stats_resp, tr->m, &resp) < 0) {
+		ret = msg_xdr_decode_as_generic(tr->m);
+		glitch_log("invalid reply from server-- can't understand "
+			"response type %d (error %d)\n",
+			unpack_from_be16(&tr->m->ty), ret);
+		ret = -EIO;
+		goto done_reset;
+	}
+	msgrstat_print(&resp);
+	xdr_free((xdrproc_t)xdr_mmm_msgr_stats_resp, (void*)&resp);
+	ret = 0;
+done_reset:
+	bsend_reset(rrc->ctx);
+done:
+	tool_rrctx_free(rrc);
+	return ret;
+}
+
+static const char *fishtool_msgrstat_usage[] = {
+	"msgrstat: show messenger statistics for a daemon.",
+	"",
+	"usage:",
+	"msgrstat [options]",
+	"",
+	"options:",
+	"-e <entity>    which of the daemon's messengers to ask: mds, osd, or",
+	"               client (default: client)",
+	"-k <oid>       OSD ID to contact",
+	"-m <mid>       MDS ID to contact",
+	"-v             also show statistics for each connection",
+	"",
+	"Latencies are measured from sending a request of the given type to",
+	"receiving the reply, and are rounded up to a power of two.",
+	NULL,
+};
+
+struct fishtool_act g_fishtool_msgrstat = {
+	.name = "msgrstat",
+	.fn = fishtool_msgrstat,
+	.getopt_str = "e:k:v",
+	.usage = fishtool_msgrstat_usage,
+};
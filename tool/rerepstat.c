@@ -0,0 +1,161 @@
+/*
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "common/cluster_map.h"
+#include "common/entity_type.h"
+#include "core/glitch_log.h"
+#include "msg/bsend.h"
+#include "msg/msg.h"
+#include "msg/msgr.h"
+#include "msg/types.h"
+#include "msg/xdr.h"
+#include "tool/common.h"
+#include "tool/tool.h"
+#include "util/error.h"
+#include "util/packed.h"
+#include "util/str_to_int.h"
+#include "util/terror.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TOOL_TIMEO 60
+
+static void rerepstat_print(const struct mmm_rerep_stats_resp *resp)
+{
+	char last_scan[64];
+	time_t t;
+	struct tm tm;
+
+	if (!resp->active) {
+		printf("re-replication is not running on this MDS\n");
+		return;
+	}
+	if (resp->scans == 0) {
+		snprintf(last_scan, sizeof(last_scan), "never");
+	}
+	else {
+		t = resp->last_scan;
+		localtime_r(&t, &tm);
+		strftime(last_scan, sizeof(last_scan), "%Y-%m-%d %H:%M:%S",
+			&tm);
+	}
+	printf("osds_down=%u scans=%" PRIu64 " last_scan=%s\n",
+		resp->osds_down, resp->scans, last_scan);
+	printf("under_rep=%" PRIu64 " one_left=%" PRIu64 " lost=%" PRIu64
+		"\n", resp->under_rep, resp->one_left, resp->lost);
+	printf("in_flight=%u copies_done=%" PRIu64 " copies_failed=%" PRIu64
+		" bytes_copied=%" PRIu64 "\n", resp->in_flight,
+		resp->copies_done, resp->copies_failed, resp->bytes_copied);
+}
+
+int fishtool_rerepstat(struct fishtool_params *params)
+{
+	char err[512] = { 0 };
+	size_t err_len = sizeof(err);
+	int ret, mid;
+	const char *mid_str;
+	struct tool_rrctx *rrc;
+	struct daemon_info *dinfo;
+	struct mmm_rerep_stats_req req;
+	struct mmm_rerep_stats_resp resp;
+	struct msg *m;
+	struct mtran *tr;
+
+	rrc = tool_rrctx_alloc(params->cpath);
+	if (IS_ERR(rrc)) {
+		ret = PTR_ERR(rrc);
+		glitch_log("fishtool_rerepstat: error allocating "
+			"rrctx: error %d (%s)\n", ret, terror(ret));
+		return -ret;
+	}
+	mid = 0;
+	mid_str = params->lowercase_args[ALPHA_IDX('m')];
+	if (mid_str) {
+		mid = str_to_int(mid_str, err, err_len);
+		if (err[0]) {
+			glitch_log("error parsing MDS ID: %s\n", err);
+			ret = -EINVAL;
+			goto done;
+		}
+	}
+	if ((mid < 0) || (mid >= rrc->cmap->num_mds)) {
+		glitch_log("Error: no such MDS as %d\n", mid);
+		ret = -EINVAL;
+		goto done;
+	}
+	dinfo = &rrc->cmap->minfo[mid];
+	memset(&req, 0, sizeof(req));
+	m = MSG_XDR_ALLOC(mmm_rerep_stats_req, &req);
+	if (IS_ERR(m)) {
+		ret = FORCE_NEGATIVE(PTR_ERR(m));
+		goto done;
+	}
+	bsend_add(rrc->ctx, rrc->msgr, BSF_RESP, m,
+		dinfo->ip, dinfo->port[RF_ENTITY_TY_CLI], TOOL_TIMEO, NULL);
+	bsend_join(rrc->ctx);
+	tr = bsend_get_mtran(rrc->ctx, 0);
+	if (IS_ERR(tr->m)) {
+		ret = PTR_ERR(tr->m);
+		glitch_log("error sending mmm_rerep_stats_req: error %d "
+			"(%s)\n", ret, terror(ret));
+		ret = -ret;
+		goto done_reset;
+	}
+	memset(&resp, 0, sizeof(resp));
+	if (MSG_XDR_DECODE(mmm_rerep_stats_resp, tr->m, &resp) < 0) {
+		ret = msg_xdr_decode_as_generic(tr->m);
+		glitch_log("invalid reply from server-- can't understand "
+			"response type %d (error %d)\n",
+			unpack_from_be16(&tr->m->ty), ret);
+		ret = -EIO;
+		goto done_reset;
+	}
+	rerepstat_print(&resp);
+	xdr_free((xdrproc_t)xdr_mmm_rerep_stats_resp, (void*)&resp);
+	ret = 0;
+done_reset:
+	bsend_reset(rrc->ctx);
+done:
+	tool_rrctx_free(rrc);
+	return ret;
+}
+
+static const char *fishtool_rerepstat_usage[] = {
+	"rerepstat: show the progress of chunk re-replication.",
+	"",
+	"usage:",
+	"rerepstat [options]",
+	"",
+	"options:",
+	"-m <mid>       MDS ID to contact (default: 0)",
+	"",
+	"Only the primary MDS re-replicates chunks.  Chunk counts are as of",
+	"the last scan of the chunk table, less the chunks fixed since then.",
+	NULL,
+};
+
+struct fishtool_act g_fishtool_rerepstat = {
+	.name = "rerepstat",
+	.fn = fishtool_rerepstat,
+	.getopt_str = "",
+	.usage = fishtool_rerepstat_usage,
+};
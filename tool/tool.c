@@ -32,13 +32,17 @@ struct fishtool_act g_fishtool_chmod;
 struct fishtool_act g_fishtool_chown;
 struct fishtool_act g_fishtool_locate;
 struct fishtool_act g_fishtool_mkdirs;
+struct fishtool_act g_fishtool_msgrstat;
 struct fishtool_act g_fishtool_ping;
 struct fishtool_act g_fishtool_read;
 struct fishtool_act g_fishtool_rename;
+struct fishtool_act g_fishtool_rerepstat;
 struct fishtool_act g_fishtool_unlink;
 struct fishtool_act g_fishtool_write;
 struct fishtool_act g_fishtool_chunk_write;
 struct fishtool_act g_fishtool_chunk_read;
+struct fishtool_act g_fishtool_chunk_copy;
+struct fishtool_act g_fishtool_chunk_csum;
 struct fishtool_act g_fishtool_usermod;
 
 const struct fishtool_act *g_fishtool_acts[] = {
@@ -46,13 +50,17 @@ const struct fishtool_act *g_fishtool_acts[] = {
 	&g_fishtool_chown,
 	&g_fishtool_locate,
 	&g_fishtool_mkdirs,
+	&g_fishtool_msgrstat,
 	&g_fishtool_ping,
 	&g_fishtool_read,
 	&g_fishtool_rename,
+	&g_fishtool_rerepstat,
 	&g_fishtool_unlink,
 	&g_fishtool_write,
 	&g_fishtool_chunk_write,
 	&g_fishtool_chunk_read,
+	&g_fishtool_chunk_copy,
+	&g_fishtool_chunk_csum,
 	&g_fishtool_usermod,
 	NULL,
 };
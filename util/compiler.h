@@ -27,6 +27,7 @@
 // TODO: actually test this to see if it compiles under Windows
 #define PACKED(D) __pragma( pack(push, 1) ) D __pragma( pack(pop) )
 #define PACKED_ALIGNED(A, D) __pragma( pack(push, A) ) D __pragma( pack(pop) )
+#define ALIGNED(A, D) __declspec(align(A)) D
 #define likely(x)
 #define unlikely(x)
 #define restrict __restrict
@@ -38,6 +39,7 @@
 #elif __GNUC__ /* GCC */
 #define PACKED(D) D __attribute__((__packed__))
 #define PACKED_ALIGNED(A, D) D __attribute__((__packed__, __aligned__(A)))
+#define ALIGNED(A, D) D __attribute__((__aligned__(A)))
 #define likely(x)      __builtin_expect(!!(x), 1)
 #define unlikely(x)    __builtin_expect(!!(x), 0)
 #define restrict       __restrict__
@@ -0,0 +1,142 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/crc32c.h"
+
+#include <endian.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/** The CRC32C polynomial, bit-reversed */
+#define CRC32C_POLY 0x82f63b78
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static pthread_once_t g_crc32c_once = PTHREAD_ONCE_INIT;
+
+/** Slicing-by-8 tables.  g_crc32c_tab[0] is the ordinary byte-at-a-time
+ * table; g_crc32c_tab[k][b] is the CRC of byte b followed by k zero bytes. */
+static uint32_t g_crc32c_tab[8][256];
+
+/** The implementation that crc32c uses */
+static crc32c_fn_t g_crc32c_fn;
+
+static uint32_t crc32c_load_le32(const uint8_t *buf)
+{
+	uint32_t u;
+
+	memcpy(&u, buf, sizeof(u));
+	return le32toh(u);
+}
+
+static uint32_t crc32c_sw_impl(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t lo, hi;
+
+	while ((len > 0) && ((uintptr_t)buf & 7)) {
+		crc = g_crc32c_tab[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc32c_load_le32(buf) ^ crc;
+		hi = crc32c_load_le32(buf + 4);
+		crc = g_crc32c_tab[7][lo & 0xff] ^
+			g_crc32c_tab[6][(lo >> 8) & 0xff] ^
+			g_crc32c_tab[5][(lo >> 16) & 0xff] ^
+			g_crc32c_tab[4][lo >> 24] ^
+			g_crc32c_tab[3][hi & 0xff] ^
+			g_crc32c_tab[2][(hi >> 8) & 0xff] ^
+			g_crc32c_tab[1][(hi >> 16) & 0xff] ^
+			g_crc32c_tab[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = g_crc32c_tab[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_impl(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t c = crc, w;
+
+	while ((len > 0) && ((uintptr_t)buf & 7)) {
+		c = __builtin_ia32_crc32qi(c, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&w, buf, sizeof(w));
+		c = __builtin_ia32_crc32di(c, w);
+		buf += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		c = __builtin_ia32_crc32qi(c, *buf++);
+		len--;
+	}
+	return c;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	int i, j;
+	uint32_t crc;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		g_crc32c_tab[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i) {
+		crc = g_crc32c_tab[0][i];
+		for (j = 1; j < 8; ++j) {
+			crc = g_crc32c_tab[0][crc & 0xff] ^ (crc >> 8);
+			g_crc32c_tab[j][i] = crc;
+		}
+	}
+	g_crc32c_fn = crc32c_sw_impl;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("sse4.2"))
+		g_crc32c_fn = crc32c_hw_impl;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&g_crc32c_once, crc32c_init);
+	return ~g_crc32c_fn(~crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&g_crc32c_once, crc32c_init);
+	return ~crc32c_sw_impl(~crc, buf, len);
+}
+
+int crc32c_is_accelerated(void)
+{
+	pthread_once(&g_crc32c_once, crc32c_init);
+	return g_crc32c_fn != crc32c_sw_impl;
+}
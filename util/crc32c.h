@@ -0,0 +1,68 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_UTIL_CRC32C_DOT_H
+#define REDFISH_UTIL_CRC32C_DOT_H
+
+/*
+ * CRC32C (Castagnoli)
+ *
+ * This is the CRC used by iSCSI, ext4 and HDFS.  On x86-64 processors with
+ * SSE4.2, it is computed with the crc32 instruction, eight bytes at a time.
+ * Elsewhere, we fall back on a slicing-by-8 table lookup.  Both give the same
+ * results.
+ *
+ * CRCs can be computed incrementally: crc32c(crc32c(0, a), b) is the same as
+ * crc32c(0, a followed by b).
+ */
+
+#include <stdint.h> /* for uint32_t */
+#include <unistd.h> /* for size_t */
+
+/** Compute a CRC32C
+ *
+ * @param crc		The CRC of the data that came before, or 0 to start a
+ *			new CRC
+ * @param buf		The data
+ * @param len		Length of the data
+ *
+ * @return		The CRC
+ */
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/** Compute a CRC32C without using any special instructions
+ *
+ * This is slower than crc32c, and only exists so that the two can be checked
+ * against each other.
+ *
+ * @param crc		The CRC of the data that came before, or 0 to start a
+ *			new CRC
+ * @param buf		The data
+ * @param len		Length of the data
+ *
+ * @return		The CRC
+ */
+extern uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/** Find out whether crc32c is using hardware acceleration
+ *
+ * @return		1 if it is; 0 otherwise
+ */
+extern int crc32c_is_accelerated(void);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/crc32c.h"
+#include "util/test.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CRC32C_UNIT_BUF_LEN 4096
+
+static int crc32c_test_vectors(void)
+{
+	char buf[32];
+
+	/* From RFC 3720, appendix B.4 */
+	memset(buf, 0, sizeof(buf));
+	EXPECT_EQ(crc32c(0, buf, 32), 0x8a9136aa);
+	memset(buf, 0xff, sizeof(buf));
+	EXPECT_EQ(crc32c(0, buf, 32), 0x62a8ab43);
+	EXPECT_EQ(crc32c(0, "123456789", 9), 0xe3069283);
+	EXPECT_EQ(crc32c_sw(0, "123456789", 9), 0xe3069283);
+	EXPECT_EQ(crc32c(0, "", 0), 0);
+	return 0;
+}
+
+static int crc32c_test_hw_matches_sw(void)
+{
+	int i, off, len;
+	unsigned char *buf;
+
+	buf = malloc(CRC32C_UNIT_BUF_LEN);
+	EXPECT_NOT_EQ(buf, NULL);
+	srandom(1234);
+	for (i = 0; i < CRC32C_UNIT_BUF_LEN; ++i)
+		buf[i] = random();
+	/* Try every alignment, and lengths around the 8-byte boundaries */
+	for (off = 0; off < 16; ++off) {
+		for (len = 0; len < 80; ++len) {
+			EXPECT_EQ(crc32c(0, buf + off, len),
+				crc32c_sw(0, buf + off, len));
+		}
+		len = CRC32C_UNIT_BUF_LEN - off;
+		EXPECT_EQ(crc32c(0, buf + off, len),
+			crc32c_sw(0, buf + off, len));
+	}
+	free(buf);
+	return 0;
+}
+
+static int crc32c_test_incremental(void)
+{
+	int i, split;
+	char buf[1000];
+	uint32_t whole, crc;
+
+	for (i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = i * 7;
+	whole = crc32c(0, buf, sizeof(buf));
+	for (split = 0; split <= (int)sizeof(buf); split += 37) {
+		crc = crc32c(0, buf, split);
+		crc = crc32c(crc, buf + split, sizeof(buf) - split);
+		EXPECT_EQ(crc, whole);
+		crc = crc32c_sw(0, buf, split);
+		crc = crc32c_sw(crc, buf + split, sizeof(buf) - split);
+		EXPECT_EQ(crc, whole);
+	}
+	return 0;
+}
+
+int main(void)
+{
+	fprintf(stderr, "crc32c hardware acceleration: %s\n",
+		crc32c_is_accelerated() ? "yes" : "no");
+	EXPECT_ZERO(crc32c_test_vectors());
+	EXPECT_ZERO(crc32c_test_hw_matches_sw());
+	EXPECT_ZERO(crc32c_test_incremental());
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,297 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/lz4.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/** log2 of the number of entries in the compressor's hash table */
+#define LZ4_HASH_LOG 12
+
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_LOG)
+
+/** Minimum length of a match */
+#define LZ4_MIN_MATCH 4
+
+/** The last match must start at least this many bytes before the end */
+#define LZ4_MF_LIMIT 12
+
+/** The last this many bytes are always literals */
+#define LZ4_LAST_LITERALS 5
+
+/** Largest offset a match can have */
+#define LZ4_MAX_OFFSET 65535
+
+/** Once this many bytes in a row fail to match, we start skipping ahead */
+#define LZ4_SKIP_TRIGGER 6
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t lz4_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/** Find how many bytes two buffers have in common
+ *
+ * @param a		The first buffer
+ * @param b		The second buffer.  Must come before a.
+ * @param limit		Don't look at a or beyond this
+ *
+ * @return		Number of leading bytes that match
+ */
+static uint32_t lz4_count(const uint8_t *a, const uint8_t *b,
+		const uint8_t *limit)
+{
+	const uint8_t *start = a;
+	uint64_t diff;
+
+	while (a + sizeof(uint64_t) <= limit) {
+		diff = lz4_read64(a) ^ lz4_read64(b);
+		if (diff) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return (a - start) + (__builtin_ctzll(diff) >> 3);
+#else
+			return (a - start) + (__builtin_clzll(diff) >> 3);
+#endif
+		}
+		a += sizeof(uint64_t);
+		b += sizeof(uint64_t);
+	}
+	while ((a < limit) && (*a == *b)) {
+		++a;
+		++b;
+	}
+	return a - start;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/** Write an LZ4 length extension
+ *
+ * @param op		(inout) output pointer
+ * @param oend		End of the output buffer
+ * @param len		Length left over after the 4 bits in the token
+ *
+ * @return		0 on success; -1 if we ran out of room
+ */
+static int lz4_put_len(uint8_t **op, const uint8_t *oend, uint32_t len)
+{
+	uint8_t *o = *op;
+
+	for (; len >= 255; len -= 255) {
+		if (o >= oend)
+			return -1;
+		*o++ = 255;
+	}
+	if (o >= oend)
+		return -1;
+	*o++ = len;
+	*op = o;
+	return 0;
+}
+
+/** Write one sequence: some literals, followed by an optional match
+ *
+ * @param op		(inout) output pointer
+ * @param oend		End of the output buffer
+ * @param lit		The literals
+ * @param lit_len	Number of literals
+ * @param off		Offset of the match, or 0 if this is the final sequence
+ * @param match_len	Length of the match, minus LZ4_MIN_MATCH
+ *
+ * @return		0 on success; -1 if we ran out of room
+ */
+static int lz4_put_seq(uint8_t **op, const uint8_t *oend, const uint8_t *lit,
+		uint32_t lit_len, uint32_t off, uint32_t match_len)
+{
+	uint8_t *o = *op, *token;
+
+	if (o >= oend)
+		return -1;
+	token = o++;
+	*token = ((lit_len < 15) ? lit_len : 15) << 4;
+	if ((lit_len >= 15) && lz4_put_len(&o, oend, lit_len - 15))
+		return -1;
+	if ((uint32_t)(oend - o) < lit_len)
+		return -1;
+	memcpy(o, lit, lit_len);
+	o += lit_len;
+	if (off) {
+		if (oend - o < 2)
+			return -1;
+		*o++ = off & 0xff;
+		*o++ = off >> 8;
+		*token |= (match_len < 15) ? match_len : 15;
+		if ((match_len >= 15) &&
+				lz4_put_len(&o, oend, match_len - 15))
+			return -1;
+	}
+	*op = o;
+	return 0;
+}
+
+int lz4_compress(const char *src, int src_len, char *dst, int dst_len)
+{
+	uint32_t htab[LZ4_HASH_SIZE], h, seq;
+	const uint8_t *base = (const uint8_t*)src;
+	const uint8_t *ip = base, *anchor = base, *ref, *mp;
+	const uint8_t *iend = base + src_len;
+	const uint8_t *mflimit = iend - LZ4_MF_LIMIT;
+	const uint8_t *matchlimit = iend - LZ4_LAST_LITERALS;
+	uint8_t *op = (uint8_t*)dst;
+	const uint8_t *oend = op + dst_len;
+
+	if (src_len > LZ4_MF_LIMIT) {
+		memset(htab, 0, sizeof(htab));
+		while (ip < mflimit) {
+			seq = lz4_read32(ip);
+			h = lz4_hash(seq);
+			ref = base + htab[h];
+			htab[h] = ip - base;
+			if ((ref >= ip) || (ip - ref > LZ4_MAX_OFFSET) ||
+					(lz4_read32(ref) != seq)) {
+				ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+				continue;
+			}
+			/* Extend the match backwards over the literals, and
+			 * then forwards as far as it will go. */
+			while ((ip > anchor) && (ref > base) &&
+					(ip[-1] == ref[-1])) {
+				--ip;
+				--ref;
+			}
+			mp = ip + LZ4_MIN_MATCH;
+			mp += lz4_count(mp, ref + LZ4_MIN_MATCH, matchlimit);
+			if (lz4_put_seq(&op, oend, anchor, ip - anchor,
+					ip - ref, (mp - ip) - LZ4_MIN_MATCH))
+				return 0;
+			ip = anchor = mp;
+			/* Remember a position near the end of the match, so
+			 * that a repeat of it can be found again. */
+			if (ip < mflimit)
+				htab[lz4_hash(lz4_read32(ip - 2))] =
+					(ip - 2) - base;
+		}
+	}
+	if (lz4_put_seq(&op, oend, anchor, iend - anchor, 0, 0))
+		return 0;
+	return op - (uint8_t*)dst;
+}
+
+/** Read an LZ4 length extension
+ *
+ * @param ip		(inout) input pointer
+ * @param iend		End of the input
+ * @param len		(inout) the length to add to
+ *
+ * @return		0 on success; -1 if the input is malformed
+ */
+static int lz4_get_len(const uint8_t **ip, const uint8_t *iend,
+		uint32_t *len)
+{
+	const uint8_t *i = *ip;
+	uint32_t l = *len;
+	uint8_t b;
+
+	do {
+		if (i >= iend)
+			return -1;
+		b = *i++;
+		/* Nothing we decompress can be anywhere near this big. */
+		if (l > 0x7fffffffU - b)
+			return -1;
+		l += b;
+	} while (b == 255);
+	*ip = i;
+	*len = l;
+	return 0;
+}
+
+int lz4_decompress(const char *src, int src_len, char *dst, int dst_len)
+{
+	const uint8_t *ip = (const uint8_t*)src, *iend = ip + src_len;
+	uint8_t *op = (uint8_t*)dst, *oend = op + dst_len, *ref;
+	uint32_t lit_len, match_len, off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit_len = token >> 4;
+		if ((lit_len == 15) && lz4_get_len(&ip, iend, &lit_len))
+			return -EINVAL;
+		if (((uint32_t)(iend - ip) < lit_len) ||
+				((uint32_t)(oend - op) < lit_len))
+			return -EINVAL;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == iend)
+			break;
+		if (iend - ip < 2)
+			return -EINVAL;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((off == 0) || (off > (uint32_t)(op - (uint8_t*)dst)))
+			return -EINVAL;
+		match_len = token & 0xf;
+		if ((match_len == 15) && lz4_get_len(&ip, iend, &match_len))
+			return -EINVAL;
+		match_len += LZ4_MIN_MATCH;
+		if ((uint32_t)(oend - op) < match_len)
+			return -EINVAL;
+		ref = op - off;
+		if (off >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		}
+		else if (off >= sizeof(uint64_t)) {
+			/* The match overlaps the bytes it produces, but each
+			 * word we copy is already there. */
+			for (; match_len >= sizeof(uint64_t);
+					match_len -= sizeof(uint64_t)) {
+				memcpy(op, ref, sizeof(uint64_t));
+				op += sizeof(uint64_t);
+				ref += sizeof(uint64_t);
+			}
+			while (match_len--)
+				*op++ = *ref++;
+		}
+		else {
+			/* A short repeating pattern, which is how LZ4
+			 * encodes runs. */
+			while (match_len--)
+				*op++ = *ref++;
+		}
+	}
+	return (op == oend) ? 0 : -EINVAL;
+}
@@ -0,0 +1,65 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_UTIL_LZ4_DOT_H
+#define REDFISH_UTIL_LZ4_DOT_H
+
+/*
+ * LZ4 block compression
+ *
+ * This is a small implementation of the LZ4 block format, as described in
+ * lz4_Block_format.md in the LZ4 distribution.  Data compressed here can be
+ * decompressed by the reference implementation and vice versa.  Only the block
+ * format is supported, not the frame format; callers have to keep track of the
+ * uncompressed length themselves.
+ *
+ * The compressor favors speed over ratio: it uses a single hash table of
+ * recent 4-byte sequences and takes the first match it finds.  Runs of data
+ * that don't compress are skipped over faster and faster, so incompressible
+ * input costs little more than a copy.
+ */
+
+/** Compress a buffer
+ *
+ * @param src		The data to compress
+ * @param src_len	Length of src
+ * @param dst		(out param) the compressed data
+ * @param dst_len	Length of dst
+ *
+ * @return		The length of the compressed data, or 0 if it would not
+ *			fit in dst_len bytes
+ */
+extern int lz4_compress(const char *src, int src_len, char *dst, int dst_len);
+
+/** Decompress a buffer
+ *
+ * The input is fully validated, so it's safe to use this on data that came
+ * off the network.
+ *
+ * @param src		The compressed data
+ * @param src_len	Length of src
+ * @param dst		(out param) the decompressed data
+ * @param dst_len	Length of the decompressed data
+ *
+ * @return		0 on success; -EINVAL if src is malformed or does not
+ *			decompress to exactly dst_len bytes
+ */
+extern int lz4_decompress(const char *src, int src_len, char *dst,
+		int dst_len);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2011-2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "util/lz4.h"
+#include "util/test.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ4_UNIT_MAX_LEN (1024 * 1024)
+
+/** Worst-case compressed length for an input of a given length */
+#define LZ4_UNIT_BOUND(len) ((len) + ((len) / 255) + 16)
+
+static int lz4_test_round_trip(const char *src, int len)
+{
+	char *comp, *out;
+	int clen;
+
+	comp = malloc(LZ4_UNIT_BOUND(len));
+	EXPECT_NOT_EQ(comp, NULL);
+	out = malloc(len + 1);
+	EXPECT_NOT_EQ(out, NULL);
+	clen = lz4_compress(src, len, comp, LZ4_UNIT_BOUND(len));
+	EXPECT_GT(clen, 0);
+	EXPECT_ZERO(lz4_decompress(comp, clen, out, len));
+	EXPECT_ZERO(memcmp(src, out, len));
+	/* The decompressed length has to be exactly right. */
+	EXPECT_EQ(lz4_decompress(comp, clen, out, len + 1), -EINVAL);
+	if (len > 0) {
+		EXPECT_EQ(lz4_decompress(comp, clen, out, len - 1),
+			-EINVAL);
+	}
+	free(comp);
+	free(out);
+	return 0;
+}
+
+/** Fill a buffer with something that looks like a log file */
+static void lz4_test_fill_text(char *buf, int len)
+{
+	static const char *words[] = { "INFO", "WARN", "block", "replica",
+		"osd", "chunk", "written", "to", "from", "client" };
+	int off = 0, i = 0;
+	char line[128];
+
+	while (off < len) {
+		snprintf(line, sizeof(line), "2012-04-%02d %s %s %d %s %s "
+			"%d\n", (i % 28) + 1, words[i % 2], words[2 + (i % 8)],
+			i * 7, words[2 + ((i / 3) % 8)], words[2 + ((i / 5) % 8)],
+			(i * 31) % 1000);
+		snprintf(buf + off, len - off, "%s", line);
+		off += strlen(line);
+		++i;
+	}
+}
+
+static int lz4_test_round_trips(void)
+{
+	int i;
+	char *buf;
+
+	buf = malloc(LZ4_UNIT_MAX_LEN + 1);
+	EXPECT_NOT_EQ(buf, NULL);
+
+	/* Short inputs are all literals. */
+	for (i = 0; i < 32; ++i) {
+		memset(buf, 'a', i);
+		EXPECT_ZERO(lz4_test_round_trip(buf, i));
+	}
+	memset(buf, 0, LZ4_UNIT_MAX_LEN);
+	EXPECT_ZERO(lz4_test_round_trip(buf, LZ4_UNIT_MAX_LEN));
+	for (i = 0; i < LZ4_UNIT_MAX_LEN; ++i)
+		buf[i] = "abcdefg"[i % 7];
+	EXPECT_ZERO(lz4_test_round_trip(buf, LZ4_UNIT_MAX_LEN));
+	lz4_test_fill_text(buf, LZ4_UNIT_MAX_LEN + 1);
+	EXPECT_ZERO(lz4_test_round_trip(buf, LZ4_UNIT_MAX_LEN));
+	EXPECT_ZERO(lz4_test_round_trip(buf, 1000));
+	srandom(1234);
+	for (i = 0; i < LZ4_UNIT_MAX_LEN; ++i)
+		buf[i] = random();
+	EXPECT_ZERO(lz4_test_round_trip(buf, LZ4_UNIT_MAX_LEN));
+	EXPECT_ZERO(lz4_test_round_trip(buf, 100));
+	/* Random data with long repeats far apart */
+	memcpy(buf + 70000, buf, 50000);
+	memcpy(buf + 200000, buf + 10, 1000);
+	EXPECT_ZERO(lz4_test_round_trip(buf, LZ4_UNIT_MAX_LEN));
+	free(buf);
+	return 0;
+}
+
+static int lz4_test_ratio(void)
+{
+	char *buf, *comp;
+	int clen;
+
+	buf = malloc(LZ4_UNIT_MAX_LEN + 1);
+	EXPECT_NOT_EQ(buf, NULL);
+	comp = malloc(LZ4_UNIT_MAX_LEN);
+	EXPECT_NOT_EQ(comp, NULL);
+
+	/* Text should compress well. */
+	lz4_test_fill_text(buf, LZ4_UNIT_MAX_LEN + 1);
+	clen = lz4_compress(buf, LZ4_UNIT_MAX_LEN, comp, LZ4_UNIT_MAX_LEN);
+	EXPECT_GT(clen, 0);
+	EXPECT_LT(clen, LZ4_UNIT_MAX_LEN / 2);
+
+	/* Random data shouldn't compress at all, and we should say so rather
+	 * than overrunning the output buffer. */
+	srandom(5678);
+	for (clen = 0; clen < LZ4_UNIT_MAX_LEN; ++clen)
+		buf[clen] = random();
+	EXPECT_ZERO(lz4_compress(buf, LZ4_UNIT_MAX_LEN, comp,
+		LZ4_UNIT_MAX_LEN - 1));
+	free(comp);
+	free(buf);
+	return 0;
+}
+
+static int lz4_test_decompress_vector(void)
+{
+	/* "abc", then a 12-byte match at offset 3, then "xyzzy" */
+	static const char vec[] = { 0x38, 'a', 'b', 'c', 0x03, 0x00,
+		0x50, 'x', 'y', 'z', 'z', 'y' };
+	static const char expect[] = "abcabcabcabcabcxyzzy";
+	char out[sizeof(expect)];
+
+	EXPECT_ZERO(lz4_decompress(vec, sizeof(vec), out,
+		sizeof(expect) - 1));
+	EXPECT_ZERO(memcmp(out, expect, sizeof(expect) - 1));
+	return 0;
+}
+
+static int lz4_test_malformed(void)
+{
+	static const char match_before_start[] = { 0x14, 'a', 0x02, 0x00,
+		0x50, 'x', 'y', 'z', 'z', 'y' };
+	static const char zero_off[] = { 0x14, 'a', 0x00, 0x00, 0x00 };
+	static const char long_lit[] = { 0xf0, 0xff, 0xff, 0xff, 0x10 };
+	static const char trunc_off[] = { 0x14, 'a', 0x01 };
+	char out[512], comp[512];
+	int i, clen;
+
+	EXPECT_EQ(lz4_decompress(match_before_start,
+		sizeof(match_before_start), out, 10), -EINVAL);
+	EXPECT_EQ(lz4_decompress(zero_off, sizeof(zero_off), out, 9),
+		-EINVAL);
+	EXPECT_EQ(lz4_decompress(long_lit, sizeof(long_lit), out,
+		sizeof(out)), -EINVAL);
+	EXPECT_EQ(lz4_decompress(trunc_off, sizeof(trunc_off), out, 9),
+		-EINVAL);
+
+	/* Every truncation of a valid stream must be rejected. */
+	memset(out, 'q', 300);
+	memcpy(out + 100, "hello", 5);
+	clen = lz4_compress(out, 300, comp, sizeof(comp));
+	EXPECT_GT(clen, 0);
+	for (i = 0; i < clen; ++i)
+		EXPECT_EQ(lz4_decompress(comp, i, out, 300), -EINVAL);
+	return 0;
+}
+
+int main(void)
+{
+	EXPECT_ZERO(lz4_test_round_trips());
+	EXPECT_ZERO(lz4_test_ratio());
+	EXPECT_ZERO(lz4_test_decompress_vector());
+	EXPECT_ZERO(lz4_test_malformed());
+	return EXIT_SUCCESS;
+}
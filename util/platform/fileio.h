@@ -0,0 +1,73 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_UTIL_PLATFORM_FILEIO_DOT_H
+#define REDFISH_UTIL_PLATFORM_FILEIO_DOT_H
+
+#include <stdint.h> /* for uint64_t */
+
+/*
+ * File space reservation and direct I/O.
+ *
+ * Neither of these is needed for correctness, so on platforms which don't
+ * have them, the functions here fail with -EOPNOTSUPP and callers carry on
+ * without them.
+ */
+
+/** Alignment of the buffers, file offsets and lengths used for direct I/O */
+#define DIRECT_IO_ALIGN 4096
+
+/** Reserve disk space for part of a file, without changing the file's size
+ *
+ * @param fd		The file descriptor
+ * @param off		Start of the range to reserve
+ * @param len		Length of the range to reserve
+ *
+ * @return		0 on success; -EOPNOTSUPP if the platform or the
+ *			filesystem can't do this; another negative error code
+ *			otherwise
+ */
+extern int do_prealloc(int fd, uint64_t off, uint64_t len);
+
+/** Give back any disk space reserved past the end of a file
+ *
+ * @param fd		The file descriptor
+ * @param size		The size of the file.  If the file isn't this size,
+ *			nothing is done, so that data can never be cut off.
+ *
+ * @return		0 on success; -EINVAL if the file isn't the given
+ *			size; -EOPNOTSUPP if the platform can't do this;
+ *			another negative error code otherwise
+ */
+extern int do_unprealloc(int fd, uint64_t size);
+
+/** Open a file for direct I/O, which bypasses the page cache
+ *
+ * Reads and writes on the file descriptor must use buffers, offsets and
+ * lengths which are multiples of DIRECT_IO_ALIGN.
+ *
+ * @param path		Path to the file
+ * @param flags		Flags to pass to open(2)
+ *
+ * @return		The file descriptor on success; -EOPNOTSUPP if the
+ *			platform or the filesystem doesn't support direct I/O;
+ *			another negative error code otherwise
+ */
+extern int do_open_direct(const char *path, int flags);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/error.h"
+#include "util/platform/fileio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int do_prealloc(int fd, uint64_t off, uint64_t len)
+{
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, off, len))
+		return -errno;
+	return 0;
+}
+
+int do_unprealloc(int fd, uint64_t size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+	if ((uint64_t)st.st_size != size)
+		return -EINVAL;
+	/* Punching a hole past the end of the file doesn't free anything on
+	 * some filesystems, like ext4.  Truncating the file to its own size
+	 * does. */
+	if (ftruncate(fd, size))
+		return -errno;
+	return 0;
+}
+
+int do_open_direct(const char *path, int flags)
+{
+	int fd, ret;
+
+	RETRY_ON_EINTR(fd, open(path, flags | O_DIRECT));
+	if (fd >= 0)
+		return fd;
+	ret = errno;
+	/* Some filesystems, like tmpfs, refuse O_DIRECT with EINVAL */
+	if (ret == EINVAL)
+		return -EOPNOTSUPP;
+	return -ret;
+}
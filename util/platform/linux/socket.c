@@ -21,8 +21,13 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 int do_socket(int domain, int type, int proto, enum redfish_plat_flags_t pf)
@@ -84,3 +89,42 @@ int do_accept(int sock, struct sockaddr *addr, socklen_t len,
 	}
 	return fd;
 }
+
+ssize_t do_sendfile(int sock, int fd, uint64_t off, size_t len)
+{
+	ssize_t res;
+	off_t o = off;
+
+	res = sendfile(sock, fd, &o, len);
+	if (res < 0)
+		return -errno;
+	return res;
+}
+
+int get_local_sockaddr(uint16_t port, struct sockaddr_un *addr,
+		socklen_t *addr_len)
+{
+	int len;
+
+	/* We use the abstract socket namespace, so there are no files to
+	 * create or clean up, and the socket goes away when the listener
+	 * exits. */
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+		"redfish.msgr.%d", port);
+	*addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	return 0;
+}
+
+int check_local_peer(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return -errno;
+	if (cred.uid != geteuid())
+		return -EPERM;
+	return 0;
+}
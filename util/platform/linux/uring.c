@@ -0,0 +1,441 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/compiler.h"
+#include "util/error.h"
+#include "util/platform/uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* We talk to the kernel directly rather than depending on liburing.  We only
+ * need a handful of operations, and the ring protocol itself is simple. */
+
+struct uring {
+	/** The ring file descriptor */
+	int fd;
+	/** Number of submission queue entries */
+	unsigned int sq_entries;
+	/** Submission queue ring mapping */
+	void *sq_ring;
+	size_t sq_ring_sz;
+	/** Completion queue ring mapping.  May be the same as sq_ring. */
+	void *cq_ring;
+	size_t cq_ring_sz;
+	/** Submission queue entries */
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/** Our copy of the submission queue tail.  Entries between *sq_tail
+	 * and this haven't been handed to the kernel yet. */
+	unsigned int sqe_tail;
+};
+
+/** Operations we need the kernel to support */
+static const int g_uring_required_ops[] = {
+	IORING_OP_POLL_ADD,
+	IORING_OP_SEND,
+	IORING_OP_RECV,
+	IORING_OP_READ,
+	IORING_OP_WRITE,
+};
+
+static int uring_probe(int fd)
+{
+	int ret, i;
+	size_t len;
+	struct io_uring_probe *probe;
+
+	len = sizeof(struct io_uring_probe) +
+		(256 * sizeof(struct io_uring_probe_op));
+	probe = calloc(1, len);
+	if (!probe)
+		return -ENOMEM;
+	ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			probe, 256);
+	if (ret < 0) {
+		/* Kernels that are too old to support probing are also too
+		 * old to support IORING_OP_SEND and IORING_OP_RECV. */
+		ret = -ENOTSUP;
+		goto done;
+	}
+	for (i = 0; i < (int)(sizeof(g_uring_required_ops) /
+			sizeof(g_uring_required_ops[0])); ++i) {
+		int op = g_uring_required_ops[i];
+		if ((op > probe->last_op) ||
+			!(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			ret = -ENOTSUP;
+			goto done;
+		}
+	}
+	ret = 0;
+done:
+	free(probe);
+	return ret;
+}
+
+int uring_init(unsigned int entries, struct uring **out)
+{
+	int ret, POSSIBLY_UNUSED(res);
+	struct uring *ring;
+	struct io_uring_params p;
+
+	ring = calloc(1, sizeof(struct uring));
+	if (!ring)
+		return -ENOMEM;
+	memset(&p, 0, sizeof(p));
+	/* Give the completion queue some headroom, since each connection can
+	 * have several operations in flight. */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		ret = (errno == ENOSYS) ? -ENOTSUP : -errno;
+		goto error_free_ring;
+	}
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		/* Without NODROP, completions can be lost when the completion
+		 * queue overflows. */
+		ret = -ENOTSUP;
+		goto error_close_fd;
+	}
+	ret = uring_probe(ring->fd);
+	if (ret)
+		goto error_close_fd;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_ring_sz = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+	ring->cq_ring_sz = p.cq_off.cqes +
+		(p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto error_close_fd;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	}
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto error_unmap_sq_ring;
+		}
+	}
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto error_unmap_cq_ring;
+	}
+	ring->sq_head = (unsigned*)((char*)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ring +
+		p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ring +
+		p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring +
+		p.cq_off.cqes);
+	ring->sqe_tail = *ring->sq_tail;
+	*out = ring;
+	return 0;
+
+error_unmap_cq_ring:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+error_unmap_sq_ring:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+error_close_fd:
+	RETRY_ON_EINTR(res, close(ring->fd));
+error_free_ring:
+	free(ring);
+	return ret;
+}
+
+void uring_free(struct uring *ring)
+{
+	int res;
+
+	munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	RETRY_ON_EINTR(res, close(ring->fd));
+	free(ring);
+}
+
+int uring_get_fd(const struct uring *ring)
+{
+	return ring->fd;
+}
+
+static int uring_enter(struct uring *ring, unsigned int to_submit,
+		unsigned int min_complete)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+int uring_submit(struct uring *ring, int wait)
+{
+	int ret;
+	unsigned int to_submit;
+
+	/* Publish the new entries before telling the kernel about them.  We
+	 * count everything the kernel hasn't consumed yet, in case an earlier
+	 * call didn't get through all of it. */
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sqe_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if ((to_submit == 0) && (!wait))
+		return 0;
+	do {
+		ret = uring_enter(ring, to_submit, wait ? 1 : 0);
+	} while (ret == -EINTR);
+	if (ret < 0)
+		return ret;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	int ret;
+	unsigned int head;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries) {
+		ret = uring_submit(ring, 0);
+		if (ret)
+			return ERR_PTR(-ret);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sqe_tail - head >= ring->sq_entries)
+			return ERR_PTR(EBUSY);
+	}
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] =
+		ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_prep_recv(struct uring *ring, int sock, void *buf,
+		size_t len, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (IS_ERR(sqe))
+		return FORCE_NEGATIVE(PTR_ERR(sqe));
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sock;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int uring_prep_send(struct uring *ring, int sock, const void *buf,
+		size_t len, int flags, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (IS_ERR(sqe))
+		return FORCE_NEGATIVE(PTR_ERR(sqe));
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sock;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int uring_prep_read(struct uring *ring, int fd, void *buf,
+		size_t len, uint64_t off, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (IS_ERR(sqe))
+		return FORCE_NEGATIVE(PTR_ERR(sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int uring_prep_write(struct uring *ring, int fd, const void *buf,
+		size_t len, uint64_t off, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (IS_ERR(sqe))
+		return FORCE_NEGATIVE(PTR_ERR(sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int uring_prep_poll(struct uring *ring, int fd, short events,
+		uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (IS_ERR(sqe))
+		return FORCE_NEGATIVE(PTR_ERR(sqe));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = (unsigned short)events;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int uring_reap(struct uring *ring, struct uring_cqe_info *cqes, int max)
+{
+	int num = 0;
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while ((head != tail) && (num < max)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		cqes[num].user_data = cqe->user_data;
+		cqes[num].res = cqe->res;
+		num++;
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return num;
+}
+
+#else
+
+/* The kernel headers we were built against don't know about io_uring. */
+
+int uring_init(POSSIBLY_UNUSED(unsigned int entries),
+		POSSIBLY_UNUSED(struct uring **ring))
+{
+	return -ENOTSUP;
+}
+
+void uring_free(POSSIBLY_UNUSED(struct uring *ring))
+{
+}
+
+int uring_get_fd(POSSIBLY_UNUSED(const struct uring *ring))
+{
+	return -1;
+}
+
+int uring_prep_recv(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int sock), POSSIBLY_UNUSED(void *buf),
+		POSSIBLY_UNUSED(size_t len),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_send(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int sock), POSSIBLY_UNUSED(const void *buf),
+		POSSIBLY_UNUSED(size_t len), POSSIBLY_UNUSED(int flags),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_read(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(void *buf),
+		POSSIBLY_UNUSED(size_t len), POSSIBLY_UNUSED(uint64_t off),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_write(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(const void *buf),
+		POSSIBLY_UNUSED(size_t len), POSSIBLY_UNUSED(uint64_t off),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_poll(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(short events),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_submit(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int wait))
+{
+	return -ENOTSUP;
+}
+
+int uring_reap(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(struct uring_cqe_info *cqes),
+		POSSIBLY_UNUSED(int max))
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/compiler.h"
+#include "util/platform/fileio.h"
+
+#include <errno.h>
+
+/* There is no portable way to reserve space without changing the size of a
+ * file, or to bypass the page cache. */
+
+int do_prealloc(POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(uint64_t off),
+		POSSIBLY_UNUSED(uint64_t len))
+{
+	return -EOPNOTSUPP;
+}
+
+int do_unprealloc(POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(uint64_t size))
+{
+	return -EOPNOTSUPP;
+}
+
+int do_open_direct(POSSIBLY_UNUSED(const char *path),
+		POSSIBLY_UNUSED(int flags))
+{
+	return -EOPNOTSUPP;
+}
@@ -19,6 +19,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <netinet/tcp.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -97,3 +98,39 @@ int do_accept(int sock, struct sockaddr *addr, socklen_t len,
 	}
 	return fd;
 }
+
+/** Size of the bounce buffer used by do_sendfile */
+#define SENDFILE_BUF_SZ 16384
+
+ssize_t do_sendfile(int sock, int fd, uint64_t off, size_t len)
+{
+	ssize_t res;
+	char buf[SENDFILE_BUF_SZ];
+
+	/* There's no portable zero-copy interface, so bounce the data through
+	 * a buffer.  If the send comes up short, the caller will ask us to
+	 * re-read the rest. */
+	if (len > SENDFILE_BUF_SZ)
+		len = SENDFILE_BUF_SZ;
+	RETRY_ON_EINTR(res, pread(fd, buf, len, off));
+	if (res <= 0)
+		return (res < 0) ? -errno : 0;
+	res = send(sock, buf, res, 0);
+	if (res < 0)
+		return -errno;
+	return res;
+}
+
+int get_local_sockaddr(POSSIBLY_UNUSED(uint16_t port),
+		POSSIBLY_UNUSED(struct sockaddr_un *addr),
+		POSSIBLY_UNUSED(socklen_t *addr_len))
+{
+	/* Without an abstract socket namespace, we would have to agree on a
+	 * directory to put socket files in.  Just use TCP. */
+	return -ENOTSUP;
+}
+
+int check_local_peer(POSSIBLY_UNUSED(int sock))
+{
+	return -ENOTSUP;
+}
@@ -0,0 +1,93 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/compiler.h"
+#include "util/platform/uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+/* There is no portable completion-based I/O interface, so callers have to use
+ * readiness notification instead. */
+
+int uring_init(POSSIBLY_UNUSED(unsigned int entries),
+		POSSIBLY_UNUSED(struct uring **ring))
+{
+	return -ENOTSUP;
+}
+
+void uring_free(POSSIBLY_UNUSED(struct uring *ring))
+{
+}
+
+int uring_get_fd(POSSIBLY_UNUSED(const struct uring *ring))
+{
+	return -1;
+}
+
+int uring_prep_recv(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int sock), POSSIBLY_UNUSED(void *buf),
+		POSSIBLY_UNUSED(size_t len),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_send(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int sock), POSSIBLY_UNUSED(const void *buf),
+		POSSIBLY_UNUSED(size_t len), POSSIBLY_UNUSED(int flags),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_read(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(void *buf),
+		POSSIBLY_UNUSED(size_t len), POSSIBLY_UNUSED(uint64_t off),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_write(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(const void *buf),
+		POSSIBLY_UNUSED(size_t len), POSSIBLY_UNUSED(uint64_t off),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_prep_poll(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int fd), POSSIBLY_UNUSED(short events),
+		POSSIBLY_UNUSED(uint64_t user_data))
+{
+	return -ENOTSUP;
+}
+
+int uring_submit(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(int wait))
+{
+	return -ENOTSUP;
+}
+
+int uring_reap(POSSIBLY_UNUSED(struct uring *ring),
+		POSSIBLY_UNUSED(struct uring_cqe_info *cqes),
+		POSSIBLY_UNUSED(int max))
+{
+	return 0;
+}
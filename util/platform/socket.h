@@ -20,8 +20,15 @@
 #include "util/platform/flags.h"
 
 #include <netinet/in.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
 
+#ifndef MSG_MORE
+/** Hint that more data will follow this send.  Not all platforms have it. */
+#define MSG_MORE 0
+#endif
 
 /** Similar to the traditional POSIX socket(2) call, but hides some
  * platform-specific stuff.
@@ -53,4 +60,47 @@ extern int do_socket(int domain, int type, int proto,
 extern int do_accept(int sock, struct sockaddr *addr, socklen_t len,
 		enum redfish_plat_flags_t pf);
 
+/** Send part of a file over a socket.
+ *
+ * Where the platform supports it, the data is sent straight from the page
+ * cache, without being copied through user space.  Like send(2), this may send
+ * less than was asked for.
+ *
+ * @param sock		socket to send on
+ * @param fd		file descriptor to read from
+ * @param off		offset in the file to start at
+ * @param len		maximum number of bytes to send
+ *
+ * @return		The number of bytes sent on success; a negative error
+ *			code on error.  0 means that we hit end-of-file.
+ */
+extern ssize_t do_sendfile(int sock, int fd, uint64_t off, size_t len);
+
+/** Get the address of the local (AF_UNIX) socket associated with a TCP port
+ *
+ * Processes on the same host can use this socket instead of going through the
+ * TCP loopback path.
+ *
+ * @param port		TCP port number
+ * @param addr		(out param) the socket address
+ * @param addr_len	(out param) length of the socket address
+ *
+ * @return		0 on success; -ENOTSUP if local sockets are not
+ *			supported on this platform.
+ */
+extern int get_local_sockaddr(uint16_t port, struct sockaddr_un *addr,
+		socklen_t *addr_len);
+
+/** Check that the process on the other end of a local socket is trusted
+ *
+ * Anyone on this host can bind or connect to a local socket address.  We only
+ * talk over local sockets to processes running as the same user as us.
+ *
+ * @param sock		A connected local socket
+ *
+ * @return		0 if the peer is trusted; -EPERM if it is not; another
+ *			negative error code if we couldn't find out
+ */
+extern int check_local_peer(int sock);
+
 #endif
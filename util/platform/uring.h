@@ -0,0 +1,170 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright 2012 the Redfish authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REDFISH_UTIL_PLATFORM_URING_DOT_H
+#define REDFISH_UTIL_PLATFORM_URING_DOT_H
+
+#include <stdint.h> /* for uint64_t */
+#include <unistd.h> /* for size_t */
+
+/*
+ * A minimal completion-based I/O ring.
+ *
+ * On Linux, this is a thin wrapper around io_uring.  Operations are queued
+ * with the uring_prep_* functions, handed to the kernel in a single batch by
+ * uring_submit, and their results are collected later by uring_reap.  The ring
+ * file descriptor becomes readable whenever there are completions to reap, so
+ * it can be watched by an ordinary event loop.
+ *
+ * On other platforms, uring_init always fails with -ENOTSUP.
+ */
+
+struct uring;
+
+/** The result of a completed operation */
+struct uring_cqe_info {
+	/** The user_data given when the operation was queued */
+	uint64_t user_data;
+	/** Result of the operation, as a system call would return it, except
+	 * that errors are negative error codes rather than -1 */
+	int res;
+};
+
+/** Create a ring
+ *
+ * @param entries	Number of operations that can be queued at once
+ * @param ring		(out param) the new ring
+ *
+ * @return		0 on success; a negative error code otherwise.
+ *			-ENOTSUP means that the platform or kernel doesn't
+ *			support everything we need.
+ */
+extern int uring_init(unsigned int entries, struct uring **ring);
+
+/** Destroy a ring
+ *
+ * Operations which are still in flight are cancelled, and their completions
+ * are never reaped.
+ *
+ * @param ring		The ring
+ */
+extern void uring_free(struct uring *ring);
+
+/** Get the file descriptor of a ring
+ *
+ * @param ring		The ring
+ *
+ * @return		A file descriptor which polls readable when there are
+ *			completions to reap.
+ */
+extern int uring_get_fd(const struct uring *ring);
+
+/** Queue a recv(2) operation
+ *
+ * If the submission queue is full, previously queued operations will be
+ * submitted to make room.
+ *
+ * @param ring		The ring
+ * @param sock		Socket to receive from
+ * @param buf		Buffer to receive into
+ * @param len		Length of buf
+ * @param user_data	Opaque value to return on completion
+ *
+ * @return		0 on success; a negative error code otherwise.
+ */
+extern int uring_prep_recv(struct uring *ring, int sock, void *buf,
+		size_t len, uint64_t user_data);
+
+/** Queue a send(2) operation
+ *
+ * @param ring		The ring
+ * @param sock		Socket to send on
+ * @param buf		Buffer to send
+ * @param len		Length of buf
+ * @param flags		send(2) flags
+ * @param user_data	Opaque value to return on completion
+ *
+ * @return		0 on success; a negative error code otherwise.
+ */
+extern int uring_prep_send(struct uring *ring, int sock, const void *buf,
+		size_t len, int flags, uint64_t user_data);
+
+/** Queue a pread(2) operation
+ *
+ * @param ring		The ring
+ * @param fd		File descriptor to read from
+ * @param buf		Buffer to read into
+ * @param len		Length of buf
+ * @param off		Offset in the file to read from
+ * @param user_data	Opaque value to return on completion
+ *
+ * @return		0 on success; a negative error code otherwise.
+ */
+extern int uring_prep_read(struct uring *ring, int fd, void *buf,
+		size_t len, uint64_t off, uint64_t user_data);
+
+/** Queue a pwrite(2) operation
+ *
+ * As with pwrite, if fd was opened with O_APPEND, the data is appended no
+ * matter what off is.
+ *
+ * @param ring		The ring
+ * @param fd		File descriptor to write to
+ * @param buf		Buffer to write
+ * @param len		Length of buf
+ * @param off		Offset in the file to write at
+ * @param user_data	Opaque value to return on completion
+ *
+ * @return		0 on success; a negative error code otherwise.
+ */
+extern int uring_prep_write(struct uring *ring, int fd, const void *buf,
+		size_t len, uint64_t off, uint64_t user_data);
+
+/** Queue a one-shot poll operation
+ *
+ * @param ring		The ring
+ * @param fd		File descriptor to poll
+ * @param events	poll(2) events to wait for
+ * @param user_data	Opaque value to return on completion
+ *
+ * @return		0 on success; a negative error code otherwise.
+ */
+extern int uring_prep_poll(struct uring *ring, int fd, short events,
+		uint64_t user_data);
+
+/** Submit all queued operations to the kernel
+ *
+ * @param ring		The ring
+ * @param wait		If nonzero, also wait for at least one completion
+ *
+ * @return		0 on success; a negative error code otherwise.
+ */
+extern int uring_submit(struct uring *ring, int wait);
+
+/** Collect the results of completed operations
+ *
+ * @param ring		The ring
+ * @param cqes		(out param) array of completions
+ * @param max		Maximum number of completions to collect
+ *
+ * @return		The number of completions collected
+ */
+extern int uring_reap(struct uring *ring, struct uring_cqe_info *cqes,
+		int max);
+
+#endif
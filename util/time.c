@@ -33,6 +33,17 @@ time_t mt_time(void)
 	return ts.tv_sec;
 }
 
+uint64_t mt_time_usec(void)
+{
+	int res;
+	struct timespec ts;
+
+	res = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (res)
+		abort();
+	return (((uint64_t)ts.tv_sec) * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
 void mt_sleep_until(time_t until)
 {
 	int res;
@@ -17,6 +17,7 @@
 #ifndef REDFISH_UTIL_CLOCK_DOT_H
 #define REDFISH_UTIL_CLOCK_DOT_H
 
+#include <stdint.h> /* for uint64_t */
 #include <time.h> /* for time_t */
 
 /** Get the monotonic time_t
@@ -26,6 +27,13 @@
  */
 extern time_t mt_time(void);
 
+/** Get the monotonic time in microseconds
+ *
+ * @return		The current monotonic time, in microseconds.  This is
+ *			only useful for measuring intervals.
+ */
+extern uint64_t mt_time_usec(void);
+
 /** Sleep until a given monotonic time_t.
  *
  * - Does not use SIGALARM